@@ -1,12 +1,49 @@
 import 'dart:async';
+import 'dart:ffi';
 import 'dart:io';
+import 'dart:isolate';
 
+import 'package:ffi/ffi.dart';
 import 'package:flutter/foundation.dart';
 import 'package:path_provider/path_provider.dart';
 import 'package:process_run/shell.dart';
 
 import '../wireguard_flutter_platform_interface.dart';
 
+typedef _ConfigWithPathMtu = Pointer<Utf8> Function(Pointer<Utf8> config);
+typedef _FreeNative = Void Function(Pointer<Utf8> string);
+typedef _Free = void Function(Pointer<Utf8> string);
+
+/// Returns [config] with its MTU set to what fits the path to its endpoints,
+/// probed by the plugin's native library, or [config] as it is if the
+/// library cannot be loaded. Blocks while probing, for up to a few seconds
+/// per peer.
+String _configWithPathMtu(String config) {
+  final DynamicLibrary library;
+  try {
+    library = DynamicLibrary.open('libwireguard_flutter_ffi.so');
+  } on ArgumentError {
+    return config;
+  }
+  final configWithPathMtu = library.lookupFunction<_ConfigWithPathMtu,
+      _ConfigWithPathMtu>('WireguardFlutterConfigWithPathMtu');
+  final free = library.lookupFunction<_FreeNative, _Free>('WireguardFlutterFree');
+  final input = config.toNativeUtf8();
+  try {
+    final output = configWithPathMtu(input);
+    if (output == nullptr) {
+      return config;
+    }
+    try {
+      return output.toDartString();
+    } finally {
+      free(output);
+    }
+  } finally {
+    malloc.free(input);
+  }
+}
+
 class WireGuardFlutterLinux extends WireGuardFlutterInterface {
   String? name;
   File? configFile;
@@ -46,7 +83,11 @@ class WireGuardFlutterLinux extends WireGuardFlutterInterface {
 
     try {
       configFile = await File(await filePath).create();
-      await configFile!.writeAsString(wgQuickConfig);
+      // A hard-coded MTU may not fit the path, and a missing one defaults
+      // to what the route allows; probe the endpoints for the right one.
+      final config =
+          await Isolate.run(() => _configWithPathMtu(wgQuickConfig));
+      await configFile!.writeAsString(config);
     } on PathAccessException {
       debugPrint('Denied to write file. Trying to start interface');
       if (isAlreadyConnected) {
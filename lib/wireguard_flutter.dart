@@ -59,4 +59,21 @@ class WireGuardFlutter extends WireGuardFlutterInterface {
 
   @override
   Future<VpnStage> stage() => _instance.stage();
+
+  @override
+  Future<void> setTracing(bool enabled) => _instance.setTracing(enabled);
+
+  @override
+  Future<String> dumpTrace() => _instance.dumpTrace();
+
+  @override
+  Future<bool> switchServer({required String wgQuickConfig}) =>
+      _instance.switchServer(wgQuickConfig: wgQuickConfig);
+
+  @override
+  Future<void> setStandby(String? wgQuickConfig) =>
+      _instance.setStandby(wgQuickConfig);
+
+  @override
+  Future<bool> failover() => _instance.failover();
 }
@@ -57,4 +57,30 @@ class WireGuardFlutterMethodChannel extends WireGuardFlutterInterface {
               )
             : VpnStage.disconnected,
       );
+
+  @override
+  Future<void> setTracing(bool enabled) =>
+      _methodChannel.invokeMethod("setTracing", {"enabled": enabled});
+
+  @override
+  Future<String> dumpTrace() => _methodChannel
+      .invokeMethod<String>("dumpTrace")
+      .then((value) => value ?? '');
+
+  @override
+  Future<bool> switchServer({required String wgQuickConfig}) =>
+      _methodChannel.invokeMethod<bool>("switchServer", {
+        "wgQuickConfig": wgQuickConfig,
+      }).then((value) => value ?? false);
+
+  @override
+  Future<void> setStandby(String? wgQuickConfig) =>
+      _methodChannel.invokeMethod("setStandby", {
+        "wgQuickConfig": wgQuickConfig ?? '',
+      });
+
+  @override
+  Future<bool> failover() => _methodChannel
+      .invokeMethod<bool>("failover")
+      .then((value) => value ?? false);
 }
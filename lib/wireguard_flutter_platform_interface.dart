@@ -15,6 +15,45 @@ abstract class WireGuardFlutterInterface {
   Future<VpnStage> stage();
   Future<bool> isConnected() =>
       stage().then((stage) => stage == VpnStage.connected);
+
+  /// Starts or stops recording how long the plugin's native operations take.
+  Future<void> setTracing(bool enabled) =>
+      throw UnsupportedError('Tracing is not supported on this platform');
+
+  /// The operations recorded since tracing was last started, as Chrome
+  /// trace-event JSON that Perfetto and chrome://tracing open.
+  Future<String> dumpTrace() =>
+      throw UnsupportedError('Tracing is not supported on this platform');
+
+  /// Connects to the server in [wgQuickConfig], switching from the current
+  /// one without dropping traffic: the new tunnel comes up beside the old
+  /// one, which is only taken down once the new one has completed a
+  /// handshake. Fails, keeping the current tunnel, if it does not.
+  ///
+  /// A full tunnel, one peer whose AllowedIPs include 0.0.0.0/0 or ::/0,
+  /// turns on a kill switch that blocks any other tunnel, so switching to or
+  /// from one takes the old tunnel down first, and a failure leaves none.
+  /// Traffic then has no tunnel until the new one completes a handshake.
+  ///
+  /// Returns true if traffic kept a tunnel throughout the switch, false if
+  /// the old tunnel was taken down first.
+  Future<bool> switchServer({required String wgQuickConfig}) =>
+      throw UnsupportedError(
+          'Switching servers is not supported on this platform');
+
+  /// Keeps a standby tunnel for [wgQuickConfig] up and handshaking beside
+  /// the active one, so [failover] or [switchServer] to it is immediate.
+  /// A null config drops the standby. Fails for a full tunnel, or while the
+  /// active tunnel is one, as its kill switch would block the other.
+  Future<void> setStandby(String? wgQuickConfig) =>
+      throw UnsupportedError(
+          'Standby tunnels are not supported on this platform');
+
+  /// Moves traffic to the standby tunnel at once. Returns false if there is
+  /// no standby or it has not completed a handshake yet.
+  Future<bool> failover() =>
+      throw UnsupportedError(
+          'Standby tunnels are not supported on this platform');
 }
 
 enum VpnStage {
@@ -0,0 +1,183 @@
+#include "address_pool.h"
+
+#include <stdexcept>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    typedef unsigned __int128 Address;
+
+    const size_t kWordBits = 64;
+
+    size_t AddressBits(int family)
+    {
+      return family == AF_INET6 ? 128 : 32;
+    }
+
+    Address LoadAddress(const IpPrefix &prefix)
+    {
+      Address address = 0;
+      for (size_t i = 0; i < AddressBits(prefix.family) / 8; i++)
+      {
+        address = (address << 8) | prefix.address[i];
+      }
+      return address;
+    }
+
+    void StoreAddress(IpPrefix *prefix, Address address)
+    {
+      for (size_t i = AddressBits(prefix->family) / 8; i-- > 0;)
+      {
+        prefix->address[i] = static_cast<uint8_t>(address);
+        address >>= 8;
+      }
+    }
+
+    size_t Words(size_t bits)
+    {
+      return (bits + kWordBits - 1) / kWordBits;
+    }
+
+  } // namespace
+
+  constexpr size_t AddressPool::kMaxAddresses;
+
+  AddressPool::AddressPool(const IpPrefix &subnet) : subnet_(subnet)
+  {
+    if (subnet.family != AF_INET && subnet.family != AF_INET6)
+    {
+      throw std::runtime_error("address pool needs an IPv4 or IPv6 subnet");
+    }
+    size_t bits = AddressBits(subnet.family);
+    if (subnet.cidr >= bits)
+    {
+      throw std::runtime_error("no host addresses in " + IpPrefixToString(subnet));
+    }
+    size_t host_bits = bits - subnet.cidr;
+    Address host_mask = host_bits == 128 ? ~static_cast<Address>(0) : (static_cast<Address>(1) << host_bits) - 1;
+    StoreAddress(&subnet_, LoadAddress(subnet) & ~host_mask);
+    bool whole = host_bits < 64 && (uint64_t(1) << host_bits) <= kMaxAddresses;
+    slots_ = whole ? size_t(1) << host_bits : kMaxAddresses;
+
+    // All tracked addresses start free.
+    size_t bits_at_level = slots_;
+    while (true)
+    {
+      std::vector<uint64_t> level(Words(bits_at_level), ~uint64_t(0));
+      if (bits_at_level % kWordBits != 0)
+      {
+        level.back() = (uint64_t(1) << (bits_at_level % kWordBits)) - 1;
+      }
+      levels_.push_back(std::move(level));
+      if (levels_.back().size() == 1)
+      {
+        break;
+      }
+      bits_at_level = levels_.back().size();
+    }
+    available_ = slots_;
+    end_usable_ = slots_;
+
+    // The subnet's own address is the network in IPv4 and the subnet-router
+    // anycast address in IPv6; IPv4 broadcasts to the last. Point-to-point
+    // subnets (RFC 3021, RFC 6164) use every address.
+    if (host_bits > 1)
+    {
+      Take(0);
+      first_usable_ = 1;
+      if (subnet.family == AF_INET && whole)
+      {
+        Take(slots_ - 1);
+        end_usable_ = slots_ - 1;
+      }
+    }
+    capacity_ = available_;
+  }
+
+  bool AddressPool::Allocate(IpPrefix *address)
+  {
+    if (available_ == 0)
+    {
+      return false;
+    }
+    size_t offset = 0;
+    for (size_t level = levels_.size(); level-- > 0;)
+    {
+      offset = offset * kWordBits + static_cast<size_t>(__builtin_ctzll(levels_[level][offset]));
+    }
+    Take(offset);
+    *address = subnet_;
+    address->cidr = static_cast<uint8_t>(AddressBits(subnet_.family));
+    StoreAddress(address, LoadAddress(subnet_) + offset);
+    return true;
+  }
+
+  bool AddressPool::Reserve(const IpPrefix &address)
+  {
+    size_t offset;
+    if (!Offset(address, &offset) || (levels_[0][offset / kWordBits] >> (offset % kWordBits) & 1) == 0)
+    {
+      return false;
+    }
+    Take(offset);
+    return true;
+  }
+
+  bool AddressPool::Free(const IpPrefix &address)
+  {
+    size_t offset;
+    if (!Offset(address, &offset) || (levels_[0][offset / kWordBits] >> (offset % kWordBits) & 1) != 0)
+    {
+      return false;
+    }
+    // A word gaining its first free bit marks itself in the word above.
+    for (auto &level : levels_)
+    {
+      uint64_t &word = level[offset / kWordBits];
+      bool was_full = word == 0;
+      word |= uint64_t(1) << (offset % kWordBits);
+      if (!was_full)
+      {
+        break;
+      }
+      offset /= kWordBits;
+    }
+    available_++;
+    return true;
+  }
+
+  bool AddressPool::Offset(const IpPrefix &address, size_t *offset) const
+  {
+    if (address.family != subnet_.family || address.cidr != AddressBits(subnet_.family))
+    {
+      return false;
+    }
+    Address difference = LoadAddress(address) - LoadAddress(subnet_);
+    if (LoadAddress(address) < LoadAddress(subnet_) || difference < first_usable_ || difference >= end_usable_)
+    {
+      return false;
+    }
+    *offset = static_cast<size_t>(difference);
+    return true;
+  }
+
+  void AddressPool::Take(size_t offset)
+  {
+    // A word losing its last free bit clears its own in the word above.
+    for (auto &level : levels_)
+    {
+      uint64_t &word = level[offset / kWordBits];
+      word &= ~(uint64_t(1) << (offset % kWordBits));
+      if (word != 0)
+      {
+        break;
+      }
+      offset /= kWordBits;
+    }
+    available_--;
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,66 @@
+#ifndef WIREGUARD_FLUTTER_ADDRESS_POOL_H
+#define WIREGUARD_FLUTTER_ADDRESS_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "config_parser.h"
+
+namespace wireguard_flutter {
+
+// Hands out the host addresses of one subnet to tunnel peers. Free addresses
+// are set bits in a bitmap, with a word of summary bits above every 64 words
+// marking which have any left; allocating walks down from the single top
+// word, freeing walks back up, so both take a fixed handful of steps however
+// full the pool is. The lowest free address always goes first. Not
+// thread-safe.
+class AddressPool {
+ public:
+  // The most addresses one pool tracks: a larger subnet, such as an IPv6
+  // /64, only has its first this many used.
+  static constexpr size_t kMaxAddresses = size_t(1) << 24;
+
+  // Throws std::runtime_error if |subnet| is not a prefix with room for
+  // any host. An IPv4 subnet's network and broadcast addresses are never
+  // handed out, nor is an IPv6 subnet's first address.
+  explicit AddressPool(const IpPrefix &subnet);
+
+  // Takes the lowest free address as a single-host prefix. Returns false
+  // when none is left.
+  bool Allocate(IpPrefix *address);
+
+  // Takes |address|, e.g. for the server itself. Returns false if it is
+  // outside the pool or already taken.
+  bool Reserve(const IpPrefix &address);
+
+  // Gives |address| back. Returns false if it is outside the pool, is one
+  // of the addresses never handed out, or was not taken.
+  bool Free(const IpPrefix &address);
+
+  const IpPrefix &subnet() const { return subnet_; }
+  size_t capacity() const { return capacity_; }
+  size_t available() const { return available_; }
+
+ private:
+  // The position of |address| in the pool, or false if it has none or is
+  // one of the subnet's unusable addresses.
+  bool Offset(const IpPrefix &address, size_t *offset) const;
+  void Take(size_t offset);
+
+  IpPrefix subnet_;
+  // Addresses tracked from the subnet's first, the unusable ones included.
+  size_t slots_;
+  // The usable ones, which are all but perhaps the first and last.
+  size_t first_usable_ = 0;
+  size_t end_usable_;
+  size_t capacity_;
+  size_t available_;
+  // levels_[0] has a bit per address, each level above a bit per word of
+  // the one below; the last has a single word.
+  std::vector<std::vector<uint64_t>> levels_;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,92 @@
+#include "allowed_ips.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    inline int BitAt(const uint8_t *address, int i)
+    {
+      return (address[i / 8] >> (7 - i % 8)) & 1;
+    }
+
+  } // namespace
+
+  AllowedIps::AllowedIps()
+  {
+    Clear();
+  }
+
+  void AllowedIps::Insert(const IpPrefix &prefix, Peer *peer)
+  {
+    std::vector<Node> &nodes = Nodes(prefix.family);
+    int32_t node = 0;
+    for (int i = 0; i < prefix.cidr; i++)
+    {
+      int bit = BitAt(prefix.address, i);
+      if (nodes[node].child[bit] < 0)
+      {
+        nodes[node].child[bit] = static_cast<int32_t>(nodes.size());
+        nodes.emplace_back();
+      }
+      node = nodes[node].child[bit];
+    }
+    nodes[node].peer = peer;
+  }
+
+  void AllowedIps::RemoveByPeer(const Peer *peer)
+  {
+    for (auto *nodes : {&v4_, &v6_})
+    {
+      for (auto &node : *nodes)
+      {
+        if (node.peer == peer)
+        {
+          node.peer = nullptr;
+        }
+      }
+    }
+  }
+
+  void AllowedIps::Clear()
+  {
+    v4_.assign(1, Node());
+    v6_.assign(1, Node());
+  }
+
+  Peer *AllowedIps::Lookup(int family, const uint8_t *address) const
+  {
+    const std::vector<Node> &nodes = Nodes(family);
+    int bits = family == AF_INET ? 32 : 128;
+    int32_t node = 0;
+    Peer *best = nodes[0].peer;
+    for (int i = 0; i < bits; i++)
+    {
+      node = nodes[node].child[BitAt(address, i)];
+      if (node < 0)
+      {
+        break;
+      }
+      if (nodes[node].peer != nullptr)
+      {
+        best = nodes[node].peer;
+      }
+    }
+    return best;
+  }
+
+  Peer *AllowedIps::LookupPacket(const uint8_t *packet, size_t len, bool source) const
+  {
+    if (len >= 20 && (packet[0] >> 4) == 4)
+    {
+      return Lookup(AF_INET, packet + (source ? 12 : 16));
+    }
+    if (len >= 40 && (packet[0] >> 4) == 6)
+    {
+      return Lookup(AF_INET6, packet + (source ? 8 : 24));
+    }
+    return nullptr;
+  }
+
+} // namespace wireguard_flutter
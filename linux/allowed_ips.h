@@ -0,0 +1,44 @@
+#ifndef WIREGUARD_FLUTTER_ALLOWED_IPS_H
+#define WIREGUARD_FLUTTER_ALLOWED_IPS_H
+
+#include <cstdint>
+#include <vector>
+
+#include "config_parser.h"
+
+namespace wireguard_flutter {
+
+struct Peer;
+
+// Longest-prefix-match table from AllowedIPs to peers (cryptokey routing).
+// Nodes live in one vector per family so lookups stay cache friendly.
+class AllowedIps {
+ public:
+  AllowedIps();
+
+  void Insert(const IpPrefix &prefix, Peer *peer);
+  void RemoveByPeer(const Peer *peer);
+  void Clear();
+
+  // |address| is 4 or 16 bytes in network order depending on |family|.
+  Peer *Lookup(int family, const uint8_t *address) const;
+
+  // Looks up the destination (or source) address of a raw IP packet.
+  Peer *LookupPacket(const uint8_t *packet, size_t len, bool source) const;
+
+ private:
+  struct Node {
+    int32_t child[2] = {-1, -1};
+    Peer *peer = nullptr;
+  };
+
+  std::vector<Node> &Nodes(int family) { return family == AF_INET ? v4_ : v6_; }
+  const std::vector<Node> &Nodes(int family) const { return family == AF_INET ? v4_ : v6_; }
+
+  std::vector<Node> v4_;
+  std::vector<Node> v6_;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,369 @@
+#include "blake2s.h"
+
+#include <atomic>
+#include <cstring>
+
+#include "blake2s_kernels.h"
+#include "byte_order.h"
+#include "chacha20poly1305.h"
+
+namespace wireguard_flutter
+{
+
+  const uint32_t kBlake2sIv[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                                  0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+  const uint8_t kBlake2sSigma[10][16] = {
+      {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+      {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+      {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+      {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+      {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+      {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+      {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+      {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+      {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+      {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+  };
+
+  namespace
+  {
+
+    inline uint32_t Rotr32(uint32_t v, int c)
+    {
+      return (v >> c) | (v << (32 - c));
+    }
+
+    Blake2sImplementation DetectBlake2sImplementation()
+    {
+#if defined(__x86_64__)
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2"))
+      {
+        return Blake2sImplementation::kAvx2;
+      }
+      if (__builtin_cpu_supports("sse4.1"))
+      {
+        return Blake2sImplementation::kSse41;
+      }
+#endif
+      return Blake2sImplementation::kScalar;
+    }
+
+    std::atomic<Blake2sImplementation> &ActiveImplementation()
+    {
+      static std::atomic<Blake2sImplementation> implementation{DetectBlake2sImplementation()};
+      return implementation;
+    }
+
+    void CompressBlock(uint32_t h[8], const uint8_t block[kBlake2sBlockSize], const uint32_t t[2], bool last)
+    {
+      switch (ActiveImplementation().load(std::memory_order_relaxed))
+      {
+#if defined(__x86_64__)
+      case Blake2sImplementation::kAvx2:
+      case Blake2sImplementation::kSse41:
+        Blake2sCompressSse41(h, block, t, last);
+        break;
+#endif
+      default:
+        Blake2sCompressScalar(h, block, t, last);
+        break;
+      }
+    }
+
+    void InitState(uint32_t h[8], size_t out_len, size_t key_len)
+    {
+      memcpy(h, kBlake2sIv, sizeof(kBlake2sIv));
+      h[0] ^= 0x01010000 ^ static_cast<uint32_t>(key_len << 8) ^ static_cast<uint32_t>(out_len);
+    }
+
+    // Finishes one message of a batch from the state after the key block.
+    void HashFromState(const uint32_t start[8], uint32_t counter, const Blake2sJob &job, size_t out_len)
+    {
+      uint32_t h[8];
+      memcpy(h, start, sizeof(h));
+      uint32_t t[2] = {counter, 0};
+      size_t offset = 0;
+      while (job.in_len - offset > kBlake2sBlockSize)
+      {
+        t[0] += kBlake2sBlockSize;
+        t[1] += (t[0] < kBlake2sBlockSize);
+        CompressBlock(h, job.in + offset, t, false);
+        offset += kBlake2sBlockSize;
+      }
+      uint8_t block[kBlake2sBlockSize] = {0};
+      memcpy(block, job.in + offset, job.in_len - offset);
+      t[0] += static_cast<uint32_t>(job.in_len - offset);
+      t[1] += (t[0] < job.in_len - offset);
+      CompressBlock(h, block, t, true);
+
+      uint8_t digest[kBlake2sHashSize];
+      for (int i = 0; i < 8; i++)
+      {
+        StoreLe32(digest + 4 * i, h[i]);
+      }
+      memcpy(job.out, digest, out_len);
+      SecureZero(h, sizeof(h));
+      SecureZero(digest, sizeof(digest));
+    }
+
+  } // namespace
+
+  void Blake2sCompressScalar(uint32_t h[8], const uint8_t block[kBlake2sBlockSize], const uint32_t t[2], bool last)
+  {
+    uint32_t m[16], v[16];
+    for (int i = 0; i < 16; i++)
+    {
+      m[i] = LoadLe32(block + 4 * i);
+    }
+    memcpy(v, h, 8 * sizeof(uint32_t));
+    memcpy(v + 8, kBlake2sIv, sizeof(kBlake2sIv));
+    v[12] ^= t[0];
+    v[13] ^= t[1];
+
+#define BLAKE2S_G(r, i, a, b, c, d)          \
+  a = a + b + m[kBlake2sSigma[r][2 * i]];     \
+  d = Rotr32(d ^ a, 16);                     \
+  c = c + d;                                 \
+  b = Rotr32(b ^ c, 12);                     \
+  a = a + b + m[kBlake2sSigma[r][2 * i + 1]]; \
+  d = Rotr32(d ^ a, 8);                      \
+  c = c + d;                                 \
+  b = Rotr32(b ^ c, 7);
+
+    if (last)
+    {
+      v[14] = ~v[14];
+    }
+    for (int r = 0; r < 10; r++)
+    {
+      BLAKE2S_G(r, 0, v[0], v[4], v[8], v[12])
+      BLAKE2S_G(r, 1, v[1], v[5], v[9], v[13])
+      BLAKE2S_G(r, 2, v[2], v[6], v[10], v[14])
+      BLAKE2S_G(r, 3, v[3], v[7], v[11], v[15])
+      BLAKE2S_G(r, 4, v[0], v[5], v[10], v[15])
+      BLAKE2S_G(r, 5, v[1], v[6], v[11], v[12])
+      BLAKE2S_G(r, 6, v[2], v[7], v[8], v[13])
+      BLAKE2S_G(r, 7, v[3], v[4], v[9], v[14])
+    }
+
+#undef BLAKE2S_G
+
+    for (int i = 0; i < 8; i++)
+    {
+      h[i] ^= v[i] ^ v[i + 8];
+    }
+  }
+
+  Blake2s::Blake2s(size_t out_len, const uint8_t *key, size_t key_len) : out_len_(out_len)
+  {
+    InitState(h_, out_len, key_len);
+    t_[0] = t_[1] = 0;
+    if (key_len > 0)
+    {
+      uint8_t block[kBlake2sBlockSize] = {0};
+      memcpy(block, key, key_len);
+      Update(block, kBlake2sBlockSize);
+      SecureZero(block, sizeof(block));
+    }
+  }
+
+  Blake2s::~Blake2s()
+  {
+    SecureZero(h_, sizeof(h_));
+    SecureZero(buffer_, sizeof(buffer_));
+  }
+
+  void Blake2s::Compress(const uint8_t block[kBlake2sBlockSize], uint32_t inc)
+  {
+    t_[0] += inc;
+    t_[1] += (t_[0] < inc);
+    CompressBlock(h_, block, t_, final_);
+  }
+
+  void Blake2s::Update(const uint8_t *data, size_t len)
+  {
+    // The last block must be kept back for Final(), so only compress when more
+    // input follows a full buffer.
+    while (len > 0)
+    {
+      if (buffer_len_ == kBlake2sBlockSize)
+      {
+        Compress(buffer_, kBlake2sBlockSize);
+        buffer_len_ = 0;
+      }
+      size_t n = kBlake2sBlockSize - buffer_len_;
+      if (n > len)
+      {
+        n = len;
+      }
+      memcpy(buffer_ + buffer_len_, data, n);
+      buffer_len_ += n;
+      data += n;
+      len -= n;
+    }
+  }
+
+  void Blake2s::Final(uint8_t *out)
+  {
+    memset(buffer_ + buffer_len_, 0, kBlake2sBlockSize - buffer_len_);
+    final_ = true;
+    Compress(buffer_, static_cast<uint32_t>(buffer_len_));
+    uint8_t digest[kBlake2sHashSize];
+    for (int i = 0; i < 8; i++)
+    {
+      StoreLe32(digest + 4 * i, h_[i]);
+    }
+    memcpy(out, digest, out_len_);
+    SecureZero(digest, sizeof(digest));
+  }
+
+  void Blake2sHash(uint8_t *out, size_t out_len, const uint8_t *in, size_t in_len, const uint8_t *key, size_t key_len)
+  {
+    Blake2s state(out_len, key, key_len);
+    state.Update(in, in_len);
+    state.Final(out);
+  }
+
+  void Blake2sHashBatch(const Blake2sJob *jobs, size_t count, size_t out_len, const uint8_t *key, size_t key_len)
+  {
+    uint32_t start[8];
+    InitState(start, out_len, key_len);
+    uint32_t counter = 0;
+    if (key_len > 0)
+    {
+      uint8_t block[kBlake2sBlockSize] = {0};
+      memcpy(block, key, key_len);
+      const uint32_t t[2] = {kBlake2sBlockSize, 0};
+      CompressBlock(start, block, t, false);
+      counter = kBlake2sBlockSize;
+      SecureZero(block, sizeof(block));
+    }
+
+#if defined(__x86_64__)
+    if (ActiveImplementation().load(std::memory_order_relaxed) == Blake2sImplementation::kAvx2)
+    {
+      // A keyed empty message makes the key block its last block, so it
+      // cannot start from the shared state.
+      Blake2sJob lanes[8];
+      size_t used = 0;
+      for (size_t i = 0; i < count; i++)
+      {
+        if (key_len > 0 && jobs[i].in_len == 0)
+        {
+          Blake2sHash(jobs[i].out, out_len, nullptr, 0, key, key_len);
+          continue;
+        }
+        lanes[used++] = jobs[i];
+        if (used == 8)
+        {
+          Blake2sHash8Avx2(start, counter, lanes, used, out_len);
+          used = 0;
+        }
+      }
+      if (used > 0)
+      {
+        Blake2sHash8Avx2(start, counter, lanes, used, out_len);
+      }
+      SecureZero(start, sizeof(start));
+      return;
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++)
+    {
+      if (key_len > 0 && jobs[i].in_len == 0)
+      {
+        Blake2sHash(jobs[i].out, out_len, nullptr, 0, key, key_len);
+      }
+      else
+      {
+        HashFromState(start, counter, jobs[i], out_len);
+      }
+    }
+    SecureZero(start, sizeof(start));
+  }
+
+  void HmacBlake2s(uint8_t out[kBlake2sHashSize], const uint8_t *key, size_t key_len, const uint8_t *in,
+                   size_t in_len)
+  {
+    uint8_t block[kBlake2sBlockSize] = {0};
+    if (key_len > kBlake2sBlockSize)
+    {
+      Blake2sHash(block, kBlake2sHashSize, key, key_len);
+    }
+    else
+    {
+      memcpy(block, key, key_len);
+    }
+
+    uint8_t inner[kBlake2sHashSize];
+    for (auto &b : block)
+    {
+      b ^= 0x36;
+    }
+    Blake2s inner_state(kBlake2sHashSize);
+    inner_state.Update(block, sizeof(block));
+    inner_state.Update(in, in_len);
+    inner_state.Final(inner);
+
+    for (auto &b : block)
+    {
+      b ^= 0x36 ^ 0x5c;
+    }
+    Blake2s outer_state(kBlake2sHashSize);
+    outer_state.Update(block, sizeof(block));
+    outer_state.Update(inner, sizeof(inner));
+    outer_state.Final(out);
+
+    SecureZero(block, sizeof(block));
+    SecureZero(inner, sizeof(inner));
+  }
+
+  void Kdf(uint8_t *first, uint8_t *second, uint8_t *third, const uint8_t chaining_key[kBlake2sHashSize],
+           const uint8_t *data, size_t data_len)
+  {
+    uint8_t secret[kBlake2sHashSize], output[kBlake2sHashSize + 1];
+    HmacBlake2s(secret, chaining_key, kBlake2sHashSize, data, data_len);
+
+    output[0] = 1;
+    HmacBlake2s(output, secret, kBlake2sHashSize, output, 1);
+    memcpy(first, output, kBlake2sHashSize);
+
+    if (second != nullptr || third != nullptr)
+    {
+      output[kBlake2sHashSize] = 2;
+      HmacBlake2s(output, secret, kBlake2sHashSize, output, kBlake2sHashSize + 1);
+      if (second != nullptr)
+      {
+        memcpy(second, output, kBlake2sHashSize);
+      }
+    }
+    if (third != nullptr)
+    {
+      output[kBlake2sHashSize] = 3;
+      HmacBlake2s(output, secret, kBlake2sHashSize, output, kBlake2sHashSize + 1);
+      memcpy(third, output, kBlake2sHashSize);
+    }
+
+    SecureZero(secret, sizeof(secret));
+    SecureZero(output, sizeof(output));
+  }
+
+  Blake2sImplementation ActiveBlake2sImplementation()
+  {
+    return ActiveImplementation().load(std::memory_order_relaxed);
+  }
+
+  bool SetBlake2sImplementation(Blake2sImplementation implementation)
+  {
+    if (implementation > DetectBlake2sImplementation())
+    {
+      return false;
+    }
+    ActiveImplementation().store(implementation, std::memory_order_relaxed);
+    return true;
+  }
+
+} // namespace wireguard_flutter
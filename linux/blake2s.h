@@ -0,0 +1,68 @@
+#ifndef WIREGUARD_FLUTTER_BLAKE2S_H
+#define WIREGUARD_FLUTTER_BLAKE2S_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace wireguard_flutter {
+
+constexpr size_t kBlake2sHashSize = 32;
+constexpr size_t kBlake2sBlockSize = 64;
+
+class Blake2s {
+ public:
+  // |out_len| is 1..32 bytes; |key| may be null when |key_len| is zero.
+  Blake2s(size_t out_len, const uint8_t *key = nullptr, size_t key_len = 0);
+  ~Blake2s();
+
+  void Update(const uint8_t *data, size_t len);
+  void Final(uint8_t *out);
+
+ private:
+  void Compress(const uint8_t block[kBlake2sBlockSize], uint32_t inc);
+
+  uint32_t h_[8];
+  uint32_t t_[2];
+  uint8_t buffer_[kBlake2sBlockSize];
+  size_t buffer_len_ = 0;
+  size_t out_len_;
+  bool final_ = false;
+};
+
+void Blake2sHash(uint8_t *out, size_t out_len, const uint8_t *in, size_t in_len, const uint8_t *key = nullptr,
+                 size_t key_len = 0);
+
+struct Blake2sJob {
+  const uint8_t *in;
+  size_t in_len;
+  uint8_t *out;
+};
+
+// Blake2sHash() for |count| messages under one key, e.g. mac1 for a batch of
+// received handshake messages. The key block is compressed once, and with
+// AVX2 eight messages of any length are hashed side by side.
+void Blake2sHashBatch(const Blake2sJob *jobs, size_t count, size_t out_len, const uint8_t *key = nullptr,
+                      size_t key_len = 0);
+
+// HMAC over BLAKE2s-256, used by the Noise KDF.
+void HmacBlake2s(uint8_t out[kBlake2sHashSize], const uint8_t *key, size_t key_len, const uint8_t *in,
+                 size_t in_len);
+
+// Noise HKDF returning one, two or three 32-byte outputs; null outputs are
+// skipped. |data| may be null when |data_len| is zero.
+void Kdf(uint8_t *first, uint8_t *second, uint8_t *third, const uint8_t chaining_key[kBlake2sHashSize],
+         const uint8_t *data, size_t data_len);
+
+enum class Blake2sImplementation { kScalar, kSse41, kAvx2 };
+
+// Single messages use the SSE4.1 compression when the CPU has it; AVX2 adds
+// the eight-lane kernel for batches. Defaults to the best one supported.
+Blake2sImplementation ActiveBlake2sImplementation();
+
+// Forces an implementation, e.g. for benchmarking. Returns false if the CPU
+// does not support it.
+bool SetBlake2sImplementation(Blake2sImplementation implementation);
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,155 @@
+#include "blake2s_kernels.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "chacha20_kernels.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    __attribute__((target("avx2"))) inline __m256i Rotr16(__m256i x)
+    {
+      const __m256i shuffle = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                              13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+      return _mm256_shuffle_epi8(x, shuffle);
+    }
+
+    __attribute__((target("avx2"))) inline __m256i Rotr8(__m256i x)
+    {
+      const __m256i shuffle = _mm256_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1,
+                                              12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1);
+      return _mm256_shuffle_epi8(x, shuffle);
+    }
+
+    __attribute__((target("avx2"))) inline __m256i Rotr(__m256i x, int c)
+    {
+      return _mm256_or_si256(_mm256_srli_epi32(x, c), _mm256_slli_epi32(x, 32 - c));
+    }
+
+    __attribute__((target("avx2"))) inline void G(__m256i &a, __m256i &b, __m256i &c, __m256i &d, __m256i x,
+                                                  __m256i y)
+    {
+      a = _mm256_add_epi32(_mm256_add_epi32(a, b), x);
+      d = Rotr16(_mm256_xor_si256(d, a));
+      c = _mm256_add_epi32(c, d);
+      b = Rotr(_mm256_xor_si256(b, c), 12);
+      a = _mm256_add_epi32(_mm256_add_epi32(a, b), y);
+      d = Rotr8(_mm256_xor_si256(d, a));
+      c = _mm256_add_epi32(c, d);
+      b = Rotr(_mm256_xor_si256(b, c), 7);
+    }
+
+    size_t Blocks(size_t len)
+    {
+      return len == 0 ? 1 : (len + kBlake2sBlockSize - 1) / kBlake2sBlockSize;
+    }
+
+  } // namespace
+
+  __attribute__((target("avx2"))) void Blake2sHash8Avx2(const uint32_t h[8], uint32_t counter,
+                                                        const Blake2sJob *jobs, size_t count, size_t out_len)
+  {
+    static const uint8_t kZeroBlock[kBlake2sBlockSize] = {0};
+    alignas(32) uint8_t padded[8][kBlake2sBlockSize];
+
+    size_t max_blocks = 0;
+    for (size_t lane = 0; lane < count; lane++)
+    {
+      max_blocks = std::max(max_blocks, Blocks(jobs[lane].in_len));
+    }
+
+    __m256i state[8];
+    for (int i = 0; i < 8; i++)
+    {
+      state[i] = _mm256_set1_epi32(h[i]);
+    }
+
+    for (size_t index = 0; index < max_blocks; index++)
+    {
+      // Lanes without a block this time hash zeros and discard the result.
+      alignas(32) uint32_t t[8] = {0};
+      alignas(32) uint32_t last[8] = {0};
+      alignas(32) uint32_t active[8] = {0};
+      __m256i low[8], high[8];
+      for (size_t lane = 0; lane < 8; lane++)
+      {
+        const uint8_t *block = kZeroBlock;
+        if (lane < count && index < Blocks(jobs[lane].in_len))
+        {
+          size_t offset = index * kBlake2sBlockSize;
+          size_t n = std::min(kBlake2sBlockSize, jobs[lane].in_len - offset);
+          block = jobs[lane].in + offset;
+          if (n < kBlake2sBlockSize)
+          {
+            memset(padded[lane], 0, sizeof(padded[lane]));
+            memcpy(padded[lane], block, n);
+            block = padded[lane];
+          }
+          t[lane] = counter + static_cast<uint32_t>(offset + n);
+          last[lane] = index + 1 == Blocks(jobs[lane].in_len) ? 0xffffffff : 0;
+          active[lane] = 0xffffffff;
+        }
+        low[lane] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+        high[lane] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + 32));
+      }
+      // Lane-major blocks to word-major message vectors.
+      ChaCha20Transpose8x8Avx2(low);
+      ChaCha20Transpose8x8Avx2(high);
+      __m256i m[16];
+      for (int i = 0; i < 8; i++)
+      {
+        m[i] = low[i];
+        m[i + 8] = high[i];
+      }
+
+      __m256i v[16];
+      for (int i = 0; i < 8; i++)
+      {
+        v[i] = state[i];
+        v[i + 8] = _mm256_set1_epi32(kBlake2sIv[i]);
+      }
+      v[12] = _mm256_xor_si256(v[12], _mm256_load_si256(reinterpret_cast<const __m256i *>(t)));
+      v[14] = _mm256_xor_si256(v[14], _mm256_load_si256(reinterpret_cast<const __m256i *>(last)));
+
+      for (int r = 0; r < 10; r++)
+      {
+        const uint8_t *s = kBlake2sSigma[r];
+        G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+        G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+        G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+        G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+        G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+        G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+        G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+      }
+
+      __m256i mask = _mm256_load_si256(reinterpret_cast<const __m256i *>(active));
+      for (int i = 0; i < 8; i++)
+      {
+        __m256i next = _mm256_xor_si256(state[i], _mm256_xor_si256(v[i], v[i + 8]));
+        state[i] = _mm256_blendv_epi8(state[i], next, mask);
+      }
+    }
+
+    // Word-major back to one digest per lane.
+    ChaCha20Transpose8x8Avx2(state);
+    for (size_t lane = 0; lane < count; lane++)
+    {
+      alignas(32) uint8_t digest[kBlake2sHashSize];
+      _mm256_store_si256(reinterpret_cast<__m256i *>(digest), state[lane]);
+      memcpy(jobs[lane].out, digest, out_len);
+    }
+  }
+
+} // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef WIREGUARD_FLUTTER_BLAKE2S_KERNELS_H
+#define WIREGUARD_FLUTTER_BLAKE2S_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "blake2s.h"
+
+namespace wireguard_flutter {
+
+extern const uint32_t kBlake2sIv[8];
+extern const uint8_t kBlake2sSigma[10][16];
+
+// One compression of |block| into the chaining value |h|. |t| is the byte
+// counter including this block; |last| marks the final block.
+void Blake2sCompressScalar(uint32_t h[8], const uint8_t block[kBlake2sBlockSize], const uint32_t t[2], bool last);
+
+#if defined(__x86_64__)
+// The four columns, then the four diagonals, of the state as 128-bit rows.
+void Blake2sCompressSse41(uint32_t h[8], const uint8_t block[kBlake2sBlockSize], const uint32_t t[2], bool last);
+
+// Up to eight messages, one per lane, all starting from the chaining value
+// |h| after |counter| bytes, e.g. a key block. Lanes that run out of blocks
+// keep their digest while the longer ones finish. Messages must be under
+// 4 GiB, and non-empty unless |counter| is zero.
+void Blake2sHash8Avx2(const uint32_t h[8], uint32_t counter, const Blake2sJob *jobs, size_t count, size_t out_len);
+#endif
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,91 @@
+#include "blake2s_kernels.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+#include <cstring>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    __attribute__((target("sse4.1"))) inline __m128i Rotr16(__m128i x)
+    {
+      const __m128i shuffle = _mm_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+      return _mm_shuffle_epi8(x, shuffle);
+    }
+
+    __attribute__((target("sse4.1"))) inline __m128i Rotr8(__m128i x)
+    {
+      const __m128i shuffle = _mm_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1);
+      return _mm_shuffle_epi8(x, shuffle);
+    }
+
+    __attribute__((target("sse4.1"))) inline __m128i Rotr(__m128i x, int c)
+    {
+      return _mm_or_si128(_mm_srli_epi32(x, c), _mm_slli_epi32(x, 32 - c));
+    }
+
+    // Half of G for all four columns or diagonals at once.
+    __attribute__((target("sse4.1"))) inline void HalfG16(__m128i &a, __m128i &b, __m128i &c, __m128i &d,
+                                                         __m128i m)
+    {
+      a = _mm_add_epi32(_mm_add_epi32(a, b), m);
+      d = Rotr16(_mm_xor_si128(d, a));
+      c = _mm_add_epi32(c, d);
+      b = Rotr(_mm_xor_si128(b, c), 12);
+    }
+
+    __attribute__((target("sse4.1"))) inline void HalfG8(__m128i &a, __m128i &b, __m128i &c, __m128i &d,
+                                                        __m128i m)
+    {
+      a = _mm_add_epi32(_mm_add_epi32(a, b), m);
+      d = Rotr8(_mm_xor_si128(d, a));
+      c = _mm_add_epi32(c, d);
+      b = Rotr(_mm_xor_si128(b, c), 7);
+    }
+
+  } // namespace
+
+  __attribute__((target("sse4.1"))) void Blake2sCompressSse41(uint32_t h[8], const uint8_t block[kBlake2sBlockSize],
+                                                              const uint32_t t[2], bool last)
+  {
+    // x86 is little-endian, so the message words load as they are.
+    uint32_t m[16];
+    memcpy(m, block, sizeof(m));
+
+    const __m128i h0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(h));
+    const __m128i h1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(h + 4));
+    __m128i a = h0;
+    __m128i b = h1;
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(kBlake2sIv));
+    __m128i d = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(kBlake2sIv + 4)),
+                              _mm_setr_epi32(t[0], t[1], last ? -1 : 0, 0));
+
+    for (int r = 0; r < 10; r++)
+    {
+      const uint8_t *s = kBlake2sSigma[r];
+      HalfG16(a, b, c, d, _mm_setr_epi32(m[s[0]], m[s[2]], m[s[4]], m[s[6]]));
+      HalfG8(a, b, c, d, _mm_setr_epi32(m[s[1]], m[s[3]], m[s[5]], m[s[7]]));
+
+      // Rotate rows so the diagonals line up as columns.
+      b = _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1));
+      c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+      d = _mm_shuffle_epi32(d, _MM_SHUFFLE(2, 1, 0, 3));
+      HalfG16(a, b, c, d, _mm_setr_epi32(m[s[8]], m[s[10]], m[s[12]], m[s[14]]));
+      HalfG8(a, b, c, d, _mm_setr_epi32(m[s[9]], m[s[11]], m[s[13]], m[s[15]]));
+      b = _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3));
+      c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2));
+      d = _mm_shuffle_epi32(d, _MM_SHUFFLE(0, 3, 2, 1));
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(h), _mm_xor_si128(h0, _mm_xor_si128(a, c)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(h + 4), _mm_xor_si128(h1, _mm_xor_si128(b, d)));
+  }
+
+} // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef WIREGUARD_FLUTTER_BYTE_ORDER_H
+#define WIREGUARD_FLUTTER_BYTE_ORDER_H
+
+#include <endian.h>
+
+#include <cstdint>
+#include <cstring>
+
+namespace wireguard_flutter {
+
+// Unaligned little/big-endian loads and stores used by the wire formats and
+// the crypto code. memcpy keeps them free of alignment and aliasing issues.
+
+inline uint32_t LoadLe32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return le32toh(v);
+}
+
+inline uint64_t LoadLe64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return le64toh(v);
+}
+
+inline void StoreLe32(uint8_t *p, uint32_t v) {
+  v = htole32(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+inline void StoreLe64(uint8_t *p, uint64_t v) {
+  v = htole64(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+inline uint16_t LoadBe16(const uint8_t *p) {
+  return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+inline uint32_t LoadBe32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return be32toh(v);
+}
+
+inline void StoreBe16(uint8_t *p, uint16_t v) {
+  p[0] = static_cast<uint8_t>(v >> 8);
+  p[1] = static_cast<uint8_t>(v);
+}
+
+inline void StoreBe32(uint8_t *p, uint32_t v) {
+  v = htobe32(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+inline void StoreBe64(uint8_t *p, uint64_t v) {
+  v = htobe64(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,169 @@
+#include "chacha20_kernels.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+#include <cstring>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    __attribute__((target("avx2"))) inline __m256i Rotl16(__m256i x)
+    {
+      const __m256i shuffle = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                              13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+      return _mm256_shuffle_epi8(x, shuffle);
+    }
+
+    __attribute__((target("avx2"))) inline __m256i Rotl8(__m256i x)
+    {
+      const __m256i shuffle = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                                              14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+      return _mm256_shuffle_epi8(x, shuffle);
+    }
+
+    __attribute__((target("avx2"))) inline __m256i Rotl(__m256i x, int c)
+    {
+      return _mm256_or_si256(_mm256_slli_epi32(x, c), _mm256_srli_epi32(x, 32 - c));
+    }
+
+#define AVX2_QUARTERROUND(a, b, c, d)   \
+  a = _mm256_add_epi32(a, b);           \
+  d = Rotl16(_mm256_xor_si256(d, a));   \
+  c = _mm256_add_epi32(c, d);           \
+  b = Rotl(_mm256_xor_si256(b, c), 12); \
+  a = _mm256_add_epi32(a, b);           \
+  d = Rotl8(_mm256_xor_si256(d, a));    \
+  c = _mm256_add_epi32(c, d);           \
+  b = Rotl(_mm256_xor_si256(b, c), 7);
+
+  } // namespace
+
+  // Turns eight rows of eight words into eight columns. The transform is its
+  // own inverse, so it serves both for loading keys and storing blocks.
+  __attribute__((target("avx2"))) void ChaCha20Transpose8x8Avx2(__m256i r[8])
+  {
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+  }
+
+  __attribute__((target("avx2"))) void ChaCha20StoreBlockAvx2(const ChaChaJob &job, __m256i first, __m256i second)
+  {
+    if (job.len == 64 && job.src != nullptr)
+    {
+      const __m256i *src = reinterpret_cast<const __m256i *>(job.src);
+      __m256i *dst = reinterpret_cast<__m256i *>(job.dst);
+      __m256i a = _mm256_loadu_si256(src);
+      __m256i b = _mm256_loadu_si256(src + 1);
+      _mm256_storeu_si256(dst, _mm256_xor_si256(a, first));
+      _mm256_storeu_si256(dst + 1, _mm256_xor_si256(b, second));
+      return;
+    }
+
+    alignas(32) uint8_t block[64];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(block), first);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(block + 32), second);
+    if (job.src == nullptr)
+    {
+      memcpy(job.dst, block, job.len);
+    }
+    else
+    {
+      for (uint32_t i = 0; i < job.len; i++)
+      {
+        job.dst[i] = job.src[i] ^ block[i];
+      }
+    }
+  }
+
+  __attribute__((target("avx2"))) void ChaCha20JobsAvx2(const ChaChaJob *jobs, size_t count)
+  {
+    for (; count >= 8; jobs += 8, count -= 8)
+    {
+      __m256i input[16];
+      input[0] = _mm256_set1_epi32(0x61707865);
+      input[1] = _mm256_set1_epi32(0x3320646e);
+      input[2] = _mm256_set1_epi32(0x79622d32);
+      input[3] = _mm256_set1_epi32(0x6b206574);
+      for (int lane = 0; lane < 8; lane++)
+      {
+        input[4 + lane] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(jobs[lane].key));
+      }
+      ChaCha20Transpose8x8Avx2(input + 4);
+      input[12] = _mm256_setr_epi32(jobs[0].counter, jobs[1].counter, jobs[2].counter, jobs[3].counter,
+                                    jobs[4].counter, jobs[5].counter, jobs[6].counter, jobs[7].counter);
+      input[13] = _mm256_setzero_si256();
+
+      // Words 14 and 15 are the low and high halves of each lane's nonce.
+      __m256i n0 = _mm256_set_epi64x(jobs[3].nonce, jobs[2].nonce, jobs[1].nonce, jobs[0].nonce);
+      __m256i n1 = _mm256_set_epi64x(jobs[7].nonce, jobs[6].nonce, jobs[5].nonce, jobs[4].nonce);
+      const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+      n0 = _mm256_permutevar8x32_epi32(n0, split);
+      n1 = _mm256_permutevar8x32_epi32(n1, split);
+      input[14] = _mm256_permute2x128_si256(n0, n1, 0x20);
+      input[15] = _mm256_permute2x128_si256(n0, n1, 0x31);
+
+      __m256i x[16];
+      for (int i = 0; i < 16; i++)
+      {
+        x[i] = input[i];
+      }
+      for (int i = 0; i < 10; i++)
+      {
+        AVX2_QUARTERROUND(x[0], x[4], x[8], x[12])
+        AVX2_QUARTERROUND(x[1], x[5], x[9], x[13])
+        AVX2_QUARTERROUND(x[2], x[6], x[10], x[14])
+        AVX2_QUARTERROUND(x[3], x[7], x[11], x[15])
+        AVX2_QUARTERROUND(x[0], x[5], x[10], x[15])
+        AVX2_QUARTERROUND(x[1], x[6], x[11], x[12])
+        AVX2_QUARTERROUND(x[2], x[7], x[8], x[13])
+        AVX2_QUARTERROUND(x[3], x[4], x[9], x[14])
+      }
+      for (int i = 0; i < 16; i++)
+      {
+        x[i] = _mm256_add_epi32(x[i], input[i]);
+      }
+
+      ChaCha20Transpose8x8Avx2(x);
+      ChaCha20Transpose8x8Avx2(x + 8);
+      for (int lane = 0; lane < 8; lane++)
+      {
+        ChaCha20StoreBlockAvx2(jobs[lane], x[lane], x[8 + lane]);
+      }
+    }
+    ChaCha20JobsScalar(jobs, count);
+  }
+
+#undef AVX2_QUARTERROUND
+
+} // namespace wireguard_flutter
+
+#endif
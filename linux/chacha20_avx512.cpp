@@ -0,0 +1,102 @@
+#include "chacha20_kernels.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+namespace wireguard_flutter
+{
+
+// Only zero-masking intrinsics are used here: the unmasked forms expand to
+// _mm512_undefined_epi32(), which trips GCC 12's -Wmaybe-uninitialized.
+#define ROTL512(x, c) _mm512_maskz_rol_epi32(0xffff, x, c)
+
+#define AVX512_QUARTERROUND(a, b, c, d)                    \
+  a = _mm512_add_epi32(a, b);                              \
+  d = ROTL512(_mm512_xor_si512(d, a), 16);        \
+  c = _mm512_add_epi32(c, d);                              \
+  b = ROTL512(_mm512_xor_si512(b, c), 12);        \
+  a = _mm512_add_epi32(a, b);                              \
+  d = ROTL512(_mm512_xor_si512(d, a), 8);         \
+  c = _mm512_add_epi32(c, d);                              \
+  b = ROTL512(_mm512_xor_si512(b, c), 7);
+
+  __attribute__((target("avx512f,avx2"))) void ChaCha20JobsAvx512(const ChaChaJob *jobs, size_t count)
+  {
+    for (; count >= 16; jobs += 16, count -= 16)
+    {
+      __m256i low[8], high[8];
+      for (int lane = 0; lane < 8; lane++)
+      {
+        low[lane] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(jobs[lane].key));
+        high[lane] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(jobs[8 + lane].key));
+      }
+      ChaCha20Transpose8x8Avx2(low);
+      ChaCha20Transpose8x8Avx2(high);
+
+      __m512i input[16];
+      input[0] = _mm512_set1_epi32(0x61707865);
+      input[1] = _mm512_set1_epi32(0x3320646e);
+      input[2] = _mm512_set1_epi32(0x79622d32);
+      input[3] = _mm512_set1_epi32(0x6b206574);
+      for (int i = 0; i < 8; i++)
+      {
+        __m512i word = _mm512_maskz_inserti64x4(0xff, _mm512_setzero_si512(), low[i], 0);
+        input[4 + i] = _mm512_maskz_inserti64x4(0xff, word, high[i], 1);
+      }
+      alignas(64) uint32_t counters[16], nonce_low[16], nonce_high[16];
+      for (int lane = 0; lane < 16; lane++)
+      {
+        counters[lane] = jobs[lane].counter;
+        nonce_low[lane] = static_cast<uint32_t>(jobs[lane].nonce);
+        nonce_high[lane] = static_cast<uint32_t>(jobs[lane].nonce >> 32);
+      }
+      input[12] = _mm512_load_si512(counters);
+      input[13] = _mm512_setzero_si512();
+      input[14] = _mm512_load_si512(nonce_low);
+      input[15] = _mm512_load_si512(nonce_high);
+
+      __m512i x[16];
+      for (int i = 0; i < 16; i++)
+      {
+        x[i] = input[i];
+      }
+      for (int i = 0; i < 10; i++)
+      {
+        AVX512_QUARTERROUND(x[0], x[4], x[8], x[12])
+        AVX512_QUARTERROUND(x[1], x[5], x[9], x[13])
+        AVX512_QUARTERROUND(x[2], x[6], x[10], x[14])
+        AVX512_QUARTERROUND(x[3], x[7], x[11], x[15])
+        AVX512_QUARTERROUND(x[0], x[5], x[10], x[15])
+        AVX512_QUARTERROUND(x[1], x[6], x[11], x[12])
+        AVX512_QUARTERROUND(x[2], x[7], x[8], x[13])
+        AVX512_QUARTERROUND(x[3], x[4], x[9], x[14])
+      }
+
+      // Lanes 0-7 live in the low 256 bits of each word, lanes 8-15 in the high.
+      __m256i words_low[16], words_high[16];
+      for (int i = 0; i < 16; i++)
+      {
+        __m512i word = _mm512_add_epi32(x[i], input[i]);
+        words_low[i] = _mm512_maskz_extracti64x4_epi64(0xff, word, 0);
+        words_high[i] = _mm512_maskz_extracti64x4_epi64(0xff, word, 1);
+      }
+      ChaCha20Transpose8x8Avx2(words_low);
+      ChaCha20Transpose8x8Avx2(words_low + 8);
+      ChaCha20Transpose8x8Avx2(words_high);
+      ChaCha20Transpose8x8Avx2(words_high + 8);
+      for (int lane = 0; lane < 8; lane++)
+      {
+        ChaCha20StoreBlockAvx2(jobs[lane], words_low[lane], words_low[8 + lane]);
+        ChaCha20StoreBlockAvx2(jobs[8 + lane], words_high[lane], words_high[8 + lane]);
+      }
+    }
+    ChaCha20JobsAvx2(jobs, count);
+  }
+
+#undef AVX512_QUARTERROUND
+#undef ROTL512
+
+} // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef WIREGUARD_FLUTTER_CHACHA20_KERNELS_H
+#define WIREGUARD_FLUTTER_CHACHA20_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace wireguard_flutter {
+
+// One 64-byte ChaCha20 block with WireGuard's nonce layout (32 zero bits and a
+// 64-bit counter). Jobs are independent, so the SIMD kernels put one job per
+// lane and can mix blocks from different packets and keys.
+struct ChaChaJob {
+  const uint8_t *key;
+  // Input to XOR with the keystream; null to write raw keystream.
+  const uint8_t *src;
+  uint8_t *dst;
+  uint64_t nonce;
+  uint32_t counter;
+  // Bytes of the block to produce, 1..64.
+  uint32_t len;
+};
+
+void ChaCha20JobsScalar(const ChaChaJob *jobs, size_t count);
+
+#if defined(__x86_64__)
+// Eight lanes per iteration; leftovers go to the scalar kernel.
+void ChaCha20JobsAvx2(const ChaChaJob *jobs, size_t count);
+// Sixteen lanes per iteration; leftovers go to the AVX2 kernel.
+void ChaCha20JobsAvx512(const ChaChaJob *jobs, size_t count);
+
+// AVX2 helpers shared with the AVX-512 kernel, which works on 256-bit halves
+// when moving between lane-major and block-major layouts.
+void ChaCha20Transpose8x8Avx2(__m256i rows[8]);
+void ChaCha20StoreBlockAvx2(const ChaChaJob &job, __m256i first, __m256i second);
+#endif
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,540 @@
+#include "chacha20poly1305.h"
+
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#include "byte_order.h"
+#include "chacha20_kernels.h"
+#include "poly1305_kernels.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    inline uint32_t Rotl32(uint32_t v, int c)
+    {
+      return (v << c) | (v >> (32 - c));
+    }
+
+#define CHACHA_QUARTERROUND(a, b, c, d) \
+  a += b;                               \
+  d = Rotl32(d ^ a, 16);                \
+  c += d;                               \
+  b = Rotl32(b ^ c, 12);                \
+  a += b;                               \
+  d = Rotl32(d ^ a, 8);                 \
+  c += d;                               \
+  b = Rotl32(b ^ c, 7);
+
+    // The 20 rounds, without the final addition of the input.
+    void ChaCha20Rounds(uint32_t x[16])
+    {
+      for (int i = 0; i < 10; i++)
+      {
+        CHACHA_QUARTERROUND(x[0], x[4], x[8], x[12])
+        CHACHA_QUARTERROUND(x[1], x[5], x[9], x[13])
+        CHACHA_QUARTERROUND(x[2], x[6], x[10], x[14])
+        CHACHA_QUARTERROUND(x[3], x[7], x[11], x[15])
+        CHACHA_QUARTERROUND(x[0], x[5], x[10], x[15])
+        CHACHA_QUARTERROUND(x[1], x[6], x[11], x[12])
+        CHACHA_QUARTERROUND(x[2], x[7], x[8], x[13])
+        CHACHA_QUARTERROUND(x[3], x[4], x[9], x[14])
+      }
+    }
+
+#undef CHACHA_QUARTERROUND
+
+    void ChaCha20Block(uint8_t out[64], const uint32_t input[16])
+    {
+      uint32_t x[16];
+      memcpy(x, input, sizeof(x));
+      ChaCha20Rounds(x);
+      for (int i = 0; i < 16; i++)
+      {
+        StoreLe32(out + 4 * i, x[i] + input[i]);
+      }
+    }
+
+    // Appends the keystream jobs for |len| bytes of data, which start at block 1
+    // because block 0 is reserved for the one-time Poly1305 key.
+    void AppendDataJobs(std::vector<ChaChaJob> &jobs, uint8_t *dst, const uint8_t *src, size_t len,
+                        const uint8_t *key, uint64_t nonce)
+    {
+      uint32_t counter = 1;
+      for (size_t offset = 0; offset < len; offset += 64)
+      {
+        size_t n = len - offset < 64 ? len - offset : 64;
+        jobs.push_back({key, src + offset, dst + offset, nonce, counter++, static_cast<uint32_t>(n)});
+      }
+    }
+
+    ChaCha20Implementation DetectChaCha20Implementation()
+    {
+#if defined(__x86_64__)
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f"))
+      {
+        return ChaCha20Implementation::kAvx512;
+      }
+      if (__builtin_cpu_supports("avx2"))
+      {
+        return ChaCha20Implementation::kAvx2;
+      }
+#endif
+      return ChaCha20Implementation::kScalar;
+    }
+
+    std::atomic<ChaCha20Implementation> &ActiveImplementation()
+    {
+      static std::atomic<ChaCha20Implementation> implementation{DetectChaCha20Implementation()};
+      return implementation;
+    }
+
+    // Below this many blocks, computing r^2 to r^4 for the AVX2 kernel costs
+    // more than it saves.
+    const size_t kPoly1305Avx2MinBlocks = 16;
+
+    void RunJobs(const ChaChaJob *jobs, size_t count)
+    {
+      switch (ActiveImplementation().load(std::memory_order_relaxed))
+      {
+#if defined(__x86_64__)
+      case ChaCha20Implementation::kAvx512:
+        ChaCha20JobsAvx512(jobs, count);
+        break;
+      case ChaCha20Implementation::kAvx2:
+        ChaCha20JobsAvx2(jobs, count);
+        break;
+#endif
+      default:
+        ChaCha20JobsScalar(jobs, count);
+        break;
+      }
+    }
+
+    // Scratch space reused across batches on each thread.
+    struct BatchScratch
+    {
+      std::vector<ChaChaJob> jobs;
+      std::vector<uint8_t> poly_keys;
+    };
+
+    BatchScratch &ThreadScratch(size_t count)
+    {
+      thread_local BatchScratch scratch;
+      scratch.jobs.clear();
+      scratch.poly_keys.resize(32 * count);
+      return scratch;
+    }
+
+    void AeadTag(uint8_t tag[16], const uint8_t poly_key[32], const uint8_t *ad, size_t ad_len, const uint8_t *ct,
+                 size_t ct_len)
+    {
+      Poly1305 mac(poly_key);
+      mac.Update(ad, ad_len);
+      mac.Pad16();
+      mac.Update(ct, ct_len);
+      mac.Pad16();
+      uint8_t lengths[16];
+      StoreLe64(lengths, ad_len);
+      StoreLe64(lengths + 8, ct_len);
+      mac.Update(lengths, sizeof(lengths));
+      mac.Final(tag);
+    }
+
+  } // namespace
+
+  void ChaCha20JobsScalar(const ChaChaJob *jobs, size_t count)
+  {
+    uint32_t input[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    uint8_t block[64];
+    for (size_t j = 0; j < count; j++)
+    {
+      const ChaChaJob &job = jobs[j];
+      for (int i = 0; i < 8; i++)
+      {
+        input[4 + i] = LoadLe32(job.key + 4 * i);
+      }
+      input[12] = job.counter;
+      input[13] = 0;
+      input[14] = static_cast<uint32_t>(job.nonce);
+      input[15] = static_cast<uint32_t>(job.nonce >> 32);
+      ChaCha20Block(block, input);
+      if (job.src == nullptr)
+      {
+        memcpy(job.dst, block, job.len);
+      }
+      else
+      {
+        for (uint32_t i = 0; i < job.len; i++)
+        {
+          job.dst[i] = job.src[i] ^ block[i];
+        }
+      }
+    }
+    SecureZero(input, sizeof(input));
+    SecureZero(block, sizeof(block));
+  }
+
+  void ChaCha20Blocks(uint8_t *out, const uint8_t key[kChaCha20KeySize], const uint8_t nonce[12], uint32_t counter,
+                      size_t blocks)
+  {
+    uint32_t input[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    for (int i = 0; i < 8; i++)
+    {
+      input[4 + i] = LoadLe32(key + 4 * i);
+    }
+    input[13] = LoadLe32(nonce);
+    input[14] = LoadLe32(nonce + 4);
+    input[15] = LoadLe32(nonce + 8);
+    for (size_t i = 0; i < blocks; i++)
+    {
+      input[12] = counter + static_cast<uint32_t>(i);
+      ChaCha20Block(out + 64 * i, input);
+    }
+  }
+
+  void HChaCha20(uint8_t out[kChaCha20KeySize], const uint8_t key[kChaCha20KeySize], const uint8_t nonce[16])
+  {
+    uint32_t x[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    for (int i = 0; i < 8; i++)
+    {
+      x[4 + i] = LoadLe32(key + 4 * i);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+      x[12 + i] = LoadLe32(nonce + 4 * i);
+    }
+    ChaCha20Rounds(x);
+    for (int i = 0; i < 4; i++)
+    {
+      StoreLe32(out + 4 * i, x[i]);
+      StoreLe32(out + 16 + 4 * i, x[12 + i]);
+    }
+    SecureZero(x, sizeof(x));
+  }
+
+  Poly1305::Poly1305(const uint8_t key[32])
+  {
+    uint64_t t0 = LoadLe64(key);
+    uint64_t t1 = LoadLe64(key + 8);
+    r_[0] = t0 & 0xffc0fffffffULL;
+    r_[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    r_[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+    h_[0] = h_[1] = h_[2] = 0;
+    pad_[0] = LoadLe64(key + 16);
+    pad_[1] = LoadLe64(key + 24);
+  }
+
+  Poly1305::~Poly1305()
+  {
+    SecureZero(r_, sizeof(r_));
+    SecureZero(pad_, sizeof(pad_));
+  }
+
+  void Poly1305::Blocks(const uint8_t *data, size_t len, uint64_t hibit)
+  {
+    typedef unsigned __int128 u128;
+    const uint64_t mask44 = 0xfffffffffffULL;
+    const uint64_t mask42 = 0x3ffffffffffULL;
+#if defined(__x86_64__)
+    // Both SIMD implementations have AVX2. The kernel takes only full
+    // blocks with the 2^128 bit set, in fours.
+    if (hibit != 0 && len >= 16 * kPoly1305Avx2MinBlocks &&
+        ActiveImplementation().load(std::memory_order_relaxed) != ChaCha20Implementation::kScalar)
+    {
+      size_t blocks = len / 64 * 4;
+      Poly1305BlocksAvx2(h_, r_, data, blocks);
+      data += 16 * blocks;
+      len -= 16 * blocks;
+    }
+#endif
+    uint64_t r0 = r_[0], r1 = r_[1], r2 = r_[2];
+    uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = h_[0], h1 = h_[1], h2 = h_[2];
+
+    while (len >= 16)
+    {
+      uint64_t t0 = LoadLe64(data);
+      uint64_t t1 = LoadLe64(data + 8);
+      h0 += t0 & mask44;
+      h1 += ((t0 >> 44) | (t1 << 20)) & mask44;
+      h2 += ((t1 >> 24) & mask42) | hibit;
+
+      u128 d0 = (u128)h0 * r0 + (u128)h1 * s2 + (u128)h2 * s1;
+      u128 d1 = (u128)h0 * r1 + (u128)h1 * r0 + (u128)h2 * s2;
+      u128 d2 = (u128)h0 * r2 + (u128)h1 * r1 + (u128)h2 * r0;
+
+      uint64_t c = (uint64_t)(d0 >> 44);
+      h0 = (uint64_t)d0 & mask44;
+      d1 += c;
+      c = (uint64_t)(d1 >> 44);
+      h1 = (uint64_t)d1 & mask44;
+      d2 += c;
+      c = (uint64_t)(d2 >> 42);
+      h2 = (uint64_t)d2 & mask42;
+      h0 += c * 5;
+      c = h0 >> 44;
+      h0 &= mask44;
+      h1 += c;
+
+      data += 16;
+      len -= 16;
+    }
+    h_[0] = h0;
+    h_[1] = h1;
+    h_[2] = h2;
+  }
+
+  void Poly1305::Update(const uint8_t *data, size_t len)
+  {
+    total_ += len;
+    if (leftover_ > 0)
+    {
+      size_t want = 16 - leftover_;
+      if (want > len)
+      {
+        want = len;
+      }
+      memcpy(buffer_ + leftover_, data, want);
+      leftover_ += want;
+      data += want;
+      len -= want;
+      if (leftover_ < 16)
+      {
+        return;
+      }
+      Blocks(buffer_, 16, 1ULL << 40);
+      leftover_ = 0;
+    }
+    size_t full = len & ~static_cast<size_t>(15);
+    if (full > 0)
+    {
+      Blocks(data, full, 1ULL << 40);
+      data += full;
+      len -= full;
+    }
+    if (len > 0)
+    {
+      memcpy(buffer_, data, len);
+      leftover_ = len;
+    }
+  }
+
+  void Poly1305::Pad16()
+  {
+    static const uint8_t zeros[16] = {0};
+    if (total_ % 16 != 0)
+    {
+      Update(zeros, 16 - total_ % 16);
+    }
+  }
+
+  void Poly1305::Final(uint8_t tag[kPoly1305TagSize])
+  {
+    const uint64_t mask44 = 0xfffffffffffULL;
+    const uint64_t mask42 = 0x3ffffffffffULL;
+    if (leftover_ > 0)
+    {
+      buffer_[leftover_] = 1;
+      memset(buffer_ + leftover_ + 1, 0, 16 - leftover_ - 1);
+      Blocks(buffer_, 16, 0);
+    }
+
+    uint64_t h0 = h_[0], h1 = h_[1], h2 = h_[2];
+    uint64_t c = h1 >> 44;
+    h1 &= mask44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= mask42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += c;
+    c = h1 >> 44;
+    h1 &= mask44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= mask42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += c;
+
+    // Compute h - p and select it when h >= p.
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44;
+    g0 &= mask44;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44;
+    g1 &= mask44;
+    uint64_t g2 = h2 + c - (1ULL << 42);
+    c = (g2 >> 63) - 1;
+    g0 &= c;
+    g1 &= c;
+    g2 &= c;
+    c = ~c;
+    h0 = (h0 & c) | g0;
+    h1 = (h1 & c) | g1;
+    h2 = (h2 & c) | g2;
+
+    uint64_t t0 = pad_[0], t1 = pad_[1];
+    h0 += t0 & mask44;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & mask44) + c;
+    c = h1 >> 44;
+    h1 &= mask44;
+    h2 += ((t1 >> 24) & mask42) + c;
+    h2 &= mask42;
+
+    StoreLe64(tag, h0 | (h1 << 44));
+    StoreLe64(tag + 8, (h1 >> 20) | (h2 << 24));
+    SecureZero(h_, sizeof(h_));
+  }
+
+  void ChaCha20Poly1305Seal(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *ad, size_t ad_len,
+                            uint64_t nonce, const uint8_t key[kChaCha20KeySize])
+  {
+    AeadPacket packet;
+    packet.src = src;
+    packet.dst = dst;
+    packet.len = len;
+    packet.ad = ad;
+    packet.ad_len = ad_len;
+    packet.nonce = nonce;
+    packet.key = key;
+    ChaCha20Poly1305SealBatch(&packet, 1);
+  }
+
+  bool ChaCha20Poly1305Open(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len,
+                            uint64_t nonce, const uint8_t key[kChaCha20KeySize])
+  {
+    AeadPacket packet;
+    packet.src = src;
+    packet.dst = dst;
+    packet.len = src_len;
+    packet.ad = ad;
+    packet.ad_len = ad_len;
+    packet.nonce = nonce;
+    packet.key = key;
+    ChaCha20Poly1305OpenBatch(&packet, 1);
+    return packet.ok;
+  }
+
+  // The last 8 bytes of an XChaCha20 nonce, after 4 zero bytes, are exactly
+  // WireGuard's counter nonce.
+  void XChaCha20Poly1305Seal(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *ad, size_t ad_len,
+                             const uint8_t nonce[kXChaCha20NonceSize], const uint8_t key[kChaCha20KeySize])
+  {
+    uint8_t subkey[kChaCha20KeySize];
+    HChaCha20(subkey, key, nonce);
+    ChaCha20Poly1305Seal(dst, src, len, ad, ad_len, LoadLe64(nonce + 16), subkey);
+    SecureZero(subkey, sizeof(subkey));
+  }
+
+  bool XChaCha20Poly1305Open(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len,
+                             const uint8_t nonce[kXChaCha20NonceSize], const uint8_t key[kChaCha20KeySize])
+  {
+    uint8_t subkey[kChaCha20KeySize];
+    HChaCha20(subkey, key, nonce);
+    bool ok = ChaCha20Poly1305Open(dst, src, src_len, ad, ad_len, LoadLe64(nonce + 16), subkey);
+    SecureZero(subkey, sizeof(subkey));
+    return ok;
+  }
+
+  void ChaCha20Poly1305SealBatch(AeadPacket *packets, size_t count)
+  {
+    BatchScratch &scratch = ThreadScratch(count);
+    for (size_t i = 0; i < count; i++)
+    {
+      AeadPacket &p = packets[i];
+      scratch.jobs.push_back({p.key, nullptr, &scratch.poly_keys[32 * i], p.nonce, 0, 32});
+      AppendDataJobs(scratch.jobs, p.dst, p.src, p.len, p.key, p.nonce);
+    }
+    RunJobs(scratch.jobs.data(), scratch.jobs.size());
+
+    for (size_t i = 0; i < count; i++)
+    {
+      AeadPacket &p = packets[i];
+      AeadTag(p.dst + p.len, &scratch.poly_keys[32 * i], p.ad, p.ad_len, p.dst, p.len);
+      p.ok = true;
+    }
+    SecureZero(scratch.poly_keys.data(), scratch.poly_keys.size());
+  }
+
+  void ChaCha20Poly1305OpenBatch(AeadPacket *packets, size_t count)
+  {
+    BatchScratch &scratch = ThreadScratch(count);
+    for (size_t i = 0; i < count; i++)
+    {
+      AeadPacket &p = packets[i];
+      p.ok = false;
+      if (p.len >= kPoly1305TagSize)
+      {
+        scratch.jobs.push_back({p.key, nullptr, &scratch.poly_keys[32 * i], p.nonce, 0, 32});
+      }
+    }
+    RunJobs(scratch.jobs.data(), scratch.jobs.size());
+
+    // Authenticate everything before decrypting anything, so forged packets
+    // cost only their Poly1305 pass.
+    scratch.jobs.clear();
+    for (size_t i = 0; i < count; i++)
+    {
+      AeadPacket &p = packets[i];
+      if (p.len < kPoly1305TagSize)
+      {
+        continue;
+      }
+      size_t len = p.len - kPoly1305TagSize;
+      uint8_t tag[kPoly1305TagSize];
+      AeadTag(tag, &scratch.poly_keys[32 * i], p.ad, p.ad_len, p.src, len);
+      p.ok = ConstantTimeEqual(tag, p.src + len, kPoly1305TagSize);
+      if (p.ok)
+      {
+        AppendDataJobs(scratch.jobs, p.dst, p.src, len, p.key, p.nonce);
+      }
+    }
+    RunJobs(scratch.jobs.data(), scratch.jobs.size());
+    SecureZero(scratch.poly_keys.data(), scratch.poly_keys.size());
+  }
+
+  ChaCha20Implementation ActiveChaCha20Implementation()
+  {
+    return ActiveImplementation().load(std::memory_order_relaxed);
+  }
+
+  bool SetChaCha20Implementation(ChaCha20Implementation implementation)
+  {
+    if (implementation > DetectChaCha20Implementation())
+    {
+      return false;
+    }
+    ActiveImplementation().store(implementation, std::memory_order_relaxed);
+    return true;
+  }
+
+  bool ConstantTimeEqual(const uint8_t *a, const uint8_t *b, size_t len)
+  {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+      diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+  }
+
+  void SecureZero(void *p, size_t len)
+  {
+    volatile uint8_t *v = static_cast<volatile uint8_t *>(p);
+    while (len--)
+    {
+      *v++ = 0;
+    }
+  }
+
+} // namespace wireguard_flutter
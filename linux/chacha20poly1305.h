@@ -0,0 +1,97 @@
+#ifndef WIREGUARD_FLUTTER_CHACHA20POLY1305_H
+#define WIREGUARD_FLUTTER_CHACHA20POLY1305_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace wireguard_flutter {
+
+constexpr size_t kChaCha20KeySize = 32;
+constexpr size_t kPoly1305TagSize = 16;
+constexpr size_t kXChaCha20NonceSize = 24;
+
+// ChaCha20 block function with the RFC 8439 96-bit nonce layout. |nonce| is
+// the 12 raw nonce bytes; writes |blocks| consecutive 64-byte keystream blocks.
+void ChaCha20Blocks(uint8_t *out, const uint8_t key[kChaCha20KeySize], const uint8_t nonce[12], uint32_t counter,
+                    size_t blocks);
+
+class Poly1305 {
+ public:
+  explicit Poly1305(const uint8_t key[32]);
+  ~Poly1305();
+
+  void Update(const uint8_t *data, size_t len);
+  // Feeds zero bytes up to the next 16-byte boundary, as the AEAD construction requires.
+  void Pad16();
+  void Final(uint8_t tag[kPoly1305TagSize]);
+
+ private:
+  void Blocks(const uint8_t *data, size_t len, uint64_t hibit);
+
+  uint64_t r_[3], h_[3], pad_[2];
+  size_t total_ = 0;
+  size_t leftover_ = 0;
+  uint8_t buffer_[16];
+};
+
+// RFC 8439 AEAD with WireGuard's nonce: 32 zero bits followed by a 64-bit
+// little-endian counter. |dst| may alias |src|. Seal writes |len| + 16 bytes.
+void ChaCha20Poly1305Seal(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *ad, size_t ad_len,
+                          uint64_t nonce, const uint8_t key[kChaCha20KeySize]);
+
+// |src_len| includes the trailing tag. Returns false (and leaves |dst|
+// unspecified) when authentication fails.
+bool ChaCha20Poly1305Open(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len,
+                          uint64_t nonce, const uint8_t key[kChaCha20KeySize]);
+
+// HChaCha20 from draft-irtf-cfrg-xchacha: derives a subkey from |key| and the
+// first 16 bytes of an extended nonce.
+void HChaCha20(uint8_t out[kChaCha20KeySize], const uint8_t key[kChaCha20KeySize], const uint8_t nonce[16]);
+
+// XChaCha20-Poly1305 with a random 24-byte nonce, as used for cookie replies.
+void XChaCha20Poly1305Seal(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *ad, size_t ad_len,
+                           const uint8_t nonce[kXChaCha20NonceSize], const uint8_t key[kChaCha20KeySize]);
+bool XChaCha20Poly1305Open(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t *ad, size_t ad_len,
+                           const uint8_t nonce[kXChaCha20NonceSize], const uint8_t key[kChaCha20KeySize]);
+
+// One packet of a batch. For sealing, |len| is the plaintext length and |dst|
+// receives |len| + 16 bytes; for opening, |len| includes the trailing tag.
+// |dst| may alias |src|.
+struct AeadPacket {
+  const uint8_t *src;
+  uint8_t *dst;
+  size_t len;
+  const uint8_t *ad = nullptr;
+  size_t ad_len = 0;
+  uint64_t nonce;
+  const uint8_t *key;
+  // Set by ChaCha20Poly1305OpenBatch when the packet authenticates.
+  bool ok = false;
+};
+
+// Seal or open |count| packets at once. Keystream blocks from all packets are
+// interleaved across the SIMD lanes, so small packets still fill the vectors.
+// Open only decrypts packets whose tag verifies.
+void ChaCha20Poly1305SealBatch(AeadPacket *packets, size_t count);
+void ChaCha20Poly1305OpenBatch(AeadPacket *packets, size_t count);
+
+enum class ChaCha20Implementation { kScalar, kAvx2, kAvx512 };
+
+// The implementation used by the AEAD functions and Poly1305: the ChaCha20
+// kernel of that width, with the AVX2 Poly1305 kernel for either SIMD one.
+// Defaults to the widest one the CPU supports.
+ChaCha20Implementation ActiveChaCha20Implementation();
+
+// Forces an implementation, e.g. for benchmarking. Returns false if the CPU
+// does not support it.
+bool SetChaCha20Implementation(ChaCha20Implementation implementation);
+
+// Constant-time comparison of two buffers.
+bool ConstantTimeEqual(const uint8_t *a, const uint8_t *b, size_t len);
+
+// Clears key material in a way the compiler may not elide.
+void SecureZero(void *p, size_t len);
+
+}  // namespace wireguard_flutter
+
+#endif
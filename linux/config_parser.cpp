@@ -0,0 +1,394 @@
+#include "config_parser.h"
+
+#include <arpa/inet.h>
+#include <libbase64.h>
+#include <netdb.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    std::string Trim(const std::string &s)
+    {
+      size_t begin = 0, end = s.size();
+      while (begin < end && isspace(static_cast<unsigned char>(s[begin])))
+      {
+        begin++;
+      }
+      while (end > begin && isspace(static_cast<unsigned char>(s[end - 1])))
+      {
+        end--;
+      }
+      return s.substr(begin, end - begin);
+    }
+
+    std::string Lower(std::string s)
+    {
+      std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c)
+                     { return static_cast<char>(tolower(c)); });
+      return s;
+    }
+
+    std::vector<std::string> SplitList(const std::string &value)
+    {
+      std::vector<std::string> items;
+      std::stringstream stream(value);
+      std::string item;
+      while (std::getline(stream, item, ','))
+      {
+        item = Trim(item);
+        if (!item.empty())
+        {
+          items.push_back(item);
+        }
+      }
+      return items;
+    }
+
+    bool ParseUint(const std::string &value, unsigned long max, unsigned long *out)
+    {
+      if (value.empty() || !std::all_of(value.begin(), value.end(), ::isdigit))
+      {
+        return false;
+      }
+      unsigned long v = strtoul(value.c_str(), nullptr, 10);
+      if (v > max)
+      {
+        return false;
+      }
+      *out = v;
+      return true;
+    }
+
+    [[noreturn]] void Fail(int line, const std::string &msg)
+    {
+      throw std::runtime_error("Invalid config at line " + std::to_string(line) + ": " + msg);
+    }
+
+  } // namespace
+
+  DeviceConfig ParseWgQuickConfig(const std::string &config)
+  {
+    enum class Section
+    {
+      kNone,
+      kInterface,
+      kPeer
+    };
+
+    DeviceConfig device;
+    Section section = Section::kNone;
+    std::stringstream stream(config);
+    std::string raw;
+    int line = 0;
+
+    while (std::getline(stream, raw))
+    {
+      line++;
+      std::string text = Trim(raw.substr(0, raw.find('#')));
+      if (text.empty())
+      {
+        continue;
+      }
+
+      if (text.front() == '[')
+      {
+        std::string name = Lower(text);
+        if (name == "[interface]")
+        {
+          section = Section::kInterface;
+        }
+        else if (name == "[peer]")
+        {
+          section = Section::kPeer;
+          device.peers.emplace_back();
+        }
+        else
+        {
+          Fail(line, "unknown section " + text);
+        }
+        continue;
+      }
+
+      size_t eq = text.find('=');
+      if (eq == std::string::npos)
+      {
+        Fail(line, "expected 'Key = Value'");
+      }
+      std::string key = Lower(Trim(text.substr(0, eq)));
+      std::string value = Trim(text.substr(eq + 1));
+      unsigned long number;
+
+      if (section == Section::kInterface)
+      {
+        if (key == "privatekey")
+        {
+          if (!DecodeBase64Key(value, device.private_key))
+          {
+            Fail(line, "invalid PrivateKey");
+          }
+          device.has_private_key = true;
+        }
+        else if (key == "listenport")
+        {
+          if (!ParseUint(value, 65535, &number))
+          {
+            Fail(line, "invalid ListenPort");
+          }
+          device.listen_port = static_cast<uint16_t>(number);
+        }
+        else if (key == "mtu")
+        {
+          if (!ParseUint(value, 65535, &number) || number < 576)
+          {
+            Fail(line, "invalid MTU");
+          }
+          device.mtu = static_cast<uint16_t>(number);
+        }
+        else if (key == "address")
+        {
+          for (const auto &item : SplitList(value))
+          {
+            IpPrefix prefix;
+            if (!ParseIpPrefix(item, &prefix))
+            {
+              Fail(line, "invalid Address " + item);
+            }
+            device.addresses.push_back(prefix);
+          }
+        }
+        else if (key == "dns")
+        {
+          for (const auto &item : SplitList(value))
+          {
+            device.dns.push_back(item);
+          }
+        }
+        else if (key != "table" && key != "fwmark" && key != "saveconfig" && key != "preup" && key != "postup" &&
+                 key != "predown" && key != "postdown")
+        {
+          Fail(line, "unknown Interface key " + key);
+        }
+      }
+      else if (section == Section::kPeer)
+      {
+        PeerConfig &peer = device.peers.back();
+        if (key == "publickey")
+        {
+          if (!DecodeBase64Key(value, peer.public_key))
+          {
+            Fail(line, "invalid PublicKey");
+          }
+        }
+        else if (key == "presharedkey")
+        {
+          if (!DecodeBase64Key(value, peer.preshared_key))
+          {
+            Fail(line, "invalid PresharedKey");
+          }
+          peer.has_preshared_key = true;
+        }
+        else if (key == "allowedips")
+        {
+          for (const auto &item : SplitList(value))
+          {
+            IpPrefix prefix;
+            if (!ParseIpPrefix(item, &prefix))
+            {
+              Fail(line, "invalid AllowedIPs entry " + item);
+            }
+            peer.allowed_ips.push_back(prefix);
+          }
+        }
+        else if (key == "endpoint")
+        {
+          peer.endpoint = value;
+        }
+        else if (key == "persistentkeepalive")
+        {
+          if (value == "off")
+          {
+            number = 0;
+          }
+          else if (!ParseUint(value, 65535, &number))
+          {
+            Fail(line, "invalid PersistentKeepalive");
+          }
+          peer.persistent_keepalive = static_cast<uint16_t>(number);
+        }
+        else
+        {
+          Fail(line, "unknown Peer key " + key);
+        }
+      }
+      else
+      {
+        Fail(line, "key outside of a section");
+      }
+    }
+
+    if (!device.has_private_key)
+    {
+      throw std::runtime_error("Invalid config: [Interface] PrivateKey is required");
+    }
+    for (size_t i = 0; i < device.peers.size(); i++)
+    {
+      static const uint8_t zero[kCurve25519KeySize] = {0};
+      if (memcmp(device.peers[i].public_key, zero, kCurve25519KeySize) == 0)
+      {
+        throw std::runtime_error("Invalid config: peer " + std::to_string(i) + " has no PublicKey");
+      }
+    }
+    return device;
+  }
+
+  std::string SetWgQuickMtu(const std::string &config, uint16_t mtu)
+  {
+    std::stringstream stream(config);
+    std::string raw, result;
+    bool in_interface = false;
+    while (std::getline(stream, raw))
+    {
+      std::string text = Trim(raw.substr(0, raw.find('#')));
+      if (!text.empty() && text.front() == '[')
+      {
+        in_interface = Lower(text) == "[interface]";
+        result += raw + "\n";
+        if (in_interface)
+        {
+          result += "MTU = " + std::to_string(mtu) + "\n";
+        }
+        continue;
+      }
+      if (in_interface && Lower(Trim(text.substr(0, text.find('=')))) == "mtu")
+      {
+        continue;
+      }
+      result += raw + "\n";
+    }
+    return result;
+  }
+
+  bool ParseIpPrefix(const std::string &text, IpPrefix *prefix)
+  {
+    std::string address = text;
+    long cidr = -1;
+    size_t slash = text.find('/');
+    if (slash != std::string::npos)
+    {
+      address = text.substr(0, slash);
+      std::string bits = text.substr(slash + 1);
+      unsigned long number;
+      if (!ParseUint(bits, 128, &number))
+      {
+        return false;
+      }
+      cidr = static_cast<long>(number);
+    }
+
+    memset(prefix->address, 0, sizeof(prefix->address));
+    if (inet_pton(AF_INET, address.c_str(), prefix->address) == 1)
+    {
+      prefix->family = AF_INET;
+      if (cidr > 32)
+      {
+        return false;
+      }
+      prefix->cidr = static_cast<uint8_t>(cidr < 0 ? 32 : cidr);
+    }
+    else if (inet_pton(AF_INET6, address.c_str(), prefix->address) == 1)
+    {
+      prefix->family = AF_INET6;
+      prefix->cidr = static_cast<uint8_t>(cidr < 0 ? 128 : cidr);
+    }
+    else
+    {
+      return false;
+    }
+    return true;
+  }
+
+  std::string IpPrefixToString(const IpPrefix &prefix)
+  {
+    char buffer[INET6_ADDRSTRLEN];
+    if (inet_ntop(prefix.family, prefix.address, buffer, sizeof(buffer)) == nullptr)
+    {
+      return std::string();
+    }
+    return std::string(buffer) + "/" + std::to_string(prefix.cidr);
+  }
+
+  bool DecodeBase64Key(const std::string &text, uint8_t key[kCurve25519KeySize])
+  {
+    if (text.size() != 44 || text[43] != '=')
+    {
+      return false;
+    }
+    char decoded[48];
+    size_t decoded_len = 0;
+    if (base64_decode(text.data(), text.size(), decoded, &decoded_len, 0) != 1 ||
+        decoded_len != kCurve25519KeySize)
+    {
+      return false;
+    }
+    memcpy(key, decoded, kCurve25519KeySize);
+    return true;
+  }
+
+  std::string EncodeBase64Key(const uint8_t key[kCurve25519KeySize])
+  {
+    char encoded[48];
+    size_t encoded_len = 0;
+    base64_encode(reinterpret_cast<const char *>(key), kCurve25519KeySize, encoded, &encoded_len, 0);
+    return std::string(encoded, encoded_len);
+  }
+
+  bool ResolveEndpoint(const std::string &endpoint, struct sockaddr_storage *addr, socklen_t *addr_len)
+  {
+    std::string host, port;
+    if (!endpoint.empty() && endpoint.front() == '[')
+    {
+      size_t close = endpoint.find(']');
+      if (close == std::string::npos || close + 1 >= endpoint.size() || endpoint[close + 1] != ':')
+      {
+        return false;
+      }
+      host = endpoint.substr(1, close - 1);
+      port = endpoint.substr(close + 2);
+    }
+    else
+    {
+      size_t colon = endpoint.rfind(':');
+      if (colon == std::string::npos)
+      {
+        return false;
+      }
+      host = endpoint.substr(0, colon);
+      port = endpoint.substr(colon + 1);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    struct addrinfo *result = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || result == nullptr)
+    {
+      return false;
+    }
+    memcpy(addr, result->ai_addr, result->ai_addrlen);
+    *addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,65 @@
+#ifndef WIREGUARD_FLUTTER_CONFIG_PARSER_H
+#define WIREGUARD_FLUTTER_CONFIG_PARSER_H
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "curve25519.h"
+
+namespace wireguard_flutter {
+
+struct IpPrefix {
+  int family = AF_UNSPEC;
+  uint8_t address[16] = {0};
+  uint8_t cidr = 0;
+};
+
+struct PeerConfig {
+  uint8_t public_key[kCurve25519KeySize];
+  uint8_t preshared_key[kCurve25519KeySize];
+  bool has_preshared_key = false;
+  // "host:port" or "[v6]:port" as written in the config; empty if unset.
+  std::string endpoint;
+  std::vector<IpPrefix> allowed_ips;
+  uint16_t persistent_keepalive = 0;
+};
+
+// The subset of a wg-quick(8) file that the data plane needs, plus the
+// interface settings the plugin applies around it.
+struct DeviceConfig {
+  uint8_t private_key[kCurve25519KeySize];
+  bool has_private_key = false;
+  uint16_t listen_port = 0;
+  uint16_t mtu = 0;
+  std::vector<IpPrefix> addresses;
+  std::vector<std::string> dns;
+  std::vector<PeerConfig> peers;
+};
+
+constexpr uint16_t kDefaultMtu = 1420;
+
+// Parses the same wg-quick text the plugin passes as 'wgQuickConfig'. Throws
+// std::runtime_error describing the first invalid line.
+DeviceConfig ParseWgQuickConfig(const std::string &config);
+
+// Returns |config| with its [Interface] MTU set to |mtu|, replacing any MTU
+// line there. Everything else, comments included, is left as it was.
+std::string SetWgQuickMtu(const std::string &config, uint16_t mtu);
+
+bool ParseIpPrefix(const std::string &text, IpPrefix *prefix);
+
+std::string IpPrefixToString(const IpPrefix &prefix);
+
+bool DecodeBase64Key(const std::string &text, uint8_t key[kCurve25519KeySize]);
+
+std::string EncodeBase64Key(const uint8_t key[kCurve25519KeySize]);
+
+// Resolves "host:port" / "[v6]:port" into a socket address.
+bool ResolveEndpoint(const std::string &endpoint, struct sockaddr_storage *addr, socklen_t *addr_len);
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,147 @@
+#include "cookie.h"
+
+#include <netinet/in.h>
+
+#include <cstring>
+
+#include "byte_order.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const char kLabelCookie[] = "cookie--";
+
+    void ComputeCookieKey(uint8_t out[kBlake2sHashSize], const uint8_t public_key[kCurve25519KeySize])
+    {
+      Blake2s state(kBlake2sHashSize);
+      state.Update(reinterpret_cast<const uint8_t *>(kLabelCookie), sizeof(kLabelCookie) - 1);
+      state.Update(public_key, kCurve25519KeySize);
+      state.Final(out);
+    }
+
+    // mac2 covers everything before it, mac1 included.
+    void ComputeMac2(uint8_t out[kCookieSize], const uint8_t *msg, size_t len, const uint8_t cookie[kCookieSize])
+    {
+      Blake2sHash(out, kCookieSize, msg, len - kCookieSize, cookie, kCookieSize);
+    }
+
+  } // namespace
+
+  CookieChecker::CookieChecker()
+  {
+    memset(mac1_key_, 0, sizeof(mac1_key_));
+    memset(encryption_key_, 0, sizeof(encryption_key_));
+    RandomBytes(secret_, sizeof(secret_));
+    secret_birth_ = std::chrono::steady_clock::now();
+  }
+
+  CookieChecker::~CookieChecker()
+  {
+    SecureZero(secret_, sizeof(secret_));
+  }
+
+  void CookieChecker::SetIdentity(const StaticIdentity &identity)
+  {
+    memcpy(mac1_key_, identity.mac1_key, sizeof(mac1_key_));
+    ComputeCookieKey(encryption_key_, identity.public_key);
+  }
+
+  bool CookieChecker::CheckMac2(const uint8_t *msg, size_t len, const struct sockaddr_storage &from,
+                                socklen_t from_len, std::chrono::steady_clock::time_point now)
+  {
+    uint8_t cookie[kCookieSize];
+    uint8_t mac2[kCookieSize];
+    MakeCookie(cookie, from, from_len, now);
+    ComputeMac2(mac2, msg, len, cookie);
+    const MessageMacs *macs = reinterpret_cast<const MessageMacs *>(msg + len - sizeof(MessageMacs));
+    return ConstantTimeEqual(mac2, macs->mac2, kCookieSize);
+  }
+
+  void CookieChecker::CreateReply(MessageCookieReply *reply, const uint8_t *msg, size_t len, uint32_t sender_index,
+                                  const struct sockaddr_storage &from, socklen_t from_len,
+                                  std::chrono::steady_clock::time_point now)
+  {
+    const MessageMacs *macs = reinterpret_cast<const MessageMacs *>(msg + len - sizeof(MessageMacs));
+    uint8_t cookie[kCookieSize];
+    MakeCookie(cookie, from, from_len, now);
+    reply->type = htole32(kMessageCookieReply);
+    reply->receiver_index = htole32(sender_index);
+    RandomBytes(reply->nonce, sizeof(reply->nonce));
+    XChaCha20Poly1305Seal(reply->encrypted_cookie, cookie, kCookieSize, macs->mac1, kCookieSize, reply->nonce,
+                          encryption_key_);
+  }
+
+  void CookieChecker::MakeCookie(uint8_t cookie[kCookieSize], const struct sockaddr_storage &from,
+                                 socklen_t from_len, std::chrono::steady_clock::time_point now)
+  {
+    if (now - secret_birth_ >= kCookieSecretMaxAge)
+    {
+      RandomBytes(secret_, sizeof(secret_));
+      secret_birth_ = now;
+    }
+
+    // The address and port, in network byte order as on the wire.
+    Blake2s state(kCookieSize, secret_, sizeof(secret_));
+    if (from.ss_family == AF_INET && from_len >= sizeof(struct sockaddr_in))
+    {
+      const struct sockaddr_in *in = reinterpret_cast<const struct sockaddr_in *>(&from);
+      state.Update(reinterpret_cast<const uint8_t *>(&in->sin_addr), sizeof(in->sin_addr));
+      state.Update(reinterpret_cast<const uint8_t *>(&in->sin_port), sizeof(in->sin_port));
+    }
+    else if (from.ss_family == AF_INET6 && from_len >= sizeof(struct sockaddr_in6))
+    {
+      const struct sockaddr_in6 *in6 = reinterpret_cast<const struct sockaddr_in6 *>(&from);
+      state.Update(reinterpret_cast<const uint8_t *>(&in6->sin6_addr), sizeof(in6->sin6_addr));
+      state.Update(reinterpret_cast<const uint8_t *>(&in6->sin6_port), sizeof(in6->sin6_port));
+    }
+    state.Final(cookie);
+  }
+
+  PeerCookie::~PeerCookie()
+  {
+    SecureZero(cookie, sizeof(cookie));
+  }
+
+  void InitPeerCookie(PeerCookie *cookie, const uint8_t remote_static[kCurve25519KeySize])
+  {
+    ComputeCookieKey(cookie->decryption_key, remote_static);
+    cookie->valid = false;
+    cookie->have_sent_mac1 = false;
+  }
+
+  void AddCookieMacs(uint8_t *msg, size_t len, const uint8_t mac1_key[kBlake2sHashSize], PeerCookie *cookie,
+                     std::chrono::steady_clock::time_point now)
+  {
+    bool fresh = cookie->valid && now - cookie->birth < kCookieSecretMaxAge - kCookieSecretLatency;
+    AddMacs(msg, len, mac1_key, fresh ? cookie->cookie : nullptr);
+    const MessageMacs *macs = reinterpret_cast<const MessageMacs *>(msg + len - sizeof(MessageMacs));
+    memcpy(cookie->last_mac1, macs->mac1, kCookieSize);
+    cookie->have_sent_mac1 = true;
+  }
+
+  bool ConsumeCookieReply(const MessageCookieReply &reply, PeerCookie *cookie,
+                          std::chrono::steady_clock::time_point now)
+  {
+    if (!cookie->have_sent_mac1)
+    {
+      return false;
+    }
+    uint8_t value[kCookieSize];
+    if (!XChaCha20Poly1305Open(value, reply.encrypted_cookie, sizeof(reply.encrypted_cookie), cookie->last_mac1,
+                               kCookieSize, reply.nonce, cookie->decryption_key))
+    {
+      return false;
+    }
+    memcpy(cookie->cookie, value, kCookieSize);
+    SecureZero(value, sizeof(value));
+    cookie->birth = now;
+    cookie->valid = true;
+    // A reply only ever answers one message.
+    cookie->have_sent_mac1 = false;
+    return true;
+  }
+
+} // namespace wireguard_flutter
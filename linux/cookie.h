@@ -0,0 +1,85 @@
+#ifndef WIREGUARD_FLUTTER_COOKIE_H
+#define WIREGUARD_FLUTTER_COOKIE_H
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "messages.h"
+#include "noise.h"
+
+namespace wireguard_flutter {
+
+// The cookie mechanism from section 5.4.4 of the whitepaper. A responder
+// under load only does the expensive part of a handshake for senders that
+// prove they can receive at their source address: their mac2 must be keyed
+// with a cookie we sent there, which is a MAC of the address under a secret
+// that changes every two minutes.
+
+// Responder side: checks MACs on incoming handshake messages and makes
+// cookie replies. Not thread-safe.
+class CookieChecker {
+ public:
+  CookieChecker();
+  ~CookieChecker();
+
+  CookieChecker(const CookieChecker &) = delete;
+  CookieChecker &operator=(const CookieChecker &) = delete;
+
+  void SetIdentity(const StaticIdentity &identity);
+
+  // Checks mac1 of a batch of handshake messages ending in MessageMacs.
+  void CheckMac1(Mac1Check *checks, size_t count) { CheckMac1Batch(checks, count, mac1_key_); }
+
+  // Whether mac2 of a message is keyed with the cookie for |from|.
+  bool CheckMac2(const uint8_t *msg, size_t len, const struct sockaddr_storage &from, socklen_t from_len,
+                 std::chrono::steady_clock::time_point now);
+
+  // Makes the reply that hands |from| its cookie, for the message |msg| sent
+  // with |sender_index|.
+  void CreateReply(MessageCookieReply *reply, const uint8_t *msg, size_t len, uint32_t sender_index,
+                   const struct sockaddr_storage &from, socklen_t from_len,
+                   std::chrono::steady_clock::time_point now);
+
+ private:
+  void MakeCookie(uint8_t cookie[kCookieSize], const struct sockaddr_storage &from, socklen_t from_len,
+                  std::chrono::steady_clock::time_point now);
+
+  uint8_t mac1_key_[kBlake2sHashSize];
+  // HASH("cookie--" || our public key).
+  uint8_t encryption_key_[kBlake2sHashSize];
+  uint8_t secret_[kBlake2sHashSize];
+  std::chrono::steady_clock::time_point secret_birth_;
+};
+
+// Initiator side: what we know about the cookies of one peer.
+struct PeerCookie {
+  // HASH("cookie--" || the peer's public key).
+  uint8_t decryption_key[kBlake2sHashSize];
+  uint8_t cookie[kCookieSize];
+  std::chrono::steady_clock::time_point birth;
+  bool valid = false;
+  // The mac1 of the last handshake message sent, which a cookie reply must
+  // be bound to.
+  uint8_t last_mac1[kCookieSize];
+  bool have_sent_mac1 = false;
+
+  ~PeerCookie();
+};
+
+void InitPeerCookie(PeerCookie *cookie, const uint8_t remote_static[kCurve25519KeySize]);
+
+// Like AddMacs(), with mac2 keyed by the peer's cookie while it is fresh.
+void AddCookieMacs(uint8_t *msg, size_t len, const uint8_t mac1_key[kBlake2sHashSize], PeerCookie *cookie,
+                   std::chrono::steady_clock::time_point now);
+
+// Takes the cookie out of a reply to the last message we sent. Returns
+// false if the reply does not authenticate.
+bool ConsumeCookieReply(const MessageCookieReply &reply, PeerCookie *cookie,
+                        std::chrono::steady_clock::time_point now);
+
+}  // namespace wireguard_flutter
+
+#endif
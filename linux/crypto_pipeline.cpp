@@ -0,0 +1,227 @@
+#include "crypto_pipeline.h"
+
+#include <new>
+
+#include "messages.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kWorkerQueueSize = 4096;
+    const size_t kMaxBatch = 32;
+
+  } // namespace
+
+  std::unique_ptr<PacketElement> PacketElement::Create(size_t capacity)
+  {
+    size_t size = kPacketElementDataOffset + capacity;
+    void *memory = PacketPool::Instance().Allocate(size);
+    std::unique_ptr<PacketElement> element(new (memory) PacketElement());
+    element->capacity = PacketPool::UsableSize(size) - kPacketElementDataOffset;
+    return element;
+  }
+
+  PeerPacketQueue::~PeerPacketQueue()
+  {
+    PacketElement *element;
+    while (ring_.Front(&element))
+    {
+      ring_.Pop();
+      delete element;
+    }
+  }
+
+  size_t DefaultCryptoWorkers()
+  {
+    unsigned int cpus = std::thread::hardware_concurrency();
+    return cpus > 1 ? cpus - 1 : 0;
+  }
+
+  CryptoPipeline::CryptoPipeline(size_t workers, Completion on_complete)
+      : on_complete_(std::move(on_complete))
+  {
+    for (size_t i = 0; i < workers; i++)
+    {
+      queues_.emplace_back(new MpmcQueue<PacketElement *>(kWorkerQueueSize));
+    }
+    for (size_t i = 0; i < workers; i++)
+    {
+      threads_.emplace_back(&CryptoPipeline::WorkerLoop, this, i);
+    }
+  }
+
+  CryptoPipeline::~CryptoPipeline()
+  {
+    stopping_ = true;
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      wake_.notify_all();
+    }
+    for (auto &thread : threads_)
+    {
+      thread.join();
+    }
+  }
+
+  bool CryptoPipeline::Submit(PacketElement *element)
+  {
+    in_flight_++;
+    if (queues_.empty())
+    {
+      pending_.push_back(element);
+      if (pending_.size() == kMaxBatch)
+      {
+        Flush();
+      }
+      return true;
+    }
+
+    size_t count = queues_.size();
+    size_t start = next_queue_.fetch_add(1, std::memory_order_relaxed);
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+      for (size_t i = 0; i < count; i++)
+      {
+        if (queues_[(start + i) % count]->TryPush(element))
+        {
+          return true;
+        }
+      }
+      // Everything is full; make sure nobody is asleep on a full queue.
+      Flush();
+      std::this_thread::yield();
+    }
+    in_flight_--;
+    return false;
+  }
+
+  void CryptoPipeline::Flush()
+  {
+    if (queues_.empty())
+    {
+      if (!pending_.empty())
+      {
+        ProcessBatch(pending_.data(), pending_.size());
+        pending_.clear();
+      }
+      return;
+    }
+    // Pairs with the fence in WorkerLoop: either the worker sees the packets,
+    // or we see it going to sleep.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) > 0)
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      wake_.notify_all();
+    }
+  }
+
+  void CryptoPipeline::WaitIdle()
+  {
+    Flush();
+    while (in_flight_.load() != 0)
+    {
+      std::this_thread::yield();
+    }
+  }
+
+  void CryptoPipeline::WorkerLoop(size_t id)
+  {
+    PacketElement *batch[kMaxBatch];
+    while (!stopping_)
+    {
+      size_t count = CollectBatch(id, batch, kMaxBatch);
+      if (count > 0)
+      {
+        ProcessBatch(batch, count);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      sleepers_++;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!stopping_ && AllQueuesEmpty())
+      {
+        wake_.wait(lock);
+      }
+      sleepers_--;
+    }
+  }
+
+  size_t CryptoPipeline::CollectBatch(size_t id, PacketElement **batch, size_t max)
+  {
+    size_t count = 0;
+    while (count < max && queues_[id]->TryPop(&batch[count]))
+    {
+      count++;
+    }
+    // Steal from the other workers, starting with our neighbour so that idle
+    // workers spread out over the busy ones.
+    for (size_t i = 1; count == 0 && i < queues_.size(); i++)
+    {
+      MpmcQueue<PacketElement *> &victim = *queues_[(id + i) % queues_.size()];
+      while (count < max / 2 && victim.TryPop(&batch[count]))
+      {
+        count++;
+      }
+    }
+    return count;
+  }
+
+  void CryptoPipeline::ProcessBatch(PacketElement **batch, size_t count)
+  {
+    AeadPacket seal[kMaxBatch], open[kMaxBatch];
+    PacketElement *sealed[kMaxBatch], *opened[kMaxBatch];
+    Peer *peers[kMaxBatch];
+    bool encrypt[kMaxBatch];
+    size_t seal_count = 0, open_count = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+      PacketElement *element = batch[i];
+      peers[i] = element->peer;
+      encrypt[i] = element->encrypt;
+      AeadPacket &packet = element->encrypt ? seal[seal_count] : open[open_count];
+      (element->encrypt ? sealed[seal_count++] : opened[open_count++]) = element;
+      packet.src = element->payload();
+      packet.dst = element->payload();
+      packet.len = element->payload_len;
+      packet.nonce = element->counter;
+      packet.key = element->key;
+    }
+
+    ChaCha20Poly1305SealBatch(seal, seal_count);
+    ChaCha20Poly1305OpenBatch(open, open_count);
+    for (size_t i = 0; i < seal_count; i++)
+    {
+      sealed[i]->state.store(PacketElement::kDone);
+    }
+    for (size_t i = 0; i < open_count; i++)
+    {
+      opened[i]->state.store(open[i].ok ? PacketElement::kDone : PacketElement::kDropped);
+    }
+
+    // Once its state is set an element may be drained and freed by another
+    // thread, so completions only get what was copied out beforehand.
+    for (size_t i = 0; i < count; i++)
+    {
+      on_complete_(peers[i], encrypt[i]);
+      in_flight_--;
+    }
+  }
+
+  bool CryptoPipeline::AllQueuesEmpty() const
+  {
+    for (const auto &queue : queues_)
+    {
+      if (!queue->Empty())
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+} // namespace wireguard_flutter
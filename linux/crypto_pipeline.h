@@ -0,0 +1,183 @@
+#ifndef WIREGUARD_FLUTTER_CRYPTO_PIPELINE_H
+#define WIREGUARD_FLUTTER_CRYPTO_PIPELINE_H
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "chacha20poly1305.h"
+#include "lockfree_queue.h"
+#include "messages.h"
+#include "packet_pool.h"
+
+namespace wireguard_flutter {
+
+struct Peer;
+
+// Per-peer bound on packets waiting for encryption or decryption, as in the
+// kernel implementation.
+constexpr size_t kMaxQueuedPackets = 1024;
+
+// A transport data message on its way through the crypto workers. Everything
+// the workers need is copied in, so keypairs and endpoints can change while
+// the packet is in flight.
+//
+// Elements live in PacketPool blocks with the message right behind them, and
+// are the handle a packet travels under from the TUN read to the UDP send
+// (or back): the plaintext is read into the payload slot, sealed in place
+// and sent straight from there.
+struct PacketElement {
+  enum State { kPending, kDone, kDropped };
+
+  // Returns an element with room for a message of at least |capacity|
+  // bytes; the |capacity| field says how much room there really is.
+  static std::unique_ptr<PacketElement> Create(size_t capacity);
+  static void operator delete(void *element) { PacketPool::Instance().Free(element); }
+
+  PacketElement(const PacketElement &) = delete;
+  PacketElement &operator=(const PacketElement &) = delete;
+  ~PacketElement() { SecureZero(key, sizeof(key)); }
+
+  // The whole message: the header, then the payload, then the tag when
+  // sealed. When encrypting, the payload is the padded plaintext.
+  uint8_t *data();
+  uint8_t *payload() { return data() + sizeof(MessageDataHeader); }
+
+  std::atomic<int> state{kPending};
+  Peer *peer = nullptr;
+  bool encrypt = false;
+  // Bytes available at data().
+  size_t capacity = 0;
+  // Message length, header and tag included.
+  size_t len = 0;
+  // Payload length: the plaintext when encrypting, ciphertext plus tag when
+  // decrypting.
+  size_t payload_len = 0;
+  uint64_t counter = 0;
+  uint8_t key[kChaCha20KeySize];
+  // Destination when encrypting, source when decrypting.
+  struct sockaddr_storage address;
+  socklen_t address_len = 0;
+
+ private:
+  PacketElement() = default;
+};
+
+// The message starts on the first cache line after the element.
+constexpr size_t kPacketElementDataOffset =
+    (sizeof(PacketElement) + kCacheLineSize - 1) & ~(kCacheLineSize - 1);
+
+inline uint8_t *PacketElement::data() {
+  return reinterpret_cast<uint8_t *>(this) + kPacketElementDataOffset;
+}
+
+// The packets of one peer and one direction, in the order they entered the
+// pipeline. Workers finish packets out of order; draining only releases the
+// finished prefix, so packets leave in the order they arrived.
+class PeerPacketQueue {
+ public:
+  PeerPacketQueue() : ring_(kMaxQueuedPackets) {}
+  ~PeerPacketQueue();
+
+  PeerPacketQueue(const PeerPacketQueue &) = delete;
+  PeerPacketQueue &operator=(const PeerPacketQueue &) = delete;
+
+  // Only one thread may enqueue at a time. Returns false when the queue is full.
+  bool Enqueue(PacketElement *element) { return ring_.TryPush(element); }
+
+  // Passes finished elements to |handler| in order; the handler owns them
+  // afterwards. |end_of_pass| runs after each pass over the queue while this
+  // thread still owns it, so work batched by the handler keeps its order. If
+  // another thread is already draining, this only records the request and
+  // returns: the drainer loops until no requests arrived while it was busy,
+  // so nothing is left behind and only the drainer ever touches queued
+  // elements.
+  template <typename Handler, typename EndOfPass>
+  void Drain(Handler handler, EndOfPass end_of_pass) {
+    if (drain_requests_.fetch_add(1) != 0) {
+      return;
+    }
+    size_t requests;
+    do {
+      requests = drain_requests_.load();
+      PacketElement *element;
+      while (ring_.Front(&element) && element->state.load() != PacketElement::kPending) {
+        ring_.Pop();
+        handler(element);
+      }
+      end_of_pass();
+    } while (drain_requests_.fetch_sub(requests) != requests);
+  }
+
+  template <typename Handler>
+  void Drain(Handler handler) {
+    Drain(handler, [] {});
+  }
+
+ private:
+  SpscQueue<PacketElement *> ring_;
+  std::atomic<size_t> drain_requests_{0};
+};
+
+// One worker per CPU beyond the one running the event loop.
+size_t DefaultCryptoWorkers();
+
+// Pool of crypto workers. Each worker has its own bounded queue; packets are
+// spread over the queues round-robin and idle workers steal from the others.
+// Workers seal or open whatever batch they collect in one pass, then run the
+// completion callback with each packet's peer and direction.
+//
+// Submit(), Flush() and WaitIdle() must not be called concurrently; the
+// device calls them with its lock held.
+class CryptoPipeline {
+ public:
+  typedef std::function<void(Peer *peer, bool encrypt)> Completion;
+
+  // With no workers, packets are processed on the submitting thread in
+  // Flush(), which still lets them share SIMD batches.
+  CryptoPipeline(size_t workers, Completion on_complete);
+  ~CryptoPipeline();
+
+  CryptoPipeline(const CryptoPipeline &) = delete;
+  CryptoPipeline &operator=(const CryptoPipeline &) = delete;
+
+  size_t workers() const { return threads_.size(); }
+
+  // Returns false if every worker queue is full. Sleeping workers are only
+  // woken by Flush(), so a burst of packets costs a single wakeup.
+  bool Submit(PacketElement *element);
+  void Flush();
+
+  // Blocks until every submitted packet has been processed and completed.
+  // Peers stay valid until then, so callers wait here before removing one.
+  void WaitIdle();
+
+ private:
+  void WorkerLoop(size_t id);
+  size_t CollectBatch(size_t id, PacketElement **batch, size_t max);
+  void ProcessBatch(PacketElement **batch, size_t count);
+  bool AllQueuesEmpty() const;
+
+  Completion on_complete_;
+  std::vector<std::unique_ptr<MpmcQueue<PacketElement *>>> queues_;
+  std::vector<std::thread> threads_;
+  // Packets waiting for Flush() when there are no workers.
+  std::vector<PacketElement *> pending_;
+  std::atomic<size_t> next_queue_{0};
+  std::atomic<size_t> in_flight_{0};
+  std::atomic<size_t> sleepers_{0};
+  std::atomic<bool> stopping_{false};
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,288 @@
+#include "curve25519.h"
+
+#include <errno.h>
+#include <sys/random.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "byte_order.h"
+#include "chacha20poly1305.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Field elements mod 2^255 - 19 in five 51-bit limbs.
+    typedef uint64_t Fe[5];
+    typedef unsigned __int128 u128;
+
+    const uint64_t kMask51 = (1ULL << 51) - 1;
+
+    void FeFromBytes(Fe h, const uint8_t s[32])
+    {
+      uint64_t t0 = LoadLe64(s), t1 = LoadLe64(s + 8), t2 = LoadLe64(s + 16), t3 = LoadLe64(s + 24);
+      h[0] = t0 & kMask51;
+      h[1] = ((t0 >> 51) | (t1 << 13)) & kMask51;
+      h[2] = ((t1 >> 38) | (t2 << 26)) & kMask51;
+      h[3] = ((t2 >> 25) | (t3 << 39)) & kMask51;
+      h[4] = (t3 >> 12) & kMask51;
+    }
+
+    void FeCarry(uint64_t t[5])
+    {
+      t[1] += t[0] >> 51;
+      t[0] &= kMask51;
+      t[2] += t[1] >> 51;
+      t[1] &= kMask51;
+      t[3] += t[2] >> 51;
+      t[2] &= kMask51;
+      t[4] += t[3] >> 51;
+      t[3] &= kMask51;
+      t[0] += 19 * (t[4] >> 51);
+      t[4] &= kMask51;
+    }
+
+    void FeToBytes(uint8_t s[32], const Fe f)
+    {
+      uint64_t t[5] = {f[0], f[1], f[2], f[3], f[4]};
+      FeCarry(t);
+      FeCarry(t);
+
+      // t is now in [0, 2^255); add 19 and then 2^255 - 19 so that the top
+      // carry reveals whether t >= p, then drop it.
+      t[0] += 19;
+      FeCarry(t);
+      t[0] += (1ULL << 51) - 19;
+      t[1] += (1ULL << 51) - 1;
+      t[2] += (1ULL << 51) - 1;
+      t[3] += (1ULL << 51) - 1;
+      t[4] += (1ULL << 51) - 1;
+      t[1] += t[0] >> 51;
+      t[0] &= kMask51;
+      t[2] += t[1] >> 51;
+      t[1] &= kMask51;
+      t[3] += t[2] >> 51;
+      t[2] &= kMask51;
+      t[4] += t[3] >> 51;
+      t[3] &= kMask51;
+      t[4] &= kMask51;
+
+      StoreLe64(s, t[0] | (t[1] << 51));
+      StoreLe64(s + 8, (t[1] >> 13) | (t[2] << 38));
+      StoreLe64(s + 16, (t[2] >> 26) | (t[3] << 25));
+      StoreLe64(s + 24, (t[3] >> 39) | (t[4] << 12));
+    }
+
+    void FeAdd(Fe h, const Fe f, const Fe g)
+    {
+      for (int i = 0; i < 5; i++)
+      {
+        h[i] = f[i] + g[i];
+      }
+    }
+
+    // h = f - g, computed as f + 2p - g so limbs never underflow for reduced inputs.
+    void FeSub(Fe h, const Fe f, const Fe g)
+    {
+      h[0] = f[0] + 0xfffffffffffdaULL - g[0];
+      h[1] = f[1] + 0xffffffffffffeULL - g[1];
+      h[2] = f[2] + 0xffffffffffffeULL - g[2];
+      h[3] = f[3] + 0xffffffffffffeULL - g[3];
+      h[4] = f[4] + 0xffffffffffffeULL - g[4];
+    }
+
+    void FeReduceWide(Fe h, u128 r0, u128 r1, u128 r2, u128 r3, u128 r4)
+    {
+      uint64_t c;
+      r1 += (uint64_t)(r0 >> 51);
+      uint64_t h0 = (uint64_t)r0 & kMask51;
+      r2 += (uint64_t)(r1 >> 51);
+      uint64_t h1 = (uint64_t)r1 & kMask51;
+      r3 += (uint64_t)(r2 >> 51);
+      uint64_t h2 = (uint64_t)r2 & kMask51;
+      r4 += (uint64_t)(r3 >> 51);
+      uint64_t h3 = (uint64_t)r3 & kMask51;
+      c = (uint64_t)(r4 >> 51);
+      uint64_t h4 = (uint64_t)r4 & kMask51;
+      h0 += c * 19;
+      h1 += h0 >> 51;
+      h0 &= kMask51;
+      h[0] = h0;
+      h[1] = h1;
+      h[2] = h2;
+      h[3] = h3;
+      h[4] = h4;
+    }
+
+    void FeMul(Fe h, const Fe f, const Fe g)
+    {
+      uint64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+      uint64_t g0 = g[0], g1 = g[1], g2 = g[2], g3 = g[3], g4 = g[4];
+      uint64_t g1_19 = 19 * g1, g2_19 = 19 * g2, g3_19 = 19 * g3, g4_19 = 19 * g4;
+
+      u128 r0 = (u128)f0 * g0 + (u128)f1 * g4_19 + (u128)f2 * g3_19 + (u128)f3 * g2_19 + (u128)f4 * g1_19;
+      u128 r1 = (u128)f0 * g1 + (u128)f1 * g0 + (u128)f2 * g4_19 + (u128)f3 * g3_19 + (u128)f4 * g2_19;
+      u128 r2 = (u128)f0 * g2 + (u128)f1 * g1 + (u128)f2 * g0 + (u128)f3 * g4_19 + (u128)f4 * g3_19;
+      u128 r3 = (u128)f0 * g3 + (u128)f1 * g2 + (u128)f2 * g1 + (u128)f3 * g0 + (u128)f4 * g4_19;
+      u128 r4 = (u128)f0 * g4 + (u128)f1 * g3 + (u128)f2 * g2 + (u128)f3 * g1 + (u128)f4 * g0;
+      FeReduceWide(h, r0, r1, r2, r3, r4);
+    }
+
+    void FeSquare(Fe h, const Fe f)
+    {
+      FeMul(h, f, f);
+    }
+
+    void FeSquareTimes(Fe h, const Fe f, int n)
+    {
+      FeSquare(h, f);
+      for (int i = 1; i < n; i++)
+      {
+        FeSquare(h, h);
+      }
+    }
+
+    void FeMulSmall(Fe h, const Fe f, uint64_t k)
+    {
+      FeReduceWide(h, (u128)f[0] * k, (u128)f[1] * k, (u128)f[2] * k, (u128)f[3] * k, (u128)f[4] * k);
+    }
+
+    // out = z^(p - 2).
+    void FeInvert(Fe out, const Fe z)
+    {
+      Fe t0, t1, t2, t3;
+      FeSquare(t0, z);
+      FeSquareTimes(t1, t0, 2);
+      FeMul(t1, z, t1);
+      FeMul(t0, t0, t1);
+      FeSquare(t2, t0);
+      FeMul(t1, t1, t2);
+      FeSquareTimes(t2, t1, 5);
+      FeMul(t1, t2, t1);
+      FeSquareTimes(t2, t1, 10);
+      FeMul(t2, t2, t1);
+      FeSquareTimes(t3, t2, 20);
+      FeMul(t2, t3, t2);
+      FeSquareTimes(t2, t2, 10);
+      FeMul(t1, t2, t1);
+      FeSquareTimes(t2, t1, 50);
+      FeMul(t2, t2, t1);
+      FeSquareTimes(t3, t2, 100);
+      FeMul(t2, t3, t2);
+      FeSquareTimes(t2, t2, 50);
+      FeMul(t1, t2, t1);
+      FeSquareTimes(t1, t1, 5);
+      FeMul(out, t1, t0);
+    }
+
+    void FeConditionalSwap(Fe f, Fe g, uint64_t swap)
+    {
+      uint64_t mask = 0 - swap;
+      for (int i = 0; i < 5; i++)
+      {
+        uint64_t x = mask & (f[i] ^ g[i]);
+        f[i] ^= x;
+        g[i] ^= x;
+      }
+    }
+
+    const uint8_t kBasePoint[32] = {9};
+
+  } // namespace
+
+  bool X25519(uint8_t out[kCurve25519KeySize], const uint8_t scalar[kCurve25519KeySize],
+              const uint8_t point[kCurve25519KeySize])
+  {
+    uint8_t e[32];
+    memcpy(e, scalar, 32);
+    e[0] &= 248;
+    e[31] &= 127;
+    e[31] |= 64;
+
+    Fe x1, x2 = {1}, z2 = {0}, x3, z3 = {1};
+    Fe a, aa, b, bb, c, d, da, cb, tmp;
+    FeFromBytes(x1, point);
+    memcpy(x3, x1, sizeof(Fe));
+
+    uint64_t swap = 0;
+    for (int pos = 254; pos >= 0; pos--)
+    {
+      uint64_t bit = (e[pos / 8] >> (pos & 7)) & 1;
+      swap ^= bit;
+      FeConditionalSwap(x2, x3, swap);
+      FeConditionalSwap(z2, z3, swap);
+      swap = bit;
+
+      FeAdd(a, x2, z2);
+      FeSquare(aa, a);
+      FeSub(b, x2, z2);
+      FeSquare(bb, b);
+      FeSub(tmp, aa, bb); // E
+      FeAdd(c, x3, z3);
+      FeSub(d, x3, z3);
+      FeMul(da, d, a);
+      FeMul(cb, c, b);
+
+      FeAdd(x3, da, cb);
+      FeSquare(x3, x3);
+      FeSub(z3, da, cb);
+      FeSquare(z3, z3);
+      FeMul(z3, z3, x1);
+      FeMul(x2, aa, bb);
+      FeMulSmall(z2, tmp, 121665);
+      FeAdd(z2, z2, aa);
+      FeMul(z2, z2, tmp);
+    }
+    FeConditionalSwap(x2, x3, swap);
+    FeConditionalSwap(z2, z3, swap);
+
+    FeInvert(z2, z2);
+    FeMul(x2, x2, z2);
+    FeToBytes(out, x2);
+    SecureZero(e, sizeof(e));
+
+    uint8_t zero = 0;
+    for (size_t i = 0; i < kCurve25519KeySize; i++)
+    {
+      zero |= out[i];
+    }
+    return zero != 0;
+  }
+
+  void X25519PublicKey(uint8_t public_key[kCurve25519KeySize], const uint8_t private_key[kCurve25519KeySize])
+  {
+    X25519(public_key, private_key, kBasePoint);
+  }
+
+  void X25519GeneratePrivateKey(uint8_t private_key[kCurve25519KeySize])
+  {
+    RandomBytes(private_key, kCurve25519KeySize);
+    private_key[0] &= 248;
+    private_key[31] &= 127;
+    private_key[31] |= 64;
+  }
+
+  void RandomBytes(void *out, size_t len)
+  {
+    uint8_t *p = static_cast<uint8_t *>(out);
+    while (len > 0)
+    {
+      ssize_t n = getrandom(p, len, 0);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        throw std::runtime_error("getrandom failed: " + std::to_string(errno));
+      }
+      p += n;
+      len -= static_cast<size_t>(n);
+    }
+  }
+
+} // namespace wireguard_flutter
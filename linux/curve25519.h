@@ -0,0 +1,26 @@
+#ifndef WIREGUARD_FLUTTER_CURVE25519_H
+#define WIREGUARD_FLUTTER_CURVE25519_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace wireguard_flutter {
+
+constexpr size_t kCurve25519KeySize = 32;
+
+// X25519 scalar multiplication (RFC 7748). Returns false when the result is
+// the all-zero point, which callers must treat as a failed handshake.
+bool X25519(uint8_t out[kCurve25519KeySize], const uint8_t scalar[kCurve25519KeySize],
+            const uint8_t point[kCurve25519KeySize]);
+
+void X25519PublicKey(uint8_t public_key[kCurve25519KeySize], const uint8_t private_key[kCurve25519KeySize]);
+
+// Fills |private_key| from the system CSPRNG and clamps it.
+void X25519GeneratePrivateKey(uint8_t private_key[kCurve25519KeySize]);
+
+// Fills |out| from the system CSPRNG; throws std::runtime_error on failure.
+void RandomBytes(void *out, size_t len);
+
+}  // namespace wireguard_flutter
+
+#endif
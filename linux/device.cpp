@@ -0,0 +1,2084 @@
+#include "device.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "byte_order.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const int kMaxPacketsPerWakeup = 64;
+
+    // Handshake messages wait in a queue so a flood of them cannot starve
+    // transport data; the loop works through a few per wakeup. A backlog of
+    // several wakeups' worth means we are under load, and we stay so until
+    // a second passes without any message to turn away.
+    const size_t kMaxQueuedHandshakes = 4096;
+    const int kHandshakesPerWakeup = 16;
+    const size_t kUnderLoadQueueDepth = 8 * kHandshakesPerWakeup;
+    // mac1 is checked this many queued messages at a time. Messages dropped
+    // or turned away before the Noise code are cheap and do not count
+    // against kHandshakesPerWakeup, but no more than kMaxPacketsPerWakeup
+    // leave the queue per wakeup.
+    const size_t kMac1BatchSize = 16;
+    const std::chrono::seconds kUnderLoadAfterTime(1);
+
+    // Outbound packets the workers may hold at once, and how far they must
+    // get through them before the event loop hands out more.
+    const size_t kMaxTransmitInFlight = 256;
+    const size_t kTransmitWakeLevel = kMaxTransmitInFlight / 2;
+
+    // io_uring: submission entries, receive buffers shared by both UDP
+    // sockets (a power of two), and TUN reads kept posted.
+    const unsigned kRingEntries = 256;
+    const unsigned kRingReceiveBuffers = 32;
+    const int kRingTunReads = 32;
+    // A multishot receive lays out each buffer as the io_uring_recvmsg_out
+    // header, the source address, the control data, then the payload.
+    const size_t kRingReceiveBufferSize = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) +
+                                          kUdpReceiveControlSize + kUdpReceiveBufferSize;
+
+    // What a completion is for, in the low bits of its user data. TUN reads
+    // and writes carry their packet element, which is cache-line aligned.
+    enum RingTag : uint64_t
+    {
+      kRingWake,
+      kRingUdp,
+      kRingTunPoll,
+      kRingTunRead,
+      kRingTunWrite,
+      kRingCancel,
+    };
+    const uint64_t kRingTagMask = 7;
+
+    // A UDP socket bound to |port| on every address of |family|. Joining an
+    // SO_REUSEPORT group takes the option before bind(). Returns -1 with
+    // errno set on failure.
+    int OpenUdpSocket(int family, uint16_t port, bool join_group)
+    {
+      int fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd < 0)
+      {
+        return -1;
+      }
+      int one = 1;
+      if (join_group)
+      {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+      }
+      struct sockaddr_storage addr;
+      memset(&addr, 0, sizeof(addr));
+      socklen_t addr_len;
+      if (family == AF_INET6)
+      {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+        struct sockaddr_in6 *addr6 = reinterpret_cast<struct sockaddr_in6 *>(&addr);
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(port);
+        addr6->sin6_addr = in6addr_any;
+        addr_len = sizeof(*addr6);
+      }
+      else
+      {
+        struct sockaddr_in *addr4 = reinterpret_cast<struct sockaddr_in *>(&addr);
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(port);
+        addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+        addr_len = sizeof(*addr4);
+      }
+      if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), addr_len) < 0)
+      {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+      }
+      return fd;
+    }
+
+    void CloseAll(const std::vector<int> &fds)
+    {
+      for (int fd : fds)
+      {
+        if (fd >= 0)
+        {
+          close(fd);
+        }
+      }
+    }
+
+    void PinToCpu(int cpu)
+    {
+      if (cpu < 0 || cpu >= CPU_SETSIZE)
+      {
+        return;
+      }
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      // Best effort: the CPU may be offline or outside our cpuset.
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    // Copies each segment of what one read from a TUN with IFF_VNET_HDR
+    // returned into a packet element of its own.
+    template <typename Handler>
+    void ForEachTunSegment(TunSegmenter *segmenter, uint8_t *packet, size_t len, Handler handler)
+    {
+      for (const PacketSpan &segment : segmenter->Split(packet, len))
+      {
+        std::unique_ptr<PacketElement> element =
+            PacketElement::Create(kMessageDataMinSize + segment.len + kMessagePaddingMultiple);
+        memcpy(element->payload(), segment.data, segment.len);
+        handler(std::move(element), segment.len);
+      }
+    }
+
+    void SetNonBlocking(int fd)
+    {
+      int flags = fcntl(fd, F_GETFL, 0);
+      if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+      {
+        throw std::runtime_error("could not make descriptor non-blocking: " + std::string(strerror(errno)));
+      }
+    }
+
+    int64_t WallClockNanos()
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+          .count();
+    }
+
+    // Length of the IP packet at |packet| according to its header, or 0 if
+    // the header is malformed or claims more than |len| bytes.
+    size_t InnerPacketLength(const uint8_t *packet, size_t len)
+    {
+      if (len >= 20 && (packet[0] >> 4) == 4)
+      {
+        size_t total = LoadBe16(packet + 2);
+        return total >= 20 && total <= len ? total : 0;
+      }
+      if (len >= 40 && (packet[0] >> 4) == 6)
+      {
+        size_t total = 40 + static_cast<size_t>(LoadBe16(packet + 4));
+        return total <= len ? total : 0;
+      }
+      return 0;
+    }
+
+    bool KeypairExpired(const Keypair *keypair, TimePoint now)
+    {
+      return keypair->send_counter.load() >= kRejectAfterMessages || now - keypair->birth >= kRejectAfterTime;
+    }
+
+    // A TUN read or write of |len| bytes at |data| inside |element|, through
+    // the fixed buffer of its slab when that could be registered.
+    void PrepareTunIo(IoUring *ring, struct io_uring_sqe *sqe, int fd, bool write, PacketElement *element,
+                      uint8_t *data, size_t len)
+    {
+      void *slab;
+      size_t slab_size;
+      PacketPool::SlabOf(element, &slab, &slab_size);
+      int slot = ring->FixedBuffer(slab, slab_size);
+      if (slot >= 0)
+      {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = static_cast<uint16_t>(slot);
+      }
+      else
+      {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+      }
+      sqe->fd = fd;
+      sqe->addr = reinterpret_cast<uint64_t>(data);
+      sqe->len = static_cast<uint32_t>(len);
+      sqe->off = static_cast<uint64_t>(-1);
+      sqe->user_data = reinterpret_cast<uint64_t>(element) | (write ? kRingTunWrite : kRingTunRead);
+    }
+
+  } // namespace
+
+  // What Run() keeps while it drives an io_uring.
+  struct Device::UringState
+  {
+    IoUring *ring;
+    // Only this thread may submit; queue threads write to the TUN directly.
+    std::thread::id thread;
+    // From the packet pool, indexed by provided buffer id.
+    std::vector<void *> buffers;
+    // Tells multishot receives how much room to leave for the source address
+    // and control data.
+    struct msghdr receive_header;
+    // The bind_generation_ the receives were armed for, and the user data of
+    // the multishot receive on each socket, 0 when none is armed.
+    uint64_t bound = 0;
+    uint64_t udp_tags[2] = {0, 0};
+    uint64_t next_generation = 1;
+    bool wake_armed = false;
+    // TUN reads posted and not yet completed.
+    int tun_reads = 0;
+    // A read ran into EAGAIN, so no more are posted until a wait for POLLIN
+    // completes.
+    bool tun_poll = false;
+    bool tun_poll_armed = false;
+    // Requests that still owe a final completion.
+    size_t active = 0;
+    // Datagrams handled since the last completions were reaped.
+    size_t udp_handled = 0;
+    // Decrypted packets to write, in order, at the end of the drain pass.
+    std::vector<std::pair<std::unique_ptr<PacketElement>, size_t>> tun_writes;
+  };
+
+  struct Device::IoQueue
+  {
+    explicit IoQueue(int fd, bool vnet_hdr) : tun_fd(fd), tun_buffer(vnet_hdr ? kMaxTunPacketSize : 0) {}
+
+    int tun_fd;
+    int wake_fd = -1;
+    // Swapped by Bind() under both |mutex| and the device lock; the thread
+    // holds |mutex| while it reads from them.
+    int udp4_fd = -1;
+    int udp6_fd = -1;
+    std::mutex mutex;
+    std::thread thread;
+    // Only touched by the queue's thread.
+    UdpReceiver udp_receiver;
+    std::vector<uint8_t> tun_buffer;
+    TunSegmenter tun_segmenter;
+    std::vector<std::pair<std::unique_ptr<PacketElement>, size_t>> tun_packets;
+    // mtu_ as of the last time the thread held the device lock.
+    uint16_t mtu = kDefaultMtu;
+  };
+
+  Device::Device(int tun_fd, size_t crypto_workers) : Device(std::vector<int>{tun_fd}, crypto_workers) {}
+
+  Device::Device(const std::vector<int> &tun_queues, size_t crypto_workers)
+      : tun_fd_(tun_queues.at(0)),
+        vnet_hdr_(TunHasVnetHeader(tun_fd_)),
+        timers_(std::chrono::steady_clock::now()),
+        tun_buffer_(vnet_hdr_ ? kMaxTunPacketSize : 0)
+  {
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd_ < 0)
+    {
+      throw std::runtime_error("eventfd failed: " + std::string(strerror(errno)));
+    }
+    SetNonBlocking(tun_fd_);
+    for (size_t i = 0; vnet_hdr_ && i < tun_queues.size(); i++)
+    {
+      tun_coalescers_.emplace_back(new TunCoalescer());
+    }
+    for (size_t i = 1; i < tun_queues.size(); i++)
+    {
+      queues_.emplace_back(new IoQueue(tun_queues[i], vnet_hdr_));
+      SetNonBlocking(tun_queues[i]);
+      queues_.back()->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (queues_.back()->wake_fd < 0)
+      {
+        throw std::runtime_error("eventfd failed: " + std::string(strerror(errno)));
+      }
+    }
+    uint32_t seed;
+    RandomBytes(&seed, sizeof(seed));
+    jitter_.seed(seed);
+    pipeline_.reset(new CryptoPipeline(crypto_workers, [this](Peer *peer, bool encrypt)
+                                       { OnCryptoComplete(peer, encrypt); }));
+    rate_limiter_gc_.set_callback([this]
+                                  { AgeRateLimiter(); });
+    transmit_timer_.set_callback([this]
+                                 { DispatchTransmit(); });
+  }
+
+  Device::~Device()
+  {
+    Stop();
+    // Joins the workers, which may still be flushing packets for our peers.
+    pipeline_.reset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    CloseAll({tun_fd_, udp4_fd_, udp6_fd_, wake_fd_});
+    for (const auto &queue : queues_)
+    {
+      CloseAll({queue->tun_fd, queue->udp4_fd, queue->udp6_fd, queue->wake_fd});
+    }
+    SecureZero(identity_.private_key, sizeof(identity_.private_key));
+  }
+
+  void Device::Configure(const DeviceConfig &config)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    bool identity_changed = !identity_.has_identity ||
+                            memcmp(identity_.private_key, config.private_key, kCurve25519KeySize) != 0;
+    if (identity_changed)
+    {
+      SetStaticIdentity(&identity_, config.private_key);
+      cookie_checker_.SetIdentity(identity_);
+    }
+    mtu_ = config.mtu != 0 ? config.mtu : kDefaultMtu;
+
+    std::map<PublicKey, const PeerConfig *> wanted;
+    for (const auto &peer_config : config.peers)
+    {
+      PublicKey key;
+      memcpy(key.data(), peer_config.public_key, kCurve25519KeySize);
+      wanted[key] = &peer_config;
+    }
+
+    // Drop peers that disappeared, and every session if our own key changed.
+    std::vector<Peer *> stale;
+    for (const auto &peer : peers_)
+    {
+      PublicKey key;
+      memcpy(key.data(), peer->public_key, kCurve25519KeySize);
+      if (identity_changed || wanted.find(key) == wanted.end())
+      {
+        stale.push_back(peer.get());
+      }
+    }
+    for (Peer *peer : stale)
+    {
+      RemovePeer(peer);
+    }
+
+    allowed_ips_.Clear();
+    for (const auto &entry : wanted)
+    {
+      const PeerConfig &peer_config = *entry.second;
+      Peer *peer;
+      bool existing = peers_by_key_.Find(entry.first, &peer);
+      if (!existing)
+      {
+        peers_.push_back(std::unique_ptr<Peer>(new Peer()));
+        peer = peers_.back().get();
+        memcpy(peer->public_key, peer_config.public_key, kCurve25519KeySize);
+        peer->queue = PublicKeyHash()(entry.first) % (queues_.size() + 1);
+        peers_by_key_.Insert(entry.first, peer);
+        InitTimers(peer);
+      }
+
+      if (!existing)
+      {
+        HandshakeInit(&peer->handshake, identity_, peer_config.public_key,
+                      peer_config.has_preshared_key ? peer_config.preshared_key : nullptr);
+        InitPeerCookie(&peer->cookie, peer_config.public_key);
+      }
+      else if (peer_config.has_preshared_key)
+      {
+        memcpy(peer->handshake.preshared_key, peer_config.preshared_key, kCurve25519KeySize);
+      }
+      else
+      {
+        memset(peer->handshake.preshared_key, 0, kCurve25519KeySize);
+      }
+
+      if (!peer_config.endpoint.empty() &&
+          !ResolveEndpoint(peer_config.endpoint, &peer->endpoint, &peer->endpoint_len))
+      {
+        throw std::runtime_error("could not resolve endpoint " + peer_config.endpoint);
+      }
+
+      peer->persistent_keepalive = peer_config.persistent_keepalive;
+      auto rate_limit = rate_limits_.find(entry.first);
+      uint64_t rate = rate_limit != rate_limits_.end() ? rate_limit->second : 0;
+      if (peer->tx_flow.rate != rate)
+      {
+        FairQueue::SetRate(&peer->tx_flow, rate, std::chrono::steady_clock::now());
+      }
+      peer->allowed_ips = peer_config.allowed_ips;
+      for (const auto &prefix : peer->allowed_ips)
+      {
+        allowed_ips_.Insert(prefix, peer);
+      }
+      if (peer->persistent_keepalive > 0 && !peer->timers.persistent_keepalive.armed())
+      {
+        timers_.Arm(&peer->timers.persistent_keepalive, std::chrono::steady_clock::now());
+      }
+    }
+  }
+
+  void Device::SetPeerRateLimit(const uint8_t public_key[kCurve25519KeySize], uint64_t bits_per_second)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    PublicKey key;
+    memcpy(key.data(), public_key, kCurve25519KeySize);
+    uint64_t rate = bits_per_second / 8;
+    if (rate != 0)
+    {
+      rate_limits_[key] = rate;
+    }
+    else
+    {
+      rate_limits_.erase(key);
+    }
+    Peer *peer;
+    if (peers_by_key_.Find(key, &peer) && peer->tx_flow.rate != rate)
+    {
+      FairQueue::SetRate(&peer->tx_flow, rate, std::chrono::steady_clock::now());
+      // A flow waiting on the old rate may be able to send now.
+      Wake();
+    }
+  }
+
+  uint16_t Device::Bind(uint16_t port)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    int fd4 = OpenUdpSocket(AF_INET, port, false);
+    if (fd4 < 0)
+    {
+      throw std::runtime_error("could not bind UDP port " + std::to_string(port) + ": " + strerror(errno));
+    }
+    struct sockaddr_in addr4;
+    socklen_t len = sizeof(addr4);
+    getsockname(fd4, reinterpret_cast<struct sockaddr *>(&addr4), &len);
+    uint16_t bound_port = ntohs(addr4.sin_port);
+    // IPv6 is optional: hosts without it still get a working IPv4 tunnel.
+    int fd6 = OpenUdpSocket(AF_INET6, bound_port, false);
+
+    // The other queues' sockets join a group on the same port, in which the
+    // kernel hashes each sender's address to one socket. The first sockets
+    // only open the group once bound, so picking a free port cannot land us
+    // in another group.
+    std::vector<int> fds4 = {fd4}, fds6 = {fd6};
+    if (!queues_.empty())
+    {
+      int one = 1;
+      for (int fd : {fd4, fd6})
+      {
+        if (fd >= 0)
+        {
+          setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        }
+      }
+    }
+    for (size_t i = 0; i < queues_.size(); i++)
+    {
+      fds4.push_back(OpenUdpSocket(AF_INET, bound_port, true));
+      fds6.push_back(fd6 >= 0 ? OpenUdpSocket(AF_INET6, bound_port, true) : -1);
+      if (fds4.back() < 0)
+      {
+        int error = errno;
+        CloseAll(fds4);
+        CloseAll(fds6);
+        throw std::runtime_error("could not add a socket to UDP port " + std::to_string(bound_port) + ": " +
+                                 strerror(error));
+      }
+    }
+
+    // Workers send on the current sockets; let them finish first.
+    pipeline_->WaitIdle();
+    CloseAll({udp4_fd_, udp6_fd_});
+    udp4_fd_ = fd4;
+    udp6_fd_ = fd6;
+    for (size_t i = 0; i < queues_.size(); i++)
+    {
+      IoQueue *queue = queues_[i].get();
+      std::lock_guard<std::mutex> queue_lock(queue->mutex);
+      CloseAll({queue->udp4_fd, queue->udp6_fd});
+      queue->udp4_fd = fds4[i + 1];
+      queue->udp6_fd = fds6[i + 1];
+    }
+    bind_generation_++;
+    bool gso4 = true, gso6 = fd6 >= 0;
+    for (size_t i = 0; i < fds4.size(); i++)
+    {
+      gso4 = EnableUdpOffloads(fds4[i]).gso && gso4;
+      gso6 = (fds6[i] < 0 || EnableUdpOffloads(fds6[i]).gso) && gso6;
+    }
+    gso4_ = gso4;
+    gso6_ = gso6;
+    Wake();
+    WakeQueues();
+    return bound_port;
+  }
+
+  void Device::SetQueueCpus(const std::vector<int> &cpus)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_cpus_ = cpus;
+  }
+
+  void Device::Run()
+  {
+    std::vector<int> cpus;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cpus = queue_cpus_;
+    }
+    cpus.resize(queues_.size() + 1, -1);
+    PinToCpu(cpus[0]);
+    for (size_t i = 0; i < queues_.size(); i++)
+    {
+      queues_[i]->thread = std::thread(&Device::RunQueue, this, queues_[i].get(), cpus[i + 1]);
+    }
+
+    try
+    {
+      std::unique_ptr<IoUring> ring;
+      if (requested_backend_ == IoBackend::kIoUring)
+      {
+        ring = IoUring::Create(kRingEntries, kRingReceiveBuffers);
+      }
+      io_backend_ = ring ? IoBackend::kIoUring : IoBackend::kPoll;
+      if (ring)
+      {
+        RunIoUring(ring.get());
+      }
+      else
+      {
+        RunPoll();
+      }
+    }
+    catch (...)
+    {
+      StopQueues();
+      throw;
+    }
+    StopQueues();
+  }
+
+  void Device::RunPoll()
+  {
+    while (running_)
+    {
+      struct pollfd fds[4];
+      int count = 0;
+      fds[count++] = {wake_fd_, POLLIN, 0};
+      fds[count++] = {tun_fd_, POLLIN, 0};
+      int udp4_slot = -1, udp6_slot = -1;
+      int timeout_ms;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (udp4_fd_ >= 0)
+        {
+          udp4_slot = count;
+          fds[count++] = {udp4_fd_, POLLIN, 0};
+        }
+        if (udp6_fd_ >= 0)
+        {
+          udp6_slot = count;
+          fds[count++] = {udp6_fd_, POLLIN, 0};
+        }
+        timeout_ms = static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(WaitTimeout()).count());
+      }
+
+      int ready = poll(fds, count, timeout_ms);
+      if (ready < 0 && errno != EINTR)
+      {
+        throw std::runtime_error("poll failed: " + std::string(strerror(errno)));
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (ready > 0)
+      {
+        if (fds[0].revents & POLLIN)
+        {
+          uint64_t value;
+          while (read(wake_fd_, &value, sizeof(value)) > 0)
+          {
+          }
+        }
+        if (fds[1].revents & POLLIN)
+        {
+          ReadTun();
+        }
+        if (udp4_slot >= 0 && (fds[udp4_slot].revents & POLLIN))
+        {
+          ReadUdp(udp4_fd_);
+        }
+        if (udp6_slot >= 0 && (fds[udp6_slot].revents & POLLIN))
+        {
+          ReadUdp(udp6_fd_);
+        }
+      }
+      ProcessHandshakes();
+      timers_.Advance(std::chrono::steady_clock::now());
+      FlushPipeline();
+    }
+  }
+
+  void Device::RunIoUring(IoUring *ring)
+  {
+    UringState state;
+    state.ring = ring;
+    state.thread = std::this_thread::get_id();
+    for (unsigned id = 0; id < kRingReceiveBuffers; id++)
+    {
+      state.buffers.push_back(PacketPool::Instance().Allocate(kRingReceiveBufferSize));
+      ring->ProvideBuffer(state.buffers.back(), kRingReceiveBufferSize, static_cast<uint16_t>(id));
+    }
+    memset(&state.receive_header, 0, sizeof(state.receive_header));
+    state.receive_header.msg_namelen = sizeof(struct sockaddr_storage);
+    state.receive_header.msg_controllen = kUdpReceiveControlSize;
+
+    auto reap = [this, &state](const struct io_uring_cqe &cqe)
+    {
+      HandleRingCompletion(&state, cqe);
+    };
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      uring_ = &state;
+    }
+    while (running_)
+    {
+      std::chrono::nanoseconds timeout;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ArmRing(&state);
+        timeout = WaitTimeout();
+      }
+      ring->SubmitAndWait(timeout);
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      state.udp_handled = 0;
+      ring->Reap(reap);
+      ProcessHandshakes();
+      timers_.Advance(std::chrono::steady_clock::now());
+      FlushPipeline();
+    }
+
+    // Requests still out may write into packet elements and receive
+    // buffers, so all of them must finish before those are freed.
+    std::lock_guard<std::mutex> lock(mutex_);
+    uring_ = nullptr;
+    struct io_uring_sqe *sqe = ring->NextSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = kRingCancel;
+    while (state.active > 0)
+    {
+      ring->SubmitAndWait(std::chrono::milliseconds(100));
+      ring->Reap(reap);
+    }
+    for (void *buffer : state.buffers)
+    {
+      PacketPool::Instance().Free(buffer);
+    }
+  }
+
+  std::chrono::nanoseconds Device::WaitTimeout()
+  {
+    TimePoint deadline = timers_.NextDeadline();
+    TimePoint now = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds timeout(0);
+    if (deadline > now && handshake_queue_.empty())
+    {
+      timeout = std::min<std::chrono::nanoseconds>(deadline - now, std::chrono::seconds(1));
+    }
+    loop_wakeup_ = now + timeout;
+    return timeout;
+  }
+
+  void Device::ArmRing(UringState *state)
+  {
+    IoUring *ring = state->ring;
+    if (!state->wake_armed)
+    {
+      struct io_uring_sqe *sqe = ring->NextSqe();
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = wake_fd_;
+      sqe->poll32_events = POLLIN;
+      sqe->len = IORING_POLL_ADD_MULTI;
+      sqe->user_data = kRingWake;
+      state->wake_armed = true;
+      state->active++;
+    }
+
+    // Receives on sockets replaced by Bind() are cancelled by their user
+    // data: the descriptor numbers may already be reused.
+    if (state->bound != bind_generation_)
+    {
+      for (uint64_t &tag : state->udp_tags)
+      {
+        if (tag != 0)
+        {
+          struct io_uring_sqe *sqe = ring->NextSqe();
+          sqe->opcode = IORING_OP_ASYNC_CANCEL;
+          sqe->addr = tag;
+          sqe->user_data = kRingCancel;
+          tag = 0;
+        }
+      }
+      state->bound = bind_generation_;
+    }
+    int fds[2] = {udp4_fd_, udp6_fd_};
+    for (size_t slot = 0; slot < 2; slot++)
+    {
+      if (fds[slot] >= 0 && state->udp_tags[slot] == 0)
+      {
+        ArmRingReceive(state, slot, fds[slot]);
+      }
+    }
+
+    ArmRingTunReads(state);
+  }
+
+  void Device::ArmRingReceive(UringState *state, size_t slot, int fd)
+  {
+    // One receive keeps delivering datagrams into provided buffers until it
+    // runs out of them.
+    uint64_t tag = (state->next_generation++ << 4) | (slot << 3) | kRingUdp;
+    struct io_uring_sqe *sqe = state->ring->NextSqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&state->receive_header);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IoUring::kBufferGroup;
+    sqe->user_data = tag;
+    state->udp_tags[slot] = tag;
+    state->active++;
+  }
+
+  void Device::ArmRingTunReads(UringState *state)
+  {
+    IoUring *ring = state->ring;
+    // Kernels that honour O_NONBLOCK here fail reads with EAGAIN instead of
+    // waiting for a packet.
+    if (state->tun_poll)
+    {
+      if (!state->tun_poll_armed)
+      {
+        struct io_uring_sqe *sqe = ring->NextSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = tun_fd_;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = kRingTunPoll;
+        state->tun_poll_armed = true;
+        state->active++;
+      }
+      return;
+    }
+    // Not linked: a linked read is only issued once the one before it has
+    // its packet, which cost a third of the throughput. Packets still come
+    // back in order, as every read runs in this thread and completes in the
+    // order it took its packet.
+    for (; state->tun_reads < kRingTunReads; state->tun_reads++)
+    {
+      // Without offloads the packet lands in the payload slot, as in
+      // ReadTun().
+      std::unique_ptr<PacketElement> element = PacketElement::Create(
+          vnet_hdr_ ? kMaxTunPacketSize : kMessageDataMinSize + mtu_ + kMessagePaddingMultiple);
+      uint8_t *data = vnet_hdr_ ? element->data() : element->payload();
+      size_t len = vnet_hdr_ ? element->capacity : element->capacity - kMessageDataMinSize;
+      struct io_uring_sqe *sqe = ring->NextSqe();
+      PrepareTunIo(ring, sqe, tun_fd_, false, element.release(), data, len);
+      state->active++;
+    }
+  }
+
+  void Device::HandleRingCompletion(UringState *state, const struct io_uring_cqe &cqe)
+  {
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    switch (cqe.user_data & kRingTagMask)
+    {
+    case kRingWake:
+    {
+      uint64_t value;
+      while (read(wake_fd_, &value, sizeof(value)) > 0)
+      {
+      }
+      if (!more)
+      {
+        state->wake_armed = false;
+        state->active--;
+      }
+      break;
+    }
+    case kRingUdp:
+      if (cqe.flags & IORING_CQE_F_BUFFER)
+      {
+        uint16_t id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        uint8_t *buffer = static_cast<uint8_t *>(state->buffers[id]);
+        if (cqe.res > 0)
+        {
+          HandleRingDatagrams(state, buffer, static_cast<size_t>(cqe.res));
+        }
+        state->ring->ProvideBuffer(buffer, kRingReceiveBufferSize, id);
+      }
+      if (!more)
+      {
+        // Out of buffers, or cancelled; re-armed on the next pass.
+        uint64_t &tag = state->udp_tags[(cqe.user_data >> 3) & 1];
+        if (tag == cqe.user_data)
+        {
+          tag = 0;
+        }
+        state->active--;
+      }
+      break;
+    case kRingTunPoll:
+      state->tun_poll = false;
+      state->tun_poll_armed = false;
+      state->active--;
+      break;
+    case kRingTunRead:
+    {
+      std::unique_ptr<PacketElement> element(reinterpret_cast<PacketElement *>(cqe.user_data & ~kRingTagMask));
+      state->tun_reads--;
+      state->active--;
+      if (cqe.res == -EAGAIN)
+      {
+        state->tun_poll = true;
+      }
+      else if (cqe.res > 0 && vnet_hdr_)
+      {
+        SplitTunPacket(element->data(), static_cast<size_t>(cqe.res));
+      }
+      else if (cqe.res > 0)
+      {
+        HandleTunPacket(std::move(element), static_cast<size_t>(cqe.res));
+      }
+      break;
+    }
+    case kRingTunWrite:
+      delete reinterpret_cast<PacketElement *>(cqe.user_data & ~kRingTagMask);
+      state->active--;
+      break;
+    default:
+      break;
+    }
+  }
+
+  void Device::HandleRingDatagrams(UringState *state, uint8_t *buffer, size_t len)
+  {
+    const struct msghdr &layout = state->receive_header;
+    struct io_uring_recvmsg_out out;
+    memcpy(&out, buffer, sizeof(out));
+    size_t payload_offset = sizeof(out) + layout.msg_namelen + layout.msg_controllen;
+    if (len < payload_offset || out.payloadlen > len - payload_offset ||
+        out.namelen > sizeof(struct sockaddr_storage) || (out.flags & (MSG_TRUNC | MSG_CTRUNC)))
+    {
+      return;
+    }
+    struct sockaddr_storage from;
+    memcpy(&from, buffer + sizeof(out), out.namelen);
+    struct msghdr control;
+    memset(&control, 0, sizeof(control));
+    control.msg_control = buffer + sizeof(out) + layout.msg_namelen;
+    control.msg_controllen = out.controllen;
+
+    uint8_t *data = buffer + payload_offset;
+    size_t segment = GroSegmentSize(control, out.payloadlen);
+    for (size_t offset = 0; offset < out.payloadlen; offset += segment)
+    {
+      HandleUdpPacket(data + offset, std::min<size_t>(segment, out.payloadlen - offset), from, out.namelen);
+      // As in ReadUdp(): keep the per-peer queues from overflowing.
+      if (++state->udp_handled % kUdpBatchSize == 0)
+      {
+        FlushPipeline();
+      }
+    }
+  }
+
+  void Device::SubmitTunWrites()
+  {
+    // Unlinked: a TUN write never waits, so each is issued during the submit
+    // in ring order. Links would hold the rest of a batch back until the
+    // next wakeup, and the next batch could overtake it.
+    IoUring *ring = uring_->ring;
+    auto &writes = uring_->tun_writes;
+    for (size_t i = 0; i < writes.size(); i++)
+    {
+      PacketElement *element = writes[i].first.release();
+      struct io_uring_sqe *sqe = ring->NextSqe();
+      PrepareTunIo(ring, sqe, TunQueue(element->peer->queue), true, element, element->payload(), writes[i].second);
+    }
+    uring_->active += writes.size();
+    writes.clear();
+  }
+
+  void Device::RunQueue(IoQueue *queue, int cpu)
+  {
+    PinToCpu(cpu);
+    // Timers and handshakes stay with the event loop; this only moves
+    // packets, so it can wait without a timeout.
+    while (running_)
+    {
+      struct pollfd fds[4];
+      int count = 0;
+      fds[count++] = {queue->wake_fd, POLLIN, 0};
+      fds[count++] = {queue->tun_fd, POLLIN, 0};
+      int udp4_slot = -1, udp6_slot = -1;
+      {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        if (queue->udp4_fd >= 0)
+        {
+          udp4_slot = count;
+          fds[count++] = {queue->udp4_fd, POLLIN, 0};
+        }
+        if (queue->udp6_fd >= 0)
+        {
+          udp6_slot = count;
+          fds[count++] = {queue->udp6_fd, POLLIN, 0};
+        }
+      }
+
+      if (poll(fds, count, -1) <= 0)
+      {
+        continue;
+      }
+      if (fds[0].revents & POLLIN)
+      {
+        uint64_t value;
+        while (read(queue->wake_fd, &value, sizeof(value)) > 0)
+        {
+        }
+      }
+      if (fds[1].revents & POLLIN)
+      {
+        ReadTunQueue(queue);
+      }
+      if (udp4_slot >= 0 && (fds[udp4_slot].revents & POLLIN))
+      {
+        ReadUdpQueue(queue, false);
+      }
+      if (udp6_slot >= 0 && (fds[udp6_slot].revents & POLLIN))
+      {
+        ReadUdpQueue(queue, true);
+      }
+    }
+  }
+
+  void Device::ReadTunQueue(IoQueue *queue)
+  {
+    // Reads and segmentation run without the device lock, so the queues
+    // take packets off the kernel in parallel; only handing them to the
+    // protocol code is serialized.
+    auto &packets = queue->tun_packets;
+    auto add = [&packets](std::unique_ptr<PacketElement> element, size_t len)
+    {
+      packets.emplace_back(std::move(element), len);
+    };
+    for (int i = 0; i < kMaxPacketsPerWakeup; i++)
+    {
+      if (!vnet_hdr_)
+      {
+        std::unique_ptr<PacketElement> element =
+            PacketElement::Create(kMessageDataMinSize + queue->mtu + kMessagePaddingMultiple);
+        ssize_t n = read(queue->tun_fd, element->payload(), element->capacity - kMessageDataMinSize);
+        if (n <= 0)
+        {
+          break;
+        }
+        add(std::move(element), static_cast<size_t>(n));
+        continue;
+      }
+
+      ssize_t n = read(queue->tun_fd, queue->tun_buffer.data(), queue->tun_buffer.size());
+      if (n <= 0)
+      {
+        break;
+      }
+      ForEachTunSegment(&queue->tun_segmenter, queue->tun_buffer.data(), static_cast<size_t>(n), add);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &packet : packets)
+    {
+      HandleTunPacket(std::move(packet.first), packet.second);
+    }
+    packets.clear();
+    queue->mtu = mtu_;
+    FlushPipeline();
+    WakeEventLoopIfNeeded();
+  }
+
+  void Device::ReadUdpQueue(IoQueue *queue, bool ipv6)
+  {
+    for (int i = 0; i < kMaxPacketsPerWakeup;)
+    {
+      std::unique_lock<std::mutex> queue_lock(queue->mutex);
+      int fd = ipv6 ? queue->udp6_fd : queue->udp4_fd;
+      if (fd < 0)
+      {
+        break;
+      }
+      const std::vector<ReceivedDatagram> &datagrams = queue->udp_receiver.Receive(fd);
+      queue_lock.unlock();
+      if (datagrams.empty())
+      {
+        break;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      size_t handled = 0;
+      for (const ReceivedDatagram &datagram : datagrams)
+      {
+        HandleUdpPacket(datagram.data, datagram.len, *datagram.from, datagram.from_len);
+        if (++handled % kUdpBatchSize == 0)
+        {
+          FlushPipeline();
+        }
+      }
+      FlushPipeline();
+      WakeEventLoopIfNeeded();
+      i += static_cast<int>(datagrams.size());
+    }
+  }
+
+  void Device::StopQueues()
+  {
+    running_ = false;
+    WakeQueues();
+    for (const auto &queue : queues_)
+    {
+      if (queue->thread.joinable())
+      {
+        queue->thread.join();
+      }
+    }
+  }
+
+  void Device::WakeEventLoopIfNeeded()
+  {
+    if (!handshake_queue_.empty() || timers_.NextDeadline() < loop_wakeup_)
+    {
+      Wake();
+    }
+  }
+
+  int Device::UdpSocket(size_t queue, bool ipv6) const
+  {
+    if (queue > 0)
+    {
+      int fd = ipv6 ? queues_[queue - 1]->udp6_fd : queues_[queue - 1]->udp4_fd;
+      if (fd >= 0)
+      {
+        return fd;
+      }
+    }
+    return ipv6 ? udp6_fd_ : udp4_fd_;
+  }
+
+  int Device::TunQueue(size_t queue) const
+  {
+    return queue == 0 ? tun_fd_ : queues_[queue - 1]->tun_fd;
+  }
+
+  void Device::Stop()
+  {
+    running_ = false;
+    Wake();
+    WakeQueues();
+  }
+
+  void Device::Wake()
+  {
+    uint64_t one = 1;
+    ssize_t written = write(wake_fd_, &one, sizeof(one));
+    (void)written;
+  }
+
+  void Device::WakeQueues()
+  {
+    for (const auto &queue : queues_)
+    {
+      uint64_t one = 1;
+      ssize_t written = write(queue->wake_fd, &one, sizeof(one));
+      (void)written;
+    }
+  }
+
+  std::vector<PeerStats> Device::GetPeerStats()
+  {
+    std::vector<PeerStats> stats;
+    GetPeerStats(&stats);
+    return stats;
+  }
+
+  void Device::GetPeerStats(std::vector<PeerStats> *stats)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats->resize(peers_.size());
+    for (size_t i = 0; i < peers_.size(); i++)
+    {
+      const Peer &peer = *peers_[i];
+      PeerStats &entry = (*stats)[i];
+      memcpy(entry.public_key, peer.public_key, kCurve25519KeySize);
+      entry.tx_bytes = peer.tx_bytes.load();
+      entry.rx_bytes = peer.rx_bytes.load();
+      entry.last_handshake_ns = peer.last_handshake_ns.load();
+      entry.tx_dropped = peer.tx_flow.dropped.load();
+      entry.handshakes = peer.handshakes.load();
+      entry.handshake_timeouts = peer.handshake_timeouts.load();
+      entry.connect_latency_ns = peer.connect_latency_ns.load();
+      // Only changed by the event loop, under |mutex_|.
+      entry.session_up = peer.session_up;
+      entry.sessions_up = peer.sessions_up.load();
+      entry.sessions_down = peer.sessions_down.load();
+    }
+  }
+
+  ConnectLatencyStats Device::GetConnectLatency()
+  {
+    ConnectLatencyStats stats;
+    stats.count = 0;
+    for (size_t i = 0; i < kConnectLatencyBuckets; i++)
+    {
+      stats.buckets[i] = connect_latency_buckets_[i].load(std::memory_order_relaxed);
+      stats.count += stats.buckets[i];
+    }
+    stats.sum_ns = connect_latency_sum_ns_.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  void Device::ReadTun()
+  {
+    uint8_t *packet = tun_buffer_.data();
+    for (int i = 0; i < kMaxPacketsPerWakeup; i++)
+    {
+      if (!vnet_hdr_)
+      {
+        // Read straight into the payload slot of a packet element; the
+        // header goes in front and the tag behind without another copy.
+        std::unique_ptr<PacketElement> element =
+            PacketElement::Create(kMessageDataMinSize + mtu_ + kMessagePaddingMultiple);
+        ssize_t n = read(tun_fd_, element->payload(), element->capacity - kMessageDataMinSize);
+        if (n <= 0)
+        {
+          break;
+        }
+        HandleTunPacket(std::move(element), static_cast<size_t>(n));
+        continue;
+      }
+
+      ssize_t n = read(tun_fd_, packet, tun_buffer_.size());
+      if (n <= 0)
+      {
+        break;
+      }
+      SplitTunPacket(packet, static_cast<size_t>(n));
+    }
+  }
+
+  void Device::SplitTunPacket(uint8_t *packet, size_t len)
+  {
+    ForEachTunSegment(&tun_segmenter_, packet, len, [this](std::unique_ptr<PacketElement> element, size_t segment_len)
+                      { HandleTunPacket(std::move(element), segment_len); });
+  }
+
+  void Device::ReadUdp(int fd)
+  {
+    for (int i = 0; i < kMaxPacketsPerWakeup;)
+    {
+      const std::vector<ReceivedDatagram> &datagrams = udp_receiver_.Receive(fd);
+      if (datagrams.empty())
+      {
+        break;
+      }
+      // GRO can turn one batch into thousands of datagrams; hand them on in
+      // batches so the per-peer queues do not overflow.
+      size_t handled = 0;
+      for (const ReceivedDatagram &datagram : datagrams)
+      {
+        HandleUdpPacket(datagram.data, datagram.len, *datagram.from, datagram.from_len);
+        if (++handled % kUdpBatchSize == 0)
+        {
+          FlushPipeline();
+        }
+      }
+      i += static_cast<int>(datagrams.size());
+    }
+  }
+
+  void Device::HandleTunPacket(std::unique_ptr<PacketElement> element, size_t len)
+  {
+    Peer *peer = allowed_ips_.LookupPacket(element->payload(), len, false);
+    if (peer == nullptr)
+    {
+      return;
+    }
+    // Sent from DispatchTransmit() once the peer's turn comes.
+    element->peer = peer;
+    transmit_queue_.Enqueue(&peer->tx_flow, std::move(element), len);
+  }
+
+  void Device::HandleUdpPacket(uint8_t *data, size_t len, const struct sockaddr_storage &from, socklen_t from_len)
+  {
+    if (len < 4)
+    {
+      return;
+    }
+    uint32_t type = LoadLe32(data);
+    if ((type == kMessageInitiation && len == sizeof(MessageInitiation)) ||
+        (type == kMessageResponse && len == sizeof(MessageResponse)))
+    {
+      QueueHandshake(data, len, from, from_len);
+    }
+    else if (type == kMessageCookieReply && len == sizeof(MessageCookieReply))
+    {
+      HandleCookieReply(data);
+    }
+    else if (type == kMessageData && len >= kMessageDataMinSize)
+    {
+      HandleData(data, len, from, from_len);
+    }
+    else if (type == kMessagePathProbe && echo_path_probes_ && len >= kMinPathProbeSize &&
+             LoadLe32(data + offsetof(MessagePathProbe, len)) == len)
+    {
+      MessagePathProbe reply;
+      memcpy(&reply, data, sizeof(reply));
+      reply.type = htole32(kMessagePathProbeReply);
+      SendTo(from, from_len, reinterpret_cast<const uint8_t *>(&reply), sizeof(reply));
+    }
+  }
+
+  void Device::QueueHandshake(const uint8_t *data, size_t len, const struct sockaddr_storage &from,
+                              socklen_t from_len)
+  {
+    if (handshake_queue_.size() >= kMaxQueuedHandshakes)
+    {
+      return;
+    }
+    handshake_queue_.emplace_back();
+    QueuedHandshake &queued = handshake_queue_.back();
+    memcpy(queued.data, data, len);
+    queued.len = len;
+    queued.from = from;
+    queued.from_len = from_len;
+  }
+
+  void Device::ProcessHandshakes()
+  {
+    int handled = 0;
+    int taken = 0;
+    while (handled < kHandshakesPerWakeup && taken < kMaxPacketsPerWakeup && !handshake_queue_.empty())
+    {
+      // Popping the front does not move the messages behind it.
+      Mac1Check checks[kMac1BatchSize];
+      size_t count = std::min(handshake_queue_.size(), kMac1BatchSize);
+      for (size_t i = 0; i < count; i++)
+      {
+        checks[i] = Mac1Check{handshake_queue_[i].data, handshake_queue_[i].len, false};
+      }
+      cookie_checker_.CheckMac1(checks, count);
+
+      for (size_t i = 0; i < count && handled < kHandshakesPerWakeup && taken < kMaxPacketsPerWakeup; i++)
+      {
+        // Whether we are under load is decided before the message leaves
+        // the queue, so a full queue counts.
+        TimePoint now = std::chrono::steady_clock::now();
+        bool under_load = UnderLoad(now);
+        QueuedHandshake queued = handshake_queue_.front();
+        handshake_queue_.pop_front();
+        taken++;
+        if (!checks[i].valid || !AdmitHandshake(queued.data, queued.len, queued.from, queued.from_len, under_load, now))
+        {
+          continue;
+        }
+        handled++;
+        if (queued.len == sizeof(MessageInitiation))
+        {
+          HandleInitiation(queued.data, queued.from, queued.from_len);
+        }
+        else
+        {
+          HandleResponse(queued.data, queued.from, queued.from_len);
+        }
+      }
+    }
+  }
+
+  bool Device::UnderLoad(TimePoint now)
+  {
+    if (handshake_queue_.size() >= kUnderLoadQueueDepth)
+    {
+      last_under_load_ = now;
+      return true;
+    }
+    return last_under_load_ != TimePoint::min() && now - last_under_load_ < kUnderLoadAfterTime;
+  }
+
+  bool Device::AdmitHandshake(const uint8_t *data, size_t len, const struct sockaddr_storage &from,
+                              socklen_t from_len, bool under_load, TimePoint now)
+  {
+    if (!under_load)
+    {
+      return true;
+    }
+    if (!cookie_checker_.CheckMac2(data, len, from, from_len, now))
+    {
+      // Make the sender prove it owns its address before we spend any
+      // Curve25519 work on it. Both messages carry their sender index at
+      // the same offset.
+      MessageCookieReply reply;
+      cookie_checker_.CreateReply(&reply, data, len, LoadLe32(data + 4), from, from_len, now);
+      SendTo(from, from_len, reinterpret_cast<const uint8_t *>(&reply), sizeof(reply));
+      // Once the flood is only turned away the queue drains fast; it is the
+      // flood itself that keeps us under load.
+      last_under_load_ = now;
+      return false;
+    }
+    if (!rate_limiter_gc_.armed())
+    {
+      timers_.Arm(&rate_limiter_gc_, now + std::chrono::seconds(1));
+    }
+    if (!rate_limiter_.Allow(from, from_len, now))
+    {
+      last_under_load_ = now;
+      return false;
+    }
+    return true;
+  }
+
+  void Device::HandleCookieReply(const uint8_t *data)
+  {
+    MessageCookieReply reply;
+    memcpy(&reply, data, sizeof(reply));
+    IndexEntry entry;
+    if (!indices_.Find(le32toh(reply.receiver_index), &entry))
+    {
+      return;
+    }
+    // The cookie is used from the next retransmission on.
+    ConsumeCookieReply(reply, &entry.peer->cookie, std::chrono::steady_clock::now());
+  }
+
+  void Device::AgeRateLimiter()
+  {
+    TimePoint now = std::chrono::steady_clock::now();
+    rate_limiter_.Age(now);
+    if (rate_limiter_.size() > 0)
+    {
+      timers_.Arm(&rate_limiter_gc_, now + std::chrono::seconds(1));
+    }
+  }
+
+  void Device::HandleInitiation(const uint8_t *data, const struct sockaddr_storage &from, socklen_t from_len)
+  {
+    MessageInitiation msg;
+    memcpy(&msg, data, sizeof(msg));
+    Peer *peer = nullptr;
+    auto lookup = [this, &peer](const uint8_t *remote_static) -> Handshake *
+    {
+      PublicKey key;
+      memcpy(key.data(), remote_static, kCurve25519KeySize);
+      if (!peers_by_key_.Find(key, &peer))
+      {
+        return nullptr;
+      }
+      return &peer->handshake;
+    };
+    Handshake *handshake = ConsumeInitiation(msg, identity_, lookup);
+    if (handshake == nullptr)
+    {
+      return;
+    }
+
+    SetEndpoint(peer, from, from_len);
+
+    MessageResponse response;
+    uint32_t index = NewIndex(peer, nullptr);
+    if (!CreateResponse(&response, handshake, index))
+    {
+      indices_.Erase(index);
+      return;
+    }
+    AddCookieMacs(reinterpret_cast<uint8_t *>(&response), sizeof(response), handshake->remote_mac1_key,
+                  &peer->cookie, std::chrono::steady_clock::now());
+
+    std::unique_ptr<Keypair> keypair(new Keypair());
+    if (!BeginSession(handshake, keypair.get()))
+    {
+      indices_.Erase(index);
+      return;
+    }
+    InstallKeypair(peer, std::move(keypair));
+    SendToPeer(peer, reinterpret_cast<uint8_t *>(&response), sizeof(response));
+    OnAuthenticatedPacketReceived(peer);
+    OnAuthenticatedPacketSent(peer);
+    OnHandshakeComplete(peer);
+  }
+
+  void Device::HandleResponse(const uint8_t *data, const struct sockaddr_storage &from, socklen_t from_len)
+  {
+    MessageResponse msg;
+    memcpy(&msg, data, sizeof(msg));
+    IndexEntry entry;
+    if (!indices_.Find(le32toh(msg.receiver_index), &entry) || entry.keypair != nullptr)
+    {
+      return;
+    }
+    Peer *peer = entry.peer;
+    if (!ConsumeResponse(msg, &peer->handshake, identity_))
+    {
+      return;
+    }
+
+    std::unique_ptr<Keypair> keypair(new Keypair());
+    if (!BeginSession(&peer->handshake, keypair.get()))
+    {
+      return;
+    }
+    SetEndpoint(peer, from, from_len);
+    InstallKeypair(peer, std::move(keypair));
+    OnAuthenticatedPacketReceived(peer);
+    OnHandshakeComplete(peer);
+
+    // The initiator confirms the session to the responder by sending first.
+    if (!peer->staged_packets.empty())
+    {
+      SendStagedPackets(peer);
+    }
+    else
+    {
+      SendKeepalive(peer);
+    }
+  }
+
+  void Device::HandleData(const uint8_t *data, size_t len, const struct sockaddr_storage &from, socklen_t from_len)
+  {
+    MessageDataHeader header;
+    memcpy(&header, data, sizeof(header));
+    IndexEntry entry;
+    if (!indices_.Find(le32toh(header.receiver_index), &entry) || entry.keypair == nullptr)
+    {
+      return;
+    }
+    Peer *peer = entry.peer;
+    Keypair *keypair = entry.keypair;
+    if (std::chrono::steady_clock::now() - keypair->birth >= kRejectAfterTime)
+    {
+      return;
+    }
+
+    std::unique_ptr<PacketElement> element = PacketElement::Create(len);
+    element->peer = peer;
+    memcpy(element->data(), data, len);
+    element->len = len;
+    element->payload_len = len - sizeof(MessageDataHeader);
+    element->counter = le64toh(header.counter);
+    memcpy(element->key, keypair->receive_key, kChaCha20KeySize);
+    memcpy(&element->address, &from, from_len);
+    element->address_len = from_len;
+    QueuePacket(&peer->rx_queue, std::move(element));
+  }
+
+  void Device::FinishData(std::unique_ptr<PacketElement> element)
+  {
+    // The keypair may have been retired while the packet was being decrypted;
+    // look it up again by index.
+    MessageDataHeader header;
+    memcpy(&header, element->data(), sizeof(header));
+    IndexEntry entry;
+    if (!indices_.Find(le32toh(header.receiver_index), &entry) || entry.keypair == nullptr ||
+        entry.peer != element->peer)
+    {
+      return;
+    }
+    Peer *peer = entry.peer;
+    Keypair *keypair = entry.keypair;
+    if (!keypair->replay.Accept(element->counter))
+    {
+      return;
+    }
+    TimePoint now = std::chrono::steady_clock::now();
+    uint8_t *payload = element->payload();
+    size_t plain_len = element->payload_len - kPoly1305TagSize;
+
+    // First packet on the responder's new keypair confirms the session.
+    if (keypair == peer->next_keypair.get())
+    {
+      ReleaseKeypair(peer->previous_keypair);
+      peer->previous_keypair = std::move(peer->current_keypair);
+      peer->current_keypair = std::move(peer->next_keypair);
+      timers_.Cancel(&peer->timers.retransmit_handshake);
+      SendStagedPackets(peer);
+    }
+
+    SetEndpoint(peer, element->address, element->address_len);
+    peer->rx_bytes += element->len;
+    OnAuthenticatedPacketReceived(peer);
+
+    if (keypair->initiator && now - keypair->birth >= kRejectAfterTime - kKeepaliveTimeout - kRekeyTimeout)
+    {
+      SendInitiation(peer, false);
+    }
+
+    if (plain_len == 0)
+    {
+      return;
+    }
+    if (!peer->timers.send_keepalive.armed())
+    {
+      timers_.Arm(&peer->timers.send_keepalive, now + kKeepaliveTimeout);
+    }
+
+    size_t inner_len = InnerPacketLength(payload, plain_len);
+    if (inner_len == 0 || allowed_ips_.LookupPacket(payload, inner_len, true) != peer)
+    {
+      return;
+    }
+    WriteTun(std::move(element), inner_len);
+  }
+
+  void Device::WriteTun(std::unique_ptr<PacketElement> element, size_t len)
+  {
+    const uint8_t *packet = element->payload();
+    if (!vnet_hdr_ && uring_ != nullptr && uring_->thread == std::this_thread::get_id())
+    {
+      uring_->tun_writes.emplace_back(std::move(element), len);
+      return;
+    }
+    if (!vnet_hdr_)
+    {
+      // The kernel sends replies of this flow back on the same queue.
+      ssize_t written = write(TunQueue(element->peer->queue), packet, len);
+      (void)written;
+      return;
+    }
+    // Written out at the end of the drain pass, merged where possible.
+    size_t queue = element->peer->queue;
+    TunCoalescer &coalescer = *tun_coalescers_[queue];
+    if (!coalescer.Add(packet, len))
+    {
+      coalescer.Flush(TunQueue(queue));
+      coalescer.Add(packet, len);
+    }
+  }
+
+  void Device::SendData(Peer *peer, const uint8_t *packet, size_t len)
+  {
+    std::unique_ptr<PacketElement> element = PacketElement::Create(kMessageDataMinSize + len + kMessagePaddingMultiple);
+    if (len > 0)
+    {
+      memcpy(element->payload(), packet, len);
+    }
+    SendData(peer, std::move(element), len);
+  }
+
+  void Device::SendData(Peer *peer, std::unique_ptr<PacketElement> element, size_t len)
+  {
+    uint8_t *packet = element->payload();
+    TimePoint now = std::chrono::steady_clock::now();
+    Keypair *keypair = peer->current_keypair.get();
+    if (keypair == nullptr || KeypairExpired(keypair, now))
+    {
+      if (len == 0)
+      {
+        SendInitiation(peer, false);
+        return;
+      }
+      if (peer->staged_packets.size() >= kMaxStagedPackets)
+      {
+        peer->staged_packets.pop_front();
+      }
+      peer->staged_packets.emplace_back(packet, packet + len);
+      SendInitiation(peer, false);
+      return;
+    }
+
+    // Plaintext is padded to a multiple of 16 bytes, but never beyond the MTU.
+    size_t padded = len;
+    if (len <= mtu_)
+    {
+      padded = std::min<size_t>((len + kMessagePaddingMultiple - 1) & ~(kMessagePaddingMultiple - 1), mtu_);
+    }
+    if (padded + kMessageDataMinSize > element->capacity)
+    {
+      return;
+    }
+
+    uint64_t counter = keypair->send_counter++;
+    element->peer = peer;
+    element->encrypt = true;
+    element->len = kMessageDataMinSize + padded;
+    MessageDataHeader header;
+    header.type = htole32(kMessageData);
+    header.receiver_index = htole32(keypair->remote_index);
+    header.counter = htole64(counter);
+    memcpy(element->data(), &header, sizeof(header));
+    memset(packet + len, 0, padded - len);
+    element->payload_len = padded;
+    element->counter = counter;
+    memcpy(element->key, keypair->send_key, kChaCha20KeySize);
+    memcpy(&element->address, &peer->endpoint, sizeof(peer->endpoint));
+    element->address_len = peer->endpoint_len;
+    QueuePacket(&peer->tx_queue, std::move(element));
+
+    OnAuthenticatedPacketSent(peer);
+    if (len > 0)
+    {
+      timers_.Cancel(&peer->timers.send_keepalive);
+      if (!peer->timers.new_handshake.armed())
+      {
+        timers_.Arm(&peer->timers.new_handshake, now + kKeepaliveTimeout + kRekeyTimeout);
+      }
+    }
+
+    if (keypair->initiator &&
+        (counter >= kRekeyAfterMessages || now - keypair->birth >= kRekeyAfterTime))
+    {
+      SendInitiation(peer, false);
+    }
+  }
+
+  void Device::SendKeepalive(Peer *peer)
+  {
+    if (peer->staged_packets.empty())
+    {
+      SendData(peer, nullptr, 0);
+    }
+    else
+    {
+      SendStagedPackets(peer);
+    }
+  }
+
+  void Device::SendInitiation(Peer *peer, bool is_retry)
+  {
+    TimePoint now = std::chrono::steady_clock::now();
+    if (!is_retry)
+    {
+      if (peer->last_sent_handshake != TimePoint::min() && now - peer->last_sent_handshake < kRekeyTimeout)
+      {
+        return;
+      }
+      peer->timers.handshake_attempts = 0;
+    }
+    if (peer->endpoint_len == 0)
+    {
+      return;
+    }
+
+    IndexEntry old;
+    if (indices_.Find(peer->handshake.local_index, &old) && old.peer == peer && old.keypair == nullptr)
+    {
+      indices_.Erase(peer->handshake.local_index);
+    }
+
+    MessageInitiation msg;
+    uint32_t index = NewIndex(peer, nullptr);
+    if (!CreateInitiation(&msg, &peer->handshake, identity_, index))
+    {
+      indices_.Erase(index);
+      return;
+    }
+    AddCookieMacs(reinterpret_cast<uint8_t *>(&msg), sizeof(msg), peer->handshake.remote_mac1_key, &peer->cookie, now);
+    peer->last_sent_handshake = now;
+    if (!peer->session_up && peer->connect_started == TimePoint::min())
+    {
+      peer->connect_started = now;
+    }
+    SendToPeer(peer, reinterpret_cast<uint8_t *>(&msg), sizeof(msg));
+    OnAuthenticatedPacketSent(peer);
+
+    std::uniform_int_distribution<int> jitter(0, 333);
+    timers_.Arm(&peer->timers.retransmit_handshake, now + kRekeyTimeout + std::chrono::milliseconds(jitter(jitter_)));
+  }
+
+  void Device::SendStagedPackets(Peer *peer)
+  {
+    std::deque<std::vector<uint8_t>> staged;
+    staged.swap(peer->staged_packets);
+    for (const auto &packet : staged)
+    {
+      SendData(peer, packet.data(), packet.size());
+    }
+  }
+
+  bool Device::SendToPeer(Peer *peer, const uint8_t *data, size_t len)
+  {
+    if (peer->endpoint_len == 0)
+    {
+      return false;
+    }
+    return SendTo(peer->endpoint, peer->endpoint_len, data, len);
+  }
+
+  bool Device::SendTo(const struct sockaddr_storage &to, socklen_t to_len, const uint8_t *data, size_t len)
+  {
+    int fd = to.ss_family == AF_INET6 ? udp6_fd_ : udp4_fd_;
+    if (fd < 0)
+    {
+      return false;
+    }
+    return sendto(fd, data, len, 0, reinterpret_cast<const struct sockaddr *>(&to), to_len) ==
+           static_cast<ssize_t>(len);
+  }
+
+  void Device::DispatchTransmit()
+  {
+    TimePoint now = std::chrono::steady_clock::now();
+    TimePoint retry = TimePoint::max();
+    while (transmit_queue_.bytes() > 0)
+    {
+      if (tx_in_flight_.load() >= kMaxTransmitInFlight)
+      {
+        // If the workers got down to the wake level before they could see
+        // the flag, nobody will wake us; carry on instead.
+        transmit_blocked_.store(true);
+        if (tx_in_flight_.load() > kTransmitWakeLevel)
+        {
+          break;
+        }
+        transmit_blocked_.store(false);
+      }
+      size_t len;
+      std::unique_ptr<PacketElement> element = transmit_queue_.Dequeue(now, &len, &retry);
+      if (!element)
+      {
+        break;
+      }
+      Peer *peer = element->peer;
+      SendData(peer, std::move(element), len);
+    }
+    if (retry != TimePoint::max())
+    {
+      timers_.Arm(&transmit_timer_, retry);
+    }
+  }
+
+  void Device::QueuePacket(PeerPacketQueue *queue, std::unique_ptr<PacketElement> element)
+  {
+    // Outbound packets wait for room, which pushes back on the TUN reader
+    // instead of dropping what the workers cannot keep up with. Inbound ones
+    // are dropped when the queue is full, as UDP would.
+    while (!queue->Enqueue(element.get()))
+    {
+      if (!element->encrypt)
+      {
+        return;
+      }
+      pipeline_->Flush();
+      std::this_thread::yield();
+    }
+    PacketElement *queued = element.release();
+    Peer *peer = queued->peer;
+    bool encrypt = queued->encrypt;
+    if (encrypt)
+    {
+      tx_in_flight_++;
+    }
+    if (!pipeline_->Submit(queued))
+    {
+      // It already holds a place in the peer's queue, so let draining discard it.
+      queued->state.store(PacketElement::kDropped);
+      OnCryptoComplete(peer, encrypt);
+    }
+  }
+
+  void Device::OnCryptoComplete(Peer *peer, bool encrypt)
+  {
+    if (encrypt)
+    {
+      FlushTransmitted(peer);
+    }
+    else if (!receive_ready_.exchange(true))
+    {
+      Wake();
+    }
+  }
+
+  void Device::FlushTransmitted(Peer *peer)
+  {
+    // Runs on the workers without |mutex_|: everything needed to send was
+    // copied into the element when it was queued.
+    PacketElement *batch[kUdpBatchSize];
+    size_t count = 0;
+    size_t finished = 0;
+    auto collect = [this, peer, &batch, &count, &finished](PacketElement *element)
+    {
+      finished++;
+      if (element->state.load() != PacketElement::kDone || element->address_len == 0)
+      {
+        delete element;
+        return;
+      }
+      batch[count++] = element;
+      if (count == kUdpBatchSize)
+      {
+        SendTransmitted(peer, batch, count);
+        count = 0;
+      }
+    };
+    auto send = [this, peer, &batch, &count]()
+    {
+      SendTransmitted(peer, batch, count);
+      count = 0;
+    };
+    peer->tx_queue.Drain(collect, send);
+    if (finished > 0 && tx_in_flight_.fetch_sub(finished) - finished <= kTransmitWakeLevel &&
+        transmit_blocked_.exchange(false))
+    {
+      Wake();
+    }
+  }
+
+  void Device::SendTransmitted(Peer *peer, PacketElement **elements, size_t count)
+  {
+    OutgoingDatagram datagrams[kUdpBatchSize];
+    for (size_t i = 0; i < count; i++)
+    {
+      datagrams[i] = OutgoingDatagram{elements[i]->data(), elements[i]->len, &elements[i]->address,
+                                      elements[i]->address_len};
+    }
+
+    // The endpoint can change family between packets; send each run on its
+    // own socket.
+    size_t end = 0;
+    for (size_t start = 0; start < count; start = end)
+    {
+      bool ipv6 = elements[start]->address.ss_family == AF_INET6;
+      end = start + 1;
+      while (end < count && (elements[end]->address.ss_family == AF_INET6) == ipv6)
+      {
+        end++;
+      }
+      int fd = UdpSocket(peer->queue, ipv6);
+      if (fd < 0)
+      {
+        continue;
+      }
+      size_t sent = SendDatagrams(fd, datagrams + start, end - start, ipv6 ? &gso6_ : &gso4_);
+      uint64_t bytes = 0;
+      for (size_t i = start; i < start + sent; i++)
+      {
+        bytes += datagrams[i].len;
+      }
+      peer->tx_bytes += bytes;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+      delete elements[i];
+    }
+  }
+
+  void Device::FlushPipeline()
+  {
+    DispatchTransmit();
+    pipeline_->Flush();
+    if (receive_ready_.exchange(false))
+    {
+      DrainReceived();
+      // Finishing a packet can release staged ones.
+      pipeline_->Flush();
+    }
+  }
+
+  void Device::DrainReceived()
+  {
+    auto finish = [this](PacketElement *element)
+    {
+      std::unique_ptr<PacketElement> owned(element);
+      if (owned->state.load() == PacketElement::kDone)
+      {
+        FinishData(std::move(owned));
+      }
+    };
+    for (const auto &peer : peers_)
+    {
+      peer->rx_queue.Drain(finish);
+    }
+    for (size_t queue = 0; queue < tun_coalescers_.size(); queue++)
+    {
+      if (!tun_coalescers_[queue]->empty())
+      {
+        tun_coalescers_[queue]->Flush(TunQueue(queue));
+      }
+    }
+    if (uring_ != nullptr && !uring_->tun_writes.empty())
+    {
+      SubmitTunWrites();
+    }
+  }
+
+  void Device::InitTimers(Peer *peer)
+  {
+    PeerTimers &timers = peer->timers;
+    timers.retransmit_handshake.set_callback([this, peer]
+                                             { RetransmitHandshake(peer); });
+    timers.send_keepalive.set_callback([this, peer]
+                                       { SendKeepalive(peer); });
+    timers.new_handshake.set_callback([this, peer]
+                                      { SendInitiation(peer, false); });
+    timers.zero_key_material.set_callback([this, peer]
+                                          { ZeroKeyMaterial(peer); });
+    timers.persistent_keepalive.set_callback([this, peer]
+                                             { SendKeepalive(peer); });
+  }
+
+  void Device::RetransmitHandshake(Peer *peer)
+  {
+    PeerTimers &timers = peer->timers;
+    if (timers.handshake_attempts >= kMaxTimerHandshakes)
+    {
+      peer->staged_packets.clear();
+      peer->connect_started = TimePoint::min();
+      peer->handshake_timeouts++;
+      if (!timers.zero_key_material.armed())
+      {
+        timers_.Arm(&timers.zero_key_material, std::chrono::steady_clock::now() + 3 * kRejectAfterTime);
+      }
+    }
+    else
+    {
+      timers.handshake_attempts++;
+      SendInitiation(peer, true);
+    }
+  }
+
+  void Device::OnAuthenticatedPacketSent(Peer *peer)
+  {
+    if (peer->persistent_keepalive > 0)
+    {
+      timers_.Arm(&peer->timers.persistent_keepalive,
+                  std::chrono::steady_clock::now() + std::chrono::seconds(peer->persistent_keepalive));
+    }
+  }
+
+  void Device::OnAuthenticatedPacketReceived(Peer *peer)
+  {
+    timers_.Cancel(&peer->timers.new_handshake);
+  }
+
+  void Device::OnHandshakeComplete(Peer *peer)
+  {
+    timers_.Cancel(&peer->timers.retransmit_handshake);
+    peer->timers.handshake_attempts = 0;
+    TimePoint now = std::chrono::steady_clock::now();
+    timers_.Arm(&peer->timers.zero_key_material, now + 3 * kRejectAfterTime);
+    peer->last_handshake_ns = WallClockNanos();
+    peer->handshakes++;
+    if (peer->connect_started != TimePoint::min())
+    {
+      RecordConnectLatency(peer, now - peer->connect_started);
+      peer->connect_started = TimePoint::min();
+    }
+    if (!peer->session_up)
+    {
+      peer->session_up = true;
+      peer->sessions_up++;
+    }
+  }
+
+  void Device::RecordConnectLatency(Peer *peer, std::chrono::nanoseconds latency)
+  {
+    peer->connect_latency_ns = latency.count();
+    size_t bucket = 0;
+    while (bucket < kConnectLatencyBuckets - 1 && latency > std::chrono::milliseconds(kConnectLatencyBoundsMs[bucket]))
+    {
+      bucket++;
+    }
+    connect_latency_buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    connect_latency_sum_ns_.fetch_add(static_cast<uint64_t>(latency.count()), std::memory_order_relaxed);
+  }
+
+  uint32_t Device::NewIndex(Peer *peer, Keypair *keypair)
+  {
+    uint32_t index;
+    do
+    {
+      RandomBytes(&index, sizeof(index));
+    } while (index == 0 || indices_.Contains(index));
+    indices_.Insert(index, IndexEntry{peer, keypair});
+    return index;
+  }
+
+  void Device::ReleaseKeypair(std::unique_ptr<Keypair> &keypair)
+  {
+    if (keypair != nullptr)
+    {
+      indices_.Erase(keypair->local_index);
+      keypair.reset();
+    }
+  }
+
+  void Device::InstallKeypair(Peer *peer, std::unique_ptr<Keypair> keypair)
+  {
+    // The handshake's index now routes to the session.
+    indices_.Insert(keypair->local_index, IndexEntry{peer, keypair.get()});
+
+    if (keypair->initiator)
+    {
+      if (peer->next_keypair != nullptr)
+      {
+        ReleaseKeypair(peer->previous_keypair);
+        peer->previous_keypair = std::move(peer->next_keypair);
+        ReleaseKeypair(peer->current_keypair);
+      }
+      else
+      {
+        ReleaseKeypair(peer->previous_keypair);
+        peer->previous_keypair = std::move(peer->current_keypair);
+      }
+      peer->current_keypair = std::move(keypair);
+    }
+    else
+    {
+      ReleaseKeypair(peer->next_keypair);
+      peer->next_keypair = std::move(keypair);
+      ReleaseKeypair(peer->previous_keypair);
+    }
+  }
+
+  void Device::ZeroKeyMaterial(Peer *peer)
+  {
+    ReleaseKeypair(peer->previous_keypair);
+    ReleaseKeypair(peer->current_keypair);
+    ReleaseKeypair(peer->next_keypair);
+    IndexEntry entry;
+    if (indices_.Find(peer->handshake.local_index, &entry) && entry.peer == peer)
+    {
+      indices_.Erase(peer->handshake.local_index);
+    }
+    HandshakeClear(&peer->handshake);
+    if (peer->session_up)
+    {
+      peer->session_up = false;
+      peer->sessions_down++;
+    }
+  }
+
+  void Device::RemovePeer(Peer *peer)
+  {
+    // Workers may still hold the peer; packets left in its queues go with it,
+    // and outbound ones stop counting against the transmit budget.
+    pipeline_->WaitIdle();
+    size_t left = 0;
+    auto discard = [&left](PacketElement *element)
+    {
+      delete element;
+      left++;
+    };
+    peer->tx_queue.Drain(discard);
+    tx_in_flight_ -= left;
+    transmit_queue_.Remove(&peer->tx_flow);
+    ZeroKeyMaterial(peer);
+    allowed_ips_.RemoveByPeer(peer);
+    PublicKey key;
+    memcpy(key.data(), peer->public_key, kCurve25519KeySize);
+    peers_by_key_.Erase(key);
+    peers_.erase(std::remove_if(peers_.begin(), peers_.end(), [peer](const std::unique_ptr<Peer> &p)
+                                { return p.get() == peer; }),
+                 peers_.end());
+  }
+
+  void Device::SetEndpoint(Peer *peer, const struct sockaddr_storage &from, socklen_t from_len)
+  {
+    memcpy(&peer->endpoint, &from, from_len);
+    peer->endpoint_len = from_len;
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,288 @@
+#ifndef WIREGUARD_FLUTTER_DEVICE_H
+#define WIREGUARD_FLUTTER_DEVICE_H
+
+#include <sys/socket.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "allowed_ips.h"
+#include "config_parser.h"
+#include "cookie.h"
+#include "crypto_pipeline.h"
+#include "fair_queue.h"
+#include "io_uring.h"
+#include "noise.h"
+#include "peer.h"
+#include "rate_limiter.h"
+#include "rcu_hash_table.h"
+#include "timer_wheel.h"
+#include "tun.h"
+#include "tun_offload.h"
+#include "udp_batch.h"
+
+namespace wireguard_flutter {
+
+enum class IoBackend {
+  // poll() for readiness, then recvmmsg() and read() until drained.
+  kPoll,
+  // Multishot UDP receives and batched TUN reads and writes on an io_uring,
+  // with packet pool slabs registered as fixed buffers.
+  kIoUring,
+};
+
+// Userspace WireGuard data plane: moves packets between a TUN file
+// descriptor and UDP sockets, running handshakes and timers for each peer.
+// The event loop thread owns all protocol state; transport data encryption
+// and decryption fan out to a pool of crypto workers and are put back in
+// order per peer before leaving.
+class Device {
+ public:
+  // Takes ownership of |tun_fd|. Any packet-oriented descriptor works, such as
+  // one end of a SOCK_SEQPACKET socketpair; a TUN opened with IFF_VNET_HDR is
+  // detected and its offloads used. With no |crypto_workers|, crypto runs on
+  // the event loop thread.
+  explicit Device(int tun_fd, size_t crypto_workers = DefaultCryptoWorkers());
+  // Takes ownership of the queues of one multi-queue TUN, as opened by
+  // OpenTunQueues(). Run() serves the first queue and starts a thread for
+  // each of the others; every queue gets its own UDP sockets in one
+  // SO_REUSEPORT group. Each peer is tied to one queue, so its packets keep
+  // their order.
+  explicit Device(const std::vector<int> &tun_queues, size_t crypto_workers = DefaultCryptoWorkers());
+  ~Device();
+
+  Device(const Device &) = delete;
+  Device &operator=(const Device &) = delete;
+
+  // Applies a parsed wg-quick config. Peers that are kept keep their sessions;
+  // peers missing from |config| are removed.
+  void Configure(const DeviceConfig &config);
+
+  // Limits what the peer with |public_key| may be sent to |bits_per_second|,
+  // 0 for no limit. wg-quick has no key for this, so it is set apart from
+  // the config, and holds for the peer whenever a config includes it.
+  void SetPeerRateLimit(const uint8_t public_key[kCurve25519KeySize], uint64_t bits_per_second);
+
+  // Binds the UDP sockets; |port| 0 picks a free port. Returns the bound port.
+  uint16_t Bind(uint16_t port);
+
+  // Runs the event loop on the calling thread until Stop() is called.
+  void Run();
+  void Stop();
+
+  // Chooses the backend for the next Run(). Where the kernel cannot do
+  // io_uring, Run() falls back to poll().
+  void SetIoBackend(IoBackend backend) { requested_backend_ = backend; }
+  // The backend the current or last Run() used.
+  IoBackend io_backend() const { return io_backend_; }
+
+  // Whether path MTU probes (see path_mtu.h) are echoed back to whoever sent
+  // them. They carry no authentication, so this is off unless the endpoint
+  // means to serve clients that probe it before connecting.
+  void SetPathProbeEcho(bool enabled) { echo_path_probes_ = enabled; }
+
+  // Pins the thread serving queue i to CPU |cpus[i]|, Run()'s own thread for
+  // the first queue. Queues without an entry, or with a negative one, are
+  // not pinned. Takes effect at the next Run().
+  void SetQueueCpus(const std::vector<int> &cpus);
+
+  std::vector<PeerStats> GetPeerStats();
+  // The same into |stats|, reusing its storage.
+  void GetPeerStats(std::vector<PeerStats> *stats);
+  ConnectLatencyStats GetConnectLatency();
+
+ private:
+  struct IndexEntry {
+    Peer *peer;
+    // Null while the index still belongs to an in-progress handshake.
+    Keypair *keypair;
+  };
+
+  // A handshake message waiting for the event loop, with its source.
+  struct QueuedHandshake {
+    uint8_t data[sizeof(MessageInitiation)];
+    size_t len;
+    struct sockaddr_storage from;
+    socklen_t from_len;
+  };
+
+  typedef std::array<uint8_t, kCurve25519KeySize> PublicKey;
+  struct PublicKeyHash {
+    // Public keys are uniformly distributed already.
+    size_t operator()(const PublicKey &key) const {
+      size_t hash;
+      memcpy(&hash, key.data(), sizeof(hash));
+      return hash;
+    }
+  };
+
+  struct UringState;
+  // A TUN queue beyond the first, with the thread serving it.
+  struct IoQueue;
+
+  void RunPoll();
+  void RunIoUring(IoUring *ring);
+  std::chrono::nanoseconds WaitTimeout();
+  void ArmRing(UringState *state);
+  void ArmRingReceive(UringState *state, size_t slot, int fd);
+  void ArmRingTunReads(UringState *state);
+  void HandleRingCompletion(UringState *state, const struct io_uring_cqe &cqe);
+  void HandleRingDatagrams(UringState *state, uint8_t *buffer, size_t len);
+  void SubmitTunWrites();
+  void RunQueue(IoQueue *queue, int cpu);
+  void ReadTunQueue(IoQueue *queue);
+  void ReadUdpQueue(IoQueue *queue, bool ipv6);
+  // Stops and joins the queue threads.
+  void StopQueues();
+  void WakeQueues();
+  // Wakes the event loop if a queue thread left it work before it planned
+  // to wake up: handshakes, or a timer due sooner.
+  void WakeEventLoopIfNeeded();
+  // The sockets and TUN descriptor of |queue|, the first one's when it has
+  // no socket of its own for the family.
+  int UdpSocket(size_t queue, bool ipv6) const;
+  int TunQueue(size_t queue) const;
+
+  void ReadTun();
+  // Splits what one read from a TUN with IFF_VNET_HDR returned.
+  void SplitTunPacket(uint8_t *packet, size_t len);
+  void ReadUdp(int fd);
+  void HandleTunPacket(std::unique_ptr<PacketElement> element, size_t len);
+  void HandleUdpPacket(uint8_t *data, size_t len, const struct sockaddr_storage &from, socklen_t from_len);
+  void QueueHandshake(const uint8_t *data, size_t len, const struct sockaddr_storage &from, socklen_t from_len);
+  void ProcessHandshakes();
+  bool UnderLoad(TimePoint now);
+  // Whether a handshake message with a valid mac1 may go on to the Noise
+  // code. Under load that takes a valid mac2 and a token from the sender's
+  // bucket; a sender without a cookie gets sent one instead.
+  bool AdmitHandshake(const uint8_t *data, size_t len, const struct sockaddr_storage &from, socklen_t from_len,
+                      bool under_load, TimePoint now);
+  void HandleCookieReply(const uint8_t *data);
+  void AgeRateLimiter();
+  void HandleInitiation(const uint8_t *data, const struct sockaddr_storage &from, socklen_t from_len);
+  void HandleResponse(const uint8_t *data, const struct sockaddr_storage &from, socklen_t from_len);
+  void HandleData(const uint8_t *data, size_t len, const struct sockaddr_storage &from, socklen_t from_len);
+  void FinishData(std::unique_ptr<PacketElement> element);
+  // Writes the |len| bytes in the payload slot of |element|.
+  void WriteTun(std::unique_ptr<PacketElement> element, size_t len);
+
+  void SendData(Peer *peer, const uint8_t *packet, size_t len);
+  // Takes a packet already in the payload slot of |element|.
+  void SendData(Peer *peer, std::unique_ptr<PacketElement> element, size_t len);
+  void SendKeepalive(Peer *peer);
+  void SendInitiation(Peer *peer, bool is_retry);
+  void SendStagedPackets(Peer *peer);
+  bool SendToPeer(Peer *peer, const uint8_t *data, size_t len);
+  bool SendTo(const struct sockaddr_storage &to, socklen_t to_len, const uint8_t *data, size_t len);
+
+  // Moves packets from the fair queue on to encryption while fewer than a
+  // budget's worth are in flight.
+  void DispatchTransmit();
+  void QueuePacket(PeerPacketQueue *queue, std::unique_ptr<PacketElement> element);
+  void OnCryptoComplete(Peer *peer, bool encrypt);
+  void FlushTransmitted(Peer *peer);
+  void SendTransmitted(Peer *peer, PacketElement **elements, size_t count);
+  void FlushPipeline();
+  void DrainReceived();
+
+  void Wake();
+  void InitTimers(Peer *peer);
+  void RetransmitHandshake(Peer *peer);
+  void OnAuthenticatedPacketSent(Peer *peer);
+  void OnAuthenticatedPacketReceived(Peer *peer);
+  void OnHandshakeComplete(Peer *peer);
+  void RecordConnectLatency(Peer *peer, std::chrono::nanoseconds latency);
+
+  uint32_t NewIndex(Peer *peer, Keypair *keypair);
+  void ReleaseKeypair(std::unique_ptr<Keypair> &keypair);
+  void InstallKeypair(Peer *peer, std::unique_ptr<Keypair> keypair);
+  void ZeroKeyMaterial(Peer *peer);
+  void RemovePeer(Peer *peer);
+  void SetEndpoint(Peer *peer, const struct sockaddr_storage &from, socklen_t from_len);
+
+  int tun_fd_;
+  // The TUN was opened with IFF_VNET_HDR: reads may be TCP super-packets to
+  // split, and writes go through the coalescer.
+  bool vnet_hdr_;
+  int udp4_fd_ = -1;
+  int udp6_fd_ = -1;
+  int wake_fd_;
+  // The queues beyond the first, served by their own threads while Run()
+  // runs.
+  std::vector<std::unique_ptr<IoQueue>> queues_;
+  std::vector<int> queue_cpus_;
+  // When the event loop last planned to wake up next.
+  TimePoint loop_wakeup_ = TimePoint::min();
+  // Bumped by every Bind(), so the io_uring loop re-arms its receives.
+  uint64_t bind_generation_ = 0;
+  uint16_t mtu_ = kDefaultMtu;
+
+  StaticIdentity identity_;
+  // Declared before the peers so it outlives the timers they embed.
+  TimerWheel timers_;
+  std::vector<std::unique_ptr<Peer>> peers_;
+  // Looked up for every packet received; written by the event loop under
+  // |mutex_| only.
+  RcuHashTable<PublicKey, Peer *, PublicKeyHash> peers_by_key_;
+  RcuHashTable<uint32_t, IndexEntry> indices_;
+  AllowedIps allowed_ips_;
+
+  CookieChecker cookie_checker_;
+  RateLimiter rate_limiter_;
+  Timer rate_limiter_gc_;
+  std::deque<QueuedHandshake> handshake_queue_;
+  // Transport data waiting its turn, and when a rate-limited peer can next
+  // send.
+  FairQueue transmit_queue_;
+  Timer transmit_timer_;
+  // Set by SetPeerRateLimit(), in bytes per second.
+  std::map<PublicKey, uint64_t> rate_limits_;
+  // When the handshake queue was last deep enough to mean load.
+  TimePoint last_under_load_ = TimePoint::min();
+
+  std::mutex mutex_;
+  std::atomic<bool> running_{true};
+  std::atomic<IoBackend> requested_backend_{IoBackend::kPoll};
+  std::atomic<IoBackend> io_backend_{IoBackend::kPoll};
+  std::atomic<bool> echo_path_probes_{false};
+  // Set while Run() drives an io_uring.
+  UringState *uring_ = nullptr;
+  std::minstd_rand jitter_;
+  std::vector<uint8_t> tun_buffer_;
+  TunSegmenter tun_segmenter_;
+  // One per TUN queue, so a peer's packets go up the queue its flows use.
+  std::vector<std::unique_ptr<TunCoalescer>> tun_coalescers_;
+  UdpReceiver udp_receiver_;
+  // Whether UDP_SEGMENT still works on each socket; workers clear these if the
+  // kernel starts rejecting it.
+  std::atomic<bool> gso4_{false};
+  std::atomic<bool> gso6_{false};
+
+  std::unique_ptr<CryptoPipeline> pipeline_;
+  // Set by the workers when decrypted packets are waiting for the event loop.
+  std::atomic<bool> receive_ready_{false};
+  // Outbound packets submitted to the workers and not yet sent. Kept to a
+  // budget so the fair queue, not the per-peer queues, is where a backlog
+  // builds up; the workers wake the event loop when they have worked it down
+  // while |transmit_blocked_| is set.
+  std::atomic<size_t> tx_in_flight_{0};
+  std::atomic<bool> transmit_blocked_{false};
+
+  // Read by GetConnectLatency() from any thread.
+  std::atomic<uint64_t> connect_latency_buckets_[kConnectLatencyBuckets] = {};
+  std::atomic<uint64_t> connect_latency_sum_ns_{0};
+};
+
+}  // namespace wireguard_flutter
+
+#endif
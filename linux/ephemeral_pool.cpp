@@ -0,0 +1,158 @@
+#include "ephemeral_pool.h"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include "chacha20poly1305.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    void GenerateKey(uint8_t private_key[kCurve25519KeySize], uint8_t public_key[kCurve25519KeySize])
+    {
+      X25519GeneratePrivateKey(private_key);
+      X25519PublicKey(public_key, private_key);
+    }
+
+  } // namespace
+
+  constexpr size_t EphemeralKeyPool::kStockSize;
+
+  struct EphemeralKeyPool::ThreadStock
+  {
+    ThreadStock() { Instance().Register(this); }
+    ~ThreadStock() { Instance().Unregister(this); }
+
+    Key keys[kStockSize];
+    // Guarded by the pool's mutex.
+    size_t count = 0;
+  };
+
+  EphemeralKeyPool &EphemeralKeyPool::Instance()
+  {
+    // Never destroyed: the refill thread runs until the process exits.
+    static EphemeralKeyPool *pool = new EphemeralKeyPool();
+    return *pool;
+  }
+
+  EphemeralKeyPool::ThreadStock &EphemeralKeyPool::LocalStock()
+  {
+    thread_local ThreadStock stock;
+    return stock;
+  }
+
+  void EphemeralKeyPool::Take(uint8_t private_key[kCurve25519KeySize], uint8_t public_key[kCurve25519KeySize])
+  {
+    if (enabled_.load(std::memory_order_relaxed))
+    {
+      ThreadStock &stock = LocalStock();
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stock.count > 0)
+      {
+        Key &key = stock.keys[--stock.count];
+        memcpy(private_key, key.private_key, kCurve25519KeySize);
+        memcpy(public_key, key.public_key, kCurve25519KeySize);
+        SecureZero(&key, sizeof(key));
+        wake_.notify_one();
+        return;
+      }
+      wake_.notify_one();
+    }
+    GenerateKey(private_key, public_key);
+  }
+
+  void EphemeralKeyPool::SetEnabled(bool enabled)
+  {
+    enabled_.store(enabled, std::memory_order_relaxed);
+    if (!enabled)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (ThreadStock *stock : stocks_)
+      {
+        SecureZero(stock->keys, sizeof(stock->keys));
+        stock->count = 0;
+      }
+    }
+  }
+
+  size_t EphemeralKeyPool::StockedKeys()
+  {
+    ThreadStock &stock = LocalStock();
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stock.count;
+  }
+
+  void EphemeralKeyPool::RefillLoop()
+  {
+    // Handshakes and packets come first. On Linux a nice value applies to
+    // the calling thread only. SCHED_IDLE would fit better, but a sleeping
+    // SCHED_IDLE thread alone cost the data plane a tenth of its throughput
+    // on a single core.
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+
+    Key key;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+      if (EmptiestStock() == nullptr || !enabled_.load(std::memory_order_relaxed))
+      {
+        wake_.wait(lock);
+        continue;
+      }
+
+      lock.unlock();
+      GenerateKey(key.private_key, key.public_key);
+      lock.lock();
+      // Stocks may have come and gone meanwhile.
+      ThreadStock *target = EmptiestStock();
+      if (target != nullptr && enabled_.load(std::memory_order_relaxed))
+      {
+        target->keys[target->count++] = key;
+      }
+      SecureZero(&key, sizeof(key));
+    }
+  }
+
+  // The one closest to running dry, or null if all are full.
+  EphemeralKeyPool::ThreadStock *EphemeralKeyPool::EmptiestStock()
+  {
+    ThreadStock *emptiest = nullptr;
+    for (ThreadStock *stock : stocks_)
+    {
+      if (stock->count < kStockSize && (emptiest == nullptr || stock->count < emptiest->count))
+      {
+        emptiest = stock;
+      }
+    }
+    return emptiest;
+  }
+
+  void EphemeralKeyPool::Register(ThreadStock *stock)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stocks_.push_back(stock);
+    if (!refilling_)
+    {
+      refilling_ = true;
+      std::thread(&EphemeralKeyPool::RefillLoop, this).detach();
+    }
+    wake_.notify_one();
+  }
+
+  void EphemeralKeyPool::Unregister(ThreadStock *stock)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stocks_.erase(std::find(stocks_.begin(), stocks_.end(), stock));
+    SecureZero(stock->keys, sizeof(stock->keys));
+    stock->count = 0;
+  }
+
+} // namespace wireguard_flutter
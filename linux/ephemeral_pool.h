@@ -0,0 +1,60 @@
+#ifndef WIREGUARD_FLUTTER_EPHEMERAL_POOL_H
+#define WIREGUARD_FLUTTER_EPHEMERAL_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "curve25519.h"
+
+namespace wireguard_flutter {
+
+// Ephemeral X25519 keypairs generated ahead of time, so creating a handshake
+// message costs one scalar multiplication instead of two. Every thread that
+// takes keys gets its own small stock; a background thread at the lowest
+// priority tops the stocks up. A key leaves its stock exactly once and its
+// slot is zeroed as it does; when a stock runs dry, keys are generated on
+// the spot as before.
+class EphemeralKeyPool {
+ public:
+  static constexpr size_t kStockSize = 8;
+
+  static EphemeralKeyPool &Instance();
+
+  void Take(uint8_t private_key[kCurve25519KeySize], uint8_t public_key[kCurve25519KeySize]);
+
+  // With the pool disabled every key is generated on the spot, e.g. for
+  // benchmarking. Stocked keys are zeroed.
+  void SetEnabled(bool enabled);
+
+  // Keys sitting in the calling thread's stock.
+  size_t StockedKeys();
+
+ private:
+  struct Key {
+    uint8_t private_key[kCurve25519KeySize];
+    uint8_t public_key[kCurve25519KeySize];
+  };
+  struct ThreadStock;
+
+  EphemeralKeyPool() = default;
+
+  void RefillLoop();
+  ThreadStock *EmptiestStock();
+  void Register(ThreadStock *stock);
+  void Unregister(ThreadStock *stock);
+  static ThreadStock &LocalStock();
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::vector<ThreadStock *> stocks_;
+  std::atomic<bool> enabled_{true};
+  bool refilling_ = false;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
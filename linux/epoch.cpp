@@ -0,0 +1,130 @@
+#include "epoch.h"
+
+#include <algorithm>
+
+#include "lockfree_queue.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Retired objects that make Retire() try to free some.
+    const size_t kReclaimThreshold = 64;
+
+  } // namespace
+
+  struct alignas(kCacheLineSize) EpochDomain::ThreadRecord
+  {
+    ThreadRecord() { Instance().Register(this); }
+    ~ThreadRecord() { Instance().Unregister(this); }
+
+    // The epoch the thread entered its outermost guard in, or 0 outside of
+    // any guard. Only written by the owning thread.
+    std::atomic<uint64_t> epoch{0};
+    size_t depth = 0;
+  };
+
+  EpochDomain &EpochDomain::Instance()
+  {
+    // Never destroyed, for the same reason as the packet pool: threads may
+    // still read while static destructors run.
+    static EpochDomain *domain = new EpochDomain();
+    return *domain;
+  }
+
+  EpochDomain::ThreadRecord &EpochDomain::LocalRecord()
+  {
+    thread_local ThreadRecord record;
+    return record;
+  }
+
+  void EpochDomain::Enter()
+  {
+    ThreadRecord &record = LocalRecord();
+    if (record.depth++ == 0)
+    {
+      // Acquire: an epoch is only ever bumped after what was retired in the
+      // one before it had been unlinked.
+      record.epoch.store(epoch_.load(std::memory_order_acquire), std::memory_order_relaxed);
+      // Pairs with the fence in ReclaimLocked(): either the reclaimer sees
+      // this thread reading, or this thread sees every unlink that happened
+      // before the reclaimer looked.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+
+  void EpochDomain::Exit()
+  {
+    ThreadRecord &record = LocalRecord();
+    if (--record.depth == 0)
+    {
+      record.epoch.store(0, std::memory_order_release);
+    }
+  }
+
+  void EpochDomain::Retire(void *object, void (*deleter)(void *))
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    retired_.push_back(Retired{object, deleter, epoch_.load(std::memory_order_relaxed)});
+    if (retired_.size() >= kReclaimThreshold)
+    {
+      ReclaimLocked();
+    }
+  }
+
+  void EpochDomain::Reclaim()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ReclaimLocked();
+  }
+
+  size_t EpochDomain::pending()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return retired_.size();
+  }
+
+  void EpochDomain::ReclaimLocked()
+  {
+    // Readers entering from now on are in a later epoch than anything
+    // retired so far, and cannot reach it: it was unlinked before it was
+    // retired.
+    uint64_t oldest = epoch_.fetch_add(1, std::memory_order_acq_rel) + 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (ThreadRecord *record : records_)
+    {
+      uint64_t epoch = record->epoch.load(std::memory_order_acquire);
+      if (epoch != 0)
+      {
+        oldest = std::min(oldest, epoch);
+      }
+    }
+
+    // A reader that entered in epoch e may hold anything retired in e or
+    // later.
+    std::vector<Retired> freeable;
+    auto keep = std::partition(retired_.begin(), retired_.end(), [oldest](const Retired &retired)
+                               { return retired.epoch >= oldest; });
+    freeable.assign(keep, retired_.end());
+    retired_.erase(keep, retired_.end());
+    for (const Retired &retired : freeable)
+    {
+      retired.deleter(retired.object);
+    }
+  }
+
+  void EpochDomain::Register(ThreadRecord *record)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    records_.push_back(record);
+  }
+
+  void EpochDomain::Unregister(ThreadRecord *record)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    records_.erase(std::find(records_.begin(), records_.end(), record));
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,73 @@
+#ifndef WIREGUARD_FLUTTER_EPOCH_H
+#define WIREGUARD_FLUTTER_EPOCH_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace wireguard_flutter {
+
+// Epoch-based reclamation for read-mostly structures whose readers take no
+// locks. Readers bracket their accesses with an EpochGuard; writers unlink
+// an object so no new reader can reach it, then Retire() it. The object is
+// freed once every reader that was inside a guard at the time has left it.
+//
+// Entering and leaving a guard costs a couple of stores to a per-thread
+// record and one fence; readers never wait. Writers only ever free memory
+// from Retire() and Reclaim(), and never wait for readers either: what
+// cannot be freed yet stays pending until a later call.
+class EpochDomain {
+ public:
+  static EpochDomain &Instance();
+
+  // Hands |object| over to be freed with |deleter| once no reader can still
+  // see it. Every so often this also frees whatever earlier calls left.
+  void Retire(void *object, void (*deleter)(void *));
+
+  // Frees every retired object no reader can still see.
+  void Reclaim();
+
+  // Retired objects not freed yet.
+  size_t pending();
+
+ private:
+  friend class EpochGuard;
+
+  struct Retired {
+    void *object;
+    void (*deleter)(void *);
+    uint64_t epoch;
+  };
+  struct ThreadRecord;
+
+  EpochDomain() = default;
+
+  void Enter();
+  void Exit();
+  void ReclaimLocked();
+  void Register(ThreadRecord *record);
+  void Unregister(ThreadRecord *record);
+  static ThreadRecord &LocalRecord();
+
+  // Starts at 1 so that 0 can mean "not reading" in a thread record.
+  std::atomic<uint64_t> epoch_{1};
+  std::mutex mutex_;
+  std::vector<ThreadRecord *> records_;
+  std::vector<Retired> retired_;
+};
+
+// Marks the calling thread as reading for its lifetime. Guards nest.
+class EpochGuard {
+ public:
+  EpochGuard() { EpochDomain::Instance().Enter(); }
+  ~EpochGuard() { EpochDomain::Instance().Exit(); }
+
+  EpochGuard(const EpochGuard &) = delete;
+  EpochGuard &operator=(const EpochGuard &) = delete;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,148 @@
+#include "fair_queue.h"
+
+#include <algorithm>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const int64_t kNanosecondsPerSecond = 1000000000;
+    // Bursts of up to 10 ms at the flow's rate, and never less than a quantum.
+    const int64_t kBurstsPerSecond = 100;
+
+    int64_t Nanoseconds(FairQueue::TimePoint time)
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+
+    int64_t MaxTokens(uint64_t rate)
+    {
+      uint64_t burst = std::max<uint64_t>(rate / kBurstsPerSecond, FairQueue::kQuantum);
+      return static_cast<int64_t>(burst * kNanosecondsPerSecond / rate);
+    }
+
+    // Refills |flow|'s bucket and charges it for |len| bytes if it is not in
+    // debt. A packet may take the bucket below zero, so one bigger than a
+    // burst still goes out, and the flow then waits until it is paid off.
+    bool TakeTokens(TransmitFlow *flow, size_t len, int64_t now, int64_t *ready)
+    {
+      flow->tokens = std::min(MaxTokens(flow->rate), flow->tokens + (now - flow->last));
+      flow->last = now;
+      if (flow->tokens < 0)
+      {
+        *ready = now - flow->tokens;
+        return false;
+      }
+      flow->tokens -= static_cast<int64_t>(len * kNanosecondsPerSecond / flow->rate);
+      return true;
+    }
+
+  } // namespace
+
+  constexpr size_t FairQueue::kQuantum;
+  constexpr size_t FairQueue::kFlowLimit;
+  constexpr size_t FairQueue::kTotalLimit;
+
+  bool FairQueue::Enqueue(TransmitFlow *flow, std::unique_ptr<PacketElement> element, size_t len)
+  {
+    if (flow->bytes + len > kFlowLimit || bytes_ + len > kTotalLimit)
+    {
+      flow->dropped.fetch_add(1, std::memory_order_relaxed);
+      dropped_++;
+      return false;
+    }
+    flow->packets.emplace_back(std::move(element), len);
+    flow->bytes += len;
+    bytes_ += len;
+    if (!flow->active)
+    {
+      flow->active = true;
+      flow->turn = false;
+      flow->deficit = 0;
+      round_.push_back(flow);
+    }
+    return true;
+  }
+
+  std::unique_ptr<PacketElement> FairQueue::Dequeue(TimePoint now, size_t *len, TimePoint *retry)
+  {
+    *retry = TimePoint::max();
+    int64_t nanoseconds = Nanoseconds(now);
+    int64_t earliest = INT64_MAX;
+    // Flows passed over in a row for want of tokens; once that is all of
+    // them, nothing can go out until the earliest refills.
+    size_t starved = 0;
+    while (starved < round_.size())
+    {
+      TransmitFlow *flow = round_.front();
+      size_t head = flow->packets.front().second;
+      if (!flow->turn)
+      {
+        flow->turn = true;
+        flow->deficit += kQuantum;
+      }
+      if (flow->deficit < head)
+      {
+        // Its turn is over; the deficit grows each round until the packet fits.
+        flow->turn = false;
+        round_.pop_front();
+        round_.push_back(flow);
+        starved = 0;
+        continue;
+      }
+      int64_t ready;
+      if (flow->rate != 0 && !TakeTokens(flow, head, nanoseconds, &ready))
+      {
+        // Keeps its turn, so waiting does not earn it a further quantum.
+        earliest = std::min(earliest, ready);
+        round_.pop_front();
+        round_.push_back(flow);
+        starved++;
+        continue;
+      }
+
+      std::unique_ptr<PacketElement> element = std::move(flow->packets.front().first);
+      flow->packets.pop_front();
+      flow->bytes -= head;
+      flow->deficit -= head;
+      bytes_ -= head;
+      if (flow->packets.empty())
+      {
+        // An idle flow keeps no credit, or it could burst past the others later.
+        flow->active = false;
+        flow->turn = false;
+        flow->deficit = 0;
+        round_.pop_front();
+      }
+      *len = head;
+      return element;
+    }
+    if (earliest != INT64_MAX)
+    {
+      *retry = TimePoint(std::chrono::nanoseconds(earliest));
+    }
+    return nullptr;
+  }
+
+  void FairQueue::Remove(TransmitFlow *flow)
+  {
+    if (flow->active)
+    {
+      round_.erase(std::find(round_.begin(), round_.end(), flow));
+      flow->active = false;
+    }
+    bytes_ -= flow->bytes;
+    flow->bytes = 0;
+    flow->packets.clear();
+  }
+
+  void FairQueue::SetRate(TransmitFlow *flow, uint64_t bytes_per_second, TimePoint now)
+  {
+    flow->rate = bytes_per_second;
+    flow->tokens = bytes_per_second != 0 ? MaxTokens(bytes_per_second) : 0;
+    flow->last = Nanoseconds(now);
+  }
+
+} // namespace wireguard_flutter
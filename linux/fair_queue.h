@@ -0,0 +1,80 @@
+#ifndef WIREGUARD_FLUTTER_FAIR_QUEUE_H
+#define WIREGUARD_FLUTTER_FAIR_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <utility>
+
+#include "crypto_pipeline.h"
+
+namespace wireguard_flutter {
+
+// One peer's place in a FairQueue: plaintext read from the TUN waits here, in
+// order, until the scheduler lets it on to encryption.
+struct TransmitFlow {
+  std::deque<std::pair<std::unique_ptr<PacketElement>, size_t>> packets;
+  size_t bytes = 0;
+  // In the scheduler's round, and whether its turn in the round has begun.
+  bool active = false;
+  bool turn = false;
+  // Bytes the flow may still send this round.
+  size_t deficit = 0;
+
+  // Token bucket, unlimited while |rate| is 0. As in RateLimiter, tokens are
+  // nanoseconds: a packet costs the time it takes to send at |rate|.
+  uint64_t rate = 0;
+  int64_t tokens = 0;
+  int64_t last = 0;
+
+  // Packets dropped because the flow or the whole queue was full.
+  std::atomic<uint64_t> dropped{0};
+};
+
+// Deficit round robin across the peers' transmit flows, so a peer with a
+// deep backlog gets its share of the crypto workers and the link and no
+// more: each flow in turn sends up to kQuantum bytes a round, carrying what
+// it did not use over to the next. A flow whose token bucket runs dry keeps
+// its place but is passed over until the bucket refills. Memory is bounded
+// per flow and overall, and packets past either bound are dropped at the
+// tail and counted. Not thread-safe.
+class FairQueue {
+ public:
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  static constexpr size_t kQuantum = 1500;
+  static constexpr size_t kFlowLimit = 512 * 1024;
+  static constexpr size_t kTotalLimit = 32 * 1024 * 1024;
+
+  // Queues the packet in the payload slot of |element| on |flow|. Returns
+  // false, freeing the element, if either bound would be exceeded.
+  bool Enqueue(TransmitFlow *flow, std::unique_ptr<PacketElement> element, size_t len);
+
+  // The next packet to send and its length, or null if no flow may send
+  // now. |*retry| is then when a rate-limited flow can next send, or
+  // TimePoint::max() if none is waiting.
+  std::unique_ptr<PacketElement> Dequeue(TimePoint now, size_t *len, TimePoint *retry);
+
+  // Frees what |flow| has queued and takes it out of the round.
+  void Remove(TransmitFlow *flow);
+
+  // Limits |flow| to |bytes_per_second|, 0 for no limit, starting with a
+  // full bucket.
+  static void SetRate(TransmitFlow *flow, uint64_t bytes_per_second, TimePoint now);
+
+  size_t bytes() const { return bytes_; }
+  uint64_t dropped() const { return dropped_; }
+
+ private:
+  // The flows with packets queued, in round order; the front one has the turn.
+  std::deque<TransmitFlow *> round_;
+  size_t bytes_ = 0;
+  uint64_t dropped_ = 0;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef FLUTTER_PLUGIN_WIREGUARD_FLUTTER_FFI_H_
+#define FLUTTER_PLUGIN_WIREGUARD_FLUTTER_FFI_H_
+
+#define FFI_PLUGIN_EXPORT __attribute__((visibility("default")))
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Returns the wg-quick |config| with its [Interface] MTU set to the largest
+// tunnel MTU that fits the path to every peer's endpoint, found by probing
+// them. A config that does not parse, or has no endpoint to probe, comes
+// back as it is. Blocks for up to a few seconds per peer. Free the result
+// with WireguardFlutterFree(); null only if memory runs out.
+FFI_PLUGIN_EXPORT char *WireguardFlutterConfigWithPathMtu(const char *config);
+
+FFI_PLUGIN_EXPORT void WireguardFlutterFree(char *string);
+
+#if defined(__cplusplus)
+}  // extern "C"
+#endif
+
+#endif  // FLUTTER_PLUGIN_WIREGUARD_FLUTTER_FFI_H_
@@ -0,0 +1,225 @@
+#include "io_uring.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// Older headers lack it; the value is fixed by the kernel ABI.
+#ifndef IORING_FEAT_REG_REG_RING
+#define IORING_FEAT_REG_REG_RING (1U << 13)
+#endif
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Slots in the sparse fixed buffer table. Packet pool slabs are a
+    // quarter of a megabyte, so this covers far more than a busy tunnel.
+    const unsigned kFixedBufferSlots = 1024;
+
+    int Register(int fd, unsigned opcode, void *arg, unsigned count)
+    {
+      return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+    }
+
+  } // namespace
+
+  constexpr uint16_t IoUring::kBufferGroup;
+
+  std::unique_ptr<IoUring> IoUring::Create(unsigned entries, unsigned buffers)
+  {
+    std::unique_ptr<IoUring> ring(new IoUring());
+    if (!ring->Setup(entries, buffers))
+    {
+      return nullptr;
+    }
+    return ring;
+  }
+
+  IoUring::~IoUring()
+  {
+    if (fd_ >= 0)
+    {
+      close(fd_);
+    }
+    if (rings_ != nullptr)
+    {
+      munmap(rings_, rings_size_);
+    }
+    if (sqes_ != nullptr)
+    {
+      munmap(sqes_, sqes_size_);
+    }
+    if (buffer_ring_ != nullptr)
+    {
+      munmap(buffer_ring_, buffer_ring_size_);
+    }
+  }
+
+  bool IoUring::Setup(unsigned entries, unsigned buffers)
+  {
+    // Completions only run when we wait for them, on this thread, so a
+    // burst of receives is handled in one go.
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    // Multishot receives post many completions per submission.
+    params.cq_entries = entries * 4;
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd_ < 0)
+    {
+      return false;
+    }
+    const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG |
+                              IORING_FEAT_REG_REG_RING;
+    if ((params.features & required) != required)
+    {
+      return false;
+    }
+
+    rings_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                           params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    void *rings = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                       IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED)
+    {
+      return false;
+    }
+    rings_ = rings;
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+      return false;
+    }
+    sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+    uint8_t *base = static_cast<uint8_t *>(rings_);
+    sq_head_ = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_local_tail_ = *sq_tail_;
+    // Entries are always submitted in the order they were filled.
+    unsigned *array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; i++)
+    {
+      array[i] = i;
+    }
+    cq_head_ = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(base + params.cq_off.cqes);
+
+    buffer_ring_size_ = buffers * sizeof(struct io_uring_buf);
+    void *buffer_ring = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer_ring == MAP_FAILED)
+    {
+      return false;
+    }
+    buffer_ring_ = static_cast<struct io_uring_buf_ring *>(buffer_ring);
+    buffer_mask_ = buffers - 1;
+    struct io_uring_buf_reg buffer_reg;
+    memset(&buffer_reg, 0, sizeof(buffer_reg));
+    buffer_reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+    buffer_reg.ring_entries = buffers;
+    buffer_reg.bgid = kBufferGroup;
+    if (Register(fd_, IORING_REGISTER_PBUF_RING, &buffer_reg, 1) < 0)
+    {
+      return false;
+    }
+
+    struct io_uring_rsrc_register table;
+    memset(&table, 0, sizeof(table));
+    table.nr = kFixedBufferSlots;
+    table.flags = IORING_RSRC_REGISTER_SPARSE;
+    return Register(fd_, IORING_REGISTER_BUFFERS2, &table, sizeof(table)) >= 0;
+  }
+
+  struct io_uring_sqe *IoUring::NextSqe()
+  {
+    if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_)
+    {
+      Enter(0, std::chrono::nanoseconds(0));
+    }
+    struct io_uring_sqe *sqe = &sqes_[sq_local_tail_ & sq_mask_];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_local_tail_++;
+    return sqe;
+  }
+
+  void IoUring::SubmitAndWait(std::chrono::nanoseconds timeout)
+  {
+    Enter(timeout.count() > 0 ? 1 : 0, timeout);
+  }
+
+  void IoUring::Enter(unsigned wait_for, std::chrono::nanoseconds timeout)
+  {
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    unsigned to_submit = sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout.count() / 1000000000;
+    ts.tv_nsec = timeout.count() % 1000000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    // GETEVENTS even without waiting: deferred completions only run here.
+    long result = syscall(__NR_io_uring_enter, fd_, to_submit, wait_for,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (result < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    {
+      throw std::runtime_error("io_uring_enter failed: " + std::string(strerror(errno)));
+    }
+  }
+
+  void IoUring::ProvideBuffer(void *data, unsigned len, uint16_t id)
+  {
+    unsigned short tail = buffer_ring_->tail;
+    // Not through |bufs|: in C++ the empty struct in front of it takes a
+    // byte, which moves the array off the ring's first entry.
+    struct io_uring_buf &buffer = reinterpret_cast<struct io_uring_buf *>(buffer_ring_)[tail & buffer_mask_];
+    buffer.addr = reinterpret_cast<uint64_t>(data);
+    buffer.len = len;
+    buffer.bid = id;
+    __atomic_store_n(&buffer_ring_->tail, static_cast<unsigned short>(tail + 1), __ATOMIC_RELEASE);
+  }
+
+  int IoUring::FixedBuffer(void *base, size_t len)
+  {
+    auto found = fixed_buffers_.find(base);
+    if (found != fixed_buffers_.end())
+    {
+      return found->second;
+    }
+    int slot = -1;
+    if (fixed_slots_used_ < kFixedBufferSlots)
+    {
+      struct iovec region = {base, len};
+      uint64_t tag = 0;
+      struct io_uring_rsrc_update2 update;
+      memset(&update, 0, sizeof(update));
+      update.offset = fixed_slots_used_;
+      update.data = reinterpret_cast<uint64_t>(&region);
+      update.tags = reinterpret_cast<uint64_t>(&tag);
+      update.nr = 1;
+      if (Register(fd_, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) >= 0)
+      {
+        slot = static_cast<int>(fixed_slots_used_++);
+      }
+    }
+    fixed_buffers_[base] = slot;
+    return slot;
+  }
+
+} // namespace wireguard_flutter
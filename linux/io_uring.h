@@ -0,0 +1,98 @@
+#ifndef WIREGUARD_FLUTTER_IO_URING_H
+#define WIREGUARD_FLUTTER_IO_URING_H
+
+#include <linux/io_uring.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+
+namespace wireguard_flutter {
+
+// An io_uring driven through the raw system calls, without liburing. The
+// rings are mapped into the process, entries are filled in place and one
+// io_uring_enter both submits and waits. Only the thread that created the
+// ring may use it.
+class IoUring {
+ public:
+  // Receives with IOSQE_BUFFER_SELECT pick from this group.
+  static constexpr uint16_t kBufferGroup = 0;
+
+  // A ring with room for |entries| submissions and a provided buffer ring
+  // of |buffers| slots, a power of two. Null if the kernel has no io_uring
+  // or one older than 6.3, the first with everything used here: multishot
+  // receives, provided buffer rings, sparse fixed buffers and timed waits.
+  static std::unique_ptr<IoUring> Create(unsigned entries, unsigned buffers);
+  ~IoUring();
+
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  // A zeroed submission entry. When the ring is full, what is queued is
+  // submitted first.
+  struct io_uring_sqe *NextSqe();
+
+  // Submits what is queued and waits until a completion is ready or
+  // |timeout| passes; a zero timeout does not wait. Throws
+  // std::runtime_error if the kernel refuses.
+  void SubmitAndWait(std::chrono::nanoseconds timeout);
+
+  // Passes each ready completion to |handler|, which may queue new
+  // submissions.
+  template <typename Handler>
+  void Reap(Handler handler) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      handler(cqes_[head & cq_mask_]);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  // Hands the kernel a buffer for receives in kBufferGroup.
+  void ProvideBuffer(void *data, unsigned len, uint16_t id);
+
+  // The fixed buffer slot of the region starting at |base|, registering it
+  // the first time. The memory must stay mapped for the ring's lifetime.
+  // Returns -1 when the table is full or registration fails, e.g. over
+  // RLIMIT_MEMLOCK; plain reads and writes still work then.
+  int FixedBuffer(void *base, size_t len);
+
+ private:
+  IoUring() = default;
+
+  bool Setup(unsigned entries, unsigned buffers);
+  void Enter(unsigned wait_for, std::chrono::nanoseconds timeout);
+
+  int fd_ = -1;
+  void *rings_ = nullptr;
+  size_t rings_size_ = 0;
+  struct io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  // Entries filled but not yet handed to the kernel.
+  unsigned sq_local_tail_ = 0;
+
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  struct io_uring_cqe *cqes_ = nullptr;
+
+  struct io_uring_buf_ring *buffer_ring_ = nullptr;
+  size_t buffer_ring_size_ = 0;
+  unsigned buffer_mask_ = 0;
+
+  // Slot per registered region, or -1 if registering it failed.
+  std::map<void *, int> fixed_buffers_;
+  unsigned fixed_slots_used_ = 0;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,599 @@
+#include "kill_switch.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netlink.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const char kTableName[] = "wireguard_flutter";
+    const char kChainName[] = "output";
+    // nft's names for the key types; the kernel only stores them.
+    const uint32_t kTypeIpv4Address = 7;
+    const uint32_t kTypeIpv6Address = 8;
+    // Set elements go out in messages of about this size; a nested
+    // attribute's length must fit 16 bits.
+    const size_t kElementsMessageSize = 48 * 1024;
+    const size_t kReceiveBufferSize = 16 * 1024;
+
+    typedef unsigned __int128 Address;
+
+    // An address range, both ends included.
+    struct Range
+    {
+      Address first;
+      Address last;
+    };
+
+    size_t AddressSize(int family)
+    {
+      return family == AF_INET6 ? 16 : 4;
+    }
+
+    Range PrefixRange(const IpPrefix &prefix)
+    {
+      size_t size = AddressSize(prefix.family);
+      Address address = 0;
+      for (size_t i = 0; i < size; i++)
+      {
+        address = (address << 8) | prefix.address[i];
+      }
+      size_t host_bits = size * 8 - std::min<size_t>(prefix.cidr, size * 8);
+      Address host_mask = host_bits == 128 ? ~static_cast<Address>(0) : (static_cast<Address>(1) << host_bits) - 1;
+      return Range{address & ~host_mask, address | host_mask};
+    }
+
+    // The prefixes of |family| among |prefixes|, merged into disjoint,
+    // non-adjacent ranges in order, as interval sets need them.
+    std::vector<Range> MergedRanges(const std::vector<IpPrefix> &prefixes, int family)
+    {
+      std::vector<Range> ranges;
+      for (const auto &prefix : prefixes)
+      {
+        if (prefix.family == family)
+        {
+          ranges.push_back(PrefixRange(prefix));
+        }
+      }
+      std::sort(ranges.begin(), ranges.end(), [](const Range &a, const Range &b)
+                { return a.first < b.first; });
+      std::vector<Range> merged;
+      for (const Range &range : ranges)
+      {
+        // The last check keeps last + 1 from wrapping at the top of IPv6.
+        if (!merged.empty() &&
+            (range.first <= merged.back().last + 1 || merged.back().last == ~static_cast<Address>(0)))
+        {
+          merged.back().last = std::max(merged.back().last, range.last);
+        }
+        else
+        {
+          merged.push_back(range);
+        }
+      }
+      return merged;
+    }
+
+    bool HasDefaultRoute(const std::vector<IpPrefix> &prefixes)
+    {
+      return std::any_of(prefixes.begin(), prefixes.end(), [](const IpPrefix &prefix)
+                         { return prefix.cidr == 0; });
+    }
+
+    // Builds a batch of nfnetlink messages in place.
+    class BatchWriter
+    {
+    public:
+      explicit BatchWriter(uint32_t *seq) : seq_(seq) {}
+
+      void Begin(uint16_t type, uint16_t flags, uint8_t family, uint16_t resource = 0)
+      {
+        message_ = buffer_.size();
+        struct nlmsghdr header;
+        memset(&header, 0, sizeof(header));
+        header.nlmsg_type = type;
+        header.nlmsg_flags = NLM_F_REQUEST | flags;
+        header.nlmsg_seq = (*seq_)++;
+        struct nfgenmsg nfgen;
+        nfgen.nfgen_family = family;
+        nfgen.version = NFNETLINK_V0;
+        nfgen.res_id = htons(resource);
+        Append(&header, sizeof(header));
+        Append(&nfgen, sizeof(nfgen));
+      }
+
+      // Starts an nf_tables request on the kill switch's table.
+      void BeginRequest(uint16_t type, uint16_t flags)
+      {
+        last_request_ = buffer_.size();
+        Begin(static_cast<uint16_t>((NFNL_SUBSYS_NFTABLES << 8) | type), flags, NFPROTO_INET);
+      }
+
+      void End()
+      {
+        uint32_t len = static_cast<uint32_t>(buffer_.size() - message_);
+        memcpy(buffer_.data() + message_ + offsetof(struct nlmsghdr, nlmsg_len), &len, sizeof(len));
+      }
+
+      void Put(uint16_t type, const void *data, size_t len)
+      {
+        struct nlattr attribute;
+        attribute.nla_len = static_cast<uint16_t>(NLA_HDRLEN + len);
+        attribute.nla_type = type;
+        Append(&attribute, sizeof(attribute));
+        Append(data, len);
+        buffer_.resize(NLA_ALIGN(buffer_.size()));
+      }
+
+      // nf_tables wants its integers big-endian.
+      void PutU32(uint16_t type, uint32_t value)
+      {
+        uint32_t be = htonl(value);
+        Put(type, &be, sizeof(be));
+      }
+
+      void PutString(uint16_t type, const char *value)
+      {
+        Put(type, value, strlen(value) + 1);
+      }
+
+      size_t BeginNest(uint16_t type)
+      {
+        size_t offset = buffer_.size();
+        Put(static_cast<uint16_t>(type | NLA_F_NESTED), nullptr, 0);
+        return offset;
+      }
+
+      void EndNest(size_t offset)
+      {
+        uint16_t len = static_cast<uint16_t>(buffer_.size() - offset);
+        memcpy(buffer_.data() + offset + offsetof(struct nlattr, nla_len), &len, sizeof(len));
+      }
+
+      size_t MessageSize() const { return buffer_.size() - message_; }
+
+      // Asks for an ack of the last request: nfnetlink reports failures
+      // anyway, and once that request is answered the batch is done.
+      void AckLastRequest()
+      {
+        struct nlmsghdr header;
+        memcpy(&header, buffer_.data() + last_request_, sizeof(header));
+        header.nlmsg_flags |= NLM_F_ACK;
+        memcpy(buffer_.data() + last_request_, &header, sizeof(header));
+      }
+
+      std::vector<uint8_t> Take() { return std::move(buffer_); }
+
+    private:
+      void Append(const void *data, size_t len)
+      {
+        size_t offset = buffer_.size();
+        buffer_.resize(offset + len);
+        if (len > 0)
+        {
+          memcpy(buffer_.data() + offset, data, len);
+        }
+      }
+
+      uint32_t *seq_;
+      std::vector<uint8_t> buffer_;
+      size_t message_ = 0;
+      size_t last_request_ = 0;
+    };
+
+    void BeginBatch(BatchWriter *batch)
+    {
+      batch->Begin(NFNL_MSG_BATCH_BEGIN, 0, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+      batch->End();
+    }
+
+    void EndBatch(BatchWriter *batch)
+    {
+      batch->AckLastRequest();
+      batch->Begin(NFNL_MSG_BATCH_END, 0, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+      batch->End();
+    }
+
+    void TableRequest(BatchWriter *batch, uint16_t type, uint16_t flags)
+    {
+      batch->BeginRequest(type, flags);
+      batch->PutString(NFTA_TABLE_NAME, kTableName);
+      batch->End();
+    }
+
+    void AddChain(BatchWriter *batch, uint32_t policy)
+    {
+      batch->BeginRequest(NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+      batch->PutString(NFTA_CHAIN_TABLE, kTableName);
+      batch->PutString(NFTA_CHAIN_NAME, kChainName);
+      size_t hook = batch->BeginNest(NFTA_CHAIN_HOOK);
+      batch->PutU32(NFTA_HOOK_HOOKNUM, NF_INET_LOCAL_OUT);
+      batch->PutU32(NFTA_HOOK_PRIORITY, 0);
+      batch->EndNest(hook);
+      batch->PutU32(NFTA_CHAIN_POLICY, policy);
+      batch->PutString(NFTA_CHAIN_TYPE, "filter");
+      batch->End();
+    }
+
+    void PutKey(BatchWriter *batch, uint16_t type, Address address, size_t size)
+    {
+      uint8_t bytes[16];
+      for (size_t i = size; i-- > 0;)
+      {
+        bytes[i] = static_cast<uint8_t>(address);
+        address >>= 8;
+      }
+      size_t key = batch->BeginNest(type);
+      batch->Put(NFTA_DATA_VALUE, bytes, size);
+      batch->EndNest(key);
+    }
+
+    void AddSetElements(BatchWriter *batch, const char *name, uint32_t id, const std::vector<Range> &ranges,
+                        size_t size)
+    {
+      // An interval set holds where each range starts and, flagged, the
+      // address after it ends. As nft does, a set not starting at zero
+      // opens with an end there.
+      struct Element
+      {
+        Address key;
+        bool end;
+      };
+      std::vector<Element> elements;
+      if (!ranges.empty() && ranges.front().first != 0)
+      {
+        elements.push_back(Element{0, true});
+      }
+      Address max = size == 16 ? ~static_cast<Address>(0) : 0xffffffff;
+      for (const Range &range : ranges)
+      {
+        elements.push_back(Element{range.first, false});
+        if (range.last != max)
+        {
+          elements.push_back(Element{range.last + 1, true});
+        }
+      }
+
+      size_t next = 0;
+      while (next < elements.size())
+      {
+        batch->BeginRequest(NFT_MSG_NEWSETELEM, NLM_F_CREATE);
+        batch->PutString(NFTA_SET_ELEM_LIST_TABLE, kTableName);
+        batch->PutString(NFTA_SET_ELEM_LIST_SET, name);
+        batch->PutU32(NFTA_SET_ELEM_LIST_SET_ID, id);
+        size_t list = batch->BeginNest(NFTA_SET_ELEM_LIST_ELEMENTS);
+        while (next < elements.size() && batch->MessageSize() < kElementsMessageSize)
+        {
+          size_t element = batch->BeginNest(NFTA_LIST_ELEM);
+          PutKey(batch, NFTA_SET_ELEM_KEY, elements[next].key, size);
+          if (elements[next].end)
+          {
+            batch->PutU32(NFTA_SET_ELEM_FLAGS, NFT_SET_ELEM_INTERVAL_END);
+          }
+          batch->EndNest(element);
+          next++;
+        }
+        batch->EndNest(list);
+        batch->End();
+      }
+    }
+
+    void AddSet(BatchWriter *batch, const char *name, uint32_t id, int family, const std::vector<IpPrefix> &prefixes)
+    {
+      size_t size = AddressSize(family);
+      batch->BeginRequest(NFT_MSG_NEWSET, NLM_F_CREATE);
+      batch->PutString(NFTA_SET_TABLE, kTableName);
+      batch->PutString(NFTA_SET_NAME, name);
+      batch->PutU32(NFTA_SET_FLAGS, NFT_SET_INTERVAL);
+      batch->PutU32(NFTA_SET_KEY_TYPE, family == AF_INET6 ? kTypeIpv6Address : kTypeIpv4Address);
+      batch->PutU32(NFTA_SET_KEY_LEN, static_cast<uint32_t>(size));
+      batch->PutU32(NFTA_SET_ID, id);
+      batch->End();
+      AddSetElements(batch, name, id, MergedRanges(prefixes, family), size);
+    }
+
+    // Rules are lists of expressions, each a name and its attributes.
+    size_t BeginExpression(BatchWriter *batch, const char *name, size_t *data)
+    {
+      size_t element = batch->BeginNest(NFTA_LIST_ELEM);
+      batch->PutString(NFTA_EXPR_NAME, name);
+      *data = batch->BeginNest(NFTA_EXPR_DATA);
+      return element;
+    }
+
+    void EndExpression(BatchWriter *batch, size_t element, size_t data)
+    {
+      batch->EndNest(data);
+      batch->EndNest(element);
+    }
+
+    void PutMeta(BatchWriter *batch, uint32_t key)
+    {
+      size_t data, element = BeginExpression(batch, "meta", &data);
+      batch->PutU32(NFTA_META_DREG, NFT_REG_1);
+      batch->PutU32(NFTA_META_KEY, key);
+      EndExpression(batch, element, data);
+    }
+
+    void PutCompare(BatchWriter *batch, const void *value, size_t len)
+    {
+      size_t data, element = BeginExpression(batch, "cmp", &data);
+      batch->PutU32(NFTA_CMP_SREG, NFT_REG_1);
+      batch->PutU32(NFTA_CMP_OP, NFT_CMP_EQ);
+      size_t compare = batch->BeginNest(NFTA_CMP_DATA);
+      batch->Put(NFTA_DATA_VALUE, value, len);
+      batch->EndNest(compare);
+      EndExpression(batch, element, data);
+    }
+
+    // Loads the destination address of the network header.
+    void PutDestination(BatchWriter *batch, int family)
+    {
+      size_t data, element = BeginExpression(batch, "payload", &data);
+      batch->PutU32(NFTA_PAYLOAD_DREG, NFT_REG_1);
+      batch->PutU32(NFTA_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER);
+      batch->PutU32(NFTA_PAYLOAD_OFFSET, family == AF_INET6 ? 24 : 16);
+      batch->PutU32(NFTA_PAYLOAD_LEN, static_cast<uint32_t>(AddressSize(family)));
+      EndExpression(batch, element, data);
+    }
+
+    void PutLookup(BatchWriter *batch, const char *set, uint32_t id)
+    {
+      size_t data, element = BeginExpression(batch, "lookup", &data);
+      batch->PutString(NFTA_LOOKUP_SET, set);
+      batch->PutU32(NFTA_LOOKUP_SET_ID, id);
+      batch->PutU32(NFTA_LOOKUP_SREG, NFT_REG_1);
+      EndExpression(batch, element, data);
+    }
+
+    void PutVerdict(BatchWriter *batch, uint32_t verdict)
+    {
+      size_t data, element = BeginExpression(batch, "immediate", &data);
+      batch->PutU32(NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+      size_t immediate = batch->BeginNest(NFTA_IMMEDIATE_DATA);
+      size_t code = batch->BeginNest(NFTA_DATA_VERDICT);
+      batch->PutU32(NFTA_VERDICT_CODE, verdict);
+      batch->EndNest(code);
+      batch->EndNest(immediate);
+      EndExpression(batch, element, data);
+    }
+
+    size_t BeginRule(BatchWriter *batch)
+    {
+      batch->BeginRequest(NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+      batch->PutString(NFTA_RULE_TABLE, kTableName);
+      batch->PutString(NFTA_RULE_CHAIN, kChainName);
+      return batch->BeginNest(NFTA_RULE_EXPRESSIONS);
+    }
+
+    void EndRule(BatchWriter *batch, size_t expressions)
+    {
+      batch->EndNest(expressions);
+      batch->End();
+    }
+
+    // oifname |name| accept
+    void AddInterfaceRule(BatchWriter *batch, const std::string &name)
+    {
+      char padded[IFNAMSIZ] = {0};
+      memcpy(padded, name.data(), name.size());
+      size_t expressions = BeginRule(batch);
+      PutMeta(batch, NFT_META_OIFNAME);
+      PutCompare(batch, padded, sizeof(padded));
+      PutVerdict(batch, NF_ACCEPT);
+      EndRule(batch, expressions);
+    }
+
+    // ip[6] daddr @|set| |verdict|
+    void AddDestinationRule(BatchWriter *batch, int family, const char *set, uint32_t id, uint32_t verdict)
+    {
+      uint8_t protocol = family == AF_INET6 ? NFPROTO_IPV6 : NFPROTO_IPV4;
+      size_t expressions = BeginRule(batch);
+      PutMeta(batch, NFT_META_NFPROTO);
+      PutCompare(batch, &protocol, sizeof(protocol));
+      PutDestination(batch, family);
+      PutLookup(batch, set, id);
+      PutVerdict(batch, verdict);
+      EndRule(batch, expressions);
+    }
+
+  } // namespace
+
+  KillSwitchConfig KillSwitchConfigFor(const DeviceConfig &config, const std::string &interface,
+                                       const std::vector<IpPrefix> &lan_exceptions)
+  {
+    KillSwitchConfig kill_switch;
+    kill_switch.interface = interface;
+    kill_switch.lan_exceptions = lan_exceptions;
+    for (const auto &peer : config.peers)
+    {
+      kill_switch.allowed_ips.insert(kill_switch.allowed_ips.end(), peer.allowed_ips.begin(), peer.allowed_ips.end());
+      struct sockaddr_storage endpoint;
+      socklen_t endpoint_len;
+      if (peer.endpoint.empty() || !ResolveEndpoint(peer.endpoint, &endpoint, &endpoint_len))
+      {
+        continue;
+      }
+      IpPrefix prefix;
+      prefix.family = endpoint.ss_family;
+      if (endpoint.ss_family == AF_INET6)
+      {
+        memcpy(prefix.address, &reinterpret_cast<struct sockaddr_in6 *>(&endpoint)->sin6_addr, 16);
+        prefix.cidr = 128;
+      }
+      else
+      {
+        memcpy(prefix.address, &reinterpret_cast<struct sockaddr_in *>(&endpoint)->sin_addr, 4);
+        prefix.cidr = 32;
+      }
+      kill_switch.endpoints.push_back(prefix);
+    }
+    return kill_switch;
+  }
+
+  std::vector<uint8_t> CompileKillSwitch(const KillSwitchConfig &config, uint32_t *seq)
+  {
+    if (config.interface.empty() || config.interface.size() >= IFNAMSIZ)
+    {
+      throw std::runtime_error("invalid interface name " + config.interface);
+    }
+    bool full_tunnel = HasDefaultRoute(config.allowed_ips);
+    std::vector<IpPrefix> bypass = config.endpoints;
+    bypass.insert(bypass.end(), config.lan_exceptions.begin(), config.lan_exceptions.end());
+
+    BatchWriter batch(seq);
+    BeginBatch(&batch);
+    // Adding the table first lets the delete succeed whether or not it was
+    // there; the new one then takes its place in the same transaction.
+    TableRequest(&batch, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+    TableRequest(&batch, NFT_MSG_DELTABLE, 0);
+    TableRequest(&batch, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+    AddChain(&batch, full_tunnel ? NF_DROP : NF_ACCEPT);
+    AddSet(&batch, "bypass4", 1, AF_INET, bypass);
+    AddSet(&batch, "bypass6", 2, AF_INET6, bypass);
+    AddSet(&batch, "tunnel4", 3, AF_INET, config.allowed_ips);
+    AddSet(&batch, "tunnel6", 4, AF_INET6, config.allowed_ips);
+
+    AddInterfaceRule(&batch, "lo");
+    AddInterfaceRule(&batch, config.interface);
+    AddDestinationRule(&batch, AF_INET, "bypass4", 1, NF_ACCEPT);
+    AddDestinationRule(&batch, AF_INET6, "bypass6", 2, NF_ACCEPT);
+    if (!full_tunnel)
+    {
+      AddDestinationRule(&batch, AF_INET, "tunnel4", 3, NF_DROP);
+      AddDestinationRule(&batch, AF_INET6, "tunnel6", 4, NF_DROP);
+    }
+    EndBatch(&batch);
+    return batch.Take();
+  }
+
+  std::vector<uint8_t> CompileKillSwitchRemoval(uint32_t *seq)
+  {
+    BatchWriter batch(seq);
+    BeginBatch(&batch);
+    TableRequest(&batch, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+    TableRequest(&batch, NFT_MSG_DELTABLE, 0);
+    EndBatch(&batch);
+    return batch.Take();
+  }
+
+  KillSwitch::KillSwitch(int netlink_fd) : fd_(netlink_fd), seq_(1), receive_buffer_(kReceiveBufferSize)
+  {
+  }
+
+  KillSwitch::~KillSwitch()
+  {
+    close(fd_);
+  }
+
+  void KillSwitch::Enable(const KillSwitchConfig &config)
+  {
+    uint32_t first_seq = seq_;
+    std::vector<uint8_t> batch = CompileKillSwitch(config, &seq_);
+    Send(batch, first_seq, seq_);
+  }
+
+  void KillSwitch::Disable()
+  {
+    uint32_t first_seq = seq_;
+    std::vector<uint8_t> batch = CompileKillSwitchRemoval(&seq_);
+    Send(batch, first_seq, seq_);
+  }
+
+  void KillSwitch::Send(const std::vector<uint8_t> &batch, uint32_t first_seq, uint32_t end_seq)
+  {
+    // The kernel takes a batch only whole, in one datagram.
+    int buffer_size = 0;
+    socklen_t len = sizeof(buffer_size);
+    if (getsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &buffer_size, &len) == 0 &&
+        static_cast<size_t>(buffer_size) < batch.size() * 2)
+    {
+      int wanted = static_cast<int>(batch.size());
+      if (setsockopt(fd_, SOL_SOCKET, SO_SNDBUFFORCE, &wanted, sizeof(wanted)) != 0)
+      {
+        setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &wanted, sizeof(wanted));
+      }
+    }
+    ssize_t sent;
+    do
+    {
+      sent = send(fd_, batch.data(), batch.size(), 0);
+    } while (sent < 0 && errno == EINTR);
+    if (sent != static_cast<ssize_t>(batch.size()))
+    {
+      throw std::runtime_error("nftables send failed: " + std::string(strerror(errno)));
+    }
+
+    // Done at the ack of the one request that asked for it, or at the first
+    // error: the transaction is then abandoned as a whole.
+    while (true)
+    {
+      ssize_t n = recv(fd_, receive_buffer_.data(), receive_buffer_.size(), 0);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        throw std::runtime_error("nftables receive failed: " + std::string(n < 0 ? strerror(errno) : "closed"));
+      }
+      int remaining = static_cast<int>(n);
+      for (struct nlmsghdr *header = reinterpret_cast<struct nlmsghdr *>(receive_buffer_.data());
+           NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining))
+      {
+        if (header->nlmsg_type != NLMSG_ERROR || header->nlmsg_seq - first_seq >= end_seq - first_seq ||
+            header->nlmsg_len < NLMSG_LENGTH(sizeof(int)))
+        {
+          continue;
+        }
+        int result;
+        memcpy(&result, NLMSG_DATA(header), sizeof(result));
+        if (result != 0)
+        {
+          throw std::runtime_error("nftables refused the kill switch: " + std::string(strerror(-result)));
+        }
+        return;
+      }
+    }
+  }
+
+  int OpenNftablesNetlink()
+  {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (fd < 0)
+    {
+      throw std::runtime_error("nfnetlink socket failed: " + std::string(strerror(errno)));
+    }
+    int one = 1;
+    setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+    // A kernel without nf_tables must not hang whoever brings the tunnel up.
+    struct timeval timeout = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_nl local;
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&local), sizeof(local)) != 0)
+    {
+      int error = errno;
+      close(fd);
+      throw std::runtime_error("nfnetlink bind failed: " + std::string(strerror(error)));
+    }
+    return fd;
+  }
+
+} // namespace wireguard_flutter
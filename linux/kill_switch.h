@@ -0,0 +1,74 @@
+#ifndef WIREGUARD_FLUTTER_KILL_SWITCH_H
+#define WIREGUARD_FLUTTER_KILL_SWITCH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "config_parser.h"
+
+namespace wireguard_flutter {
+
+struct KillSwitchConfig {
+  // The tunnel's link; whatever leaves through it is allowed.
+  std::string interface;
+  // Peer endpoints, which the encrypted packets must still reach outside
+  // the tunnel.
+  std::vector<IpPrefix> endpoints;
+  // Destinations that may only be reached through the tunnel. A default
+  // route among them makes it a full tunnel: then nothing else leaves, of
+  // either family, so IPv6 cannot leak around an IPv4-only tunnel.
+  std::vector<IpPrefix> allowed_ips;
+  // Destinations reachable outside the tunnel whatever AllowedIPs says,
+  // such as the local network.
+  std::vector<IpPrefix> lan_exceptions;
+};
+
+// The kill switch for |config|'s peers on |interface|. Endpoints that do
+// not resolve are left out.
+KillSwitchConfig KillSwitchConfigFor(const DeviceConfig &config, const std::string &interface,
+                                     const std::vector<IpPrefix> &lan_exceptions);
+
+// Compiles |config| into one nf_tables batch that atomically replaces the
+// table "inet wireguard_flutter": an output chain that accepts loopback and
+// the tunnel link, accepts endpoints and LAN exceptions, and drops
+// AllowedIPs leaving anywhere else. Addresses live in interval sets, so the
+// rules stay the same whatever the number of prefixes. Messages are numbered
+// from |*seq|, which is advanced past them; only the last asks for an ack.
+// Throws std::runtime_error if the interface name is too long.
+std::vector<uint8_t> CompileKillSwitch(const KillSwitchConfig &config, uint32_t *seq);
+
+// A batch that removes the table, whether or not it exists.
+std::vector<uint8_t> CompileKillSwitchRemoval(uint32_t *seq);
+
+// Applies compiled kill switches: one send and one acknowledgement per
+// update, however large the ruleset. Not thread-safe.
+class KillSwitch {
+ public:
+  // Takes ownership of |netlink_fd|, normally from OpenNftablesNetlink().
+  explicit KillSwitch(int netlink_fd);
+  ~KillSwitch();
+
+  KillSwitch(const KillSwitch &) = delete;
+  KillSwitch &operator=(const KillSwitch &) = delete;
+
+  // Installs or replaces the ruleset; on failure the old one stays. Throws
+  // std::runtime_error with the kernel's error.
+  void Enable(const KillSwitchConfig &config);
+  void Disable();
+
+ private:
+  void Send(const std::vector<uint8_t> &batch, uint32_t first_seq, uint32_t end_seq);
+
+  int fd_;
+  uint32_t seq_;
+  std::vector<uint8_t> receive_buffer_;
+};
+
+// An nfnetlink socket for KillSwitch. Needs CAP_NET_ADMIN to change
+// anything. Throws std::runtime_error on failure.
+int OpenNftablesNetlink();
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef WIREGUARD_FLUTTER_LOCKFREE_QUEUE_H
+#define WIREGUARD_FLUTTER_LOCKFREE_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace wireguard_flutter {
+
+constexpr size_t kCacheLineSize = 64;
+
+inline size_t RoundUpToPowerOfTwo(size_t value) {
+  size_t result = 1;
+  while (result < value) {
+    result <<= 1;
+  }
+  return result;
+}
+
+// Bounded multi-producer multi-consumer queue after Dmitry Vyukov's design.
+// Every slot carries a sequence number, so producers and consumers only
+// contend on their own index and never block each other.
+template <typename T>
+class MpmcQueue {
+ public:
+  // |capacity| is rounded up to a power of two.
+  explicit MpmcQueue(size_t capacity)
+      : mask_(RoundUpToPowerOfTwo(capacity) - 1), slots_(new Slot[mask_ + 1]) {
+    for (size_t i = 0; i <= mask_; i++) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpmcQueue(const MpmcQueue &) = delete;
+  MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+  bool TryPush(const T &value) {
+    size_t position = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot &slot = slots_[position & mask_];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          slot.value = value;
+          slot.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        position = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool TryPop(T *value) {
+    size_t position = head_.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot &slot = slots_[position & mask_];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          *value = slot.value;
+          slot.sequence.store(position + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        position = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Only a hint while other threads are pushing or popping.
+  bool Empty() const {
+    return head_.load(std::memory_order_acquire) >= tail_.load(std::memory_order_acquire);
+  }
+
+ private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  const size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  alignas(kCacheLineSize) std::atomic<size_t> head_{0};
+  alignas(kCacheLineSize) std::atomic<size_t> tail_{0};
+};
+
+// Bounded single-producer single-consumer ring. The consumer may change
+// threads as long as the handoff between them synchronises, e.g. through a
+// flag released by the previous consumer and acquired by the next.
+template <typename T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(size_t capacity)
+      : mask_(RoundUpToPowerOfTwo(capacity) - 1), slots_(new T[mask_ + 1]) {}
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  // Producer side.
+  bool TryPush(const T &value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) {
+      return false;
+    }
+    slots_[tail & mask_] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side: peeks at the oldest entry without removing it.
+  bool Front(T *value) const {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *value = slots_[head & mask_];
+    return true;
+  }
+
+  // Consumer side: removes the entry returned by Front().
+  void Pop() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+ private:
+  const size_t mask_;
+  std::unique_ptr<T[]> slots_;
+  alignas(kCacheLineSize) std::atomic<size_t> head_{0};
+  alignas(kCacheLineSize) std::atomic<size_t> tail_{0};
+};
+
+}  // namespace wireguard_flutter
+
+#endif
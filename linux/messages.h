@@ -0,0 +1,103 @@
+#ifndef WIREGUARD_FLUTTER_MESSAGES_H
+#define WIREGUARD_FLUTTER_MESSAGES_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "blake2s.h"
+#include "chacha20poly1305.h"
+#include "curve25519.h"
+
+namespace wireguard_flutter {
+
+// Wire formats and protocol constants from the WireGuard whitepaper. All
+// integer fields are little-endian on the wire.
+
+enum MessageType : uint32_t {
+  kMessageInitiation = 1,
+  kMessageResponse = 2,
+  kMessageCookieReply = 3,
+  kMessageData = 4,
+  // Not part of WireGuard: path MTU probes, which a device echoes so the
+  // sender learns the size got through. Other implementations drop both as
+  // unknown types.
+  kMessagePathProbe = 0x80,
+  kMessagePathProbeReply = 0x81,
+};
+
+constexpr size_t kCookieSize = 16;
+constexpr size_t kCookieNonceSize = 24;
+constexpr size_t kTimestampSize = 12;
+
+struct MessageMacs {
+  uint8_t mac1[kCookieSize];
+  uint8_t mac2[kCookieSize];
+};
+
+struct MessageInitiation {
+  uint32_t type;
+  uint32_t sender_index;
+  uint8_t unencrypted_ephemeral[kCurve25519KeySize];
+  uint8_t encrypted_static[kCurve25519KeySize + kPoly1305TagSize];
+  uint8_t encrypted_timestamp[kTimestampSize + kPoly1305TagSize];
+  MessageMacs macs;
+};
+
+struct MessageResponse {
+  uint32_t type;
+  uint32_t sender_index;
+  uint32_t receiver_index;
+  uint8_t unencrypted_ephemeral[kCurve25519KeySize];
+  uint8_t encrypted_nothing[kPoly1305TagSize];
+  MessageMacs macs;
+};
+
+struct MessageCookieReply {
+  uint32_t type;
+  uint32_t receiver_index;
+  uint8_t nonce[kCookieNonceSize];
+  uint8_t encrypted_cookie[kCookieSize + kPoly1305TagSize];
+};
+
+struct MessageDataHeader {
+  uint32_t type;
+  uint32_t receiver_index;
+  uint64_t counter;
+};
+
+// A probe is this header padded out to the size being tried; the reply is
+// the bare header, with the probe's id and length.
+struct MessagePathProbe {
+  uint32_t type;
+  uint32_t id;
+  uint32_t len;
+};
+
+static_assert(sizeof(MessageInitiation) == 148, "initiation must match the wire size");
+static_assert(sizeof(MessageResponse) == 92, "response must match the wire size");
+static_assert(sizeof(MessageCookieReply) == 64, "cookie reply must match the wire size");
+static_assert(sizeof(MessageDataHeader) == 16, "data header must match the wire size");
+
+constexpr size_t kMessageDataMinSize = sizeof(MessageDataHeader) + kPoly1305TagSize;
+constexpr size_t kMessagePaddingMultiple = 16;
+constexpr size_t kMaxMessageSize = 65535;
+// Smaller probes are not echoed, so a reply is always a small fraction of
+// what a spoofed probe cost to send.
+constexpr size_t kMinPathProbeSize = 512;
+
+constexpr uint64_t kRekeyAfterMessages = 1ULL << 60;
+constexpr uint64_t kRejectAfterMessages = UINT64_MAX - (1ULL << 13);
+constexpr std::chrono::seconds kRekeyAfterTime(120);
+constexpr std::chrono::seconds kRejectAfterTime(180);
+constexpr std::chrono::seconds kRekeyAttemptTime(90);
+constexpr std::chrono::seconds kRekeyTimeout(5);
+constexpr std::chrono::seconds kKeepaliveTimeout(10);
+constexpr std::chrono::seconds kCookieSecretMaxAge(120);
+constexpr std::chrono::seconds kCookieSecretLatency(5);
+constexpr int kMaxTimerHandshakes = 90 / 5;
+constexpr size_t kMaxStagedPackets = 128;
+
+}  // namespace wireguard_flutter
+
+#endif
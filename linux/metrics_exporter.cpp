@@ -0,0 +1,470 @@
+#include "metrics_exporter.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <libbase64.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Room for the family headers and the histogram, and for each peer's
+    // samples: ten lines of at most a name, key, label and value each.
+    const size_t kFixedBytes = 8192;
+    const size_t kPerPeerBytes = 2048;
+    const uint64_t kNanosPerSecond = 1000000000;
+    const int kClientTimeoutSeconds = 1;
+
+    const char kContentType[] = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+    // Appends to a buffer the caller has made large enough.
+    class TextWriter
+    {
+    public:
+      explicit TextWriter(char *out) : start_(out), p_(out) {}
+
+      void Put(const char *text)
+      {
+        size_t len = strlen(text);
+        memcpy(p_, text, len);
+        p_ += len;
+      }
+
+      void PutU64(uint64_t value)
+      {
+        char digits[20];
+        size_t count = 0;
+        do
+        {
+          digits[count++] = static_cast<char>('0' + value % 10);
+          value /= 10;
+        } while (value != 0);
+        while (count > 0)
+        {
+          *p_++ = digits[--count];
+        }
+      }
+
+      // Seconds as a decimal, with at least one digit after the point.
+      void PutSeconds(uint64_t nanos)
+      {
+        PutU64(nanos / kNanosPerSecond);
+        *p_++ = '.';
+        uint64_t fraction = nanos % kNanosPerSecond;
+        int digits = 9;
+        while (digits > 1 && fraction % 10 == 0)
+        {
+          fraction /= 10;
+          digits--;
+        }
+        for (int i = digits - 1; i >= 0; i--)
+        {
+          p_[i] = static_cast<char>('0' + fraction % 10);
+          fraction /= 10;
+        }
+        p_ += digits;
+      }
+
+      void PutKey(const uint8_t key[kCurve25519KeySize])
+      {
+        size_t len = 0;
+        base64_encode(reinterpret_cast<const char *>(key), kCurve25519KeySize, p_, &len, 0);
+        p_ += len;
+      }
+
+      size_t size() const { return static_cast<size_t>(p_ - start_); }
+
+    private:
+      char *start_;
+      char *p_;
+    };
+
+    void PutFamily(TextWriter *out, const char *name, const char *type, const char *unit, const char *help)
+    {
+      out->Put("# TYPE ");
+      out->Put(name);
+      out->Put(" ");
+      out->Put(type);
+      out->Put("\n");
+      if (unit != nullptr)
+      {
+        out->Put("# UNIT ");
+        out->Put(name);
+        out->Put(" ");
+        out->Put(unit);
+        out->Put("\n");
+      }
+      out->Put("# HELP ");
+      out->Put(name);
+      out->Put(" ");
+      out->Put(help);
+      out->Put("\n");
+    }
+
+    // Starts a sample of the peer's: the name and labels, up to the value.
+    void PutPeerSample(TextWriter *out, const char *name, const char *suffix, const PeerStats &peer,
+                       const char *labels = "")
+    {
+      out->Put(name);
+      out->Put(suffix);
+      out->Put("{public_key=\"");
+      out->PutKey(peer.public_key);
+      out->Put("\"");
+      out->Put(labels);
+      out->Put("} ");
+    }
+
+    template <typename Value>
+    void PutCounterFamily(TextWriter *out, const std::vector<PeerStats> &stats, const char *name, const char *unit,
+                          const char *help, Value value)
+    {
+      PutFamily(out, name, "counter", unit, help);
+      for (const PeerStats &peer : stats)
+      {
+        PutPeerSample(out, name, "_total", peer);
+        out->PutU64(value(peer));
+        out->Put("\n");
+      }
+    }
+
+    int64_t WallClockNanos()
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+          .count();
+    }
+
+    bool SendAll(int fd, const char *data, size_t len)
+    {
+      while (len > 0)
+      {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        if (n <= 0)
+        {
+          return false;
+        }
+        data += n;
+        len -= static_cast<size_t>(n);
+      }
+      return true;
+    }
+
+  } // namespace
+
+  MetricsExporter::MetricsExporter(Device *device) : device_(device)
+  {
+  }
+
+  MetricsExporter::~MetricsExporter()
+  {
+    Stop();
+  }
+
+  uint16_t MetricsExporter::ListenLocalhost(uint16_t port)
+  {
+    CheckIdle();
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+      throw std::runtime_error("metrics socket failed: " + std::string(strerror(errno)));
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &addr_len) != 0)
+    {
+      int error = errno;
+      close(fd);
+      throw std::runtime_error("metrics bind failed: " + std::string(strerror(error)));
+    }
+    Start(fd);
+    return ntohs(addr.sin_port);
+  }
+
+  void MetricsExporter::ListenUnix(const std::string &path)
+  {
+    CheckIdle();
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+    {
+      throw std::runtime_error("invalid metrics socket path " + path);
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+      throw std::runtime_error("metrics socket failed: " + std::string(strerror(errno)));
+    }
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+      int error = errno;
+      close(fd);
+      throw std::runtime_error("metrics bind failed: " + std::string(strerror(error)));
+    }
+    Start(fd);
+    unix_path_ = path;
+  }
+
+  void MetricsExporter::CheckIdle()
+  {
+    if (thread_.joinable())
+    {
+      throw std::runtime_error("metrics exporter already serving");
+    }
+  }
+
+  void MetricsExporter::Start(int listen_fd)
+  {
+    if (listen(listen_fd, 16) != 0)
+    {
+      int error = errno;
+      close(listen_fd);
+      throw std::runtime_error("metrics listen failed: " + std::string(strerror(error)));
+    }
+    wake_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd_ < 0)
+    {
+      close(listen_fd);
+      throw std::runtime_error("metrics eventfd failed: " + std::string(strerror(errno)));
+    }
+    listen_fd_ = listen_fd;
+    thread_ = std::thread(&MetricsExporter::Serve, this);
+  }
+
+  void MetricsExporter::Stop()
+  {
+    if (!thread_.joinable())
+    {
+      return;
+    }
+    uint64_t one = 1;
+    ssize_t n = write(wake_fd_, &one, sizeof(one));
+    (void)n;
+    thread_.join();
+    close(listen_fd_);
+    close(wake_fd_);
+    listen_fd_ = -1;
+    wake_fd_ = -1;
+    if (!unix_path_.empty())
+    {
+      unlink(unix_path_.c_str());
+      unix_path_.clear();
+    }
+  }
+
+  const char *MetricsExporter::Render(size_t *len)
+  {
+    device_->GetPeerStats(&stats_);
+    ConnectLatencyStats latency = device_->GetConnectLatency();
+    int64_t now_ns = WallClockNanos();
+    size_t bound = kFixedBytes + stats_.size() * kPerPeerBytes;
+    if (text_.size() < bound)
+    {
+      text_.resize(bound);
+    }
+
+    TextWriter out(text_.data());
+    auto tx_bytes = [](const PeerStats &peer)
+    {
+      return peer.tx_bytes;
+    };
+    auto rx_bytes = [](const PeerStats &peer)
+    {
+      return peer.rx_bytes;
+    };
+    auto tx_dropped = [](const PeerStats &peer)
+    {
+      return peer.tx_dropped;
+    };
+    auto handshakes = [](const PeerStats &peer)
+    {
+      return peer.handshakes;
+    };
+    auto handshake_timeouts = [](const PeerStats &peer)
+    {
+      return peer.handshake_timeouts;
+    };
+    PutCounterFamily(&out, stats_, "wireguard_peer_transmit_bytes", "bytes",
+                     "Bytes of transport data sent to the peer.", tx_bytes);
+    PutCounterFamily(&out, stats_, "wireguard_peer_receive_bytes", "bytes",
+                     "Bytes of transport data received from the peer.", rx_bytes);
+    PutCounterFamily(&out, stats_, "wireguard_peer_transmit_dropped_packets", nullptr,
+                     "Packets for the peer dropped because its transmit queue was full.", tx_dropped);
+    PutCounterFamily(&out, stats_, "wireguard_peer_handshakes", nullptr, "Handshakes completed with the peer.",
+                     handshakes);
+    PutCounterFamily(&out, stats_, "wireguard_peer_handshake_timeouts", nullptr,
+                     "Attempts to connect to the peer given up after retrying.", handshake_timeouts);
+
+    PutFamily(&out, "wireguard_peer_state_transitions", "counter", nullptr,
+              "Times a session with the peer came up, or went down as its keys expired.");
+    for (const PeerStats &peer : stats_)
+    {
+      PutPeerSample(&out, "wireguard_peer_state_transitions", "_total", peer, ",state=\"up\"");
+      out.PutU64(peer.sessions_up);
+      out.Put("\n");
+      PutPeerSample(&out, "wireguard_peer_state_transitions", "_total", peer, ",state=\"down\"");
+      out.PutU64(peer.sessions_down);
+      out.Put("\n");
+    }
+
+    PutFamily(&out, "wireguard_peer_up", "gauge", nullptr, "Whether the peer has a session.");
+    for (const PeerStats &peer : stats_)
+    {
+      PutPeerSample(&out, "wireguard_peer_up", "", peer);
+      out.Put(peer.session_up ? "1\n" : "0\n");
+    }
+
+    PutFamily(&out, "wireguard_peer_handshake_age_seconds", "gauge", "seconds",
+              "Time since the last handshake with the peer, for peers that had one.");
+    for (const PeerStats &peer : stats_)
+    {
+      if (peer.last_handshake_ns != 0)
+      {
+        PutPeerSample(&out, "wireguard_peer_handshake_age_seconds", "", peer);
+        out.PutSeconds(now_ns > peer.last_handshake_ns ? static_cast<uint64_t>(now_ns - peer.last_handshake_ns) : 0);
+        out.Put("\n");
+      }
+    }
+
+    PutFamily(&out, "wireguard_peer_connect_latency_seconds", "gauge", "seconds",
+              "How long the last connect to the peer took, from its first initiation to the handshake.");
+    for (const PeerStats &peer : stats_)
+    {
+      if (peer.connect_latency_ns != 0)
+      {
+        PutPeerSample(&out, "wireguard_peer_connect_latency_seconds", "", peer);
+        out.PutSeconds(static_cast<uint64_t>(peer.connect_latency_ns));
+        out.Put("\n");
+      }
+    }
+
+    PutFamily(&out, "wireguard_connect_latency_seconds", "histogram", "seconds",
+              "How long connects to all peers took, from their first initiation to the handshake.");
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < kConnectLatencyBuckets; i++)
+    {
+      cumulative += latency.buckets[i];
+      out.Put("wireguard_connect_latency_seconds_bucket{le=\"");
+      if (i < kConnectLatencyBuckets - 1)
+      {
+        out.PutSeconds(kConnectLatencyBoundsMs[i] * 1000000);
+      }
+      else
+      {
+        out.Put("+Inf");
+      }
+      out.Put("\"} ");
+      out.PutU64(cumulative);
+      out.Put("\n");
+    }
+    out.Put("wireguard_connect_latency_seconds_count ");
+    out.PutU64(latency.count);
+    out.Put("\nwireguard_connect_latency_seconds_sum ");
+    out.PutSeconds(latency.sum_ns);
+    out.Put("\n# EOF\n");
+
+    *len = out.size();
+    return text_.data();
+  }
+
+  void MetricsExporter::Serve()
+  {
+    struct pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+    while (true)
+    {
+      if (poll(fds, 2, -1) < 0 && errno != EINTR)
+      {
+        return;
+      }
+      if (fds[1].revents != 0)
+      {
+        return;
+      }
+      if (fds[0].revents == 0)
+      {
+        continue;
+      }
+      int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0)
+      {
+        continue;
+      }
+      // A stuck client holds up the next scrape for this long at most.
+      struct timeval timeout = {kClientTimeoutSeconds, 0};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      HandleConnection(fd);
+      close(fd);
+    }
+  }
+
+  void MetricsExporter::HandleConnection(int fd)
+  {
+    // Only the request line matters, but the headers are read to their end
+    // so closing does not reset the connection under the response.
+    size_t len = 0;
+    while (len < sizeof(request_) - 1)
+    {
+      ssize_t n = recv(fd, request_ + len, sizeof(request_) - 1 - len, 0);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        return;
+      }
+      len += static_cast<size_t>(n);
+      request_[len] = '\0';
+      if (strstr(request_, "\r\n\r\n") != nullptr)
+      {
+        break;
+      }
+    }
+
+    char header[256];
+    if (strncmp(request_, "GET /metrics", 12) != 0 || (request_[12] != ' ' && request_[12] != '?'))
+    {
+      static const char kNotFound[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+      SendAll(fd, kNotFound, sizeof(kNotFound) - 1);
+      return;
+    }
+    size_t body_len;
+    const char *body = Render(&body_len);
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                              kContentType, body_len);
+    if (SendAll(fd, header, static_cast<size_t>(header_len)))
+    {
+      SendAll(fd, body, body_len);
+    }
+  }
+
+} // namespace wireguard_flutter
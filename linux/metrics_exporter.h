@@ -0,0 +1,60 @@
+#ifndef WIREGUARD_FLUTTER_METRICS_EXPORTER_H
+#define WIREGUARD_FLUTTER_METRICS_EXPORTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "device.h"
+
+namespace wireguard_flutter {
+
+// Serves a device's metrics in the OpenMetrics text format for Prometheus
+// to scrape: per-peer traffic, handshake age, handshakes and timeouts,
+// session state and its transitions, and how long connecting took. A
+// single thread answers GET /metrics on localhost or a Unix socket, one
+// connection at a time. Scrapes render into buffers kept between them, so
+// once the peer count is steady they allocate nothing.
+class MetricsExporter {
+ public:
+  explicit MetricsExporter(Device *device);
+  ~MetricsExporter();
+
+  MetricsExporter(const MetricsExporter &) = delete;
+  MetricsExporter &operator=(const MetricsExporter &) = delete;
+
+  // Starts serving on 127.0.0.1:|port|; 0 picks a free port. Returns the
+  // bound port. Throws std::runtime_error on failure.
+  uint16_t ListenLocalhost(uint16_t port);
+  // Starts serving on a Unix stream socket at |path|, replacing a stale
+  // socket left there. Throws std::runtime_error on failure.
+  void ListenUnix(const std::string &path);
+  void Stop();
+
+  // Renders the metrics, valid until the next call. Not to be called while
+  // serving.
+  const char *Render(size_t *len);
+
+ private:
+  // Throws std::runtime_error if already serving.
+  void CheckIdle();
+  void Start(int listen_fd);
+  void Serve();
+  void HandleConnection(int fd);
+
+  Device *device_;
+  int listen_fd_ = -1;
+  int wake_fd_ = -1;
+  std::string unix_path_;
+  std::thread thread_;
+
+  std::vector<PeerStats> stats_;
+  std::vector<char> text_;
+  char request_[2048];
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,403 @@
+#include "noise.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "byte_order.h"
+#include "ephemeral_pool.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const char kConstruction[] = "Noise_IKpsk2_25519_ChaChaPoly_BLAKE2s";
+    const char kIdentifier[] = "WireGuard v1 zx2c4 Jason@zx2c4.com";
+    const char kLabelMac1[] = "mac1----";
+
+    struct InitialState
+    {
+      uint8_t chaining_key[kBlake2sHashSize];
+      uint8_t hash[kBlake2sHashSize];
+
+      InitialState()
+      {
+        Blake2sHash(chaining_key, kBlake2sHashSize, reinterpret_cast<const uint8_t *>(kConstruction),
+                    sizeof(kConstruction) - 1);
+        Blake2s state(kBlake2sHashSize);
+        state.Update(chaining_key, kBlake2sHashSize);
+        state.Update(reinterpret_cast<const uint8_t *>(kIdentifier), sizeof(kIdentifier) - 1);
+        state.Final(hash);
+      }
+    };
+
+    const InitialState &Initial()
+    {
+      static const InitialState initial;
+      return initial;
+    }
+
+    void MixHash(uint8_t hash[kBlake2sHashSize], const uint8_t *data, size_t len)
+    {
+      Blake2s state(kBlake2sHashSize);
+      state.Update(hash, kBlake2sHashSize);
+      state.Update(data, len);
+      state.Final(hash);
+    }
+
+    // chaining_key, key = KDF2(chaining_key, DH(private_key, public_key)).
+    bool MixDh(uint8_t chaining_key[kBlake2sHashSize], uint8_t *key, const uint8_t private_key[kCurve25519KeySize],
+               const uint8_t public_key[kCurve25519KeySize])
+    {
+      uint8_t dh[kCurve25519KeySize];
+      if (!X25519(dh, private_key, public_key))
+      {
+        return false;
+      }
+      Kdf(chaining_key, key, nullptr, chaining_key, dh, sizeof(dh));
+      SecureZero(dh, sizeof(dh));
+      return true;
+    }
+
+    void MixPrecomputedDh(uint8_t chaining_key[kBlake2sHashSize], uint8_t key[kChaCha20KeySize],
+                          const uint8_t precomputed[kCurve25519KeySize])
+    {
+      Kdf(chaining_key, key, nullptr, chaining_key, precomputed, kCurve25519KeySize);
+    }
+
+    void MessageEphemeral(uint8_t dst[kCurve25519KeySize], const uint8_t src[kCurve25519KeySize],
+                          uint8_t chaining_key[kBlake2sHashSize], uint8_t hash[kBlake2sHashSize])
+    {
+      if (dst != src)
+      {
+        memcpy(dst, src, kCurve25519KeySize);
+      }
+      MixHash(hash, src, kCurve25519KeySize);
+      Kdf(chaining_key, nullptr, nullptr, chaining_key, src, kCurve25519KeySize);
+    }
+
+    void MessageEncrypt(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t key[kChaCha20KeySize],
+                        uint8_t hash[kBlake2sHashSize])
+    {
+      ChaCha20Poly1305Seal(dst, src, len, hash, kBlake2sHashSize, 0, key);
+      MixHash(hash, dst, len + kPoly1305TagSize);
+    }
+
+    bool MessageDecrypt(uint8_t *dst, const uint8_t *src, size_t src_len, const uint8_t key[kChaCha20KeySize],
+                        uint8_t hash[kBlake2sHashSize])
+    {
+      if (!ChaCha20Poly1305Open(dst, src, src_len, hash, kBlake2sHashSize, 0, key))
+      {
+        return false;
+      }
+      MixHash(hash, src, src_len);
+      return true;
+    }
+
+    // TAI64N timestamp: big-endian seconds since 1970 offset by 2^62, then nanoseconds.
+    void Tai64n(uint8_t out[kTimestampSize])
+    {
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      StoreBe64(out, 0x400000000000000aULL + static_cast<uint64_t>(now.tv_sec));
+      StoreBe32(out + 8, static_cast<uint32_t>(now.tv_nsec));
+    }
+
+    void GenerateEphemeral(uint8_t private_key[kCurve25519KeySize], uint8_t public_key[kCurve25519KeySize])
+    {
+      EphemeralKeyPool::Instance().Take(private_key, public_key);
+    }
+
+  } // namespace
+
+  Keypair::~Keypair()
+  {
+    SecureZero(send_key, sizeof(send_key));
+    SecureZero(receive_key, sizeof(receive_key));
+  }
+
+  void SetStaticIdentity(StaticIdentity *identity, const uint8_t private_key[kCurve25519KeySize])
+  {
+    memcpy(identity->private_key, private_key, kCurve25519KeySize);
+    X25519PublicKey(identity->public_key, identity->private_key);
+    ComputeMac1Key(identity->mac1_key, identity->public_key);
+    identity->has_identity = true;
+  }
+
+  void HandshakeInit(Handshake *handshake, const StaticIdentity &identity,
+                     const uint8_t remote_static[kCurve25519KeySize], const uint8_t *preshared_key)
+  {
+    HandshakeClear(handshake);
+    memcpy(handshake->remote_static, remote_static, kCurve25519KeySize);
+    if (preshared_key != nullptr)
+    {
+      memcpy(handshake->preshared_key, preshared_key, kCurve25519KeySize);
+    }
+    else
+    {
+      memset(handshake->preshared_key, 0, kCurve25519KeySize);
+    }
+    ComputeMac1Key(handshake->remote_mac1_key, remote_static);
+    if (!identity.has_identity ||
+        !X25519(handshake->precomputed_static_static, identity.private_key, remote_static))
+    {
+      memset(handshake->precomputed_static_static, 0, kCurve25519KeySize);
+    }
+    memset(handshake->latest_timestamp, 0, kTimestampSize);
+  }
+
+  void HandshakeClear(Handshake *handshake)
+  {
+    SecureZero(handshake->ephemeral_private, kCurve25519KeySize);
+    SecureZero(handshake->remote_ephemeral, kCurve25519KeySize);
+    SecureZero(handshake->hash, kBlake2sHashSize);
+    SecureZero(handshake->chaining_key, kBlake2sHashSize);
+    handshake->remote_index = 0;
+    handshake->state = HandshakeState::kZeroed;
+  }
+
+  bool CreateInitiation(MessageInitiation *msg, Handshake *handshake, const StaticIdentity &identity,
+                        uint32_t local_index)
+  {
+    if (!identity.has_identity)
+    {
+      return false;
+    }
+
+    uint8_t key[kChaCha20KeySize], timestamp[kTimestampSize];
+    uint8_t ephemeral_public[kCurve25519KeySize];
+    bool ok = false;
+
+    msg->type = htole32(kMessageInitiation);
+    memcpy(handshake->chaining_key, Initial().chaining_key, kBlake2sHashSize);
+    memcpy(handshake->hash, Initial().hash, kBlake2sHashSize);
+    MixHash(handshake->hash, handshake->remote_static, kCurve25519KeySize);
+
+    GenerateEphemeral(handshake->ephemeral_private, ephemeral_public);
+    MessageEphemeral(msg->unencrypted_ephemeral, ephemeral_public, handshake->chaining_key, handshake->hash);
+
+    if (MixDh(handshake->chaining_key, key, handshake->ephemeral_private, handshake->remote_static))
+    {
+      MessageEncrypt(msg->encrypted_static, identity.public_key, kCurve25519KeySize, key, handshake->hash);
+
+      MixPrecomputedDh(handshake->chaining_key, key, handshake->precomputed_static_static);
+      Tai64n(timestamp);
+      MessageEncrypt(msg->encrypted_timestamp, timestamp, kTimestampSize, key, handshake->hash);
+
+      handshake->local_index = local_index;
+      msg->sender_index = htole32(local_index);
+      handshake->state = HandshakeState::kCreatedInitiation;
+      ok = true;
+    }
+
+    SecureZero(key, sizeof(key));
+    return ok;
+  }
+
+  Handshake *ConsumeInitiation(const MessageInitiation &msg, const StaticIdentity &identity,
+                               const std::function<Handshake *(const uint8_t *remote_static)> &lookup)
+  {
+    if (!identity.has_identity)
+    {
+      return nullptr;
+    }
+
+    uint8_t chaining_key[kBlake2sHashSize], hash[kBlake2sHashSize], key[kChaCha20KeySize];
+    uint8_t remote_ephemeral[kCurve25519KeySize], remote_static[kCurve25519KeySize];
+    uint8_t timestamp[kTimestampSize];
+    Handshake *handshake = nullptr;
+
+    memcpy(chaining_key, Initial().chaining_key, kBlake2sHashSize);
+    memcpy(hash, Initial().hash, kBlake2sHashSize);
+    MixHash(hash, identity.public_key, kCurve25519KeySize);
+
+    MessageEphemeral(remote_ephemeral, msg.unencrypted_ephemeral, chaining_key, hash);
+
+    if (MixDh(chaining_key, key, identity.private_key, remote_ephemeral) &&
+        MessageDecrypt(remote_static, msg.encrypted_static, sizeof(msg.encrypted_static), key, hash))
+    {
+      handshake = lookup(remote_static);
+    }
+
+    if (handshake != nullptr)
+    {
+      MixPrecomputedDh(chaining_key, key, handshake->precomputed_static_static);
+      if (!MessageDecrypt(timestamp, msg.encrypted_timestamp, sizeof(msg.encrypted_timestamp), key, hash) ||
+          memcmp(timestamp, handshake->latest_timestamp, kTimestampSize) <= 0)
+      {
+        handshake = nullptr;
+      }
+    }
+
+    if (handshake != nullptr)
+    {
+      memcpy(handshake->remote_ephemeral, remote_ephemeral, kCurve25519KeySize);
+      memcpy(handshake->latest_timestamp, timestamp, kTimestampSize);
+      memcpy(handshake->hash, hash, kBlake2sHashSize);
+      memcpy(handshake->chaining_key, chaining_key, kBlake2sHashSize);
+      handshake->remote_index = le32toh(msg.sender_index);
+      handshake->state = HandshakeState::kConsumedInitiation;
+    }
+
+    SecureZero(chaining_key, sizeof(chaining_key));
+    SecureZero(hash, sizeof(hash));
+    SecureZero(key, sizeof(key));
+    return handshake;
+  }
+
+  bool CreateResponse(MessageResponse *msg, Handshake *handshake, uint32_t local_index)
+  {
+    if (handshake->state != HandshakeState::kConsumedInitiation)
+    {
+      return false;
+    }
+
+    uint8_t key[kChaCha20KeySize], tau[kBlake2sHashSize];
+    uint8_t ephemeral_public[kCurve25519KeySize];
+    bool ok = false;
+
+    msg->type = htole32(kMessageResponse);
+    msg->receiver_index = htole32(handshake->remote_index);
+
+    GenerateEphemeral(handshake->ephemeral_private, ephemeral_public);
+    MessageEphemeral(msg->unencrypted_ephemeral, ephemeral_public, handshake->chaining_key, handshake->hash);
+
+    if (MixDh(handshake->chaining_key, nullptr, handshake->ephemeral_private, handshake->remote_ephemeral) &&
+        MixDh(handshake->chaining_key, nullptr, handshake->ephemeral_private, handshake->remote_static))
+    {
+      Kdf(handshake->chaining_key, tau, key, handshake->chaining_key, handshake->preshared_key,
+          kCurve25519KeySize);
+      MixHash(handshake->hash, tau, sizeof(tau));
+      MessageEncrypt(msg->encrypted_nothing, nullptr, 0, key, handshake->hash);
+
+      handshake->local_index = local_index;
+      msg->sender_index = htole32(local_index);
+      handshake->state = HandshakeState::kCreatedResponse;
+      ok = true;
+    }
+
+    SecureZero(key, sizeof(key));
+    SecureZero(tau, sizeof(tau));
+    return ok;
+  }
+
+  bool ConsumeResponse(const MessageResponse &msg, Handshake *handshake, const StaticIdentity &identity)
+  {
+    if (handshake->state != HandshakeState::kCreatedInitiation || !identity.has_identity)
+    {
+      return false;
+    }
+
+    uint8_t chaining_key[kBlake2sHashSize], hash[kBlake2sHashSize];
+    uint8_t key[kChaCha20KeySize], tau[kBlake2sHashSize];
+    uint8_t remote_ephemeral[kCurve25519KeySize];
+    bool ok = false;
+
+    memcpy(chaining_key, handshake->chaining_key, kBlake2sHashSize);
+    memcpy(hash, handshake->hash, kBlake2sHashSize);
+
+    MessageEphemeral(remote_ephemeral, msg.unencrypted_ephemeral, chaining_key, hash);
+    if (MixDh(chaining_key, nullptr, handshake->ephemeral_private, remote_ephemeral) &&
+        MixDh(chaining_key, nullptr, identity.private_key, remote_ephemeral))
+    {
+      Kdf(chaining_key, tau, key, chaining_key, handshake->preshared_key, kCurve25519KeySize);
+      MixHash(hash, tau, sizeof(tau));
+      ok = MessageDecrypt(nullptr, msg.encrypted_nothing, sizeof(msg.encrypted_nothing), key, hash);
+    }
+
+    if (ok)
+    {
+      memcpy(handshake->remote_ephemeral, remote_ephemeral, kCurve25519KeySize);
+      memcpy(handshake->hash, hash, kBlake2sHashSize);
+      memcpy(handshake->chaining_key, chaining_key, kBlake2sHashSize);
+      handshake->remote_index = le32toh(msg.sender_index);
+      handshake->state = HandshakeState::kConsumedResponse;
+    }
+
+    SecureZero(chaining_key, sizeof(chaining_key));
+    SecureZero(hash, sizeof(hash));
+    SecureZero(key, sizeof(key));
+    SecureZero(tau, sizeof(tau));
+    return ok;
+  }
+
+  bool BeginSession(Handshake *handshake, Keypair *keypair)
+  {
+    if (handshake->state == HandshakeState::kConsumedResponse)
+    {
+      Kdf(keypair->send_key, keypair->receive_key, nullptr, handshake->chaining_key, nullptr, 0);
+      keypair->initiator = true;
+    }
+    else if (handshake->state == HandshakeState::kCreatedResponse)
+    {
+      Kdf(keypair->receive_key, keypair->send_key, nullptr, handshake->chaining_key, nullptr, 0);
+      keypair->initiator = false;
+    }
+    else
+    {
+      return false;
+    }
+
+    keypair->local_index = handshake->local_index;
+    keypair->remote_index = handshake->remote_index;
+    keypair->send_counter = 0;
+    keypair->replay.Reset();
+    keypair->birth = std::chrono::steady_clock::now();
+    HandshakeClear(handshake);
+    return true;
+  }
+
+  void ComputeMac1Key(uint8_t out[kBlake2sHashSize], const uint8_t public_key[kCurve25519KeySize])
+  {
+    Blake2s state(kBlake2sHashSize);
+    state.Update(reinterpret_cast<const uint8_t *>(kLabelMac1), sizeof(kLabelMac1) - 1);
+    state.Update(public_key, kCurve25519KeySize);
+    state.Final(out);
+  }
+
+  void AddMacs(uint8_t *msg, size_t len, const uint8_t mac1_key[kBlake2sHashSize], const uint8_t *cookie)
+  {
+    MessageMacs *macs = reinterpret_cast<MessageMacs *>(msg + len - sizeof(MessageMacs));
+    Blake2sHash(macs->mac1, kCookieSize, msg, len - sizeof(MessageMacs), mac1_key, kBlake2sHashSize);
+    if (cookie != nullptr)
+    {
+      Blake2sHash(macs->mac2, kCookieSize, msg, len - kCookieSize, cookie, kCookieSize);
+    }
+    else
+    {
+      memset(macs->mac2, 0, kCookieSize);
+    }
+  }
+
+  bool CheckMac1(const uint8_t *msg, size_t len, const uint8_t mac1_key[kBlake2sHashSize])
+  {
+    uint8_t mac1[kCookieSize];
+    Blake2sHash(mac1, kCookieSize, msg, len - sizeof(MessageMacs), mac1_key, kBlake2sHashSize);
+    return ConstantTimeEqual(mac1, msg + len - sizeof(MessageMacs), kCookieSize);
+  }
+
+  void CheckMac1Batch(Mac1Check *checks, size_t count, const uint8_t mac1_key[kBlake2sHashSize])
+  {
+    const size_t kChunk = 16;
+    for (size_t done = 0; done < count; done += kChunk)
+    {
+      Mac1Check *chunk = checks + done;
+      size_t n = std::min(count - done, kChunk);
+      Blake2sJob jobs[kChunk];
+      uint8_t macs[kChunk][kCookieSize];
+      for (size_t i = 0; i < n; i++)
+      {
+        jobs[i] = Blake2sJob{chunk[i].msg, chunk[i].len - sizeof(MessageMacs), macs[i]};
+      }
+      Blake2sHashBatch(jobs, n, kCookieSize, mac1_key, kBlake2sHashSize);
+      for (size_t i = 0; i < n; i++)
+      {
+        chunk[i].valid = ConstantTimeEqual(macs[i], chunk[i].msg + chunk[i].len - sizeof(MessageMacs), kCookieSize);
+      }
+    }
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,106 @@
+#ifndef WIREGUARD_FLUTTER_NOISE_H
+#define WIREGUARD_FLUTTER_NOISE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+#include "messages.h"
+#include "replay_window.h"
+
+namespace wireguard_flutter {
+
+// Noise_IKpsk2_25519_ChaChaPoly_BLAKE2s handshake as specified by WireGuard.
+
+struct StaticIdentity {
+  uint8_t private_key[kCurve25519KeySize];
+  uint8_t public_key[kCurve25519KeySize];
+  // Key that incoming handshake messages must be MAC'd with: HASH("mac1----" || public_key).
+  uint8_t mac1_key[kBlake2sHashSize];
+  bool has_identity = false;
+};
+
+enum class HandshakeState {
+  kZeroed,
+  kCreatedInitiation,
+  kConsumedInitiation,
+  kCreatedResponse,
+  kConsumedResponse,
+};
+
+struct Handshake {
+  HandshakeState state = HandshakeState::kZeroed;
+  uint8_t remote_static[kCurve25519KeySize];
+  uint8_t precomputed_static_static[kCurve25519KeySize];
+  uint8_t preshared_key[kCurve25519KeySize];
+  // Key that outgoing handshake messages are MAC'd with.
+  uint8_t remote_mac1_key[kBlake2sHashSize];
+  uint8_t hash[kBlake2sHashSize];
+  uint8_t chaining_key[kBlake2sHashSize];
+  uint8_t ephemeral_private[kCurve25519KeySize];
+  uint8_t remote_ephemeral[kCurve25519KeySize];
+  uint8_t latest_timestamp[kTimestampSize];
+  uint32_t local_index = 0;
+  uint32_t remote_index = 0;
+};
+
+struct Keypair {
+  uint8_t send_key[kChaCha20KeySize];
+  uint8_t receive_key[kChaCha20KeySize];
+  std::atomic<uint64_t> send_counter{0};
+  ReplayWindow replay;
+  uint32_t local_index = 0;
+  uint32_t remote_index = 0;
+  bool initiator = false;
+  std::chrono::steady_clock::time_point birth;
+
+  ~Keypair();
+};
+
+void SetStaticIdentity(StaticIdentity *identity, const uint8_t private_key[kCurve25519KeySize]);
+
+// Prepares |handshake| for a peer; |preshared_key| may be null.
+void HandshakeInit(Handshake *handshake, const StaticIdentity &identity,
+                   const uint8_t remote_static[kCurve25519KeySize], const uint8_t *preshared_key);
+
+// Clears all transient state (ephemeral keys, transcript) but keeps the peer's
+// static configuration and the latest timestamp.
+void HandshakeClear(Handshake *handshake);
+
+bool CreateInitiation(MessageInitiation *msg, Handshake *handshake, const StaticIdentity &identity,
+                      uint32_t local_index);
+
+// Decrypts an initiation, resolving the initiator's static key to a handshake
+// through |lookup|. Returns the updated handshake or null if the message is
+// invalid, unknown or a replay.
+Handshake *ConsumeInitiation(const MessageInitiation &msg, const StaticIdentity &identity,
+                             const std::function<Handshake *(const uint8_t *remote_static)> &lookup);
+
+bool CreateResponse(MessageResponse *msg, Handshake *handshake, uint32_t local_index);
+
+bool ConsumeResponse(const MessageResponse &msg, Handshake *handshake, const StaticIdentity &identity);
+
+// Derives transport keys from a completed handshake and zeroes the handshake.
+bool BeginSession(Handshake *handshake, Keypair *keypair);
+
+void ComputeMac1Key(uint8_t out[kBlake2sHashSize], const uint8_t public_key[kCurve25519KeySize]);
+
+// Fills mac1 (and mac2 when |cookie| is set) of a handshake message of |len|
+// bytes whose last 32 bytes are MessageMacs.
+void AddMacs(uint8_t *msg, size_t len, const uint8_t mac1_key[kBlake2sHashSize], const uint8_t *cookie);
+
+bool CheckMac1(const uint8_t *msg, size_t len, const uint8_t mac1_key[kBlake2sHashSize]);
+
+struct Mac1Check {
+  const uint8_t *msg;
+  size_t len;
+  bool valid;
+};
+
+// CheckMac1() for a batch of received messages, hashed side by side.
+void CheckMac1Batch(Mac1Check *checks, size_t count, const uint8_t mac1_key[kBlake2sHashSize]);
+
+}  // namespace wireguard_flutter
+
+#endif
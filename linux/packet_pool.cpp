@@ -0,0 +1,257 @@
+#include "packet_pool.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Blocks a thread keeps per class before handing some back.
+    const size_t kThreadCacheSize = 64;
+    // Blocks moved between a thread cache and the shared lists at a time.
+    const size_t kTransferBatch = 32;
+    // Slabs are carved into at least this many bytes' worth of blocks.
+    const size_t kSlabSize = 256 * 1024;
+
+    const uint32_t kBlockFree = 0x46524545;
+    const uint32_t kBlockAllocated = 0x55534544;
+
+    size_t SizeClass(size_t size)
+    {
+      for (size_t size_class = 0; size_class < kPacketPoolClasses; size_class++)
+      {
+        if (size + kCacheLineSize <= kPacketPoolBlockSizes[size_class])
+        {
+          return size_class;
+        }
+      }
+      throw std::bad_alloc();
+    }
+
+    size_t SlabBytes(size_t size_class)
+    {
+      size_t block_size = kPacketPoolBlockSizes[size_class];
+      return std::max<size_t>(kSlabSize / block_size, 4) * block_size;
+    }
+
+    // The NUMA node the calling thread runs on, or 0 if unknown.
+    size_t CurrentNode()
+    {
+      unsigned int cpu, node;
+      if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+      {
+        return 0;
+      }
+      return node % kPacketPoolNodes;
+    }
+
+  } // namespace
+
+  // Sits in the first cache line of every block, in front of the memory
+  // handed out.
+  struct PacketPool::Block
+  {
+    Block *next;
+    uint32_t size_class;
+    uint32_t state;
+    uint8_t *slab;
+    // The free list the block goes back to when NUMA-aware.
+    uint32_t node;
+  };
+
+  struct PacketPool::ThreadCache
+  {
+    ThreadCache() { Instance().Register(this); }
+    ~ThreadCache() { Instance().Unregister(this); }
+
+    Block *blocks[kPacketPoolClasses][kThreadCacheSize];
+    // Only written by the owning thread; atomic so Stats() can read it.
+    std::atomic<size_t> counts[kPacketPoolClasses] = {};
+  };
+
+  PacketPool &PacketPool::Instance()
+  {
+    // Never destroyed: worker threads may still free packets while static
+    // destructors run.
+    static PacketPool *pool = new PacketPool();
+    return *pool;
+  }
+
+  PacketPool::ThreadCache &PacketPool::LocalCache()
+  {
+    thread_local ThreadCache cache;
+    return cache;
+  }
+
+  size_t PacketPool::UsableSize(size_t size)
+  {
+    return kPacketPoolBlockSizes[SizeClass(size)] - kCacheLineSize;
+  }
+
+  void *PacketPool::Allocate(size_t size)
+  {
+    size_t size_class = SizeClass(size);
+
+    ThreadCache &cache = LocalCache();
+    size_t count = cache.counts[size_class].load(std::memory_order_relaxed);
+    Block *block;
+    if (count > 0)
+    {
+      block = cache.blocks[size_class][count - 1];
+      cache.counts[size_class].store(count - 1, std::memory_order_relaxed);
+    }
+    else
+    {
+      block = Refill(&cache, size_class);
+    }
+    block->state = kBlockAllocated;
+    return reinterpret_cast<uint8_t *>(block) + kCacheLineSize;
+  }
+
+  void PacketPool::Free(void *memory)
+  {
+    Block *block = reinterpret_cast<Block *>(static_cast<uint8_t *>(memory) - kCacheLineSize);
+    if (block->state != kBlockAllocated)
+    {
+      fprintf(stderr, "PacketPool: free of a block that is not allocated: %p\n", memory);
+      abort();
+    }
+    block->state = kBlockFree;
+
+    ThreadCache &cache = LocalCache();
+    size_t size_class = block->size_class;
+    size_t count = cache.counts[size_class].load(std::memory_order_relaxed);
+    if (count == kThreadCacheSize)
+    {
+      Spill(&cache, size_class, kTransferBatch);
+      count -= kTransferBatch;
+    }
+    cache.blocks[size_class][count] = block;
+    cache.counts[size_class].store(count + 1, std::memory_order_relaxed);
+  }
+
+  PacketPoolStats PacketPool::Stats()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PacketPoolStats stats;
+    for (size_t c = 0; c < kPacketPoolClasses; c++)
+    {
+      stats.blocks[c] = block_counts_[c];
+      stats.free[c] = 0;
+      for (size_t node = 0; node < kPacketPoolNodes; node++)
+      {
+        stats.free[c] += free_counts_[node][c];
+      }
+      stats.cached[c] = 0;
+      for (ThreadCache *cache : caches_)
+      {
+        stats.cached[c] += cache->counts[c].load(std::memory_order_relaxed);
+      }
+      size_t idle = stats.free[c] + stats.cached[c];
+      stats.outstanding[c] = stats.blocks[c] > idle ? stats.blocks[c] - idle : 0;
+    }
+    return stats;
+  }
+
+  void PacketPool::SlabOf(const void *memory, void **base, size_t *size)
+  {
+    const Block *block = reinterpret_cast<const Block *>(static_cast<const uint8_t *>(memory) - kCacheLineSize);
+    *base = block->slab;
+    *size = SlabBytes(block->size_class);
+  }
+
+  PacketPool::Block *PacketPool::Refill(ThreadCache *cache, size_t size_class)
+  {
+    size_t node = numa_aware_ ? CurrentNode() : 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    Block *&free_list = free_lists_[node][size_class];
+    if (free_list == nullptr)
+    {
+      CarveSlab(size_class, node);
+    }
+    Block *block = free_list;
+    free_list = block->next;
+    free_counts_[node][size_class]--;
+
+    size_t count = 0;
+    while (count < kTransferBatch && free_list != nullptr)
+    {
+      cache->blocks[size_class][count++] = free_list;
+      free_list = free_list->next;
+    }
+    free_counts_[node][size_class] -= count;
+    cache->counts[size_class].store(count, std::memory_order_relaxed);
+    return block;
+  }
+
+  void PacketPool::Spill(ThreadCache *cache, size_t size_class, size_t count)
+  {
+    bool numa_aware = numa_aware_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t remaining = cache->counts[size_class].load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++)
+    {
+      Block *block = cache->blocks[size_class][--remaining];
+      size_t node = numa_aware ? block->node : 0;
+      block->next = free_lists_[node][size_class];
+      free_lists_[node][size_class] = block;
+      free_counts_[node][size_class]++;
+    }
+    cache->counts[size_class].store(remaining, std::memory_order_relaxed);
+  }
+
+  void PacketPool::CarveSlab(size_t size_class, size_t node)
+  {
+    size_t block_size = kPacketPoolBlockSizes[size_class];
+    size_t blocks = SlabBytes(size_class) / block_size;
+    uint8_t *slab = static_cast<uint8_t *>(aligned_alloc(kCacheLineSize, blocks * block_size));
+    if (slab == nullptr)
+    {
+      throw std::bad_alloc();
+    }
+    if (numa_aware_)
+    {
+      // Pages are placed on the node of the thread that first touches them.
+      memset(slab, 0, blocks * block_size);
+    }
+    slabs_.push_back(slab);
+    for (size_t i = 0; i < blocks; i++)
+    {
+      Block *block = reinterpret_cast<Block *>(slab + i * block_size);
+      block->next = free_lists_[node][size_class];
+      block->size_class = static_cast<uint32_t>(size_class);
+      block->state = kBlockFree;
+      block->slab = slab;
+      block->node = static_cast<uint32_t>(node);
+      free_lists_[node][size_class] = block;
+    }
+    free_counts_[node][size_class] += blocks;
+    block_counts_[size_class] += blocks;
+  }
+
+  void PacketPool::Register(ThreadCache *cache)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    caches_.push_back(cache);
+  }
+
+  void PacketPool::Unregister(ThreadCache *cache)
+  {
+    for (size_t c = 0; c < kPacketPoolClasses; c++)
+    {
+      Spill(cache, c, cache->counts[c].load(std::memory_order_relaxed));
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    caches_.erase(std::find(caches_.begin(), caches_.end(), cache));
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,88 @@
+#ifndef WIREGUARD_FLUTTER_PACKET_POOL_H
+#define WIREGUARD_FLUTTER_PACKET_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "lockfree_queue.h"
+
+namespace wireguard_flutter {
+
+// Fixed-size blocks come in two classes: one that fits a packet element with
+// an MTU-sized packet, and one for the 64 KiB packets a TUN without
+// offloads can still hand us.
+constexpr size_t kPacketPoolClasses = 2;
+constexpr size_t kPacketPoolBlockSizes[kPacketPoolClasses] = {2560, 66816};
+// NUMA nodes with free lists of their own; nodes beyond share them.
+constexpr size_t kPacketPoolNodes = 8;
+
+struct PacketPoolStats {
+  // Blocks carved out of slabs so far, per class.
+  size_t blocks[kPacketPoolClasses];
+  // Blocks sitting in the shared free lists and in per-thread caches.
+  size_t free[kPacketPoolClasses];
+  size_t cached[kPacketPoolClasses];
+  // Blocks handed out and not yet returned. Only exact while no other
+  // thread is allocating or freeing.
+  size_t outstanding[kPacketPoolClasses];
+};
+
+// Process-wide slab allocator for packet memory. Blocks are cache-line
+// aligned and never go back to the system; each thread keeps a small cache
+// per class and only touches the shared free lists, under a lock, to move
+// blocks in batches. A block freed on another thread than the one that
+// allocated it simply lands in that thread's cache.
+class PacketPool {
+ public:
+  static PacketPool &Instance();
+
+  // Returns a block of at least |size| bytes. Throws std::bad_alloc if
+  // |size| exceeds the largest class or memory runs out.
+  void *Allocate(size_t size);
+  // How many bytes a block serving a request of |size| really has.
+  static size_t UsableSize(size_t size);
+
+  // Returns a block to the calling thread's cache. Freeing a block twice
+  // aborts.
+  void Free(void *block);
+
+  // When enabled, slabs are faulted in by the thread that carves them, so
+  // they sit on its NUMA node, and the shared free lists are kept per node:
+  // a thread refills from its own node and blocks go back to the node they
+  // came from. Off by default; blocks already cached stay where they are.
+  void SetNumaAware(bool enabled) { numa_aware_ = enabled; }
+
+  PacketPoolStats Stats();
+
+  // The slab |block| was carved from. Slabs stay mapped for good, so they
+  // can be registered once for I/O, e.g. as io_uring fixed buffers.
+  static void SlabOf(const void *block, void **base, size_t *size);
+
+ private:
+  struct Block;
+  struct ThreadCache;
+
+  PacketPool() = default;
+
+  Block *Refill(ThreadCache *cache, size_t size_class);
+  void Spill(ThreadCache *cache, size_t size_class, size_t count);
+  void CarveSlab(size_t size_class, size_t node);
+  void Register(ThreadCache *cache);
+  void Unregister(ThreadCache *cache);
+  static ThreadCache &LocalCache();
+
+  std::mutex mutex_;
+  Block *free_lists_[kPacketPoolNodes][kPacketPoolClasses] = {};
+  size_t free_counts_[kPacketPoolNodes][kPacketPoolClasses] = {};
+  size_t block_counts_[kPacketPoolClasses] = {};
+  std::vector<void *> slabs_;
+  std::vector<ThreadCache *> caches_;
+  std::atomic<bool> numa_aware_{false};
+};
+
+}  // namespace wireguard_flutter
+
+#endif
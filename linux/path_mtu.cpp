@@ -0,0 +1,301 @@
+#include "path_mtu.h"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "curve25519.h"
+#include "messages.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kUdpHeaderSize = 8;
+    // Once the endpoint has echoed, a probe is given up on after this many
+    // times the slowest echo yet, but no sooner than kMinProbeWait.
+    const int kEchoTimeMultiple = 4;
+    const std::chrono::milliseconds kMinProbeWait(20);
+
+    size_t IpHeaderSize(int family)
+    {
+      return family == AF_INET6 ? 40 : 20;
+    }
+
+    enum class ProbeOutcome
+    {
+      kEchoed,
+      kTooBig,
+      kLost,
+      // ICMP Port Unreachable: nothing listens, so nothing will echo.
+      kRefused,
+    };
+
+    struct Prober
+    {
+      int fd;
+      int family;
+      uint32_t next_id;
+      // What EMSGSIZE and ICMP errors said the path takes at most.
+      uint16_t mtu_limit;
+      std::chrono::nanoseconds slowest_echo;
+      int probes;
+      std::vector<uint8_t> buffer;
+    };
+
+    // The MTU the kernel has for the connected route, learned PMTU included.
+    uint16_t KernelMtu(const Prober &prober)
+    {
+      int mtu = 0;
+      socklen_t len = sizeof(mtu);
+      if (prober.family == AF_INET6 ? getsockopt(prober.fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) != 0
+                                    : getsockopt(prober.fd, IPPROTO_IP, IP_MTU, &mtu, &len) != 0)
+      {
+        return UINT16_MAX;
+      }
+      return static_cast<uint16_t>(std::min(mtu, static_cast<int>(UINT16_MAX)));
+    }
+
+    // Takes one error off the socket's queue. Returns kTooBig if it says
+    // probe |id| was, kRefused if nothing listens, and kLost otherwise, for
+    // the probe to time out. Any size limit it gives is noted either way.
+    ProbeOutcome ReadError(Prober *prober, uint32_t id)
+    {
+      MessagePathProbe probe;
+      uint8_t control[256];
+      struct iovec iov = {&probe, sizeof(probe)};
+      struct msghdr message;
+      memset(&message, 0, sizeof(message));
+      message.msg_iov = &iov;
+      message.msg_iovlen = 1;
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+      ssize_t n = recvmsg(prober->fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT);
+      if (n < 0)
+      {
+        return ProbeOutcome::kLost;
+      }
+      // The error carries the start of the datagram it is about.
+      bool ours = static_cast<size_t>(n) >= sizeof(probe) && le32toh(probe.type) == kMessagePathProbe &&
+                  le32toh(probe.id) == id;
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr; cmsg = CMSG_NXTHDR(&message, cmsg))
+      {
+        if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+            !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        {
+          continue;
+        }
+        struct sock_extended_err error;
+        memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+        if (error.ee_errno == EMSGSIZE)
+        {
+          if (error.ee_info != 0 && error.ee_info < prober->mtu_limit)
+          {
+            prober->mtu_limit = static_cast<uint16_t>(error.ee_info);
+          }
+          if (ours)
+          {
+            return ProbeOutcome::kTooBig;
+          }
+        }
+        else if (error.ee_errno == ECONNREFUSED)
+        {
+          return ProbeOutcome::kRefused;
+        }
+      }
+      return ProbeOutcome::kLost;
+    }
+
+    // Sends a probe making a |size|-byte IP packet and waits for its fate.
+    ProbeOutcome Probe(Prober *prober, uint16_t size, std::chrono::milliseconds timeout)
+    {
+      size_t len = size - IpHeaderSize(prober->family) - kUdpHeaderSize;
+      uint32_t id = prober->next_id++;
+      prober->buffer.assign(len, 0);
+      MessagePathProbe probe;
+      probe.type = htole32(kMessagePathProbe);
+      probe.id = htole32(id);
+      probe.len = htole32(static_cast<uint32_t>(len));
+      memcpy(prober->buffer.data(), &probe, sizeof(probe));
+      prober->probes++;
+      if (send(prober->fd, prober->buffer.data(), len, 0) < 0)
+      {
+        if (errno == EMSGSIZE)
+        {
+          prober->mtu_limit = std::min(prober->mtu_limit, KernelMtu(*prober));
+          return ProbeOutcome::kTooBig;
+        }
+        return errno == ECONNREFUSED ? ProbeOutcome::kRefused : ProbeOutcome::kLost;
+      }
+
+      auto sent = std::chrono::steady_clock::now();
+      auto deadline = sent + timeout;
+      if (prober->slowest_echo.count() > 0)
+      {
+        deadline = sent + std::min<std::chrono::nanoseconds>(
+                              timeout, std::max<std::chrono::nanoseconds>(kMinProbeWait,
+                                                                          kEchoTimeMultiple * prober->slowest_echo));
+      }
+      while (true)
+      {
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0)
+        {
+          return ProbeOutcome::kLost;
+        }
+        struct pollfd pfd = {prober->fd, POLLIN, 0};
+        if (poll(&pfd, 1, static_cast<int>(remaining.count())) <= 0)
+        {
+          continue;
+        }
+        if (pfd.revents & POLLERR)
+        {
+          ProbeOutcome outcome = ReadError(prober, id);
+          if (outcome != ProbeOutcome::kLost)
+          {
+            return outcome;
+          }
+        }
+        if (pfd.revents & POLLIN)
+        {
+          MessagePathProbe reply;
+          ssize_t n = recv(prober->fd, &reply, sizeof(reply), MSG_DONTWAIT);
+          // Echoes of earlier probes that timed out are ignored.
+          if (n == sizeof(reply) && le32toh(reply.type) == kMessagePathProbeReply && le32toh(reply.id) == id &&
+              le32toh(reply.len) == len)
+          {
+            prober->slowest_echo = std::max<std::chrono::nanoseconds>(prober->slowest_echo,
+                                                                      std::chrono::steady_clock::now() - sent);
+            return ProbeOutcome::kEchoed;
+          }
+        }
+      }
+    }
+
+    ProbeOutcome ProbeSize(Prober *prober, uint16_t size, const PathMtuOptions &options)
+    {
+      if (size > prober->mtu_limit)
+      {
+        return ProbeOutcome::kTooBig;
+      }
+      ProbeOutcome outcome = ProbeOutcome::kLost;
+      for (int attempt = 0; attempt < std::max(options.attempts, 1) && outcome == ProbeOutcome::kLost; attempt++)
+      {
+        outcome = Probe(prober, size, options.timeout);
+      }
+      return outcome;
+    }
+
+  } // namespace
+
+  PathMtuResult DiscoverPathMtu(const struct sockaddr_storage &endpoint, socklen_t endpoint_len,
+                                const PathMtuOptions &options)
+  {
+    auto start = std::chrono::steady_clock::now();
+    int family = endpoint.ss_family;
+    uint16_t min_mtu = std::max<uint16_t>(options.min_mtu, IpHeaderSize(family) + kUdpHeaderSize + kMinPathProbeSize);
+    uint16_t max_mtu = std::max(options.max_mtu, min_mtu);
+
+    int fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+      throw std::runtime_error("socket failed: " + std::string(strerror(errno)));
+    }
+    // DF set, and sizes above what the kernel believes the path takes still
+    // go out; errors, ICMP ones included, come back on the error queue.
+    int probe = family == AF_INET6 ? IPV6_PMTUDISC_PROBE : IP_PMTUDISC_PROBE;
+    int one = 1;
+    bool ok = family == AF_INET6
+                  ? setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &probe, sizeof(probe)) == 0 &&
+                        setsockopt(fd, IPPROTO_IPV6, IPV6_RECVERR, &one, sizeof(one)) == 0
+                  : setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &probe, sizeof(probe)) == 0 &&
+                        setsockopt(fd, IPPROTO_IP, IP_RECVERR, &one, sizeof(one)) == 0;
+    if (!ok || connect(fd, reinterpret_cast<const struct sockaddr *>(&endpoint), endpoint_len) != 0)
+    {
+      int error = errno;
+      close(fd);
+      throw std::runtime_error("could not set up path MTU probes: " + std::string(strerror(error)));
+    }
+
+    Prober prober;
+    prober.fd = fd;
+    prober.family = family;
+    RandomBytes(&prober.next_id, sizeof(prober.next_id));
+    prober.mtu_limit = UINT16_MAX;
+    prober.slowest_echo = std::chrono::nanoseconds(0);
+    prober.probes = 0;
+
+    PathMtuResult result;
+    // The smallest size first, to learn whether and how fast the endpoint
+    // echoes; then the largest, which most paths take.
+    ProbeOutcome bottom = ProbeSize(&prober, min_mtu, options);
+    ProbeOutcome top = bottom == ProbeOutcome::kRefused ? bottom : ProbeSize(&prober, max_mtu, options);
+    if (bottom == ProbeOutcome::kEchoed && top == ProbeOutcome::kEchoed)
+    {
+      result.path_mtu = max_mtu;
+      result.confirmed = true;
+    }
+    else if (bottom == ProbeOutcome::kEchoed)
+    {
+      uint16_t low = min_mtu, high = max_mtu - 1;
+      while (low < high)
+      {
+        high = std::max(low, std::min(high, prober.mtu_limit));
+        uint16_t middle = low + (high - low + 1) / 2;
+        if (ProbeSize(&prober, middle, options) == ProbeOutcome::kEchoed)
+        {
+          low = middle;
+        }
+        else
+        {
+          high = middle - 1;
+        }
+      }
+      result.path_mtu = low;
+      result.confirmed = true;
+    }
+    else
+    {
+      result.path_mtu = std::min({max_mtu, prober.mtu_limit, KernelMtu(prober)});
+    }
+    close(fd);
+    result.probes = prober.probes;
+    result.elapsed = std::chrono::steady_clock::now() - start;
+    return result;
+  }
+
+  uint16_t TunnelMtuForPath(uint16_t path_mtu, int family)
+  {
+    size_t overhead = IpHeaderSize(family) + kUdpHeaderSize + kMessageDataMinSize;
+    return path_mtu > overhead ? static_cast<uint16_t>(path_mtu - overhead) : 0;
+  }
+
+  uint16_t DiscoverTunnelMtu(const DeviceConfig &config, const PathMtuOptions &options)
+  {
+    uint16_t mtu = 0;
+    for (const auto &peer : config.peers)
+    {
+      struct sockaddr_storage endpoint;
+      socklen_t endpoint_len;
+      if (peer.endpoint.empty() || !ResolveEndpoint(peer.endpoint, &endpoint, &endpoint_len))
+      {
+        continue;
+      }
+      PathMtuResult result = DiscoverPathMtu(endpoint, endpoint_len, options);
+      uint16_t tunnel_mtu = TunnelMtuForPath(result.path_mtu, endpoint.ss_family);
+      mtu = mtu == 0 ? tunnel_mtu : std::min(mtu, tunnel_mtu);
+    }
+    return mtu;
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,57 @@
+#ifndef WIREGUARD_FLUTTER_PATH_MTU_H
+#define WIREGUARD_FLUTTER_PATH_MTU_H
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstdint>
+
+#include "config_parser.h"
+
+namespace wireguard_flutter {
+
+struct PathMtuOptions {
+  // The range searched, in outer packet sizes with the IP header. 1280 is
+  // the least IPv6 guarantees, and less than that is no path to tunnel over.
+  uint16_t min_mtu = 1280;
+  uint16_t max_mtu = 1500;
+  // How long to wait for the echo of a probe, and how many probes of a size
+  // go unanswered before it counts as too big. Once the endpoint has
+  // echoed, the wait shrinks to a few times its echo time.
+  std::chrono::milliseconds timeout{250};
+  int attempts = 2;
+};
+
+struct PathMtuResult {
+  // The largest packet found to get through, IP header included.
+  uint16_t path_mtu = 0;
+  // Whether the endpoint echoed probes. If it did not, |path_mtu| is only
+  // what the kernel knows: the route's MTU, lowered by any ICMP
+  // Fragmentation Needed the probes drew.
+  bool confirmed = false;
+  int probes = 0;
+  std::chrono::nanoseconds elapsed{0};
+};
+
+// Finds the path MTU to a UDP endpoint with a binary search over the sizes
+// of probes sent with DF set. A size gets through if the endpoint echoes
+// the probe in time, as a Device with SetPathProbeEcho() on does, and is
+// too big if the kernel or an ICMP error says so or every attempt times
+// out. Blocks for up to a few seconds. Throws std::runtime_error if no
+// socket can be set up.
+PathMtuResult DiscoverPathMtu(const struct sockaddr_storage &endpoint, socklen_t endpoint_len,
+                              const PathMtuOptions &options = PathMtuOptions());
+
+// The largest tunnel MTU whose packets, once encapsulated, fit |path_mtu|.
+uint16_t TunnelMtuForPath(uint16_t path_mtu, int family);
+
+// Probes the endpoint of every peer in |config| and returns the tunnel MTU
+// that fits all their paths, ready for SetWgQuickMtu() before the tunnel
+// comes up. Returns 0 if no peer has an endpoint that resolves. On Linux
+// the plugin calls it through WireguardFlutterConfigWithPathMtu() on the
+// config it is about to hand to wg-quick.
+uint16_t DiscoverTunnelMtu(const DeviceConfig &config, const PathMtuOptions &options = PathMtuOptions());
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef WIREGUARD_FLUTTER_PEER_H
+#define WIREGUARD_FLUTTER_PEER_H
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "config_parser.h"
+#include "cookie.h"
+#include "crypto_pipeline.h"
+#include "fair_queue.h"
+#include "noise.h"
+#include "timer_wheel.h"
+
+namespace wireguard_flutter {
+
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+// The per-peer timers described in the whitepaper, run by the device's timer
+// wheel.
+struct PeerTimers {
+  Timer retransmit_handshake;
+  Timer send_keepalive;
+  Timer new_handshake;
+  Timer zero_key_material;
+  Timer persistent_keepalive;
+  int handshake_attempts = 0;
+};
+
+struct Peer {
+  uint8_t public_key[kCurve25519KeySize];
+  Handshake handshake;
+  PeerCookie cookie;
+  std::unique_ptr<Keypair> current_keypair;
+  std::unique_ptr<Keypair> previous_keypair;
+  std::unique_ptr<Keypair> next_keypair;
+
+  struct sockaddr_storage endpoint;
+  socklen_t endpoint_len = 0;
+  uint16_t persistent_keepalive = 0;
+  std::vector<IpPrefix> allowed_ips;
+  // The device queue the peer's packets leave on: sent from its UDP
+  // sockets, and written to its TUN queue once decrypted.
+  size_t queue = 0;
+
+  // Packets read from the TUN, waiting for the fair queue to let them go on
+  // to encryption.
+  TransmitFlow tx_flow;
+  // Packets waiting for a session to be established.
+  std::deque<std::vector<uint8_t>> staged_packets;
+  // Transport data in flight through the crypto workers, in arrival order.
+  PeerPacketQueue tx_queue;
+  PeerPacketQueue rx_queue;
+  PeerTimers timers;
+  TimePoint last_sent_handshake = TimePoint::min();
+  // When the initiation that began the current connect attempt went out;
+  // min() when no attempt is under way.
+  TimePoint connect_started = TimePoint::min();
+  // Whether the peer has had a session since its last handshake, until the
+  // keys are zeroed.
+  bool session_up = false;
+
+  std::atomic<uint64_t> tx_bytes{0};
+  std::atomic<uint64_t> rx_bytes{0};
+  // Wall-clock time of the last completed handshake, in nanoseconds since the epoch.
+  std::atomic<int64_t> last_handshake_ns{0};
+  std::atomic<uint64_t> handshakes{0};
+  // Connect attempts abandoned after kMaxTimerHandshakes retries.
+  std::atomic<uint64_t> handshake_timeouts{0};
+  // From the first initiation of the last successful connect attempt to its
+  // response.
+  std::atomic<int64_t> connect_latency_ns{0};
+  std::atomic<uint64_t> sessions_up{0};
+  std::atomic<uint64_t> sessions_down{0};
+};
+
+struct PeerStats {
+  uint8_t public_key[kCurve25519KeySize];
+  uint64_t tx_bytes;
+  uint64_t rx_bytes;
+  int64_t last_handshake_ns;
+  // Packets dropped because its transmit queue was full.
+  uint64_t tx_dropped;
+  uint64_t handshakes;
+  uint64_t handshake_timeouts;
+  int64_t connect_latency_ns;
+  bool session_up;
+  // Times a session came up after none, and went when its keys expired.
+  uint64_t sessions_up;
+  uint64_t sessions_down;
+};
+
+// Upper bounds of the connect latency histogram's buckets, in milliseconds;
+// a last bucket takes the rest.
+constexpr uint64_t kConnectLatencyBoundsMs[] = {5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000};
+constexpr size_t kConnectLatencyBuckets = sizeof(kConnectLatencyBoundsMs) / sizeof(kConnectLatencyBoundsMs[0]) + 1;
+
+// Connect latencies of all peers since the device was created.
+struct ConnectLatencyStats {
+  // Not cumulative: each counts only its own range.
+  uint64_t buckets[kConnectLatencyBuckets];
+  uint64_t count;
+  uint64_t sum_ns;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,241 @@
+#include "poly1305_kernels.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    typedef unsigned __int128 u128;
+
+    const uint64_t kMask26 = 0x3ffffff;
+    const uint64_t kMask42 = 0x3ffffffffffULL;
+    const uint64_t kMask44 = 0xfffffffffffULL;
+
+    // a * b modulo 2^130 - 5 in radix 2^44, partly reduced like the
+    // accumulator in Poly1305::Blocks.
+    void Multiply44(uint64_t out[3], const uint64_t a[3], const uint64_t b[3])
+    {
+      uint64_t s1 = b[1] * (5 << 2), s2 = b[2] * (5 << 2);
+      u128 d0 = (u128)a[0] * b[0] + (u128)a[1] * s2 + (u128)a[2] * s1;
+      u128 d1 = (u128)a[0] * b[1] + (u128)a[1] * b[0] + (u128)a[2] * s2;
+      u128 d2 = (u128)a[0] * b[2] + (u128)a[1] * b[1] + (u128)a[2] * b[0];
+      uint64_t c = (uint64_t)(d0 >> 44);
+      uint64_t h0 = (uint64_t)d0 & kMask44;
+      d1 += c;
+      c = (uint64_t)(d1 >> 44);
+      uint64_t h1 = (uint64_t)d1 & kMask44;
+      d2 += c;
+      c = (uint64_t)(d2 >> 42);
+      uint64_t h2 = (uint64_t)d2 & kMask42;
+      h0 += c * 5;
+      c = h0 >> 44;
+      out[0] = h0 & kMask44;
+      out[1] = h1 + c;
+      out[2] = h2;
+    }
+
+    // Radix 2^44 to five limbs of radix 2^26. The top limb takes whatever
+    // the input carries above 2^130.
+    void To26(uint64_t out[5], const uint64_t h[3])
+    {
+      uint64_t h0 = h[0], h1 = h[1], h2 = h[2];
+      uint64_t c = h0 >> 44;
+      h0 &= kMask44;
+      h1 += c;
+      c = h1 >> 44;
+      h1 &= kMask44;
+      h2 += c;
+      out[0] = h0 & kMask26;
+      out[1] = ((h0 >> 26) | (h1 << 18)) & kMask26;
+      out[2] = (h1 >> 8) & kMask26;
+      out[3] = ((h1 >> 34) | (h2 << 10)) & kMask26;
+      out[4] = h2 >> 16;
+    }
+
+    // Back from radix 2^26, carrying first so the limbs do not overlap.
+    void From26(uint64_t h[3], uint64_t l[5])
+    {
+      uint64_t c = l[0] >> 26;
+      l[0] &= kMask26;
+      for (int i = 1; i < 5; i++)
+      {
+        l[i] += c;
+        c = l[i] >> 26;
+        l[i] &= kMask26;
+      }
+      l[0] += c * 5;
+      c = l[0] >> 26;
+      l[0] &= kMask26;
+      l[1] += c;
+      uint64_t t = (l[1] >> 18) + (l[2] << 8) + (l[3] << 34);
+      h[0] = (l[0] | (l[1] << 26)) & kMask44;
+      h[1] = t & kMask44;
+      h[2] = (t >> 44) + (l[4] << 16);
+    }
+
+    struct Limbs
+    {
+      __m256i v[5];
+    };
+
+    // The multiplier for each lane, with its limbs 1 to 4 premultiplied by 5
+    // for the terms that wrap past 2^130.
+    struct Multiplier
+    {
+      __m256i r[5];
+      __m256i s[5];
+    };
+
+    __attribute__((target("avx2"))) Multiplier MakeMultiplier(const uint64_t *const lanes[4])
+    {
+      Multiplier m;
+      for (int i = 0; i < 5; i++)
+      {
+        m.r[i] = _mm256_set_epi64x(lanes[3][i], lanes[2][i], lanes[1][i], lanes[0][i]);
+        m.s[i] = _mm256_add_epi64(m.r[i], _mm256_slli_epi64(m.r[i], 2));
+      }
+      return m;
+    }
+
+    // Adds four message blocks, one per lane, with the 2^128 bit set.
+    __attribute__((target("avx2"))) void AddBlocks(Limbs *h, const uint8_t *data)
+    {
+      const __m256i mask = _mm256_set1_epi64x(kMask26);
+      __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+      __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 32));
+      // Low and high halves of the four blocks, in block order.
+      __m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+      __m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+      h->v[0] = _mm256_add_epi64(h->v[0], _mm256_and_si256(lo, mask));
+      h->v[1] = _mm256_add_epi64(h->v[1], _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask));
+      h->v[2] = _mm256_add_epi64(
+          h->v[2], _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)), mask));
+      h->v[3] = _mm256_add_epi64(h->v[3], _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask));
+      h->v[4] = _mm256_add_epi64(
+          h->v[4], _mm256_or_si256(_mm256_srli_epi64(hi, 40), _mm256_set1_epi64x(1 << 24)));
+    }
+
+    // h = h * m per lane, leaving every limb within about 26 bits.
+    __attribute__((target("avx2"))) void MultiplyLanes(Limbs *h, const Multiplier &m)
+    {
+      const __m256i mask = _mm256_set1_epi64x(kMask26);
+      const __m256i *a = h->v;
+      __m256i d0 = _mm256_mul_epu32(a[0], m.r[0]);
+      d0 = _mm256_add_epi64(d0, _mm256_mul_epu32(a[1], m.s[4]));
+      d0 = _mm256_add_epi64(d0, _mm256_mul_epu32(a[2], m.s[3]));
+      d0 = _mm256_add_epi64(d0, _mm256_mul_epu32(a[3], m.s[2]));
+      d0 = _mm256_add_epi64(d0, _mm256_mul_epu32(a[4], m.s[1]));
+      __m256i d1 = _mm256_mul_epu32(a[0], m.r[1]);
+      d1 = _mm256_add_epi64(d1, _mm256_mul_epu32(a[1], m.r[0]));
+      d1 = _mm256_add_epi64(d1, _mm256_mul_epu32(a[2], m.s[4]));
+      d1 = _mm256_add_epi64(d1, _mm256_mul_epu32(a[3], m.s[3]));
+      d1 = _mm256_add_epi64(d1, _mm256_mul_epu32(a[4], m.s[2]));
+      __m256i d2 = _mm256_mul_epu32(a[0], m.r[2]);
+      d2 = _mm256_add_epi64(d2, _mm256_mul_epu32(a[1], m.r[1]));
+      d2 = _mm256_add_epi64(d2, _mm256_mul_epu32(a[2], m.r[0]));
+      d2 = _mm256_add_epi64(d2, _mm256_mul_epu32(a[3], m.s[4]));
+      d2 = _mm256_add_epi64(d2, _mm256_mul_epu32(a[4], m.s[3]));
+      __m256i d3 = _mm256_mul_epu32(a[0], m.r[3]);
+      d3 = _mm256_add_epi64(d3, _mm256_mul_epu32(a[1], m.r[2]));
+      d3 = _mm256_add_epi64(d3, _mm256_mul_epu32(a[2], m.r[1]));
+      d3 = _mm256_add_epi64(d3, _mm256_mul_epu32(a[3], m.r[0]));
+      d3 = _mm256_add_epi64(d3, _mm256_mul_epu32(a[4], m.s[4]));
+      __m256i d4 = _mm256_mul_epu32(a[0], m.r[4]);
+      d4 = _mm256_add_epi64(d4, _mm256_mul_epu32(a[1], m.r[3]));
+      d4 = _mm256_add_epi64(d4, _mm256_mul_epu32(a[2], m.r[2]));
+      d4 = _mm256_add_epi64(d4, _mm256_mul_epu32(a[3], m.r[1]));
+      d4 = _mm256_add_epi64(d4, _mm256_mul_epu32(a[4], m.r[0]));
+
+      // Two carry chains interleaved, d0 to d2 and d3 through d4 to d0.
+      __m256i c = _mm256_srli_epi64(d3, 26);
+      d3 = _mm256_and_si256(d3, mask);
+      d4 = _mm256_add_epi64(d4, c);
+      c = _mm256_srli_epi64(d0, 26);
+      d0 = _mm256_and_si256(d0, mask);
+      d1 = _mm256_add_epi64(d1, c);
+      c = _mm256_srli_epi64(d4, 26);
+      d4 = _mm256_and_si256(d4, mask);
+      d0 = _mm256_add_epi64(d0, _mm256_add_epi64(c, _mm256_slli_epi64(c, 2)));
+      c = _mm256_srli_epi64(d1, 26);
+      d1 = _mm256_and_si256(d1, mask);
+      d2 = _mm256_add_epi64(d2, c);
+      c = _mm256_srli_epi64(d0, 26);
+      d0 = _mm256_and_si256(d0, mask);
+      d1 = _mm256_add_epi64(d1, c);
+      c = _mm256_srli_epi64(d2, 26);
+      d2 = _mm256_and_si256(d2, mask);
+      d3 = _mm256_add_epi64(d3, c);
+      c = _mm256_srli_epi64(d3, 26);
+      d3 = _mm256_and_si256(d3, mask);
+      d4 = _mm256_add_epi64(d4, c);
+
+      h->v[0] = d0;
+      h->v[1] = d1;
+      h->v[2] = d2;
+      h->v[3] = d3;
+      h->v[4] = d4;
+    }
+
+  } // namespace
+
+  __attribute__((target("avx2"))) void Poly1305BlocksAvx2(uint64_t h[3], const uint64_t r[3], const uint8_t *data,
+                                                          size_t blocks)
+  {
+    if (blocks == 0)
+    {
+      return;
+    }
+    // Powers r^1 to r^4, radix 2^26.
+    uint64_t powers44[4][3];
+    uint64_t powers[4][5];
+    powers44[0][0] = r[0];
+    powers44[0][1] = r[1];
+    powers44[0][2] = r[2];
+    for (int i = 1; i < 4; i++)
+    {
+      Multiply44(powers44[i], powers44[i - 1], r);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+      To26(powers[i], powers44[i]);
+    }
+    const uint64_t *const step_powers[4] = {powers[3], powers[3], powers[3], powers[3]};
+    // Lane i holds the stream of blocks i, i + 4, ..., so it ends on the
+    // block that wants r^(4 - i).
+    const uint64_t *const last_powers[4] = {powers[3], powers[2], powers[1], powers[0]};
+    const Multiplier step = MakeMultiplier(step_powers);
+    const Multiplier last = MakeMultiplier(last_powers);
+
+    uint64_t start[5];
+    To26(start, h);
+    Limbs acc;
+    for (int i = 0; i < 5; i++)
+    {
+      acc.v[i] = _mm256_set_epi64x(0, 0, 0, start[i]);
+    }
+    for (; blocks > 4; blocks -= 4, data += 64)
+    {
+      AddBlocks(&acc, data);
+      MultiplyLanes(&acc, step);
+    }
+    AddBlocks(&acc, data);
+    MultiplyLanes(&acc, last);
+
+    uint64_t sum[5];
+    for (int i = 0; i < 5; i++)
+    {
+      alignas(32) uint64_t lanes[4];
+      _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), acc.v[i]);
+      sum[i] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    From26(h, sum);
+  }
+
+} // namespace wireguard_flutter
+
+#endif
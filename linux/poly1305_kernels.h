@@ -0,0 +1,20 @@
+#ifndef WIREGUARD_FLUTTER_POLY1305_KERNELS_H
+#define WIREGUARD_FLUTTER_POLY1305_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace wireguard_flutter {
+
+#if defined(__x86_64__)
+// Absorbs |blocks| full 16-byte blocks, a multiple of four, into the
+// accumulator |h| keyed by |r|, both in the scalar code's three limbs of
+// radix 2^44. Four interleaved streams run one per lane in radix 2^26:
+// each multiplies by r^4 per step, and the last step multiplies the lanes
+// by r^4, r^3, r^2 and r before summing them.
+void Poly1305BlocksAvx2(uint64_t h[3], const uint64_t r[3], const uint8_t *data, size_t blocks);
+#endif
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,747 @@
+#include "profile_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include "chacha20poly1305.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const uint64_t kStoreMagic = 0x3146525046475721; // "!WGFPRF1"
+    const size_t kMinProfilesPerThread = 32;
+    const size_t kTarBlock = 512;
+    const char kConfExtension[] = ".conf";
+
+    // The tables, in the order they follow the records.
+    enum Table
+    {
+      kByName,
+      kByHost,
+      kByCountry,
+      kByKey,
+      kTables
+    };
+
+    struct StoreHeader
+    {
+      uint64_t magic;
+      uint32_t count;
+      // Slots in each table, a power of two.
+      uint32_t buckets;
+      // The whole file's size, so a truncated store is refused.
+      uint64_t size;
+      uint64_t reserved;
+    };
+
+    std::string ErrnoMessage(const std::string &what)
+    {
+      return what + ": " + strerror(errno);
+    }
+
+    uint64_t Hash(const std::string_view &value)
+    {
+      uint64_t hash = 14695981039346656037ull;
+      for (unsigned char c : value)
+      {
+        hash = (hash ^ c) * 1099511628211ull;
+      }
+      return hash;
+    }
+
+    std::string Lower(std::string text)
+    {
+      for (auto &c : text)
+      {
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+      }
+      return text;
+    }
+
+    bool EndsWith(const std::string &text, const char *suffix)
+    {
+      size_t len = strlen(suffix);
+      return text.size() >= len && text.compare(text.size() - len, len, suffix) == 0;
+    }
+
+    // A .conf file found in the source, and where its text is.
+    struct Source
+    {
+      std::string name;
+      // The file's path, or empty if it is in the archive at |offset|.
+      std::string path;
+      size_t offset = 0;
+      size_t len = 0;
+    };
+
+    struct Profile
+    {
+      std::string name;
+      std::string host;
+      std::string country;
+      std::string key;
+      std::string text;
+    };
+
+    void FindConfFiles(const std::string &directory, std::vector<Source> *sources)
+    {
+      DIR *dir = opendir(directory.c_str());
+      if (dir == nullptr)
+      {
+        throw std::runtime_error(ErrnoMessage("cannot open " + directory));
+      }
+      std::vector<std::string> subdirectories;
+      while (struct dirent *entry = readdir(dir))
+      {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..")
+        {
+          continue;
+        }
+        std::string path = directory + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+        {
+          continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+          subdirectories.push_back(path);
+        }
+        else if (S_ISREG(st.st_mode) && EndsWith(name, kConfExtension))
+        {
+          Source source;
+          source.name = name.substr(0, name.size() - strlen(kConfExtension));
+          source.path = path;
+          sources->push_back(source);
+        }
+      }
+      closedir(dir);
+      for (const auto &subdirectory : subdirectories)
+      {
+        FindConfFiles(subdirectory, sources);
+      }
+    }
+
+    bool ParseOctal(const char *field, size_t len, size_t *value)
+    {
+      size_t result = 0;
+      size_t i = 0;
+      while (i < len && field[i] == ' ')
+      {
+        i++;
+      }
+      for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+      {
+        result = result * 8 + (field[i] - '0');
+      }
+      *value = result;
+      return i < len && (field[i] == '\0' || field[i] == ' ');
+    }
+
+    // Lists the .conf files of a ustar archive held in |archive|.
+    void FindConfEntries(const std::string &archive, std::vector<Source> *sources)
+    {
+      size_t offset = 0;
+      while (offset + kTarBlock <= archive.size())
+      {
+        const char *header = archive.data() + offset;
+        if (header[0] == '\0')
+        {
+          return;
+        }
+        size_t size;
+        if (memcmp(header + 257, "ustar", 5) != 0 || !ParseOctal(header + 124, 12, &size) ||
+            size > archive.size() - offset - kTarBlock)
+        {
+          throw std::runtime_error("not a tar archive, or a damaged one");
+        }
+        char type = header[156];
+        std::string name(header, strnlen(header, 100));
+        std::string prefix(header + 345, strnlen(header + 345, 155));
+        if (!prefix.empty())
+        {
+          name = prefix + "/" + name;
+        }
+        if ((type == '0' || type == '\0') && EndsWith(name, kConfExtension))
+        {
+          size_t slash = name.rfind('/');
+          name = name.substr(slash == std::string::npos ? 0 : slash + 1);
+          Source source;
+          source.name = name.substr(0, name.size() - strlen(kConfExtension));
+          source.offset = offset + kTarBlock;
+          source.len = size;
+          sources->push_back(source);
+        }
+        offset += kTarBlock + (size + kTarBlock - 1) / kTarBlock * kTarBlock;
+      }
+    }
+
+    std::string ReadFile(const std::string &path)
+    {
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+      {
+        throw std::runtime_error(ErrnoMessage("cannot open " + path));
+      }
+      std::string text;
+      char buffer[16384];
+      ssize_t n;
+      while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+      {
+        text.append(buffer, n);
+      }
+      int error = errno;
+      close(fd);
+      if (n < 0)
+      {
+        errno = error;
+        throw std::runtime_error(ErrnoMessage("cannot read " + path));
+      }
+      return text;
+    }
+
+    bool IsCountry(const std::string &word)
+    {
+      return word.size() == 2 && isalpha(static_cast<unsigned char>(word[0])) &&
+             isalpha(static_cast<unsigned char>(word[1]));
+    }
+
+    // From a "# Country = XX" comment, else the name's first two-letter
+    // word.
+    std::string FindCountry(const std::string &name, const std::string &text)
+    {
+      size_t start = 0;
+      while (start < text.size())
+      {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos)
+        {
+          end = text.size();
+        }
+        std::string line = Lower(text.substr(start, end - start));
+        start = end + 1;
+        size_t hash = line.find_first_not_of(" \t");
+        if (hash == std::string::npos || line[hash] != '#')
+        {
+          continue;
+        }
+        size_t key = line.find_first_not_of(" \t", hash + 1);
+        if (key == std::string::npos || line.compare(key, 7, "country") != 0)
+        {
+          continue;
+        }
+        size_t eq = line.find_first_not_of(" \t", key + 7);
+        if (eq == std::string::npos || (line[eq] != '=' && line[eq] != ':'))
+        {
+          continue;
+        }
+        size_t value = line.find_first_not_of(" \t", eq + 1);
+        size_t value_end = line.find_last_not_of(" \t\r");
+        if (value != std::string::npos && value_end != std::string::npos && value_end >= value)
+        {
+          std::string country = line.substr(value, value_end - value + 1);
+          if (IsCountry(country))
+          {
+            return country;
+          }
+        }
+      }
+
+      std::string word;
+      for (size_t i = 0; i <= name.size(); i++)
+      {
+        if (i < name.size() && isalnum(static_cast<unsigned char>(name[i])))
+        {
+          word.push_back(name[i]);
+          continue;
+        }
+        if (IsCountry(word))
+        {
+          return Lower(word);
+        }
+        word.clear();
+      }
+      return "";
+    }
+
+    std::string EndpointHost(const std::string &endpoint)
+    {
+      if (!endpoint.empty() && endpoint.front() == '[')
+      {
+        size_t close = endpoint.find(']');
+        return Lower(endpoint.substr(1, close == std::string::npos ? std::string::npos : close - 1));
+      }
+      return Lower(endpoint.substr(0, endpoint.rfind(':')));
+    }
+
+    // Parses and validates one profile; throws std::runtime_error saying
+    // what is wrong with it.
+    Profile ParseProfile(const std::string &name, std::string text)
+    {
+      DeviceConfig config = ParseWgQuickConfig(text);
+      if (!config.has_private_key)
+      {
+        throw std::runtime_error("no PrivateKey");
+      }
+      if (config.peers.empty() || config.peers[0].endpoint.empty())
+      {
+        throw std::runtime_error("no peer with an Endpoint");
+      }
+      Profile profile;
+      profile.name = name;
+      profile.host = EndpointHost(config.peers[0].endpoint);
+      profile.country = FindCountry(name, text);
+      profile.key.assign(reinterpret_cast<const char *>(config.peers[0].public_key), kCurve25519KeySize);
+      profile.text = std::move(text);
+      SecureZero(config.private_key, sizeof(config.private_key));
+      return profile;
+    }
+
+    void WriteAll(int fd, const std::string &data, const std::string &path)
+    {
+      size_t written = 0;
+      while (written < data.size())
+      {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        if (n <= 0)
+        {
+          throw std::runtime_error(ErrnoMessage("cannot write " + path));
+        }
+        written += n;
+      }
+    }
+
+  } // namespace
+
+  struct ProfileStore::Record
+  {
+    uint64_t config_offset;
+    uint32_t config_len;
+    uint32_t name_offset;
+    uint32_t host_offset;
+    uint16_t name_len;
+    uint16_t host_len;
+    char country[2];
+    uint8_t reserved[2];
+    // The next record with the same host, country and key, in import
+    // order, or kNotFound.
+    uint32_t next[kTables - 1];
+    uint8_t public_key[kCurve25519KeySize];
+  };
+
+  constexpr uint32_t ProfileStore::kNotFound;
+
+  namespace
+  {
+
+    // Writes the store file: a header, the records, the tables of record
+    // ids by name, host, country and key, the names and hosts, and last the
+    // config texts, which are read only when a profile is loaded.
+    std::string BuildStore(const std::vector<Profile> &profiles)
+    {
+      typedef ProfileStore::Record Record;
+      uint32_t count = static_cast<uint32_t>(profiles.size());
+      uint32_t buckets = 16;
+      while (buckets < count * 2)
+      {
+        buckets *= 2;
+      }
+      size_t records_offset = sizeof(StoreHeader);
+      size_t tables_offset = records_offset + count * sizeof(Record);
+      size_t strings_offset = tables_offset + kTables * buckets * sizeof(uint32_t);
+      size_t strings_size = 0;
+      size_t configs_size = 0;
+      for (const auto &profile : profiles)
+      {
+        strings_size += profile.name.size() + profile.host.size();
+        configs_size += profile.text.size();
+      }
+      size_t configs_offset = strings_offset + strings_size;
+      if (configs_offset > UINT32_MAX)
+      {
+        throw std::runtime_error("too many profiles");
+      }
+
+      std::string file(configs_offset + configs_size, '\0');
+      auto *header = reinterpret_cast<StoreHeader *>(&file[0]);
+      header->magic = kStoreMagic;
+      header->count = count;
+      header->buckets = buckets;
+      header->size = file.size();
+      auto *records = reinterpret_cast<Record *>(&file[records_offset]);
+      auto *tables = reinterpret_cast<uint32_t *>(&file[tables_offset]);
+      std::fill(tables, tables + kTables * buckets, ProfileStore::kNotFound);
+
+      auto value = [&](int table, uint32_t id)
+      {
+        const Profile &profile = profiles[id];
+        const std::string *values[kTables] = {&profile.name, &profile.host, &profile.country, &profile.key};
+        return std::string_view(*values[table]);
+      };
+      // The last record of each chain, by its first.
+      std::vector<uint32_t> tails(kTables * count);
+      size_t strings = strings_offset;
+      size_t configs = configs_offset;
+      for (uint32_t id = 0; id < count; id++)
+      {
+        const Profile &profile = profiles[id];
+        Record &record = records[id];
+        record.name_offset = static_cast<uint32_t>(strings);
+        record.name_len = static_cast<uint16_t>(profile.name.size());
+        memcpy(&file[strings], profile.name.data(), profile.name.size());
+        strings += profile.name.size();
+        record.host_offset = static_cast<uint32_t>(strings);
+        record.host_len = static_cast<uint16_t>(profile.host.size());
+        memcpy(&file[strings], profile.host.data(), profile.host.size());
+        strings += profile.host.size();
+        memcpy(record.country, profile.country.data(), profile.country.size());
+        memcpy(record.public_key, profile.key.data(), kCurve25519KeySize);
+        record.config_offset = configs;
+        record.config_len = static_cast<uint32_t>(profile.text.size());
+        memcpy(&file[configs], profile.text.data(), profile.text.size());
+        configs += profile.text.size();
+        std::fill(record.next, record.next + kTables - 1, ProfileStore::kNotFound);
+
+        for (int table = 0; table < kTables; table++)
+        {
+          std::string_view key = value(table, id);
+          if (key.empty())
+          {
+            continue;
+          }
+          uint32_t *slots = tables + table * buckets;
+          for (uint64_t slot = Hash(key);; slot++)
+          {
+            uint32_t &head = slots[slot & (buckets - 1)];
+            if (head == ProfileStore::kNotFound)
+            {
+              head = id;
+              tails[table * count + id] = id;
+              break;
+            }
+            if (value(table, head) == key)
+            {
+              // Names are unique, so only the other tables chain.
+              uint32_t &tail = tails[table * count + head];
+              records[tail].next[table - 1] = id;
+              tail = id;
+              break;
+            }
+          }
+        }
+      }
+      return file;
+    }
+
+  } // namespace
+
+  ProfileImportResult ImportProfiles(const std::string &source, const std::string &store_path, size_t threads)
+  {
+    struct stat st;
+    if (stat(source.c_str(), &st) != 0)
+    {
+      throw std::runtime_error(ErrnoMessage("cannot open " + source));
+    }
+    std::vector<Source> sources;
+    std::string archive;
+    if (S_ISDIR(st.st_mode))
+    {
+      FindConfFiles(source, &sources);
+    }
+    else
+    {
+      archive = ReadFile(source);
+      FindConfEntries(archive, &sources);
+    }
+
+    // Reading and parsing are nearly all the work; each thread takes its
+    // own run of files.
+    size_t count = sources.size();
+    std::vector<Profile> parsed(count);
+    std::vector<std::string> errors(count);
+    auto parse = [&](size_t begin, size_t end)
+    {
+      for (size_t i = begin; i < end; i++)
+      {
+        try
+        {
+          std::string text = sources[i].path.empty() ? archive.substr(sources[i].offset, sources[i].len)
+                                                     : ReadFile(sources[i].path);
+          parsed[i] = ParseProfile(sources[i].name, std::move(text));
+        }
+        catch (const std::exception &e)
+        {
+          errors[i] = e.what();
+          if (errors[i].empty())
+          {
+            errors[i] = "invalid profile";
+          }
+        }
+      }
+    };
+    threads = threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max<size_t>(1, std::min(threads, count / kMinProfilesPerThread));
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++)
+    {
+      workers.emplace_back(parse, count * t / threads, count * (t + 1) / threads);
+    }
+    parse(0, count / threads);
+    for (auto &worker : workers)
+    {
+      worker.join();
+    }
+
+    ProfileImportResult result;
+    std::vector<Profile> profiles;
+    std::unordered_map<std::string, size_t> by_name;
+    auto add = [&](Profile &&profile)
+    {
+      auto it = by_name.find(profile.name);
+      if (it != by_name.end())
+      {
+        profiles[it->second] = std::move(profile);
+        return;
+      }
+      by_name.emplace(profile.name, profiles.size());
+      profiles.push_back(std::move(profile));
+    };
+    if (access(store_path.c_str(), F_OK) == 0)
+    {
+      ProfileStore old(store_path);
+      for (uint32_t id = 0; id < old.size(); id++)
+      {
+        ProfileSummary summary = old.Summary(id);
+        Profile profile;
+        profile.name = std::string(summary.name);
+        profile.host = std::string(summary.endpoint_host);
+        profile.country = std::string(summary.country);
+        profile.key.assign(reinterpret_cast<const char *>(summary.public_key), kCurve25519KeySize);
+        profile.text = old.Config(id);
+        add(std::move(profile));
+      }
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+      if (!errors[i].empty())
+      {
+        result.errors.push_back({sources[i].name, errors[i]});
+        continue;
+      }
+      add(std::move(parsed[i]));
+      result.imported++;
+    }
+    result.profiles = profiles.size();
+
+    std::string file = BuildStore(profiles);
+    for (auto &profile : profiles)
+    {
+      SecureZero(&profile.text[0], profile.text.size());
+    }
+    std::string temp_path = store_path + ".tmp";
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+      throw std::runtime_error(ErrnoMessage("cannot create " + temp_path));
+    }
+    try
+    {
+      WriteAll(fd, file, temp_path);
+      if (fsync(fd) != 0)
+      {
+        throw std::runtime_error(ErrnoMessage("cannot sync " + temp_path));
+      }
+    }
+    catch (...)
+    {
+      close(fd);
+      unlink(temp_path.c_str());
+      throw;
+    }
+    close(fd);
+    SecureZero(&file[0], file.size());
+    if (rename(temp_path.c_str(), store_path.c_str()) != 0)
+    {
+      unlink(temp_path.c_str());
+      throw std::runtime_error(ErrnoMessage("cannot replace " + store_path));
+    }
+    return result;
+  }
+
+  ProfileStore::ProfileStore(const std::string &path)
+  {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      throw std::runtime_error(ErrnoMessage("cannot open " + path));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      close(fd);
+      throw std::runtime_error(ErrnoMessage("cannot stat " + path));
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ < sizeof(StoreHeader))
+    {
+      close(fd);
+      throw std::runtime_error(path + " is not a profile store");
+    }
+    void *data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+      throw std::runtime_error(ErrnoMessage("cannot map " + path));
+    }
+    // Lookups touch a slot here and a record there; reading ahead would
+    // only pull in config texts nobody asked for.
+    madvise(data, size_, MADV_RANDOM);
+    data_ = static_cast<const uint8_t *>(data);
+
+    const auto *header = reinterpret_cast<const StoreHeader *>(data_);
+    count_ = header->count;
+    buckets_ = header->buckets;
+    size_t tables_offset = sizeof(StoreHeader) + static_cast<size_t>(count_) * sizeof(Record);
+    if (header->magic != kStoreMagic || header->size != size_ || buckets_ == 0 ||
+        (buckets_ & (buckets_ - 1)) != 0 || buckets_ < count_ ||
+        tables_offset + kTables * static_cast<size_t>(buckets_) * sizeof(uint32_t) > size_)
+    {
+      munmap(data, size_);
+      throw std::runtime_error(path + " is not a profile store, or a damaged one");
+    }
+    records_ = reinterpret_cast<const Record *>(data_ + sizeof(StoreHeader));
+    tables_ = reinterpret_cast<const uint32_t *>(data_ + tables_offset);
+  }
+
+  ProfileStore::~ProfileStore()
+  {
+    munmap(const_cast<uint8_t *>(data_), size_);
+  }
+
+  const ProfileStore::Record &ProfileStore::GetRecord(uint32_t id) const
+  {
+    if (id >= count_)
+    {
+      throw std::runtime_error("no such profile");
+    }
+    return records_[id];
+  }
+
+  std::string_view ProfileStore::Bytes(uint64_t offset, uint64_t len) const
+  {
+    if (offset > size_ || len > size_ - offset)
+    {
+      throw std::runtime_error("damaged profile store");
+    }
+    return std::string_view(reinterpret_cast<const char *>(data_ + offset), len);
+  }
+
+  ProfileSummary ProfileStore::Summary(uint32_t id) const
+  {
+    const Record &record = GetRecord(id);
+    ProfileSummary summary;
+    summary.name = Bytes(record.name_offset, record.name_len);
+    summary.endpoint_host = Bytes(record.host_offset, record.host_len);
+    summary.country = std::string_view(record.country, record.country[0] == '\0' ? 0 : 2);
+    summary.public_key = record.public_key;
+    return summary;
+  }
+
+  std::string ProfileStore::Config(uint32_t id) const
+  {
+    const Record &record = GetRecord(id);
+    return std::string(Bytes(record.config_offset, record.config_len));
+  }
+
+  std::vector<uint32_t> ProfileStore::FindChain(int table, const std::string_view &value) const
+  {
+    std::vector<uint32_t> ids;
+    if (value.empty())
+    {
+      return ids;
+    }
+    auto matches = [&](uint32_t id)
+    {
+      ProfileSummary summary = Summary(id);
+      switch (table)
+      {
+      case kByName:
+        return summary.name == value;
+      case kByHost:
+        return summary.endpoint_host == value;
+      case kByCountry:
+        return summary.country == value;
+      default:
+        return std::string_view(reinterpret_cast<const char *>(summary.public_key), kCurve25519KeySize) == value;
+      }
+    };
+    const uint32_t *slots = tables_ + static_cast<size_t>(table) * buckets_;
+    // Tables are at most half full, so a probe ends at an empty slot.
+    uint64_t hash = Hash(value);
+    for (uint32_t probes = 0; probes < buckets_; probes++)
+    {
+      uint32_t id = slots[(hash + probes) & (buckets_ - 1)];
+      if (id == kNotFound)
+      {
+        break;
+      }
+      if (matches(id))
+      {
+        // A damaged chain could loop; no chain is longer than the store.
+        for (uint32_t n = 0; id != kNotFound && n < count_; n++)
+        {
+          ids.push_back(id);
+          if (table == kByName)
+          {
+            break;
+          }
+          id = GetRecord(id).next[table - 1];
+        }
+        break;
+      }
+    }
+    return ids;
+  }
+
+  uint32_t ProfileStore::FindByName(const std::string &name) const
+  {
+    std::vector<uint32_t> ids = FindChain(kByName, name);
+    return ids.empty() ? kNotFound : ids[0];
+  }
+
+  std::vector<uint32_t> ProfileStore::FindByHost(const std::string &host) const
+  {
+    return FindChain(kByHost, Lower(host));
+  }
+
+  std::vector<uint32_t> ProfileStore::FindByCountry(const std::string &country) const
+  {
+    return FindChain(kByCountry, Lower(country));
+  }
+
+  std::vector<uint32_t> ProfileStore::FindByKey(const uint8_t key[kCurve25519KeySize]) const
+  {
+    return FindChain(kByKey, std::string_view(reinterpret_cast<const char *>(key), kCurve25519KeySize));
+  }
+
+} // namespace wireguard_flutter
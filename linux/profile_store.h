@@ -0,0 +1,99 @@
+#ifndef WIREGUARD_FLUTTER_PROFILE_STORE_H
+#define WIREGUARD_FLUTTER_PROFILE_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "config_parser.h"
+
+namespace wireguard_flutter {
+
+struct ProfileImportError {
+  std::string name;
+  std::string message;
+};
+
+struct ProfileImportResult {
+  // Profiles added or replaced by this import.
+  size_t imported = 0;
+  // Profiles in the store afterwards.
+  size_t profiles = 0;
+  std::vector<ProfileImportError> errors;
+};
+
+// Imports every .conf file under |source|, a directory or a tar archive,
+// into the profile store at |store_path|, parsing and validating them on
+// |threads| threads, 0 for one per CPU. A profile is named after its file,
+// without the extension, and replaces any stored profile of the same name;
+// the other stored profiles are kept. Files that fail to parse, or lack a
+// private key or a peer with an endpoint, are reported in |errors| and
+// skipped. The store is rewritten to a temporary file and renamed over the
+// old one, so readers see either store whole. Throws std::runtime_error if
+// |source| cannot be read or the store cannot be written.
+ProfileImportResult ImportProfiles(const std::string &source, const std::string &store_path, size_t threads = 0);
+
+struct ProfileSummary {
+  std::string_view name;
+  // The host of the first peer's endpoint, lowercased.
+  std::string_view endpoint_host;
+  // Two lowercase letters from a "# Country = XX" comment, or else from the
+  // first two-letter word of the name, e.g. "de" for "mullvad-de-ber-001";
+  // empty if neither has one.
+  std::string_view country;
+  // The first peer's public key.
+  const uint8_t *public_key;
+};
+
+// A profile store opened read-only. The store file is mapped into memory
+// and holds hash tables by name, endpoint host, country and server key, so
+// opening it reads only its header and a lookup probes a table slot or
+// two. A profile's config text is read and parsed only when asked for.
+// Lookups are thread-safe.
+class ProfileStore {
+ public:
+  static constexpr uint32_t kNotFound = UINT32_MAX;
+  // A profile as laid out in the file.
+  struct Record;
+
+  // Throws std::runtime_error if the store cannot be opened or is not one.
+  explicit ProfileStore(const std::string &path);
+  ~ProfileStore();
+
+  ProfileStore(const ProfileStore &) = delete;
+  ProfileStore &operator=(const ProfileStore &) = delete;
+
+  size_t size() const { return count_; }
+
+  // The id of the profile named |name|, or kNotFound.
+  uint32_t FindByName(const std::string &name) const;
+  // The ids of the profiles matching, in import order.
+  std::vector<uint32_t> FindByHost(const std::string &host) const;
+  std::vector<uint32_t> FindByCountry(const std::string &country) const;
+  std::vector<uint32_t> FindByKey(const uint8_t key[kCurve25519KeySize]) const;
+
+  // Valid as long as the store. Throws std::runtime_error if the record is
+  // damaged.
+  ProfileSummary Summary(uint32_t id) const;
+  // The profile's wg-quick text, as imported.
+  std::string Config(uint32_t id) const;
+  DeviceConfig Load(uint32_t id) const { return ParseWgQuickConfig(Config(id)); }
+
+ private:
+  const Record &GetRecord(uint32_t id) const;
+  std::string_view Bytes(uint64_t offset, uint64_t len) const;
+  std::vector<uint32_t> FindChain(int table, const std::string_view &value) const;
+
+  const uint8_t *data_;
+  size_t size_;
+  uint32_t count_;
+  uint32_t buckets_;
+  const Record *records_;
+  const uint32_t *tables_;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,158 @@
+#include "provisioning.h"
+
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "chacha20poly1305.h"
+#include "curve25519.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Fewer peers than this per thread are not worth starting one for.
+    const size_t kMinPeersPerThread = 64;
+
+    std::string JoinPrefixes(const std::vector<IpPrefix> &prefixes)
+    {
+      std::string joined;
+      for (const auto &prefix : prefixes)
+      {
+        if (!joined.empty())
+        {
+          joined += ", ";
+        }
+        joined += IpPrefixToString(prefix);
+      }
+      return joined;
+    }
+
+    std::string ClientConfig(const ProvisionedPeer &peer, const ProvisionOptions &options,
+                             const std::string &server_key, const std::string &allowed_ips)
+    {
+      std::string config = "[Interface]\nPrivateKey = " + EncodeBase64Key(peer.private_key) + "\n";
+      config += "Address = " + JoinPrefixes(peer.addresses) + "\n";
+      for (const auto &dns : options.dns)
+      {
+        config += "DNS = " + dns + "\n";
+      }
+      config += "\n[Peer]\nPublicKey = " + server_key + "\n";
+      config += "AllowedIPs = " + allowed_ips + "\n";
+      if (!options.endpoint.empty())
+      {
+        config += "Endpoint = " + options.endpoint + "\n";
+      }
+      if (options.persistent_keepalive != 0)
+      {
+        config += "PersistentKeepalive = " + std::to_string(options.persistent_keepalive) + "\n";
+      }
+      return config;
+    }
+
+  } // namespace
+
+  std::vector<ProvisionedPeer> ProvisionPeers(size_t count, const std::vector<AddressPool *> &pools,
+                                              const ProvisionOptions &options)
+  {
+    std::vector<ProvisionedPeer> peers(count);
+    for (size_t i = 0; i < count; i++)
+    {
+      for (AddressPool *pool : pools)
+      {
+        IpPrefix address;
+        if (!pool->Allocate(&address))
+        {
+          peers.resize(i + 1);
+          ReleasePeers(peers, pools);
+          throw std::runtime_error("no addresses left in " + IpPrefixToString(pool->subnet()));
+        }
+        peers[i].addresses.push_back(address);
+      }
+    }
+
+    std::string server_key = EncodeBase64Key(options.server_public_key);
+    std::string allowed_ips = options.client_allowed_ips.empty() ? "0.0.0.0/0, ::/0"
+                                                                  : JoinPrefixes(options.client_allowed_ips);
+    // Key generation is nearly all the work; each thread takes its own run
+    // of peers.
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto provision = [&](size_t begin, size_t end)
+    {
+      try
+      {
+        for (size_t i = begin; i < end; i++)
+        {
+          X25519GeneratePrivateKey(peers[i].private_key);
+          X25519PublicKey(peers[i].public_key, peers[i].private_key);
+          peers[i].client_config = ClientConfig(peers[i], options, server_key, allowed_ips);
+        }
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        error = std::current_exception();
+      }
+    };
+    size_t threads = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max<size_t>(1, std::min(threads, count / kMinPeersPerThread));
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++)
+    {
+      workers.emplace_back(provision, count * t / threads, count * (t + 1) / threads);
+    }
+    provision(0, count / threads);
+    for (auto &worker : workers)
+    {
+      worker.join();
+    }
+    if (error)
+    {
+      ReleasePeers(peers, pools);
+      for (auto &peer : peers)
+      {
+        SecureZero(peer.private_key, sizeof(peer.private_key));
+      }
+      std::rethrow_exception(error);
+    }
+    return peers;
+  }
+
+  std::string ServerPeerEntries(const std::vector<ProvisionedPeer> &peers)
+  {
+    std::string entries;
+    for (const auto &peer : peers)
+    {
+      if (!entries.empty())
+      {
+        entries += "\n";
+      }
+      entries += "[Peer]\nPublicKey = " + EncodeBase64Key(peer.public_key) + "\n";
+      entries += "AllowedIPs = " + JoinPrefixes(peer.addresses) + "\n";
+    }
+    return entries;
+  }
+
+  void ReleasePeers(const std::vector<ProvisionedPeer> &peers, const std::vector<AddressPool *> &pools)
+  {
+    for (const auto &peer : peers)
+    {
+      for (const auto &address : peer.addresses)
+      {
+        for (AddressPool *pool : pools)
+        {
+          if (pool->Free(address))
+          {
+            break;
+          }
+        }
+      }
+    }
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,53 @@
+#ifndef WIREGUARD_FLUTTER_PROVISIONING_H
+#define WIREGUARD_FLUTTER_PROVISIONING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "address_pool.h"
+#include "config_parser.h"
+
+namespace wireguard_flutter {
+
+// What every client provisioned for one server has in common.
+struct ProvisionOptions {
+  uint8_t server_public_key[kCurve25519KeySize];
+  // "host:port" the clients reach the server at.
+  std::string endpoint;
+  std::vector<std::string> dns;
+  // What the clients route into the tunnel; all of it if empty.
+  std::vector<IpPrefix> client_allowed_ips;
+  uint16_t persistent_keepalive = 0;
+  // Threads generating keys; 0 for one per CPU.
+  size_t threads = 0;
+};
+
+struct ProvisionedPeer {
+  uint8_t private_key[kCurve25519KeySize];
+  uint8_t public_key[kCurve25519KeySize];
+  // One host address from each pool.
+  std::vector<IpPrefix> addresses;
+  // The client's complete wg-quick config.
+  std::string client_config;
+};
+
+// Provisions |count| client peers of a gateway: takes a tunnel address for
+// each from every pool in |pools|, typically one IPv4 and one IPv6, and
+// generates their keypairs and client configs on |options.threads|
+// threads. All or nothing: if a pool runs out, whatever was taken is given
+// back and std::runtime_error is thrown.
+std::vector<ProvisionedPeer> ProvisionPeers(size_t count, const std::vector<AddressPool *> &pools,
+                                            const ProvisionOptions &options);
+
+// The [Peer] sections the server's own config needs for |peers|.
+std::string ServerPeerEntries(const std::vector<ProvisionedPeer> &peers);
+
+// Gives the addresses of |peers| back to |pools|, e.g. when the clients are
+// revoked.
+void ReleasePeers(const std::vector<ProvisionedPeer> &peers, const std::vector<AddressPool *> &pools);
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,124 @@
+#include "rate_limiter.h"
+
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "blake2s.h"
+#include "byte_order.h"
+#include "curve25519.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Twice kMaxEntries rounded up to a power of two keeps probe runs short.
+    const size_t kSlots = 8192;
+    const int64_t kNanosecondsPerSecond = 1000000000;
+    const int64_t kPacketCost = kNanosecondsPerSecond / RateLimiter::kPacketsPerSecond;
+    const int64_t kMaxTokens = kPacketCost * RateLimiter::kPacketsBurst;
+
+    int64_t Nanoseconds(RateLimiter::TimePoint time)
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+
+  } // namespace
+
+  constexpr int RateLimiter::kPacketsPerSecond;
+  constexpr int RateLimiter::kPacketsBurst;
+  constexpr size_t RateLimiter::kMaxEntries;
+
+  RateLimiter::RateLimiter() : entries_(kSlots)
+  {
+    RandomBytes(hash_key_, sizeof(hash_key_));
+  }
+
+  bool RateLimiter::Allow(const struct sockaddr_storage &from, socklen_t from_len, TimePoint now)
+  {
+    uint64_t address;
+    uint32_t family;
+    if (from.ss_family == AF_INET && from_len >= sizeof(struct sockaddr_in))
+    {
+      const struct sockaddr_in *in = reinterpret_cast<const struct sockaddr_in *>(&from);
+      address = LoadBe32(reinterpret_cast<const uint8_t *>(&in->sin_addr));
+      family = AF_INET;
+    }
+    else if (from.ss_family == AF_INET6 && from_len >= sizeof(struct sockaddr_in6))
+    {
+      // One /64 is usually one host, or one host's worth of addresses.
+      const struct sockaddr_in6 *in6 = reinterpret_cast<const struct sockaddr_in6 *>(&from);
+      memcpy(&address, &in6->sin6_addr, sizeof(address));
+      family = AF_INET6;
+    }
+    else
+    {
+      return false;
+    }
+
+    int64_t nanoseconds = Nanoseconds(now);
+    Entry *entry = Find(address, family);
+    if (entry->family != 0)
+    {
+      entry->tokens = std::min(kMaxTokens, entry->tokens + (nanoseconds - entry->last));
+      entry->last = nanoseconds;
+      if (entry->tokens < kPacketCost)
+      {
+        return false;
+      }
+      entry->tokens -= kPacketCost;
+      return true;
+    }
+
+    if (size_ >= kMaxEntries)
+    {
+      return false;
+    }
+    *entry = Entry{address, family, kMaxTokens - kPacketCost, nanoseconds};
+    size_++;
+    return true;
+  }
+
+  void RateLimiter::Age(TimePoint now)
+  {
+    // Linear probing cannot just clear slots, so survivors are put back into
+    // an emptied table.
+    int64_t nanoseconds = Nanoseconds(now);
+    std::vector<Entry> live;
+    for (Entry &entry : entries_)
+    {
+      if (entry.family != 0 && nanoseconds - entry.last < kNanosecondsPerSecond)
+      {
+        live.push_back(entry);
+      }
+      entry.family = 0;
+    }
+    for (const Entry &entry : live)
+    {
+      *Find(entry.address, entry.family) = entry;
+    }
+    size_ = live.size();
+  }
+
+  RateLimiter::Entry *RateLimiter::Find(uint64_t address, uint32_t family)
+  {
+    uint8_t input[12];
+    StoreLe64(input, address);
+    StoreLe32(input + 8, family);
+    uint8_t hash[8];
+    Blake2sHash(hash, sizeof(hash), input, sizeof(input), hash_key_, sizeof(hash_key_));
+
+    // The table is never more than three quarters full, so this finds either
+    // the source or a free slot.
+    size_t slot = LoadLe64(hash) & (kSlots - 1);
+    while (entries_[slot].family != 0 && (entries_[slot].address != address || entries_[slot].family != family))
+    {
+      slot = (slot + 1) & (kSlots - 1);
+    }
+    return &entries_[slot];
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,59 @@
+#ifndef WIREGUARD_FLUTTER_RATE_LIMITER_H
+#define WIREGUARD_FLUTTER_RATE_LIMITER_H
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace wireguard_flutter {
+
+// Per-source token buckets for handshake messages, as in the kernel
+// implementation: 20 a second with bursts of 5, per IPv4 address or IPv6
+// /64. Sources live in a fixed-size open-addressing table; Age() drops the
+// ones that have been quiet long enough to have a full bucket again, so
+// forgetting them changes nothing. Not thread-safe.
+class RateLimiter {
+ public:
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  static constexpr int kPacketsPerSecond = 20;
+  static constexpr int kPacketsBurst = 5;
+  // Sources tracked at most; a new source beyond that is refused until the
+  // next Age().
+  static constexpr size_t kMaxEntries = 6144;
+
+  RateLimiter();
+
+  // Whether a packet from |from| may be processed now. Takes a token if so.
+  bool Allow(const struct sockaddr_storage &from, socklen_t from_len, TimePoint now);
+
+  // Forgets sources idle for a second or more.
+  void Age(TimePoint now);
+
+  size_t size() const { return size_; }
+
+ private:
+  struct Entry {
+    // The IPv4 address or the IPv6 /64; |family| 0 marks a free slot.
+    uint64_t address;
+    uint32_t family;
+    // In nanoseconds: each packet costs a second divided by
+    // kPacketsPerSecond, and a full bucket holds kPacketsBurst packets.
+    int64_t tokens;
+    int64_t last;
+  };
+
+  Entry *Find(uint64_t address, uint32_t family);
+
+  std::vector<Entry> entries_;
+  size_t size_ = 0;
+  // Keys the slot hash, so sources cannot aim at one probe sequence.
+  uint8_t hash_key_[16];
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef WIREGUARD_FLUTTER_RCU_HASH_TABLE_H
+#define WIREGUARD_FLUTTER_RCU_HASH_TABLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+#include "epoch.h"
+
+namespace wireguard_flutter {
+
+// Hash table for lookups on the packet path. Readers take no lock: Find()
+// walks immutable nodes under an EpochGuard and copies the value out.
+// Writers never change a node a reader might be looking at; they publish a
+// replacement and retire the old one to the epoch domain, and growing the
+// table publishes a fresh bucket array with fresh nodes.
+//
+// Writers must be serialized by the caller. Find() may run on any thread,
+// concurrently with them and with each other. Value is copied on every
+// lookup and so should be small, such as a pointer or two.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class RcuHashTable {
+ public:
+  explicit RcuHashTable(size_t buckets = 16) : buckets_(NewBuckets(buckets)) {}
+
+  // No reader may be left inside the table.
+  ~RcuHashTable() {
+    Buckets *buckets = buckets_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i <= buckets->mask; i++) {
+      Node *node = buckets->heads[i].load(std::memory_order_relaxed);
+      while (node != nullptr) {
+        Node *next = node->next.load(std::memory_order_relaxed);
+        delete node;
+        node = next;
+      }
+    }
+    delete buckets;
+  }
+
+  RcuHashTable(const RcuHashTable &) = delete;
+  RcuHashTable &operator=(const RcuHashTable &) = delete;
+
+  // Copies the value for |key| to |value|, if there is one and |value| is
+  // not null.
+  bool Find(const Key &key, Value *value) const {
+    EpochGuard guard;
+    const Buckets *buckets = buckets_.load(std::memory_order_acquire);
+    const Node *node = buckets->heads[Hash()(key) & buckets->mask].load(std::memory_order_acquire);
+    for (; node != nullptr; node = node->next.load(std::memory_order_acquire)) {
+      if (node->key == key) {
+        if (value != nullptr) {
+          *value = node->value;
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool Contains(const Key &key) const { return Find(key, nullptr); }
+
+  // Adds |key| or replaces its value. Readers see either the old value or
+  // the new one.
+  void Insert(const Key &key, const Value &value) {
+    Buckets *buckets = buckets_.load(std::memory_order_relaxed);
+    std::atomic<Node *> &head = buckets->heads[Hash()(key) & buckets->mask];
+    std::atomic<Node *> *link = &head;
+    for (Node *node = link->load(std::memory_order_relaxed); node != nullptr;
+         node = node->next.load(std::memory_order_relaxed)) {
+      if (node->key == key) {
+        Node *replacement = new Node(key, value, node->next.load(std::memory_order_relaxed));
+        link->store(replacement, std::memory_order_release);
+        Retire(node);
+        return;
+      }
+      link = &node->next;
+    }
+    head.store(new Node(key, value, head.load(std::memory_order_relaxed)), std::memory_order_release);
+    if (++size_ > buckets->mask + 1) {
+      Grow();
+    }
+  }
+
+  bool Erase(const Key &key) {
+    Buckets *buckets = buckets_.load(std::memory_order_relaxed);
+    std::atomic<Node *> *link = &buckets->heads[Hash()(key) & buckets->mask];
+    for (Node *node = link->load(std::memory_order_relaxed); node != nullptr;
+         node = node->next.load(std::memory_order_relaxed)) {
+      if (node->key == key) {
+        link->store(node->next.load(std::memory_order_relaxed), std::memory_order_release);
+        Retire(node);
+        size_--;
+        return true;
+      }
+      link = &node->next;
+    }
+    return false;
+  }
+
+  // Only meaningful to writers.
+  size_t size() const { return size_; }
+
+ private:
+  struct Node {
+    Node(const Key &node_key, const Value &node_value, Node *node_next)
+        : key(node_key), value(node_value), next(node_next) {}
+
+    const Key key;
+    const Value value;
+    std::atomic<Node *> next;
+  };
+
+  struct Buckets {
+    explicit Buckets(size_t count) : mask(count - 1), heads(new std::atomic<Node *>[count]) {
+      for (size_t i = 0; i < count; i++) {
+        heads[i].store(nullptr, std::memory_order_relaxed);
+      }
+    }
+
+    size_t mask;
+    std::unique_ptr<std::atomic<Node *>[]> heads;
+  };
+
+  static Buckets *NewBuckets(size_t count) {
+    size_t rounded = 1;
+    while (rounded < count) {
+      rounded <<= 1;
+    }
+    return new Buckets(rounded);
+  }
+
+  static void Retire(Node *node) {
+    EpochDomain::Instance().Retire(node, [](void *object) { delete static_cast<Node *>(object); });
+  }
+
+  // Readers may be walking the old chains, so every node is copied rather
+  // than relinked; the old array and nodes go to the epoch domain. Doubling
+  // keeps the copying amortized O(1) per insert.
+  void Grow() {
+    Buckets *old_buckets = buckets_.load(std::memory_order_relaxed);
+    Buckets *buckets = new Buckets((old_buckets->mask + 1) * 2);
+    for (size_t i = 0; i <= old_buckets->mask; i++) {
+      Node *node = old_buckets->heads[i].load(std::memory_order_relaxed);
+      for (; node != nullptr; node = node->next.load(std::memory_order_relaxed)) {
+        std::atomic<Node *> &head = buckets->heads[Hash()(node->key) & buckets->mask];
+        head.store(new Node(node->key, node->value, head.load(std::memory_order_relaxed)),
+                   std::memory_order_relaxed);
+      }
+    }
+    buckets_.store(buckets, std::memory_order_release);
+
+    // Only now that nothing new can reach them.
+    for (size_t i = 0; i <= old_buckets->mask; i++) {
+      Node *node = old_buckets->heads[i].load(std::memory_order_relaxed);
+      while (node != nullptr) {
+        Node *next = node->next.load(std::memory_order_relaxed);
+        Retire(node);
+        node = next;
+      }
+    }
+    EpochDomain::Instance().Retire(old_buckets, [](void *object) { delete static_cast<Buckets *>(object); });
+  }
+
+  std::atomic<Buckets *> buckets_;
+  size_t size_ = 0;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,52 @@
+#include "replay_window.h"
+
+#include <cstring>
+
+#include "messages.h"
+
+namespace wireguard_flutter
+{
+
+  bool ReplayWindow::Accept(uint64_t counter)
+  {
+    if (counter >= kRejectAfterMessages)
+    {
+      return false;
+    }
+    // Shift by one so that counter zero is distinguishable from the initial state.
+    ++counter;
+    if (counter + kWindowSize < greatest_)
+    {
+      return false;
+    }
+
+    uint64_t index = counter / kWordBits;
+    if (counter > greatest_)
+    {
+      uint64_t index_current = greatest_ / kWordBits;
+      uint64_t diff = index - index_current;
+      uint64_t top = diff < static_cast<uint64_t>(kWords) ? diff : kWords;
+      for (uint64_t i = 1; i <= top; i++)
+      {
+        bitmap_[(i + index_current) % kWords] = 0;
+      }
+      greatest_ = counter;
+    }
+
+    uint64_t bit = 1ULL << (counter % kWordBits);
+    uint64_t &word = bitmap_[index % kWords];
+    if (word & bit)
+    {
+      return false;
+    }
+    word |= bit;
+    return true;
+  }
+
+  void ReplayWindow::Reset()
+  {
+    greatest_ = 0;
+    memset(bitmap_, 0, sizeof(bitmap_));
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,30 @@
+#ifndef WIREGUARD_FLUTTER_REPLAY_WINDOW_H
+#define WIREGUARD_FLUTTER_REPLAY_WINDOW_H
+
+#include <cstdint>
+
+namespace wireguard_flutter {
+
+// Sliding anti-replay window over receive counters (RFC 6479 layout, as used
+// by the kernel implementation).
+class ReplayWindow {
+ public:
+  static constexpr int kWordBits = 64;
+  static constexpr int kWords = 2048 / kWordBits;
+  static constexpr uint64_t kWindowSize = 2048 - kWordBits;
+
+  ReplayWindow() { Reset(); }
+
+  // Records |counter| and returns true unless it is a replay, too old or past
+  // the reject limit. Only call this once the packet has been authenticated.
+  bool Accept(uint64_t counter);
+  void Reset();
+
+ private:
+  uint64_t greatest_;
+  uint64_t bitmap_[kWords];
+};
+
+}  // namespace wireguard_flutter
+
+#endif
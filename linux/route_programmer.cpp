@@ -0,0 +1,466 @@
+#include "route_programmer.h"
+
+#include <errno.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include "byte_order.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Kept well under the default socket send buffer.
+    const size_t kBatchSize = 64 * 1024;
+    const size_t kMaxRouteMessage = 128;
+    // Each refused route draws an error message, which takes up about a
+    // kilobyte of the socket's receive buffer; a batch that is refused
+    // whole has to fit even the default buffer, or the kernel drops
+    // acknowledgements.
+    const size_t kMaxBatchRoutes = 128;
+    const size_t kReceiveBufferSize = 64 * 1024;
+    // Asked of the kernel for the netlink socket, for errors and dumps.
+    const int kSocketReceiveBuffer = 1024 * 1024;
+
+    size_t AddressSize(int family)
+    {
+      return family == AF_INET6 ? 16 : 4;
+    }
+
+    IpPrefix Normalize(const IpPrefix &prefix)
+    {
+      IpPrefix normalized;
+      normalized.family = prefix.family;
+      normalized.cidr = std::min<uint8_t>(prefix.cidr, static_cast<uint8_t>(AddressSize(prefix.family) * 8));
+      size_t bytes = normalized.cidr / 8;
+      memcpy(normalized.address, prefix.address, bytes);
+      if (normalized.cidr % 8 != 0)
+      {
+        normalized.address[bytes] = prefix.address[bytes] & static_cast<uint8_t>(0xff << (8 - normalized.cidr % 8));
+      }
+      return normalized;
+    }
+
+    // Any strict order does for diffing; whole words compare fastest.
+    bool PrefixLess(const IpPrefix &a, const IpPrefix &b)
+    {
+      uint64_t a_word = LoadLe64(a.address), b_word = LoadLe64(b.address);
+      if (a_word != b_word)
+      {
+        return a_word < b_word;
+      }
+      a_word = LoadLe64(a.address + 8);
+      b_word = LoadLe64(b.address + 8);
+      if (a_word != b_word)
+      {
+        return a_word < b_word;
+      }
+      if (a.family != b.family)
+      {
+        return a.family < b.family;
+      }
+      return a.cidr < b.cidr;
+    }
+
+    bool PrefixEqual(const IpPrefix &a, const IpPrefix &b)
+    {
+      return a.family == b.family && a.cidr == b.cidr && memcmp(a.address, b.address, sizeof(a.address)) == 0;
+    }
+
+    void AddAttribute(std::vector<uint8_t> *buffer, uint16_t type, const void *data, size_t len)
+    {
+      struct rtattr attribute;
+      attribute.rta_len = static_cast<unsigned short>(RTA_LENGTH(len));
+      attribute.rta_type = type;
+      size_t offset = buffer->size();
+      buffer->resize(offset + RTA_SPACE(len));
+      memcpy(buffer->data() + offset, &attribute, sizeof(attribute));
+      memcpy(buffer->data() + offset + RTA_LENGTH(0), data, len);
+    }
+
+  } // namespace
+
+  RouteProgrammer::RouteProgrammer(int netlink_fd, int ifindex, uint32_t table)
+      : fd_(netlink_fd), ifindex_(ifindex), table_(table), seq_(1), receive_buffer_(kReceiveBufferSize)
+  {
+  }
+
+  RouteProgrammer::~RouteProgrammer()
+  {
+    close(fd_);
+  }
+
+  RouteUpdate RouteProgrammer::Apply(const std::vector<IpPrefix> &prefixes)
+  {
+    std::vector<IpPrefix> wanted;
+    wanted.reserve(prefixes.size());
+    for (const auto &prefix : prefixes)
+    {
+      wanted.push_back(Normalize(prefix));
+    }
+    std::sort(wanted.begin(), wanted.end(), PrefixLess);
+    wanted.erase(std::unique(wanted.begin(), wanted.end(), PrefixEqual), wanted.end());
+
+    std::vector<IpPrefix> before = installed_;
+    RouteUpdate update;
+    size_t refused = 0;
+    int error = 0;
+    int failure = Update(wanted, &refused, &error, &update);
+    if (failure == ENOBUFS)
+    {
+      // The kernel dropped acknowledgements, so which requests it refused is
+      // unknown; read back what it has and go again from there.
+      Resync();
+      refused = 0;
+      error = 0;
+      failure = Update(wanted, &refused, &error, &update);
+      if (failure == ENOBUFS)
+      {
+        Resync();
+      }
+    }
+
+    std::vector<IpPrefix> changed;
+    std::set_difference(installed_.begin(), installed_.end(), before.begin(), before.end(),
+                        std::back_inserter(changed), PrefixLess);
+    update.added = changed.size();
+    changed.clear();
+    std::set_difference(before.begin(), before.end(), installed_.begin(), installed_.end(),
+                        std::back_inserter(changed), PrefixLess);
+    update.removed = changed.size();
+
+    if (failure != 0)
+    {
+      throw std::runtime_error("netlink failed while changing routes: " + std::string(strerror(failure)));
+    }
+    if (error != 0)
+    {
+      throw std::runtime_error("kernel refused " + std::to_string(refused) + " route(s): " + strerror(error));
+    }
+    return update;
+  }
+
+  int RouteProgrammer::Update(const std::vector<IpPrefix> &wanted, size_t *refused, int *error,
+                              RouteUpdate *update)
+  {
+    std::vector<IpPrefix> to_remove, to_add;
+    std::set_difference(installed_.begin(), installed_.end(), wanted.begin(), wanted.end(),
+                        std::back_inserter(to_remove), PrefixLess);
+    std::set_difference(wanted.begin(), wanted.end(), installed_.begin(), installed_.end(),
+                        std::back_inserter(to_add), PrefixLess);
+
+    int failure = 0;
+    std::vector<IpPrefix> not_removed, not_added;
+    size_t removes_answered = Submit(RTM_DELROUTE, to_remove, &not_removed, error, &failure, update);
+    size_t adds_answered = failure == 0 ? Submit(RTM_NEWROUTE, to_add, &not_added, error, &failure, update) : 0;
+    *refused += not_removed.size() + not_added.size();
+    // Requests the kernel never answered for may or may not have been done.
+    // Counting them as not done makes the next Apply() send them again,
+    // which is harmless either way.
+    not_removed.insert(not_removed.end(), to_remove.begin() + removes_answered, to_remove.end());
+    not_added.insert(not_added.end(), to_add.begin() + adds_answered, to_add.end());
+
+    // What is installed now: everything wanted, less what could not be
+    // added, plus what could not be removed.
+    if (not_added.empty() && not_removed.empty())
+    {
+      installed_ = wanted;
+    }
+    else
+    {
+      std::sort(not_added.begin(), not_added.end(), PrefixLess);
+      installed_.clear();
+      std::set_difference(wanted.begin(), wanted.end(), not_added.begin(), not_added.end(),
+                          std::back_inserter(installed_), PrefixLess);
+      installed_.insert(installed_.end(), not_removed.begin(), not_removed.end());
+      std::sort(installed_.begin(), installed_.end(), PrefixLess);
+    }
+    return failure;
+  }
+
+  size_t RouteProgrammer::Submit(uint16_t type, const std::vector<IpPrefix> &prefixes,
+                                 std::vector<IpPrefix> *refused, int *error, int *failure, RouteUpdate *update)
+  {
+    size_t next = 0;
+    while (next < prefixes.size())
+    {
+      batch_.clear();
+      size_t begin = next;
+      uint32_t first_seq = seq_;
+      size_t last_offset = 0;
+      while (next < prefixes.size() && next - begin < kMaxBatchRoutes &&
+             batch_.size() + kMaxRouteMessage <= kBatchSize)
+      {
+        last_offset = batch_.size();
+        AppendRoute(type, prefixes[next++], seq_++);
+      }
+      struct nlmsghdr last;
+      memcpy(&last, batch_.data() + last_offset, sizeof(last));
+      last.nlmsg_flags |= NLM_F_ACK;
+      memcpy(batch_.data() + last_offset, &last, sizeof(last));
+
+      ssize_t sent;
+      do
+      {
+        sent = send(fd_, batch_.data(), batch_.size(), 0);
+      } while (sent < 0 && errno == EINTR);
+      if (sent != static_cast<ssize_t>(batch_.size()))
+      {
+        *failure = sent < 0 ? errno : EMSGSIZE;
+        return begin;
+      }
+      update->batches++;
+      *failure = WaitForAck(type, first_seq, last.nlmsg_seq, prefixes.data() + begin, refused, error);
+      if (*failure != 0)
+      {
+        return begin;
+      }
+    }
+    return prefixes.size();
+  }
+
+  void RouteProgrammer::AppendRoute(uint16_t type, const IpPrefix &prefix, uint32_t seq)
+  {
+    size_t start = batch_.size();
+    batch_.resize(start + NLMSG_SPACE(sizeof(struct rtmsg)));
+
+    struct rtmsg route;
+    memset(&route, 0, sizeof(route));
+    route.rtm_family = static_cast<unsigned char>(prefix.family);
+    route.rtm_dst_len = prefix.cidr;
+    // Tables past 255 only fit the attribute.
+    route.rtm_table = table_ < 256 ? static_cast<unsigned char>(table_) : static_cast<unsigned char>(RT_TABLE_UNSPEC);
+    route.rtm_protocol = RTPROT_BOOT;
+    // As "ip route": a route through the link is scoped to it, and a delete
+    // matches any scope.
+    route.rtm_scope = type == RTM_NEWROUTE ? RT_SCOPE_LINK : RT_SCOPE_NOWHERE;
+    route.rtm_type = RTN_UNICAST;
+    memcpy(batch_.data() + start + NLMSG_HDRLEN, &route, sizeof(route));
+    AddAttribute(&batch_, RTA_DST, prefix.address, AddressSize(prefix.family));
+    AddAttribute(&batch_, RTA_OIF, &ifindex_, sizeof(ifindex_));
+    AddAttribute(&batch_, RTA_TABLE, &table_, sizeof(table_));
+
+    struct nlmsghdr header;
+    memset(&header, 0, sizeof(header));
+    header.nlmsg_len = static_cast<uint32_t>(batch_.size() - start);
+    header.nlmsg_type = type;
+    header.nlmsg_flags = NLM_F_REQUEST;
+    if (type == RTM_NEWROUTE)
+    {
+      header.nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+    }
+    header.nlmsg_seq = seq;
+    memcpy(batch_.data() + start, &header, sizeof(header));
+  }
+
+  int RouteProgrammer::WaitForAck(uint16_t type, uint32_t first_seq, uint32_t last_seq, const IpPrefix *requests,
+                                  std::vector<IpPrefix> *refused, int *error)
+  {
+    // Already there is as good as added, and already gone as removed.
+    int harmless = type == RTM_NEWROUTE ? EEXIST : ESRCH;
+    while (true)
+    {
+      ssize_t n = Receive();
+      if (n < 0)
+      {
+        return errno;
+      }
+      int len = static_cast<int>(n);
+      for (struct nlmsghdr *header = reinterpret_cast<struct nlmsghdr *>(receive_buffer_.data());
+           NLMSG_OK(header, len); header = NLMSG_NEXT(header, len))
+      {
+        // Sequence numbers may wrap; the offset into the batch does not.
+        uint32_t index = header->nlmsg_seq - first_seq;
+        if (header->nlmsg_type != NLMSG_ERROR || index > last_seq - first_seq ||
+            header->nlmsg_len < NLMSG_LENGTH(sizeof(int)))
+        {
+          continue;
+        }
+        int result;
+        memcpy(&result, NLMSG_DATA(header), sizeof(result));
+        if (result != 0 && -result != harmless)
+        {
+          refused->push_back(requests[index]);
+          if (*error == 0)
+          {
+            *error = -result;
+          }
+        }
+        if (header->nlmsg_seq == last_seq)
+        {
+          return 0;
+        }
+      }
+    }
+  }
+
+  void RouteProgrammer::Resync()
+  {
+    struct
+    {
+      struct nlmsghdr header;
+      struct rtmsg route;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = RTM_GETROUTE;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = seq_++;
+    request.route.rtm_family = AF_UNSPEC;
+    // Drops what is left of earlier replies. The kernel only starts a dump
+    // into a receive buffer with room, and reports ENOBUFS otherwise.
+    ssize_t drained;
+    do
+    {
+      drained = recv(fd_, receive_buffer_.data(), receive_buffer_.size(), MSG_DONTWAIT);
+    } while (drained > 0 || (drained < 0 && (errno == EINTR || errno == ENOBUFS)));
+    ssize_t sent;
+    do
+    {
+      sent = send(fd_, &request, sizeof(request), 0);
+    } while (sent < 0 && errno == EINTR);
+    if (sent != static_cast<ssize_t>(sizeof(request)))
+    {
+      throw std::runtime_error("netlink send failed: " + std::string(strerror(errno)));
+    }
+
+    std::vector<IpPrefix> routes;
+    while (true)
+    {
+      ssize_t n = Receive();
+      if (n < 0)
+      {
+        throw std::runtime_error("netlink route dump failed: " + std::string(strerror(errno)));
+      }
+      int len = static_cast<int>(n);
+      for (struct nlmsghdr *header = reinterpret_cast<struct nlmsghdr *>(receive_buffer_.data());
+           NLMSG_OK(header, len); header = NLMSG_NEXT(header, len))
+      {
+        // Late acknowledgements of earlier batches are of no interest now.
+        if (header->nlmsg_seq != request.header.nlmsg_seq)
+        {
+          continue;
+        }
+        if (header->nlmsg_type == NLMSG_DONE)
+        {
+          std::sort(routes.begin(), routes.end(), PrefixLess);
+          routes.erase(std::unique(routes.begin(), routes.end(), PrefixEqual), routes.end());
+          installed_ = std::move(routes);
+          return;
+        }
+        if (header->nlmsg_type == NLMSG_ERROR)
+        {
+          int result = 0;
+          if (header->nlmsg_len >= NLMSG_LENGTH(sizeof(int)))
+          {
+            memcpy(&result, NLMSG_DATA(header), sizeof(result));
+          }
+          throw std::runtime_error("netlink route dump failed: " + std::string(strerror(-result)));
+        }
+        if (header->nlmsg_type != RTM_NEWROUTE || header->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg)))
+        {
+          continue;
+        }
+        struct rtmsg route;
+        memcpy(&route, NLMSG_DATA(header), sizeof(route));
+        if ((route.rtm_family != AF_INET && route.rtm_family != AF_INET6) || route.rtm_type != RTN_UNICAST ||
+            route.rtm_protocol != RTPROT_BOOT || (route.rtm_flags & RTM_F_CLONED) != 0)
+        {
+          continue;
+        }
+        IpPrefix prefix;
+        prefix.family = route.rtm_family;
+        prefix.cidr = route.rtm_dst_len;
+        uint32_t table = route.rtm_table;
+        int oif = 0;
+        int attributes_len = static_cast<int>(RTM_PAYLOAD(header));
+        for (struct rtattr *attribute = RTM_RTA(NLMSG_DATA(header)); RTA_OK(attribute, attributes_len);
+             attribute = RTA_NEXT(attribute, attributes_len))
+        {
+          size_t payload = RTA_PAYLOAD(attribute);
+          if (attribute->rta_type == RTA_DST && payload == AddressSize(prefix.family))
+          {
+            memcpy(prefix.address, RTA_DATA(attribute), payload);
+          }
+          else if (attribute->rta_type == RTA_TABLE && payload == sizeof(table))
+          {
+            memcpy(&table, RTA_DATA(attribute), sizeof(table));
+          }
+          else if (attribute->rta_type == RTA_OIF && payload == sizeof(oif))
+          {
+            memcpy(&oif, RTA_DATA(attribute), sizeof(oif));
+          }
+        }
+        if (table == table_ && oif == ifindex_)
+        {
+          routes.push_back(Normalize(prefix));
+        }
+      }
+    }
+  }
+
+  ssize_t RouteProgrammer::Receive()
+  {
+    ssize_t n;
+    do
+    {
+      n = recv(fd_, receive_buffer_.data(), receive_buffer_.size(), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n == 0)
+    {
+      errno = EPIPE;
+      return -1;
+    }
+    return n;
+  }
+
+  int OpenRouteNetlink()
+  {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0)
+    {
+      throw std::runtime_error("netlink socket failed: " + std::string(strerror(errno)));
+    }
+    // Errors need not echo the whole request back.
+    int one = 1;
+    setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+    // Past net.core.rmem_max where privileged, for headroom over the errors
+    // a refused batch draws; the batch cap keeps the default enough anyway.
+    int receive_buffer = kSocketReceiveBuffer;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &receive_buffer, sizeof(receive_buffer)) != 0)
+    {
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    }
+    struct sockaddr_nl local;
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&local), sizeof(local)) != 0)
+    {
+      int error = errno;
+      close(fd);
+      throw std::runtime_error("netlink bind failed: " + std::string(strerror(error)));
+    }
+    return fd;
+  }
+
+  std::vector<IpPrefix> RoutesForConfig(const DeviceConfig &config)
+  {
+    std::vector<IpPrefix> routes;
+    for (const auto &peer : config.peers)
+    {
+      routes.insert(routes.end(), peer.allowed_ips.begin(), peer.allowed_ips.end());
+    }
+    return routes;
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,103 @@
+#ifndef WIREGUARD_FLUTTER_ROUTE_PROGRAMMER_H
+#define WIREGUARD_FLUTTER_ROUTE_PROGRAMMER_H
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "config_parser.h"
+
+namespace wireguard_flutter {
+
+struct RouteUpdate {
+  size_t added = 0;
+  size_t removed = 0;
+  // Datagrams sent to the kernel, each a batch of route messages.
+  size_t batches = 0;
+};
+
+// Keeps the routes through one link in step with a set of prefixes. It
+// remembers what it installed, and on each Apply() sends only the routes to
+// add and remove. Messages go out in batches of many per datagram, and only
+// the last of each batch asks for an acknowledgement: the kernel handles a
+// batch in order and reports failures anyway, so that one ack accounts for
+// the whole batch. Batches are capped so the errors a whole batch can draw
+// fit the receive buffer; if the kernel drops acknowledgements all the
+// same (ENOBUFS), it reads the routes back from the kernel instead. Not
+// thread-safe.
+class RouteProgrammer {
+ public:
+  // Takes ownership of |netlink_fd|, normally from OpenRouteNetlink(). Any
+  // datagram descriptor that answers like rtnetlink works, such as one end
+  // of a SOCK_SEQPACKET socketpair. Routes go through link |ifindex| in
+  // routing table |table|.
+  RouteProgrammer(int netlink_fd, int ifindex, uint32_t table);
+  ~RouteProgrammer();
+
+  RouteProgrammer(const RouteProgrammer &) = delete;
+  RouteProgrammer &operator=(const RouteProgrammer &) = delete;
+
+  // Makes the installed routes exactly |prefixes|; host bits are ignored and
+  // duplicates merged. Adding a route that exists, or removing one that is
+  // gone, counts as done. Throws std::runtime_error if the kernel refused
+  // any route or the socket failed, after recording what did change; routes
+  // whose fate is unknown count as not yet done, so the next Apply() sends
+  // them again.
+  RouteUpdate Apply(const std::vector<IpPrefix> &prefixes);
+
+  // Forgets the installed routes, for when the link went away and took
+  // them with it.
+  void Forget() { installed_.clear(); }
+
+  // Replaces what it remembers with the routes the kernel has through the
+  // link in the table, as installed with RTPROT_BOOT, for when that is in
+  // doubt, such as after a previous instance exited without cleaning up.
+  // Throws std::runtime_error if the dump fails.
+  void Resync();
+
+  size_t size() const { return installed_.size(); }
+
+ private:
+  // Sends the changes from the installed routes to |wanted| and records
+  // what the kernel did. Adds the routes it refused to |*refused|, with the
+  // first error in |*error|. Returns 0, or the errno of a send or receive
+  // that failed part way.
+  int Update(const std::vector<IpPrefix> &wanted, size_t *refused, int *error, RouteUpdate *update);
+  // Sends |prefixes| as |type| requests and waits for every batch to be
+  // acknowledged, adding those the kernel refused to |*refused|. Returns
+  // how many of |prefixes| the kernel answered for: all of them, unless a
+  // send or receive failed, with its errno in |*failure|.
+  size_t Submit(uint16_t type, const std::vector<IpPrefix> &prefixes, std::vector<IpPrefix> *refused, int *error,
+                int *failure, RouteUpdate *update);
+  void AppendRoute(uint16_t type, const IpPrefix &prefix, uint32_t seq);
+  // Reads acknowledgements until the one for |last_seq|, collecting the
+  // |requests| sent from |first_seq| on that failed. Returns 0, or the
+  // errno of a failed receive.
+  int WaitForAck(uint16_t type, uint32_t first_seq, uint32_t last_seq, const IpPrefix *requests,
+                 std::vector<IpPrefix> *refused, int *error);
+  // Receives into |receive_buffer_|, retrying on EINTR. Returns the length,
+  // or -1 with errno set, EPIPE if the socket was closed.
+  ssize_t Receive();
+
+  int fd_;
+  int ifindex_;
+  uint32_t table_;
+  uint32_t seq_;
+  // Sorted, normalized and unique.
+  std::vector<IpPrefix> installed_;
+  std::vector<uint8_t> batch_;
+  std::vector<uint8_t> receive_buffer_;
+};
+
+// An rtnetlink socket for RouteProgrammer. Throws std::runtime_error on
+// failure.
+int OpenRouteNetlink();
+
+// Every peer's AllowedIPs in |config|: the routes the tunnel needs.
+std::vector<IpPrefix> RoutesForConfig(const DeviceConfig &config);
+
+}  // namespace wireguard_flutter
+
+#endif
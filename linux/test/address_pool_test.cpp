@@ -0,0 +1,226 @@
+#include <cstring>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "address_pool.h"
+#include "provisioning.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    IpPrefix Prefix(const std::string &text)
+    {
+      IpPrefix prefix;
+      EXPECT_TRUE(ParseIpPrefix(text, &prefix));
+      return prefix;
+    }
+
+    std::string Allocated(AddressPool *pool)
+    {
+      IpPrefix address;
+      return pool->Allocate(&address) ? IpPrefixToString(address) : std::string("none");
+    }
+
+    // The host at |offset| from the start of fd00::/104.
+    IpPrefix Ipv6Host(size_t offset)
+    {
+      IpPrefix prefix = Prefix("fd00::/128");
+      prefix.address[13] = static_cast<uint8_t>(offset >> 16);
+      prefix.address[14] = static_cast<uint8_t>(offset >> 8);
+      prefix.address[15] = static_cast<uint8_t>(offset);
+      return prefix;
+    }
+
+    bool Throws(const std::string &subnet)
+    {
+      try
+      {
+        AddressPool pool(Prefix(subnet));
+      }
+      catch (const std::runtime_error &)
+      {
+        return true;
+      }
+      return false;
+    }
+
+  } // namespace
+
+  // Every host of a /24 in order, then nothing; the network and broadcast
+  // addresses are never handed out.
+  TEST(address_pool, Ipv4Exhaustion)
+  {
+    AddressPool pool(Prefix("10.8.0.77/24"));
+    EXPECT_EQ(pool.capacity(), static_cast<size_t>(254));
+    for (int host = 1; host <= 254; host++)
+    {
+      EXPECT_EQ(Allocated(&pool), "10.8.0." + std::to_string(host) + "/32");
+    }
+    EXPECT_EQ(pool.available(), static_cast<size_t>(0));
+    EXPECT_EQ(Allocated(&pool), std::string("none"));
+    EXPECT_FALSE(pool.Reserve(Prefix("10.8.0.0/32")));
+    EXPECT_FALSE(pool.Reserve(Prefix("10.8.0.255/32")));
+  }
+
+  // Freed addresses come back lowest first, and only what was taken can be
+  // freed.
+  TEST(address_pool, FreeAndReuse)
+  {
+    AddressPool pool(Prefix("192.168.50.0/24"));
+    for (int i = 0; i < 200; i++)
+    {
+      Allocated(&pool);
+    }
+    EXPECT_TRUE(pool.Free(Prefix("192.168.50.100/32")));
+    EXPECT_TRUE(pool.Free(Prefix("192.168.50.7/32")));
+    EXPECT_FALSE(pool.Free(Prefix("192.168.50.7/32")));
+    EXPECT_FALSE(pool.Free(Prefix("192.168.50.201/32")));
+    EXPECT_FALSE(pool.Free(Prefix("192.168.51.7/32")));
+    EXPECT_FALSE(pool.Free(Prefix("fd00::7/128")));
+    EXPECT_FALSE(pool.Free(Prefix("192.168.50.255/32")));
+    EXPECT_FALSE(pool.Free(Prefix("192.168.50.0/32")));
+    EXPECT_EQ(pool.available(), static_cast<size_t>(56));
+    EXPECT_EQ(Allocated(&pool), std::string("192.168.50.7/32"));
+    EXPECT_EQ(Allocated(&pool), std::string("192.168.50.100/32"));
+    EXPECT_EQ(Allocated(&pool), std::string("192.168.50.201/32"));
+  }
+
+  TEST(address_pool, Reserve)
+  {
+    AddressPool pool(Prefix("10.0.0.0/29"));
+    EXPECT_TRUE(pool.Reserve(Prefix("10.0.0.1/32")));
+    EXPECT_FALSE(pool.Reserve(Prefix("10.0.0.1/32")));
+    EXPECT_TRUE(pool.Reserve(Prefix("10.0.0.3/32")));
+    EXPECT_FALSE(pool.Reserve(Prefix("10.0.0.8/32")));
+    EXPECT_EQ(Allocated(&pool), std::string("10.0.0.2/32"));
+    EXPECT_EQ(Allocated(&pool), std::string("10.0.0.4/32"));
+    EXPECT_TRUE(pool.Free(Prefix("10.0.0.1/32")));
+    EXPECT_EQ(Allocated(&pool), std::string("10.0.0.1/32"));
+    EXPECT_EQ(pool.available(), static_cast<size_t>(2));
+  }
+
+  // Subnets with no host to hand out are refused; point-to-point ones use
+  // both their addresses.
+  TEST(address_pool, SubnetSizes)
+  {
+    EXPECT_TRUE(Throws("10.0.0.1/32"));
+    EXPECT_TRUE(Throws("fd00::1/128"));
+    EXPECT_FALSE(Throws("10.0.0.0/30"));
+
+    AddressPool pool(Prefix("10.0.0.0/31"));
+    EXPECT_EQ(pool.capacity(), static_cast<size_t>(2));
+    EXPECT_EQ(Allocated(&pool), std::string("10.0.0.0/32"));
+    EXPECT_EQ(Allocated(&pool), std::string("10.0.0.1/32"));
+    EXPECT_EQ(Allocated(&pool), std::string("none"));
+  }
+
+  // A larger subnet than the pool tracks only has its first kMaxAddresses
+  // used.
+  TEST(address_pool, LargeIpv6Subnet)
+  {
+    AddressPool pool(Prefix("fd00:1::/64"));
+    EXPECT_EQ(pool.capacity(), AddressPool::kMaxAddresses - 1);
+    EXPECT_EQ(Allocated(&pool), std::string("fd00:1::1/128"));
+    EXPECT_TRUE(pool.Reserve(Prefix("fd00:1::ff:ffff/128")));
+    EXPECT_FALSE(pool.Reserve(Prefix("fd00:1::100:0/128")));
+    EXPECT_FALSE(pool.Free(Prefix("fd00:1::/128")));
+  }
+
+  // Random allocations, reservations and frees across every level of the
+  // summary bitmap agree with a plain set of free addresses.
+  TEST(address_pool, MatchesModel)
+  {
+    AddressPool pool(Prefix("fd00::/104"));
+    std::set<size_t> free;
+    for (size_t offset = 1; offset < AddressPool::kMaxAddresses; offset++)
+    {
+      free.insert(free.end(), offset);
+    }
+    // Deep enough to empty whole summary words.
+    std::vector<size_t> taken;
+    for (size_t i = 0; i < 300000; i++)
+    {
+      IpPrefix address;
+      ASSERT_TRUE(pool.Allocate(&address));
+      taken.push_back(*free.begin());
+      free.erase(free.begin());
+    }
+    std::mt19937 rng(5);
+    for (int step = 0; step < 200000; step++)
+    {
+      switch (rng() % 3)
+      {
+      case 0:
+      {
+        IpPrefix address;
+        ASSERT_TRUE(pool.Allocate(&address));
+        EXPECT_EQ(IpPrefixToString(address), IpPrefixToString(Ipv6Host(*free.begin())));
+        taken.push_back(*free.begin());
+        free.erase(free.begin());
+        break;
+      }
+      case 1:
+      {
+        size_t offset = 1 + rng() % (AddressPool::kMaxAddresses - 1);
+        EXPECT_EQ(pool.Reserve(Ipv6Host(offset)), free.erase(offset) == 1);
+        taken.push_back(offset);
+        break;
+      }
+      default:
+      {
+        if (taken.empty())
+        {
+          break;
+        }
+        size_t index = rng() % taken.size();
+        size_t offset = taken[index];
+        taken[index] = taken.back();
+        taken.pop_back();
+        EXPECT_EQ(pool.Free(Ipv6Host(offset)), free.insert(offset).second);
+        break;
+      }
+      }
+    }
+    EXPECT_EQ(pool.available(), free.size());
+  }
+
+  // Provisioning more peers than a pool has room for takes nothing.
+  TEST(address_pool, ProvisioningIsAllOrNothing)
+  {
+    AddressPool v4(Prefix("10.9.0.0/29"));
+    AddressPool v6(Prefix("fd09::/120"));
+    ASSERT_TRUE(v4.Reserve(Prefix("10.9.0.1/32")));
+    ProvisionOptions options;
+    memset(options.server_public_key, 0x11, sizeof(options.server_public_key));
+    options.endpoint = "vpn.example.com:51820";
+    options.threads = 2;
+    bool thrown = false;
+    try
+    {
+      ProvisionPeers(6, {&v4, &v6}, options);
+    }
+    catch (const std::runtime_error &)
+    {
+      thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+    EXPECT_EQ(v4.available(), static_cast<size_t>(5));
+    EXPECT_EQ(v6.available(), v6.capacity());
+
+    std::vector<ProvisionedPeer> peers = ProvisionPeers(5, {&v4, &v6}, options);
+    ASSERT_EQ(peers.size(), static_cast<size_t>(5));
+    EXPECT_EQ(IpPrefixToString(peers[0].addresses[0]), std::string("10.9.0.2/32"));
+    EXPECT_EQ(v4.available(), static_cast<size_t>(0));
+    ReleasePeers(peers, {&v4, &v6});
+    EXPECT_EQ(v4.available(), static_cast<size_t>(5));
+    EXPECT_EQ(v6.available(), v6.capacity());
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,62 @@
+#ifndef WIREGUARD_FLUTTER_TEST_BENCHMARK_H
+#define WIREGUARD_FLUTTER_TEST_BENCHMARK_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace wireguard_flutter {
+namespace benchmark {
+
+// Benchmarks for the data plane, run by hand rather than by CTest, as their
+// numbers only mean something on the machine they ran on. BENCHMARK(name)
+// registers one; the runner runs those named on its command line, or every
+// one, and each prints its own results, a line per measurement.
+
+typedef void (*BenchmarkFunction)();
+
+struct BenchmarkRegistration {
+  BenchmarkRegistration(const char *name, BenchmarkFunction function);
+};
+
+// Seconds on the steady clock, from an arbitrary start.
+inline double Now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Calls |fn| in rounds of |batch| until about |seconds| have passed, and
+// returns calls per second.
+template <typename Fn>
+double CallsPerSecond(Fn fn, double seconds = 0.5, int batch = 64) {
+  const double start = Now();
+  uint64_t calls = 0;
+  double elapsed = 0;
+  do {
+    for (int i = 0; i < batch; i++) {
+      fn();
+    }
+    calls += batch;
+    elapsed = Now() - start;
+  } while (elapsed < seconds);
+  return calls / elapsed;
+}
+
+// The process's peak resident set size since the last ResetPeakMemory(), in
+// bytes, from /proc/self/status; 0 where that cannot be read.
+size_t PeakMemory();
+// The resident set size now.
+size_t CurrentMemory();
+// Starts a new peak at the current resident set size, where the kernel
+// allows it.
+void ResetPeakMemory();
+
+}  // namespace benchmark
+}  // namespace wireguard_flutter
+
+#define BENCHMARK(name)                                                                             \
+  static void name##_Benchmark();                                                                   \
+  static ::wireguard_flutter::benchmark::BenchmarkRegistration name##_registration(#name,           \
+                                                                                   name##_Benchmark); \
+  static void name##_Benchmark()
+
+#endif
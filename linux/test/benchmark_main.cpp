@@ -0,0 +1,120 @@
+#include "benchmark.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace wireguard_flutter
+{
+  namespace benchmark
+  {
+
+    namespace
+    {
+
+      struct Benchmark
+      {
+        const char *name;
+        BenchmarkFunction function;
+      };
+
+      std::vector<Benchmark> &Registry()
+      {
+        static std::vector<Benchmark> registry;
+        return registry;
+      }
+
+      // A "Vm...:  1234 kB" line of /proc/self/status, in bytes.
+      size_t ReadStatus(const char *field)
+      {
+        FILE *file = fopen("/proc/self/status", "r");
+        if (file == nullptr)
+        {
+          return 0;
+        }
+        char line[256];
+        size_t kb = 0;
+        size_t field_len = strlen(field);
+        while (fgets(line, sizeof(line), file) != nullptr)
+        {
+          if (strncmp(line, field, field_len) == 0 && line[field_len] == ':')
+          {
+            kb = strtoul(line + field_len + 1, nullptr, 10);
+            break;
+          }
+        }
+        fclose(file);
+        return kb * 1024;
+      }
+
+    } // namespace
+
+    BenchmarkRegistration::BenchmarkRegistration(const char *name, BenchmarkFunction function)
+    {
+      Registry().push_back({name, function});
+    }
+
+    size_t PeakMemory()
+    {
+      return ReadStatus("VmHWM");
+    }
+
+    size_t CurrentMemory()
+    {
+      return ReadStatus("VmRSS");
+    }
+
+    void ResetPeakMemory()
+    {
+      // Writing 5 to clear_refs resets VmHWM to the current RSS.
+      FILE *file = fopen("/proc/self/clear_refs", "w");
+      if (file != nullptr)
+      {
+        fputs("5", file);
+        fclose(file);
+      }
+    }
+
+  } // namespace benchmark
+} // namespace wireguard_flutter
+
+// Runs the benchmarks named by the arguments, or every one; --list prints
+// their names.
+int main(int argc, char **argv)
+{
+  using namespace wireguard_flutter::benchmark;
+  if (argc > 1 && strcmp(argv[1], "--list") == 0)
+  {
+    for (const Benchmark &benchmark : Registry())
+    {
+      printf("%s\n", benchmark.name);
+    }
+    return 0;
+  }
+  int run = 0;
+  for (const Benchmark &benchmark : Registry())
+  {
+    bool selected = argc == 1;
+    for (int i = 1; i < argc; i++)
+    {
+      selected = selected || strcmp(argv[i], benchmark.name) == 0;
+    }
+    if (!selected)
+    {
+      continue;
+    }
+    run++;
+    printf("== %s\n", benchmark.name);
+    fflush(stdout);
+    benchmark.function();
+    fflush(stdout);
+  }
+  if (run == 0)
+  {
+    fprintf(stderr, "no benchmarks match; --list shows them\n");
+    return 1;
+  }
+  return 0;
+}
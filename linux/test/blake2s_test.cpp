@@ -0,0 +1,168 @@
+#include <array>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "blake2s.h"
+#include "messages.h"
+#include "noise.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    using test::ToHex;
+
+    const std::array<Blake2sImplementation, 3> kImplementations = {
+        Blake2sImplementation::kScalar, Blake2sImplementation::kSse41, Blake2sImplementation::kAvx2};
+
+    // Selects an implementation for the life of the object, then restores
+    // the one that was active.
+    class ScopedImplementation
+    {
+    public:
+      explicit ScopedImplementation(Blake2sImplementation implementation)
+          : previous_(ActiveBlake2sImplementation()), supported_(SetBlake2sImplementation(implementation)) {}
+      ~ScopedImplementation() { SetBlake2sImplementation(previous_); }
+
+      bool supported() const { return supported_; }
+
+    private:
+      Blake2sImplementation previous_;
+      bool supported_;
+    };
+
+  } // namespace
+
+  // RFC 7693 appendix A, in every lane of a batch longer than the kernel's
+  // eight.
+  TEST(blake2s, BatchVector)
+  {
+    const std::string abc = "abc";
+    for (Blake2sImplementation implementation : kImplementations)
+    {
+      ScopedImplementation scoped(implementation);
+      if (!scoped.supported())
+      {
+        continue;
+      }
+      std::vector<std::array<uint8_t, kBlake2sHashSize>> out(11);
+      std::vector<Blake2sJob> jobs;
+      for (auto &digest : out)
+      {
+        jobs.push_back(Blake2sJob{reinterpret_cast<const uint8_t *>(abc.data()), abc.size(), digest.data()});
+      }
+      Blake2sHashBatch(jobs.data(), jobs.size(), kBlake2sHashSize);
+      for (const auto &digest : out)
+      {
+        EXPECT_EQ(ToHex(digest.data(), digest.size()),
+                  std::string("508c5e8c327c14e2e1a72ba34eeb452f37458b209ed63a294d999b4c86675982"));
+      }
+    }
+  }
+
+  // Batches of mixed lengths, keyed and not, match one-at-a-time hashing
+  // under every implementation.
+  TEST(blake2s, BatchMatchesSingle)
+  {
+    std::mt19937 rng(3);
+    std::vector<uint8_t> data(4096);
+    for (uint8_t &b : data)
+    {
+      b = static_cast<uint8_t>(rng());
+    }
+    for (Blake2sImplementation implementation : kImplementations)
+    {
+      ScopedImplementation scoped(implementation);
+      if (!scoped.supported())
+      {
+        continue;
+      }
+      for (size_t key_len : {0, 16, 32})
+      {
+        for (size_t out_len : {16, 32})
+        {
+          for (size_t count = 1; count <= 20; count++)
+          {
+            std::vector<size_t> lens, offsets;
+            for (size_t i = 0; i < count; i++)
+            {
+              // Some empty, which a keyed batch has to hash on their own.
+              lens.push_back(i % 7 == 0 ? 0 : rng() % 300);
+              offsets.push_back(rng() % 3000);
+            }
+            std::vector<std::vector<uint8_t>> out(count, std::vector<uint8_t>(out_len));
+            std::vector<Blake2sJob> jobs;
+            for (size_t i = 0; i < count; i++)
+            {
+              jobs.push_back(Blake2sJob{&data[offsets[i]], lens[i], out[i].data()});
+            }
+            Blake2sHashBatch(jobs.data(), count, out_len, key_len != 0 ? &data[4000] : nullptr, key_len);
+            for (size_t i = 0; i < count; i++)
+            {
+              std::vector<uint8_t> expected(out_len);
+              Blake2sHash(expected.data(), out_len, &data[offsets[i]], lens[i], &data[4000], key_len);
+              EXPECT_EQ(ToHex(out[i].data(), out_len), ToHex(expected.data(), out_len));
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // CheckMac1Batch() agrees with CheckMac1() on a mix of initiations and
+  // responses, some with a bad mac1.
+  TEST(blake2s, Mac1Batch)
+  {
+    uint8_t public_key[kCurve25519KeySize], mac1_key[kBlake2sHashSize];
+    memset(public_key, 0x24, sizeof(public_key));
+    ComputeMac1Key(mac1_key, public_key);
+    for (Blake2sImplementation implementation : kImplementations)
+    {
+      ScopedImplementation scoped(implementation);
+      if (!scoped.supported())
+      {
+        continue;
+      }
+      std::vector<MessageInitiation> initiations(9);
+      std::vector<MessageResponse> responses(8);
+      std::vector<Mac1Check> checks;
+      std::vector<bool> expected;
+      for (size_t i = 0; i < initiations.size(); i++)
+      {
+        uint8_t *msg = reinterpret_cast<uint8_t *>(&initiations[i]);
+        memset(msg, static_cast<int>(i), sizeof(MessageInitiation));
+        AddMacs(msg, sizeof(MessageInitiation), mac1_key, nullptr);
+        if (i % 3 == 0)
+        {
+          msg[i] ^= 0x80;
+        }
+        checks.push_back(Mac1Check{msg, sizeof(MessageInitiation), false});
+        expected.push_back(i % 3 != 0);
+      }
+      for (size_t i = 0; i < responses.size(); i++)
+      {
+        uint8_t *msg = reinterpret_cast<uint8_t *>(&responses[i]);
+        memset(msg, static_cast<int>(100 + i), sizeof(MessageResponse));
+        AddMacs(msg, sizeof(MessageResponse), mac1_key, nullptr);
+        if (i % 4 == 1)
+        {
+          responses[i].macs.mac1[0] ^= 1;
+        }
+        checks.push_back(Mac1Check{msg, sizeof(MessageResponse), false});
+        expected.push_back(i % 4 != 1);
+      }
+      CheckMac1Batch(checks.data(), checks.size(), mac1_key);
+      for (size_t i = 0; i < checks.size(); i++)
+      {
+        EXPECT_EQ(checks[i].valid, static_cast<bool>(expected[i]));
+        EXPECT_EQ(CheckMac1(checks[i].msg, checks[i].len, mac1_key), static_cast<bool>(expected[i]));
+      }
+    }
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,212 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "cookie.h"
+#include "curve25519.h"
+#include "rate_limiter.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    typedef std::chrono::steady_clock Clock;
+    using std::chrono::milliseconds;
+    using std::chrono::seconds;
+
+    const Clock::time_point kStart = Clock::time_point() + std::chrono::hours(1000);
+
+    socklen_t Ipv4(struct sockaddr_storage *address, const char *ip, uint16_t port)
+    {
+      memset(address, 0, sizeof(*address));
+      struct sockaddr_in *sin = reinterpret_cast<struct sockaddr_in *>(address);
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons(port);
+      inet_pton(AF_INET, ip, &sin->sin_addr);
+      return sizeof(*sin);
+    }
+
+    socklen_t Ipv6(struct sockaddr_storage *address, const char *ip)
+    {
+      memset(address, 0, sizeof(*address));
+      struct sockaddr_in6 *sin6 = reinterpret_cast<struct sockaddr_in6 *>(address);
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons(51820);
+      inet_pton(AF_INET6, ip, &sin6->sin6_addr);
+      return sizeof(*sin6);
+    }
+
+    // A responder and an initiator that knows its public key.
+    struct CookieFixture
+    {
+      CookieFixture()
+      {
+        uint8_t private_key[kCurve25519KeySize];
+        X25519GeneratePrivateKey(private_key);
+        SetStaticIdentity(&identity, private_key);
+        checker.SetIdentity(identity);
+        InitPeerCookie(&cookie, identity.public_key);
+        memset(&msg, 0x33, sizeof(msg));
+        msg.type = kMessageInitiation;
+      }
+
+      uint8_t *bytes() { return reinterpret_cast<uint8_t *>(&msg); }
+
+      bool Mac2Zero() const
+      {
+        static const uint8_t kZero[kCookieSize] = {};
+        return memcmp(msg.macs.mac2, kZero, kCookieSize) == 0;
+      }
+
+      StaticIdentity identity;
+      CookieChecker checker;
+      PeerCookie cookie;
+      MessageInitiation msg;
+    };
+
+  } // namespace
+
+  // Under load the responder answers with a cookie; the initiator's next
+  // message carries a mac2 the responder accepts from that address only.
+  TEST(cookie, CookieRoundTrip)
+  {
+    CookieFixture f;
+    struct sockaddr_storage from, other;
+    socklen_t from_len = Ipv4(&from, "192.0.2.1", 51820);
+    socklen_t other_len = Ipv4(&other, "192.0.2.2", 51820);
+
+    AddCookieMacs(f.bytes(), sizeof(f.msg), f.identity.mac1_key, &f.cookie, kStart);
+    EXPECT_TRUE(f.Mac2Zero());
+    Mac1Check check = {f.bytes(), sizeof(f.msg), false};
+    f.checker.CheckMac1(&check, 1);
+    EXPECT_TRUE(check.valid);
+    EXPECT_FALSE(f.checker.CheckMac2(f.bytes(), sizeof(f.msg), from, from_len, kStart));
+
+    MessageCookieReply reply;
+    f.checker.CreateReply(&reply, f.bytes(), sizeof(f.msg), 1234, from, from_len, kStart);
+    EXPECT_EQ(reply.type, static_cast<uint32_t>(kMessageCookieReply));
+    EXPECT_EQ(reply.receiver_index, static_cast<uint32_t>(1234));
+
+    MessageCookieReply forged = reply;
+    forged.encrypted_cookie[0] ^= 1;
+    EXPECT_FALSE(ConsumeCookieReply(forged, &f.cookie, kStart));
+    EXPECT_TRUE(ConsumeCookieReply(reply, &f.cookie, kStart));
+
+    AddCookieMacs(f.bytes(), sizeof(f.msg), f.identity.mac1_key, &f.cookie, kStart + seconds(1));
+    EXPECT_FALSE(f.Mac2Zero());
+    check.valid = false;
+    f.checker.CheckMac1(&check, 1);
+    EXPECT_TRUE(check.valid);
+    EXPECT_TRUE(f.checker.CheckMac2(f.bytes(), sizeof(f.msg), from, from_len, kStart + seconds(1)));
+    EXPECT_FALSE(f.checker.CheckMac2(f.bytes(), sizeof(f.msg), other, other_len, kStart + seconds(1)));
+    // The port is part of the address the cookie is bound to.
+    Ipv4(&other, "192.0.2.1", 51821);
+    EXPECT_FALSE(f.checker.CheckMac2(f.bytes(), sizeof(f.msg), other, other_len, kStart + seconds(1)));
+
+    // The secret changes every two minutes, and cookies go stale with it.
+    EXPECT_FALSE(f.checker.CheckMac2(f.bytes(), sizeof(f.msg), from, from_len, kStart + seconds(121)));
+    AddCookieMacs(f.bytes(), sizeof(f.msg), f.identity.mac1_key, &f.cookie, kStart + seconds(121));
+    EXPECT_TRUE(f.Mac2Zero());
+  }
+
+  // A reply only counts for the last message the initiator sent.
+  TEST(cookie, ReplyBoundToLastMessage)
+  {
+    CookieFixture f;
+    struct sockaddr_storage from;
+    socklen_t from_len = Ipv4(&from, "198.51.100.7", 4000);
+    MessageCookieReply reply;
+    // No message sent yet.
+    f.checker.CreateReply(&reply, f.bytes(), sizeof(f.msg), 1, from, from_len, kStart);
+    EXPECT_FALSE(ConsumeCookieReply(reply, &f.cookie, kStart));
+
+    AddCookieMacs(f.bytes(), sizeof(f.msg), f.identity.mac1_key, &f.cookie, kStart);
+    f.checker.CreateReply(&reply, f.bytes(), sizeof(f.msg), 1, from, from_len, kStart);
+    // A newer message changes the mac1 the reply has to match.
+    f.msg.sender_index ^= 1;
+    AddCookieMacs(f.bytes(), sizeof(f.msg), f.identity.mac1_key, &f.cookie, kStart);
+    EXPECT_FALSE(ConsumeCookieReply(reply, &f.cookie, kStart));
+  }
+
+  // Bursts of five, then one packet per 50 ms, per source.
+  TEST(cookie, RateLimiterBuckets)
+  {
+    RateLimiter limiter;
+    struct sockaddr_storage a, b;
+    socklen_t a_len = Ipv4(&a, "203.0.113.1", 1);
+    socklen_t b_len = Ipv4(&b, "203.0.113.2", 1);
+    int allowed = 0;
+    for (int i = 0; i < 20; i++)
+    {
+      allowed += limiter.Allow(a, a_len, kStart);
+    }
+    EXPECT_EQ(allowed, RateLimiter::kPacketsBurst);
+    EXPECT_TRUE(limiter.Allow(b, b_len, kStart));
+    // Another port on the same host shares the bucket.
+    Ipv4(&a, "203.0.113.1", 2);
+    EXPECT_FALSE(limiter.Allow(a, a_len, kStart));
+
+    EXPECT_FALSE(limiter.Allow(a, a_len, kStart + milliseconds(40)));
+    EXPECT_TRUE(limiter.Allow(a, a_len, kStart + milliseconds(50)));
+    EXPECT_FALSE(limiter.Allow(a, a_len, kStart + milliseconds(60)));
+
+    // Sustained at twice the rate, half get through.
+    allowed = 0;
+    Clock::time_point now = kStart + seconds(10);
+    for (int i = 0; i < 400; i++, now += milliseconds(25))
+    {
+      allowed += limiter.Allow(a, a_len, now);
+    }
+    EXPECT_TRUE(allowed >= 200 && allowed <= 200 + RateLimiter::kPacketsBurst);
+  }
+
+  TEST(cookie, RateLimiterIpv6Prefixes)
+  {
+    RateLimiter limiter;
+    struct sockaddr_storage address;
+    socklen_t len = Ipv6(&address, "2001:db8:1:2::1");
+    for (int i = 0; i < RateLimiter::kPacketsBurst; i++)
+    {
+      EXPECT_TRUE(limiter.Allow(address, len, kStart));
+    }
+    // Same /64.
+    Ipv6(&address, "2001:db8:1:2:ffff::9");
+    EXPECT_FALSE(limiter.Allow(address, len, kStart));
+    // Another /64.
+    Ipv6(&address, "2001:db8:1:3::1");
+    EXPECT_TRUE(limiter.Allow(address, len, kStart));
+    EXPECT_EQ(limiter.size(), static_cast<size_t>(2));
+  }
+
+  // The table holds kMaxEntries sources; Age() makes room by forgetting the
+  // idle ones.
+  TEST(cookie, RateLimiterTableFullAndAge)
+  {
+    RateLimiter limiter;
+    struct sockaddr_storage address;
+    socklen_t len = 0;
+    char ip[32];
+    for (size_t i = 0; i < RateLimiter::kMaxEntries; i++)
+    {
+      snprintf(ip, sizeof(ip), "10.%zu.%zu.1", i / 256, i % 256);
+      len = Ipv4(&address, ip, 1);
+      EXPECT_TRUE(limiter.Allow(address, len, kStart));
+    }
+    EXPECT_EQ(limiter.size(), RateLimiter::kMaxEntries);
+    len = Ipv4(&address, "172.16.0.1", 1);
+    EXPECT_FALSE(limiter.Allow(address, len, kStart));
+
+    limiter.Age(kStart + milliseconds(500));
+    EXPECT_EQ(limiter.size(), RateLimiter::kMaxEntries);
+    limiter.Age(kStart + seconds(1));
+    EXPECT_EQ(limiter.size(), static_cast<size_t>(0));
+    EXPECT_TRUE(limiter.Allow(address, len, kStart + seconds(1)));
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,117 @@
+// Throughput of Poly1305 and ChaCha20-Poly1305 under each implementation the
+// CPU supports, for small, medium and full-size packets, and BLAKE2s hashes
+// per second for the handshake's mac1.
+#include <cstdio>
+#include <vector>
+
+#include "benchmark.h"
+#include "blake2s.h"
+#include "chacha20poly1305.h"
+#include "messages.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const char *Name(ChaCha20Implementation implementation)
+    {
+      switch (implementation)
+      {
+      case ChaCha20Implementation::kScalar:
+        return "scalar";
+      case ChaCha20Implementation::kAvx2:
+        return "avx2";
+      case ChaCha20Implementation::kAvx512:
+        return "avx512";
+      }
+      return "?";
+    }
+
+    const char *Name(Blake2sImplementation implementation)
+    {
+      switch (implementation)
+      {
+      case Blake2sImplementation::kScalar:
+        return "scalar";
+      case Blake2sImplementation::kSse41:
+        return "sse4.1";
+      case Blake2sImplementation::kAvx2:
+        return "avx2";
+      }
+      return "?";
+    }
+
+    double Gbps(double calls_per_second, size_t bytes)
+    {
+      return calls_per_second * bytes * 8 / 1e9;
+    }
+
+  } // namespace
+
+  BENCHMARK(chacha20poly1305)
+  {
+    const ChaCha20Implementation previous = ActiveChaCha20Implementation();
+    for (size_t len : {64, 512, 1420})
+    {
+      std::vector<uint8_t> key(kChaCha20KeySize, 0x42), data(len, 0x17), out(len + kPoly1305TagSize);
+      for (ChaCha20Implementation implementation :
+           {ChaCha20Implementation::kScalar, ChaCha20Implementation::kAvx2, ChaCha20Implementation::kAvx512})
+      {
+        if (!SetChaCha20Implementation(implementation))
+        {
+          printf("%5zu bytes  %-8s unsupported\n", len, Name(implementation));
+          continue;
+        }
+        double poly = benchmark::CallsPerSecond([&]
+                                                {
+                                                  Poly1305 mac(key.data());
+                                                  mac.Update(data.data(), len);
+                                                  mac.Final(out.data());
+                                                });
+        uint64_t nonce = 0;
+        double seal = benchmark::CallsPerSecond(
+            [&]
+            { ChaCha20Poly1305Seal(out.data(), data.data(), len, nullptr, 0, nonce++, key.data()); });
+        printf("%5zu bytes  %-8s poly1305 %7.2f Gbit/s   seal %7.2f Gbit/s\n", len, Name(implementation),
+               Gbps(poly, len), Gbps(seal, len));
+      }
+    }
+    SetChaCha20Implementation(previous);
+  }
+
+  // mac1 of an initiation, keyed, one message at a time and in the batches
+  // of 16 queued handshakes the device checks together.
+  BENCHMARK(blake2s)
+  {
+    const Blake2sImplementation previous = ActiveBlake2sImplementation();
+    const size_t kBatch = 16;
+    const size_t len = sizeof(MessageInitiation) - sizeof(MessageMacs);
+    std::vector<uint8_t> key(kBlake2sHashSize, 0x42), data(kBatch * len, 0x17), out(kBatch * kCookieSize);
+    std::vector<Blake2sJob> jobs;
+    for (size_t i = 0; i < kBatch; i++)
+    {
+      jobs.push_back(Blake2sJob{data.data() + i * len, len, out.data() + i * kCookieSize});
+    }
+    for (Blake2sImplementation implementation :
+         {Blake2sImplementation::kScalar, Blake2sImplementation::kSse41, Blake2sImplementation::kAvx2})
+    {
+      if (!SetBlake2sImplementation(implementation))
+      {
+        printf("%-8s unsupported\n", Name(implementation));
+        continue;
+      }
+      double single = benchmark::CallsPerSecond(
+          [&]
+          { Blake2sHash(out.data(), kCookieSize, data.data(), len, key.data(), key.size()); });
+      double batch = benchmark::CallsPerSecond(
+          [&]
+          { Blake2sHashBatch(jobs.data(), jobs.size(), kCookieSize, key.data(), key.size()); });
+      printf("%-8s %3zu bytes  single %6.2f M hashes/s   batch of %zu %6.2f M hashes/s\n", Name(implementation), len,
+             single / 1e6, kBatch, batch * kBatch / 1e6);
+    }
+    SetBlake2sImplementation(previous);
+  }
+
+} // namespace wireguard_flutter
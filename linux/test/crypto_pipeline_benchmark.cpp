@@ -0,0 +1,87 @@
+// How sealing scales with the number of crypto workers: the pipeline alone,
+// then the whole data plane through two devices.
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include "benchmark.h"
+#include "crypto_pipeline.h"
+#include "device_pair.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kPayloadLength = 1420;
+
+    // Worker counts from none, sealing on the submitting thread, up to one
+    // per CPU and at least two.
+    size_t MaxWorkers()
+    {
+      size_t cpus = std::thread::hardware_concurrency();
+      return cpus > 2 ? cpus : 2;
+    }
+
+    // Seals packets of one peer through |workers| workers for half a second.
+    // Returns Gbit/s of payload.
+    double SealThroughput(size_t workers)
+    {
+      uint8_t key[kChaCha20KeySize];
+      memset(key, 0x5a, sizeof(key));
+      PeerPacketQueue queue;
+      size_t sealed = 0;
+      CryptoPipeline pipeline(workers, [&](Peer *, bool)
+                              { queue.Drain([&](PacketElement *element)
+                                            {
+                                              std::unique_ptr<PacketElement> owned(element);
+                                              sealed++; }); });
+      const double start = benchmark::Now();
+      double end = start + 0.5;
+      uint64_t counter = 0;
+      while (benchmark::Now() < end)
+      {
+        for (int i = 0; i < 32; i++, counter++)
+        {
+          std::unique_ptr<PacketElement> element =
+              PacketElement::Create(sizeof(MessageDataHeader) + kPayloadLength + kPoly1305TagSize);
+          memset(element->payload(), 0, kPayloadLength);
+          element->encrypt = true;
+          element->counter = counter;
+          element->payload_len = kPayloadLength;
+          memcpy(element->key, key, sizeof(key));
+          if (!queue.Enqueue(element.get()))
+          {
+            pipeline.WaitIdle();
+            queue.Enqueue(element.get());
+          }
+          pipeline.Submit(element.release());
+        }
+        pipeline.Flush();
+      }
+      pipeline.WaitIdle();
+      end = benchmark::Now();
+      return sealed * kPayloadLength * 8 / (end - start) / 1e9;
+    }
+
+  } // namespace
+
+  BENCHMARK(crypto_pipeline_scaling)
+  {
+    printf("%zu CPUs\n", static_cast<size_t>(std::thread::hardware_concurrency()));
+    for (size_t workers = 0; workers <= MaxWorkers(); workers++)
+    {
+      printf("%2zu workers  pipeline %7.3f Gbit/s", workers, SealThroughput(workers));
+      benchmark::DevicePair pair(workers);
+      if (!pair.Connect())
+      {
+        printf("  handshake failed\n");
+        continue;
+      }
+      benchmark::Throughput throughput = benchmark::MeasureThroughput(&pair, kPayloadLength, 1.0);
+      printf("  devices %7.3f Gbit/s  %5.1f%% lost\n", throughput.gbps, throughput.loss * 100);
+    }
+  }
+
+} // namespace wireguard_flutter
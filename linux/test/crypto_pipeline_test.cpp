@@ -0,0 +1,138 @@
+#include <cstring>
+#include <vector>
+
+#include "crypto_pipeline.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kPackets = 5000;
+
+    size_t PayloadLength(uint64_t counter) { return 16 + counter * 37 % 1400; }
+
+    void FillPayload(uint8_t *payload, uint64_t counter)
+    {
+      for (size_t i = 0; i < PayloadLength(counter); i++)
+      {
+        payload[i] = static_cast<uint8_t>(counter + i);
+      }
+    }
+
+    // Sends kPackets packets of one peer through a pipeline with |workers|
+    // workers. Each is sealed, or with |open| opened, and every seventh
+    // ciphertext is corrupted first. Returns the counters in the order the
+    // peer's queue released them, and counts the packets whose outcome or
+    // contents were wrong.
+    std::vector<uint64_t> RunPipeline(size_t workers, bool open, size_t *wrong)
+    {
+      uint8_t key[kChaCha20KeySize];
+      memset(key, 0x5a, sizeof(key));
+      PeerPacketQueue queue;
+      std::vector<uint64_t> order;
+      *wrong = 0;
+      // Runs on whichever thread drains the queue; only one does at a time.
+      auto check = [&](PacketElement *element)
+      {
+        std::unique_ptr<PacketElement> owned(element);
+        uint64_t counter = element->counter;
+        order.push_back(counter);
+        size_t len = PayloadLength(counter);
+        std::vector<uint8_t> expected(len);
+        FillPayload(expected.data(), counter);
+        int state = element->state.load();
+        if (open && counter % 7 == 0)
+        {
+          *wrong += state != PacketElement::kDropped;
+        }
+        else if (state != PacketElement::kDone)
+        {
+          (*wrong)++;
+        }
+        else if (open)
+        {
+          *wrong += memcmp(element->payload(), expected.data(), len) != 0;
+        }
+        else
+        {
+          std::vector<uint8_t> plain(len);
+          *wrong += !ChaCha20Poly1305Open(plain.data(), element->payload(), len + kPoly1305TagSize, nullptr, 0,
+                                          counter, key) ||
+                    plain != expected;
+        }
+      };
+      CryptoPipeline pipeline(workers, [&](Peer *, bool)
+                              { queue.Drain(check); });
+
+      for (uint64_t counter = 0; counter < kPackets; counter++)
+      {
+        size_t len = PayloadLength(counter);
+        std::unique_ptr<PacketElement> element =
+            PacketElement::Create(sizeof(MessageDataHeader) + len + kPoly1305TagSize);
+        FillPayload(element->payload(), counter);
+        element->encrypt = !open;
+        element->counter = counter;
+        element->payload_len = len;
+        memcpy(element->key, key, sizeof(key));
+        if (open)
+        {
+          ChaCha20Poly1305Seal(element->payload(), element->payload(), len, nullptr, 0, counter, key);
+          element->payload_len += kPoly1305TagSize;
+          if (counter % 7 == 0)
+          {
+            element->payload()[0] ^= 1;
+          }
+        }
+        if (!queue.Enqueue(element.get()))
+        {
+          pipeline.WaitIdle();
+          EXPECT_TRUE(queue.Enqueue(element.get()));
+        }
+        EXPECT_TRUE(pipeline.Submit(element.release()));
+        if (counter % 32 == 31)
+        {
+          pipeline.Flush();
+        }
+      }
+      pipeline.WaitIdle();
+      return order;
+    }
+
+  } // namespace
+
+  // Workers finish packets out of order, but each peer's packets leave its
+  // queue in the order they went in, dropped ones included.
+  TEST(crypto_pipeline, SealKeepsOrder)
+  {
+    for (size_t workers : {0, 1, 4})
+    {
+      size_t wrong;
+      std::vector<uint64_t> order = RunPipeline(workers, false, &wrong);
+      ASSERT_EQ(order.size(), kPackets);
+      for (uint64_t i = 0; i < kPackets; i++)
+      {
+        ASSERT_EQ(order[i], i);
+      }
+      EXPECT_EQ(wrong, static_cast<size_t>(0));
+    }
+  }
+
+  TEST(crypto_pipeline, OpenKeepsOrderAndDropsForgeries)
+  {
+    for (size_t workers : {0, 1, 4})
+    {
+      size_t wrong;
+      std::vector<uint64_t> order = RunPipeline(workers, true, &wrong);
+      ASSERT_EQ(order.size(), kPackets);
+      for (uint64_t i = 0; i < kPackets; i++)
+      {
+        ASSERT_EQ(order[i], i);
+      }
+      EXPECT_EQ(wrong, static_cast<size_t>(0));
+    }
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "chacha20poly1305.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    using test::ToHex;
+
+    const std::array<ChaCha20Implementation, 3> kImplementations = {
+        ChaCha20Implementation::kScalar, ChaCha20Implementation::kAvx2, ChaCha20Implementation::kAvx512};
+
+    // Selects an implementation for the life of the object, then restores
+    // the one that was active.
+    class ScopedImplementation
+    {
+    public:
+      explicit ScopedImplementation(ChaCha20Implementation implementation)
+          : previous_(ActiveChaCha20Implementation()), supported_(SetChaCha20Implementation(implementation)) {}
+      ~ScopedImplementation() { SetChaCha20Implementation(previous_); }
+
+      bool supported() const { return supported_; }
+
+    private:
+      ChaCha20Implementation previous_;
+      bool supported_;
+    };
+
+    std::vector<uint8_t> RandomBytes(std::mt19937 *rng, size_t len)
+    {
+      std::vector<uint8_t> out(len);
+      for (uint8_t &b : out)
+      {
+        b = static_cast<uint8_t>((*rng)());
+      }
+      return out;
+    }
+
+    // The tag over |message| fed in pieces of at most |piece| bytes.
+    std::string Poly1305Hex(const uint8_t key[32], const std::vector<uint8_t> &message, size_t piece)
+    {
+      Poly1305 mac(key);
+      for (size_t off = 0; off < message.size(); off += piece)
+      {
+        mac.Update(message.data() + off, std::min(piece, message.size() - off));
+      }
+      uint8_t tag[kPoly1305TagSize];
+      mac.Final(tag);
+      return ToHex(tag, sizeof(tag));
+    }
+
+  } // namespace
+
+  // Messages long enough for the vector kernel, against tags computed with
+  // arbitrary-precision arithmetic. The all-ones key and message give the
+  // largest limbs the kernel can see.
+  TEST(crypto_simd, Poly1305LongMessages)
+  {
+    std::array<uint8_t, 32> key, ones_key;
+    for (size_t i = 0; i < key.size(); i++)
+    {
+      key[i] = static_cast<uint8_t>(i);
+    }
+    ones_key.fill(0xff);
+    std::vector<uint8_t> message(1000), ones(1024, 0xff);
+    for (size_t i = 0; i < message.size(); i++)
+    {
+      message[i] = static_cast<uint8_t>(i * 7 + 3);
+    }
+    for (ChaCha20Implementation implementation : kImplementations)
+    {
+      ScopedImplementation scoped(implementation);
+      if (!scoped.supported())
+      {
+        continue;
+      }
+      EXPECT_EQ(Poly1305Hex(key.data(), message, message.size()), std::string("b74ce66f76a2566fb0052967c146de6d"));
+      EXPECT_EQ(Poly1305Hex(key.data(), message, 333), std::string("b74ce66f76a2566fb0052967c146de6d"));
+      EXPECT_EQ(Poly1305Hex(ones_key.data(), ones, ones.size()), std::string("25d4926a53bb480da228ec61e0a31a38"));
+    }
+  }
+
+  TEST(crypto_simd, Poly1305MatchesScalar)
+  {
+    if (!ScopedImplementation(ChaCha20Implementation::kAvx2).supported())
+    {
+      SKIP("no AVX2");
+    }
+    std::mt19937 rng(1);
+    for (size_t len = 0; len <= 2048; len += 1 + len / 8)
+    {
+      std::vector<uint8_t> key = RandomBytes(&rng, 32), message = RandomBytes(&rng, len);
+      std::string expected;
+      {
+        ScopedImplementation scoped(ChaCha20Implementation::kScalar);
+        expected = Poly1305Hex(key.data(), message, message.size() + 1);
+      }
+      for (ChaCha20Implementation implementation : kImplementations)
+      {
+        ScopedImplementation scoped(implementation);
+        if (!scoped.supported())
+        {
+          continue;
+        }
+        EXPECT_EQ(Poly1305Hex(key.data(), message, message.size() + 1), expected);
+        EXPECT_EQ(Poly1305Hex(key.data(), message, 300), expected);
+      }
+    }
+  }
+
+  // Seal and open, one at a time and batched, give the scalar bytes under
+  // every implementation.
+  TEST(crypto_simd, AeadMatchesScalar)
+  {
+    if (!ScopedImplementation(ChaCha20Implementation::kAvx2).supported())
+    {
+      SKIP("no AVX2");
+    }
+    std::mt19937 rng(2);
+    std::vector<std::vector<uint8_t>> keys, plaintexts;
+    std::vector<std::string> expected;
+    for (size_t len = 0; len <= 2000; len += 1 + len / 4)
+    {
+      keys.push_back(RandomBytes(&rng, kChaCha20KeySize));
+      plaintexts.push_back(RandomBytes(&rng, len));
+      std::vector<uint8_t> sealed(len + kPoly1305TagSize);
+      ScopedImplementation scoped(ChaCha20Implementation::kScalar);
+      ChaCha20Poly1305Seal(sealed.data(), plaintexts.back().data(), len, nullptr, 0, len * 31, keys.back().data());
+      expected.push_back(ToHex(sealed.data(), sealed.size()));
+    }
+    for (ChaCha20Implementation implementation : kImplementations)
+    {
+      ScopedImplementation scoped(implementation);
+      if (!scoped.supported())
+      {
+        continue;
+      }
+      std::vector<std::vector<uint8_t>> sealed(plaintexts.size());
+      std::vector<AeadPacket> batch(plaintexts.size());
+      for (size_t i = 0; i < plaintexts.size(); i++)
+      {
+        size_t len = plaintexts[i].size();
+        sealed[i].resize(len + kPoly1305TagSize);
+        ChaCha20Poly1305Seal(sealed[i].data(), plaintexts[i].data(), len, nullptr, 0, len * 31, keys[i].data());
+        EXPECT_EQ(ToHex(sealed[i].data(), sealed[i].size()), expected[i]);
+        std::vector<uint8_t> opened(len);
+        EXPECT_TRUE(ChaCha20Poly1305Open(opened.data(), sealed[i].data(), sealed[i].size(), nullptr, 0, len * 31,
+                                         keys[i].data()));
+        EXPECT_TRUE(opened == plaintexts[i]);
+
+        memset(sealed[i].data(), 0, sealed[i].size());
+        batch[i].dst = sealed[i].data();
+        batch[i].src = plaintexts[i].data();
+        batch[i].len = len;
+        batch[i].nonce = len * 31;
+        batch[i].key = keys[i].data();
+      }
+      ChaCha20Poly1305SealBatch(batch.data(), batch.size());
+      for (size_t i = 0; i < plaintexts.size(); i++)
+      {
+        EXPECT_EQ(ToHex(sealed[i].data(), sealed[i].size()), expected[i]);
+      }
+    }
+  }
+
+} // namespace wireguard_flutter
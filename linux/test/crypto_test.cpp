@@ -0,0 +1,220 @@
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "blake2s.h"
+#include "byte_order.h"
+#include "chacha20poly1305.h"
+#include "curve25519.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    using test::FromHex;
+    using test::ToHex;
+
+    std::string X25519Hex(const std::string &scalar, const std::string &point)
+    {
+      std::vector<uint8_t> k = FromHex(scalar), u = FromHex(point);
+      uint8_t out[kCurve25519KeySize];
+      X25519(out, k.data(), u.data());
+      return ToHex(out, sizeof(out));
+    }
+
+    // RFC 8439 section 2.8 built from its parts, for nonces that do not have
+    // WireGuard's layout.
+    void ReferenceSeal(std::vector<uint8_t> *ciphertext, uint8_t tag[16], const std::vector<uint8_t> &key,
+                       const std::vector<uint8_t> &nonce, const std::vector<uint8_t> &ad,
+                       const std::vector<uint8_t> &plaintext)
+    {
+      uint8_t poly_key[64];
+      ChaCha20Blocks(poly_key, key.data(), nonce.data(), 0, 1);
+      std::vector<uint8_t> keystream((plaintext.size() + 63) / 64 * 64);
+      ChaCha20Blocks(keystream.data(), key.data(), nonce.data(), 1, keystream.size() / 64);
+      ciphertext->resize(plaintext.size());
+      for (size_t i = 0; i < plaintext.size(); i++)
+      {
+        (*ciphertext)[i] = plaintext[i] ^ keystream[i];
+      }
+      Poly1305 mac(poly_key);
+      mac.Update(ad.data(), ad.size());
+      mac.Pad16();
+      mac.Update(ciphertext->data(), ciphertext->size());
+      mac.Pad16();
+      uint8_t lengths[16];
+      StoreLe64(lengths, ad.size());
+      StoreLe64(lengths + 8, ciphertext->size());
+      mac.Update(lengths, sizeof(lengths));
+      mac.Final(tag);
+    }
+
+  } // namespace
+
+  // RFC 7748 section 5.2.
+  TEST(crypto, X25519Vectors)
+  {
+    EXPECT_EQ(X25519Hex("a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4",
+                        "e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c"),
+              std::string("c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552"));
+    EXPECT_EQ(X25519Hex("4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d",
+                        "e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493"),
+              std::string("95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957"));
+  }
+
+  // RFC 7748 section 5.2: k and u both start as 9, and each round computes
+  // X25519(k, u), sets u to the old k and k to the result.
+  TEST(crypto, X25519Iterated)
+  {
+    uint8_t k[kCurve25519KeySize] = {9}, u[kCurve25519KeySize] = {9}, result[kCurve25519KeySize];
+    for (int i = 1; i <= 1000; i++)
+    {
+      X25519(result, k, u);
+      memcpy(u, k, sizeof(u));
+      memcpy(k, result, sizeof(k));
+      if (i == 1)
+      {
+        EXPECT_EQ(ToHex(k, sizeof(k)), std::string("422c8e7a6227d7bca1350b3e2bb7279f7897b87bb6854b783c60e80311ae3079"));
+      }
+    }
+    EXPECT_EQ(ToHex(k, sizeof(k)), std::string("684cf59ba83309552800ef566f2f4d3c1c3887c49360e3875f2eb94d99532c51"));
+  }
+
+  // RFC 7748 section 6.1.
+  TEST(crypto, X25519DiffieHellman)
+  {
+    std::vector<uint8_t> alice = FromHex("77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a");
+    std::vector<uint8_t> bob = FromHex("5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb");
+    uint8_t alice_public[kCurve25519KeySize], bob_public[kCurve25519KeySize];
+    X25519PublicKey(alice_public, alice.data());
+    X25519PublicKey(bob_public, bob.data());
+    EXPECT_EQ(ToHex(alice_public, sizeof(alice_public)),
+              std::string("8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a"));
+    EXPECT_EQ(ToHex(bob_public, sizeof(bob_public)),
+              std::string("de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f"));
+    uint8_t alice_shared[kCurve25519KeySize], bob_shared[kCurve25519KeySize];
+    X25519(alice_shared, alice.data(), bob_public);
+    X25519(bob_shared, bob.data(), alice_public);
+    EXPECT_EQ(ToHex(alice_shared, sizeof(alice_shared)),
+              std::string("4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742"));
+    EXPECT_EQ(ToHex(bob_shared, sizeof(bob_shared)), ToHex(alice_shared, sizeof(alice_shared)));
+  }
+
+  // RFC 8439 section 2.3.2.
+  TEST(crypto, ChaCha20Block)
+  {
+    std::vector<uint8_t> key = FromHex("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f");
+    std::vector<uint8_t> nonce = FromHex("000000090000004a00000000");
+    uint8_t block[64];
+    ChaCha20Blocks(block, key.data(), nonce.data(), 1, 1);
+    EXPECT_EQ(ToHex(block, sizeof(block)),
+              std::string("10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+                          "d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e"));
+  }
+
+  // RFC 8439 section 2.5.2, fed in uneven pieces.
+  TEST(crypto, Poly1305)
+  {
+    std::vector<uint8_t> key = FromHex("85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b");
+    const std::string message = "Cryptographic Forum Research Group";
+    Poly1305 mac(key.data());
+    mac.Update(reinterpret_cast<const uint8_t *>(message.data()), 5);
+    mac.Update(reinterpret_cast<const uint8_t *>(message.data()) + 5, message.size() - 5);
+    uint8_t tag[kPoly1305TagSize];
+    mac.Final(tag);
+    EXPECT_EQ(ToHex(tag, sizeof(tag)), std::string("a8061dc1305136c6c22b8baf0c0127a9"));
+  }
+
+  // RFC 8439 section 2.8.2.
+  TEST(crypto, ChaCha20Poly1305Vector)
+  {
+    std::vector<uint8_t> key = FromHex("808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f");
+    std::vector<uint8_t> nonce = FromHex("070000004041424344454647");
+    std::vector<uint8_t> ad = FromHex("50515253c0c1c2c3c4c5c6c7");
+    const std::string text = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the "
+                             "future, sunscreen would be it.";
+    std::vector<uint8_t> plaintext(text.begin(), text.end());
+    std::vector<uint8_t> ciphertext;
+    uint8_t tag[kPoly1305TagSize];
+    ReferenceSeal(&ciphertext, tag, key, nonce, ad, plaintext);
+    EXPECT_EQ(ToHex(ciphertext), std::string("d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+                                             "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+                                             "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+                                             "3ff4def08e4b7a9de576d26586cec64b6116"));
+    EXPECT_EQ(ToHex(tag, sizeof(tag)), std::string("1ae10b594f09e26a7e902ecbd0600691"));
+  }
+
+  // Seal puts WireGuard's counter in the last 8 bytes of the RFC nonce, and
+  // Open takes back only what Seal produced.
+  TEST(crypto, ChaCha20Poly1305WireGuardNonce)
+  {
+    std::vector<uint8_t> key = FromHex("808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f");
+    std::vector<uint8_t> ad = FromHex("50515253c0c1c2c3c4c5c6c7");
+    const uint64_t counter = 0x0807060504030201ULL;
+    for (size_t len : {0, 1, 63, 64, 65, 1420})
+    {
+      std::vector<uint8_t> plaintext(len);
+      for (size_t i = 0; i < len; i++)
+      {
+        plaintext[i] = static_cast<uint8_t>(i * 7);
+      }
+      std::vector<uint8_t> expected;
+      uint8_t expected_tag[kPoly1305TagSize];
+      ReferenceSeal(&expected, expected_tag, key, FromHex("000000000102030405060708"), ad, plaintext);
+
+      std::vector<uint8_t> sealed(len + kPoly1305TagSize);
+      ChaCha20Poly1305Seal(sealed.data(), plaintext.data(), len, ad.data(), ad.size(), counter, key.data());
+      EXPECT_EQ(ToHex(sealed.data(), len), ToHex(expected));
+      EXPECT_EQ(ToHex(sealed.data() + len, kPoly1305TagSize), ToHex(expected_tag, sizeof(expected_tag)));
+
+      std::vector<uint8_t> opened(len);
+      EXPECT_TRUE(ChaCha20Poly1305Open(opened.data(), sealed.data(), sealed.size(), ad.data(), ad.size(), counter,
+                                       key.data()));
+      EXPECT_EQ(ToHex(opened), ToHex(plaintext));
+      EXPECT_FALSE(ChaCha20Poly1305Open(opened.data(), sealed.data(), sealed.size(), ad.data(), ad.size(),
+                                        counter + 1, key.data()));
+      sealed[len / 2] ^= 1;
+      EXPECT_FALSE(ChaCha20Poly1305Open(opened.data(), sealed.data(), sealed.size(), ad.data(), ad.size(), counter,
+                                        key.data()));
+    }
+  }
+
+  // draft-irtf-cfrg-xchacha section 2.2.1.
+  TEST(crypto, HChaCha20)
+  {
+    std::vector<uint8_t> key = FromHex("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f");
+    std::vector<uint8_t> nonce = FromHex("000000090000004a0000000031415927");
+    uint8_t subkey[kChaCha20KeySize];
+    HChaCha20(subkey, key.data(), nonce.data());
+    EXPECT_EQ(ToHex(subkey, sizeof(subkey)),
+              std::string("82413b4227b27bfed30e42508a877d73a0f9e4d58a74a853c12ec41326d3ecdc"));
+  }
+
+  // The BLAKE2 reference KAT: keyed with 00..1f, over inputs 00, 01, 02...
+  TEST(crypto, Blake2sVectors)
+  {
+    uint8_t hash[kBlake2sHashSize];
+    Blake2sHash(hash, sizeof(hash), reinterpret_cast<const uint8_t *>("abc"), 3);
+    EXPECT_EQ(ToHex(hash, sizeof(hash)), std::string("508c5e8c327c14e2e1a72ba34eeb452f37458b209ed63a294d999b4c86675982"));
+
+    uint8_t key[32], input[255];
+    for (int i = 0; i < 32; i++)
+    {
+      key[i] = static_cast<uint8_t>(i);
+    }
+    for (int i = 0; i < 255; i++)
+    {
+      input[i] = static_cast<uint8_t>(i);
+    }
+    Blake2sHash(hash, sizeof(hash), nullptr, 0, key, sizeof(key));
+    EXPECT_EQ(ToHex(hash, sizeof(hash)), std::string("48a8997da407876b3d79c0d92325ad3b89cbb754d86ab71aee047ad345fd2c49"));
+    Blake2sHash(hash, sizeof(hash), input, 64, key, sizeof(key));
+    EXPECT_EQ(ToHex(hash, sizeof(hash)), std::string("8975b0577fd35566d750b362b0897a26c399136df07bababbde6203ff2954ed4"));
+    Blake2sHash(hash, sizeof(hash), input, 255, key, sizeof(key));
+    EXPECT_EQ(ToHex(hash, sizeof(hash)), std::string("3fb735061abc519dfe979e54c1ee5bfad0a9d858b3315bad34bde999efd724dd"));
+  }
+
+} // namespace wireguard_flutter
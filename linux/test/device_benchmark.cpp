@@ -0,0 +1,27 @@
+// Transport data throughput through two devices over loopback UDP, from one
+// app socket to the other, for small and full-size packets.
+#include <cstdio>
+
+#include "benchmark.h"
+#include "device_pair.h"
+
+namespace wireguard_flutter
+{
+
+  BENCHMARK(device_throughput)
+  {
+    benchmark::DevicePair pair(DefaultCryptoWorkers());
+    if (!pair.Connect())
+    {
+      printf("handshake failed\n");
+      return;
+    }
+    for (size_t len : {128, 512, 1420})
+    {
+      benchmark::Throughput throughput = benchmark::MeasureThroughput(&pair, len, 1.0);
+      printf("%5zu bytes  %7.3f Gbit/s  %9.0f packets/s  %5.1f%% lost\n", len, throughput.gbps,
+             throughput.packets_per_second, throughput.loss * 100);
+    }
+  }
+
+} // namespace wireguard_flutter
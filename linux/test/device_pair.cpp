@@ -0,0 +1,154 @@
+#include "device_pair.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "benchmark.h"
+#include "config_parser.h"
+#include "curve25519.h"
+
+namespace wireguard_flutter
+{
+  namespace benchmark
+  {
+
+    DevicePair::DevicePair(size_t crypto_workers, IoBackend backend)
+    {
+      uint8_t a_private[kCurve25519KeySize], b_private[kCurve25519KeySize];
+      uint8_t a_public[kCurve25519KeySize], b_public[kCurve25519KeySize];
+      X25519GeneratePrivateKey(a_private);
+      X25519GeneratePrivateKey(b_private);
+      X25519PublicKey(a_public, a_private);
+      X25519PublicKey(b_public, b_private);
+
+      int tun_a[2], tun_b[2];
+      if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_a) != 0 || socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_b) != 0)
+      {
+        throw std::runtime_error("socketpair failed");
+      }
+      a_app_ = tun_a[1];
+      b_app_ = tun_b[1];
+      a_.reset(new Device(tun_a[0], crypto_workers));
+      b_.reset(new Device(tun_b[0], crypto_workers));
+      a_->SetIoBackend(backend);
+      b_->SetIoBackend(backend);
+      uint16_t b_port = b_->Bind(0);
+      a_->Bind(0);
+      a_->Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(a_private) +
+                                       "\n[Peer]\nPublicKey = " + EncodeBase64Key(b_public) +
+                                       "\nAllowedIPs = 10.0.0.2/32\nEndpoint = 127.0.0.1:" + std::to_string(b_port) +
+                                       "\n"));
+      b_->Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(b_private) +
+                                       "\n[Peer]\nPublicKey = " + EncodeBase64Key(a_public) +
+                                       "\nAllowedIPs = 10.0.0.1/32\n"));
+      run_a_ = std::thread([this]
+                           { a_->Run(); });
+      run_b_ = std::thread([this]
+                           { b_->Run(); });
+    }
+
+    DevicePair::~DevicePair()
+    {
+      a_->Stop();
+      b_->Stop();
+      run_a_.join();
+      run_b_.join();
+      close(a_app_);
+      close(b_app_);
+    }
+
+    bool DevicePair::Connect()
+    {
+      uint8_t packet[100], received[2048];
+      MakePacket(packet, sizeof(packet), 1, 2, 0);
+      if (write(a_app_, packet, sizeof(packet)) != static_cast<ssize_t>(sizeof(packet)))
+      {
+        return false;
+      }
+      struct pollfd p = {b_app_, POLLIN, 0};
+      return poll(&p, 1, 2000) == 1 && read(b_app_, received, sizeof(received)) == sizeof(packet);
+    }
+
+    void MakePacket(uint8_t *packet, size_t len, int from, int to, uint32_t sequence)
+    {
+      memset(packet, 0, len);
+      packet[0] = 0x45;
+      packet[2] = static_cast<uint8_t>(len >> 8);
+      packet[3] = static_cast<uint8_t>(len);
+      packet[8] = 64;
+      packet[9] = 17;
+      packet[12] = 10;
+      packet[15] = static_cast<uint8_t>(from);
+      packet[16] = 10;
+      packet[19] = static_cast<uint8_t>(to);
+      memcpy(packet + 28, &sequence, sizeof(sequence));
+    }
+
+    uint32_t PacketSequence(const uint8_t *packet)
+    {
+      uint32_t sequence;
+      memcpy(&sequence, packet + 28, sizeof(sequence));
+      return sequence;
+    }
+
+    Throughput MeasureThroughput(DevicePair *pair, size_t len, double seconds)
+    {
+      std::atomic<bool> writing{true};
+      uint64_t written = 0;
+      std::thread writer([&]
+                         {
+                           std::vector<uint8_t> packet(len);
+                           MakePacket(packet.data(), len, 1, 2, 0);
+                           const double end = Now() + seconds;
+                           while (Now() < end)
+                           {
+                             for (int i = 0; i < 64; i++)
+                             {
+                               if (write(pair->a_app(), packet.data(), len) == static_cast<ssize_t>(len))
+                               {
+                                 written++;
+                               }
+                             }
+                           }
+                           writing = false; });
+
+      uint64_t received = 0;
+      std::vector<uint8_t> buffer(len + 64);
+      const double start = Now();
+      double last = start;
+      for (;;)
+      {
+        struct pollfd p = {pair->b_app(), POLLIN, 0};
+        if (poll(&p, 1, 200) <= 0)
+        {
+          if (!writing)
+          {
+            break;
+          }
+          continue;
+        }
+        if (read(pair->b_app(), buffer.data(), buffer.size()) == static_cast<ssize_t>(len))
+        {
+          received++;
+          last = Now();
+        }
+      }
+      writer.join();
+      Throughput throughput;
+      double elapsed = last > start ? last - start : 1e-9;
+      throughput.packets = received;
+      throughput.packets_per_second = received / elapsed;
+      throughput.gbps = throughput.packets_per_second * len * 8 / 1e9;
+      throughput.loss = written == 0 ? 0 : 1 - static_cast<double>(received) / written;
+      return throughput;
+    }
+
+  } // namespace benchmark
+} // namespace wireguard_flutter
@@ -0,0 +1,64 @@
+#ifndef WIREGUARD_FLUTTER_TEST_DEVICE_PAIR_H
+#define WIREGUARD_FLUTTER_TEST_DEVICE_PAIR_H
+
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+#include "device.h"
+
+namespace wireguard_flutter {
+namespace benchmark {
+
+// Two running devices that reach each other over loopback UDP, each with one
+// end of a SOCK_SEQPACKET socketpair as its TUN. The other ends stand in for
+// the applications: what is written to a_app() as a packet from 10.0.0.1 to
+// 10.0.0.2 comes out of b_app(), and the other way round.
+class DevicePair {
+ public:
+  DevicePair(size_t crypto_workers, IoBackend backend = IoBackend::kPoll);
+  // Stops both devices.
+  ~DevicePair();
+
+  DevicePair(const DevicePair &) = delete;
+  DevicePair &operator=(const DevicePair &) = delete;
+
+  Device &a() { return *a_; }
+  Device &b() { return *b_; }
+  int a_app() const { return a_app_; }
+  int b_app() const { return b_app_; }
+
+  // Sends one packet through, completing the handshake. Returns false if it
+  // does not arrive within two seconds.
+  bool Connect();
+
+ private:
+  std::unique_ptr<Device> a_, b_;
+  int a_app_, b_app_;
+  std::thread run_a_, run_b_;
+};
+
+// Writes an IPv4 UDP packet of |len| bytes from 10.0.0.|from| to 10.0.0.|to|
+// into |packet|, with |sequence| in the first payload bytes.
+void MakePacket(uint8_t *packet, size_t len, int from, int to, uint32_t sequence);
+// The sequence number MakePacket() put in |packet|.
+uint32_t PacketSequence(const uint8_t *packet);
+
+struct Throughput {
+  // Packets that came out of B.
+  uint64_t packets;
+  double gbps;
+  double packets_per_second;
+  // The share of packets written that did not come out.
+  double loss;
+};
+
+// Writes |len|-byte packets into A for about |seconds| while another thread
+// reads them out of B. Counts what arrives until the link has been quiet
+// for a moment after the last write.
+Throughput MeasureThroughput(DevicePair *pair, size_t len, double seconds);
+
+}  // namespace benchmark
+}  // namespace wireguard_flutter
+
+#endif
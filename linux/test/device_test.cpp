@@ -0,0 +1,328 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "byte_order.h"
+#include "config_parser.h"
+#include "curve25519.h"
+#include "device.h"
+#include "noise.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // An IPv4 header of |len| bytes from 10.0.0.|from| to 10.0.0.|to|, with
+    // |tag| in the payload.
+    void MakePacket(uint8_t *packet, size_t len, int from, int to, uint8_t tag)
+    {
+      memset(packet, 0, len);
+      packet[0] = 0x45;
+      packet[2] = static_cast<uint8_t>(len >> 8);
+      packet[3] = static_cast<uint8_t>(len);
+      packet[8] = 64;
+      packet[9] = 17;
+      packet[12] = 10;
+      packet[15] = static_cast<uint8_t>(from);
+      packet[16] = 10;
+      packet[19] = static_cast<uint8_t>(to);
+      packet[len - 1] = tag;
+    }
+
+    // Reads one packet from |fd|, waiting up to two seconds. Returns its
+    // length, or -1.
+    ssize_t ReadPacket(int fd, uint8_t *buffer, size_t len)
+    {
+      struct pollfd p = {fd, POLLIN, 0};
+      if (poll(&p, 1, 2000) <= 0)
+      {
+        return -1;
+      }
+      return read(fd, buffer, len);
+    }
+
+    // Two devices, each with one end of a socketpair for its TUN, reach
+    // each other over loopback UDP with |backend|: the first packet starts
+    // a handshake, and traffic then flows both ways.
+    void ExchangeTraffic(IoBackend backend)
+    {
+      uint8_t a_private[kCurve25519KeySize], b_private[kCurve25519KeySize];
+      uint8_t a_public[kCurve25519KeySize], b_public[kCurve25519KeySize];
+      X25519GeneratePrivateKey(a_private);
+      X25519GeneratePrivateKey(b_private);
+      X25519PublicKey(a_public, a_private);
+      X25519PublicKey(b_public, b_private);
+
+      int tun_a[2], tun_b[2];
+      ASSERT_TRUE(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_a) == 0);
+      ASSERT_TRUE(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_b) == 0);
+      Device a(tun_a[0], 1), b(tun_b[0], 1);
+      a.SetIoBackend(backend);
+      b.SetIoBackend(backend);
+      uint16_t b_port = b.Bind(0);
+      a.Bind(0);
+      a.Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(a_private) +
+                                     "\n[Peer]\nPublicKey = " + EncodeBase64Key(b_public) +
+                                     "\nAllowedIPs = 10.0.0.2/32\nEndpoint = 127.0.0.1:" + std::to_string(b_port) +
+                                     "\n"));
+      b.Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(b_private) +
+                                     "\n[Peer]\nPublicKey = " + EncodeBase64Key(a_public) +
+                                     "\nAllowedIPs = 10.0.0.1/32\n"));
+      std::thread run_a([&]
+                        { a.Run(); });
+      std::thread run_b([&]
+                        { b.Run(); });
+
+      uint8_t packet[100], received[2048];
+      int delivered = 0;
+      for (int i = 0; i < 100; i++)
+      {
+        MakePacket(packet, sizeof(packet), 1, 2, static_cast<uint8_t>(i));
+        EXPECT_EQ(write(tun_a[1], packet, sizeof(packet)), static_cast<ssize_t>(sizeof(packet)));
+        ssize_t n = ReadPacket(tun_b[1], received, sizeof(received));
+        if (n == static_cast<ssize_t>(sizeof(packet)) && memcmp(received, packet, sizeof(packet)) == 0)
+        {
+          delivered++;
+        }
+      }
+      EXPECT_EQ(delivered, 100);
+
+      // B learned A's endpoint from the handshake and can answer.
+      MakePacket(packet, 60, 2, 1, 0xab);
+      EXPECT_EQ(write(tun_b[1], packet, 60), 60);
+      EXPECT_EQ(ReadPacket(tun_a[1], received, sizeof(received)), 60);
+      EXPECT_EQ(received[59], 0xab);
+
+      // A packet for an address outside B's AllowedIPs on A goes nowhere.
+      MakePacket(packet, 60, 1, 3, 0);
+      EXPECT_EQ(write(tun_a[1], packet, 60), 60);
+      struct pollfd p = {tun_b[1], POLLIN, 0};
+      EXPECT_EQ(poll(&p, 1, 200), 0);
+
+      std::vector<PeerStats> stats = a.GetPeerStats();
+      ASSERT_EQ(stats.size(), static_cast<size_t>(1));
+      EXPECT_TRUE(stats[0].last_handshake_ns != 0);
+      EXPECT_TRUE(stats[0].session_up);
+      EXPECT_EQ(stats[0].handshakes, static_cast<uint64_t>(1));
+      EXPECT_TRUE(stats[0].tx_bytes > 0 && stats[0].rx_bytes > 0);
+
+      a.Stop();
+      b.Stop();
+      run_a.join();
+      run_b.join();
+      EXPECT_TRUE(a.io_backend() == backend && b.io_backend() == backend);
+      close(tun_a[1]);
+      close(tun_b[1]);
+    }
+
+  } // namespace
+
+  TEST(device, HandshakeOverSocketpair)
+  {
+    ExchangeTraffic(IoBackend::kPoll);
+  }
+
+  TEST(device, HandshakeOverIoUring)
+  {
+    if (IoUring::Create(8, 8) == nullptr)
+    {
+      SKIP("io_uring unavailable or older than 6.3");
+    }
+    ExchangeTraffic(IoBackend::kIoUring);
+  }
+
+  // The per-peer rate limit is set through the API, not the config, which
+  // stays what wg-quick reads; it holds across Configure() and can be lifted.
+  TEST(device, PeerRateLimit)
+  {
+    uint8_t a_private[kCurve25519KeySize], b_private[kCurve25519KeySize];
+    uint8_t a_public[kCurve25519KeySize], b_public[kCurve25519KeySize];
+    X25519GeneratePrivateKey(a_private);
+    X25519GeneratePrivateKey(b_private);
+    X25519PublicKey(a_public, a_private);
+    X25519PublicKey(b_public, b_private);
+    bool rejected = false;
+    try
+    {
+      ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(a_private) + "\n[Peer]\nPublicKey = " +
+                         EncodeBase64Key(b_public) + "\nRateLimit = 8M\n");
+    }
+    catch (const std::runtime_error &)
+    {
+      rejected = true;
+    }
+    EXPECT_TRUE(rejected);
+
+    int tun_a[2], tun_b[2];
+    ASSERT_TRUE(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_a) == 0);
+    ASSERT_TRUE(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_b) == 0);
+    Device a(tun_a[0], 1), b(tun_b[0], 1);
+    uint16_t b_port = b.Bind(0);
+    a.Bind(0);
+    // 2 Mbit/s, set before the peer exists.
+    a.SetPeerRateLimit(b_public, 2000000);
+    a.Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(a_private) +
+                                   "\n[Peer]\nPublicKey = " + EncodeBase64Key(b_public) +
+                                   "\nAllowedIPs = 10.0.0.2/32\nEndpoint = 127.0.0.1:" + std::to_string(b_port) +
+                                   "\n"));
+    b.Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(b_private) +
+                                   "\n[Peer]\nPublicKey = " + EncodeBase64Key(a_public) +
+                                   "\nAllowedIPs = 10.0.0.1/32\n"));
+    std::thread run_a([&]
+                      { a.Run(); });
+    std::thread run_b([&]
+                      { b.Run(); });
+
+    uint8_t packet[1400], received[2048];
+    MakePacket(packet, sizeof(packet), 1, 2, 0);
+    ASSERT_EQ(write(tun_a[1], packet, sizeof(packet)), static_cast<ssize_t>(sizeof(packet)));
+    ASSERT_EQ(ReadPacket(tun_b[1], received, sizeof(received)), static_cast<ssize_t>(sizeof(packet)));
+
+    // How long 50 packets, 70 kB, take to arrive. Few enough that, unlimited,
+    // none are lost to full socket buffers.
+    auto send_burst = [&]
+    {
+      std::thread writer([&]
+                         {
+                           for (int i = 0; i < 50; i++)
+                           {
+                             write(tun_a[1], packet, sizeof(packet));
+                           } });
+      auto start = std::chrono::steady_clock::now();
+      int arrived = 0;
+      while (arrived < 50 && ReadPacket(tun_b[1], received, sizeof(received)) > 0)
+      {
+        arrived++;
+      }
+      writer.join();
+      EXPECT_EQ(arrived, 50);
+      return std::chrono::steady_clock::now() - start;
+    };
+    // 70 kB at 250 kB/s, less a burst.
+    EXPECT_TRUE(send_burst() >= std::chrono::milliseconds(200));
+    a.SetPeerRateLimit(b_public, 0);
+    EXPECT_TRUE(send_burst() < std::chrono::milliseconds(150));
+
+    a.Stop();
+    b.Stop();
+    run_a.join();
+    run_b.join();
+    close(tun_a[1]);
+    close(tun_b[1]);
+  }
+
+  // A flood of initiations with valid mac1 from one address puts the
+  // responder under load: the flood draws cookie replies instead of
+  // handshakes, while a real peer on the same host answers its cookie and
+  // gets through.
+  TEST(device, HandshakeUnderInitiationFlood)
+  {
+    uint8_t a_private[kCurve25519KeySize], b_private[kCurve25519KeySize];
+    uint8_t a_public[kCurve25519KeySize], b_public[kCurve25519KeySize];
+    X25519GeneratePrivateKey(a_private);
+    X25519GeneratePrivateKey(b_private);
+    X25519PublicKey(a_public, a_private);
+    X25519PublicKey(b_public, b_private);
+
+    int tun_a[2], tun_b[2];
+    ASSERT_TRUE(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_a) == 0);
+    ASSERT_TRUE(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_b) == 0);
+    Device a(tun_a[0], 1), b(tun_b[0], 1);
+    uint16_t b_port = b.Bind(0);
+    a.Bind(0);
+    a.Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(a_private) +
+                                   "\n[Peer]\nPublicKey = " + EncodeBase64Key(b_public) +
+                                   "\nAllowedIPs = 10.0.0.2/32\nEndpoint = 127.0.0.1:" + std::to_string(b_port) +
+                                   "\n"));
+    b.Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(b_private) +
+                                   "\n[Peer]\nPublicKey = " + EncodeBase64Key(a_public) +
+                                   "\nAllowedIPs = 10.0.0.1/32\n"));
+    std::thread run_a([&]
+                      { a.Run(); });
+    std::thread run_b([&]
+                      { b.Run(); });
+
+    int flood_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    ASSERT_TRUE(flood_fd >= 0);
+    struct sockaddr_in target = {};
+    target.sin_family = AF_INET;
+    target.sin_port = htons(b_port);
+    target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_TRUE(connect(flood_fd, reinterpret_cast<struct sockaddr *>(&target), sizeof(target)) == 0);
+    std::atomic<bool> flooding{true};
+    uint64_t flood_sent = 0, cookie_replies = 0;
+    std::thread flood([&]
+                      {
+                        uint8_t mac1_key[kBlake2sHashSize];
+                        ComputeMac1Key(mac1_key, b_public);
+                        MessageInitiation msg;
+                        uint8_t *bytes = reinterpret_cast<uint8_t *>(&msg);
+                        uint8_t reply[256];
+                        // Bursts of 256 every 5 ms keep B's handshake queue
+                        // past the under-load depth without filling its socket
+                        // buffer for good, which would drop A's messages too.
+                        for (uint32_t i = 0; flooding;)
+                        {
+                          for (int burst = 0; burst < 256; burst++, i++)
+                          {
+                            memset(&msg, static_cast<int>(i), sizeof(msg));
+                            msg.type = htole32(kMessageInitiation);
+                            msg.sender_index = htole32(i);
+                            AddMacs(bytes, sizeof(msg), mac1_key, nullptr);
+                            flood_sent += send(flood_fd, bytes, sizeof(msg), 0) == sizeof(msg);
+                          }
+                          std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                          ssize_t n;
+                          while ((n = recv(flood_fd, reply, sizeof(reply), 0)) > 0)
+                          {
+                            cookie_replies += n == sizeof(MessageCookieReply) && LoadLe32(reply) == kMessageCookieReply;
+                          }
+                        } });
+
+    // A's first initiation is turned away with a cookie; the retransmission
+    // after kRekeyTimeout carries mac2 and is admitted.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    uint8_t packet[100], received[2048];
+    MakePacket(packet, sizeof(packet), 1, 2, 0x5a);
+    bool delivered = false;
+    auto deadline = std::chrono::steady_clock::now() + kRekeyTimeout * 4;
+    while (!delivered && std::chrono::steady_clock::now() < deadline)
+    {
+      EXPECT_EQ(write(tun_a[1], packet, sizeof(packet)), static_cast<ssize_t>(sizeof(packet)));
+      delivered = ReadPacket(tun_b[1], received, sizeof(received)) == static_cast<ssize_t>(sizeof(packet)) &&
+                  received[sizeof(packet) - 1] == 0x5a;
+    }
+    flooding = false;
+    flood.join();
+    EXPECT_TRUE(delivered);
+    EXPECT_TRUE(flood_sent > 1000);
+    // Nearly all of the flood is turned away with a cookie, before any
+    // Curve25519 work.
+    EXPECT_TRUE(cookie_replies > flood_sent / 2);
+    // The session B holds is the one with A.
+    std::vector<PeerStats> stats = b.GetPeerStats();
+    ASSERT_EQ(stats.size(), static_cast<size_t>(1));
+    EXPECT_TRUE(stats[0].session_up);
+
+    a.Stop();
+    b.Stop();
+    run_a.join();
+    run_b.join();
+    close(flood_fd);
+    close(tun_a[1]);
+    close(tun_b[1]);
+  }
+
+} // namespace wireguard_flutter
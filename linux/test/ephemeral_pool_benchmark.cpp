@@ -0,0 +1,75 @@
+// How long creating a handshake initiation takes with ephemeral keys from the
+// pool and with keys generated on the spot: initiations spaced out, as a
+// client's are, so the pool has time to restock, and back to back, which
+// drains the stock.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "curve25519.h"
+#include "ephemeral_pool.h"
+#include "noise.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kSamples = 500;
+
+    // Microseconds each of kSamples initiations took, sorted, with |gap|
+    // between them.
+    std::vector<double> Initiations(std::chrono::microseconds gap)
+    {
+      uint8_t local_private[kCurve25519KeySize], remote_private[kCurve25519KeySize];
+      uint8_t remote_public[kCurve25519KeySize];
+      X25519GeneratePrivateKey(local_private);
+      X25519GeneratePrivateKey(remote_private);
+      X25519PublicKey(remote_public, remote_private);
+      StaticIdentity identity;
+      SetStaticIdentity(&identity, local_private);
+      Handshake handshake;
+      HandshakeInit(&handshake, identity, remote_public, nullptr);
+
+      std::vector<double> latencies;
+      MessageInitiation msg;
+      for (size_t i = 0; i < kSamples; i++)
+      {
+        if (gap.count() > 0)
+        {
+          std::this_thread::sleep_for(gap);
+        }
+        double start = benchmark::Now();
+        CreateInitiation(&msg, &handshake, identity, static_cast<uint32_t>(i));
+        latencies.push_back((benchmark::Now() - start) * 1e6);
+        HandshakeClear(&handshake);
+      }
+      std::sort(latencies.begin(), latencies.end());
+      return latencies;
+    }
+
+    void Report(const char *name, const std::vector<double> &latencies)
+    {
+      printf("%-22s median %7.1f us  p99 %7.1f us\n", name, latencies[latencies.size() / 2],
+             latencies[latencies.size() * 99 / 100]);
+    }
+
+  } // namespace
+
+  BENCHMARK(ephemeral_pool)
+  {
+    EphemeralKeyPool &pool = EphemeralKeyPool::Instance();
+    pool.SetEnabled(true);
+    Report("pool, spaced 2 ms", Initiations(std::chrono::milliseconds(2)));
+    Report("pool, back to back", Initiations(std::chrono::microseconds(0)));
+    pool.SetEnabled(false);
+    Report("no pool, spaced 2 ms", Initiations(std::chrono::milliseconds(2)));
+    Report("no pool, back to back", Initiations(std::chrono::microseconds(0)));
+    pool.SetEnabled(true);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,110 @@
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ephemeral_pool.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Takes a key and checks that its halves belong together. Returns the
+    // public key in hex, or an empty string if they do not.
+    std::string TakeChecked(EphemeralKeyPool *pool)
+    {
+      uint8_t private_key[kCurve25519KeySize], public_key[kCurve25519KeySize], expected[kCurve25519KeySize];
+      pool->Take(private_key, public_key);
+      X25519PublicKey(expected, private_key);
+      if (memcmp(expected, public_key, kCurve25519KeySize) != 0)
+      {
+        return std::string();
+      }
+      return test::ToHex(public_key, kCurve25519KeySize);
+    }
+
+    // Waits up to two seconds for the calling thread's stock to fill.
+    bool WaitForFullStock(EphemeralKeyPool *pool)
+    {
+      for (int i = 0; i < 200 && pool->StockedKeys() < EphemeralKeyPool::kStockSize; i++)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      return pool->StockedKeys() == EphemeralKeyPool::kStockSize;
+    }
+
+  } // namespace
+
+  // The background thread stocks every thread that takes keys, and keys
+  // taken from stock are valid and never handed out twice.
+  TEST(ephemeral_pool, StockRefillsAndKeysAreUnique)
+  {
+    EphemeralKeyPool &pool = EphemeralKeyPool::Instance();
+    std::set<std::string> seen;
+    seen.insert(TakeChecked(&pool));
+    ASSERT_TRUE(WaitForFullStock(&pool));
+    for (size_t i = 0; i < EphemeralKeyPool::kStockSize; i++)
+    {
+      seen.insert(TakeChecked(&pool));
+    }
+    ASSERT_TRUE(WaitForFullStock(&pool));
+    for (int i = 0; i < 50; i++)
+    {
+      seen.insert(TakeChecked(&pool));
+    }
+    EXPECT_EQ(seen.count(std::string()), static_cast<size_t>(0));
+    EXPECT_EQ(seen.size(), static_cast<size_t>(1 + EphemeralKeyPool::kStockSize + 50));
+  }
+
+  TEST(ephemeral_pool, ConcurrentTakers)
+  {
+    EphemeralKeyPool &pool = EphemeralKeyPool::Instance();
+    std::mutex mutex;
+    std::vector<std::string> keys;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+      threads.emplace_back([&]
+                           {
+                             std::vector<std::string> local;
+                             for (int i = 0; i < 100; i++)
+                             {
+                               local.push_back(TakeChecked(&pool));
+                             }
+                             std::lock_guard<std::mutex> lock(mutex);
+                             keys.insert(keys.end(), local.begin(), local.end()); });
+    }
+    for (std::thread &thread : threads)
+    {
+      thread.join();
+    }
+    std::set<std::string> unique(keys.begin(), keys.end());
+    EXPECT_EQ(unique.count(std::string()), static_cast<size_t>(0));
+    EXPECT_EQ(unique.size(), keys.size());
+  }
+
+  // Disabled, the pool empties the stocks and generates every key on the
+  // spot; enabled again, it stocks up again.
+  TEST(ephemeral_pool, Disable)
+  {
+    EphemeralKeyPool &pool = EphemeralKeyPool::Instance();
+    TakeChecked(&pool);
+    ASSERT_TRUE(WaitForFullStock(&pool));
+    pool.SetEnabled(false);
+    EXPECT_EQ(pool.StockedKeys(), static_cast<size_t>(0));
+    EXPECT_FALSE(TakeChecked(&pool).empty());
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_EQ(pool.StockedKeys(), static_cast<size_t>(0));
+
+    pool.SetEnabled(true);
+    TakeChecked(&pool);
+    EXPECT_TRUE(WaitForFullStock(&pool));
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "fair_queue.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    typedef FairQueue::TimePoint TimePoint;
+    using std::chrono::milliseconds;
+
+    const TimePoint kStart = TimePoint() + std::chrono::hours(1000);
+
+    bool Enqueue(FairQueue *queue, TransmitFlow *flow, size_t len)
+    {
+      return queue->Enqueue(flow, PacketElement::Create(len), len);
+    }
+
+  } // namespace
+
+  // A flow of big packets and flows of small ones get the same bytes, to
+  // within a packet and a quantum, at every point while all are backlogged.
+  TEST(fair_queue, EqualSharesOfBytes)
+  {
+    FairQueue queue;
+    TransmitFlow flows[3];
+    const size_t kLens[3] = {1400, 500, 100};
+    for (size_t f = 0; f < 3; f++)
+    {
+      for (size_t sent = 0; sent < 140000; sent += kLens[f])
+      {
+        ASSERT_TRUE(Enqueue(&queue, &flows[f], kLens[f]));
+      }
+    }
+    size_t bytes[3] = {0, 0, 0};
+    size_t worst = 0;
+    for (;;)
+    {
+      size_t len;
+      TimePoint retry;
+      std::unique_ptr<PacketElement> element = queue.Dequeue(kStart, &len, &retry);
+      if (element == nullptr)
+      {
+        break;
+      }
+      // Which flow it came from follows from the length.
+      size_t f = static_cast<size_t>(std::find(kLens, kLens + 3, len) - kLens);
+      ASSERT_TRUE(f < 3);
+      bytes[f] += len;
+      if (flows[0].active && flows[1].active && flows[2].active)
+      {
+        size_t most = std::max({bytes[0], bytes[1], bytes[2]});
+        size_t least = std::min({bytes[0], bytes[1], bytes[2]});
+        worst = std::max(worst, most - least);
+      }
+    }
+    EXPECT_TRUE(worst <= FairQueue::kQuantum + 1400);
+    EXPECT_EQ(queue.bytes(), static_cast<size_t>(0));
+    EXPECT_TRUE(bytes[0] >= 140000 && bytes[1] >= 140000 && bytes[2] >= 140000);
+  }
+
+  // A packet bigger than a quantum waits rounds for its deficit to build up
+  // but is not passed over for good.
+  TEST(fair_queue, DeficitCarriesOver)
+  {
+    FairQueue queue;
+    TransmitFlow big, small;
+    ASSERT_TRUE(Enqueue(&queue, &big, 4000));
+    for (int i = 0; i < 20; i++)
+    {
+      ASSERT_TRUE(Enqueue(&queue, &small, 1000));
+    }
+    size_t len;
+    TimePoint retry;
+    size_t small_before_big = 0;
+    while (queue.Dequeue(kStart, &len, &retry) != nullptr && len != 4000)
+    {
+      small_before_big++;
+    }
+    EXPECT_EQ(len, static_cast<size_t>(4000));
+    // Two rounds of one small packet each before the big flow has 4500.
+    EXPECT_TRUE(small_before_big >= 2 && small_before_big <= 4);
+  }
+
+  // A rate-limited flow sends a burst, then waits for its bucket, while an
+  // unlimited one keeps sending.
+  TEST(fair_queue, RateLimitedFlowWaits)
+  {
+    FairQueue queue;
+    TransmitFlow limited, open;
+    // 150 kB/s: the bucket holds a quantum, refilled in 10 ms. A full
+    // bucket lets two packets through, the second on credit.
+    FairQueue::SetRate(&limited, 150000, kStart);
+    for (int i = 0; i < 4; i++)
+    {
+      ASSERT_TRUE(Enqueue(&queue, &limited, 1500));
+    }
+    for (int i = 0; i < 3; i++)
+    {
+      ASSERT_TRUE(Enqueue(&queue, &open, 1400));
+    }
+    size_t len;
+    TimePoint retry;
+    int limited_sent = 0, open_sent = 0;
+    while (queue.Dequeue(kStart, &len, &retry) != nullptr)
+    {
+      (len == 1400 ? open_sent : limited_sent)++;
+    }
+    EXPECT_EQ(open_sent, 3);
+    EXPECT_EQ(limited_sent, 2);
+    EXPECT_TRUE(retry == kStart + milliseconds(10));
+
+    EXPECT_TRUE(queue.Dequeue(kStart + milliseconds(9), &len, &retry) == nullptr);
+    EXPECT_TRUE(queue.Dequeue(kStart + milliseconds(10), &len, &retry) != nullptr);
+    EXPECT_TRUE(queue.Dequeue(kStart + milliseconds(10), &len, &retry) == nullptr);
+    EXPECT_TRUE(queue.Dequeue(kStart + milliseconds(20), &len, &retry) != nullptr);
+    EXPECT_TRUE(queue.Dequeue(kStart + milliseconds(20), &len, &retry) == nullptr);
+    EXPECT_TRUE(retry == TimePoint::max());
+  }
+
+  // Past a flow's bound its packets are dropped and counted; others still
+  // get in.
+  TEST(fair_queue, FlowLimit)
+  {
+    FairQueue queue;
+    TransmitFlow heavy, light;
+    size_t accepted = 0;
+    while (Enqueue(&queue, &heavy, 1500))
+    {
+      accepted++;
+    }
+    EXPECT_EQ(accepted, FairQueue::kFlowLimit / 1500);
+    EXPECT_FALSE(Enqueue(&queue, &heavy, 1500));
+    EXPECT_EQ(heavy.dropped.load(), static_cast<uint64_t>(2));
+    EXPECT_EQ(queue.dropped(), static_cast<uint64_t>(2));
+    EXPECT_TRUE(Enqueue(&queue, &light, 1500));
+
+    queue.Remove(&heavy);
+    EXPECT_EQ(queue.bytes(), static_cast<size_t>(1500));
+    size_t len;
+    TimePoint retry;
+    EXPECT_TRUE(queue.Dequeue(kStart, &len, &retry) != nullptr);
+    EXPECT_TRUE(queue.Dequeue(kStart, &len, &retry) == nullptr);
+  }
+
+  // A simulated 100 Mbit/s link, sending one packet at a time: a heavy peer
+  // offers twice the link rate in full-size packets and keeps its flow at its
+  // bound, while a light peer sends a small packet every 10 ms. However deep
+  // the heavy backlog, a light packet waits at most for the packet on the
+  // wire and the heavy flow's turn, not for the backlog.
+  TEST(fair_queue, LightPeerDelayBoundedUnderLoad)
+  {
+    const double kLinkBytesPerNs = 100e6 / 8 / 1e9;
+    const std::chrono::nanoseconds kHeavyGap(static_cast<int64_t>(1400 / (2 * kLinkBytesPerNs)));
+    const std::chrono::nanoseconds kLightGap = milliseconds(10);
+    FairQueue queue;
+    TransmitFlow heavy, light;
+    TimePoint now = kStart, next_heavy = kStart, next_light = kStart + milliseconds(1);
+    std::chrono::nanoseconds worst(0);
+    int light_sent = 0;
+    size_t most_queued = 0;
+    while (now < kStart + std::chrono::seconds(2))
+    {
+      for (; next_heavy <= now; next_heavy += kHeavyGap)
+      {
+        Enqueue(&queue, &heavy, 1400);
+      }
+      for (; next_light <= now; next_light += kLightGap)
+      {
+        std::unique_ptr<PacketElement> element = PacketElement::Create(100);
+        // The arrival time rides along in the counter.
+        element->counter = static_cast<uint64_t>((next_light - kStart).count());
+        ASSERT_TRUE(queue.Enqueue(&light, std::move(element), 100));
+      }
+      most_queued = std::max(most_queued, queue.bytes());
+      size_t len;
+      TimePoint retry;
+      std::unique_ptr<PacketElement> element = queue.Dequeue(now, &len, &retry);
+      if (element == nullptr)
+      {
+        now = std::min(next_heavy, next_light);
+        continue;
+      }
+      if (len == 100)
+      {
+        worst = std::max(worst, now - (kStart + std::chrono::nanoseconds(element->counter)));
+        light_sent++;
+      }
+      now += std::chrono::nanoseconds(static_cast<int64_t>(len / kLinkBytesPerNs));
+    }
+    EXPECT_TRUE(light_sent >= 190);
+    // The heavy flow saturated the link and hit its bound.
+    EXPECT_TRUE(most_queued >= FairQueue::kFlowLimit - 1400);
+    EXPECT_TRUE(heavy.dropped.load() > 0);
+    // A 1400-byte packet on the wire, then at most the heavy flow's deficit,
+    // a quantum plus a packet: about 0.3 ms, where draining the backlog
+    // would take 40.
+    const std::chrono::nanoseconds bound(static_cast<int64_t>((2 * 1400 + FairQueue::kQuantum) / kLinkBytesPerNs));
+    EXPECT_TRUE(worst <= bound);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,56 @@
+// The device's event loop on io_uring against poll(): throughput between two
+// devices and the process CPU time, the app threads' included, that each
+// delivered packet costs.
+#include <sys/resource.h>
+
+#include <cstdio>
+
+#include "benchmark.h"
+#include "device_pair.h"
+#include "io_uring.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    double CpuSeconds()
+    {
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    void Run(const char *name, IoBackend backend)
+    {
+      benchmark::DevicePair pair(DefaultCryptoWorkers(), backend);
+      if (!pair.Connect())
+      {
+        printf("%-8s handshake failed\n", name);
+        return;
+      }
+      for (size_t len : {128, 1420})
+      {
+        double cpu = CpuSeconds();
+        benchmark::Throughput throughput = benchmark::MeasureThroughput(&pair, len, 1.0);
+        cpu = CpuSeconds() - cpu;
+        printf("%-8s %5zu bytes  %7.3f Gbit/s  %9.0f packets/s  %6.2f us CPU/packet\n", name, len, throughput.gbps,
+               throughput.packets_per_second, cpu * 1e6 / throughput.packets);
+      }
+    }
+
+  } // namespace
+
+  BENCHMARK(io_uring)
+  {
+    Run("poll", IoBackend::kPoll);
+    if (IoUring::Create(8, 8) == nullptr)
+    {
+      printf("io_uring unavailable or older than 6.3\n");
+      return;
+    }
+    Run("io_uring", IoBackend::kIoUring);
+  }
+
+} // namespace wireguard_flutter
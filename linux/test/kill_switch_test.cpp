@@ -0,0 +1,354 @@
+#include <arpa/inet.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netlink.h>
+#include <sched.h>
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "kill_switch.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    struct Attribute
+    {
+      uint16_t type;
+      const uint8_t *data;
+      size_t len;
+    };
+
+    // The attributes in |len| bytes at |data|, with the nested flag masked
+    // off their types. Fails the test if any overruns the space.
+    std::vector<Attribute> ParseAttributes(const uint8_t *data, size_t len)
+    {
+      std::vector<Attribute> attributes;
+      size_t offset = 0;
+      while (offset + NLA_HDRLEN <= len)
+      {
+        struct nlattr header;
+        memcpy(&header, data + offset, sizeof(header));
+        ASSERT_TRUE(header.nla_len >= NLA_HDRLEN && offset + header.nla_len <= len);
+        attributes.push_back(Attribute{static_cast<uint16_t>(header.nla_type & NLA_TYPE_MASK),
+                                       data + offset + NLA_HDRLEN, static_cast<size_t>(header.nla_len - NLA_HDRLEN)});
+        offset += NLA_ALIGN(header.nla_len);
+      }
+      EXPECT_EQ(offset, len);
+      return attributes;
+    }
+
+    // The first attribute of |type|, or one with no data.
+    Attribute Find(const std::vector<Attribute> &attributes, uint16_t type)
+    {
+      for (const Attribute &attribute : attributes)
+      {
+        if (attribute.type == type)
+        {
+          return attribute;
+        }
+      }
+      return Attribute{type, nullptr, 0};
+    }
+
+    std::vector<Attribute> Nested(const Attribute &attribute)
+    {
+      return ParseAttributes(attribute.data, attribute.len);
+    }
+
+    std::string String(const Attribute &attribute)
+    {
+      return attribute.data != nullptr ? std::string(reinterpret_cast<const char *>(attribute.data)) : std::string();
+    }
+
+    uint32_t U32(const Attribute &attribute)
+    {
+      uint32_t value = 0;
+      if (attribute.len == sizeof(value))
+      {
+        memcpy(&value, attribute.data, sizeof(value));
+      }
+      return ntohl(value);
+    }
+
+    // One message of a batch, split up; its attributes point into the batch.
+    struct Message
+    {
+      uint16_t type;
+      uint16_t flags;
+      uint32_t seq;
+      size_t len;
+      std::vector<Attribute> attributes;
+    };
+
+    std::vector<Message> ParseBatch(const std::vector<uint8_t> &batch)
+    {
+      std::vector<Message> messages;
+      size_t offset = 0;
+      while (offset < batch.size())
+      {
+        struct nlmsghdr header;
+        ASSERT_TRUE(offset + sizeof(header) <= batch.size());
+        memcpy(&header, batch.data() + offset, sizeof(header));
+        ASSERT_TRUE(header.nlmsg_len >= NLMSG_SPACE(sizeof(struct nfgenmsg)) &&
+                    offset + header.nlmsg_len <= batch.size());
+        size_t attributes = NLMSG_SPACE(sizeof(struct nfgenmsg));
+        messages.push_back(Message{header.nlmsg_type, header.nlmsg_flags, header.nlmsg_seq, header.nlmsg_len,
+                                   ParseAttributes(batch.data() + offset + attributes,
+                                                   header.nlmsg_len - attributes)});
+        offset += NLMSG_ALIGN(header.nlmsg_len);
+      }
+      EXPECT_EQ(offset, batch.size());
+      return messages;
+    }
+
+    uint16_t Nftables(uint16_t type)
+    {
+      return static_cast<uint16_t>((NFNL_SUBSYS_NFTABLES << 8) | type);
+    }
+
+    // The elements of every set in |messages|, as "address" or
+    // "address end", in order.
+    std::map<std::string, std::vector<std::string>> SetElements(const std::vector<Message> &messages)
+    {
+      std::map<std::string, std::vector<std::string>> sets;
+      for (const Message &message : messages)
+      {
+        if (message.type == Nftables(NFT_MSG_NEWSET))
+        {
+          sets[String(Find(message.attributes, NFTA_SET_NAME))];
+        }
+        if (message.type != Nftables(NFT_MSG_NEWSETELEM))
+        {
+          continue;
+        }
+        std::vector<std::string> &elements = sets[String(Find(message.attributes, NFTA_SET_ELEM_LIST_SET))];
+        for (const Attribute &element : Nested(Find(message.attributes, NFTA_SET_ELEM_LIST_ELEMENTS)))
+        {
+          std::vector<Attribute> fields = Nested(element);
+          Attribute value = Find(Nested(Find(fields, NFTA_SET_ELEM_KEY)), NFTA_DATA_VALUE);
+          ASSERT_TRUE(value.len == 4 || value.len == 16);
+          char text[INET6_ADDRSTRLEN];
+          inet_ntop(value.len == 4 ? AF_INET : AF_INET6, value.data, text, sizeof(text));
+          bool end = (U32(Find(fields, NFTA_SET_ELEM_FLAGS)) & NFT_SET_ELEM_INTERVAL_END) != 0;
+          elements.push_back(std::string(text) + (end ? " end" : ""));
+        }
+      }
+      return sets;
+    }
+
+    IpPrefix Prefix(const char *text)
+    {
+      IpPrefix prefix;
+      EXPECT_TRUE(ParseIpPrefix(text, &prefix));
+      return prefix;
+    }
+
+    KillSwitchConfig SplitTunnel()
+    {
+      KillSwitchConfig config;
+      config.interface = "wg0";
+      config.endpoints = {Prefix("198.51.100.7/32"), Prefix("2001:db8::7/128")};
+      config.allowed_ips = {Prefix("10.0.1.0/24"), Prefix("10.0.0.0/24"), Prefix("10.0.0.128/25"),
+                            Prefix("192.168.0.0/16"), Prefix("fd00::/8")};
+      config.lan_exceptions = {Prefix("192.168.1.0/24")};
+      return config;
+    }
+
+  } // namespace
+
+  // The batch is one transaction: begin and end markers around the
+  // requests, sequence numbers running on from |seq|, and an ack asked of
+  // the last request only.
+  TEST(kill_switch, BatchFraming)
+  {
+    uint32_t seq = 1000;
+    std::vector<uint8_t> batch = CompileKillSwitch(SplitTunnel(), &seq);
+    std::vector<Message> messages = ParseBatch(batch);
+    ASSERT_TRUE(messages.size() > 4);
+    EXPECT_EQ(seq, static_cast<uint32_t>(1000 + messages.size()));
+    EXPECT_EQ(messages.front().type, static_cast<uint16_t>(NFNL_MSG_BATCH_BEGIN));
+    EXPECT_EQ(messages.back().type, static_cast<uint16_t>(NFNL_MSG_BATCH_END));
+    for (size_t i = 0; i < messages.size(); i++)
+    {
+      EXPECT_EQ(messages[i].seq, static_cast<uint32_t>(1000 + i));
+      EXPECT_TRUE((messages[i].flags & NLM_F_REQUEST) != 0);
+      EXPECT_EQ((messages[i].flags & NLM_F_ACK) != 0, i == messages.size() - 2);
+    }
+    // Any old table goes, and a new one takes its place.
+    EXPECT_EQ(messages[1].type, Nftables(NFT_MSG_NEWTABLE));
+    EXPECT_EQ(messages[2].type, Nftables(NFT_MSG_DELTABLE));
+    EXPECT_EQ(messages[3].type, Nftables(NFT_MSG_NEWTABLE));
+    EXPECT_EQ(String(Find(messages[3].attributes, NFTA_TABLE_NAME)), std::string("wireguard_flutter"));
+
+    std::vector<uint8_t> removal_batch = CompileKillSwitchRemoval(&seq);
+    std::vector<Message> removal = ParseBatch(removal_batch);
+    ASSERT_EQ(removal.size(), static_cast<size_t>(4));
+    EXPECT_EQ(removal[2].type, Nftables(NFT_MSG_DELTABLE));
+    EXPECT_TRUE((removal[2].flags & NLM_F_ACK) != 0);
+    EXPECT_EQ(removal[0].seq, static_cast<uint32_t>(1000 + messages.size()));
+  }
+
+  // Prefixes are merged into intervals, each set opening with an end at
+  // zero as nft writes them.
+  TEST(kill_switch, SetIntervals)
+  {
+    uint32_t seq = 1;
+    std::vector<uint8_t> batch = CompileKillSwitch(SplitTunnel(), &seq);
+    std::map<std::string, std::vector<std::string>> sets = SetElements(ParseBatch(batch));
+    EXPECT_EQ(sets.size(), static_cast<size_t>(4));
+    std::vector<std::string> tunnel4 = {"0.0.0.0 end", "10.0.0.0", "10.0.2.0 end", "192.168.0.0", "192.169.0.0 end"};
+    EXPECT_TRUE(sets["tunnel4"] == tunnel4);
+    std::vector<std::string> tunnel6 = {":: end", "fd00::", "fe00:: end"};
+    EXPECT_TRUE(sets["tunnel6"] == tunnel6);
+    std::vector<std::string> bypass4 = {"0.0.0.0 end", "192.168.1.0", "192.168.2.0 end", "198.51.100.7",
+                                        "198.51.100.8 end"};
+    EXPECT_TRUE(sets["bypass4"] == bypass4);
+    std::vector<std::string> bypass6 = {":: end", "2001:db8::7", "2001:db8::8 end"};
+    EXPECT_TRUE(sets["bypass6"] == bypass6);
+  }
+
+  // A split tunnel accepts by default and drops AllowedIPs off the tunnel;
+  // a full tunnel drops by default, of both families, and needs no drop
+  // rules.
+  TEST(kill_switch, ChainPolicyAndRules)
+  {
+    for (bool full : {false, true})
+    {
+      KillSwitchConfig config = SplitTunnel();
+      if (full)
+      {
+        config.allowed_ips = {Prefix("0.0.0.0/0")};
+      }
+      uint32_t seq = 1;
+      std::vector<uint8_t> batch = CompileKillSwitch(config, &seq);
+      std::vector<Message> messages = ParseBatch(batch);
+      size_t rules = 0;
+      std::vector<uint32_t> verdicts;
+      for (const Message &message : messages)
+      {
+        if (message.type == Nftables(NFT_MSG_NEWCHAIN))
+        {
+          EXPECT_EQ(U32(Find(message.attributes, NFTA_CHAIN_POLICY)),
+                    static_cast<uint32_t>(full ? NF_DROP : NF_ACCEPT));
+          EXPECT_EQ(U32(Find(Nested(Find(message.attributes, NFTA_CHAIN_HOOK)), NFTA_HOOK_HOOKNUM)),
+                    static_cast<uint32_t>(NF_INET_LOCAL_OUT));
+        }
+        if (message.type != Nftables(NFT_MSG_NEWRULE))
+        {
+          continue;
+        }
+        rules++;
+        std::vector<Attribute> expressions = Nested(Find(message.attributes, NFTA_RULE_EXPRESSIONS));
+        ASSERT_TRUE(!expressions.empty());
+        // The verdict is the rule's last expression.
+        std::vector<Attribute> last = Nested(expressions.back());
+        EXPECT_EQ(String(Find(last, NFTA_EXPR_NAME)), std::string("immediate"));
+        Attribute immediate = Find(Nested(Find(last, NFTA_EXPR_DATA)), NFTA_IMMEDIATE_DATA);
+        Attribute verdict = Find(Nested(immediate), NFTA_DATA_VERDICT);
+        verdicts.push_back(U32(Find(Nested(verdict), NFTA_VERDICT_CODE)));
+      }
+      // lo, the tunnel, and the bypass sets, then drops for a split tunnel.
+      std::vector<uint32_t> expected = {NF_ACCEPT, NF_ACCEPT, NF_ACCEPT, NF_ACCEPT};
+      if (!full)
+      {
+        expected.push_back(NF_DROP);
+        expected.push_back(NF_DROP);
+      }
+      EXPECT_EQ(rules, expected.size());
+      EXPECT_TRUE(verdicts == expected);
+    }
+  }
+
+  // Tens of thousands of prefixes spread over element messages small enough
+  // for nested attribute lengths, with every one of them there; the rules
+  // stay the same.
+  TEST(kill_switch, LargeSets)
+  {
+    KillSwitchConfig config = SplitTunnel();
+    config.allowed_ips.clear();
+    for (uint32_t i = 0; i < 20000; i++)
+    {
+      // Every other /32, so none merge.
+      IpPrefix prefix;
+      prefix.family = AF_INET;
+      prefix.cidr = 32;
+      uint32_t address = htonl((172u << 24) | (16u << 16) | (i * 2));
+      memcpy(prefix.address, &address, 4);
+      config.allowed_ips.push_back(prefix);
+    }
+    uint32_t seq = 1;
+    std::vector<uint8_t> batch = CompileKillSwitch(config, &seq);
+    std::vector<Message> messages = ParseBatch(batch);
+    size_t element_messages = 0;
+    for (const Message &message : messages)
+    {
+      EXPECT_TRUE(message.len < 65536);
+      element_messages += message.type == Nftables(NFT_MSG_NEWSETELEM);
+    }
+    EXPECT_TRUE(element_messages > 4);
+    std::map<std::string, std::vector<std::string>> sets = SetElements(messages);
+    // The opening end, then a start and an end for each.
+    ASSERT_EQ(sets["tunnel4"].size(), static_cast<size_t>(1 + 2 * 20000));
+    EXPECT_EQ(sets["tunnel4"][1], std::string("172.16.0.0"));
+    EXPECT_EQ(sets["tunnel4"][2], std::string("172.16.0.1 end"));
+    EXPECT_EQ(sets["tunnel4"].back(), std::string("172.16.156.63 end"));
+  }
+
+  TEST(kill_switch, RejectsBadInterfaceName)
+  {
+    KillSwitchConfig config = SplitTunnel();
+    uint32_t seq = 1;
+    for (const char *name : {"", "an-interface-name-too-long"})
+    {
+      config.interface = name;
+      bool thrown = false;
+      try
+      {
+        CompileKillSwitch(config, &seq);
+      }
+      catch (const std::runtime_error &)
+      {
+        thrown = true;
+      }
+      EXPECT_TRUE(thrown);
+    }
+  }
+
+  // The kernel takes the batch, replaces it, and removes it, in a network
+  // namespace of the test's own.
+  TEST(kill_switch, KernelAcceptsBatch)
+  {
+    if (unshare(CLONE_NEWNET) != 0)
+    {
+      SKIP(std::string("no network namespace: ") + strerror(errno));
+    }
+    std::unique_ptr<KillSwitch> kill_switch;
+    try
+    {
+      kill_switch.reset(new KillSwitch(OpenNftablesNetlink()));
+      kill_switch->Disable();
+    }
+    catch (const std::runtime_error &error)
+    {
+      SKIP(std::string("no nf_tables: ") + error.what());
+    }
+    KillSwitchConfig config = SplitTunnel();
+    kill_switch->Enable(config);
+    config.allowed_ips = {Prefix("0.0.0.0/0"), Prefix("::/0")};
+    kill_switch->Enable(config);
+    kill_switch->Disable();
+    kill_switch->Disable();
+  }
+
+} // namespace wireguard_flutter
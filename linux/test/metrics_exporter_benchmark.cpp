@@ -0,0 +1,98 @@
+// Scraping a device with 10k peers: rendering the OpenMetrics text alone,
+// and a whole GET /metrics over a localhost connection as Prometheus makes
+// it.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "benchmark.h"
+#include "config_parser.h"
+#include "curve25519.h"
+#include "device.h"
+#include "metrics_exporter.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kPeers = 10000;
+
+    // Reads a whole response; the exporter closes the connection after
+    // each.
+    size_t Scrape(uint16_t port)
+    {
+      int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr.sin_port = htons(port);
+      if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+      {
+        close(fd);
+        throw std::runtime_error("cannot connect to the exporter");
+      }
+      const char request[] = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+      send(fd, request, sizeof(request) - 1, 0);
+      size_t total = 0;
+      char buffer[64 * 1024];
+      ssize_t n;
+      while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+      {
+        total += static_cast<size_t>(n);
+      }
+      close(fd);
+      return total;
+    }
+
+  } // namespace
+
+  BENCHMARK(metrics_exporter)
+  {
+    uint8_t key[kCurve25519KeySize];
+    X25519GeneratePrivateKey(key);
+    std::string config = "[Interface]\nPrivateKey = " + EncodeBase64Key(key) + "\n";
+    for (size_t i = 0; i < kPeers; i++)
+    {
+      uint8_t peer_key[kCurve25519KeySize] = {0x40, static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)};
+      config += "[Peer]\nPublicKey = " + EncodeBase64Key(peer_key) + "\nAllowedIPs = 10." + std::to_string(i >> 8) +
+                "." + std::to_string(i & 255) + ".0/24\n";
+    }
+    // Never run, so its TUN can be one end of a socketpair.
+    int tun[2];
+    socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun);
+    std::unique_ptr<Device> device(new Device(tun[0], 1));
+    device->Configure(ParseWgQuickConfig(config));
+
+    {
+      MetricsExporter exporter(device.get());
+      size_t len = 0;
+      // The first scrape sizes the buffers.
+      exporter.Render(&len);
+      double rate = benchmark::CallsPerSecond([&]
+                                              { exporter.Render(&len); },
+                                              0.5, 1);
+      printf("%zu peers  render %7.2f ms  %5.2f MB  %6.0f MB/s\n", kPeers, 1e3 / rate, len / 1e6, rate * len / 1e6);
+
+      uint16_t port = exporter.ListenLocalhost(0);
+      size_t bytes = 0;
+      rate = benchmark::CallsPerSecond([&]
+                                       { bytes = Scrape(port); },
+                                       0.5, 1);
+      printf("%zu peers  scrape %7.2f ms  %5.2f MB over localhost\n", kPeers, 1e3 / rate, bytes / 1e6);
+      exporter.Stop();
+    }
+    device.reset();
+    close(tun[1]);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,604 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "config_parser.h"
+#include "curve25519.h"
+#include "device.h"
+#include "metrics_exporter.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    typedef std::vector<std::pair<std::string, std::string>> Labels;
+
+    struct Sample
+    {
+      std::string name;
+      Labels labels;
+      double value;
+    };
+
+    struct Family
+    {
+      std::string type = "unknown";
+      std::string unit;
+      std::string help;
+      std::vector<Sample> samples;
+    };
+
+    // A strict reader of the OpenMetrics 1.0 text format, for the parts the
+    // exporter uses: metadata before samples, families not interleaved or
+    // repeated, sample names that fit the family's type, escaped label
+    // values, unique label sets, valid histograms, and # EOF at the end.
+    class OpenMetricsParser
+    {
+    public:
+      // Returns an empty string if |text| parses, or what is wrong with it.
+      std::string Parse(const std::string &text)
+      {
+        size_t pos = 0;
+        line_ = 0;
+        while (pos < text.size())
+        {
+          size_t end = text.find('\n', pos);
+          if (end == std::string::npos)
+          {
+            return Error("line not terminated");
+          }
+          std::string line = text.substr(pos, end - pos);
+          pos = end + 1;
+          line_++;
+          if (line == "# EOF")
+          {
+            if (pos != text.size())
+            {
+              return Error("text after # EOF");
+            }
+            return Finish();
+          }
+          std::string error = line.compare(0, 2, "# ") == 0 ? Metadata(line.substr(2)) : SampleLine(line);
+          if (!error.empty())
+          {
+            return error;
+          }
+        }
+        return Error("no # EOF");
+      }
+
+      const std::map<std::string, Family> &families() const { return families_; }
+
+    private:
+      std::string Error(const std::string &what) const { return "line " + std::to_string(line_) + ": " + what; }
+
+      static bool IsMetricName(const std::string &name)
+      {
+        if (name.empty() || isdigit(static_cast<unsigned char>(name[0])))
+        {
+          return false;
+        }
+        for (char c : name)
+        {
+          if (!isalnum(static_cast<unsigned char>(c)) && c != '_' && c != ':')
+          {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      static bool IsLabelName(const std::string &name)
+      {
+        return IsMetricName(name) && name.find(':') == std::string::npos;
+      }
+
+      // Checks the escapes of |text|, which may only be \\, \" and \n.
+      static bool Unescape(const std::string &text, std::string *out)
+      {
+        out->clear();
+        for (size_t i = 0; i < text.size(); i++)
+        {
+          if (text[i] != '\\')
+          {
+            out->push_back(text[i]);
+            continue;
+          }
+          if (++i == text.size() || (text[i] != '\\' && text[i] != '"' && text[i] != 'n'))
+          {
+            return false;
+          }
+          out->push_back(text[i] == 'n' ? '\n' : text[i]);
+        }
+        return true;
+      }
+
+      std::string Metadata(const std::string &line)
+      {
+        size_t first = line.find(' ');
+        size_t second = first == std::string::npos ? first : line.find(' ', first + 1);
+        if (second == std::string::npos)
+        {
+          return Error("malformed metadata");
+        }
+        std::string kind = line.substr(0, first);
+        std::string name = line.substr(first + 1, second - first - 1);
+        std::string value = line.substr(second + 1);
+        if (!IsMetricName(name))
+        {
+          return Error("bad family name " + name);
+        }
+        if (name != current_)
+        {
+          if (families_.count(name) != 0)
+          {
+            return Error("family " + name + " interleaved with another");
+          }
+          current_ = name;
+          families_[name];
+          seen_.clear();
+        }
+        Family &family = families_[name];
+        if (!family.samples.empty())
+        {
+          return Error("metadata after samples of " + name);
+        }
+        if (!seen_.insert(kind).second)
+        {
+          return Error("repeated " + kind + " for " + name);
+        }
+        if (kind == "TYPE")
+        {
+          static const std::set<std::string> kTypes = {"counter", "gauge", "histogram", "gaugehistogram",
+                                                       "stateset", "info", "summary", "unknown"};
+          if (kTypes.count(value) == 0)
+          {
+            return Error("unknown type " + value);
+          }
+          family.type = value;
+        }
+        else if (kind == "UNIT")
+        {
+          if (name.size() <= value.size() || name.compare(name.size() - value.size() - 1, std::string::npos,
+                                                          "_" + value) != 0)
+          {
+            return Error("family " + name + " does not end in its unit " + value);
+          }
+          family.unit = value;
+        }
+        else if (kind == "HELP")
+        {
+          if (!Unescape(value, &family.help))
+          {
+            return Error("bad escape in help");
+          }
+        }
+        else
+        {
+          return Error("unknown metadata " + kind);
+        }
+        return "";
+      }
+
+      std::string SampleLine(const std::string &line)
+      {
+        size_t i = 0;
+        while (i < line.size() && line[i] != '{' && line[i] != ' ')
+        {
+          i++;
+        }
+        Sample sample;
+        sample.name = line.substr(0, i);
+        if (!IsMetricName(sample.name))
+        {
+          return Error("bad metric name " + sample.name);
+        }
+        if (i < line.size() && line[i] == '{')
+        {
+          i++;
+          std::set<std::string> names;
+          while (i < line.size() && line[i] != '}')
+          {
+            size_t equals = line.find("=\"", i);
+            if (equals == std::string::npos)
+            {
+              return Error("malformed label");
+            }
+            std::string name = line.substr(i, equals - i);
+            if (!IsLabelName(name) || !names.insert(name).second)
+            {
+              return Error("bad or repeated label " + name);
+            }
+            size_t j = equals + 2;
+            while (j < line.size() && line[j] != '"')
+            {
+              j += line[j] == '\\' ? 2 : 1;
+            }
+            if (j >= line.size())
+            {
+              return Error("unterminated label value");
+            }
+            std::string value;
+            if (!Unescape(line.substr(equals + 2, j - equals - 2), &value))
+            {
+              return Error("bad escape in label value");
+            }
+            sample.labels.emplace_back(name, value);
+            i = j + 1;
+            if (i < line.size() && line[i] == ',')
+            {
+              i++;
+            }
+          }
+          if (i >= line.size())
+          {
+            return Error("unterminated labels");
+          }
+          i++;
+        }
+        if (i >= line.size() || line[i] != ' ')
+        {
+          return Error("no value");
+        }
+        std::string value = line.substr(i + 1);
+        if (value == "+Inf" || value == "-Inf" || value == "NaN")
+        {
+          sample.value = value == "NaN" ? NAN : value[0] == '+' ? INFINITY : -INFINITY;
+        }
+        else
+        {
+          char *end = nullptr;
+          sample.value = strtod(value.c_str(), &end);
+          if (value.empty() || *end != '\0' || value.find_first_of("xXpP") != std::string::npos)
+          {
+            return Error("bad value " + value);
+          }
+        }
+
+        auto family = families_.find(current_);
+        if (family == families_.end() || !Suffixed(sample.name, current_, family->second.type))
+        {
+          return Error("sample " + sample.name + " outside its family");
+        }
+        if (family->second.type == "counter" && !(sample.value >= 0))
+        {
+          return Error("negative counter " + sample.name);
+        }
+        Labels sorted = sample.labels;
+        std::sort(sorted.begin(), sorted.end());
+        std::string key = sample.name;
+        for (const auto &label : sorted)
+        {
+          key += "\n" + label.first + "=" + label.second;
+        }
+        if (!keys_.insert(key).second)
+        {
+          return Error("repeated sample " + sample.name);
+        }
+        family->second.samples.push_back(sample);
+        return "";
+      }
+
+      static bool Suffixed(const std::string &sample, const std::string &family, const std::string &type)
+      {
+        if (sample.compare(0, family.size(), family) != 0)
+        {
+          return false;
+        }
+        std::string suffix = sample.substr(family.size());
+        if (type == "counter")
+        {
+          return suffix == "_total" || suffix == "_created";
+        }
+        if (type == "histogram")
+        {
+          return suffix == "_bucket" || suffix == "_count" || suffix == "_sum" || suffix == "_created";
+        }
+        return suffix.empty();
+      }
+
+      // Histogram buckets rise with le up to +Inf, which _count matches.
+      std::string Finish()
+      {
+        for (const auto &entry : families_)
+        {
+          if (entry.second.type != "histogram")
+          {
+            continue;
+          }
+          double last_le = -INFINITY, last_count = 0, count = -1;
+          bool inf = false;
+          for (const Sample &sample : entry.second.samples)
+          {
+            if (sample.name == entry.first + "_count")
+            {
+              count = sample.value;
+            }
+            if (sample.name != entry.first + "_bucket")
+            {
+              continue;
+            }
+            if (sample.labels.size() != 1 || sample.labels[0].first != "le")
+            {
+              return "histogram " + entry.first + " bucket without le";
+            }
+            double le = sample.labels[0].second == "+Inf" ? INFINITY : strtod(sample.labels[0].second.c_str(), nullptr);
+            if (!(le > last_le) || sample.value < last_count)
+            {
+              return "histogram " + entry.first + " buckets out of order";
+            }
+            inf = std::isinf(le);
+            last_le = le;
+            last_count = sample.value;
+          }
+          if (!inf || count != last_count)
+          {
+            return "histogram " + entry.first + " without a +Inf bucket matching its count";
+          }
+        }
+        return "";
+      }
+
+      std::map<std::string, Family> families_;
+      std::string current_;
+      std::set<std::string> seen_;
+      std::set<std::string> keys_;
+      int line_ = 0;
+    };
+
+    std::string Render(MetricsExporter *exporter)
+    {
+      size_t len;
+      const char *text = exporter->Render(&len);
+      return std::string(text, len);
+    }
+
+    const Family &Get(const OpenMetricsParser &parser, const std::string &name)
+    {
+      static const Family kMissing;
+      auto it = parser.families().find(name);
+      EXPECT_TRUE(it != parser.families().end());
+      return it == parser.families().end() ? kMissing : it->second;
+    }
+
+    std::string InterfaceConfig()
+    {
+      uint8_t key[kCurve25519KeySize];
+      X25519GeneratePrivateKey(key);
+      return "[Interface]\nPrivateKey = " + EncodeBase64Key(key) + "\n";
+    }
+
+    // A configured device that is never run, with a socketpair for its
+    // TUN.
+    class IdleDevice
+    {
+    public:
+      explicit IdleDevice(const std::string &config)
+      {
+        socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_);
+        device_.reset(new Device(tun_[0], 1));
+        device_->Configure(ParseWgQuickConfig(config));
+      }
+
+      ~IdleDevice() { close(tun_[1]); }
+
+      Device *get() { return device_.get(); }
+
+    private:
+      int tun_[2];
+      std::unique_ptr<Device> device_;
+    };
+
+    // Sends |request| to a stream socket at |addr| and reads the response
+    // until the exporter closes the connection.
+    std::string Fetch(const struct sockaddr *addr, socklen_t addr_len, const std::string &request)
+    {
+      int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      EXPECT_EQ(connect(fd, addr, addr_len), 0);
+      EXPECT_EQ(send(fd, request.data(), request.size(), 0), static_cast<ssize_t>(request.size()));
+      std::string response;
+      char buffer[4096];
+      ssize_t n;
+      struct pollfd p = {fd, POLLIN, 0};
+      while (poll(&p, 1, 2000) > 0 && (n = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+      {
+        response.append(buffer, static_cast<size_t>(n));
+      }
+      close(fd);
+      return response;
+    }
+
+    // Checks an HTTP response carries a whole OpenMetrics body.
+    void CheckScrape(const std::string &response)
+    {
+      size_t split = response.find("\r\n\r\n");
+      ASSERT_TRUE(split != std::string::npos);
+      std::string headers = response.substr(0, split + 2);
+      std::string body = response.substr(split + 4);
+      EXPECT_EQ(headers.compare(0, 17, "HTTP/1.1 200 OK\r\n"), 0);
+      EXPECT_TRUE(headers.find("\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n") !=
+                  std::string::npos);
+      EXPECT_TRUE(headers.find("\r\nContent-Length: " + std::to_string(body.size()) + "\r\n") != std::string::npos);
+      OpenMetricsParser parser;
+      EXPECT_EQ(parser.Parse(body), std::string());
+    }
+
+  } // namespace
+
+  // The reader used below rejects what the format forbids.
+  TEST(metrics_exporter, ParserIsStrict)
+  {
+    const std::string good = "# TYPE a counter\n# HELP a A \\\\ count.\na_total{k=\"v\\\"\"} 1\n# EOF\n";
+    OpenMetricsParser parser;
+    EXPECT_EQ(parser.Parse(good), std::string());
+    EXPECT_EQ(parser.families().at("a").samples[0].labels[0].second, std::string("v\""));
+    const char *bad[] = {
+        "# TYPE a counter\na_total 1\n",
+        "# TYPE a counter\na 1\n# EOF\n",
+        "# TYPE a counter\na_total -1\n# EOF\n",
+        "# TYPE a counter\na_total{k=\"\\x\"} 1\n# EOF\n",
+        "# TYPE a counter\na_total{k=\"1\",k=\"2\"} 1\n# EOF\n",
+        "# TYPE a counter\na_total 1\na_total 2\n# EOF\n",
+        "# TYPE a gauge\n# TYPE b gauge\n# HELP a late\n# EOF\n",
+        "# TYPE a gauge\na 1\n# HELP a late\n# EOF\n",
+        "# TYPE a_bytes gauge\n# UNIT a_bytes seconds\n# EOF\n",
+        "# TYPE a gauge\na 1x\n# EOF\n",
+        "# TYPE h histogram\nh_bucket{le=\"1.0\"} 2\nh_bucket{le=\"+Inf\"} 1\nh_count 1\n# EOF\n",
+        "# TYPE h histogram\nh_bucket{le=\"+Inf\"} 1\nh_count 2\n# EOF\n",
+        "# EOF\n\n",
+    };
+    for (const char *text : bad)
+    {
+      OpenMetricsParser strict;
+      EXPECT_TRUE(!strict.Parse(text).empty());
+    }
+  }
+
+  // With no peers every family is still declared, and the histogram is
+  // empty but whole.
+  TEST(metrics_exporter, NoPeers)
+  {
+    IdleDevice device(InterfaceConfig());
+    MetricsExporter exporter(device.get());
+    OpenMetricsParser parser;
+    ASSERT_EQ(parser.Parse(Render(&exporter)), std::string());
+    EXPECT_EQ(parser.families().size(), static_cast<size_t>(10));
+    EXPECT_EQ(Get(parser, "wireguard_peer_transmit_bytes").type, std::string("counter"));
+    EXPECT_EQ(Get(parser, "wireguard_peer_transmit_bytes").unit, std::string("bytes"));
+    EXPECT_TRUE(Get(parser, "wireguard_peer_up").samples.empty());
+    const Family &latency = Get(parser, "wireguard_connect_latency_seconds");
+    EXPECT_EQ(latency.type, std::string("histogram"));
+    EXPECT_EQ(latency.samples.size(), kConnectLatencyBuckets + 2);
+    EXPECT_EQ(latency.samples[0].labels[0].second, std::string("0.005"));
+  }
+
+  // Thousands of peers fit the buffer the exporter sizes for them, each
+  // with its own label set in every family.
+  TEST(metrics_exporter, ManyPeers)
+  {
+    std::string config = InterfaceConfig();
+    const size_t kPeers = 2000;
+    for (size_t i = 0; i < kPeers; i++)
+    {
+      uint8_t key[kCurve25519KeySize] = {0x40, static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)};
+      config += "[Peer]\nPublicKey = " + EncodeBase64Key(key) + "\nAllowedIPs = 10." +
+                std::to_string(i >> 8) + "." + std::to_string(i & 255) + ".0/24\n";
+    }
+    IdleDevice device(config);
+    MetricsExporter exporter(device.get());
+    for (int scrape = 0; scrape < 2; scrape++)
+    {
+      OpenMetricsParser parser;
+      ASSERT_EQ(parser.Parse(Render(&exporter)), std::string());
+      EXPECT_EQ(Get(parser, "wireguard_peer_receive_bytes").samples.size(), kPeers);
+      EXPECT_EQ(Get(parser, "wireguard_peer_state_transitions").samples.size(), 2 * kPeers);
+      EXPECT_EQ(Get(parser, "wireguard_peer_up").samples.size(), kPeers);
+      EXPECT_TRUE(Get(parser, "wireguard_peer_handshake_age_seconds").samples.empty());
+    }
+  }
+
+  // After a handshake the peer's traffic, session and connect time show up,
+  // and the output still parses.
+  TEST(metrics_exporter, AfterHandshake)
+  {
+    uint8_t a_private[kCurve25519KeySize], b_private[kCurve25519KeySize];
+    uint8_t a_public[kCurve25519KeySize], b_public[kCurve25519KeySize];
+    X25519GeneratePrivateKey(a_private);
+    X25519GeneratePrivateKey(b_private);
+    X25519PublicKey(a_public, a_private);
+    X25519PublicKey(b_public, b_private);
+    int tun_a[2], tun_b[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_a), 0);
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_b), 0);
+    Device a(tun_a[0], 1), b(tun_b[0], 1);
+    uint16_t b_port = b.Bind(0);
+    a.Bind(0);
+    a.Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(a_private) +
+                                   "\n[Peer]\nPublicKey = " + EncodeBase64Key(b_public) +
+                                   "\nAllowedIPs = 10.0.0.2/32\nEndpoint = 127.0.0.1:" + std::to_string(b_port) +
+                                   "\n"));
+    b.Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(b_private) +
+                                   "\n[Peer]\nPublicKey = " + EncodeBase64Key(a_public) +
+                                   "\nAllowedIPs = 10.0.0.1/32\n"));
+    std::thread run_a([&]
+                      { a.Run(); });
+    std::thread run_b([&]
+                      { b.Run(); });
+    uint8_t packet[100] = {0x45, 0, 0, 100, 0, 0, 0, 0, 64, 17, 0, 0, 10, 0, 0, 1, 10, 0, 0, 2};
+    uint8_t received[2048];
+    EXPECT_EQ(write(tun_a[1], packet, sizeof(packet)), static_cast<ssize_t>(sizeof(packet)));
+    struct pollfd p = {tun_b[1], POLLIN, 0};
+    EXPECT_EQ(poll(&p, 1, 2000), 1);
+    EXPECT_EQ(read(tun_b[1], received, sizeof(received)), static_cast<ssize_t>(sizeof(packet)));
+    a.Stop();
+    b.Stop();
+    run_a.join();
+    run_b.join();
+
+    MetricsExporter exporter(&a);
+    OpenMetricsParser parser;
+    ASSERT_EQ(parser.Parse(Render(&exporter)), std::string());
+    const Family &tx = Get(parser, "wireguard_peer_transmit_bytes");
+    ASSERT_EQ(tx.samples.size(), static_cast<size_t>(1));
+    EXPECT_EQ(tx.samples[0].labels[0].first, std::string("public_key"));
+    EXPECT_EQ(tx.samples[0].labels[0].second, EncodeBase64Key(b_public));
+    EXPECT_TRUE(tx.samples[0].value > 0);
+    EXPECT_EQ(Get(parser, "wireguard_peer_handshakes").samples[0].value, 1.0);
+    EXPECT_EQ(Get(parser, "wireguard_peer_up").samples[0].value, 1.0);
+    EXPECT_EQ(Get(parser, "wireguard_peer_handshake_age_seconds").samples.size(), static_cast<size_t>(1));
+    EXPECT_EQ(Get(parser, "wireguard_peer_connect_latency_seconds").samples.size(), static_cast<size_t>(1));
+    const Family &latency = Get(parser, "wireguard_connect_latency_seconds");
+    EXPECT_EQ(latency.samples[kConnectLatencyBuckets].name, std::string("wireguard_connect_latency_seconds_count"));
+    EXPECT_EQ(latency.samples[kConnectLatencyBuckets].value, 1.0);
+    close(tun_a[1]);
+    close(tun_b[1]);
+  }
+
+  // Scrapes over TCP and a Unix socket get the same text with the OpenMetrics
+  // content type; other paths are not found.
+  TEST(metrics_exporter, ServesScrapes)
+  {
+    IdleDevice device(InterfaceConfig());
+    MetricsExporter exporter(device.get());
+    struct sockaddr_in in;
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    in.sin_port = htons(exporter.ListenLocalhost(0));
+    const struct sockaddr *addr = reinterpret_cast<const struct sockaddr *>(&in);
+    CheckScrape(Fetch(addr, sizeof(in), "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n"));
+    CheckScrape(Fetch(addr, sizeof(in), "GET /metrics?x=1 HTTP/1.1\r\n\r\n"));
+    EXPECT_EQ(Fetch(addr, sizeof(in), "GET /other HTTP/1.1\r\n\r\n").compare(0, 22, "HTTP/1.1 404 Not Found"), 0);
+    exporter.Stop();
+
+    std::string path = "/tmp/metrics_exporter_test." + std::to_string(getpid());
+    exporter.ListenUnix(path);
+    struct sockaddr_un un;
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, path.c_str());
+    CheckScrape(Fetch(reinterpret_cast<const struct sockaddr *>(&un), sizeof(un), "GET /metrics HTTP/1.0\r\n\r\n"));
+    exporter.Stop();
+    EXPECT_EQ(access(path.c_str(), F_OK), -1);
+  }
+
+} // namespace wireguard_flutter
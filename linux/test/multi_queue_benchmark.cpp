@@ -0,0 +1,192 @@
+// Throughput from sockets on this host through a multi-queue TUN to a peer,
+// with 1, 2 and 4 queues: many flows, so the kernel spreads them over the
+// queues and each queue's thread reads and encrypts its share. Needs
+// CAP_NET_ADMIN for the TUN.
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "config_parser.h"
+#include "curve25519.h"
+#include "device.h"
+#include "tun.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kPayloadLength = 1400;
+    const int kSenders = 4;
+    const int kFlowsPerSender = 16;
+
+    // Gives the interface 10.78.0.1/24 and brings it up.
+    bool ConfigureInterface(const std::string &name)
+    {
+      int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      struct ifreq ifr;
+      memset(&ifr, 0, sizeof(ifr));
+      memcpy(ifr.ifr_name, name.c_str(), name.size());
+      struct sockaddr_in *sin = reinterpret_cast<struct sockaddr_in *>(&ifr.ifr_addr);
+      sin->sin_family = AF_INET;
+      inet_pton(AF_INET, "10.78.0.1", &sin->sin_addr);
+      bool ok = ioctl(fd, SIOCSIFADDR, &ifr) == 0;
+      inet_pton(AF_INET, "255.255.255.0", &sin->sin_addr);
+      ok = ok && ioctl(fd, SIOCSIFNETMASK, &ifr) == 0;
+      ok = ok && ioctl(fd, SIOCGIFFLAGS, &ifr) == 0;
+      ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+      ok = ok && ioctl(fd, SIOCSIFFLAGS, &ifr) == 0;
+      close(fd);
+      return ok;
+    }
+
+    // Returns false if there is no TUN to run on.
+    bool Run(size_t queue_count)
+    {
+      std::string name;
+      std::vector<int> queues;
+      try
+      {
+        queues = OpenTunQueues("", queue_count, &name);
+      }
+      catch (const std::runtime_error &error)
+      {
+        printf("no TUN: %s\n", error.what());
+        return false;
+      }
+      if (!ConfigureInterface(name))
+      {
+        printf("cannot configure %s\n", name.c_str());
+        for (int fd : queues)
+        {
+          close(fd);
+        }
+        return false;
+      }
+
+      uint8_t a_private[kCurve25519KeySize], b_private[kCurve25519KeySize];
+      uint8_t a_public[kCurve25519KeySize], b_public[kCurve25519KeySize];
+      X25519GeneratePrivateKey(a_private);
+      X25519GeneratePrivateKey(b_private);
+      X25519PublicKey(a_public, a_private);
+      X25519PublicKey(b_public, b_private);
+      int tun_b[2];
+      if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_b) != 0)
+      {
+        throw std::runtime_error("socketpair failed");
+      }
+      Device a(queues, DefaultCryptoWorkers()), b(tun_b[0], DefaultCryptoWorkers());
+      uint16_t b_port = b.Bind(0);
+      a.Bind(0);
+      a.Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(a_private) +
+                                     "\n[Peer]\nPublicKey = " + EncodeBase64Key(b_public) +
+                                     "\nAllowedIPs = 10.78.0.0/24\nEndpoint = 127.0.0.1:" + std::to_string(b_port) +
+                                     "\n"));
+      b.Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(b_private) +
+                                     "\n[Peer]\nPublicKey = " + EncodeBase64Key(a_public) +
+                                     "\nAllowedIPs = 10.78.0.1/32\n"));
+      std::thread run_a([&]
+                        { a.Run(); });
+      std::thread run_b([&]
+                        { b.Run(); });
+
+      struct sockaddr_in to = {};
+      to.sin_family = AF_INET;
+      to.sin_port = htons(9);
+      inet_pton(AF_INET, "10.78.0.2", &to.sin_addr);
+      std::vector<uint8_t> payload(kPayloadLength, 0x5a), buffer(2048);
+      int first = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      sendto(first, payload.data(), payload.size(), 0, reinterpret_cast<struct sockaddr *>(&to), sizeof(to));
+      close(first);
+      struct pollfd p = {tun_b[1], POLLIN, 0};
+      bool connected = poll(&p, 1, 2000) == 1 && read(tun_b[1], buffer.data(), buffer.size()) > 0;
+
+      uint64_t received = 0;
+      double elapsed = 0;
+      if (connected)
+      {
+        std::atomic<bool> sending{true};
+        std::vector<std::thread> senders;
+        for (int i = 0; i < kSenders; i++)
+        {
+          senders.emplace_back([&]
+                               {
+                                 std::vector<int> flows;
+                                 for (int j = 0; j < kFlowsPerSender; j++)
+                                 {
+                                   flows.push_back(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+                                 }
+                                 while (sending)
+                                 {
+                                   for (int fd : flows)
+                                   {
+                                     sendto(fd, payload.data(), payload.size(), 0,
+                                            reinterpret_cast<struct sockaddr *>(&to), sizeof(to));
+                                   }
+                                 }
+                                 for (int fd : flows)
+                                 {
+                                   close(fd);
+                                 } });
+        }
+        const double start = benchmark::Now();
+        while (benchmark::Now() - start < 1.0)
+        {
+          if (poll(&p, 1, 100) == 1 && read(tun_b[1], buffer.data(), buffer.size()) > 0)
+          {
+            received++;
+          }
+        }
+        elapsed = benchmark::Now() - start;
+        sending = false;
+        for (std::thread &sender : senders)
+        {
+          sender.join();
+        }
+      }
+
+      a.Stop();
+      b.Stop();
+      run_a.join();
+      run_b.join();
+      close(tun_b[1]);
+      if (!connected)
+      {
+        printf("%zu queues  handshake failed\n", queue_count);
+        return true;
+      }
+      printf("%zu queues  %7.3f Gbit/s  %9.0f packets/s\n", queue_count,
+             received * kPayloadLength * 8 / elapsed / 1e9, received / elapsed);
+      return true;
+    }
+
+  } // namespace
+
+  BENCHMARK(multi_queue)
+  {
+    printf("%zu CPUs\n", static_cast<size_t>(std::thread::hardware_concurrency()));
+    for (size_t queues : {1, 2, 4})
+    {
+      if (!Run(queues))
+      {
+        return;
+      }
+    }
+  }
+
+} // namespace wireguard_flutter
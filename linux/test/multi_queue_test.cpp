@@ -0,0 +1,350 @@
+#include <arpa/inet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config_parser.h"
+#include "curve25519.h"
+#include "device.h"
+#include "test.h"
+#include "tun.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kQueues = 4;
+
+    // A multi-queue TUN, or a skipped test where /dev/net/tun is missing or
+    // needs CAP_NET_ADMIN.
+    std::vector<int> RequireTunQueues(std::string *name)
+    {
+      try
+      {
+        return OpenTunQueues("", kQueues, name);
+      }
+      catch (const std::runtime_error &error)
+      {
+        SKIP(std::string("no TUN: ") + error.what());
+      }
+      return {};
+    }
+
+    // Gives the interface 10.77.0.1/24 and brings it up.
+    bool ConfigureInterface(const std::string &name)
+    {
+      int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      struct ifreq ifr;
+      memset(&ifr, 0, sizeof(ifr));
+      memcpy(ifr.ifr_name, name.c_str(), name.size());
+      struct sockaddr_in *sin = reinterpret_cast<struct sockaddr_in *>(&ifr.ifr_addr);
+      sin->sin_family = AF_INET;
+      inet_pton(AF_INET, "10.77.0.1", &sin->sin_addr);
+      bool ok = ioctl(fd, SIOCSIFADDR, &ifr) == 0;
+      inet_pton(AF_INET, "255.255.255.0", &sin->sin_addr);
+      ok = ok && ioctl(fd, SIOCSIFNETMASK, &ifr) == 0;
+      ok = ok && ioctl(fd, SIOCGIFFLAGS, &ifr) == 0;
+      ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+      ok = ok && ioctl(fd, SIOCSIFFLAGS, &ifr) == 0;
+      close(fd);
+      return ok;
+    }
+
+    // Device A on the multi-queue TUN, as 10.77.0.1/24, and device B on a
+    // socketpair as 10.77.0.2, both running. Skips the test without a TUN.
+    class QueuedPair
+    {
+    public:
+      QueuedPair()
+      {
+        std::string name;
+        std::vector<int> queues = RequireTunQueues(&name);
+        if (!ConfigureInterface(name))
+        {
+          for (int fd : queues)
+          {
+            close(fd);
+          }
+          SKIP("cannot configure " + name);
+        }
+
+        uint8_t a_private[kCurve25519KeySize], b_private[kCurve25519KeySize];
+        uint8_t a_public[kCurve25519KeySize], b_public[kCurve25519KeySize];
+        X25519GeneratePrivateKey(a_private);
+        X25519GeneratePrivateKey(b_private);
+        X25519PublicKey(a_public, a_private);
+        X25519PublicKey(b_public, b_private);
+        int tun_b[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_b) != 0)
+        {
+          throw std::runtime_error("socketpair failed");
+        }
+        b_app_ = tun_b[1];
+        a_.reset(new Device(queues, 1));
+        b_.reset(new Device(tun_b[0], 1));
+        uint16_t b_port = b_->Bind(0);
+        a_->Bind(0);
+        a_->Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(a_private) +
+                                         "\n[Peer]\nPublicKey = " + EncodeBase64Key(b_public) +
+                                         "\nAllowedIPs = 10.77.0.0/24\nEndpoint = 127.0.0.1:" +
+                                         std::to_string(b_port) + "\n"));
+        b_->Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(b_private) +
+                                         "\n[Peer]\nPublicKey = " + EncodeBase64Key(a_public) +
+                                         "\nAllowedIPs = 10.77.0.1/32\n"));
+        run_a_ = std::thread([this]
+                             { a_->Run(); });
+        run_b_ = std::thread([this]
+                             { b_->Run(); });
+      }
+
+      ~QueuedPair()
+      {
+        a_->Stop();
+        b_->Stop();
+        run_a_.join();
+        run_b_.join();
+        close(b_app_);
+      }
+
+      // What B's side of its TUN reads and writes.
+      int b_app() const { return b_app_; }
+
+    private:
+      std::unique_ptr<Device> a_, b_;
+      int b_app_;
+      std::thread run_a_, run_b_;
+    };
+
+    // A UDP socket on A's host, bound to |address|, or to any address with a
+    // null one. Returns its port in |port|.
+    int UdpSocket(const char *address, uint16_t *port)
+    {
+      int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      struct sockaddr_in sin = {};
+      sin.sin_family = AF_INET;
+      if (address != nullptr)
+      {
+        inet_pton(AF_INET, address, &sin.sin_addr);
+      }
+      bind(fd, reinterpret_cast<struct sockaddr *>(&sin), sizeof(sin));
+      socklen_t len = sizeof(sin);
+      getsockname(fd, reinterpret_cast<struct sockaddr *>(&sin), &len);
+      *port = ntohs(sin.sin_port);
+      return fd;
+    }
+
+    // An IPv4 UDP packet from 10.77.0.2:|from_port| to 10.77.0.1:|to_port|
+    // carrying |sequence|, with a valid header checksum and none for UDP.
+    size_t MakeUdpPacket(uint8_t *packet, uint16_t from_port, uint16_t to_port, uint32_t sequence)
+    {
+      const size_t len = 20 + 8 + sizeof(sequence);
+      memset(packet, 0, len);
+      packet[0] = 0x45;
+      packet[3] = static_cast<uint8_t>(len);
+      packet[8] = 64;
+      packet[9] = 17;
+      inet_pton(AF_INET, "10.77.0.2", packet + 12);
+      inet_pton(AF_INET, "10.77.0.1", packet + 16);
+      uint32_t sum = 0;
+      for (size_t i = 0; i < 20; i += 2)
+      {
+        sum += packet[i] << 8 | packet[i + 1];
+      }
+      sum = (sum & 0xffff) + (sum >> 16);
+      sum = (sum & 0xffff) + (sum >> 16);
+      packet[10] = static_cast<uint8_t>(~sum >> 8);
+      packet[11] = static_cast<uint8_t>(~sum);
+      packet[20] = static_cast<uint8_t>(from_port >> 8);
+      packet[21] = static_cast<uint8_t>(from_port);
+      packet[22] = static_cast<uint8_t>(to_port >> 8);
+      packet[23] = static_cast<uint8_t>(to_port);
+      packet[25] = static_cast<uint8_t>(len - 20);
+      memcpy(packet + 28, &sequence, sizeof(sequence));
+      return len;
+    }
+
+  } // namespace
+
+  TEST(multi_queue, OpenQueues)
+  {
+    std::string name;
+    std::vector<int> queues = RequireTunQueues(&name);
+    ASSERT_EQ(queues.size(), kQueues);
+    EXPECT_FALSE(name.empty());
+    EXPECT_EQ(std::set<int>(queues.begin(), queues.end()).size(), kQueues);
+    bool vnet_hdr = TunHasVnetHeader(queues[0]);
+    for (int fd : queues)
+    {
+      struct ifreq ifr;
+      memset(&ifr, 0, sizeof(ifr));
+      ASSERT_EQ(ioctl(fd, TUNGETIFF, &ifr), 0);
+      EXPECT_EQ(std::string(ifr.ifr_name), name);
+      EXPECT_TRUE((ifr.ifr_flags & IFF_MULTI_QUEUE) != 0);
+      EXPECT_EQ(TunHasVnetHeader(fd), vnet_hdr);
+      close(fd);
+    }
+  }
+
+  // Flows sent into a multi-queue TUN land on different queues; every
+  // queue's thread encrypts what it reads, and all of it reaches a peer.
+  TEST(multi_queue, FlowsReachPeerFromEveryQueue)
+  {
+    QueuedPair pair;
+
+    // Many flows, one datagram each, so the kernel spreads them over the
+    // queues.
+    const int kFlows = 64;
+    std::set<uint16_t> sent_ports, received_ports;
+    for (int i = 0; i < kFlows; i++)
+    {
+      uint16_t port;
+      int fd = UdpSocket(nullptr, &port);
+      struct sockaddr_in to = {};
+      to.sin_family = AF_INET;
+      to.sin_port = htons(9);
+      inet_pton(AF_INET, "10.77.0.2", &to.sin_addr);
+      const char payload[] = "multi-queue";
+      sendto(fd, payload, sizeof(payload), 0, reinterpret_cast<struct sockaddr *>(&to), sizeof(to));
+      struct sockaddr_in from;
+      socklen_t from_len = sizeof(from);
+      getsockname(fd, reinterpret_cast<struct sockaddr *>(&from), &from_len);
+      sent_ports.insert(ntohs(from.sin_port));
+      close(fd);
+    }
+    uint8_t packet[2048];
+    for (;;)
+    {
+      struct pollfd p = {pair.b_app(), POLLIN, 0};
+      if (poll(&p, 1, 2000) <= 0)
+      {
+        break;
+      }
+      ssize_t n = read(pair.b_app(), packet, sizeof(packet));
+      // IPv4 UDP from 10.77.0.1; the source port follows the header.
+      if (n >= 28 && packet[0] == 0x45 && packet[9] == 17)
+      {
+        received_ports.insert(static_cast<uint16_t>(packet[20] << 8 | packet[21]));
+      }
+      if (received_ports == sent_ports)
+      {
+        break;
+      }
+    }
+    // The first datagram of each flow may race the handshake and be queued
+    // behind it, but none is lost.
+    EXPECT_EQ(received_ports.size(), sent_ports.size());
+  }
+
+  // Sequence-numbered datagrams of many flows, interleaved, go through the
+  // queues to the peer and back from it to sockets on A's host. Whatever
+  // queue a flow uses, its datagrams come out in the order they went in.
+  TEST(multi_queue, FlowsKeepTheirOrder)
+  {
+    QueuedPair pair;
+    const size_t kFlows = 16;
+    const uint32_t kPackets = 50;
+    std::vector<int> sockets(kFlows);
+    std::vector<uint16_t> ports(kFlows);
+    for (size_t i = 0; i < kFlows; i++)
+    {
+      sockets[i] = UdpSocket("10.77.0.1", &ports[i]);
+    }
+
+    // One datagram first, so the handshake is done before the sequences.
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_port = htons(9);
+    inet_pton(AF_INET, "10.77.0.2", &to.sin_addr);
+    uint32_t sequence = 0;
+    sendto(sockets[0], &sequence, sizeof(sequence), 0, reinterpret_cast<struct sockaddr *>(&to), sizeof(to));
+    uint8_t packet[2048];
+    struct pollfd p = {pair.b_app(), POLLIN, 0};
+    ASSERT_TRUE(poll(&p, 1, 2000) == 1 && read(pair.b_app(), packet, sizeof(packet)) > 0);
+
+    // Outbound: A's host to B, read on B's side while A's host sends.
+    std::map<uint16_t, std::vector<uint32_t>> outbound;
+    std::thread reader([&]
+                       {
+                         uint8_t received[2048];
+                         size_t count = 0;
+                         while (count < kFlows * kPackets)
+                         {
+                           struct pollfd p = {pair.b_app(), POLLIN, 0};
+                           if (poll(&p, 1, 2000) <= 0)
+                           {
+                             break;
+                           }
+                           ssize_t n = read(pair.b_app(), received, sizeof(received));
+                           if (n >= 32 && received[0] == 0x45 && received[9] == 17)
+                           {
+                             uint32_t value;
+                             memcpy(&value, received + 28, sizeof(value));
+                             outbound[static_cast<uint16_t>(received[20] << 8 | received[21])].push_back(value);
+                             count++;
+                           }
+                         } });
+    // A round at a time, so the TUN's transmit queue does not overflow.
+    for (sequence = 1; sequence <= kPackets; sequence++)
+    {
+      for (size_t i = 0; i < kFlows; i++)
+      {
+        sendto(sockets[i], &sequence, sizeof(sequence), 0, reinterpret_cast<struct sockaddr *>(&to), sizeof(to));
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    reader.join();
+
+    // Inbound: B to the sockets, through whichever queue A writes for B.
+    for (sequence = 1; sequence <= kPackets; sequence++)
+    {
+      for (size_t i = 0; i < kFlows; i++)
+      {
+        size_t len = MakeUdpPacket(packet, 9, ports[i], sequence);
+        EXPECT_EQ(write(pair.b_app(), packet, len), static_cast<ssize_t>(len));
+      }
+    }
+    std::vector<std::vector<uint32_t>> inbound(kFlows);
+    for (size_t i = 0; i < kFlows; i++)
+    {
+      while (inbound[i].size() < kPackets)
+      {
+        struct pollfd p = {sockets[i], POLLIN, 0};
+        uint32_t value;
+        if (poll(&p, 1, 2000) <= 0 || recv(sockets[i], &value, sizeof(value), 0) != sizeof(value))
+        {
+          break;
+        }
+        inbound[i].push_back(value);
+      }
+      close(sockets[i]);
+    }
+
+    std::vector<uint32_t> expected;
+    for (sequence = 1; sequence <= kPackets; sequence++)
+    {
+      expected.push_back(sequence);
+    }
+    for (size_t i = 0; i < kFlows; i++)
+    {
+      EXPECT_TRUE(outbound[ports[i]] == expected);
+      EXPECT_TRUE(inbound[i] == expected);
+    }
+  }
+
+} // namespace wireguard_flutter
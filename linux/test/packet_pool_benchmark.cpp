@@ -0,0 +1,161 @@
+// PacketPool against malloc/free for MTU-sized packet blocks, with several
+// threads at once: each thread allocating and freeing its own batches, and
+// pairs of threads where one allocates and the other frees, as the TUN
+// reader and the UDP sender do.
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "lockfree_queue.h"
+#include "packet_pool.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kBlockSize = 1500;
+    const size_t kBatch = 64;
+    const double kSeconds = 0.5;
+
+    struct PoolAllocator
+    {
+      static void *Allocate() { return PacketPool::Instance().Allocate(kBlockSize); }
+      static void Free(void *block) { PacketPool::Instance().Free(block); }
+    };
+
+    struct MallocAllocator
+    {
+      static void *Allocate() { return malloc(kBlockSize); }
+      static void Free(void *block) { free(block); }
+    };
+
+    // Runs |threads| copies of |body| for kSeconds. Each returns how many
+    // blocks it allocated and freed; returns the total per second.
+    template <typename Body>
+    double RunThreads(size_t threads, Body body)
+    {
+      std::atomic<uint64_t> total{0};
+      std::vector<std::thread> running;
+      const double end = benchmark::Now() + kSeconds;
+      for (size_t i = 0; i < threads; i++)
+      {
+        running.emplace_back([&, i]
+                             { total += body(i, end); });
+      }
+      for (std::thread &thread : running)
+      {
+        thread.join();
+      }
+      return total / kSeconds;
+    }
+
+    // Every thread allocates a batch, touches it and frees it again.
+    template <typename Allocator>
+    double SameThread(size_t threads)
+    {
+      return RunThreads(threads, [](size_t, double end)
+                        {
+                          uint64_t blocks = 0;
+                          void *batch[kBatch];
+                          while (benchmark::Now() < end)
+                          {
+                            for (int round = 0; round < 16; round++)
+                            {
+                              for (size_t i = 0; i < kBatch; i++)
+                              {
+                                batch[i] = Allocator::Allocate();
+                                static_cast<volatile uint8_t *>(batch[i])[0] = 1;
+                              }
+                              for (size_t i = 0; i < kBatch; i++)
+                              {
+                                Allocator::Free(batch[i]);
+                              }
+                            }
+                            blocks += 16 * kBatch;
+                          }
+                          return blocks; });
+    }
+
+    // Even threads allocate and pass blocks through a queue to the odd thread
+    // next to them, which frees them.
+    template <typename Allocator>
+    double CrossThread(size_t threads)
+    {
+      std::vector<std::unique_ptr<SpscQueue<void *>>> queues;
+      for (size_t i = 0; i < threads / 2; i++)
+      {
+        queues.emplace_back(new SpscQueue<void *>(4096));
+      }
+      std::vector<std::atomic<bool>> done(threads / 2);
+      return RunThreads(threads, [&](size_t id, double end)
+                        {
+                          SpscQueue<void *> &queue = *queues[id / 2];
+                          uint64_t blocks = 0;
+                          if (id % 2 == 0)
+                          {
+                            while (benchmark::Now() < end)
+                            {
+                              for (size_t i = 0; i < kBatch; i++)
+                              {
+                                void *block = Allocator::Allocate();
+                                while (!queue.TryPush(block))
+                                {
+                                  std::this_thread::yield();
+                                }
+                              }
+                            }
+                            done[id / 2] = true;
+                            return blocks;
+                          }
+                          for (;;)
+                          {
+                            void *block;
+                            if (queue.Front(&block))
+                            {
+                              queue.Pop();
+                              Allocator::Free(block);
+                              blocks++;
+                            }
+                            else if (done[id / 2])
+                            {
+                              if (!queue.Front(&block))
+                              {
+                                return blocks;
+                              }
+                            }
+                            else
+                            {
+                              std::this_thread::yield();
+                            }
+                          } });
+    }
+
+  } // namespace
+
+  BENCHMARK(packet_pool)
+  {
+    size_t cpus = std::thread::hardware_concurrency();
+    std::vector<size_t> thread_counts = {1, 2, 4};
+    if (cpus > 4)
+    {
+      thread_counts.push_back(cpus);
+    }
+    for (size_t threads : thread_counts)
+    {
+      printf("%2zu threads  same thread  pool %7.2f M/s  malloc %7.2f M/s\n", threads,
+             SameThread<PoolAllocator>(threads) / 1e6, SameThread<MallocAllocator>(threads) / 1e6);
+      if (threads >= 2)
+      {
+        printf("%2zu threads  cross thread pool %7.2f M/s  malloc %7.2f M/s\n", threads,
+               CrossThread<PoolAllocator>(threads) / 1e6, CrossThread<MallocAllocator>(threads) / 1e6);
+      }
+    }
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,121 @@
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "packet_pool.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  TEST(packet_pool, SizeClassesAndAlignment)
+  {
+    PacketPool &pool = PacketPool::Instance();
+    for (size_t size : {1, 100, 1500, 2000, 2496, 2497, 9000, 65535})
+    {
+      size_t usable = PacketPool::UsableSize(size);
+      EXPECT_TRUE(usable >= size);
+      void *block = pool.Allocate(size);
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(block) % kCacheLineSize, static_cast<uintptr_t>(0));
+      // The whole usable size is writable.
+      memset(block, 0xa5, usable);
+      pool.Free(block);
+    }
+    EXPECT_EQ(PacketPool::UsableSize(100), PacketPool::UsableSize(2000));
+    EXPECT_TRUE(PacketPool::UsableSize(9000) > PacketPool::UsableSize(2000));
+
+    bool threw = false;
+    try
+    {
+      pool.Allocate(kPacketPoolBlockSizes[kPacketPoolClasses - 1]);
+    }
+    catch (const std::bad_alloc &)
+    {
+      threw = true;
+    }
+    EXPECT_TRUE(threw);
+  }
+
+  // Freed blocks come back from the thread cache, and the statistics track
+  // what is handed out.
+  TEST(packet_pool, ReuseAndStats)
+  {
+    PacketPool &pool = PacketPool::Instance();
+    PacketPoolStats before = pool.Stats();
+    std::vector<void *> blocks;
+    for (int i = 0; i < 1000; i++)
+    {
+      blocks.push_back(pool.Allocate(1500));
+    }
+    EXPECT_EQ(std::set<void *>(blocks.begin(), blocks.end()).size(), blocks.size());
+    PacketPoolStats during = pool.Stats();
+    EXPECT_EQ(during.outstanding[0], before.outstanding[0] + 1000);
+    EXPECT_TRUE(during.blocks[0] >= 1000);
+
+    void *last = blocks.back();
+    pool.Free(last);
+    EXPECT_TRUE(pool.Allocate(1500) == last);
+    for (void *block : blocks)
+    {
+      pool.Free(block);
+    }
+    PacketPoolStats after = pool.Stats();
+    EXPECT_EQ(after.outstanding[0], before.outstanding[0]);
+    EXPECT_EQ(after.blocks[0], during.blocks[0]);
+  }
+
+  // Blocks allocated on one thread and freed on others, as packets are when
+  // a crypto worker or the TUN writer finishes with them, are all accounted
+  // for once the threads are gone.
+  TEST(packet_pool, CrossThreadFree)
+  {
+    PacketPool &pool = PacketPool::Instance();
+    PacketPoolStats before = pool.Stats();
+    const size_t kThreads = 4, kPerThread = 5000;
+    std::vector<std::vector<void *>> handoff(kThreads);
+    for (size_t t = 0; t < kThreads; t++)
+    {
+      for (size_t i = 0; i < kPerThread; i++)
+      {
+        handoff[t].push_back(pool.Allocate(i % 10 == 0 ? 9000 : 1500));
+        memset(handoff[t].back(), static_cast<int>(t), 64);
+      }
+    }
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kThreads; t++)
+    {
+      threads.emplace_back([&pool, &handoff, t]
+                           {
+                             for (void *block : handoff[t])
+                             {
+                               pool.Free(block);
+                             }
+                             // Churn the cache through the shared lists.
+                             for (int round = 0; round < 100; round++)
+                             {
+                               std::vector<void *> local;
+                               for (int i = 0; i < 100; i++)
+                               {
+                                 local.push_back(pool.Allocate(1500));
+                               }
+                               for (void *block : local)
+                               {
+                                 pool.Free(block);
+                               }
+                             } });
+    }
+    for (std::thread &thread : threads)
+    {
+      thread.join();
+    }
+    PacketPoolStats after = pool.Stats();
+    for (size_t c = 0; c < kPacketPoolClasses; c++)
+    {
+      EXPECT_EQ(after.outstanding[c], before.outstanding[c]);
+    }
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,191 @@
+#include <net/if.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config_parser.h"
+#include "curve25519.h"
+#include "device.h"
+#include "path_mtu.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Two running devices, A with B as its peer over loopback, B with its
+    // TUN's other end kept to read what arrives. B echoes path probes if
+    // |echo| is set.
+    class DevicePair
+    {
+    public:
+      explicit DevicePair(bool echo = true)
+      {
+        X25519GeneratePrivateKey(a_private_);
+        X25519GeneratePrivateKey(b_private_);
+        X25519PublicKey(a_public_, a_private_);
+        X25519PublicKey(b_public_, b_private_);
+        socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_a_);
+        socketpair(AF_UNIX, SOCK_SEQPACKET, 0, tun_b_);
+        a_.reset(new Device(tun_a_[0], 1));
+        b_.reset(new Device(tun_b_[0], 1));
+        b_->SetPathProbeEcho(echo);
+        b_port_ = b_->Bind(0);
+        a_->Bind(0);
+        a_->Configure(ParseWgQuickConfig(AConfig()));
+        b_->Configure(ParseWgQuickConfig("[Interface]\nPrivateKey = " + EncodeBase64Key(b_private_) +
+                                         "\n[Peer]\nPublicKey = " + EncodeBase64Key(a_public_) +
+                                         "\nAllowedIPs = 10.0.0.1/32\n"));
+        run_a_ = std::thread([this]
+                             { a_->Run(); });
+        run_b_ = std::thread([this]
+                             { b_->Run(); });
+      }
+
+      ~DevicePair()
+      {
+        a_->Stop();
+        b_->Stop();
+        run_a_.join();
+        run_b_.join();
+        close(tun_a_[1]);
+        close(tun_b_[1]);
+      }
+
+      std::string BEndpoint() const { return "127.0.0.1:" + std::to_string(b_port_); }
+
+      // A's wg-quick config, as the app would hand it over.
+      std::string AConfig() const
+      {
+        return "[Interface]\n# Tunnel to B\nPrivateKey = " + EncodeBase64Key(a_private_) +
+               "\n\n[Peer]\nPublicKey = " + EncodeBase64Key(b_public_) +
+               "\nAllowedIPs = 10.0.0.2/32\nEndpoint = " + BEndpoint() + "\n";
+      }
+
+      Device *a() { return a_.get(); }
+
+      // Sends a |len|-byte IPv4 packet from A's side of the tunnel and
+      // returns how many bytes of it B's side got, or -1.
+      ssize_t SendThrough(size_t len)
+      {
+        std::vector<uint8_t> packet(len), received(65536);
+        packet[0] = 0x45;
+        packet[2] = static_cast<uint8_t>(len >> 8);
+        packet[3] = static_cast<uint8_t>(len);
+        packet[8] = 64;
+        packet[9] = 17;
+        packet[12] = 10;
+        packet[15] = 1;
+        packet[16] = 10;
+        packet[19] = 2;
+        if (write(tun_a_[1], packet.data(), len) != static_cast<ssize_t>(len))
+        {
+          return -1;
+        }
+        struct pollfd p = {tun_b_[1], POLLIN, 0};
+        if (poll(&p, 1, 2000) <= 0)
+        {
+          return -1;
+        }
+        return read(tun_b_[1], received.data(), received.size());
+      }
+
+    private:
+      uint8_t a_private_[kCurve25519KeySize], b_private_[kCurve25519KeySize];
+      uint8_t a_public_[kCurve25519KeySize], b_public_[kCurve25519KeySize];
+      int tun_a_[2], tun_b_[2];
+      std::unique_ptr<Device> a_, b_;
+      uint16_t b_port_;
+      std::thread run_a_, run_b_;
+    };
+
+    // Moves the process into a network namespace of its own whose loopback
+    // takes packets of at most |mtu| bytes, or skips the test where that
+    // takes privileges the process lacks.
+    void RequireLoopbackMtu(int mtu)
+    {
+      if (unshare(CLONE_NEWNET) != 0)
+      {
+        SKIP(std::string("no network namespace: ") + strerror(errno));
+      }
+      int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      struct ifreq ifr;
+      memset(&ifr, 0, sizeof(ifr));
+      strcpy(ifr.ifr_name, "lo");
+      ifr.ifr_mtu = mtu;
+      bool ok = ioctl(fd, SIOCSIFMTU, &ifr) == 0 && ioctl(fd, SIOCGIFFLAGS, &ifr) == 0;
+      ifr.ifr_flags |= IFF_UP;
+      ok = ok && ioctl(fd, SIOCSIFFLAGS, &ifr) == 0;
+      close(fd);
+      if (!ok)
+      {
+        SKIP("cannot configure loopback");
+      }
+    }
+
+    // What the app does before bringing the tunnel up: probe the peers'
+    // paths and write the tunnel MTU into the config.
+    std::string WithDiscoveredMtu(const std::string &config)
+    {
+      uint16_t mtu = DiscoverTunnelMtu(ParseWgQuickConfig(config));
+      return mtu != 0 ? SetWgQuickMtu(config, mtu) : config;
+    }
+
+  } // namespace
+
+  // On a path that takes the largest size searched, one echoed probe at
+  // either end of the range settles it.
+  TEST(path_mtu, WidePath)
+  {
+    DevicePair pair;
+    std::string config = WithDiscoveredMtu(pair.AConfig());
+    EXPECT_EQ(ParseWgQuickConfig(config).mtu, TunnelMtuForPath(1500, AF_INET));
+    EXPECT_TRUE(config.find("# Tunnel to B") != std::string::npos);
+  }
+
+  // Devices echo probes, so the search confirms the exact limit of the
+  // path, and a tunnel at the MTU found carries full-size packets.
+  TEST(path_mtu, ProbesBetweenDevices)
+  {
+    RequireLoopbackMtu(1400);
+    DevicePair pair;
+    struct sockaddr_storage endpoint;
+    socklen_t endpoint_len;
+    ASSERT_TRUE(ResolveEndpoint(pair.BEndpoint(), &endpoint, &endpoint_len));
+    PathMtuResult result = DiscoverPathMtu(endpoint, endpoint_len);
+    EXPECT_EQ(result.path_mtu, 1400);
+    EXPECT_TRUE(result.confirmed);
+
+    std::string config = WithDiscoveredMtu(pair.AConfig());
+    uint16_t mtu = ParseWgQuickConfig(config).mtu;
+    EXPECT_EQ(mtu, TunnelMtuForPath(1400, AF_INET));
+    pair.a()->Configure(ParseWgQuickConfig(config));
+    EXPECT_EQ(pair.SendThrough(mtu), static_cast<ssize_t>(mtu));
+  }
+
+  // Probes carry no authentication, so a device that has not opted in
+  // stays silent, and the search falls back on what the kernel knows.
+  TEST(path_mtu, SilentWithoutOptIn)
+  {
+    RequireLoopbackMtu(1400);
+    DevicePair pair(false);
+    struct sockaddr_storage endpoint;
+    socklen_t endpoint_len;
+    ASSERT_TRUE(ResolveEndpoint(pair.BEndpoint(), &endpoint, &endpoint_len));
+    PathMtuResult result = DiscoverPathMtu(endpoint, endpoint_len);
+    EXPECT_FALSE(result.confirmed);
+    EXPECT_EQ(result.path_mtu, 1400);
+  }
+
+} // namespace wireguard_flutter
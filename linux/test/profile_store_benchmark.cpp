@@ -0,0 +1,187 @@
+// Importing 5000 provider profiles from a directory of .conf files, on one
+// thread and on one per CPU, and then opening the store with its pages
+// dropped from the page cache and looking a profile up, against reading
+// and parsing every file to find it, as the app would without the store.
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "config_parser.h"
+#include "profile_store.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kProfiles = 5000;
+
+    std::string ProfileName(size_t i)
+    {
+      static const char *kCountries[] = {"de", "us", "se", "jp", "nl", "ch", "gb", "fr"};
+      return std::string("provider-") + kCountries[i % 8] + "-" + std::to_string(i);
+    }
+
+    std::string ProfileText(size_t i)
+    {
+      uint8_t private_key[kCurve25519KeySize] = {0x10, static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)};
+      uint8_t public_key[kCurve25519KeySize] = {0x50, static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)};
+      return "[Interface]\nPrivateKey = " + EncodeBase64Key(private_key) +
+             "\nAddress = 10.64.0.2/32, fc00:bbbb:bbbb:bb01::2/128\nDNS = 10.64.0.1\n\n[Peer]\nPublicKey = " +
+             EncodeBase64Key(public_key) + "\nAllowedIPs = 0.0.0.0/0, ::/0\nEndpoint = server-" +
+             std::to_string(i % 700) + ".example.net:51820\n";
+    }
+
+    bool WriteFile(const std::string &path, const std::string &text)
+    {
+      FILE *file = fopen(path.c_str(), "wb");
+      if (file == nullptr)
+      {
+        return false;
+      }
+      bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+      return fclose(file) == 0 && written;
+    }
+
+    std::string ReadFile(const std::string &path)
+    {
+      std::string text;
+      FILE *file = fopen(path.c_str(), "rb");
+      if (file == nullptr)
+      {
+        return text;
+      }
+      char buffer[4096];
+      size_t n;
+      while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+      {
+        text.append(buffer, n);
+      }
+      fclose(file);
+      return text;
+    }
+
+    // Asks the kernel to drop the file's cached pages, so the next read
+    // goes to the disk, as after a reboot.
+    void DropCache(const std::string &path)
+    {
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd >= 0)
+      {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+      }
+    }
+
+    void RemoveDirectory(const std::string &path)
+    {
+      if (DIR *dir = opendir(path.c_str()))
+      {
+        while (struct dirent *entry = readdir(dir))
+        {
+          std::string name = entry->d_name;
+          if (name != "." && name != "..")
+          {
+            unlink((path + "/" + name).c_str());
+          }
+        }
+        closedir(dir);
+      }
+      rmdir(path.c_str());
+    }
+
+  } // namespace
+
+  BENCHMARK(profile_store)
+  {
+    char root[] = "/tmp/profile_store_benchmark.XXXXXX";
+    if (mkdtemp(root) == nullptr)
+    {
+      printf("no scratch directory\n");
+      return;
+    }
+    const std::string profiles = std::string(root) + "/profiles";
+    const std::string store_path = std::string(root) + "/profiles.store";
+    mkdir(profiles.c_str(), 0700);
+    for (size_t i = 0; i < kProfiles; i++)
+    {
+      if (!WriteFile(profiles + "/" + ProfileName(i) + ".conf", ProfileText(i)))
+      {
+        printf("cannot write profiles\n");
+        RemoveDirectory(profiles);
+        RemoveDirectory(root);
+        return;
+      }
+    }
+
+    size_t cpus = std::max<size_t>(1, std::thread::hardware_concurrency());
+    std::vector<size_t> thread_counts = {1};
+    if (cpus > 1)
+    {
+      thread_counts.push_back(cpus);
+    }
+    try
+    {
+      for (size_t threads : thread_counts)
+      {
+        unlink(store_path.c_str());
+        double start = benchmark::Now();
+        ProfileImportResult result = ImportProfiles(profiles, store_path, threads);
+        double elapsed = benchmark::Now() - start;
+        printf("import %zu profiles  %2zu threads  %7.1f ms  %7.0f profiles/s  %zu errors\n", result.imported,
+               threads, elapsed * 1e3, result.imported / elapsed, result.errors.size());
+      }
+
+      const std::string wanted = ProfileName(kProfiles - 1);
+      DropCache(store_path);
+      double start = benchmark::Now();
+      ProfileStore store(store_path);
+      double opened = benchmark::Now() - start;
+      uint32_t id = store.FindByName(wanted);
+      DeviceConfig config = store.Load(id);
+      double loaded = benchmark::Now() - start;
+      size_t in_country = store.FindByCountry("de").size();
+      double listed = benchmark::Now() - start;
+      printf("cold open %6.3f ms  +lookup and load %6.3f ms  +%zu by country %6.3f ms\n", opened * 1e3,
+             loaded * 1e3, in_country, listed * 1e3);
+
+      // Without the store: read and parse files until the wanted one turns
+      // up, which for the last is all of them.
+      for (size_t i = 0; i < kProfiles; i++)
+      {
+        DropCache(profiles + "/" + ProfileName(i) + ".conf");
+      }
+      start = benchmark::Now();
+      size_t parsed = 0;
+      for (size_t i = 0; i < kProfiles; i++)
+      {
+        config = ParseWgQuickConfig(ReadFile(profiles + "/" + ProfileName(i) + ".conf"));
+        parsed++;
+        if (ProfileName(i) == wanted)
+        {
+          break;
+        }
+      }
+      printf("parse %zu files  %8.1f ms\n", parsed, (benchmark::Now() - start) * 1e3);
+    }
+    catch (const std::runtime_error &error)
+    {
+      printf("failed: %s\n", error.what());
+    }
+    RemoveDirectory(profiles);
+    RemoveDirectory(root);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,394 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "config_parser.h"
+#include "profile_store.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    void RemoveTree(const std::string &path)
+    {
+      if (DIR *dir = opendir(path.c_str()))
+      {
+        while (struct dirent *entry = readdir(dir))
+        {
+          std::string name = entry->d_name;
+          if (name != "." && name != "..")
+          {
+            RemoveTree(path + "/" + name);
+          }
+        }
+        closedir(dir);
+        rmdir(path.c_str());
+      }
+      else
+      {
+        unlink(path.c_str());
+      }
+    }
+
+    // A scratch directory, removed with everything in it.
+    class TempDirectory
+    {
+    public:
+      TempDirectory()
+      {
+        char path[] = "/tmp/profile_store_test.XXXXXX";
+        ASSERT_TRUE(mkdtemp(path) != nullptr);
+        path_ = path;
+      }
+
+      ~TempDirectory() { RemoveTree(path_); }
+
+      std::string File(const std::string &name) const { return path_ + "/" + name; }
+
+    private:
+      std::string path_;
+    };
+
+    void WriteFile(const std::string &path, const std::string &text)
+    {
+      FILE *file = fopen(path.c_str(), "wb");
+      ASSERT_TRUE(file != nullptr);
+      ASSERT_EQ(fwrite(text.data(), 1, text.size(), file), text.size());
+      fclose(file);
+    }
+
+    // What a profile should be stored as.
+    struct Expected
+    {
+      std::string name;
+      std::string host;
+      std::string country;
+      std::string public_key;
+      std::string text;
+    };
+
+    std::string Key(uint8_t tag, size_t index)
+    {
+      uint8_t key[kCurve25519KeySize] = {tag, static_cast<uint8_t>(index >> 8), static_cast<uint8_t>(index), 0x77};
+      return EncodeBase64Key(key);
+    }
+
+    // Provider-style profiles: the country in the name, or in a comment
+    // that wins over it; hosts in mixed case or IPv6; servers shared by
+    // several profiles.
+    Expected MakeProfile(size_t i, const std::string &tag = "")
+    {
+      static const char *kCountries[] = {"de", "us", "se", "jp"};
+      Expected profile;
+      std::string country = kCountries[i % 4];
+      profile.name = "vpn-" + country + "-" + std::to_string(i) + tag;
+      profile.country = country;
+      std::string comment;
+      if (i % 10 == 0)
+      {
+        profile.country = "ch";
+        comment = "# Country = CH\n";
+      }
+      std::string endpoint;
+      if (i % 7 == 0)
+      {
+        profile.host = "2001:db8::" + std::to_string(i % 50);
+        endpoint = "[2001:DB8::" + std::to_string(i % 50) + "]:51820";
+      }
+      else
+      {
+        profile.host = country + "-" + std::to_string(i % 50) + ".example.net";
+        std::string upper = country;
+        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+        endpoint = (i % 2 == 0 ? upper : country) + "-" + std::to_string(i % 50) + ".Example.NET:51820";
+      }
+      // Every fifth profile is a server seen before.
+      size_t server = i % 5 == 0 ? i / 5 : 100000 + i;
+      uint8_t raw[kCurve25519KeySize] = {0x50, static_cast<uint8_t>(server >> 16), static_cast<uint8_t>(server >> 8),
+                                         static_cast<uint8_t>(server)};
+      profile.public_key.assign(reinterpret_cast<const char *>(raw), sizeof(raw));
+      profile.text = comment + "[Interface]\nPrivateKey = " + Key(0x10, i) +
+                     "\nAddress = 10.64.0.2/32\nDNS = 10.64.0.1\n\n[Peer]\nPublicKey = " + EncodeBase64Key(raw) +
+                     "\nAllowedIPs = 0.0.0.0/0, ::/0\nEndpoint = " + endpoint + tag + "\n";
+      if (!tag.empty())
+      {
+        // Tagged profiles move to a host of their own.
+        profile.host = "moved" + tag + ".example.org";
+        profile.text = comment + "[Interface]\nPrivateKey = " + Key(0x11, i) + "\n\n[Peer]\nPublicKey = " +
+                       EncodeBase64Key(raw) + "\nAllowedIPs = 0.0.0.0/0\nEndpoint = moved" + tag +
+                       ".example.org:51820\n";
+      }
+      return profile;
+    }
+
+    std::vector<uint32_t> Sorted(std::vector<uint32_t> ids)
+    {
+      EXPECT_TRUE(std::is_sorted(ids.begin(), ids.end()));
+      return ids;
+    }
+
+    // Checks every expected profile against the store, and that each index
+    // finds exactly the profiles that share its value.
+    void CheckStore(const ProfileStore &store, const std::map<std::string, Expected> &expected)
+    {
+      ASSERT_EQ(store.size(), expected.size());
+      std::map<std::string, std::set<uint32_t>> by_host, by_country, by_key;
+      for (const auto &entry : expected)
+      {
+        const Expected &profile = entry.second;
+        uint32_t id = store.FindByName(profile.name);
+        ASSERT_TRUE(id != ProfileStore::kNotFound);
+        ProfileSummary summary = store.Summary(id);
+        EXPECT_EQ(std::string(summary.name), profile.name);
+        EXPECT_EQ(std::string(summary.endpoint_host), profile.host);
+        EXPECT_EQ(std::string(summary.country), profile.country);
+        EXPECT_EQ(memcmp(summary.public_key, profile.public_key.data(), kCurve25519KeySize), 0);
+        EXPECT_EQ(store.Config(id), profile.text);
+        by_host[profile.host].insert(id);
+        by_country[profile.country].insert(id);
+        by_key[profile.public_key].insert(id);
+      }
+      for (const auto &host : by_host)
+      {
+        std::vector<uint32_t> ids = Sorted(store.FindByHost(host.first));
+        EXPECT_TRUE(std::set<uint32_t>(ids.begin(), ids.end()) == host.second && ids.size() == host.second.size());
+      }
+      for (const auto &country : by_country)
+      {
+        std::vector<uint32_t> ids = Sorted(store.FindByCountry(country.first));
+        EXPECT_TRUE(std::set<uint32_t>(ids.begin(), ids.end()) == country.second);
+      }
+      for (const auto &key : by_key)
+      {
+        std::vector<uint32_t> ids =
+            Sorted(store.FindByKey(reinterpret_cast<const uint8_t *>(key.first.data())));
+        EXPECT_TRUE(std::set<uint32_t>(ids.begin(), ids.end()) == key.second);
+      }
+    }
+
+    // Lays out ustar entries: a header block and the data padded to blocks.
+    void AddTarEntry(std::string *archive, const std::string &path, const std::string &data, char type = '0')
+    {
+      char header[512];
+      memset(header, 0, sizeof(header));
+      std::string name = path;
+      size_t slash = path.rfind('/');
+      if (path.size() > 99 && slash != std::string::npos)
+      {
+        memcpy(header + 345, path.data(), slash);
+        name = path.substr(slash + 1);
+      }
+      memcpy(header, name.data(), name.size());
+      snprintf(header + 100, 8, "%07o", 0600);
+      snprintf(header + 124, 12, "%011zo", data.size());
+      snprintf(header + 136, 12, "%011o", 0);
+      header[156] = type;
+      memcpy(header + 257, "ustar", 6);
+      memcpy(header + 263, "00", 2);
+      memset(header + 148, ' ', 8);
+      unsigned sum = 0;
+      for (unsigned char c : header)
+      {
+        sum += c;
+      }
+      snprintf(header + 148, 8, "%06o", sum);
+      archive->append(header, sizeof(header));
+      archive->append(data);
+      archive->append((512 - data.size() % 512) % 512, '\0');
+    }
+
+    bool OpenThrows(const std::string &path)
+    {
+      try
+      {
+        ProfileStore store(path);
+      }
+      catch (const std::runtime_error &)
+      {
+        return true;
+      }
+      return false;
+    }
+
+  } // namespace
+
+  // A directory tree of profiles imports on several threads; broken files
+  // are reported and skipped, and the store finds every profile by name,
+  // host, country and server key.
+  TEST(profile_store, ImportDirectory)
+  {
+    TempDirectory dir;
+    std::string source = dir.File("profiles");
+    mkdir(source.c_str(), 0700);
+    mkdir((source + "/de").c_str(), 0700);
+    mkdir((source + "/de/nested").c_str(), 0700);
+    std::map<std::string, Expected> expected;
+    for (size_t i = 0; i < 600; i++)
+    {
+      Expected profile = MakeProfile(i);
+      const char *subdirectory = i % 3 == 0 ? "/" : i % 3 == 1 ? "/de/" : "/de/nested/";
+      WriteFile(source + subdirectory + profile.name + ".conf", profile.text);
+      expected[profile.name] = profile;
+    }
+    WriteFile(source + "/no-key.conf", "[Peer]\nPublicKey = " + Key(1, 1) + "\nEndpoint = a.example:1\n");
+    WriteFile(source + "/no-endpoint.conf", "[Interface]\nPrivateKey = " + Key(1, 2) + "\n");
+    WriteFile(source + "/garbage.conf", "[Interface]\nPrivateKey = not a key\n");
+    WriteFile(source + "/readme.txt", "not a profile");
+
+    ProfileImportResult result = ImportProfiles(source, dir.File("store"), 4);
+    EXPECT_EQ(result.imported, static_cast<size_t>(600));
+    EXPECT_EQ(result.profiles, static_cast<size_t>(600));
+    ASSERT_EQ(result.errors.size(), static_cast<size_t>(3));
+    std::map<std::string, std::string> errors;
+    for (const ProfileImportError &error : result.errors)
+    {
+      errors[error.name] = error.message;
+    }
+    EXPECT_TRUE(errors["no-key"].find("PrivateKey") != std::string::npos);
+    EXPECT_EQ(errors["no-endpoint"], std::string("no peer with an Endpoint"));
+    EXPECT_TRUE(!errors["garbage"].empty());
+    EXPECT_EQ(access(dir.File("store.tmp").c_str(), F_OK), -1);
+
+    ProfileStore store(dir.File("store"));
+    CheckStore(store, expected);
+    EXPECT_EQ(store.FindByName("readme"), ProfileStore::kNotFound);
+    EXPECT_EQ(store.FindByHost("DE-1.EXAMPLE.NET").size(), store.FindByHost("de-1.example.net").size());
+    EXPECT_TRUE(store.FindByCountry("fr").empty());
+    EXPECT_TRUE(store.FindByHost("").empty());
+    DeviceConfig config = store.Load(store.FindByName("vpn-us-1"));
+    EXPECT_TRUE(config.has_private_key);
+    EXPECT_EQ(config.peers.size(), static_cast<size_t>(1));
+  }
+
+  // Importing again keeps the stored profiles, replaces those of the same
+  // name, adds the rest, and reindexes them all; readers of the old store
+  // keep seeing it whole.
+  TEST(profile_store, ReimportAndReopen)
+  {
+    TempDirectory dir;
+    std::string first = dir.File("first");
+    std::string second = dir.File("second");
+    mkdir(first.c_str(), 0700);
+    mkdir(second.c_str(), 0700);
+    std::map<std::string, Expected> expected;
+    for (size_t i = 0; i < 200; i++)
+    {
+      Expected profile = MakeProfile(i);
+      WriteFile(first + "/" + profile.name + ".conf", profile.text);
+      expected[profile.name] = profile;
+    }
+    ImportProfiles(first, dir.File("store"), 2);
+    ProfileStore old_store(dir.File("store"));
+    CheckStore(old_store, expected);
+    std::map<std::string, Expected> old_expected = expected;
+
+    // Half of them replaced with moved servers, and 100 new ones.
+    for (size_t i = 0; i < 300; i++)
+    {
+      Expected profile = MakeProfile(i);
+      if (i < 200 && i % 2 == 0)
+      {
+        Expected moved = MakeProfile(i, "-m");
+        moved.name = profile.name;
+        profile = moved;
+      }
+      else if (i < 200)
+      {
+        continue;
+      }
+      WriteFile(second + "/" + profile.name + ".conf", profile.text);
+      expected[profile.name] = profile;
+    }
+    ProfileImportResult result = ImportProfiles(second, dir.File("store"), 3);
+    EXPECT_EQ(result.imported, static_cast<size_t>(200));
+    EXPECT_EQ(result.profiles, static_cast<size_t>(300));
+    EXPECT_TRUE(result.errors.empty());
+
+    ProfileStore store(dir.File("store"));
+    CheckStore(store, expected);
+    EXPECT_TRUE(store.FindByHost("moved-m.example.org").size() == 100);
+    // The old mapping still reads the store it opened.
+    CheckStore(old_store, old_expected);
+    EXPECT_TRUE(old_store.FindByHost("moved-m.example.org").empty());
+  }
+
+  // Profiles in a tar archive, with directories, long paths and other
+  // files, import like a directory of them.
+  TEST(profile_store, ImportTar)
+  {
+    TempDirectory dir;
+    std::string archive;
+    std::map<std::string, Expected> expected;
+    AddTarEntry(&archive, "profiles/", "", '5');
+    for (size_t i = 0; i < 100; i++)
+    {
+      Expected profile = MakeProfile(i);
+      std::string path = i % 2 == 0 ? "profiles/" + profile.name + ".conf"
+                                    : "profiles/" + std::string(100, 'd') + "/" + profile.name + ".conf";
+      AddTarEntry(&archive, path, profile.text);
+      expected[profile.name] = profile;
+    }
+    AddTarEntry(&archive, "profiles/README", "not a profile");
+    archive.append(1024, '\0');
+    WriteFile(dir.File("profiles.tar"), archive);
+
+    ProfileImportResult result = ImportProfiles(dir.File("profiles.tar"), dir.File("store"));
+    EXPECT_EQ(result.imported, static_cast<size_t>(100));
+    EXPECT_TRUE(result.errors.empty());
+    ProfileStore store(dir.File("store"));
+    CheckStore(store, expected);
+
+    WriteFile(dir.File("bad.tar"), std::string(1024, 'x'));
+    bool thrown = false;
+    try
+    {
+      ImportProfiles(dir.File("bad.tar"), dir.File("store"));
+    }
+    catch (const std::runtime_error &)
+    {
+      thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+    // The failed import left the store alone.
+    CheckStore(ProfileStore(dir.File("store")), expected);
+  }
+
+  // Files that are not whole stores are refused on opening.
+  TEST(profile_store, RejectsDamagedStores)
+  {
+    TempDirectory dir;
+    std::string source = dir.File("profiles");
+    mkdir(source.c_str(), 0700);
+    Expected profile = MakeProfile(1);
+    WriteFile(source + "/" + profile.name + ".conf", profile.text);
+    ImportProfiles(source, dir.File("store"));
+    EXPECT_FALSE(OpenThrows(dir.File("store")));
+    EXPECT_TRUE(OpenThrows(dir.File("missing")));
+
+    struct stat st;
+    ASSERT_EQ(stat(dir.File("store").c_str(), &st), 0);
+    ASSERT_EQ(truncate(dir.File("store").c_str(), st.st_size - 1), 0);
+    EXPECT_TRUE(OpenThrows(dir.File("store")));
+
+    WriteFile(dir.File("store"), std::string(static_cast<size_t>(st.st_size), 'x'));
+    EXPECT_TRUE(OpenThrows(dir.File("store")));
+    WriteFile(dir.File("store"), "");
+    EXPECT_TRUE(OpenThrows(dir.File("store")));
+  }
+
+} // namespace wireguard_flutter
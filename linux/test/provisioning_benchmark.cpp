@@ -0,0 +1,87 @@
+// Provisioning 50k gateway peers with an IPv4 and an IPv6 address each:
+// the address pools alone, then the whole of ProvisionPeers() on one thread
+// and on one per CPU, and the server's [Peer] sections for all of them.
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "address_pool.h"
+#include "benchmark.h"
+#include "provisioning.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kPeers = 50000;
+
+    IpPrefix Subnet(int family, const char *address, uint8_t cidr)
+    {
+      IpPrefix subnet;
+      subnet.family = family;
+      subnet.cidr = cidr;
+      inet_pton(family, address, subnet.address);
+      return subnet;
+    }
+
+  } // namespace
+
+  BENCHMARK(provisioning)
+  {
+    const IpPrefix v4 = Subnet(AF_INET, "10.8.0.0", 16);
+    const IpPrefix v6 = Subnet(AF_INET6, "fd00:8::", 64);
+
+    {
+      AddressPool pool(v4);
+      std::vector<IpPrefix> addresses(kPeers);
+      double start = benchmark::Now();
+      for (auto &address : addresses)
+      {
+        pool.Allocate(&address);
+      }
+      double allocate = benchmark::Now() - start;
+      start = benchmark::Now();
+      for (const auto &address : addresses)
+      {
+        pool.Free(address);
+      }
+      double free = benchmark::Now() - start;
+      printf("address pool  allocate %5.1f ns  free %5.1f ns\n", allocate / kPeers * 1e9, free / kPeers * 1e9);
+    }
+
+    ProvisionOptions options;
+    options.endpoint = "gateway.example:51820";
+    options.dns.push_back("10.8.0.1");
+    std::fill(options.server_public_key, options.server_public_key + kCurve25519KeySize, 0x42);
+    size_t cpus = std::max<size_t>(1, std::thread::hardware_concurrency());
+    std::vector<size_t> thread_counts = {1};
+    if (cpus > 1)
+    {
+      thread_counts.push_back(cpus);
+    }
+    for (size_t threads : thread_counts)
+    {
+      AddressPool pool4(v4), pool6(v6);
+      options.threads = threads;
+      double start = benchmark::Now();
+      std::vector<ProvisionedPeer> peers = ProvisionPeers(kPeers, {&pool4, &pool6}, options);
+      double elapsed = benchmark::Now() - start;
+      printf("%zu peers  %2zu threads  %7.2f s  %8.0f peers/s\n", peers.size(), threads, elapsed,
+             peers.size() / elapsed);
+      if (threads == thread_counts.back())
+      {
+        start = benchmark::Now();
+        std::string entries = ServerPeerEntries(peers);
+        elapsed = benchmark::Now() - start;
+        printf("server entries  %6.1f ms  %5.1f MB\n", elapsed * 1e3, entries.size() / 1e6);
+      }
+    }
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,122 @@
+// Lookups per second in a table of 10k receiver indices while a writer keeps
+// replacing entries, as handshakes do: RcuHashTable against an
+// std::unordered_map behind a std::shared_mutex.
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "benchmark.h"
+#include "rcu_hash_table.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const uint32_t kEntries = 10000;
+    const double kSeconds = 0.5;
+
+    class LockedTable
+    {
+    public:
+      bool Find(uint32_t key, uintptr_t *value) const
+      {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        auto it = map_.find(key);
+        if (it == map_.end())
+        {
+          return false;
+        }
+        *value = it->second;
+        return true;
+      }
+
+      void Insert(uint32_t key, uintptr_t value)
+      {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        map_[key] = value;
+      }
+
+    private:
+      mutable std::shared_mutex mutex_;
+      std::unordered_map<uint32_t, uintptr_t> map_;
+    };
+
+    // Runs |readers| threads looking up random keys for kSeconds while one
+    // more thread replaces an entry every 10 microseconds. Returns lookups
+    // per second across the readers.
+    template <typename Table>
+    double Lookups(Table *table, size_t readers)
+    {
+      for (uint32_t key = 0; key < kEntries; key++)
+      {
+        table->Insert(key, key);
+      }
+      std::atomic<bool> stop{false};
+      std::atomic<uint64_t> total{0};
+      std::thread writer([&]
+                         {
+                           uint32_t key = 0;
+                           while (!stop)
+                           {
+                             table->Insert(key, key + 1);
+                             key = (key + 1) % kEntries;
+                             std::this_thread::sleep_for(std::chrono::microseconds(10));
+                           } });
+      std::vector<std::thread> threads;
+      for (size_t i = 0; i < readers; i++)
+      {
+        threads.emplace_back([&, i]
+                             {
+                               uint32_t key = static_cast<uint32_t>(i) * 7919;
+                               uint64_t found = 0;
+                               const double end = benchmark::Now() + kSeconds;
+                               while (benchmark::Now() < end)
+                               {
+                                 for (int j = 0; j < 256; j++)
+                                 {
+                                   uintptr_t value;
+                                   key = (key * 1103515245 + 12345) % kEntries;
+                                   found += table->Find(key, &value);
+                                 }
+                               }
+                               total += found; });
+      }
+      for (std::thread &thread : threads)
+      {
+        thread.join();
+      }
+      stop = true;
+      writer.join();
+      return total / kSeconds;
+    }
+
+  } // namespace
+
+  BENCHMARK(rcu_hash_table)
+  {
+    size_t cpus = std::thread::hardware_concurrency();
+    std::vector<size_t> reader_counts = {1, 2, 4};
+    if (cpus > 4)
+    {
+      reader_counts.push_back(cpus);
+    }
+    for (size_t readers : reader_counts)
+    {
+      RcuHashTable<uint32_t, uintptr_t> rcu;
+      LockedTable locked;
+      double rcu_rate = Lookups(&rcu, readers);
+      double locked_rate = Lookups(&locked, readers);
+      printf("%2zu readers  rcu %7.2f M lookups/s  shared_mutex %7.2f M lookups/s\n", readers, rcu_rate / 1e6,
+             locked_rate / 1e6);
+    }
+  }
+
+} // namespace wireguard_flutter
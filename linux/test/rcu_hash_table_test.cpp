@@ -0,0 +1,167 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "epoch.h"
+#include "rcu_hash_table.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Values carry their key, so a reader can tell a value that belongs to
+    // another key, or to a node already freed and reused, from a good one.
+    uint64_t MakeValue(uint64_t key, uint64_t version) { return key << 32 | version; }
+
+    std::atomic<size_t> deleted{0};
+
+    void CountingDelete(void *object)
+    {
+      delete static_cast<int *>(object);
+      deleted++;
+    }
+
+  } // namespace
+
+  TEST(rcu_hash_table, InsertFindErase)
+  {
+    RcuHashTable<uint64_t, uint64_t> table(4);
+    for (uint64_t key = 0; key < 1000; key++)
+    {
+      table.Insert(key, MakeValue(key, 0));
+    }
+    EXPECT_EQ(table.size(), static_cast<size_t>(1000));
+    for (uint64_t key = 0; key < 1000; key += 2)
+    {
+      table.Insert(key, MakeValue(key, 1));
+      EXPECT_TRUE(table.Erase(key + 1));
+    }
+    EXPECT_FALSE(table.Erase(1));
+    EXPECT_EQ(table.size(), static_cast<size_t>(500));
+    size_t right = 0;
+    for (uint64_t key = 0; key < 1000; key++)
+    {
+      uint64_t value = 0;
+      bool found = table.Find(key, &value);
+      right += key % 2 == 0 ? found && value == MakeValue(key, 1) : !found;
+    }
+    EXPECT_EQ(right, static_cast<size_t>(1000));
+  }
+
+  // Readers look keys up while a writer inserts, replaces and erases them
+  // and the table grows. Keys the writer never touches are always found,
+  // and every value found belongs to its key.
+  TEST(rcu_hash_table, ConcurrentReadersAndWriter)
+  {
+    const uint64_t kStableKeys = 256, kChurnKeys = 4096;
+    RcuHashTable<uint64_t, uint64_t> table;
+    for (uint64_t key = 0; key < kStableKeys; key++)
+    {
+      table.Insert(key, MakeValue(key, 0));
+    }
+
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> lookups{0}, missing{0}, wrong{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; r++)
+    {
+      readers.emplace_back([&, r]
+                           {
+                             std::mt19937_64 rng(r);
+                             uint64_t local = 0;
+                             while (!stop.load(std::memory_order_relaxed))
+                             {
+                               uint64_t key = rng() % (kStableKeys + kChurnKeys);
+                               uint64_t value;
+                               if (table.Find(key, &value))
+                               {
+                                 wrong += value >> 32 != key;
+                               }
+                               else if (key < kStableKeys)
+                               {
+                                 missing++;
+                               }
+                               local++;
+                             }
+                             lookups += local; });
+    }
+
+    std::mt19937_64 rng(99);
+    const auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+    for (uint64_t version = 1; std::chrono::steady_clock::now() < end; version++)
+    {
+      uint64_t key = kStableKeys + rng() % kChurnKeys;
+      switch (rng() % 3)
+      {
+      case 0:
+        table.Erase(key);
+        break;
+      default:
+        table.Insert(key, MakeValue(key, version));
+        break;
+      }
+      if (version % 5000 == 0)
+      {
+        // Replace the stable keys too, which must stay visible throughout.
+        for (uint64_t stable = 0; stable < kStableKeys; stable++)
+        {
+          table.Insert(stable, MakeValue(stable, version));
+        }
+      }
+    }
+    stop = true;
+    for (std::thread &reader : readers)
+    {
+      reader.join();
+    }
+    EXPECT_TRUE(lookups.load() > 0);
+    EXPECT_EQ(missing.load(), static_cast<uint64_t>(0));
+    EXPECT_EQ(wrong.load(), static_cast<uint64_t>(0));
+
+    // With no reader left, everything the writer retired can go.
+    EpochDomain::Instance().Reclaim();
+    EXPECT_EQ(EpochDomain::Instance().pending(), static_cast<size_t>(0));
+  }
+
+  // An object retired while a reader is inside a guard outlives the guard,
+  // and is freed by the first reclaim after it.
+  TEST(rcu_hash_table, ReclaimWaitsForReaders)
+  {
+    EpochDomain &domain = EpochDomain::Instance();
+    domain.Reclaim();
+    size_t before = deleted.load();
+    std::atomic<bool> entered{false}, release{false};
+    std::thread reader([&]
+                       {
+                         EpochGuard guard;
+                         entered = true;
+                         while (!release)
+                         {
+                           std::this_thread::yield();
+                         } });
+    while (!entered)
+    {
+      std::this_thread::yield();
+    }
+    for (int i = 0; i < 200; i++)
+    {
+      domain.Retire(new int(i), CountingDelete);
+    }
+    domain.Reclaim();
+    EXPECT_EQ(deleted.load(), before);
+    EXPECT_EQ(domain.pending(), static_cast<size_t>(200));
+
+    release = true;
+    reader.join();
+    domain.Reclaim();
+    EXPECT_EQ(deleted.load(), before + 200);
+    EXPECT_EQ(domain.pending(), static_cast<size_t>(0));
+  }
+
+} // namespace wireguard_flutter
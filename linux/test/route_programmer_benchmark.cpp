@@ -0,0 +1,129 @@
+// Keeping 50k routes in step as 1% of them change at a time, in a network
+// namespace of its own: the first install, a round of churn, and an Apply()
+// with nothing to change, which costs only the diff.
+#include <net/if.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "route_programmer.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kRoutes = 50000;
+    const size_t kChurn = kRoutes / 100;
+    const int kRounds = 20;
+    const uint32_t kTable = 100;
+
+    IpPrefix Route(size_t n)
+    {
+      IpPrefix prefix;
+      prefix.family = AF_INET;
+      prefix.cidr = 32;
+      prefix.address[0] = 10;
+      prefix.address[1] = static_cast<uint8_t>(n >> 16);
+      prefix.address[2] = static_cast<uint8_t>(n >> 8);
+      prefix.address[3] = static_cast<uint8_t>(n);
+      return prefix;
+    }
+
+    bool SetLoopbackUp()
+    {
+      int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      struct ifreq ifr;
+      memset(&ifr, 0, sizeof(ifr));
+      strcpy(ifr.ifr_name, "lo");
+      bool up = ioctl(fd, SIOCGIFFLAGS, &ifr) == 0;
+      ifr.ifr_flags = static_cast<short>(ifr.ifr_flags | IFF_UP);
+      up = up && ioctl(fd, SIOCSIFFLAGS, &ifr) == 0;
+      close(fd);
+      return up;
+    }
+
+    double Median(std::vector<double> values)
+    {
+      std::sort(values.begin(), values.end());
+      return values[values.size() / 2];
+    }
+
+    void Run()
+    {
+      // Only this thread moves, so later benchmarks keep the host's network.
+      if (unshare(CLONE_NEWNET) != 0 || !SetLoopbackUp())
+      {
+        printf("no network namespace: %s\n", strerror(errno));
+        return;
+      }
+      RouteProgrammer programmer(OpenRouteNetlink(), static_cast<int>(if_nametoindex("lo")), kTable);
+      std::vector<IpPrefix> routes;
+      for (size_t i = 0; i < kRoutes; i++)
+      {
+        routes.push_back(Route(i));
+      }
+      double start = benchmark::Now();
+      RouteUpdate update = programmer.Apply(routes);
+      double elapsed = benchmark::Now() - start;
+      printf("install %zu routes  %8.1f ms  %4zu batches  %7.0f routes/s\n", update.added, elapsed * 1e3,
+             update.batches, update.added / elapsed);
+
+      // Each round replaces the oldest 1% with fresh routes.
+      std::vector<double> churn, unchanged;
+      size_t next = kRoutes;
+      for (int round = 0; round < kRounds; round++)
+      {
+        routes.erase(routes.begin(), routes.begin() + kChurn);
+        for (size_t i = 0; i < kChurn; i++)
+        {
+          routes.push_back(Route(next++));
+        }
+        start = benchmark::Now();
+        update = programmer.Apply(routes);
+        churn.push_back(benchmark::Now() - start);
+        if (update.added != kChurn || update.removed != kChurn)
+        {
+          printf("churn round %d changed %zu+%zu routes\n", round, update.added, update.removed);
+          return;
+        }
+        start = benchmark::Now();
+        programmer.Apply(routes);
+        unchanged.push_back(benchmark::Now() - start);
+      }
+      printf("churn %zu+%zu routes  %8.2f ms  %4zu batches\n", kChurn, kChurn, Median(churn) * 1e3,
+             update.batches);
+      printf("unchanged apply     %8.2f ms\n", Median(unchanged) * 1e3);
+    }
+
+  } // namespace
+
+  BENCHMARK(route_programmer)
+  {
+    std::thread thread(
+        []
+        {
+          try
+          {
+            Run();
+          }
+          catch (const std::runtime_error &error)
+          {
+            printf("failed: %s\n", error.what());
+          }
+        });
+    thread.join();
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,632 @@
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "route_programmer.h"
+#include "test.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const uint32_t kTable = 100;
+
+    // Moves the process into a network namespace of its own, so routes can
+    // be programmed without touching the host's. Skips the test where that
+    // takes privileges the process lacks.
+    void RequireNetworkNamespace()
+    {
+      if (unshare(CLONE_NEWNET) != 0)
+      {
+        SKIP(std::string("no network namespace: ") + strerror(errno));
+      }
+    }
+
+    // Brings the namespace's loopback up or down; routes through it are
+    // refused while it is down.
+    void SetLoopbackUp(bool up)
+    {
+      int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      struct ifreq ifr;
+      memset(&ifr, 0, sizeof(ifr));
+      strcpy(ifr.ifr_name, "lo");
+      ASSERT_EQ(ioctl(fd, SIOCGIFFLAGS, &ifr), 0);
+      ifr.ifr_flags = static_cast<short>(up ? ifr.ifr_flags | IFF_UP : ifr.ifr_flags & ~IFF_UP);
+      ASSERT_EQ(ioctl(fd, SIOCSIFFLAGS, &ifr), 0);
+      close(fd);
+    }
+
+    // |count| distinct prefixes: /32s in 10.0.0.0/8, then /128s.
+    std::vector<IpPrefix> Routes(size_t count, size_t first = 0)
+    {
+      std::vector<IpPrefix> routes(count);
+      for (size_t i = 0; i < count; i++)
+      {
+        size_t n = first + i;
+        if (i % 2 == 0)
+        {
+          routes[i].family = AF_INET;
+          routes[i].cidr = 32;
+          routes[i].address[0] = 10;
+          routes[i].address[1] = static_cast<uint8_t>(n >> 16);
+          routes[i].address[2] = static_cast<uint8_t>(n >> 8);
+          routes[i].address[3] = static_cast<uint8_t>(n);
+        }
+        else
+        {
+          routes[i].family = AF_INET6;
+          routes[i].cidr = 128;
+          routes[i].address[0] = 0xfd;
+          routes[i].address[13] = static_cast<uint8_t>(n >> 16);
+          routes[i].address[14] = static_cast<uint8_t>(n >> 8);
+          routes[i].address[15] = static_cast<uint8_t>(n);
+        }
+      }
+      return routes;
+    }
+
+    // What the kernel has through the loopback in the table, read back by
+    // a programmer of its own.
+    size_t KernelRoutes()
+    {
+      RouteProgrammer reader(OpenRouteNetlink(), static_cast<int>(if_nametoindex("lo")), kTable);
+      reader.Resync();
+      return reader.size();
+    }
+
+    // Answers like rtnetlink on one end of a SOCK_SEQPACKET socketpair, so
+    // the programmer can be tested without privileges. It keeps a table of
+    // routes and takes each request of a batch in order, sending an error
+    // for each failure and an acknowledgement where one is asked for; a
+    // dump reads the table back. Refuse() scripts failures, and
+    // HangUpAfter() closes the socket after answering some batches.
+    class FakeKernel
+    {
+    public:
+      // One datagram of requests, as received.
+      struct Batch
+      {
+        uint16_t type = 0;
+        size_t messages = 0;
+        size_t acks_asked = 0;
+        bool last_asks_ack = false;
+      };
+
+      FakeKernel();
+      ~FakeKernel();
+
+      // The programmer's end, which it takes ownership of.
+      int programmer_fd() const { return programmer_fd_; }
+
+      void Add(const IpPrefix &prefix, uint32_t table, int oif, uint8_t protocol = RTPROT_BOOT);
+      // Requests for |prefix| fail with |error| from now on; 0 lets them
+      // through again.
+      void Refuse(const IpPrefix &prefix, int error);
+      void HangUpAfter(size_t batches);
+      // How many routes it has through |oif| in |table|, or in all.
+      size_t Routes(uint32_t table, int oif);
+      size_t Routes();
+      // The batches received since the last call.
+      std::vector<Batch> TakeBatches();
+
+    private:
+      struct Route
+      {
+        IpPrefix prefix;
+        uint32_t table;
+        int oif;
+        uint8_t protocol;
+      };
+
+      static std::string PrefixKey(const IpPrefix &prefix);
+      static std::string RouteKey(const Route &route);
+
+      void Run();
+      // Applies one route request, returning 0 or the errno to report.
+      int HandleRoute(const struct nlmsghdr *header);
+      void SendError(const struct nlmsghdr *request, int error);
+      void SendDump(uint32_t seq);
+
+      int fd_;
+      int programmer_fd_;
+      std::thread thread_;
+      std::mutex mutex_;
+      std::map<std::string, Route> routes_;
+      std::map<std::string, int> refused_;
+      std::vector<Batch> batches_;
+      size_t answered_ = 0;
+      size_t hang_up_after_ = SIZE_MAX;
+    };
+
+    FakeKernel::FakeKernel()
+    {
+      int fds[2];
+      if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)
+      {
+        throw std::runtime_error("socketpair failed: " + std::string(strerror(errno)));
+      }
+      fd_ = fds[0];
+      programmer_fd_ = fds[1];
+      thread_ = std::thread(&FakeKernel::Run, this);
+    }
+
+    FakeKernel::~FakeKernel()
+    {
+      shutdown(fd_, SHUT_RDWR);
+      thread_.join();
+      close(fd_);
+    }
+
+    void FakeKernel::Add(const IpPrefix &prefix, uint32_t table, int oif, uint8_t protocol)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Route route = {prefix, table, oif, protocol};
+      routes_[RouteKey(route)] = route;
+    }
+
+    void FakeKernel::Refuse(const IpPrefix &prefix, int error)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (error == 0)
+      {
+        refused_.erase(PrefixKey(prefix));
+      }
+      else
+      {
+        refused_[PrefixKey(prefix)] = error;
+      }
+    }
+
+    void FakeKernel::HangUpAfter(size_t batches)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      hang_up_after_ = batches;
+    }
+
+    size_t FakeKernel::Routes(uint32_t table, int oif)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      size_t count = 0;
+      for (const auto &entry : routes_)
+      {
+        count += entry.second.table == table && entry.second.oif == oif;
+      }
+      return count;
+    }
+
+    size_t FakeKernel::Routes()
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return routes_.size();
+    }
+
+    std::vector<FakeKernel::Batch> FakeKernel::TakeBatches()
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::vector<Batch> batches;
+      batches.swap(batches_);
+      return batches;
+    }
+
+    std::string FakeKernel::PrefixKey(const IpPrefix &prefix)
+    {
+      std::string key(reinterpret_cast<const char *>(prefix.address), sizeof(prefix.address));
+      key += static_cast<char>(prefix.family);
+      key += static_cast<char>(prefix.cidr);
+      return key;
+    }
+
+    std::string FakeKernel::RouteKey(const Route &route)
+    {
+      return PrefixKey(route.prefix) + std::to_string(route.table) + "/" + std::to_string(route.oif);
+    }
+
+    void FakeKernel::Run()
+    {
+      std::vector<uint8_t> buffer(256 * 1024);
+      while (true)
+      {
+        ssize_t n = recv(fd_, buffer.data(), buffer.size(), 0);
+        if (n <= 0)
+        {
+          return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (answered_ == hang_up_after_)
+        {
+          shutdown(fd_, SHUT_RDWR);
+          return;
+        }
+        answered_++;
+        Batch batch;
+        int len = static_cast<int>(n);
+        for (struct nlmsghdr *header = reinterpret_cast<struct nlmsghdr *>(buffer.data()); NLMSG_OK(header, len);
+             header = NLMSG_NEXT(header, len))
+        {
+          batch.type = header->nlmsg_type;
+          batch.messages++;
+          batch.last_asks_ack = (header->nlmsg_flags & NLM_F_ACK) != 0;
+          batch.acks_asked += batch.last_asks_ack;
+          if (header->nlmsg_type == RTM_GETROUTE && (header->nlmsg_flags & NLM_F_DUMP) == NLM_F_DUMP)
+          {
+            SendDump(header->nlmsg_seq);
+            continue;
+          }
+          int error = HandleRoute(header);
+          if (error != 0 || batch.last_asks_ack)
+          {
+            SendError(header, error);
+          }
+        }
+        batches_.push_back(batch);
+      }
+    }
+
+    int FakeKernel::HandleRoute(const struct nlmsghdr *header)
+    {
+      if ((header->nlmsg_type != RTM_NEWROUTE && header->nlmsg_type != RTM_DELROUTE) ||
+          header->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg)))
+      {
+        return EINVAL;
+      }
+      struct rtmsg message;
+      memcpy(&message, NLMSG_DATA(header), sizeof(message));
+      Route route = {IpPrefix(), message.rtm_table, 0, message.rtm_protocol};
+      route.prefix.family = message.rtm_family;
+      route.prefix.cidr = message.rtm_dst_len;
+      int attributes_len = static_cast<int>(RTM_PAYLOAD(header));
+      for (const struct rtattr *attribute = RTM_RTA(NLMSG_DATA(header)); RTA_OK(attribute, attributes_len);
+           attribute = RTA_NEXT(attribute, attributes_len))
+      {
+        size_t payload = RTA_PAYLOAD(attribute);
+        if (attribute->rta_type == RTA_DST && payload <= sizeof(route.prefix.address))
+        {
+          memcpy(route.prefix.address, RTA_DATA(attribute), payload);
+        }
+        else if (attribute->rta_type == RTA_TABLE && payload == sizeof(route.table))
+        {
+          memcpy(&route.table, RTA_DATA(attribute), payload);
+        }
+        else if (attribute->rta_type == RTA_OIF && payload == sizeof(route.oif))
+        {
+          memcpy(&route.oif, RTA_DATA(attribute), payload);
+        }
+      }
+      auto refused = refused_.find(PrefixKey(route.prefix));
+      if (refused != refused_.end())
+      {
+        return refused->second;
+      }
+      std::string key = RouteKey(route);
+      if (header->nlmsg_type == RTM_DELROUTE)
+      {
+        return routes_.erase(key) == 0 ? ESRCH : 0;
+      }
+      if (routes_.count(key) != 0)
+      {
+        return EEXIST;
+      }
+      routes_[key] = route;
+      return 0;
+    }
+
+    void FakeKernel::SendError(const struct nlmsghdr *request, int error)
+    {
+      struct
+      {
+        struct nlmsghdr header;
+        struct nlmsgerr error;
+      } reply;
+      memset(&reply, 0, sizeof(reply));
+      reply.header.nlmsg_len = sizeof(reply);
+      reply.header.nlmsg_type = NLMSG_ERROR;
+      reply.header.nlmsg_seq = request->nlmsg_seq;
+      reply.error.error = -error;
+      reply.error.msg = *request;
+      send(fd_, &reply, sizeof(reply), 0);
+    }
+
+    // As the kernel does, packs the routes into datagrams of many messages
+    // each and ends with NLMSG_DONE.
+    void FakeKernel::SendDump(uint32_t seq)
+    {
+      std::vector<uint8_t> datagram;
+      auto append = [&](uint16_t type, const void *data, size_t len)
+      {
+        size_t start = datagram.size();
+        datagram.resize(start + NLMSG_SPACE(len));
+        struct nlmsghdr header;
+        memset(&header, 0, sizeof(header));
+        header.nlmsg_len = static_cast<uint32_t>(NLMSG_LENGTH(len));
+        header.nlmsg_type = type;
+        header.nlmsg_flags = NLM_F_MULTI;
+        header.nlmsg_seq = seq;
+        memcpy(datagram.data() + start, &header, sizeof(header));
+        memcpy(datagram.data() + start + NLMSG_HDRLEN, data, len);
+      };
+      for (const auto &entry : routes_)
+      {
+        const Route &route = entry.second;
+        std::vector<uint8_t> payload(NLMSG_ALIGN(sizeof(struct rtmsg)));
+        struct rtmsg message;
+        memset(&message, 0, sizeof(message));
+        message.rtm_family = static_cast<unsigned char>(route.prefix.family);
+        message.rtm_dst_len = route.prefix.cidr;
+        message.rtm_table = static_cast<unsigned char>(route.table < 256 ? route.table : RT_TABLE_UNSPEC);
+        message.rtm_protocol = route.protocol;
+        message.rtm_scope = RT_SCOPE_LINK;
+        message.rtm_type = RTN_UNICAST;
+        memcpy(payload.data(), &message, sizeof(message));
+        auto attribute = [&](uint16_t type, const void *data, size_t len)
+        {
+          struct rtattr header;
+          header.rta_len = static_cast<unsigned short>(RTA_LENGTH(len));
+          header.rta_type = type;
+          size_t offset = payload.size();
+          payload.resize(offset + RTA_SPACE(len));
+          memcpy(payload.data() + offset, &header, sizeof(header));
+          memcpy(payload.data() + offset + RTA_LENGTH(0), data, len);
+        };
+        attribute(RTA_DST, route.prefix.address, route.prefix.family == AF_INET6 ? 16 : 4);
+        attribute(RTA_TABLE, &route.table, sizeof(route.table));
+        attribute(RTA_OIF, &route.oif, sizeof(route.oif));
+        append(RTM_NEWROUTE, payload.data(), payload.size());
+        if (datagram.size() >= 16 * 1024)
+        {
+          send(fd_, datagram.data(), datagram.size(), 0);
+          datagram.clear();
+        }
+      }
+      int done = 0;
+      append(NLMSG_DONE, &done, sizeof(done));
+      send(fd_, datagram.data(), datagram.size(), 0);
+    }
+
+    const int kFakeIfindex = 7;
+
+  } // namespace
+
+  // Thousands of routes go in and come out in capped batches, and only the
+  // difference is sent when the set changes.
+  TEST(route_programmer, ApplyAndDiff)
+  {
+    RequireNetworkNamespace();
+    SetLoopbackUp(true);
+    RouteProgrammer programmer(OpenRouteNetlink(), static_cast<int>(if_nametoindex("lo")), kTable);
+    RouteUpdate update = programmer.Apply(Routes(5001));
+    EXPECT_EQ(update.added, static_cast<size_t>(5001));
+    EXPECT_TRUE(update.batches >= 5001 / 128);
+    EXPECT_EQ(programmer.size(), static_cast<size_t>(5001));
+    EXPECT_EQ(KernelRoutes(), static_cast<size_t>(5001));
+
+    // Half kept, half replaced.
+    std::vector<IpPrefix> next = Routes(2500);
+    std::vector<IpPrefix> fresh = Routes(2500, 100000);
+    next.insert(next.end(), fresh.begin(), fresh.end());
+    update = programmer.Apply(next);
+    EXPECT_EQ(update.added, static_cast<size_t>(2500));
+    EXPECT_EQ(update.removed, static_cast<size_t>(2501));
+    EXPECT_EQ(KernelRoutes(), static_cast<size_t>(5000));
+
+    update = programmer.Apply({});
+    EXPECT_EQ(update.removed, static_cast<size_t>(5000));
+    EXPECT_EQ(KernelRoutes(), static_cast<size_t>(0));
+  }
+
+  // A big batch the kernel refuses whole draws an error per route; all of
+  // them are read and reported, and nothing counts as installed.
+  TEST(route_programmer, RefusedBatch)
+  {
+    RequireNetworkNamespace();
+    SetLoopbackUp(false);
+    RouteProgrammer programmer(OpenRouteNetlink(), static_cast<int>(if_nametoindex("lo")), kTable);
+    std::vector<IpPrefix> routes = Routes(5001);
+    std::string message;
+    try
+    {
+      programmer.Apply(routes);
+    }
+    catch (const std::runtime_error &error)
+    {
+      message = error.what();
+    }
+    EXPECT_TRUE(message.find("kernel refused 5001 route(s)") != std::string::npos);
+    EXPECT_EQ(programmer.size(), static_cast<size_t>(0));
+
+    // Once the link is up, the same set goes in.
+    SetLoopbackUp(true);
+    EXPECT_EQ(programmer.Apply(routes).added, static_cast<size_t>(5001));
+    EXPECT_EQ(KernelRoutes(), static_cast<size_t>(5001));
+  }
+
+  // With a receive buffer too small for a batch's errors, the kernel drops
+  // acknowledgements; the programmer reads the routes back instead and ends
+  // up knowing what is installed.
+  TEST(route_programmer, ResyncAfterDroppedAcks)
+  {
+    RequireNetworkNamespace();
+    SetLoopbackUp(true);
+    int ifindex = static_cast<int>(if_nametoindex("lo"));
+    RouteProgrammer first(OpenRouteNetlink(), ifindex, kTable);
+    first.Apply(Routes(2000));
+
+    // A second programmer that knows nothing of them: every route it adds
+    // that exists already draws an error, if a harmless one.
+    int fd = OpenRouteNetlink();
+    int tiny = 1;
+    ASSERT_EQ(setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &tiny, sizeof(tiny)), 0);
+    RouteProgrammer second(fd, ifindex, kTable);
+    RouteUpdate update = second.Apply(Routes(2500));
+    EXPECT_EQ(second.size(), static_cast<size_t>(2500));
+    EXPECT_EQ(update.added, static_cast<size_t>(2500));
+    EXPECT_EQ(KernelRoutes(), static_cast<size_t>(2500));
+
+    // Resync() also picks up routes it did not install itself.
+    first.Resync();
+    EXPECT_EQ(first.size(), static_cast<size_t>(2500));
+    EXPECT_EQ(first.Apply({}).removed, static_cast<size_t>(2500));
+    EXPECT_EQ(KernelRoutes(), static_cast<size_t>(0));
+  }
+
+  // Routes go out in batches of up to 128, and only the last request of
+  // each asks for an acknowledgement.
+  TEST(route_programmer, FakeKernelBatches)
+  {
+    FakeKernel kernel;
+    RouteProgrammer programmer(kernel.programmer_fd(), kFakeIfindex, kTable);
+    RouteUpdate update = programmer.Apply(Routes(1000));
+    EXPECT_EQ(update.added, static_cast<size_t>(1000));
+    EXPECT_EQ(update.batches, static_cast<size_t>(8));
+    std::vector<FakeKernel::Batch> batches = kernel.TakeBatches();
+    ASSERT_EQ(batches.size(), static_cast<size_t>(8));
+    size_t messages = 0;
+    for (const auto &batch : batches)
+    {
+      EXPECT_EQ(batch.type, static_cast<uint16_t>(RTM_NEWROUTE));
+      EXPECT_TRUE(batch.messages <= 128);
+      EXPECT_EQ(batch.acks_asked, static_cast<size_t>(1));
+      EXPECT_TRUE(batch.last_asks_ack);
+      messages += batch.messages;
+    }
+    EXPECT_EQ(messages, static_cast<size_t>(1000));
+    EXPECT_EQ(kernel.Routes(kTable, kFakeIfindex), static_cast<size_t>(1000));
+  }
+
+  // A changed set sends only the routes to remove and add, duplicates and
+  // host bits notwithstanding, and an unchanged one sends nothing.
+  TEST(route_programmer, FakeKernelSendsOnlyTheDifference)
+  {
+    FakeKernel kernel;
+    RouteProgrammer programmer(kernel.programmer_fd(), kFakeIfindex, kTable);
+    programmer.Apply(Routes(1000));
+    kernel.TakeBatches();
+
+    std::vector<IpPrefix> next = Routes(990);
+    std::vector<IpPrefix> fresh = Routes(10, 5000);
+    next.insert(next.end(), fresh.begin(), fresh.end());
+    next.push_back(next[0]);
+    IpPrefix with_host_bits = next[2];
+    with_host_bits.cidr = 24;
+    with_host_bits.address[3] = 0;
+    next.push_back(with_host_bits);
+    with_host_bits.address[3] = 99;
+    next.push_back(with_host_bits);
+    RouteUpdate update = programmer.Apply(next);
+    EXPECT_EQ(update.added, static_cast<size_t>(11));
+    EXPECT_EQ(update.removed, static_cast<size_t>(10));
+    std::vector<FakeKernel::Batch> batches = kernel.TakeBatches();
+    ASSERT_EQ(batches.size(), static_cast<size_t>(2));
+    EXPECT_EQ(batches[0].type, static_cast<uint16_t>(RTM_DELROUTE));
+    EXPECT_EQ(batches[0].messages, static_cast<size_t>(10));
+    EXPECT_EQ(batches[1].type, static_cast<uint16_t>(RTM_NEWROUTE));
+    EXPECT_EQ(batches[1].messages, static_cast<size_t>(11));
+    EXPECT_EQ(kernel.Routes(), static_cast<size_t>(1001));
+
+    update = programmer.Apply(next);
+    EXPECT_EQ(update.added + update.removed + update.batches, static_cast<size_t>(0));
+    EXPECT_TRUE(kernel.TakeBatches().empty());
+  }
+
+  // Routes the kernel has already count as added; refused ones are
+  // reported, left out of what is installed, and sent again next time.
+  TEST(route_programmer, FakeKernelRefusedRoutesAreSentAgain)
+  {
+    FakeKernel kernel;
+    std::vector<IpPrefix> routes = Routes(1000);
+    for (size_t i = 0; i < 100; i++)
+    {
+      kernel.Add(routes[i], kTable, kFakeIfindex);
+    }
+    kernel.Refuse(routes[200], ENETUNREACH);
+    kernel.Refuse(routes[500], ENETUNREACH);
+    kernel.Refuse(routes[999], EINVAL);
+    RouteProgrammer programmer(kernel.programmer_fd(), kFakeIfindex, kTable);
+    std::string message;
+    try
+    {
+      programmer.Apply(routes);
+    }
+    catch (const std::runtime_error &error)
+    {
+      message = error.what();
+    }
+    EXPECT_TRUE(message.find("kernel refused 3 route(s)") != std::string::npos);
+    EXPECT_EQ(programmer.size(), static_cast<size_t>(997));
+    EXPECT_EQ(kernel.Routes(), static_cast<size_t>(997));
+
+    kernel.Refuse(routes[200], 0);
+    kernel.Refuse(routes[500], 0);
+    kernel.Refuse(routes[999], 0);
+    kernel.TakeBatches();
+    RouteUpdate update = programmer.Apply(routes);
+    EXPECT_EQ(update.added, static_cast<size_t>(3));
+    EXPECT_EQ(update.batches, static_cast<size_t>(1));
+    EXPECT_EQ(kernel.Routes(), static_cast<size_t>(1000));
+  }
+
+  // Resync() reads a dump spanning several datagrams and keeps only the
+  // routes through the link in the table that it would have installed.
+  // The ENOBUFS path that calls it needs a real kernel, above.
+  TEST(route_programmer, FakeKernelResync)
+  {
+    FakeKernel kernel;
+    std::vector<IpPrefix> ours = Routes(300);
+    for (const auto &prefix : ours)
+    {
+      kernel.Add(prefix, kTable, kFakeIfindex);
+    }
+    std::vector<IpPrefix> others = Routes(50, 10000);
+    for (const auto &prefix : others)
+    {
+      kernel.Add(prefix, kTable + 1, kFakeIfindex);
+      kernel.Add(prefix, kTable, kFakeIfindex + 1);
+      kernel.Add(prefix, kTable, kFakeIfindex, RTPROT_STATIC);
+    }
+    // Past 255, the table is only in the attribute.
+    kernel.Add(others[0], 1000, kFakeIfindex);
+    RouteProgrammer programmer(kernel.programmer_fd(), kFakeIfindex, kTable);
+    programmer.Resync();
+    EXPECT_EQ(programmer.size(), static_cast<size_t>(300));
+
+    RouteUpdate update = programmer.Apply(std::vector<IpPrefix>(ours.begin(), ours.begin() + 100));
+    EXPECT_EQ(update.added, static_cast<size_t>(0));
+    EXPECT_EQ(update.removed, static_cast<size_t>(200));
+    EXPECT_EQ(kernel.Routes(), static_cast<size_t>(100 + 3 * 50 + 1));
+  }
+
+  // A socket that fails part way through leaves the batches it never
+  // acknowledged counted as not done.
+  TEST(route_programmer, FakeKernelHangsUp)
+  {
+    FakeKernel kernel;
+    kernel.HangUpAfter(3);
+    RouteProgrammer programmer(kernel.programmer_fd(), kFakeIfindex, kTable);
+    std::string message;
+    try
+    {
+      programmer.Apply(Routes(1000));
+    }
+    catch (const std::runtime_error &error)
+    {
+      message = error.what();
+    }
+    EXPECT_TRUE(message.find("netlink failed") != std::string::npos);
+    EXPECT_EQ(programmer.size(), static_cast<size_t>(3 * 128));
+  }
+
+} // namespace wireguard_flutter
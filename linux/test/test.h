@@ -0,0 +1,94 @@
+#ifndef WIREGUARD_FLUTTER_TEST_TEST_H
+#define WIREGUARD_FLUTTER_TEST_TEST_H
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace wireguard_flutter {
+namespace test {
+
+// A small test harness for the data plane, so the tests build with nothing
+// but the library. TEST(suite, name) registers a case; the runner takes a
+// suite name to run only that suite, which is how CMake registers each
+// suite with CTest. EXPECT_* records a failure and carries on, ASSERT_*
+// ends the case, and SKIP() ends it as skipped, e.g. when the kernel lacks
+// a feature or the test needs privileges it does not have.
+
+typedef void (*TestFunction)();
+
+struct TestRegistration {
+  TestRegistration(const char *suite, const char *name, TestFunction function);
+};
+
+// Thrown by ASSERT_* and SKIP() to leave the case.
+struct AssertionFailed {};
+struct Skipped {
+  std::string reason;
+};
+
+void AddFailure(const char *file, int line, const std::string &message);
+
+template <typename A, typename B>
+std::string Describe(const char *a_text, const char *b_text, const A &a, const B &b) {
+  std::ostringstream out;
+  out << a_text << " == " << b_text << "\n  left:  " << a << "\n  right: " << b;
+  return out.str();
+}
+
+// Parses hex, ignoring anything that is not a hex digit.
+std::vector<uint8_t> FromHex(const std::string &hex);
+std::string ToHex(const uint8_t *data, size_t len);
+inline std::string ToHex(const std::vector<uint8_t> &data) { return ToHex(data.data(), data.size()); }
+
+}  // namespace test
+}  // namespace wireguard_flutter
+
+#define TEST(suite, name)                                                                                   \
+  static void suite##_##name##_Test();                                                                      \
+  static ::wireguard_flutter::test::TestRegistration suite##_##name##_registration(#suite, #name,           \
+                                                                                   suite##_##name##_Test); \
+  static void suite##_##name##_Test()
+
+#define EXPECT_TRUE(condition)                                                      \
+  do {                                                                              \
+    if (!(condition)) {                                                             \
+      ::wireguard_flutter::test::AddFailure(__FILE__, __LINE__, "expected " #condition); \
+    }                                                                               \
+  } while (0)
+
+#define EXPECT_FALSE(condition) EXPECT_TRUE(!(condition))
+
+#define EXPECT_EQ(a, b)                                                                        \
+  do {                                                                                         \
+    const auto &expect_a_ = (a);                                                               \
+    const auto &expect_b_ = (b);                                                               \
+    if (!(expect_a_ == expect_b_)) {                                                           \
+      ::wireguard_flutter::test::AddFailure(                                                   \
+          __FILE__, __LINE__, ::wireguard_flutter::test::Describe(#a, #b, expect_a_, expect_b_)); \
+    }                                                                                          \
+  } while (0)
+
+#define ASSERT_TRUE(condition)                                                        \
+  do {                                                                                \
+    if (!(condition)) {                                                               \
+      ::wireguard_flutter::test::AddFailure(__FILE__, __LINE__, "expected " #condition); \
+      throw ::wireguard_flutter::test::AssertionFailed();                             \
+    }                                                                                 \
+  } while (0)
+
+#define ASSERT_EQ(a, b)                                                                        \
+  do {                                                                                         \
+    const auto &assert_a_ = (a);                                                               \
+    const auto &assert_b_ = (b);                                                               \
+    if (!(assert_a_ == assert_b_)) {                                                           \
+      ::wireguard_flutter::test::AddFailure(                                                   \
+          __FILE__, __LINE__, ::wireguard_flutter::test::Describe(#a, #b, assert_a_, assert_b_)); \
+      throw ::wireguard_flutter::test::AssertionFailed();                                      \
+    }                                                                                          \
+  } while (0)
+
+#define SKIP(reason) throw ::wireguard_flutter::test::Skipped{reason}
+
+#endif
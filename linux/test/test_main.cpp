@@ -0,0 +1,167 @@
+#include "test.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+namespace wireguard_flutter
+{
+  namespace test
+  {
+
+    namespace
+    {
+
+      // The return code that tells CTest every case in the suite was
+      // skipped; CMakeLists.txt sets it as SKIP_RETURN_CODE.
+      const int kAllSkipped = 77;
+
+      struct TestCase
+      {
+        const char *suite;
+        const char *name;
+        TestFunction function;
+      };
+
+      std::vector<TestCase> &Registry()
+      {
+        static std::vector<TestCase> registry;
+        return registry;
+      }
+
+      bool current_failed = false;
+
+    } // namespace
+
+    TestRegistration::TestRegistration(const char *suite, const char *name, TestFunction function)
+    {
+      Registry().push_back({suite, name, function});
+    }
+
+    void AddFailure(const char *file, int line, const std::string &message)
+    {
+      current_failed = true;
+      fprintf(stderr, "%s:%d: failure: %s\n", file, line, message.c_str());
+    }
+
+    std::vector<uint8_t> FromHex(const std::string &hex)
+    {
+      std::vector<uint8_t> out;
+      int high = -1;
+      for (char c : hex)
+      {
+        int digit;
+        if (c >= '0' && c <= '9')
+        {
+          digit = c - '0';
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+          digit = c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+          digit = c - 'A' + 10;
+        }
+        else
+        {
+          continue;
+        }
+        if (high < 0)
+        {
+          high = digit;
+        }
+        else
+        {
+          out.push_back(static_cast<uint8_t>(high << 4 | digit));
+          high = -1;
+        }
+      }
+      return out;
+    }
+
+    std::string ToHex(const uint8_t *data, size_t len)
+    {
+      static const char kDigits[] = "0123456789abcdef";
+      std::string out;
+      out.reserve(2 * len);
+      for (size_t i = 0; i < len; i++)
+      {
+        out += kDigits[data[i] >> 4];
+        out += kDigits[data[i] & 15];
+      }
+      return out;
+    }
+
+  } // namespace test
+} // namespace wireguard_flutter
+
+// Runs every case, or those of the suite named by the first argument.
+int main(int argc, char **argv)
+{
+  using namespace wireguard_flutter::test;
+  const char *only = argc > 1 ? argv[1] : nullptr;
+  int run = 0, failed = 0, skipped = 0;
+  for (const TestCase &test : Registry())
+  {
+    if (only != nullptr && strcmp(only, test.suite) != 0)
+    {
+      continue;
+    }
+    run++;
+    current_failed = false;
+    printf("[ RUN      ] %s.%s\n", test.suite, test.name);
+    fflush(stdout);
+    auto start = std::chrono::steady_clock::now();
+    std::string skip_reason;
+    bool was_skipped = false;
+    try
+    {
+      test.function();
+    }
+    catch (const AssertionFailed &)
+    {
+    }
+    catch (const Skipped &skip)
+    {
+      was_skipped = true;
+      skip_reason = skip.reason;
+    }
+    catch (const std::exception &e)
+    {
+      AddFailure(__FILE__, __LINE__, std::string("uncaught exception: ") + e.what());
+    }
+    long ms = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count());
+    if (current_failed)
+    {
+      failed++;
+      printf("[  FAILED  ] %s.%s (%ld ms)\n", test.suite, test.name, ms);
+    }
+    else if (was_skipped)
+    {
+      skipped++;
+      printf("[  SKIPPED ] %s.%s: %s\n", test.suite, test.name, skip_reason.c_str());
+    }
+    else
+    {
+      printf("[       OK ] %s.%s (%ld ms)\n", test.suite, test.name, ms);
+    }
+    fflush(stdout);
+  }
+  printf("%d run, %d failed, %d skipped\n", run, failed, skipped);
+  if (run == 0)
+  {
+    fprintf(stderr, "no tests match\n");
+    return 1;
+  }
+  if (failed > 0)
+  {
+    return 1;
+  }
+  return skipped == run ? kAllSkipped : 0;
+}
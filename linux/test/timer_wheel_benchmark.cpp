@@ -0,0 +1,93 @@
+// Re-arming the timers of 100k peers as traffic flows: every packet pushes
+// its peer's timer ten seconds out while the clock advances a tick per
+// thousand packets. The wheel against a std::multimap keyed by deadline.
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "benchmark.h"
+#include "timer_wheel.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    typedef TimerWheel::Clock Clock;
+
+    const size_t kPeers = 100000;
+    const size_t kPacketsPerTick = 1000;
+    const std::chrono::seconds kTimeout(10);
+
+    // |rearm| runs once per packet with the peer it belongs to and the current
+    // time; |advance| once per tick. Returns packets per second.
+    template <typename Rearm, typename Advance>
+    double RunTraffic(Rearm rearm, Advance advance)
+    {
+      std::mt19937 random(7);
+      std::uniform_int_distribution<size_t> peer(0, kPeers - 1);
+      Clock::time_point now = Clock::time_point() + std::chrono::hours(1);
+      uint64_t packets = 0;
+      const double start = benchmark::Now();
+      while (benchmark::Now() - start < 0.5)
+      {
+        for (size_t i = 0; i < kPacketsPerTick; i++)
+        {
+          rearm(peer(random), now);
+        }
+        packets += kPacketsPerTick;
+        now += std::chrono::milliseconds(1);
+        advance(now);
+      }
+      return packets / (benchmark::Now() - start);
+    }
+
+  } // namespace
+
+  BENCHMARK(timer_wheel)
+  {
+    Clock::time_point start = Clock::time_point() + std::chrono::hours(1);
+    TimerWheel wheel(start);
+    std::vector<std::unique_ptr<Timer>> timers;
+    for (size_t i = 0; i < kPeers; i++)
+    {
+      timers.emplace_back(new Timer([] {}));
+      wheel.Arm(timers.back().get(), start + kTimeout);
+    }
+    double wheel_rate = RunTraffic([&](size_t peer, Clock::time_point now)
+                                   { wheel.Arm(timers[peer].get(), now + kTimeout); },
+                                   [&](Clock::time_point now)
+                                   { wheel.Advance(now); });
+
+    typedef std::multimap<Clock::time_point, size_t> Deadlines;
+    Deadlines deadlines;
+    std::vector<Deadlines::iterator> entries;
+    for (size_t i = 0; i < kPeers; i++)
+    {
+      entries.push_back(deadlines.emplace(start + kTimeout, i));
+    }
+    double map_rate = RunTraffic(
+        [&](size_t peer, Clock::time_point now)
+        {
+          deadlines.erase(entries[peer]);
+          entries[peer] = deadlines.emplace(now + kTimeout, peer);
+        },
+        [&](Clock::time_point now)
+        {
+          while (!deadlines.empty() && deadlines.begin()->first <= now)
+          {
+            size_t peer = deadlines.begin()->second;
+            deadlines.erase(deadlines.begin());
+            entries[peer] = deadlines.emplace(Clock::time_point::max(), peer);
+          }
+        });
+
+    printf("%zu peers  wheel %6.2f M re-arms/s  multimap %6.2f M re-arms/s\n", kPeers, wheel_rate / 1e6,
+           map_rate / 1e6);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,146 @@
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "test.h"
+#include "timer_wheel.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    typedef TimerWheel::Clock Clock;
+    using std::chrono::milliseconds;
+    using std::chrono::nanoseconds;
+
+    const Clock::time_point kStart = Clock::time_point() + std::chrono::hours(1000);
+
+    struct Fired
+    {
+      Clock::time_point deadline;
+      Clock::time_point at;
+    };
+
+  } // namespace
+
+  // Driven like an event loop, sleeping until NextDeadline() each time,
+  // every timer fires at or after its deadline and within one tick of it,
+  // at every level of the wheel.
+  TEST(timer_wheel, FireTimeBounds)
+  {
+    for (nanoseconds tick : {nanoseconds(milliseconds(1)), nanoseconds(250000)})
+    {
+      TimerWheel wheel(kStart, tick);
+      std::mt19937_64 rng(7);
+      const size_t kTimers = 20000;
+      std::vector<std::unique_ptr<Timer>> timers;
+      std::vector<Fired> fired;
+      Clock::time_point now = kStart;
+      for (size_t i = 0; i < kTimers; i++)
+      {
+        // Spread over microseconds to hours, so every level holds some.
+        nanoseconds delay(rng() % (nanoseconds(tick).count() << (4 + i % 22)));
+        Clock::time_point deadline = kStart + delay;
+        timers.emplace_back(new Timer());
+        timers.back()->set_callback([&fired, &now, deadline]
+                                    { fired.push_back(Fired{deadline, now}); });
+        wheel.Arm(timers.back().get(), deadline);
+      }
+      EXPECT_EQ(wheel.size(), kTimers);
+
+      while (wheel.size() > 0)
+      {
+        Clock::time_point next = wheel.NextDeadline();
+        ASSERT_TRUE(next >= now);
+        now = next;
+        wheel.Advance(now);
+      }
+      ASSERT_EQ(fired.size(), kTimers);
+      size_t early = 0, late = 0, out_of_order = 0;
+      for (size_t i = 0; i < fired.size(); i++)
+      {
+        early += fired[i].at < fired[i].deadline;
+        late += fired[i].at - fired[i].deadline >= tick;
+        // Deadlines within one tick of each other may fire in either order.
+        out_of_order += i > 0 && fired[i].deadline + tick <= fired[i - 1].deadline;
+      }
+      EXPECT_EQ(early, static_cast<size_t>(0));
+      EXPECT_EQ(late, static_cast<size_t>(0));
+      EXPECT_EQ(out_of_order, static_cast<size_t>(0));
+    }
+  }
+
+  // Advancing in coarse steps fires everything due by then, never early.
+  TEST(timer_wheel, CoarseAdvance)
+  {
+    TimerWheel wheel(kStart);
+    std::vector<std::unique_ptr<Timer>> timers;
+    std::vector<Fired> fired;
+    Clock::time_point now = kStart;
+    for (int i = 0; i < 1000; i++)
+    {
+      Clock::time_point deadline = kStart + milliseconds(i * 37 % 5000);
+      timers.emplace_back(new Timer([&fired, &now, deadline]
+                                    { fired.push_back(Fired{deadline, now}); }));
+      wheel.Arm(timers.back().get(), deadline);
+    }
+    const milliseconds step(10);
+    while (wheel.size() > 0)
+    {
+      now += step;
+      wheel.Advance(now);
+    }
+    ASSERT_EQ(fired.size(), static_cast<size_t>(1000));
+    size_t outside = 0;
+    for (const Fired &f : fired)
+    {
+      outside += f.at < f.deadline || f.at - f.deadline > step;
+    }
+    EXPECT_EQ(outside, static_cast<size_t>(0));
+  }
+
+  TEST(timer_wheel, RearmCancelAndDestroy)
+  {
+    TimerWheel wheel(kStart);
+    Clock::time_point now = kStart;
+    int ticks = 0, cancelled_runs = 0;
+    Timer cancelled([&]
+                    { cancelled_runs++; });
+    Timer periodic;
+    periodic.set_callback([&]
+                          {
+                            if (++ticks < 10)
+                            {
+                              wheel.Arm(&periodic, now + milliseconds(100));
+                            }
+                            if (ticks == 3)
+                            {
+                              wheel.Cancel(&cancelled);
+                            } });
+    wheel.Arm(&periodic, now + milliseconds(100));
+    wheel.Arm(&cancelled, now + milliseconds(550));
+    {
+      Timer destroyed;
+      wheel.Arm(&destroyed, now + milliseconds(50));
+      EXPECT_EQ(wheel.size(), static_cast<size_t>(3));
+    }
+    EXPECT_EQ(wheel.size(), static_cast<size_t>(2));
+
+    // Re-arming moves a timer rather than adding it twice.
+    wheel.Arm(&periodic, now + milliseconds(100));
+    EXPECT_EQ(wheel.size(), static_cast<size_t>(2));
+
+    while (wheel.size() > 0)
+    {
+      now = wheel.NextDeadline();
+      wheel.Advance(now);
+    }
+    EXPECT_EQ(ticks, 10);
+    EXPECT_EQ(cancelled_runs, 0);
+    EXPECT_TRUE(now == kStart + milliseconds(1000));
+    EXPECT_TRUE(wheel.NextDeadline() == Clock::time_point::max());
+  }
+
+} // namespace wireguard_flutter
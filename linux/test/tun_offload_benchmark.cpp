@@ -0,0 +1,126 @@
+// A bulk TCP flow through the vnet_hdr path: TSO super-packets read from the
+// TUN cut into segments, and received segments merged back into GRO
+// super-packets for the TUN write. Reports payload Gbit/s and how many TUN
+// reads or writes each segment costs, against one per segment without
+// offloads.
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "benchmark.h"
+#include "byte_order.h"
+#include "tun_offload.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kMss = 1448;
+    const size_t kSegments = 44;
+
+    uint16_t Checksum(const uint8_t *data, size_t len, uint64_t sum)
+    {
+      for (size_t i = 0; i + 1 < len; i += 2)
+      {
+        sum += LoadBe16(data + i);
+      }
+      if (len % 2)
+      {
+        sum += static_cast<uint64_t>(data[len - 1]) << 8;
+      }
+      while (sum >> 16)
+      {
+        sum = (sum & 0xffff) + (sum >> 16);
+      }
+      return static_cast<uint16_t>(~sum);
+    }
+
+    // Segment |index| of an IPv4 TCP flow from 10.0.0.1 to 10.0.0.2, ACK
+    // only, with valid checksums.
+    std::vector<uint8_t> MakeSegment(size_t index)
+    {
+      std::vector<uint8_t> packet(40 + kMss);
+      uint8_t *ip = packet.data();
+      uint8_t *tcp = ip + 20;
+      ip[0] = 0x45;
+      StoreBe16(ip + 2, static_cast<uint16_t>(packet.size()));
+      StoreBe16(ip + 4, static_cast<uint16_t>(index));
+      ip[6] = 0x40;
+      ip[8] = 64;
+      ip[9] = 6;
+      ip[12] = 10;
+      ip[15] = 1;
+      ip[16] = 10;
+      ip[19] = 2;
+      StoreBe16(ip + 10, Checksum(ip, 20, 0));
+      StoreBe16(tcp, 1000);
+      StoreBe16(tcp + 2, 2000);
+      StoreBe32(tcp + 4, static_cast<uint32_t>(index * kMss));
+      tcp[12] = 5 << 4;
+      tcp[13] = 0x10;
+      StoreBe16(tcp + 14, 512);
+      memset(tcp + 20, static_cast<int>(index), kMss);
+      size_t tcp_len = packet.size() - 20;
+      uint64_t pseudo = LoadBe16(ip + 12) + LoadBe16(ip + 14) + LoadBe16(ip + 16) + LoadBe16(ip + 18) + 6 + tcp_len;
+      StoreBe16(tcp + 16, Checksum(tcp, tcp_len, pseudo));
+      return packet;
+    }
+
+    void Report(const char *name, double calls_per_second, size_t tun_calls)
+    {
+      printf("%-4s %7.3f Gbit/s  %5.3f TUN calls/segment (1 without offloads)\n", name,
+             calls_per_second * kSegments * kMss * 8 / 1e9, static_cast<double>(tun_calls) / kSegments);
+    }
+
+  } // namespace
+
+  BENCHMARK(tun_offload)
+  {
+    std::vector<std::vector<uint8_t>> segments;
+    for (size_t i = 0; i < kSegments; i++)
+    {
+      segments.push_back(MakeSegment(i));
+    }
+
+    TunCoalescer coalescer;
+    for (const std::vector<uint8_t> &segment : segments)
+    {
+      coalescer.Add(segment.data(), segment.size());
+    }
+    size_t writes = coalescer.Packets().size();
+    double gro = benchmark::CallsPerSecond(
+        [&]
+        {
+          coalescer.Clear();
+          for (const std::vector<uint8_t> &segment : segments)
+          {
+            coalescer.Add(segment.data(), segment.size());
+          }
+          coalescer.Packets();
+        },
+        0.5, 16);
+
+    // The super-packet the kernel would hand us with TSO, as one read.
+    const PacketSpan &super_packet = coalescer.Packets()[0];
+    std::vector<uint8_t> read(super_packet.data, super_packet.data + super_packet.len);
+    std::vector<uint8_t> buffer(read.size());
+    TunSegmenter segmenter;
+    size_t split = 0;
+    double tso = benchmark::CallsPerSecond(
+        [&]
+        {
+          memcpy(buffer.data(), read.data(), read.size());
+          split = segmenter.Split(buffer.data(), buffer.size()).size();
+        },
+        0.5, 16);
+    if (split != kSegments || writes != 1)
+    {
+      printf("super-packet of %zu segments split into %zu, merged into %zu\n", kSegments, split, writes);
+    }
+    Report("tso", tso, 1);
+    Report("gro", gro, writes);
+  }
+
+} // namespace wireguard_flutter
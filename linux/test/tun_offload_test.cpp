@@ -0,0 +1,153 @@
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "byte_order.h"
+#include "test.h"
+#include "tun_offload.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kSegmentSize = 1000;
+    const uint32_t kFirstSeq = 0x10000;
+
+    uint16_t Checksum(const uint8_t *data, size_t len, uint64_t sum)
+    {
+      for (size_t i = 0; i + 1 < len; i += 2)
+      {
+        sum += LoadBe16(data + i);
+      }
+      if (len % 2)
+      {
+        sum += static_cast<uint64_t>(data[len - 1]) << 8;
+      }
+      while (sum >> 16)
+      {
+        sum = (sum & 0xffff) + (sum >> 16);
+      }
+      return static_cast<uint16_t>(~sum);
+    }
+
+    // Segment |index| of an IPv4 TCP flow from 10.0.0.1:1000 to
+    // 10.0.0.2:2000, ACK only, with valid checksums.
+    std::vector<uint8_t> MakeSegment(size_t index, size_t payload_len = kSegmentSize, uint16_t window = 512)
+    {
+      std::vector<uint8_t> packet(40 + payload_len);
+      uint8_t *ip = packet.data();
+      uint8_t *tcp = ip + 20;
+      ip[0] = 0x45;
+      StoreBe16(ip + 2, static_cast<uint16_t>(packet.size()));
+      StoreBe16(ip + 4, static_cast<uint16_t>(100 + index));
+      ip[6] = 0x40;
+      ip[8] = 64;
+      ip[9] = 6;
+      ip[12] = 10;
+      ip[15] = 1;
+      ip[16] = 10;
+      ip[19] = 2;
+      StoreBe16(ip + 10, Checksum(ip, 20, 0));
+      StoreBe16(tcp, 1000);
+      StoreBe16(tcp + 2, 2000);
+      StoreBe32(tcp + 4, kFirstSeq + static_cast<uint32_t>(index * kSegmentSize));
+      StoreBe32(tcp + 8, 77);
+      tcp[12] = 5 << 4;
+      tcp[13] = 0x10;
+      StoreBe16(tcp + 14, window);
+      for (size_t i = 0; i < payload_len; i++)
+      {
+        tcp[20 + i] = static_cast<uint8_t>(index * 3 + i);
+      }
+      size_t tcp_len = packet.size() - 20;
+      uint64_t pseudo = LoadBe16(ip + 12) + LoadBe16(ip + 14) + LoadBe16(ip + 16) + LoadBe16(ip + 18) + 6 + tcp_len;
+      StoreBe16(tcp + 16, Checksum(tcp, tcp_len, pseudo));
+      return packet;
+    }
+
+    VirtioNetHeader HeaderOf(const PacketSpan &packet)
+    {
+      VirtioNetHeader header;
+      memcpy(&header, packet.data, sizeof(header));
+      return header;
+    }
+
+    std::string Hex(const uint8_t *data, size_t len) { return test::ToHex(data, len); }
+
+  } // namespace
+
+  // Consecutive segments become one super-packet, which the segmenter cuts
+  // back into the original packets, checksums and IP IDs included.
+  TEST(tun_offload, CoalesceAndSplitRoundTrip)
+  {
+    TunCoalescer coalescer;
+    std::vector<std::vector<uint8_t>> segments;
+    for (size_t i = 0; i < 10; i++)
+    {
+      segments.push_back(MakeSegment(i, i == 9 ? 400 : kSegmentSize));
+      EXPECT_TRUE(coalescer.Add(segments.back().data(), segments.back().size()));
+    }
+    const std::vector<PacketSpan> &packets = coalescer.Packets();
+    ASSERT_EQ(packets.size(), static_cast<size_t>(1));
+    VirtioNetHeader header = HeaderOf(packets[0]);
+    EXPECT_EQ(header.gso_type, 1);
+    EXPECT_EQ(header.gso_size, kSegmentSize);
+    EXPECT_EQ(header.hdr_len, 40);
+    EXPECT_EQ(packets[0].len, kVirtioNetHeaderSize + 40 + 9 * kSegmentSize + 400);
+
+    std::vector<uint8_t> buffer(packets[0].data, packets[0].data + packets[0].len);
+    TunSegmenter segmenter;
+    const std::vector<PacketSpan> &split = segmenter.Split(buffer.data(), buffer.size());
+    ASSERT_EQ(split.size(), segments.size());
+    for (size_t i = 0; i < split.size(); i++)
+    {
+      EXPECT_EQ(Hex(split[i].data, split[i].len), Hex(segments[i].data(), segments[i].size()));
+    }
+  }
+
+  // A segment that fails its checksum goes up alone with no offload flags,
+  // so the kernel drops it, and it ends the run before it.
+  TEST(tun_offload, CorruptSegmentIsNotMerged)
+  {
+    for (size_t corrupt_byte : {10, 24, 100})
+    {
+      TunCoalescer coalescer;
+      for (size_t i = 0; i < 6; i++)
+      {
+        std::vector<uint8_t> segment = MakeSegment(i);
+        if (i == 3)
+        {
+          segment[corrupt_byte] ^= 0x40;
+        }
+        EXPECT_TRUE(coalescer.Add(segment.data(), segment.size()));
+      }
+      const std::vector<PacketSpan> &packets = coalescer.Packets();
+      ASSERT_EQ(packets.size(), static_cast<size_t>(3));
+      EXPECT_EQ(packets[0].len, kVirtioNetHeaderSize + 40 + 3 * kSegmentSize);
+      EXPECT_EQ(packets[1].len, kVirtioNetHeaderSize + 40 + kSegmentSize);
+      EXPECT_EQ(HeaderOf(packets[1]).gso_type, 0);
+      EXPECT_EQ(HeaderOf(packets[1]).flags, 0);
+      EXPECT_EQ(packets[2].len, kVirtioNetHeaderSize + 40 + 2 * kSegmentSize);
+    }
+  }
+
+  // The kernel would give every segment of a super-packet the first one's
+  // window, so a window update starts a new one.
+  TEST(tun_offload, WindowChangeStartsNewSuperPacket)
+  {
+    TunCoalescer coalescer;
+    for (size_t i = 0; i < 8; i++)
+    {
+      std::vector<uint8_t> segment = MakeSegment(i, kSegmentSize, i < 5 ? 512 : 1024);
+      EXPECT_TRUE(coalescer.Add(segment.data(), segment.size()));
+    }
+    const std::vector<PacketSpan> &packets = coalescer.Packets();
+    ASSERT_EQ(packets.size(), static_cast<size_t>(2));
+    EXPECT_EQ(packets[0].len, kVirtioNetHeaderSize + 40 + 5 * kSegmentSize);
+    EXPECT_EQ(packets[1].len, kVirtioNetHeaderSize + 40 + 3 * kSegmentSize);
+    EXPECT_EQ(LoadBe16(packets[1].data + kVirtioNetHeaderSize + 34), 1024);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,131 @@
+// Loopback UDP packets per second and system calls per packet: one
+// sendto/recvfrom per datagram, against sendmmsg/recvmmsg batches, against
+// batches with GSO and GRO.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <vector>
+
+#include "benchmark.h"
+#include "udp_batch.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kDatagramLength = 1420;
+
+    // A non-blocking UDP socket bound to an ephemeral port on 127.0.0.1.
+    int BindLoopback(struct sockaddr_storage *address, socklen_t *address_len)
+    {
+      int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      struct sockaddr_in sin = {};
+      sin.sin_family = AF_INET;
+      sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      bind(fd, reinterpret_cast<struct sockaddr *>(&sin), sizeof(sin));
+      *address_len = sizeof(*address);
+      getsockname(fd, reinterpret_cast<struct sockaddr *>(address), address_len);
+      return fd;
+    }
+
+    enum class Mode
+    {
+      kSingle,
+      kBatched,
+      kOffloaded,
+    };
+
+    // Sends kUdpBatchSize datagrams and reads them back, over and over for
+    // half a second, counting the send, receive and poll calls made.
+    void Run(const char *name, Mode mode)
+    {
+      struct sockaddr_storage receiver_address, sender_address;
+      socklen_t receiver_len, sender_len;
+      int receiver_fd = BindLoopback(&receiver_address, &receiver_len);
+      int sender_fd = BindLoopback(&sender_address, &sender_len);
+      std::atomic<bool> gso{false};
+      if (mode == Mode::kOffloaded)
+      {
+        UdpOffloads offloads = EnableUdpOffloads(receiver_fd);
+        gso = EnableUdpOffloads(sender_fd).gso;
+        if (!gso || !offloads.gro)
+        {
+          printf("%-10s GSO or GRO unavailable\n", name);
+          close(receiver_fd);
+          close(sender_fd);
+          return;
+        }
+      }
+
+      std::vector<uint8_t> payload(kDatagramLength, 0x5a), buffer(kUdpReceiveBufferSize);
+      std::vector<OutgoingDatagram> datagrams(kUdpBatchSize,
+                                              {payload.data(), payload.size(), &receiver_address, receiver_len});
+      UdpReceiver receiver;
+      uint64_t packets = 0, syscalls = 0;
+      const double start = benchmark::Now();
+      const double end = start + 0.5;
+      while (benchmark::Now() < end)
+      {
+        size_t sent = 0, received = 0;
+        if (mode == Mode::kSingle)
+        {
+          for (; sent < kUdpBatchSize; sent++, syscalls++)
+          {
+            sendto(sender_fd, payload.data(), payload.size(), 0, reinterpret_cast<struct sockaddr *>(&receiver_address),
+                   receiver_len);
+          }
+        }
+        else
+        {
+          sent = SendDatagrams(sender_fd, datagrams.data(), datagrams.size(), &gso);
+          syscalls++;
+        }
+        while (received < sent)
+        {
+          size_t got = 0;
+          if (mode == Mode::kSingle)
+          {
+            got = recv(receiver_fd, buffer.data(), buffer.size(), 0) > 0 ? 1 : 0;
+          }
+          else
+          {
+            got = receiver.Receive(receiver_fd).size();
+          }
+          syscalls++;
+          if (got == 0)
+          {
+            struct pollfd p = {receiver_fd, POLLIN, 0};
+            syscalls++;
+            if (poll(&p, 1, 100) <= 0)
+            {
+              break;
+            }
+          }
+          received += got;
+        }
+        packets += received;
+      }
+      double elapsed = benchmark::Now() - start;
+      printf("%-10s %9.0f packets/s  %6.3f syscalls/packet\n", name, packets / elapsed,
+             static_cast<double>(syscalls) / packets);
+      close(receiver_fd);
+      close(sender_fd);
+    }
+
+  } // namespace
+
+  BENCHMARK(udp_batch)
+  {
+    Run("single", Mode::kSingle);
+    Run("batched", Mode::kBatched);
+    Run("gso+gro", Mode::kOffloaded);
+  }
+
+} // namespace wireguard_flutter
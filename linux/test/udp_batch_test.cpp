@@ -0,0 +1,144 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+#include "test.h"
+#include "udp_batch.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // A non-blocking UDP socket bound to an ephemeral port on 127.0.0.1.
+    int BindLoopback(struct sockaddr_storage *address, socklen_t *address_len)
+    {
+      int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      struct sockaddr_in sin = {};
+      sin.sin_family = AF_INET;
+      sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      bind(fd, reinterpret_cast<struct sockaddr *>(&sin), sizeof(sin));
+      *address_len = sizeof(*address);
+      getsockname(fd, reinterpret_cast<struct sockaddr *>(address), address_len);
+      return fd;
+    }
+
+    // Receives until |count| datagrams arrived or nothing came for a second.
+    std::vector<std::vector<uint8_t>> ReceiveAll(int fd, UdpReceiver *receiver, size_t count,
+                                                 std::vector<uint16_t> *ports)
+    {
+      std::vector<std::vector<uint8_t>> received;
+      while (received.size() < count)
+      {
+        struct pollfd p = {fd, POLLIN, 0};
+        if (poll(&p, 1, 1000) <= 0)
+        {
+          break;
+        }
+        for (const ReceivedDatagram &datagram : receiver->Receive(fd))
+        {
+          received.emplace_back(datagram.data, datagram.data + datagram.len);
+          ports->push_back(ntohs(reinterpret_cast<const struct sockaddr_in *>(datagram.from)->sin_port));
+        }
+      }
+      return received;
+    }
+
+    // Sends |lens.size()| datagrams, datagram i filled with i, and checks
+    // they all arrive intact, in order and from the sender.
+    void SendAndReceive(const std::vector<size_t> &lens, bool offloads)
+    {
+      struct sockaddr_storage receiver_address, sender_address;
+      socklen_t receiver_len, sender_len;
+      int receiver_fd = BindLoopback(&receiver_address, &receiver_len);
+      int sender_fd = BindLoopback(&sender_address, &sender_len);
+      int buffer = 4 << 20;
+      setsockopt(receiver_fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+      std::atomic<bool> gso{false};
+      if (offloads)
+      {
+        EnableUdpOffloads(receiver_fd);
+        gso = EnableUdpOffloads(sender_fd).gso;
+      }
+
+      std::vector<std::vector<uint8_t>> payloads;
+      std::vector<OutgoingDatagram> datagrams;
+      for (size_t i = 0; i < lens.size(); i++)
+      {
+        payloads.emplace_back(lens[i], static_cast<uint8_t>(i));
+      }
+      for (const std::vector<uint8_t> &payload : payloads)
+      {
+        datagrams.push_back(OutgoingDatagram{payload.data(), payload.size(), &receiver_address, receiver_len});
+      }
+      EXPECT_EQ(SendDatagrams(sender_fd, datagrams.data(), datagrams.size(), &gso), datagrams.size());
+
+      UdpReceiver receiver;
+      std::vector<uint16_t> ports;
+      std::vector<std::vector<uint8_t>> received = ReceiveAll(receiver_fd, &receiver, payloads.size(), &ports);
+      EXPECT_EQ(received.size(), payloads.size());
+      size_t matching = 0;
+      for (size_t i = 0; i < received.size() && i < payloads.size(); i++)
+      {
+        matching += received[i] == payloads[i] &&
+                    ports[i] == ntohs(reinterpret_cast<struct sockaddr_in *>(&sender_address)->sin_port);
+      }
+      EXPECT_EQ(matching, payloads.size());
+      close(sender_fd);
+      close(receiver_fd);
+    }
+
+  } // namespace
+
+  // More datagrams than one sendmmsg batch, of assorted sizes.
+  TEST(udp_batch, SendmmsgRecvmmsg)
+  {
+    std::vector<size_t> lens;
+    for (size_t i = 0; i < 100; i++)
+    {
+      lens.push_back(1 + i * 97 % 1500);
+    }
+    SendAndReceive(lens, false);
+  }
+
+  // Runs of equal sizes with a shorter tail go out as GSO sends and may come
+  // back GRO-coalesced; either way the receiver hands out the datagrams.
+  TEST(udp_batch, GsoGro)
+  {
+    std::vector<size_t> lens;
+    for (size_t run = 0; run < 4; run++)
+    {
+      for (size_t i = 0; i < 40; i++)
+      {
+        lens.push_back(1200);
+      }
+      lens.push_back(300 + run);
+    }
+    SendAndReceive(lens, true);
+  }
+
+  TEST(udp_batch, GroSegmentSize)
+  {
+    alignas(struct cmsghdr) uint8_t control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr header = {};
+    EXPECT_EQ(GroSegmentSize(header, 3000), static_cast<size_t>(3000));
+
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_GRO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    int size = 1200;
+    memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+    EXPECT_EQ(GroSegmentSize(header, 3000), static_cast<size_t>(1200));
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,110 @@
+// Six hours of 10 second samples from 1000 peers, appended as the metrics
+// loop would, then read back: one peer's last hour, its whole history, and
+// its last hour rolled up into minutes. The store lives in a scratch
+// directory under /tmp.
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "benchmark.h"
+#include "usage_store.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kPeers = 1000;
+    const uint64_t kStartMs = 1700000000000;
+    const uint64_t kIntervalMs = 10000;
+    const uint64_t kIntervals = 6 * 360;
+
+    UsageStore::Series Peer(size_t index)
+    {
+      UsageStore::Series series{};
+      series[0] = static_cast<uint8_t>(index);
+      series[1] = static_cast<uint8_t>(index >> 8);
+      series[2] = 1;
+      return series;
+    }
+
+    void RemoveDirectory(const std::string &path)
+    {
+      if (DIR *dir = opendir(path.c_str()))
+      {
+        while (struct dirent *entry = readdir(dir))
+        {
+          if (entry->d_name[0] != '.')
+          {
+            unlink((path + "/" + entry->d_name).c_str());
+          }
+        }
+        closedir(dir);
+      }
+      rmdir(path.c_str());
+    }
+
+  } // namespace
+
+  BENCHMARK(usage_store)
+  {
+    char path[] = "/tmp/usage_store_benchmark.XXXXXX";
+    if (mkdtemp(path) == nullptr)
+    {
+      printf("no scratch directory\n");
+      return;
+    }
+    {
+      UsageStore store(path);
+      std::vector<UsageStore::Series> peers;
+      for (size_t p = 0; p < kPeers; p++)
+      {
+        peers.push_back(Peer(p));
+      }
+      double start = benchmark::Now();
+      for (uint64_t i = 0; i < kIntervals; i++)
+      {
+        for (size_t p = 0; p < kPeers; p++)
+        {
+          UsageSample sample;
+          sample.time_ms = kStartMs + i * kIntervalMs + p;
+          // Busy peers and idle ones.
+          sample.tx_bytes = i * (p % 10 == 0 ? 1250000 : 300 + p);
+          sample.rx_bytes = i * (p % 10 == 0 ? 4000000 : 90);
+          sample.last_handshake_ms = kStartMs + i / 12 * 120000;
+          store.Append(peers[p], sample);
+        }
+      }
+      double elapsed = benchmark::Now() - start;
+      uint64_t samples = kIntervals * kPeers;
+      printf("append %9.0f samples/s  %4.1f bytes/sample on disk  %zu segments\n", samples / elapsed,
+             static_cast<double>(store.segments() * UsageStore::kSegmentSize) / samples, store.segments());
+      start = benchmark::Now();
+      store.Sync();
+      printf("sync   %9.1f ms\n", (benchmark::Now() - start) * 1e3);
+
+      const uint64_t end_ms = kStartMs + kIntervals * kIntervalMs;
+      const uint64_t hour_ms = 3600000;
+      size_t returned = 0;
+      double rate = benchmark::CallsPerSecond([&]
+                                              { returned = store.Samples(peers[17], end_ms - hour_ms, end_ms).size(); },
+                                              0.5, 1);
+      printf("last hour      %8.1f queries/s  %zu samples\n", rate, returned);
+      rate = benchmark::CallsPerSecond([&]
+                                       { returned = store.Samples(peers[17], 0, UINT64_MAX).size(); },
+                                       0.5, 1);
+      printf("whole history  %8.1f queries/s  %zu samples\n", rate, returned);
+      rate = benchmark::CallsPerSecond([&]
+                                       { returned = store.Rollup(peers[17], end_ms - hour_ms, end_ms, 60000).size(); },
+                                       0.5, 1);
+      printf("hour rollup    %8.1f queries/s  %zu steps\n", rate, returned);
+    }
+    RemoveDirectory(path);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,454 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "test.h"
+#include "usage_store.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Where the segment layout puts the committed byte count and the data,
+    // for tearing records as a crash would.
+    const off_t kCommittedOffset = 16;
+    const off_t kDataOffset = 8192;
+
+    // A scratch directory, removed with the store's files in it.
+    class TempDirectory
+    {
+    public:
+      TempDirectory()
+      {
+        char path[] = "/tmp/usage_store_test.XXXXXX";
+        ASSERT_TRUE(mkdtemp(path) != nullptr);
+        path_ = path;
+      }
+
+      ~TempDirectory()
+      {
+        if (DIR *dir = opendir(path_.c_str()))
+        {
+          while (struct dirent *entry = readdir(dir))
+          {
+            if (entry->d_name[0] != '.')
+            {
+              unlink((path_ + "/" + entry->d_name).c_str());
+            }
+          }
+          closedir(dir);
+        }
+        rmdir(path_.c_str());
+      }
+
+      const std::string &path() const { return path_; }
+      std::string File(const std::string &name) const { return path_ + "/" + name; }
+
+    private:
+      std::string path_;
+    };
+
+    const size_t kSeries = 3;
+
+    UsageStore::Series SeriesKey(size_t index)
+    {
+      UsageStore::Series series{};
+      series[0] = static_cast<uint8_t>(index + 1);
+      return series;
+    }
+
+    // The |index|th sample appended, to series index % kSeries.
+    UsageSample Expected(uint64_t index)
+    {
+      UsageSample sample;
+      sample.time_ms = 1000000 + index * 10;
+      sample.tx_bytes = index * 1500;
+      sample.rx_bytes = index * 700 + 3;
+      sample.last_handshake_ms = 1000000 + index / 120 * 1200;
+      return sample;
+    }
+
+    void AppendExpected(UsageStore *store, uint64_t index)
+    {
+      store->Append(SeriesKey(index % kSeries), Expected(index));
+    }
+
+    bool Equal(const UsageSample &a, const UsageSample &b)
+    {
+      return a.time_ms == b.time_ms && a.tx_bytes == b.tx_bytes && a.rx_bytes == b.rx_bytes &&
+             a.last_handshake_ms == b.last_handshake_ms;
+    }
+
+    // Reads every series back and checks the store holds exactly the first
+    // samples appended, with none skipped or damaged. Returns how many.
+    uint64_t CheckPrefix(UsageStore *store)
+    {
+      uint64_t total = 0;
+      std::vector<size_t> counts;
+      for (size_t s = 0; s < kSeries; s++)
+      {
+        std::vector<UsageSample> samples = store->Samples(SeriesKey(s), 0, UINT64_MAX);
+        for (size_t j = 0; j < samples.size(); j++)
+        {
+          ASSERT_TRUE(Equal(samples[j], Expected(s + j * kSeries)));
+        }
+        counts.push_back(samples.size());
+        total += samples.size();
+      }
+      // Samples go to the series in turn, so a prefix leaves the earlier
+      // series at most one ahead.
+      for (size_t s = 1; s < kSeries; s++)
+      {
+        EXPECT_TRUE(counts[s] <= counts[s - 1] && counts[s] + 1 >= counts[0]);
+      }
+      return total;
+    }
+
+    uint64_t Committed(const std::string &segment)
+    {
+      int fd = open(segment.c_str(), O_RDONLY);
+      uint64_t committed = 0;
+      EXPECT_EQ(pread(fd, &committed, sizeof(committed), kCommittedOffset), static_cast<ssize_t>(sizeof(committed)));
+      close(fd);
+      return committed;
+    }
+
+    // Writes |bytes| after the committed records of |segment| and moves the
+    // count past them, as if a crash tore the record being written.
+    void TearRecord(const std::string &segment, const std::vector<uint8_t> &bytes)
+    {
+      uint64_t committed = Committed(segment);
+      int fd = open(segment.c_str(), O_RDWR);
+      ASSERT_EQ(pwrite(fd, bytes.data(), bytes.size(), kDataOffset + static_cast<off_t>(committed)),
+                static_cast<ssize_t>(bytes.size()));
+      committed += bytes.size();
+      ASSERT_EQ(pwrite(fd, &committed, sizeof(committed), kCommittedOffset), static_cast<ssize_t>(sizeof(committed)));
+      close(fd);
+    }
+
+    std::string FirstSegment(const TempDirectory &dir)
+    {
+      return dir.File("usage-0000000000000000.seg");
+    }
+
+    // Appends the expected samples until the store has |segments| segments
+    // and the last holds a few blocks. Returns how many were appended.
+    uint64_t FillSegments(UsageStore *store, size_t segments)
+    {
+      uint64_t count = 0;
+      while (store->segments() < segments)
+      {
+        AppendExpected(store, count++);
+      }
+      for (uint64_t end = count * 11 / 10; count < end; count++)
+      {
+        AppendExpected(store, count);
+      }
+      return count;
+    }
+
+    size_t SegmentFiles(const TempDirectory &dir)
+    {
+      size_t files = 0;
+      if (DIR *directory = opendir(dir.path().c_str()))
+      {
+        while (struct dirent *entry = readdir(directory))
+        {
+          files += strstr(entry->d_name, ".seg") != nullptr;
+        }
+        closedir(directory);
+      }
+      return files;
+    }
+
+  } // namespace
+
+  // A writer killed mid-stream, never having synced, leaves the samples it
+  // appended before the kill, all of them intact, and the store takes new
+  // ones after reopening.
+  TEST(usage_store, RecoversAfterKill)
+  {
+    TempDirectory dir;
+    int ready[2];
+    ASSERT_EQ(pipe(ready), 0);
+    pid_t child = fork();
+    ASSERT_TRUE(child >= 0);
+    if (child == 0)
+    {
+      close(ready[0]);
+      UsageStore store(dir.path());
+      // Enough to fill several segments before the kill lands.
+      for (uint64_t i = 0; i < 2000000; i++)
+      {
+        AppendExpected(&store, i);
+        if (i == 100000)
+        {
+          (void)!write(ready[1], "r", 1);
+        }
+      }
+      pause();
+      _exit(0);
+    }
+    close(ready[1]);
+    char byte;
+    ASSERT_EQ(read(ready[0], &byte, 1), 1);
+    close(ready[0]);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    kill(child, SIGKILL);
+    int status;
+    waitpid(child, &status, 0);
+    EXPECT_TRUE(WIFSIGNALED(status));
+
+    UsageStore store(dir.path());
+    uint64_t kept = CheckPrefix(&store);
+    EXPECT_TRUE(kept > 100000);
+    EXPECT_TRUE(store.segments() > 1);
+    for (uint64_t i = kept; i < kept + 1000; i++)
+    {
+      AppendExpected(&store, i);
+    }
+    EXPECT_EQ(CheckPrefix(&store), kept + 1000);
+  }
+
+  // A record torn by a crash is dropped on reopening, whether it stops
+  // partway through or names a series whose key never reached the disk, and
+  // new records go where it was.
+  TEST(usage_store, DropsTornRecords)
+  {
+    TempDirectory dir;
+    {
+      UsageStore store(dir.path());
+      for (uint64_t i = 0; i < 1000; i++)
+      {
+        AppendExpected(&store, i);
+      }
+      store.Sync();
+    }
+    uint64_t committed = Committed(FirstSegment(dir));
+
+    // Cut off inside a varint.
+    TearRecord(FirstSegment(dir), {0x01, 0x94, 0x80, 0x80});
+    {
+      UsageStore store(dir.path());
+      EXPECT_EQ(CheckPrefix(&store), static_cast<uint64_t>(1000));
+    }
+    EXPECT_EQ(Committed(FirstSegment(dir)), committed);
+
+    // Whole, but for a series id past the series file.
+    TearRecord(FirstSegment(dir), {static_cast<uint8_t>(kSeries + 2), 0x14, 0x02, 0x02, 0x00});
+    {
+      UsageStore store(dir.path());
+      EXPECT_EQ(CheckPrefix(&store), static_cast<uint64_t>(1000));
+      for (uint64_t i = 1000; i < 1100; i++)
+      {
+        AppendExpected(&store, i);
+      }
+    }
+    UsageStore store(dir.path());
+    EXPECT_EQ(CheckPrefix(&store), static_cast<uint64_t>(1100));
+  }
+
+  // A series key torn at the end of the series file, and segments a crash
+  // left unsized or without a header, are dropped on reopening.
+  TEST(usage_store, DropsTornFiles)
+  {
+    TempDirectory dir;
+    {
+      UsageStore store(dir.path());
+      for (uint64_t i = 0; i < 300; i++)
+      {
+        AppendExpected(&store, i);
+      }
+    }
+    int fd = open(dir.File("series").c_str(), O_WRONLY | O_APPEND);
+    ASSERT_EQ(write(fd, "torn key", 8), 8);
+    close(fd);
+    fd = open(dir.File("usage-0000000000000001.seg").c_str(), O_RDWR | O_CREAT, 0600);
+    close(fd);
+    {
+      UsageStore store(dir.path());
+      EXPECT_EQ(store.segments(), static_cast<size_t>(1));
+      EXPECT_EQ(CheckPrefix(&store), static_cast<uint64_t>(300));
+      store.Append(SeriesKey(7), Expected(300));
+      EXPECT_EQ(store.Samples(SeriesKey(7), 0, UINT64_MAX).size(), static_cast<size_t>(1));
+    }
+    EXPECT_EQ(access(dir.File("usage-0000000000000001.seg").c_str(), F_OK), -1);
+
+    // Sized, but the header never written.
+    fd = open(dir.File("usage-0000000000000001.seg").c_str(), O_RDWR | O_CREAT, 0600);
+    ASSERT_EQ(ftruncate(fd, UsageStore::kSegmentSize), 0);
+    close(fd);
+    UsageStore store(dir.path());
+    EXPECT_EQ(store.segments(), static_cast<size_t>(1));
+    EXPECT_EQ(store.Samples(SeriesKey(7), 0, UINT64_MAX).size(), static_cast<size_t>(1));
+  }
+
+  // Damage a crash cannot cause is an error, not something to repair.
+  TEST(usage_store, RejectsForeignSegments)
+  {
+    TempDirectory dir;
+    {
+      UsageStore store(dir.path());
+      AppendExpected(&store, 0);
+    }
+    int fd = open(FirstSegment(dir).c_str(), O_RDWR);
+    ASSERT_EQ(pwrite(fd, "NOTUSAGE", 8, 0), 8);
+    close(fd);
+    bool thrown = false;
+    try
+    {
+      UsageStore store(dir.path());
+    }
+    catch (const std::runtime_error &)
+    {
+      thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+  }
+
+  // A bounded range returns exactly the samples in it, from <= time < to,
+  // wherever it starts and ends among the segments and their blocks.
+  TEST(usage_store, SamplesAcrossSegments)
+  {
+    TempDirectory dir;
+    UsageStore store(dir.path());
+    uint64_t count = FillSegments(&store, 4);
+    // In indexes of the samples appended: everything, most, a single
+    // sample, none, past the end, and ranges a quarter of the store long
+    // starting all through it, which cross segment boundaries.
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    ranges.emplace_back(0, count);
+    ranges.emplace_back(1, count - 1);
+    ranges.emplace_back(count / 3, count / 3 + 1);
+    ranges.emplace_back(7, 7);
+    ranges.emplace_back(count, count + 50);
+    for (uint64_t i = 1; i < 12; i++)
+    {
+      uint64_t from = count * i / 13;
+      ranges.emplace_back(from - 3, from + count / 4 + 5);
+    }
+    for (const auto &range : ranges)
+    {
+      uint64_t from_ms = Expected(range.first).time_ms, to_ms = Expected(range.second).time_ms;
+      for (size_t s = 0; s < kSeries; s++)
+      {
+        std::vector<UsageSample> samples = store.Samples(SeriesKey(s), from_ms, to_ms);
+        uint64_t first = range.first + (kSeries + s - range.first % kSeries) % kSeries;
+        size_t expected = 0;
+        for (uint64_t i = first; i < std::min(range.second, count); i += kSeries)
+        {
+          ASSERT_TRUE(expected < samples.size());
+          ASSERT_TRUE(Equal(samples[expected], Expected(i)));
+          expected++;
+        }
+        EXPECT_EQ(samples.size(), expected);
+      }
+    }
+  }
+
+  // Rollups downsample a series into steps, counting what the counters
+  // gained into the step of the later sample, and what a counter reset to
+  // as its gain.
+  TEST(usage_store, RollupAcrossCounterResets)
+  {
+    TempDirectory dir;
+    UsageStore store(dir.path());
+    const uint64_t kStart = 1700000000000;
+    // A sample every 10 seconds for an hour; the peer is re-added at sample
+    // 100 and its counters start again from 500 bytes.
+    for (uint64_t i = 0; i < 360; i++)
+    {
+      UsageSample sample;
+      sample.time_ms = kStart + i * 10000;
+      sample.tx_bytes = i < 100 ? i * 1000 : 500 + (i - 100) * 1000;
+      sample.rx_bytes = 2 * sample.tx_bytes;
+      sample.last_handshake_ms = kStart + i / 12 * 120000;
+      store.Append(SeriesKey(0), sample);
+    }
+
+    std::vector<UsageRollup> minutes = store.Rollup(SeriesKey(0), kStart, kStart + 3600000, 60000);
+    ASSERT_EQ(minutes.size(), static_cast<size_t>(60));
+    uint64_t total = 0;
+    for (size_t k = 0; k < minutes.size(); k++)
+    {
+      EXPECT_EQ(minutes[k].start_ms, kStart + k * 60000);
+      EXPECT_EQ(minutes[k].samples, 6u);
+      EXPECT_EQ(minutes[k].rx_bytes, 2 * minutes[k].tx_bytes);
+      EXPECT_EQ(minutes[k].last_handshake_ms, kStart + (6 * k + 5) / 12 * 120000);
+      total += minutes[k].tx_bytes;
+    }
+    // The first sample has nothing before it.
+    EXPECT_EQ(minutes[0].tx_bytes, static_cast<uint64_t>(5000));
+    EXPECT_EQ(minutes[1].tx_bytes, static_cast<uint64_t>(6000));
+    // Samples 96 to 101: four gains, the reset to 500 and one more gain.
+    EXPECT_EQ(minutes[16].tx_bytes, static_cast<uint64_t>(5500));
+    EXPECT_EQ(total, static_cast<uint64_t>(359 * 1000 - 1000 + 500));
+
+    // A range off the step grid, ending in a partial step, starts counting
+    // at its own first sample.
+    std::vector<UsageRollup> part = store.Rollup(SeriesKey(0), kStart + 30000, kStart + 155000, 60000);
+    ASSERT_EQ(part.size(), static_cast<size_t>(3));
+    EXPECT_EQ(part[0].tx_bytes, static_cast<uint64_t>(5000));
+    EXPECT_EQ(part[1].tx_bytes, static_cast<uint64_t>(6000));
+    EXPECT_EQ(part[2].samples, 1u);
+    EXPECT_EQ(part[2].tx_bytes, static_cast<uint64_t>(1000));
+
+    EXPECT_EQ(store.Rollup(SeriesKey(0), kStart, kStart + 3600000, 0).size(), static_cast<size_t>(0));
+    EXPECT_EQ(store.Rollup(SeriesKey(1), kStart, kStart + 3600000, 60000).size(), static_cast<size_t>(0));
+  }
+
+  // Pruning deletes only segments with nothing at or after the cutoff,
+  // never the one being appended to, and the store reopens without them.
+  TEST(usage_store, PruneDropsOldSegments)
+  {
+    TempDirectory dir;
+    uint64_t count, middle_ms;
+    size_t kept;
+    {
+      UsageStore store(dir.path());
+      count = FillSegments(&store, 4);
+      size_t segments = store.segments();
+
+      store.Prune(Expected(0).time_ms);
+      EXPECT_EQ(store.segments(), segments);
+
+      middle_ms = Expected(count / 2).time_ms;
+      store.Prune(middle_ms);
+      kept = store.segments();
+      EXPECT_TRUE(kept < segments && kept > 1);
+      EXPECT_EQ(SegmentFiles(dir), kept);
+      for (size_t s = 0; s < kSeries; s++)
+      {
+        std::vector<UsageSample> samples = store.Samples(SeriesKey(s), 0, UINT64_MAX);
+        ASSERT_TRUE(!samples.empty());
+        EXPECT_TRUE(samples.front().time_ms > Expected(0).time_ms && samples.front().time_ms <= middle_ms);
+        EXPECT_TRUE(Equal(samples.back(), Expected(count - 1 - (count - 1 - s) % kSeries)));
+      }
+    }
+
+    UsageStore store(dir.path());
+    EXPECT_EQ(store.segments(), kept);
+    std::vector<UsageSample> samples = store.Samples(SeriesKey(0), middle_ms, UINT64_MAX);
+    EXPECT_EQ(samples.size(), static_cast<size_t>((count - count / 2 + kSeries - 1) / kSeries));
+    store.Prune(UINT64_MAX);
+    EXPECT_EQ(store.segments(), static_cast<size_t>(1));
+    EXPECT_EQ(SegmentFiles(dir), static_cast<size_t>(1));
+    AppendExpected(&store, count);
+    EXPECT_TRUE(Equal(store.Samples(SeriesKey(count % kSeries), 0, UINT64_MAX).back(), Expected(count)));
+  }
+
+} // namespace wireguard_flutter
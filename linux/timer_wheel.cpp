@@ -0,0 +1,248 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Level of timers detached from their slot and about to fire.
+    const uint8_t kExpiredLevel = 0xff;
+
+    // Distance from |from| to the next set bit of a cyclic bitmap of
+    // |slots| bits, or |slots| if none is set.
+    size_t NextOccupied(const uint64_t *bits, size_t slots, size_t from)
+    {
+      for (size_t distance = 0; distance < slots;)
+      {
+        size_t slot = (from + distance) % slots;
+        uint64_t word = bits[slot / 64] >> (slot % 64);
+        if (word != 0)
+        {
+          return distance + __builtin_ctzll(word);
+        }
+        distance += 64 - slot % 64;
+      }
+      return slots;
+    }
+
+  } // namespace
+
+  constexpr std::chrono::milliseconds TimerWheel::kDefaultTick;
+
+  Timer::~Timer()
+  {
+    if (wheel_ != nullptr)
+    {
+      wheel_->Cancel(this);
+    }
+  }
+
+  TimerWheel::TimerWheel(Clock::time_point start, std::chrono::nanoseconds tick) : start_(start), tick_(tick) {}
+
+  TimerWheel::~TimerWheel()
+  {
+    // Leave the timers disarmed rather than pointing at a dead wheel.
+    for (auto &level : slots_)
+    {
+      for (Timer *head : level)
+      {
+        for (Timer *timer = head; timer != nullptr; timer = timer->next_)
+        {
+          timer->wheel_ = nullptr;
+        }
+      }
+    }
+  }
+
+  void TimerWheel::Arm(Timer *timer, Clock::time_point deadline)
+  {
+    const uint64_t kReach = (uint64_t(1) << Shift(kLevels)) - 1;
+    uint64_t expires = 0;
+    if (deadline > start_)
+    {
+      auto delta = deadline - start_;
+      expires = static_cast<uint64_t>(delta / tick_) + (delta % tick_ != delta.zero() ? 1 : 0);
+    }
+    expires = std::min(std::max(expires, now_), now_ + kReach);
+
+    if (timer->wheel_ == this)
+    {
+      // Keepalives get pushed back on every packet; most of the time the
+      // deadline has not moved by a whole tick.
+      if (timer->expires_ == expires && timer->level_ != kExpiredLevel)
+      {
+        return;
+      }
+      Unlink(timer);
+    }
+    else
+    {
+      if (timer->wheel_ != nullptr)
+      {
+        timer->wheel_->Cancel(timer);
+      }
+      timer->wheel_ = this;
+      size_++;
+    }
+    timer->expires_ = expires;
+    Link(timer);
+  }
+
+  void TimerWheel::Cancel(Timer *timer)
+  {
+    if (timer->wheel_ != this)
+    {
+      return;
+    }
+    Unlink(timer);
+    timer->wheel_ = nullptr;
+    size_--;
+  }
+
+  void TimerWheel::Advance(Clock::time_point now)
+  {
+    if (now < start_)
+    {
+      return;
+    }
+    uint64_t target = static_cast<uint64_t>((now - start_) / tick_);
+    while (now_ <= target)
+    {
+      if (size_ == 0)
+      {
+        // Nothing to cascade or fire; catch up in one step.
+        now_ = target + 1;
+        break;
+      }
+      RunTick();
+    }
+  }
+
+  TimerWheel::Clock::time_point TimerWheel::NextDeadline() const
+  {
+    if (size_ == 0)
+    {
+      return Clock::time_point::max();
+    }
+    uint64_t next = NextOccupied(occupied_[0], kLevel0Slots, now_ % kLevel0Slots) + now_;
+    for (int level = 1; level < kLevels; level++)
+    {
+      // Slot s of this level moves down when block s of the level's span
+      // begins; the current block already has unless we sit on its start.
+      uint64_t span = uint64_t(1) << Shift(level);
+      uint64_t block = now_ >> Shift(level);
+      if (now_ % span != 0)
+      {
+        block++;
+      }
+      size_t distance = NextOccupied(occupied_[level], kLevelSlots, block % kLevelSlots);
+      if (distance < kLevelSlots)
+      {
+        next = std::min(next, (block + distance) << Shift(level));
+      }
+    }
+    return start_ + std::chrono::duration_cast<Clock::duration>(tick_ * next);
+  }
+
+  void TimerWheel::Link(Timer *timer)
+  {
+    uint64_t delta = timer->expires_ - now_;
+    int level = 0;
+    while (level + 1 < kLevels && delta >= (uint64_t(1) << Shift(level + 1)))
+    {
+      level++;
+    }
+    size_t slot = (timer->expires_ >> Shift(level)) % Slots(level);
+    timer->level_ = static_cast<uint8_t>(level);
+    timer->slot_ = static_cast<uint8_t>(slot);
+    timer->prev_ = nullptr;
+    timer->next_ = slots_[level][slot];
+    if (timer->next_ != nullptr)
+    {
+      timer->next_->prev_ = timer;
+    }
+    slots_[level][slot] = timer;
+    occupied_[level][slot / 64] |= uint64_t(1) << (slot % 64);
+  }
+
+  void TimerWheel::Unlink(Timer *timer)
+  {
+    Timer **head = timer->level_ == kExpiredLevel ? &expired_ : &slots_[timer->level_][timer->slot_];
+    if (timer->prev_ != nullptr)
+    {
+      timer->prev_->next_ = timer->next_;
+    }
+    else
+    {
+      *head = timer->next_;
+    }
+    if (timer->next_ != nullptr)
+    {
+      timer->next_->prev_ = timer->prev_;
+    }
+    if (*head == nullptr && timer->level_ != kExpiredLevel)
+    {
+      occupied_[timer->level_][timer->slot_ / 64] &= ~(uint64_t(1) << (timer->slot_ % 64));
+    }
+    timer->prev_ = nullptr;
+    timer->next_ = nullptr;
+  }
+
+  void TimerWheel::Cascade(int level)
+  {
+    size_t slot = (now_ >> Shift(level)) % Slots(level);
+    Timer *timer = slots_[level][slot];
+    slots_[level][slot] = nullptr;
+    occupied_[level][slot / 64] &= ~(uint64_t(1) << (slot % 64));
+    while (timer != nullptr)
+    {
+      Timer *next = timer->next_;
+      Link(timer);
+      timer = next;
+    }
+  }
+
+  void TimerWheel::RunTick()
+  {
+    size_t slot = now_ % kLevel0Slots;
+    if (slot == 0)
+    {
+      for (int level = 1; level < kLevels; level++)
+      {
+        Cascade(level);
+        if ((now_ >> Shift(level)) % Slots(level) != 0)
+        {
+          break;
+        }
+      }
+    }
+
+    // Detach the slot before firing anything: callbacks may cancel timers
+    // that are still waiting their turn, or arm new ones for the next
+    // turn of this very slot.
+    expired_ = slots_[0][slot];
+    slots_[0][slot] = nullptr;
+    occupied_[0][slot / 64] &= ~(uint64_t(1) << (slot % 64));
+    for (Timer *timer = expired_; timer != nullptr; timer = timer->next_)
+    {
+      timer->level_ = kExpiredLevel;
+    }
+    now_++;
+
+    while (expired_ != nullptr)
+    {
+      Timer *timer = expired_;
+      Unlink(timer);
+      timer->wheel_ = nullptr;
+      size_--;
+      if (timer->callback_)
+      {
+        timer->callback_();
+      }
+    }
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,106 @@
+#ifndef WIREGUARD_FLUTTER_TIMER_WHEEL_H
+#define WIREGUARD_FLUTTER_TIMER_WHEEL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace wireguard_flutter {
+
+class TimerWheel;
+
+// A timer owned by whoever embeds it. Arming, re-arming and cancelling go
+// through the wheel and are O(1); destroying an armed timer cancels it.
+class Timer {
+ public:
+  Timer() = default;
+  explicit Timer(std::function<void()> callback) : callback_(std::move(callback)) {}
+  ~Timer();
+
+  Timer(const Timer &) = delete;
+  Timer &operator=(const Timer &) = delete;
+
+  void set_callback(std::function<void()> callback) { callback_ = std::move(callback); }
+  bool armed() const { return wheel_ != nullptr; }
+
+ private:
+  friend class TimerWheel;
+
+  std::function<void()> callback_;
+  TimerWheel *wheel_ = nullptr;
+  Timer *prev_ = nullptr;
+  Timer *next_ = nullptr;
+  uint64_t expires_ = 0;
+  uint8_t level_ = 0;
+  uint8_t slot_ = 0;
+};
+
+// Hierarchical timer wheel in the style of the kernel's classic one: 256
+// one-tick slots, then three levels of 64 slots, each slot of a level
+// spanning a whole turn of the level below. Timers move down a level when
+// their slot comes up, so arming and expiring never look at more than one
+// slot, however many timers there are.
+//
+// The wheel has no thread of its own and no clock: its owner calls Advance()
+// with the current time, typically from an event loop that sleeps until
+// NextDeadline(). Nothing here is thread-safe.
+class TimerWheel {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  static constexpr std::chrono::milliseconds kDefaultTick{1};
+
+  explicit TimerWheel(Clock::time_point start, std::chrono::nanoseconds tick = kDefaultTick);
+  ~TimerWheel();
+
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  // Arms or re-arms |timer|. Deadlines are rounded up to the next tick, so a
+  // timer never fires early; ones already past fire on the next Advance().
+  // Deadlines beyond the wheel's reach (about 18 hours at 1 ms ticks) are
+  // clamped to it.
+  void Arm(Timer *timer, Clock::time_point deadline);
+  void Cancel(Timer *timer);
+
+  // Fires, in deadline order to the tick, every timer due at |now|.
+  // Callbacks may arm and cancel timers, including their own.
+  void Advance(Clock::time_point now);
+
+  // When Advance() next has something to do: a timer may fire or move down
+  // a level then. Clock::time_point::max() when nothing is armed.
+  Clock::time_point NextDeadline() const;
+
+  size_t size() const { return size_; }
+
+ private:
+  static constexpr int kLevels = 4;
+  static constexpr int kLevel0Bits = 8;
+  static constexpr int kLevelBits = 6;
+  static constexpr size_t kLevel0Slots = 1 << kLevel0Bits;
+  static constexpr size_t kLevelSlots = 1 << kLevelBits;
+
+  static int Shift(int level) { return level == 0 ? 0 : kLevel0Bits + (level - 1) * kLevelBits; }
+  static size_t Slots(int level) { return level == 0 ? kLevel0Slots : kLevelSlots; }
+
+  void Link(Timer *timer);
+  void Unlink(Timer *timer);
+  void Cascade(int level);
+  void RunTick();
+
+  Clock::time_point start_;
+  std::chrono::nanoseconds tick_;
+  // The tick the wheel processes next; everything before it has fired.
+  uint64_t now_ = 0;
+  size_t size_ = 0;
+  Timer *slots_[kLevels][kLevel0Slots] = {};
+  // Timers of the tick being run, while their callbacks are called.
+  Timer *expired_ = nullptr;
+  // One bit per non-empty slot, so NextDeadline() skips empty ones quickly.
+  uint64_t occupied_[kLevels][kLevel0Slots / 64] = {};
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,111 @@
+#include "tun.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // Attaches a new descriptor to the interface named in |ifr|, creating it
+    // if needed. Returns -1 with errno set on failure.
+    int AttachTunQueue(struct ifreq *ifr)
+    {
+      int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+      if (fd < 0)
+      {
+        throw std::runtime_error("could not open /dev/net/tun: " + std::string(strerror(errno)));
+      }
+      if (ioctl(fd, TUNSETIFF, ifr) < 0)
+      {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+      }
+      if (ifr->ifr_flags & IFF_VNET_HDR)
+      {
+        // If this fails the kernel keeps sending checksummed MTU-sized
+        // packets, which the data plane handles all the same.
+        unsigned int offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+        ioctl(fd, TUNSETOFFLOAD, offloads);
+      }
+      return fd;
+    }
+
+  } // namespace
+
+  int OpenTun(const std::string &name, std::string *actual_name)
+  {
+    return OpenTunQueues(name, 1, actual_name)[0];
+  }
+
+  std::vector<int> OpenTunQueues(const std::string &name, size_t queues, std::string *actual_name)
+  {
+    if (name.size() >= IFNAMSIZ)
+    {
+      throw std::runtime_error("interface name too long: " + name);
+    }
+    if (queues == 0)
+    {
+      throw std::runtime_error("a TUN needs at least one queue");
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    short multi_queue = queues > 1 ? IFF_MULTI_QUEUE : 0;
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_VNET_HDR | multi_queue;
+    memcpy(ifr.ifr_name, name.c_str(), name.size());
+    int fd = AttachTunQueue(&ifr);
+    if (fd < 0 && errno == EINVAL)
+    {
+      ifr.ifr_flags = IFF_TUN | IFF_NO_PI | multi_queue;
+      fd = AttachTunQueue(&ifr);
+    }
+    if (fd < 0)
+    {
+      throw std::runtime_error("TUNSETIFF failed: " + std::string(strerror(errno)));
+    }
+
+    // The other queues join the interface the first one created, with the
+    // same flags.
+    std::vector<int> fds = {fd};
+    while (fds.size() < queues)
+    {
+      fd = AttachTunQueue(&ifr);
+      if (fd < 0)
+      {
+        int error = errno;
+        for (int opened : fds)
+        {
+          close(opened);
+        }
+        throw std::runtime_error("could not attach TUN queue: " + std::string(strerror(error)));
+      }
+      fds.push_back(fd);
+    }
+
+    if (actual_name != nullptr)
+    {
+      *actual_name = ifr.ifr_name;
+    }
+    return fds;
+  }
+
+  bool TunHasVnetHeader(int fd)
+  {
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    return ioctl(fd, TUNGETIFF, &ifr) == 0 && (ifr.ifr_flags & IFF_VNET_HDR) != 0;
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,30 @@
+#ifndef WIREGUARD_FLUTTER_TUN_H
+#define WIREGUARD_FLUTTER_TUN_H
+
+#include <string>
+#include <vector>
+
+namespace wireguard_flutter {
+
+// Opens (creating if needed) a layer 3 TUN interface without packet
+// information headers. |name| may be empty to let the kernel choose; the
+// final name is stored in |actual_name| when it is not null. Throws
+// std::runtime_error on failure.
+//
+// Where the kernel supports it the interface carries a virtio_net_hdr on
+// every packet and has checksum and TCP segmentation offloads turned on, so
+// reads may return TCP super-packets of up to 64 KiB.
+int OpenTun(const std::string &name, std::string *actual_name);
+
+// Like OpenTun(), but opens |queues| descriptors on one interface. With more
+// than one the interface is created with IFF_MULTI_QUEUE, and the kernel
+// spreads the packets it hands to userspace over the queues by flow: a flow
+// goes to the queue its reply packets were last written to.
+std::vector<int> OpenTunQueues(const std::string &name, size_t queues, std::string *actual_name);
+
+// Whether |fd| is a TUN descriptor opened with IFF_VNET_HDR.
+bool TunHasVnetHeader(int fd);
+
+}  // namespace wireguard_flutter
+
+#endif
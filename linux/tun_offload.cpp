@@ -0,0 +1,430 @@
+#include "tun_offload.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "byte_order.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const uint8_t kIpProtocolTcp = 6;
+    const size_t kIpv4HeaderSize = 20;
+    const size_t kIpv6HeaderSize = 40;
+    const size_t kTcpHeaderSize = 20;
+    const size_t kTcpChecksumOffset = 16;
+    const size_t kMaxIpPacketSize = 65535;
+    // Packets held by the coalescer before it has to be flushed.
+    const size_t kMaxCoalescedPackets = 128;
+
+    // From linux/virtio_net.h.
+    const uint8_t kVirtioNetHeaderNeedsChecksum = 1;
+    const uint8_t kVirtioNetGsoNone = 0;
+    const uint8_t kVirtioNetGsoTcpv4 = 1;
+    const uint8_t kVirtioNetGsoTcpv6 = 4;
+    const uint8_t kVirtioNetGsoEcn = 0x80;
+
+    const uint8_t kTcpFin = 0x01;
+    const uint8_t kTcpPsh = 0x08;
+    const uint8_t kTcpAck = 0x10;
+    const uint8_t kTcpCwr = 0x80;
+
+    // Ones' complement sum of |data| as big-endian 16-bit words. Summing
+    // 32-bit words gives the same result once folded, at half the loads.
+    uint64_t ChecksumAdd(const uint8_t *data, size_t len, uint64_t sum)
+    {
+      for (; len >= 4; data += 4, len -= 4)
+      {
+        sum += LoadBe32(data);
+      }
+      if (len >= 2)
+      {
+        sum += LoadBe16(data);
+        data += 2;
+        len -= 2;
+      }
+      if (len == 1)
+      {
+        sum += static_cast<uint64_t>(data[0]) << 8;
+      }
+      return sum;
+    }
+
+    uint16_t ChecksumFold(uint64_t sum)
+    {
+      while (sum >> 16)
+      {
+        sum = (sum & 0xffff) + (sum >> 16);
+      }
+      return static_cast<uint16_t>(sum);
+    }
+
+    uint64_t PseudoHeaderSum(const uint8_t *packet, bool ipv6, size_t tcp_len)
+    {
+      uint64_t sum = ipv6 ? ChecksumAdd(packet + 8, 32, 0) : ChecksumAdd(packet + 12, 8, 0);
+      return sum + kIpProtocolTcp + tcp_len;
+    }
+
+    bool IsIpv6(const uint8_t *packet)
+    {
+      return (packet[0] >> 4) == 6;
+    }
+
+    // Length of the IP and TCP headers of a TCP packet, or 0 if |packet| is
+    // not TCP or carries IP options, extension headers or fragments.
+    size_t TcpHeadersLength(const uint8_t *packet, size_t len)
+    {
+      size_t ip_len;
+      if (len >= kIpv4HeaderSize && (packet[0] >> 4) == 4)
+      {
+        // No options, and neither a fragment nor more to come.
+        if (packet[0] != 0x45 || packet[9] != kIpProtocolTcp || (LoadBe16(packet + 6) & 0x3fff) != 0)
+        {
+          return 0;
+        }
+        ip_len = kIpv4HeaderSize;
+      }
+      else if (len >= kIpv6HeaderSize && IsIpv6(packet))
+      {
+        if (packet[6] != kIpProtocolTcp)
+        {
+          return 0;
+        }
+        ip_len = kIpv6HeaderSize;
+      }
+      else
+      {
+        return 0;
+      }
+      if (len < ip_len + kTcpHeaderSize)
+      {
+        return 0;
+      }
+      size_t tcp_len = (packet[ip_len + 12] >> 4) * 4;
+      if (tcp_len < kTcpHeaderSize || ip_len + tcp_len > len)
+      {
+        return 0;
+      }
+      return ip_len + tcp_len;
+    }
+
+    // Sets the IP length fields of |packet| to |len|.
+    void SetIpLength(uint8_t *packet, size_t len)
+    {
+      if (IsIpv6(packet))
+      {
+        StoreBe16(packet + 4, static_cast<uint16_t>(len - kIpv6HeaderSize));
+        return;
+      }
+      StoreBe16(packet + 2, static_cast<uint16_t>(len));
+      StoreBe16(packet + 10, 0);
+      StoreBe16(packet + 10, static_cast<uint16_t>(~ChecksumFold(ChecksumAdd(packet, kIpv4HeaderSize, 0))));
+    }
+
+    // Whether the IPv4 header checksum, if any, and the TCP checksum of a
+    // TCP packet verify.
+    bool TcpChecksumsValid(const uint8_t *packet, size_t len)
+    {
+      bool ipv6 = IsIpv6(packet);
+      size_t ip_len = ipv6 ? kIpv6HeaderSize : kIpv4HeaderSize;
+      if (!ipv6 && ChecksumFold(ChecksumAdd(packet, kIpv4HeaderSize, 0)) != 0xffff)
+      {
+        return false;
+      }
+      size_t tcp_len = len - ip_len;
+      return ChecksumFold(ChecksumAdd(packet + ip_len, tcp_len, PseudoHeaderSum(packet, ipv6, tcp_len))) == 0xffff;
+    }
+
+    // Whether two TCP packets share addresses and ports.
+    bool SameFlow(const uint8_t *a, const uint8_t *b)
+    {
+      if (IsIpv6(a) != IsIpv6(b))
+      {
+        return false;
+      }
+      if (IsIpv6(a))
+      {
+        return memcmp(a + 8, b + 8, 32) == 0 && memcmp(a + kIpv6HeaderSize, b + kIpv6HeaderSize, 4) == 0;
+      }
+      return memcmp(a + 12, b + 12, 8) == 0 && memcmp(a + kIpv4HeaderSize, b + kIpv4HeaderSize, 4) == 0;
+    }
+
+    // Whether two TCP packets with |header_len| bytes of headers belong to
+    // the same flow and could have come from one super-packet: everything
+    // but lengths, IDs, sequence numbers and checksums must match. The
+    // kernel gives every segment it cuts the first one's window.
+    bool SameSegmentHeaders(const uint8_t *a, const uint8_t *b, size_t header_len)
+    {
+      size_t ip_len;
+      if (IsIpv6(a))
+      {
+        // Version, traffic class, flow label, next header and hop limit,
+        // then the addresses.
+        if (!IsIpv6(b) || memcmp(a, b, 4) != 0 || memcmp(a + 6, b + 6, kIpv6HeaderSize - 6) != 0)
+        {
+          return false;
+        }
+        ip_len = kIpv6HeaderSize;
+      }
+      else
+      {
+        // Version and TOS; flags; TTL and protocol; the addresses.
+        if (IsIpv6(b) || memcmp(a, b, 2) != 0 || a[6] != b[6] || memcmp(a + 8, b + 8, 2) != 0 ||
+            memcmp(a + 12, b + 12, 8) != 0)
+        {
+          return false;
+        }
+        ip_len = kIpv4HeaderSize;
+      }
+      const uint8_t *tcp_a = a + ip_len;
+      const uint8_t *tcp_b = b + ip_len;
+      // Ports; acknowledgment number and data offset; window; options. The
+      // flags were checked by the caller.
+      return memcmp(tcp_a, tcp_b, 4) == 0 && memcmp(tcp_a + 8, tcp_b + 8, 5) == 0 &&
+             memcmp(tcp_a + 14, tcp_b + 14, 2) == 0 &&
+             memcmp(tcp_a + kTcpHeaderSize, tcp_b + kTcpHeaderSize, header_len - ip_len - kTcpHeaderSize) == 0;
+    }
+
+  } // namespace
+
+  TunSegmenter::TunSegmenter()
+  {
+    storage_.reserve(kMaxTunPacketSize * 2);
+  }
+
+  const std::vector<PacketSpan> &TunSegmenter::Split(uint8_t *buffer, size_t len)
+  {
+    packets_.clear();
+    if (len < kVirtioNetHeaderSize)
+    {
+      return packets_;
+    }
+    VirtioNetHeader header;
+    memcpy(&header, buffer, sizeof(header));
+    uint8_t *packet = buffer + kVirtioNetHeaderSize;
+    len -= kVirtioNetHeaderSize;
+
+    uint8_t gso_type = header.gso_type & ~kVirtioNetGsoEcn;
+    if (gso_type == kVirtioNetGsoTcpv4 || gso_type == kVirtioNetGsoTcpv6)
+    {
+      if (!SplitTcp(header, packet, len))
+      {
+        packets_.clear();
+      }
+      return packets_;
+    }
+    if (gso_type != kVirtioNetGsoNone)
+    {
+      return packets_;
+    }
+
+    if (header.flags & kVirtioNetHeaderNeedsChecksum)
+    {
+      // The checksum field already holds the pseudo-header sum.
+      size_t start = header.csum_start;
+      size_t field = start + header.csum_offset;
+      if (field + 2 > len)
+      {
+        return packets_;
+      }
+      uint16_t checksum = ChecksumFold(ChecksumAdd(packet + start, len - start, 0));
+      StoreBe16(packet + field, static_cast<uint16_t>(~checksum));
+    }
+    packets_.push_back(PacketSpan{packet, len});
+    return packets_;
+  }
+
+  bool TunSegmenter::SplitTcp(const VirtioNetHeader &header, const uint8_t *packet, size_t len)
+  {
+    size_t header_len = TcpHeadersLength(packet, len);
+    size_t segment_size = header.gso_size;
+    if (header_len == 0 || segment_size == 0)
+    {
+      return false;
+    }
+    bool ipv6 = IsIpv6(packet);
+    if (ipv6 != ((header.gso_type & ~kVirtioNetGsoEcn) == kVirtioNetGsoTcpv6))
+    {
+      return false;
+    }
+    size_t ip_len = ipv6 ? kIpv6HeaderSize : kIpv4HeaderSize;
+    size_t payload_len = len - header_len;
+    size_t count = std::max<size_t>(1, (payload_len + segment_size - 1) / segment_size);
+    size_t stride = header_len + segment_size;
+    storage_.resize(count * stride);
+
+    uint32_t seq = LoadBe32(packet + ip_len + 4);
+    uint16_t id = ipv6 ? 0 : LoadBe16(packet + 4);
+    for (size_t i = 0; i < count; i++)
+    {
+      size_t offset = i * segment_size;
+      size_t chunk = std::min(segment_size, payload_len - offset);
+      uint8_t *segment = &storage_[i * stride];
+      memcpy(segment, packet, header_len);
+      memcpy(segment + header_len, packet + header_len + offset, chunk);
+      size_t segment_len = header_len + chunk;
+
+      if (!ipv6)
+      {
+        StoreBe16(segment + 4, static_cast<uint16_t>(id + i));
+      }
+      SetIpLength(segment, segment_len);
+
+      // FIN and PSH belong on the last segment only, CWR on the first.
+      uint8_t *tcp = segment + ip_len;
+      StoreBe32(tcp + 4, seq + static_cast<uint32_t>(offset));
+      if (i + 1 < count)
+      {
+        tcp[13] &= ~(kTcpFin | kTcpPsh);
+      }
+      if (i > 0)
+      {
+        tcp[13] &= ~kTcpCwr;
+      }
+      size_t tcp_len = segment_len - ip_len;
+      StoreBe16(tcp + kTcpChecksumOffset, 0);
+      uint64_t sum = ChecksumAdd(tcp, tcp_len, PseudoHeaderSum(segment, ipv6, tcp_len));
+      StoreBe16(tcp + kTcpChecksumOffset, static_cast<uint16_t>(~ChecksumFold(sum)));
+      packets_.push_back(PacketSpan{segment, segment_len});
+    }
+    return true;
+  }
+
+  TunCoalescer::TunCoalescer() : batches_(kMaxCoalescedPackets)
+  {
+    packets_.reserve(kMaxCoalescedPackets);
+  }
+
+  bool TunCoalescer::Add(const uint8_t *packet, size_t len)
+  {
+    size_t header_len = TcpHeadersLength(packet, len);
+    size_t ip_len = IsIpv6(packet) ? kIpv6HeaderSize : kIpv4HeaderSize;
+    uint8_t flags = header_len != 0 ? packet[ip_len + 13] : 0;
+    // Only plain data segments are merged; anything that changes the state
+    // of the connection goes up on its own. So do segments that fail their
+    // checksums: the kernel trusts a super-packet's segments, so a corrupt
+    // one must reach it unmerged to be dropped there.
+    bool mergeable = header_len != 0 && header_len < len && (flags & ~kTcpPsh) == kTcpAck &&
+                     TcpChecksumsValid(packet, len);
+
+    if (mergeable)
+    {
+      // Only the flow's latest packet may grow, or the flow would be
+      // reordered.
+      for (size_t i = used_; i-- > 0;)
+      {
+        Batch &batch = batches_[i];
+        const uint8_t *first = batch.data.data() + kVirtioNetHeaderSize;
+        if (batch.header_len != 0 && SameFlow(first, packet))
+        {
+          if (batch.header_len == header_len && SameSegmentHeaders(first, packet, header_len) &&
+              Merge(&batch, packet, len, header_len))
+          {
+            return true;
+          }
+          break;
+        }
+      }
+    }
+
+    if (used_ == batches_.size())
+    {
+      return false;
+    }
+    Batch &batch = batches_[used_++];
+    batch.data.assign(kVirtioNetHeaderSize, 0);
+    batch.data.insert(batch.data.end(), packet, packet + len);
+    batch.header_len = header_len;
+    batch.segment_size = len - header_len;
+    batch.segments = 1;
+    batch.closed = !mergeable || (flags & kTcpPsh) != 0;
+    if (header_len != 0)
+    {
+      batch.next_seq = LoadBe32(packet + ip_len + 4) + static_cast<uint32_t>(batch.segment_size);
+    }
+    return true;
+  }
+
+  bool TunCoalescer::Merge(Batch *batch, const uint8_t *packet, size_t len, size_t header_len)
+  {
+    size_t ip_len = IsIpv6(packet) ? kIpv6HeaderSize : kIpv4HeaderSize;
+    size_t payload_len = len - header_len;
+    if (batch->closed || batch->segments == kMaxCoalescedSegments || payload_len > batch->segment_size ||
+        LoadBe32(packet + ip_len + 4) != batch->next_seq ||
+        batch->data.size() - kVirtioNetHeaderSize + payload_len > kMaxIpPacketSize)
+    {
+      return false;
+    }
+    batch->data.insert(batch->data.end(), packet + header_len, packet + len);
+    batch->segments++;
+    batch->next_seq += static_cast<uint32_t>(payload_len);
+    // A short segment or a push ends the super-packet, as it would have
+    // ended the sender's.
+    uint8_t flags = packet[ip_len + 13];
+    if (payload_len < batch->segment_size || (flags & kTcpPsh))
+    {
+      batch->data[kVirtioNetHeaderSize + ip_len + 13] |= flags & kTcpPsh;
+      batch->closed = true;
+    }
+    return true;
+  }
+
+  void TunCoalescer::Finish(Batch *batch)
+  {
+    VirtioNetHeader header;
+    memset(&header, 0, sizeof(header));
+    if (batch->segments > 1)
+    {
+      uint8_t *packet = batch->data.data() + kVirtioNetHeaderSize;
+      size_t len = batch->data.size() - kVirtioNetHeaderSize;
+      bool ipv6 = IsIpv6(packet);
+      size_t ip_len = ipv6 ? kIpv6HeaderSize : kIpv4HeaderSize;
+      SetIpLength(packet, len);
+      // The kernel finishes the checksum of each segment it cuts from this;
+      // it expects the pseudo-header sum in place.
+      uint16_t partial = ChecksumFold(PseudoHeaderSum(packet, ipv6, len - ip_len));
+      StoreBe16(packet + ip_len + kTcpChecksumOffset, partial);
+
+      header.flags = kVirtioNetHeaderNeedsChecksum;
+      header.gso_type = ipv6 ? kVirtioNetGsoTcpv6 : kVirtioNetGsoTcpv4;
+      header.hdr_len = static_cast<uint16_t>(batch->header_len);
+      header.gso_size = static_cast<uint16_t>(batch->segment_size);
+      header.csum_start = static_cast<uint16_t>(ip_len);
+      header.csum_offset = kTcpChecksumOffset;
+    }
+    memcpy(batch->data.data(), &header, sizeof(header));
+  }
+
+  const std::vector<PacketSpan> &TunCoalescer::Packets()
+  {
+    packets_.clear();
+    for (size_t i = 0; i < used_; i++)
+    {
+      Finish(&batches_[i]);
+      packets_.push_back(PacketSpan{batches_[i].data.data(), batches_[i].data.size()});
+    }
+    return packets_;
+  }
+
+  void TunCoalescer::Clear()
+  {
+    used_ = 0;
+    packets_.clear();
+  }
+
+  void TunCoalescer::Flush(int fd)
+  {
+    for (const PacketSpan &packet : Packets())
+    {
+      ssize_t written = write(fd, packet.data, packet.len);
+      (void)written;
+    }
+    Clear();
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,107 @@
+#ifndef WIREGUARD_FLUTTER_TUN_OFFLOAD_H
+#define WIREGUARD_FLUTTER_TUN_OFFLOAD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace wireguard_flutter {
+
+// With IFF_VNET_HDR every packet on the TUN descriptor is preceded by this,
+// in host byte order. Mirrors struct virtio_net_hdr, whose header does not
+// compile as C++.
+struct VirtioNetHeader {
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+};
+
+constexpr size_t kVirtioNetHeaderSize = sizeof(VirtioNetHeader);
+static_assert(kVirtioNetHeaderSize == 10, "virtio_net_hdr is 10 bytes");
+
+// Largest packet the kernel hands us or accepts from us with TSO enabled.
+constexpr size_t kMaxTunPacketSize = kVirtioNetHeaderSize + 65535;
+
+// Super-packets built by the coalescer are capped at this many segments.
+constexpr size_t kMaxCoalescedSegments = 64;
+
+struct PacketSpan {
+  uint8_t *data;
+  size_t len;
+};
+
+// Turns what one read from an IFF_VNET_HDR TUN returned into plain IP
+// packets: checksums the kernel left to us are filled in, and TCP
+// super-packets are cut into |gso_size| segments with their IP and TCP
+// headers fixed up as a NIC would.
+class TunSegmenter {
+ public:
+  TunSegmenter();
+
+  TunSegmenter(const TunSegmenter &) = delete;
+  TunSegmenter &operator=(const TunSegmenter &) = delete;
+
+  // |buffer| starts with the VirtioNetHeader. Packets without GSO are
+  // returned in place; segments point into the segmenter's own storage.
+  // Either way they stay valid until the next call. Malformed packets come
+  // back as an empty list.
+  const std::vector<PacketSpan> &Split(uint8_t *buffer, size_t len);
+
+ private:
+  bool SplitTcp(const VirtioNetHeader &header, const uint8_t *packet, size_t len);
+
+  std::vector<uint8_t> storage_;
+  std::vector<PacketSpan> packets_;
+};
+
+// Collects decrypted packets bound for an IFF_VNET_HDR TUN and merges
+// consecutive segments of a TCP flow into one super-packet, so the kernel
+// sees a single large receive instead of dozens of small ones. Everything
+// else, including segments whose checksums fail, is passed through with an
+// empty header.
+class TunCoalescer {
+ public:
+  TunCoalescer();
+
+  TunCoalescer(const TunCoalescer &) = delete;
+  TunCoalescer &operator=(const TunCoalescer &) = delete;
+
+  // Copies |packet|. Returns false once the batch is full; Flush() first.
+  bool Add(const uint8_t *packet, size_t len);
+
+  // The batched packets, each starting with its VirtioNetHeader, in an order
+  // that keeps every flow's packets in sequence. Valid until Clear().
+  const std::vector<PacketSpan> &Packets();
+  void Clear();
+
+  // Writes the batch to |fd| and clears it.
+  void Flush(int fd);
+
+  bool empty() const { return used_ == 0; }
+
+ private:
+  struct Batch {
+    // VirtioNetHeader followed by the IP packet.
+    std::vector<uint8_t> data;
+    size_t header_len = 0;  // IP plus TCP headers; 0 if not TCP.
+    size_t segment_size = 0;
+    size_t segments = 0;
+    uint32_t next_seq = 0;
+    // No more segments may be appended.
+    bool closed = false;
+  };
+
+  bool Merge(Batch *batch, const uint8_t *packet, size_t len, size_t header_len);
+  void Finish(Batch *batch);
+
+  std::vector<Batch> batches_;
+  size_t used_ = 0;
+  std::vector<PacketSpan> packets_;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
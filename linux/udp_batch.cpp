@@ -0,0 +1,246 @@
+#include "udp_batch.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // UDP_MAX_SEGMENTS in the kernel.
+    const size_t kMaxGsoSegments = 64;
+    // Leaves room for the IPv6 and UDP headers within the 64 KiB IP limit.
+    const size_t kMaxGsoBytes = 65000;
+    const size_t kSendControlSize = CMSG_SPACE(sizeof(uint16_t));
+    // How long a sender waits for socket buffer space before dropping.
+    const int kSendBlockTimeoutMs = 100;
+
+    bool SameDestination(const OutgoingDatagram &a, const OutgoingDatagram &b)
+    {
+      return a.address_len == b.address_len && memcmp(a.address, b.address, a.address_len) == 0;
+    }
+
+    // sendmmsg, or one sendmsg per message on kernels without it.
+    int SendMessages(int fd, struct mmsghdr *messages, unsigned int count)
+    {
+      int result = sendmmsg(fd, messages, count, 0);
+      if (result >= 0 || errno != ENOSYS)
+      {
+        return result;
+      }
+      unsigned int sent = 0;
+      for (; sent < count; sent++)
+      {
+        if (sendmsg(fd, &messages[sent].msg_hdr, 0) < 0)
+        {
+          break;
+        }
+      }
+      return sent > 0 ? static_cast<int>(sent) : -1;
+    }
+
+    // recvmmsg, or a single recvmsg on kernels without it.
+    int ReceiveMessages(int fd, struct mmsghdr *messages, unsigned int count)
+    {
+      int result = recvmmsg(fd, messages, count, 0, nullptr);
+      if (result >= 0 || errno != ENOSYS)
+      {
+        return result;
+      }
+      ssize_t len = recvmsg(fd, &messages[0].msg_hdr, 0);
+      if (len < 0)
+      {
+        return -1;
+      }
+      messages[0].msg_len = static_cast<unsigned int>(len);
+      return 1;
+    }
+
+  } // namespace
+
+  UdpOffloads EnableUdpOffloads(int fd)
+  {
+    UdpOffloads offloads;
+    int one = 1;
+    offloads.gro = setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+    int segment_size = 0;
+    socklen_t len = sizeof(segment_size);
+    offloads.gso = getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment_size, &len) == 0;
+    return offloads;
+  }
+
+  size_t SendDatagrams(int fd, const OutgoingDatagram *datagrams, size_t count, std::atomic<bool> *gso)
+  {
+    struct mmsghdr messages[kUdpBatchSize];
+    struct iovec iovecs[kUdpBatchSize];
+    alignas(struct cmsghdr) uint8_t control[kUdpBatchSize][kSendControlSize];
+    // Index of the first datagram carried by each message.
+    size_t first[kUdpBatchSize + 1];
+
+    size_t sent = 0;
+    while (sent < count)
+    {
+      bool use_gso = gso != nullptr && gso->load(std::memory_order_relaxed);
+      const OutgoingDatagram *batch = datagrams + sent;
+      size_t batch_size = std::min(count - sent, kUdpBatchSize);
+      memset(messages, 0, sizeof(messages[0]) * batch_size);
+
+      size_t message_count = 0;
+      for (size_t i = 0; i < batch_size;)
+      {
+        // A GSO run is equal-sized datagrams to one destination; only the
+        // last may be shorter.
+        size_t segments = 1;
+        size_t total = batch[i].len;
+        iovecs[i].iov_base = const_cast<uint8_t *>(batch[i].data);
+        iovecs[i].iov_len = batch[i].len;
+        while (use_gso && i + segments < batch_size && segments < kMaxGsoSegments)
+        {
+          const OutgoingDatagram &next = batch[i + segments];
+          if (!SameDestination(batch[i], next) || next.len > batch[i].len || total + next.len > kMaxGsoBytes)
+          {
+            break;
+          }
+          iovecs[i + segments].iov_base = const_cast<uint8_t *>(next.data);
+          iovecs[i + segments].iov_len = next.len;
+          total += next.len;
+          segments++;
+          if (next.len < batch[i].len)
+          {
+            break;
+          }
+        }
+
+        struct msghdr &header = messages[message_count].msg_hdr;
+        header.msg_name = const_cast<struct sockaddr_storage *>(batch[i].address);
+        header.msg_namelen = batch[i].address_len;
+        header.msg_iov = &iovecs[i];
+        header.msg_iovlen = segments;
+        if (segments > 1)
+        {
+          header.msg_control = control[message_count];
+          header.msg_controllen = kSendControlSize;
+          struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+          cmsg->cmsg_level = SOL_UDP;
+          cmsg->cmsg_type = UDP_SEGMENT;
+          cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+          uint16_t segment_size = static_cast<uint16_t>(batch[i].len);
+          memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+        }
+        first[message_count++] = i;
+        i += segments;
+      }
+      first[message_count] = batch_size;
+
+      int result = SendMessages(fd, messages, static_cast<unsigned int>(message_count));
+      if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+      {
+        // The socket is non-blocking for the event loop's sake, but a full
+        // send buffer is better met with backpressure than with drops.
+        struct pollfd writable = {fd, POLLOUT, 0};
+        if (poll(&writable, 1, kSendBlockTimeoutMs) > 0)
+        {
+          continue;
+        }
+        return sent;
+      }
+      if (result < 0)
+      {
+        // EIO means the device cannot checksum the segments; stop using GSO
+        // on this socket and resend the batch datagram by datagram.
+        if (use_gso && message_count < batch_size && (errno == EIO || errno == EINVAL))
+        {
+          gso->store(false, std::memory_order_relaxed);
+          continue;
+        }
+        return sent;
+      }
+      sent += first[result];
+      if (static_cast<size_t>(result) < message_count)
+      {
+        return sent;
+      }
+    }
+    return sent;
+  }
+
+  size_t GroSegmentSize(const struct msghdr &header, size_t len)
+  {
+    size_t segment = len;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(const_cast<struct msghdr *>(&header), cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+      {
+        int size;
+        memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+        if (size > 0)
+        {
+          segment = static_cast<size_t>(size);
+        }
+      }
+    }
+    return segment;
+  }
+
+  UdpReceiver::UdpReceiver()
+      : buffers_(kUdpBatchSize * kUdpReceiveBufferSize),
+        messages_(kUdpBatchSize),
+        iovecs_(kUdpBatchSize),
+        addresses_(kUdpBatchSize),
+        control_(kUdpBatchSize * kUdpReceiveControlSize)
+  {
+    datagrams_.reserve(kUdpBatchSize);
+  }
+
+  const std::vector<ReceivedDatagram> &UdpReceiver::Receive(int fd)
+  {
+    datagrams_.clear();
+    size_t count = ReceiveBatch(fd);
+    for (size_t i = 0; i < count; i++)
+    {
+      const struct msghdr &header = messages_[i].msg_hdr;
+      if (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+      {
+        continue;
+      }
+      uint8_t *data = static_cast<uint8_t *>(iovecs_[i].iov_base);
+      size_t len = messages_[i].msg_len;
+
+      size_t segment = GroSegmentSize(header, len);
+      for (size_t offset = 0; offset < len; offset += segment)
+      {
+        datagrams_.push_back(
+            ReceivedDatagram{data + offset, std::min(segment, len - offset), &addresses_[i], header.msg_namelen});
+      }
+    }
+    return datagrams_;
+  }
+
+  size_t UdpReceiver::ReceiveBatch(int fd)
+  {
+    for (size_t i = 0; i < kUdpBatchSize; i++)
+    {
+      iovecs_[i].iov_base = &buffers_[i * kUdpReceiveBufferSize];
+      iovecs_[i].iov_len = kUdpReceiveBufferSize;
+      struct msghdr &header = messages_[i].msg_hdr;
+      header.msg_name = &addresses_[i];
+      header.msg_namelen = sizeof(addresses_[i]);
+      header.msg_iov = &iovecs_[i];
+      header.msg_iovlen = 1;
+      header.msg_control = &control_[i * kUdpReceiveControlSize];
+      header.msg_controllen = kUdpReceiveControlSize;
+      header.msg_flags = 0;
+    }
+    int count = ReceiveMessages(fd, messages_.data(), static_cast<unsigned int>(kUdpBatchSize));
+    return count > 0 ? static_cast<size_t>(count) : 0;
+  }
+
+} // namespace wireguard_flutter
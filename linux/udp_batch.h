@@ -0,0 +1,85 @@
+#ifndef WIREGUARD_FLUTTER_UDP_BATCH_H
+#define WIREGUARD_FLUTTER_UDP_BATCH_H
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "messages.h"
+
+namespace wireguard_flutter {
+
+// Datagrams moved per recvmmsg/sendmmsg call.
+constexpr size_t kUdpBatchSize = 32;
+
+// A receive buffer holds at most one maximum-sized UDP payload, which GRO
+// may fill with several datagrams; its control data the GRO segment size.
+constexpr size_t kUdpReceiveBufferSize = kMaxMessageSize + kMessageDataMinSize;
+constexpr size_t kUdpReceiveControlSize = CMSG_SPACE(sizeof(int));
+
+struct UdpOffloads {
+  // UDP_SEGMENT: one send carries a run of equal-sized datagrams.
+  bool gso = false;
+  // UDP_GRO: one receive may return several datagrams from the same source.
+  bool gro = false;
+};
+
+// Turns on GRO for |fd| and probes for GSO. Kernels without either simply
+// report them as unavailable.
+UdpOffloads EnableUdpOffloads(int fd);
+
+struct OutgoingDatagram {
+  const uint8_t *data;
+  size_t len;
+  const struct sockaddr_storage *address;
+  socklen_t address_len;
+};
+
+// Sends |count| datagrams with sendmmsg. When |*gso| is set, consecutive
+// datagrams to the same destination are handed to the kernel as one GSO
+// send, gathered straight from their buffers. A kernel or NIC that rejects
+// GSO clears |*gso| and the datagrams go out one by one. Returns how many
+// datagrams from the front of the array were sent.
+size_t SendDatagrams(int fd, const OutgoingDatagram *datagrams, size_t count, std::atomic<bool> *gso);
+
+struct ReceivedDatagram {
+  uint8_t *data;
+  size_t len;
+  const struct sockaddr_storage *from;
+  socklen_t from_len;
+};
+
+// The size of the datagrams in a buffer of |len| bytes received with
+// |header|: with GRO they sit back to back, the last possibly shorter.
+size_t GroSegmentSize(const struct msghdr &header, size_t len);
+
+// Reads batches of datagrams with recvmmsg, splitting GRO-coalesced buffers
+// into the individual datagrams in place.
+class UdpReceiver {
+ public:
+  UdpReceiver();
+
+  UdpReceiver(const UdpReceiver &) = delete;
+  UdpReceiver &operator=(const UdpReceiver &) = delete;
+
+  // Returns the datagrams read by one call, empty when none were waiting.
+  // They point into the receiver's buffers and stay valid until the next call.
+  const std::vector<ReceivedDatagram> &Receive(int fd);
+
+ private:
+  size_t ReceiveBatch(int fd);
+
+  std::vector<uint8_t> buffers_;
+  std::vector<struct mmsghdr> messages_;
+  std::vector<struct iovec> iovecs_;
+  std::vector<struct sockaddr_storage> addresses_;
+  std::vector<uint8_t> control_;
+  std::vector<ReceivedDatagram> datagrams_;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
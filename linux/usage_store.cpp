@@ -0,0 +1,462 @@
+#include "usage_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const uint64_t kSegmentMagic = 0x3153554746475721; // "!WGFGUS1"
+    const size_t kHeaderSize = 8192;
+    const size_t kBlocksPerSegment = (UsageStore::kSegmentSize - kHeaderSize) / UsageStore::kBlockSize;
+    // An id, then four differences.
+    const size_t kMaxRecordSize = 5 + 4 * 10;
+    const char kSeriesFile[] = "series";
+    const char kSegmentPrefix[] = "usage-";
+    const char kSegmentSuffix[] = ".seg";
+
+    // The times of the first and last record in a block, the lowest and
+    // highest if they were appended out of order.
+    struct BlockSpan
+    {
+      uint64_t first_ms;
+      uint64_t last_ms;
+    };
+
+    struct SegmentHeader
+    {
+      uint64_t magic;
+      uint64_t sequence;
+      // Bytes of whole records in the data area, padding included. Only
+      // ever moves forward past a record once the record is written.
+      uint64_t committed;
+      uint64_t reserved[5];
+      BlockSpan blocks[kBlocksPerSegment];
+    };
+
+    static_assert(sizeof(SegmentHeader) <= kHeaderSize, "segment header too large");
+
+    std::string ErrnoMessage(const std::string &what)
+    {
+      return what + ": " + strerror(errno);
+    }
+
+    size_t PutVarint(uint8_t *out, uint64_t value)
+    {
+      size_t len = 0;
+      while (value >= 0x80)
+      {
+        out[len++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+      }
+      out[len++] = static_cast<uint8_t>(value);
+      return len;
+    }
+
+    bool GetVarint(const uint8_t **p, const uint8_t *end, uint64_t *value)
+    {
+      uint64_t result = 0;
+      for (unsigned shift = 0; shift < 64 && *p < end; shift += 7)
+      {
+        uint8_t byte = *(*p)++;
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+          *value = result;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Differences go up or down; zigzag keeps small ones of either sign
+    // short.
+    uint64_t ZigZag(uint64_t difference)
+    {
+      return (difference << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(difference) >> 63);
+    }
+
+    uint64_t UnZigZag(uint64_t value)
+    {
+      return (value >> 1) ^ (~(value & 1) + 1);
+    }
+
+    size_t EncodeRecord(uint8_t *out, uint32_t id, const UsageSample &sample, const UsageSample &previous)
+    {
+      size_t len = PutVarint(out, uint64_t(id) + 1);
+      len += PutVarint(out + len, ZigZag(sample.time_ms - previous.time_ms));
+      len += PutVarint(out + len, ZigZag(sample.tx_bytes - previous.tx_bytes));
+      len += PutVarint(out + len, ZigZag(sample.rx_bytes - previous.rx_bytes));
+      len += PutVarint(out + len, ZigZag(sample.last_handshake_ms - previous.last_handshake_ms));
+      return len;
+    }
+
+    // Decodes the records of one block, each against |state|, the last
+    // record of its series in the block so far. A zero byte pads the rest
+    // of a block. Returns the bytes of whole, valid records.
+    template <typename Visit>
+    size_t DecodeBlock(const uint8_t *data, size_t len, size_t series_count,
+                       std::unordered_map<uint32_t, UsageSample> *state, Visit visit)
+    {
+      const uint8_t *p = data;
+      const uint8_t *end = data + len;
+      while (p < end && *p != 0)
+      {
+        const uint8_t *record = p;
+        uint64_t id, time, tx, rx, handshake;
+        if (!GetVarint(&p, end, &id) || id > series_count || !GetVarint(&p, end, &time) ||
+            !GetVarint(&p, end, &tx) || !GetVarint(&p, end, &rx) || !GetVarint(&p, end, &handshake))
+        {
+          return static_cast<size_t>(record - data);
+        }
+        UsageSample &sample = (*state)[static_cast<uint32_t>(id - 1)];
+        sample.time_ms += UnZigZag(time);
+        sample.tx_bytes += UnZigZag(tx);
+        sample.rx_bytes += UnZigZag(rx);
+        sample.last_handshake_ms += UnZigZag(handshake);
+        visit(static_cast<uint32_t>(id - 1), sample);
+      }
+      return static_cast<size_t>(p - data);
+    }
+
+    std::string SegmentName(uint64_t sequence)
+    {
+      char name[64];
+      snprintf(name, sizeof(name), "%s%016llx%s", kSegmentPrefix, static_cast<unsigned long long>(sequence),
+               kSegmentSuffix);
+      return name;
+    }
+
+  } // namespace
+
+  constexpr size_t UsageStore::kSegmentSize;
+  constexpr size_t UsageStore::kBlockSize;
+
+  struct UsageStore::Segment
+  {
+    ~Segment() { munmap(header, kSegmentSize); }
+
+    std::string path;
+    SegmentHeader *header;
+    uint8_t *data;
+    uint64_t Committed() const { return __atomic_load_n(&header->committed, __ATOMIC_ACQUIRE); }
+  };
+
+  UsageStore::UsageStore(const std::string &directory) : directory_(directory)
+  {
+    if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST)
+    {
+      throw std::runtime_error(ErrnoMessage("cannot create " + directory));
+    }
+
+    // Series ids are positions in the series file; a key torn by a crash is
+    // dropped with the records that could not have been written after it.
+    std::string series_path = directory + "/" + kSeriesFile;
+    series_fd_ = open(series_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (series_fd_ < 0)
+    {
+      throw std::runtime_error(ErrnoMessage("cannot open " + series_path));
+    }
+    Series series;
+    while (pread(series_fd_, series.data(), series.size(), series_.size() * series.size()) ==
+           static_cast<ssize_t>(series.size()))
+    {
+      series_ids_[series] = static_cast<uint32_t>(series_.size());
+      series_.push_back(series);
+    }
+    if (ftruncate(series_fd_, series_.size() * series.size()) != 0)
+    {
+      close(series_fd_);
+      throw std::runtime_error(ErrnoMessage("cannot truncate " + series_path));
+    }
+
+    std::vector<uint64_t> sequences;
+    if (DIR *dir = opendir(directory.c_str()))
+    {
+      while (struct dirent *entry = readdir(dir))
+      {
+        unsigned long long sequence;
+        char suffix[8];
+        if (sscanf(entry->d_name, "usage-%16llx%7s", &sequence, suffix) == 2 && strcmp(suffix, kSegmentSuffix) == 0)
+        {
+          sequences.push_back(sequence);
+        }
+      }
+      closedir(dir);
+    }
+    std::sort(sequences.begin(), sequences.end());
+    try
+    {
+      for (uint64_t sequence : sequences)
+      {
+        OpenSegment(sequence, false);
+      }
+      if (!segments_.empty())
+      {
+        Recover(segments_.back().get());
+      }
+    }
+    catch (...)
+    {
+      close(series_fd_);
+      throw;
+    }
+  }
+
+  UsageStore::~UsageStore()
+  {
+    close(series_fd_);
+  }
+
+  void UsageStore::Append(const Series &series, const UsageSample &sample)
+  {
+    uint32_t id = SeriesId(series);
+    uint8_t record[kMaxRecordSize];
+    size_t len = 0;
+    uint64_t committed = 0;
+    if (!segments_.empty())
+    {
+      committed = segments_.back()->Committed();
+      len = EncodeRecord(record, id, sample, block_state_[id]);
+    }
+    if (segments_.empty() || committed % kBlockSize == 0 || committed % kBlockSize + len > kBlockSize)
+    {
+      // Start the next block, of a new segment if this one is full. The
+      // zeros left at the end of the current one mark it finished.
+      committed = (committed + kBlockSize - 1) / kBlockSize * kBlockSize;
+      if (segments_.empty() || committed == kBlocksPerSegment * kBlockSize)
+      {
+        OpenSegment(segments_.empty() ? 0 : segments_.back()->header->sequence + 1, true);
+        committed = 0;
+      }
+      block_state_.clear();
+      len = EncodeRecord(record, id, sample, block_state_[id]);
+    }
+
+    Segment *segment = segments_.back().get();
+    memcpy(segment->data + committed, record, len);
+    BlockSpan &span = segment->header->blocks[committed / kBlockSize];
+    if (committed % kBlockSize == 0)
+    {
+      span.first_ms = sample.time_ms;
+      span.last_ms = sample.time_ms;
+    }
+    span.first_ms = std::min(span.first_ms, sample.time_ms);
+    span.last_ms = std::max(span.last_ms, sample.time_ms);
+    __atomic_store_n(&segment->header->committed, committed + len, __ATOMIC_RELEASE);
+    block_state_[id] = sample;
+  }
+
+  std::vector<UsageSample> UsageStore::Samples(const Series &series, uint64_t from_ms, uint64_t to_ms)
+  {
+    std::vector<UsageSample> samples;
+    auto id = series_ids_.find(series);
+    if (id != series_ids_.end())
+    {
+      auto add = [&](const UsageSample &sample)
+      {
+        samples.push_back(sample);
+      };
+      Scan(id->second, from_ms, to_ms, add);
+    }
+    return samples;
+  }
+
+  std::vector<UsageRollup> UsageStore::Rollup(const Series &series, uint64_t from_ms, uint64_t to_ms,
+                                              uint64_t step_ms)
+  {
+    std::vector<UsageRollup> rollups;
+    auto id = series_ids_.find(series);
+    if (id == series_ids_.end() || step_ms == 0 || to_ms <= from_ms)
+    {
+      return rollups;
+    }
+    rollups.resize((to_ms - from_ms + step_ms - 1) / step_ms);
+    for (size_t i = 0; i < rollups.size(); i++)
+    {
+      rollups[i].start_ms = from_ms + i * step_ms;
+    }
+    bool have_previous = false;
+    UsageSample previous;
+    auto add = [&](const UsageSample &sample)
+    {
+      UsageRollup &rollup = rollups[(sample.time_ms - from_ms) / step_ms];
+      if (have_previous)
+      {
+        rollup.tx_bytes += sample.tx_bytes >= previous.tx_bytes ? sample.tx_bytes - previous.tx_bytes : sample.tx_bytes;
+        rollup.rx_bytes += sample.rx_bytes >= previous.rx_bytes ? sample.rx_bytes - previous.rx_bytes : sample.rx_bytes;
+      }
+      rollup.last_handshake_ms = std::max(rollup.last_handshake_ms, sample.last_handshake_ms);
+      rollup.samples++;
+      previous = sample;
+      have_previous = true;
+    };
+    Scan(id->second, from_ms, to_ms, add);
+    return rollups;
+  }
+
+  void UsageStore::Sync()
+  {
+    // Keys before the records that use them.
+    if (fdatasync(series_fd_) != 0)
+    {
+      throw std::runtime_error(ErrnoMessage("cannot sync series"));
+    }
+    if (!segments_.empty() && msync(segments_.back()->header, kSegmentSize, MS_SYNC) != 0)
+    {
+      throw std::runtime_error(ErrnoMessage("cannot sync " + segments_.back()->path));
+    }
+  }
+
+  void UsageStore::Prune(uint64_t before_ms)
+  {
+    while (segments_.size() > 1)
+    {
+      const Segment &segment = *segments_.front();
+      uint64_t blocks = (segment.Committed() + kBlockSize - 1) / kBlockSize;
+      for (uint64_t b = 0; b < blocks; b++)
+      {
+        if (segment.header->blocks[b].last_ms >= before_ms)
+        {
+          return;
+        }
+      }
+      unlink(segment.path.c_str());
+      segments_.erase(segments_.begin());
+    }
+  }
+
+  void UsageStore::OpenSegment(uint64_t sequence, bool create)
+  {
+    std::string path = directory_ + "/" + SegmentName(sequence);
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600);
+    if (fd < 0)
+    {
+      throw std::runtime_error(ErrnoMessage("cannot open " + path));
+    }
+    struct stat st;
+    if ((create && ftruncate(fd, kSegmentSize) != 0) || fstat(fd, &st) != 0)
+    {
+      close(fd);
+      throw std::runtime_error(ErrnoMessage("cannot size " + path));
+    }
+    if (!create && st.st_size == 0)
+    {
+      // Created, then a crash before it was sized: it never held a record.
+      close(fd);
+      unlink(path.c_str());
+      return;
+    }
+    if (static_cast<size_t>(st.st_size) != kSegmentSize)
+    {
+      close(fd);
+      throw std::runtime_error("bad usage segment " + path);
+    }
+    void *base = mmap(nullptr, kSegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+      throw std::runtime_error(ErrnoMessage("cannot map " + path));
+    }
+    std::unique_ptr<Segment> segment(new Segment());
+    segment->path = path;
+    segment->header = static_cast<SegmentHeader *>(base);
+    segment->data = static_cast<uint8_t *>(base) + kHeaderSize;
+    if (create)
+    {
+      segment->header->sequence = sequence;
+      segment->header->magic = kSegmentMagic;
+    }
+    else if (segment->header->magic == 0)
+    {
+      // Sized, but its header never reached the disk.
+      unlink(path.c_str());
+      return;
+    }
+    else if (segment->header->magic != kSegmentMagic || segment->header->sequence != sequence)
+    {
+      throw std::runtime_error("bad usage segment " + path);
+    }
+    segments_.push_back(std::move(segment));
+  }
+
+  void UsageStore::Recover(Segment *segment)
+  {
+    // Replays the segment's blocks up to the committed count, which a
+    // crash may have left past a record torn on disk.
+    uint64_t committed = std::min<uint64_t>(segment->Committed(), kBlocksPerSegment * kBlockSize);
+    uint64_t valid = 0;
+    for (uint64_t block = 0; block * kBlockSize < committed; block++)
+    {
+      block_state_.clear();
+      size_t len = static_cast<size_t>(std::min<uint64_t>(committed - block * kBlockSize, kBlockSize));
+      size_t good = DecodeBlock(segment->data + block * kBlockSize, len, series_.size(), &block_state_,
+                                [](uint32_t, const UsageSample &) {});
+      if (good < len && segment->data[block * kBlockSize + good] != 0)
+      {
+        valid = block * kBlockSize + good;
+        memset(segment->data + valid, 0, kBlockSize - good);
+        break;
+      }
+      valid = block * kBlockSize + len;
+    }
+    __atomic_store_n(&segment->header->committed, valid, __ATOMIC_RELEASE);
+  }
+
+  uint32_t UsageStore::SeriesId(const Series &series)
+  {
+    auto found = series_ids_.find(series);
+    if (found != series_ids_.end())
+    {
+      return found->second;
+    }
+    if (write(series_fd_, series.data(), series.size()) != static_cast<ssize_t>(series.size()))
+    {
+      throw std::runtime_error(ErrnoMessage("cannot add series"));
+    }
+    uint32_t id = static_cast<uint32_t>(series_.size());
+    series_.push_back(series);
+    series_ids_[series] = id;
+    return id;
+  }
+
+  void UsageStore::Scan(uint32_t id, uint64_t from_ms, uint64_t to_ms,
+                        const std::function<void(const UsageSample &)> &visit)
+  {
+    std::unordered_map<uint32_t, UsageSample> state;
+    auto filter = [&](uint32_t record_id, const UsageSample &sample)
+    {
+      if (record_id == id && sample.time_ms >= from_ms && sample.time_ms < to_ms)
+      {
+        visit(sample);
+      }
+    };
+    for (const auto &segment : segments_)
+    {
+      uint64_t committed = segment->Committed();
+      for (uint64_t block = 0; block * kBlockSize < committed; block++)
+      {
+        const BlockSpan &span = segment->header->blocks[block];
+        if (span.last_ms < from_ms || span.first_ms >= to_ms)
+        {
+          continue;
+        }
+        state.clear();
+        size_t len = static_cast<size_t>(std::min<uint64_t>(committed - block * kBlockSize, kBlockSize));
+        DecodeBlock(segment->data + block * kBlockSize, len, series_.size(), &state, filter);
+      }
+    }
+  }
+
+} // namespace wireguard_flutter
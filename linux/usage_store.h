@@ -0,0 +1,117 @@
+#ifndef WIREGUARD_FLUTTER_USAGE_STORE_H
+#define WIREGUARD_FLUTTER_USAGE_STORE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "curve25519.h"
+
+namespace wireguard_flutter {
+
+// One reading of a peer's counters, or the tunnel's as a whole.
+struct UsageSample {
+  // Milliseconds since the epoch.
+  uint64_t time_ms = 0;
+  uint64_t tx_bytes = 0;
+  uint64_t rx_bytes = 0;
+  // 0 if there has been no handshake.
+  uint64_t last_handshake_ms = 0;
+};
+
+// Traffic within [start_ms, start_ms + step) of a rollup.
+struct UsageRollup {
+  uint64_t start_ms = 0;
+  uint64_t tx_bytes = 0;
+  uint64_t rx_bytes = 0;
+  uint64_t last_handshake_ms = 0;
+  uint32_t samples = 0;
+};
+
+// Append-only history of usage samples, kept in a directory of fixed-size
+// segment files mapped into memory. Each record holds the differences from
+// the series' previous record as varints, about 12 bytes for a busy peer's
+// 10 second sample. A segment's data is split into blocks that each start
+// the differences afresh, and the segment header keeps every block's time
+// span, so a range query decodes only the blocks that overlap it.
+//
+// A record is written in full before the header's count of committed bytes
+// moves past it, so a crash loses at most the record being written; Sync()
+// makes everything appended so far survive power loss too. Reopening checks
+// the last segment and drops anything after its last whole record. Not
+// thread-safe.
+class UsageStore {
+ public:
+  // A peer's public key, or all zeros for the tunnel's own totals.
+  typedef std::array<uint8_t, kCurve25519KeySize> Series;
+
+  static constexpr size_t kSegmentSize = 1024 * 1024;
+  static constexpr size_t kBlockSize = 4096;
+
+  // Opens the store in |directory|, creating it if needed. Throws
+  // std::runtime_error on failure.
+  explicit UsageStore(const std::string &directory);
+  ~UsageStore();
+
+  UsageStore(const UsageStore &) = delete;
+  UsageStore &operator=(const UsageStore &) = delete;
+
+  // Samples are expected about in time order; counters may go down, e.g.
+  // when a peer is re-added. Throws std::runtime_error if a new segment
+  // cannot be created.
+  void Append(const Series &series, const UsageSample &sample);
+
+  // The samples of |series| with from_ms <= time_ms < to_ms, in the order
+  // they were appended.
+  std::vector<UsageSample> Samples(const Series &series, uint64_t from_ms, uint64_t to_ms);
+
+  // The traffic of |series| in each |step_ms| from |from_ms| up to |to_ms|.
+  // What a counter gained between consecutive samples is counted in the
+  // later one's step; a counter that went down counts from zero.
+  std::vector<UsageRollup> Rollup(const Series &series, uint64_t from_ms, uint64_t to_ms, uint64_t step_ms);
+
+  // Writes everything appended so far to disk.
+  void Sync();
+
+  // Deletes the segments holding only samples from before |before_ms|. The
+  // one being appended to is kept.
+  void Prune(uint64_t before_ms);
+
+  size_t segments() const { return segments_.size(); }
+
+ private:
+  struct Segment;
+  struct SeriesHash {
+    // Public keys are uniformly distributed already.
+    size_t operator()(const Series &series) const {
+      size_t hash;
+      memcpy(&hash, series.data(), sizeof(hash));
+      return hash;
+    }
+  };
+
+  void OpenSegment(uint64_t sequence, bool create);
+  void Recover(Segment *segment);
+  uint32_t SeriesId(const Series &series);
+  // Calls |visit| with each sample of series |id| in blocks overlapping
+  // [from_ms, to_ms).
+  void Scan(uint32_t id, uint64_t from_ms, uint64_t to_ms, const std::function<void(const UsageSample &)> &visit);
+
+  std::string directory_;
+  int series_fd_;
+  std::vector<Series> series_;
+  std::unordered_map<Series, uint32_t, SeriesHash> series_ids_;
+  std::vector<std::unique_ptr<Segment>> segments_;
+  // The last record of each series in the block being appended to.
+  std::unordered_map<uint32_t, UsageSample> block_state_;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
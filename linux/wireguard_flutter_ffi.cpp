@@ -0,0 +1,32 @@
+#include "include/wireguard_flutter/wireguard_flutter_ffi.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+
+#include "config_parser.h"
+#include "path_mtu.h"
+
+char *WireguardFlutterConfigWithPathMtu(const char *config)
+{
+  std::string result = config;
+  try
+  {
+    uint16_t mtu = wireguard_flutter::DiscoverTunnelMtu(wireguard_flutter::ParseWgQuickConfig(config));
+    if (mtu != 0)
+    {
+      result = wireguard_flutter::SetWgQuickMtu(config, mtu);
+    }
+  }
+  catch (const std::exception &)
+  {
+    // wg-quick reports what is wrong with the config better than we can.
+  }
+  return strdup(result.c_str());
+}
+
+void WireguardFlutterFree(char *string)
+{
+  free(string);
+}
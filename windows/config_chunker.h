@@ -0,0 +1,121 @@
+#ifndef WIREGUARD_FLUTTER_CONFIG_CHUNKER_H
+#define WIREGUARD_FLUTTER_CONFIG_CHUNKER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+namespace wireguard_flutter {
+
+// The flags the chunker sets or clears, as wireguard.h defines them. They
+// are repeated here so the chunker builds and can be tested without the
+// Windows headers.
+constexpr uint32_t kChunkerPeerReplaceAllowedIps = 1 << 5;
+constexpr uint32_t kChunkerPeerUpdate = 1 << 7;
+
+// Streams a WireGuardSetConfiguration layout, an interface followed by each
+// peer and its allowed IPs, as a series of buffers of at most |chunk_bytes|.
+// The first chunk carries the interface as given. Later chunks carry an
+// interface with no flags, so they only add peers and never replace the
+// ones before them. A peer with too many allowed IPs for one chunk
+// continues in the next with WIREGUARD_PEER_UPDATE set and
+// WIREGUARD_PEER_REPLACE_ALLOWED_IPS cleared, adding to the IPs it already
+// has. Applying the chunks in order leaves the adapter as the single blob
+// would, while holding only one chunk in memory and the adapter lock for
+// one chunk at a time.
+//
+// Interface, Peer and AllowedIp are WIREGUARD_INTERFACE, WIREGUARD_PEER and
+// WIREGUARD_ALLOWED_IP, or any types laid out the same with the same
+// Flags, PeersCount and AllowedIPsCount members.
+template <typename Interface, typename Peer, typename AllowedIp>
+class ConfigChunker {
+ public:
+  // Receives each chunk in turn; returning false stops the stream, e.g.
+  // when WireGuardSetConfiguration fails.
+  typedef std::function<bool(const Interface *config, size_t bytes)> Sink;
+
+  // Throws std::runtime_error if |chunk_bytes| cannot hold the interface
+  // and one peer with one allowed IP.
+  ConfigChunker(const Interface &interface, size_t chunk_bytes, Sink sink)
+      : interface_(interface), chunk_bytes_(chunk_bytes), sink_(std::move(sink)) {
+    static_assert(alignof(Interface) == 8 && alignof(Peer) == 8 && alignof(AllowedIp) == 8,
+                  "the configuration layout is 8-byte aligned");
+    if (chunk_bytes < sizeof(Interface) + sizeof(Peer) + sizeof(AllowedIp)) {
+      throw std::runtime_error("configuration chunk too small");
+    }
+    buffer_.reset(new uint64_t[(chunk_bytes + 7) / 8]);
+    Start(interface_);
+  }
+
+  ConfigChunker(const ConfigChunker &) = delete;
+  ConfigChunker &operator=(const ConfigChunker &) = delete;
+
+  // Appends |peer| with |allowed_ips|; its own AllowedIPsCount is ignored.
+  // Returns false if the sink stopped the stream.
+  bool AddPeer(const Peer &peer, const AllowedIp *allowed_ips, size_t count) {
+    Peer record = peer;
+    do {
+      if (used_ + sizeof(Peer) + (count > 0 ? sizeof(AllowedIp) : 0) > chunk_bytes_ && !Flush()) {
+        return false;
+      }
+      size_t fits = std::min(count, (chunk_bytes_ - used_ - sizeof(Peer)) / sizeof(AllowedIp));
+      record.AllowedIPsCount = static_cast<decltype(record.AllowedIPsCount)>(fits);
+      Append(&record, sizeof(record));
+      Append(allowed_ips, fits * sizeof(AllowedIp));
+      peers_++;
+      allowed_ips += fits;
+      count -= fits;
+      // The rest goes to the peer the record above created.
+      record.Flags = static_cast<decltype(record.Flags)>((record.Flags | kChunkerPeerUpdate) &
+                                                         ~kChunkerPeerReplaceAllowedIps);
+    } while (count > 0);
+    return true;
+  }
+
+  // Hands over the last chunk, which holds the interface alone if no peers
+  // were added. Returns false if the sink stopped the stream.
+  bool Finish() { return Flush(); }
+
+  size_t chunks() const { return chunks_; }
+
+ private:
+  void Start(const Interface &interface) {
+    used_ = 0;
+    peers_ = 0;
+    Append(&interface, sizeof(interface));
+  }
+
+  void Append(const void *data, size_t len) {
+    memcpy(reinterpret_cast<uint8_t *>(buffer_.get()) + used_, data, len);
+    used_ += len;
+  }
+
+  bool Flush() {
+    Interface *config = reinterpret_cast<Interface *>(buffer_.get());
+    config->PeersCount = static_cast<decltype(config->PeersCount)>(peers_);
+    chunks_++;
+    if (!sink_(config, used_)) {
+      return false;
+    }
+    Interface next = interface_;
+    next.Flags = static_cast<decltype(next.Flags)>(0);
+    Start(next);
+    return true;
+  }
+
+  Interface interface_;
+  size_t chunk_bytes_;
+  Sink sink_;
+  std::unique_ptr<uint64_t[]> buffer_;
+  size_t used_ = 0;
+  size_t peers_ = 0;
+  size_t chunks_ = 0;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,127 @@
+#include "config_model.h"
+
+#include <stdexcept>
+
+namespace wireguard_flutter
+{
+
+  constexpr uint32_t ConfigModel::kNone;
+
+  size_t ModelEndpointHash::operator()(const ModelEndpoint &endpoint) const
+  {
+    // FNV-1a over the address and port.
+    uint64_t hash = 14695981039346656037ull;
+    for (uint8_t byte : endpoint.address)
+    {
+      hash = (hash ^ byte) * 1099511628211ull;
+    }
+    hash = (hash ^ endpoint.port) * 1099511628211ull;
+    return static_cast<size_t>(hash);
+  }
+
+  void ConfigModel::SetPrivateKey(const Key &key)
+  {
+    private_key_ = key;
+    has_private_key_ = true;
+  }
+
+  void ConfigModel::AddDns(const std::string &name)
+  {
+    dns_.push_back(strings_.Intern(name));
+  }
+
+  size_t ConfigModel::AddPeer(const Key &public_key)
+  {
+    public_keys_.push_back(public_key);
+    preshared_ids_.push_back(kNone);
+    endpoint_ids_.push_back(kNone);
+    keepalives_.push_back(0);
+    tx_bytes_.push_back(0);
+    rx_bytes_.push_back(0);
+    last_handshakes_.push_back(0);
+    prefix_offsets_.push_back(prefix_offsets_.back());
+    return public_keys_.size() - 1;
+  }
+
+  void ConfigModel::SetPresharedKey(size_t peer, const Key &key)
+  {
+    if (preshared_ids_[peer] == kNone)
+    {
+      preshared_ids_[peer] = static_cast<uint32_t>(preshared_keys_.size());
+      preshared_keys_.push_back(key);
+    }
+    else
+    {
+      preshared_keys_[preshared_ids_[peer]] = key;
+    }
+  }
+
+  void ConfigModel::SetEndpoint(size_t peer, const ModelEndpoint &endpoint)
+  {
+    endpoint_ids_[peer] = endpoints_.Intern(endpoint);
+  }
+
+  void ConfigModel::AddAllowedIp(size_t peer, const ModelPrefix &prefix)
+  {
+    if (peer + 1 != peers())
+    {
+      throw std::runtime_error("allowed IPs must be added to the last peer");
+    }
+    prefixes_.push_back(prefix);
+    prefix_offsets_.back() = static_cast<uint32_t>(prefixes_.size());
+  }
+
+  void ConfigModel::SetTransfer(size_t peer, uint64_t tx_bytes, uint64_t rx_bytes, uint64_t last_handshake)
+  {
+    tx_bytes_[peer] = tx_bytes;
+    rx_bytes_[peer] = rx_bytes;
+    last_handshakes_[peer] = last_handshake;
+  }
+
+  void ConfigModel::Reserve(size_t peers, size_t allowed_ips)
+  {
+    public_keys_.reserve(peers);
+    preshared_ids_.reserve(peers);
+    endpoint_ids_.reserve(peers);
+    keepalives_.reserve(peers);
+    tx_bytes_.reserve(peers);
+    rx_bytes_.reserve(peers);
+    last_handshakes_.reserve(peers);
+    prefix_offsets_.reserve(peers + 1);
+    prefixes_.reserve(allowed_ips);
+  }
+
+  uint32_t ConfigModel::FindPeer(const Key &public_key) const
+  {
+    for (size_t i = 0; i < public_keys_.size(); i++)
+    {
+      if (public_keys_[i] == public_key)
+      {
+        return static_cast<uint32_t>(i);
+      }
+    }
+    return kNone;
+  }
+
+  size_t ConfigModel::MemoryUsage() const
+  {
+    size_t bytes = sizeof(*this);
+    bytes += dns_.capacity() * sizeof(uint32_t);
+    bytes += public_keys_.capacity() * sizeof(Key);
+    bytes += preshared_ids_.capacity() * sizeof(uint32_t);
+    bytes += preshared_keys_.capacity() * sizeof(Key);
+    bytes += endpoint_ids_.capacity() * sizeof(uint32_t);
+    bytes += keepalives_.capacity() * sizeof(uint16_t);
+    bytes += (tx_bytes_.capacity() + rx_bytes_.capacity() + last_handshakes_.capacity()) * sizeof(uint64_t);
+    bytes += prefix_offsets_.capacity() * sizeof(uint32_t);
+    bytes += prefixes_.capacity() * sizeof(ModelPrefix);
+    // Each value, plus a hash set node and bucket per id.
+    bytes += endpoints_.size() * (sizeof(ModelEndpoint) + 4 * sizeof(void *));
+    for (size_t i = 0; i < strings_.size(); i++)
+    {
+      bytes += sizeof(std::string) + strings_.Get(i).capacity() + 4 * sizeof(void *);
+    }
+    return bytes;
+  }
+
+} // namespace wireguard_flutter
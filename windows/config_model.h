@@ -0,0 +1,343 @@
+#ifndef WIREGUARD_FLUTTER_CONFIG_MODEL_H
+#define WIREGUARD_FLUTTER_CONFIG_MODEL_H
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#endif
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace wireguard_flutter {
+
+// The wireguard.h flags the model reads and writes, repeated like the
+// chunker's so the model builds and can be tested without the Windows
+// headers.
+constexpr uint32_t kModelInterfaceHasPrivateKey = 1 << 1;
+constexpr uint32_t kModelInterfaceHasListenPort = 1 << 2;
+constexpr uint32_t kModelInterfaceReplacePeers = 1 << 3;
+constexpr uint32_t kModelPeerHasPublicKey = 1 << 0;
+constexpr uint32_t kModelPeerHasPresharedKey = 1 << 1;
+constexpr uint32_t kModelPeerHasPersistentKeepalive = 1 << 2;
+constexpr uint32_t kModelPeerHasEndpoint = 1 << 3;
+constexpr uint32_t kModelPeerReplaceAllowedIps = 1 << 5;
+
+// A resolved endpoint, as the adapter takes it.
+struct ModelEndpoint {
+  uint8_t address[16] = {0};
+  // AF_INET or AF_INET6.
+  uint16_t family = 0;
+  // Host byte order.
+  uint16_t port = 0;
+
+  bool operator==(const ModelEndpoint &other) const {
+    return family == other.family && port == other.port && memcmp(address, other.address, sizeof(address)) == 0;
+  }
+};
+
+struct ModelPrefix {
+  uint8_t address[16] = {0};
+  // 4 or 6, which fits in a byte where AF_INET6 differs between systems.
+  uint8_t version = 0;
+  uint8_t cidr = 0;
+};
+
+// Hands out a small id per distinct value, so values repeated across peers
+// are stored once. Ids stay valid as long as the pool.
+template <typename T, typename Hash>
+class InternPool {
+ public:
+  InternPool() : ids_(16, IdHash{&values_}, IdEqual{&values_}) {}
+
+  InternPool(const InternPool &) = delete;
+  InternPool &operator=(const InternPool &) = delete;
+
+  uint32_t Intern(const T &value) {
+    // Looks up by adding the value as the next id, as the set hashes ids
+    // through |values_|; takes it back out if it was already there.
+    values_.push_back(value);
+    auto inserted = ids_.insert(static_cast<uint32_t>(values_.size() - 1));
+    if (!inserted.second) {
+      values_.pop_back();
+    }
+    return *inserted.first;
+  }
+
+  const T &Get(uint32_t id) const { return values_[id]; }
+
+  size_t size() const { return values_.size(); }
+
+ private:
+  struct IdHash {
+    const std::vector<T> *values;
+    size_t operator()(uint32_t id) const { return Hash()((*values)[id]); }
+  };
+  struct IdEqual {
+    const std::vector<T> *values;
+    bool operator()(uint32_t a, uint32_t b) const { return (*values)[a] == (*values)[b]; }
+  };
+
+  std::vector<T> values_;
+  std::unordered_set<uint32_t, IdHash, IdEqual> ids_;
+};
+
+struct ModelEndpointHash {
+  size_t operator()(const ModelEndpoint &endpoint) const;
+};
+
+// An adapter configuration held column by column: each peer attribute is
+// its own array indexed by peer, keys are fixed arrays, endpoints and DNS
+// names are interned, and the allowed IPs of all peers share one prefix
+// array that each peer indexes by offset. A peer without a preshared key,
+// endpoint or allowed IPs costs nothing for them, and a pass over one
+// attribute of every peer reads only that attribute's memory.
+//
+// Peers are added in order, and a peer's allowed IPs must be added before
+// the next peer. Converts to and from the WIREGUARD_INTERFACE layout that
+// WireGuardSetConfiguration and WireGuardGetConfiguration use; Interface,
+// Peer and AllowedIp are the wireguard.h types, or any laid out the same
+// with the same member names.
+class ConfigModel {
+ public:
+  typedef std::array<uint8_t, 32> Key;
+  static constexpr uint32_t kNone = UINT32_MAX;
+
+  ConfigModel() = default;
+
+  ConfigModel(const ConfigModel &) = delete;
+  ConfigModel &operator=(const ConfigModel &) = delete;
+
+  void SetPrivateKey(const Key &key);
+  bool has_private_key() const { return has_private_key_; }
+  const Key &private_key() const { return private_key_; }
+
+  void SetListenPort(uint16_t port) { listen_port_ = port; }
+  uint16_t listen_port() const { return listen_port_; }
+
+  void AddDns(const std::string &name);
+  size_t dns_count() const { return dns_.size(); }
+  const std::string &dns(size_t i) const { return strings_.Get(dns_[i]); }
+
+  // Returns the new peer's index.
+  size_t AddPeer(const Key &public_key);
+  void SetPresharedKey(size_t peer, const Key &key);
+  void SetEndpoint(size_t peer, const ModelEndpoint &endpoint);
+  void SetPersistentKeepalive(size_t peer, uint16_t seconds) { keepalives_[peer] = seconds; }
+  // Throws std::runtime_error unless |peer| is the last one added.
+  void AddAllowedIp(size_t peer, const ModelPrefix &prefix);
+  // Counters as the adapter reported them; zero for peers not read back.
+  void SetTransfer(size_t peer, uint64_t tx_bytes, uint64_t rx_bytes, uint64_t last_handshake);
+
+  void Reserve(size_t peers, size_t allowed_ips);
+
+  size_t peers() const { return public_keys_.size(); }
+  const Key &public_key(size_t peer) const { return public_keys_[peer]; }
+  // Null if the peer has none.
+  const Key *preshared_key(size_t peer) const {
+    return preshared_ids_[peer] == kNone ? nullptr : &preshared_keys_[preshared_ids_[peer]];
+  }
+  // Null if the peer has none.
+  const ModelEndpoint *endpoint(size_t peer) const {
+    return endpoint_ids_[peer] == kNone ? nullptr : &endpoints_.Get(endpoint_ids_[peer]);
+  }
+  uint16_t persistent_keepalive(size_t peer) const { return keepalives_[peer]; }
+  const ModelPrefix *allowed_ips(size_t peer) const { return prefixes_.data() + prefix_offsets_[peer]; }
+  size_t allowed_ip_count(size_t peer) const { return prefix_offsets_[peer + 1] - prefix_offsets_[peer]; }
+  uint64_t tx_bytes(size_t peer) const { return tx_bytes_[peer]; }
+  uint64_t rx_bytes(size_t peer) const { return rx_bytes_[peer]; }
+  uint64_t last_handshake(size_t peer) const { return last_handshakes_[peer]; }
+
+  // The index of the peer with |public_key|, or kNone. Scans the keys,
+  // which are contiguous, so suits occasional lookups.
+  uint32_t FindPeer(const Key &public_key) const;
+
+  // Bytes held by the model, for comparing with other representations.
+  size_t MemoryUsage() const;
+
+  // The size of the configuration in the WIREGUARD_INTERFACE layout.
+  template <typename Interface, typename Peer, typename AllowedIp>
+  size_t PackedSize() const {
+    return sizeof(Interface) + peers() * sizeof(Peer) + prefixes_.size() * sizeof(AllowedIp);
+  }
+
+  // Writes the configuration to |buffer|, which must be 8-byte aligned and
+  // hold PackedSize() bytes, so that applying it replaces the adapter's
+  // peers with the model's.
+  template <typename Interface, typename Peer, typename AllowedIp>
+  void ToPacked(void *buffer) const {
+    uint8_t *out = static_cast<uint8_t *>(buffer);
+    Interface *config = reinterpret_cast<Interface *>(out);
+    memset(config, 0, sizeof(Interface));
+    uint32_t flags = kModelInterfaceHasListenPort | kModelInterfaceReplacePeers;
+    if (has_private_key_) {
+      flags |= kModelInterfaceHasPrivateKey;
+      memcpy(config->PrivateKey, private_key_.data(), sizeof(config->PrivateKey));
+    }
+    config->Flags = static_cast<decltype(config->Flags)>(flags);
+    config->ListenPort = listen_port_;
+    config->PeersCount = static_cast<decltype(config->PeersCount)>(peers());
+    out += sizeof(Interface);
+
+    for (size_t i = 0; i < peers(); i++) {
+      Peer *peer = reinterpret_cast<Peer *>(out);
+      memset(peer, 0, sizeof(Peer));
+      flags = kModelPeerHasPublicKey | kModelPeerHasPersistentKeepalive | kModelPeerReplaceAllowedIps;
+      memcpy(peer->PublicKey, public_keys_[i].data(), sizeof(peer->PublicKey));
+      if (const Key *psk = preshared_key(i)) {
+        flags |= kModelPeerHasPresharedKey;
+        memcpy(peer->PresharedKey, psk->data(), sizeof(peer->PresharedKey));
+      }
+      if (const ModelEndpoint *endpoint = this->endpoint(i)) {
+        flags |= kModelPeerHasEndpoint;
+        WriteEndpoint(*endpoint, &peer->Endpoint);
+      }
+      peer->Flags = static_cast<decltype(peer->Flags)>(flags);
+      peer->PersistentKeepalive = keepalives_[i];
+      peer->AllowedIPsCount = static_cast<decltype(peer->AllowedIPsCount)>(allowed_ip_count(i));
+      out += sizeof(Peer);
+
+      for (const ModelPrefix *prefix = allowed_ips(i), *end = prefix + allowed_ip_count(i); prefix != end;
+           prefix++) {
+        AllowedIp *ip = reinterpret_cast<AllowedIp *>(out);
+        memset(ip, 0, sizeof(AllowedIp));
+        if (prefix->version == 4) {
+          ip->AddressFamily = AF_INET;
+          memcpy(&ip->Address.V4, prefix->address, 4);
+        } else {
+          ip->AddressFamily = AF_INET6;
+          memcpy(&ip->Address.V6, prefix->address, 16);
+        }
+        ip->Cidr = prefix->cidr;
+        out += sizeof(AllowedIp);
+      }
+    }
+  }
+
+  // Reads what WireGuardGetConfiguration returned into an empty model,
+  // counters included. Throws std::runtime_error if |bytes| ends inside a
+  // record.
+  template <typename Interface, typename Peer, typename AllowedIp>
+  void FromPacked(const void *buffer, size_t bytes) {
+    const uint8_t *in = static_cast<const uint8_t *>(buffer);
+    const uint8_t *end = in + bytes;
+    if (bytes < sizeof(Interface)) {
+      throw std::runtime_error("truncated adapter configuration");
+    }
+    const Interface *config = reinterpret_cast<const Interface *>(in);
+    if (config->Flags & kModelInterfaceHasPrivateKey) {
+      Key key;
+      memcpy(key.data(), config->PrivateKey, key.size());
+      SetPrivateKey(key);
+    }
+    listen_port_ = config->ListenPort;
+    in += sizeof(Interface);
+    Reserve(config->PeersCount, (end - in) / sizeof(AllowedIp));
+
+    for (size_t i = 0; i < config->PeersCount; i++) {
+      if (static_cast<size_t>(end - in) < sizeof(Peer)) {
+        throw std::runtime_error("truncated adapter configuration");
+      }
+      const Peer *peer = reinterpret_cast<const Peer *>(in);
+      in += sizeof(Peer);
+      if (static_cast<size_t>(end - in) / sizeof(AllowedIp) < peer->AllowedIPsCount) {
+        throw std::runtime_error("truncated adapter configuration");
+      }
+      Key key;
+      memcpy(key.data(), peer->PublicKey, key.size());
+      size_t index = AddPeer(key);
+      if (peer->Flags & kModelPeerHasPresharedKey) {
+        memcpy(key.data(), peer->PresharedKey, key.size());
+        SetPresharedKey(index, key);
+      }
+      ModelEndpoint endpoint;
+      if ((peer->Flags & kModelPeerHasEndpoint) && ReadEndpoint(peer->Endpoint, &endpoint)) {
+        SetEndpoint(index, endpoint);
+      }
+      keepalives_[index] = peer->PersistentKeepalive;
+      SetTransfer(index, peer->TxBytes, peer->RxBytes, peer->LastHandshake);
+
+      for (size_t j = 0; j < peer->AllowedIPsCount; j++) {
+        const AllowedIp *ip = reinterpret_cast<const AllowedIp *>(in);
+        ModelPrefix prefix;
+        if (ip->AddressFamily == AF_INET) {
+          prefix.version = 4;
+          memcpy(prefix.address, &ip->Address.V4, 4);
+        } else {
+          prefix.version = 6;
+          memcpy(prefix.address, &ip->Address.V6, 16);
+        }
+        prefix.cidr = ip->Cidr;
+        prefixes_.push_back(prefix);
+        in += sizeof(AllowedIp);
+      }
+      prefix_offsets_.back() = static_cast<uint32_t>(prefixes_.size());
+    }
+  }
+
+ private:
+  // SOCKADDR_INET: a union of Ipv4 and Ipv6 sockaddrs and si_family.
+  template <typename SockaddrInet>
+  static void WriteEndpoint(const ModelEndpoint &endpoint, SockaddrInet *out) {
+    uint8_t port[2] = {static_cast<uint8_t>(endpoint.port >> 8), static_cast<uint8_t>(endpoint.port)};
+    if (endpoint.family == AF_INET) {
+      out->Ipv4.sin_family = AF_INET;
+      memcpy(&out->Ipv4.sin_port, port, 2);
+      memcpy(&out->Ipv4.sin_addr, endpoint.address, 4);
+    } else {
+      out->Ipv6.sin6_family = AF_INET6;
+      memcpy(&out->Ipv6.sin6_port, port, 2);
+      memcpy(&out->Ipv6.sin6_addr, endpoint.address, 16);
+    }
+  }
+
+  template <typename SockaddrInet>
+  static bool ReadEndpoint(const SockaddrInet &in, ModelEndpoint *endpoint) {
+    uint8_t port[2];
+    if (in.si_family == AF_INET) {
+      memcpy(port, &in.Ipv4.sin_port, 2);
+      memcpy(endpoint->address, &in.Ipv4.sin_addr, 4);
+    } else if (in.si_family == AF_INET6) {
+      memcpy(port, &in.Ipv6.sin6_port, 2);
+      memcpy(endpoint->address, &in.Ipv6.sin6_addr, 16);
+    } else {
+      return false;
+    }
+    endpoint->family = static_cast<uint16_t>(in.si_family);
+    endpoint->port = static_cast<uint16_t>(port[0] << 8 | port[1]);
+    return true;
+  }
+
+  Key private_key_{};
+  bool has_private_key_ = false;
+  uint16_t listen_port_ = 0;
+  std::vector<uint32_t> dns_;
+
+  std::vector<Key> public_keys_;
+  std::vector<uint32_t> preshared_ids_;
+  std::vector<Key> preshared_keys_;
+  std::vector<uint32_t> endpoint_ids_;
+  std::vector<uint16_t> keepalives_;
+  std::vector<uint64_t> tx_bytes_;
+  std::vector<uint64_t> rx_bytes_;
+  std::vector<uint64_t> last_handshakes_;
+  // Peer i's allowed IPs are prefixes_[prefix_offsets_[i]] up to
+  // prefixes_[prefix_offsets_[i + 1]].
+  std::vector<uint32_t> prefix_offsets_{0};
+  std::vector<ModelPrefix> prefixes_;
+
+  InternPool<ModelEndpoint, ModelEndpointHash> endpoints_;
+  InternPool<std::string, std::hash<std::string>> strings_;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
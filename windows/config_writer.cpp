@@ -4,11 +4,14 @@
 #include <stdexcept>
 #include <string>
 
+#include "tracer.h"
+
 namespace wireguard_flutter
 {
 
   std::wstring WriteConfigToTempFile(std::string config)
   {
+    TraceSpan span("WriteConfigToTempFile");
     WCHAR temp_path[MAX_PATH];
     DWORD temp_path_len = GetTempPath(MAX_PATH, temp_path);
     if (temp_path_len > MAX_PATH || temp_path_len == 0)
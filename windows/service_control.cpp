@@ -8,9 +8,11 @@
 
 #include <windows.h>
 
+#include <sstream>
 #include <stdexcept>
 #include <string>
 
+#include "tracer.h"
 #include "utils.h"
 #include <iostream>
 
@@ -42,6 +44,7 @@ namespace wireguard_flutter
 
   void ServiceControl::CreateAndStart(CreateArgs args)
   {
+    TraceSpan span("CreateAndStart", args.first_time ? "first_time" : "recreate");
     SC_HANDLE service_manager = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
     if (service_manager == NULL)
     {
@@ -54,6 +57,7 @@ namespace wireguard_flutter
       CloseServiceHandle(service);
 
       EmitState("connecting");
+      TraceSpan create_span("CreateService");
       service = CreateService(service_manager,                  // SCM database
                               &service_name_[0],                // name of service
                               &service_name_[0],                // service name to display
@@ -124,7 +128,12 @@ namespace wireguard_flutter
 
     EmitState("connecting");
 
-    if (!StartService(service, 0, NULL))
+    BOOL started;
+    {
+      TraceSpan start_span("StartService");
+      started = StartService(service, 0, NULL);
+    }
+    if (!started)
     {
       std::cout << "wireguard_flutter: Failed to start the service: " << GetLastError() << std::endl;
 
@@ -152,7 +161,10 @@ namespace wireguard_flutter
       dwWaitTime = 1000;
     else if (dwWaitTime > 1500)
       dwWaitTime = 1500;
-    Sleep(dwWaitTime);
+    {
+      TraceSpan wait_span("WaitForStart");
+      Sleep(dwWaitTime);
+    }
 
     // If the service is too old, it may fail to start and needs to be recreated.
     // This is done only once. If it fails twice, the error is propagated.
@@ -185,6 +197,7 @@ namespace wireguard_flutter
 
   void ServiceControl::Stop()
   {
+    TraceSpan span("Stop");
     SC_HANDLE service_manager = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
     if (service_manager == NULL)
     {
@@ -298,8 +311,55 @@ namespace wireguard_flutter
     CloseServiceHandle(service_manager);
   }
 
+  void ServiceControl::Delete()
+  {
+    SC_HANDLE service_manager = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
+    if (service_manager == NULL)
+    {
+      throw ServiceControlException("Failed to open service manager", GetLastError());
+    }
+
+    SC_HANDLE service = OpenService(service_manager, &service_name_[0], DELETE);
+    if (service == NULL)
+    {
+      CloseServiceHandle(service_manager);
+      return;
+    }
+
+    if (!DeleteService(service) && GetLastError() != ERROR_SERVICE_MARKED_FOR_DELETE)
+    {
+      DWORD error = GetLastError();
+      CloseServiceHandle(service);
+      CloseServiceHandle(service_manager);
+      throw ServiceControlException("Failed to delete the service", error);
+    }
+
+    CloseServiceHandle(service);
+    CloseServiceHandle(service_manager);
+  }
+
+  bool ServiceControl::WaitForRunning(unsigned long timeout_ms)
+  {
+    TraceSpan span("WaitForRunning");
+    DWORD start_time = GetTickCount();
+    for (;;)
+    {
+      std::string status = GetStatus();
+      if (status != "connecting")
+      {
+        return status == "connected";
+      }
+      if (GetTickCount() - start_time > timeout_ms)
+      {
+        return false;
+      }
+      Sleep(100);
+    }
+  }
+
   std::string ServiceControl::GetStatus()
   {
+    TraceSpan span("GetStatus");
     SC_HANDLE service_manager = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
     if (service_manager == NULL)
     {
@@ -371,6 +431,7 @@ namespace wireguard_flutter
 
   void ServiceControl::EmitState(std::string state)
   {
+    TraceSpan span("EmitState", state.c_str());
     if (events_ == nullptr)
     {
       return;
@@ -378,4 +439,16 @@ namespace wireguard_flutter
     events_->Success(flutter::EncodableValue(state));
   }
 
+  std::wstring TunnelServiceCommandLine(const std::wstring &config_file)
+  {
+    wchar_t module_filename[MAX_PATH];
+    GetModuleFileName(NULL, module_filename, MAX_PATH);
+    auto current_exec_dir = std::wstring(module_filename);
+    current_exec_dir = current_exec_dir.substr(0, current_exec_dir.find_last_of(L"\\/"));
+    std::wostringstream service_exec_builder;
+    service_exec_builder << current_exec_dir << "\\wireguard_svc.exe" << L" -service"
+                         << L" -config-file=\"" << config_file << "\"";
+    return service_exec_builder.str();
+  }
+
 } // namespace wireguard_flutter
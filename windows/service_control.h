@@ -25,13 +25,25 @@ class ServiceControl {
   ServiceControl(const std::wstring service_name) : service_name_(service_name) {}
 
   void CreateAndStart(CreateArgs args);
+  // Waits up to |timeout_ms| for the service to finish starting, which
+  // CreateAndStart() does not, and returns whether it is running. The tunnel
+  // service reports running once it has read its config and brought its
+  // adapter up.
+  bool WaitForRunning(unsigned long timeout_ms);
   void Stop();
+  // Marks the service for deletion, e.g. so the next CreateAndStart
+  // registers it afresh with new arguments. It goes once it has stopped.
+  void Delete();
   std::string GetStatus();
   void RegisterListener(std::unique_ptr<flutter::EventSink<flutter::EncodableValue>> &&events);
   void UnregisterListener();
   void EmitState(std::string state);
 };
 
+// The command line that runs wireguard_svc.exe, from the running
+// executable's directory, as a tunnel service for |config_file|.
+std::wstring TunnelServiceCommandLine(const std::wstring &config_file);
+
 }  // namespace wireguard_flutter
 
 #endif
@@ -0,0 +1,316 @@
+#include "service_tunnel_backend.h"
+
+#include <winsock2.h>
+#include <windows.h>
+#include <iphlpapi.h>
+#include <netioapi.h>
+#include <wireguard.h>
+
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+
+#include "config_model.h"
+#include "config_writer.h"
+#include "utils.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // The routed tunnel's adapter wins over every other interface; the
+    // rest sit at the highest metric, so Windows only uses them for their
+    // own endpoints.
+    const ULONG kRoutedMetric = 0;
+    const ULONG kUnroutedMetric = 9999;
+
+    // How long a tunnel service has to come up, and its adapter to take a
+    // metric.
+    const DWORD kStartTimeoutMs = 15000;
+    const DWORD kPollIntervalMs = 100;
+
+    // Sets the interface metric of |adapter| for IPv4 and IPv6 and reads it
+    // back. Returns the error, ERROR_NOT_FOUND while the adapter or its IP
+    // interfaces are not up yet, or ERROR_INVALID_DATA if the metric did not
+    // stick.
+    DWORD TrySetAdapterMetric(const std::wstring &adapter, ULONG metric)
+    {
+      NET_LUID luid;
+      DWORD error = ConvertInterfaceAliasToLuid(adapter.c_str(), &luid);
+      if (error != NO_ERROR)
+      {
+        return error;
+      }
+      int families = 0;
+      for (ADDRESS_FAMILY family : {AF_INET, AF_INET6})
+      {
+        MIB_IPINTERFACE_ROW row;
+        InitializeIpInterfaceEntry(&row);
+        row.Family = family;
+        row.InterfaceLuid = luid;
+        error = GetIpInterfaceEntry(&row);
+        if (error == ERROR_NOT_FOUND)
+        {
+          continue;
+        }
+        if (error != NO_ERROR)
+        {
+          return error;
+        }
+        families++;
+        row.UseAutomaticMetric = FALSE;
+        row.Metric = metric;
+        if (family == AF_INET)
+        {
+          // SetIpInterfaceEntry rejects IPv4 rows with this set.
+          row.SitePrefixLength = 0;
+        }
+        error = SetIpInterfaceEntry(&row);
+        if (error != NO_ERROR)
+        {
+          return error;
+        }
+        InitializeIpInterfaceEntry(&row);
+        row.Family = family;
+        row.InterfaceLuid = luid;
+        error = GetIpInterfaceEntry(&row);
+        if (error != NO_ERROR)
+        {
+          return error;
+        }
+        if (row.UseAutomaticMetric || row.Metric != metric)
+        {
+          return ERROR_INVALID_DATA;
+        }
+      }
+      return families == 0 ? ERROR_NOT_FOUND : NO_ERROR;
+    }
+
+    // Sets the interface metric of |adapter| for IPv4 and IPv6, retrying
+    // while the adapter is still coming up or the metric does not stick.
+    void SetAdapterMetric(const std::wstring &adapter, ULONG metric)
+    {
+      DWORD start_time = GetTickCount();
+      for (;;)
+      {
+        DWORD error = TrySetAdapterMetric(adapter, metric);
+        if (error == NO_ERROR)
+        {
+          return;
+        }
+        if (GetTickCount() - start_time > kStartTimeoutMs)
+        {
+          throw std::runtime_error(ErrorWithCode("Failed to set the tunnel adapter's metric", error));
+        }
+        Sleep(kPollIntervalMs);
+      }
+    }
+
+    std::wstring AdapterNameFromConfigFile(const std::wstring &config_file)
+    {
+      std::wstring name = config_file.substr(config_file.find_last_of(L"\\/") + 1);
+      const std::wstring extension = L".conf";
+      if (name.size() > extension.size() &&
+          name.compare(name.size() - extension.size(), extension.size(), extension) == 0)
+      {
+        name.resize(name.size() - extension.size());
+      }
+      return name;
+    }
+
+  } // namespace
+
+  ServiceTunnelBackend::ServiceTunnelBackend(const std::wstring &service_name) : service_name_(service_name) {}
+
+  ServiceTunnelBackend::~ServiceTunnelBackend()
+  {
+    if (wireguard_ != NULL)
+    {
+      FreeLibrary(wireguard_);
+    }
+  }
+
+  TunnelBackend::Tunnel ServiceTunnelBackend::Adopt(const std::wstring &service_name, const std::wstring &config_file)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Tunnel tunnel = next_++;
+    Entry &entry = tunnels_[tunnel];
+    entry.service = std::make_unique<ServiceControl>(service_name);
+    entry.adapter_name = AdapterNameFromConfigFile(config_file);
+    entry.owned = false;
+    return tunnel;
+  }
+
+  TunnelBackend::Tunnel ServiceTunnelBackend::Start(const std::string &config)
+  {
+    std::wstring config_file = WriteConfigToTempFile(config);
+    Tunnel tunnel;
+    ServiceControl *service;
+    {
+      // Takes the lowest slot no live tunnel uses.
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::set<std::wstring> names;
+      for (const auto &it : tunnels_)
+      {
+        names.insert(it.second.service->service_name_);
+      }
+      int slot = 1;
+      while (names.count(service_name_ + L"_" + std::to_wstring(slot)) != 0)
+      {
+        slot++;
+      }
+      std::wstring name = service_name_ + L"_" + std::to_wstring(slot);
+      tunnel = next_++;
+      Entry &entry = tunnels_[tunnel];
+      entry.service = std::make_unique<ServiceControl>(name);
+      entry.adapter_name = AdapterNameFromConfigFile(config_file);
+      entry.owned = true;
+      service = entry.service.get();
+    }
+
+    try
+    {
+      // A service left from before would start with its old config.
+      service->Delete();
+      CreateArgs csa;
+      csa.description = service->service_name_ + L" WireGuard tunnel";
+      csa.executable_and_args = TunnelServiceCommandLine(config_file);
+      csa.dependencies = L"Nsi\0TcpIp\0";
+      csa.first_time = true;
+      service->CreateAndStart(csa);
+      // Until the service is running, its adapter may not exist yet, and it
+      // may still be configuring it over the metric.
+      if (!service->WaitForRunning(kStartTimeoutMs))
+      {
+        throw std::runtime_error("The tunnel service did not start");
+      }
+      // The service has read the config, and its private key should not
+      // sit on disk.
+      DeleteFileW(config_file.c_str());
+      // The service routes through its adapter as it comes up; keeps it
+      // out of the way until it is picked.
+      SetAdapterMetric(AdapterName(tunnel), kUnroutedMetric);
+    }
+    catch (...)
+    {
+      DeleteFileW(config_file.c_str());
+      try
+      {
+        Stop(tunnel);
+      }
+      catch (...)
+      {
+      }
+      throw;
+    }
+    return tunnel;
+  }
+
+  bool ServiceTunnelBackend::HandshakeDone(Tunnel tunnel)
+  {
+    if (!LoadWireGuardApi())
+    {
+      return false;
+    }
+    auto open_adapter = reinterpret_cast<WIREGUARD_OPEN_ADAPTER_FUNC *>(open_adapter_);
+    auto close_adapter = reinterpret_cast<WIREGUARD_CLOSE_ADAPTER_FUNC *>(close_adapter_);
+    auto get_configuration = reinterpret_cast<WIREGUARD_GET_CONFIGURATION_FUNC *>(get_configuration_);
+
+    WIREGUARD_ADAPTER_HANDLE adapter = open_adapter(AdapterName(tunnel).c_str());
+    if (adapter == NULL)
+    {
+      return false;
+    }
+    DWORD bytes = 4096;
+    std::unique_ptr<uint64_t[]> buffer;
+    for (;;)
+    {
+      buffer.reset(new uint64_t[(bytes + 7) / 8]);
+      if (get_configuration(adapter, reinterpret_cast<WIREGUARD_INTERFACE *>(buffer.get()), &bytes))
+      {
+        break;
+      }
+      if (GetLastError() != ERROR_MORE_DATA)
+      {
+        close_adapter(adapter);
+        return false;
+      }
+    }
+    close_adapter(adapter);
+
+    ConfigModel model;
+    model.FromPacked<WIREGUARD_INTERFACE, WIREGUARD_PEER, WIREGUARD_ALLOWED_IP>(buffer.get(), bytes);
+    for (size_t i = 0; i < model.peers(); i++)
+    {
+      if (model.last_handshake(i) != 0)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void ServiceTunnelBackend::Route(Tunnel tunnel, Tunnel previous)
+  {
+    // Lowers the new adapter first: for a moment both tunnels carry
+    // traffic, rather than neither.
+    SetAdapterMetric(AdapterName(tunnel), kRoutedMetric);
+    if (previous != kNoTunnel)
+    {
+      SetAdapterMetric(AdapterName(previous), kUnroutedMetric);
+    }
+  }
+
+  void ServiceTunnelBackend::Stop(Tunnel tunnel)
+  {
+    Entry entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = tunnels_.find(tunnel);
+      if (it == tunnels_.end())
+      {
+        return;
+      }
+      entry = std::move(it->second);
+      tunnels_.erase(it);
+    }
+    entry.service->Stop();
+    if (entry.owned)
+    {
+      entry.service->Delete();
+    }
+  }
+
+  std::wstring ServiceTunnelBackend::AdapterName(Tunnel tunnel)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tunnels_.find(tunnel);
+    if (it == tunnels_.end())
+    {
+      throw std::runtime_error("no such tunnel");
+    }
+    return it->second.adapter_name;
+  }
+
+  bool ServiceTunnelBackend::LoadWireGuardApi()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (wireguard_ == NULL)
+    {
+      wireguard_ = LoadLibraryExW(L"wireguard.dll", NULL,
+                                  LOAD_LIBRARY_SEARCH_APPLICATION_DIR | LOAD_LIBRARY_SEARCH_SYSTEM32);
+      if (wireguard_ == NULL)
+      {
+        return false;
+      }
+      open_adapter_ = GetProcAddress(wireguard_, "WireGuardOpenAdapter");
+      close_adapter_ = GetProcAddress(wireguard_, "WireGuardCloseAdapter");
+      get_configuration_ = GetProcAddress(wireguard_, "WireGuardGetConfiguration");
+    }
+    return open_adapter_ != NULL && close_adapter_ != NULL && get_configuration_ != NULL;
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,63 @@
+#ifndef WIREGUARD_FLUTTER_SERVICE_TUNNEL_BACKEND_H
+#define WIREGUARD_FLUTTER_SERVICE_TUNNEL_BACKEND_H
+
+#include <windows.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "service_control.h"
+#include "tunnel_switcher.h"
+
+namespace wireguard_flutter {
+
+// Runs each tunnel as its own wireguard_svc.exe service, named after the
+// plugin's service with a slot number, so tunnels can run side by side.
+// Traffic is steered by the adapters' interface metrics: the routed
+// tunnel's adapter gets the lowest, the others one Windows never prefers.
+// Handshakes are read from the adapter through wireguard.dll.
+class ServiceTunnelBackend : public TunnelBackend {
+ public:
+  explicit ServiceTunnelBackend(const std::wstring &service_name);
+  ~ServiceTunnelBackend();
+
+  ServiceTunnelBackend(const ServiceTunnelBackend &) = delete;
+  ServiceTunnelBackend &operator=(const ServiceTunnelBackend &) = delete;
+
+  // Takes on the tunnel the plugin started itself as |service_name| with
+  // |config_file|, so it can be switched away from.
+  Tunnel Adopt(const std::wstring &service_name, const std::wstring &config_file);
+
+  Tunnel Start(const std::string &config) override;
+  bool HandshakeDone(Tunnel tunnel) override;
+  void Route(Tunnel tunnel, Tunnel previous) override;
+  void Stop(Tunnel tunnel) override;
+
+ private:
+  struct Entry {
+    std::unique_ptr<ServiceControl> service;
+    // The service names the tunnel and its adapter after the config file.
+    std::wstring adapter_name;
+    // Slot services are deleted once stopped; an adopted one is left.
+    bool owned;
+  };
+
+  std::wstring AdapterName(Tunnel tunnel);
+  bool LoadWireGuardApi();
+
+  std::wstring service_name_;
+  std::mutex mutex_;
+  std::map<Tunnel, Entry> tunnels_;
+  Tunnel next_ = 0;
+
+  HMODULE wireguard_ = NULL;
+  FARPROC open_adapter_ = NULL;
+  FARPROC close_adapter_ = NULL;
+  FARPROC get_configuration_ = NULL;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
@@ -0,0 +1,127 @@
+// Handing 50k peers with four allowed IPs each to the adapter: built whole
+// as one WireGuardSetConfiguration blob, against streamed through the
+// chunker in bounded chunks. Reports the time and how far each pushes the
+// peak resident set above where it started.
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "benchmark.h"
+#include "config_chunker.h"
+#include "wireguard_layout.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    typedef ConfigChunker<test::Interface, test::Peer, test::AllowedIp> Chunker;
+
+    const size_t kPeers = 50000;
+    const size_t kAllowedIps = 4;
+
+    test::Peer MakePeer(size_t index)
+    {
+      test::Peer peer;
+      memset(&peer, 0, sizeof(peer));
+      peer.Flags = 1 | kChunkerPeerReplaceAllowedIps;
+      memcpy(peer.PublicKey, &index, sizeof(index));
+      return peer;
+    }
+
+    void MakeAllowedIps(size_t index, test::AllowedIp *allowed_ips)
+    {
+      for (size_t i = 0; i < kAllowedIps; i++)
+      {
+        memset(&allowed_ips[i], 0, sizeof(allowed_ips[i]));
+        allowed_ips[i].AddressFamily = AF_INET;
+        allowed_ips[i].Cidr = 32;
+        uint32_t address = htonl(static_cast<uint32_t>(0x0a000000 + index * kAllowedIps + i));
+        memcpy(&allowed_ips[i].Address.V4, &address, sizeof(address));
+      }
+    }
+
+    // Stands in for WireGuardSetConfiguration, which reads all of what it
+    // is given.
+    uint64_t Apply(const void *config, size_t bytes)
+    {
+      uint64_t sum = 0;
+      const uint8_t *data = static_cast<const uint8_t *>(config);
+      for (size_t i = 0; i < bytes; i += 64)
+      {
+        sum += data[i];
+      }
+      return sum;
+    }
+
+    void Report(const char *name, double elapsed, size_t baseline, size_t chunks)
+    {
+      size_t peak = benchmark::PeakMemory();
+      printf("%-15s %7.1f ms  peak +%7.2f MB  %5zu chunk(s)\n", name, elapsed * 1e3,
+             (peak > baseline ? peak - baseline : 0) / 1e6, chunks);
+    }
+
+  } // namespace
+
+  BENCHMARK(config_chunker)
+  {
+    test::Interface interface;
+    memset(&interface, 0, sizeof(interface));
+    test::AllowedIp allowed_ips[kAllowedIps];
+    uint64_t sum = 0;
+
+    const size_t chunk_sizes[] = {64 * 1024, 1024 * 1024};
+    for (size_t chunk_bytes : chunk_sizes)
+    {
+      benchmark::ResetPeakMemory();
+      size_t baseline = benchmark::CurrentMemory();
+      double start = benchmark::Now();
+      Chunker chunker(interface, chunk_bytes, [&sum](const test::Interface *config, size_t bytes)
+                      {
+                        sum += Apply(config, bytes);
+                        return true;
+                      });
+      for (size_t i = 0; i < kPeers; i++)
+      {
+        MakeAllowedIps(i, allowed_ips);
+        chunker.AddPeer(MakePeer(i), allowed_ips, kAllowedIps);
+      }
+      chunker.Finish();
+      char name[32];
+      snprintf(name, sizeof(name), "chunked %zu KB", chunk_bytes / 1024);
+      Report(name, benchmark::Now() - start, baseline, chunker.chunks());
+    }
+
+    {
+      benchmark::ResetPeakMemory();
+      size_t baseline = benchmark::CurrentMemory();
+      double start = benchmark::Now();
+      size_t bytes = sizeof(test::Interface) + kPeers * (sizeof(test::Peer) + kAllowedIps * sizeof(test::AllowedIp));
+      std::vector<uint64_t> blob((bytes + 7) / 8);
+      uint8_t *next = reinterpret_cast<uint8_t *>(blob.data());
+      test::Interface whole = interface;
+      whole.PeersCount = static_cast<uint32_t>(kPeers);
+      memcpy(next, &whole, sizeof(whole));
+      next += sizeof(whole);
+      for (size_t i = 0; i < kPeers; i++)
+      {
+        test::Peer peer = MakePeer(i);
+        peer.AllowedIPsCount = static_cast<uint32_t>(kAllowedIps);
+        memcpy(next, &peer, sizeof(peer));
+        next += sizeof(peer);
+        MakeAllowedIps(i, allowed_ips);
+        memcpy(next, allowed_ips, sizeof(allowed_ips));
+        next += sizeof(allowed_ips);
+      }
+      sum += Apply(blob.data(), bytes);
+      Report("single blob", benchmark::Now() - start, baseline, 1);
+    }
+    // Keeps the reads from being optimized away.
+    if (sum == 1)
+    {
+      printf("\n");
+    }
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,345 @@
+#include <array>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "config_chunker.h"
+#include "test.h"
+#include "wireguard_layout.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    typedef ConfigChunker<test::Interface, test::Peer, test::AllowedIp> Chunker;
+    typedef std::array<uint8_t, 32> Key;
+
+    const uint32_t kInterfaceHasPrivateKey = 1 << 1;
+    const uint32_t kInterfaceReplacePeers = 1 << 3;
+    const uint32_t kPeerHasPublicKey = 1 << 0;
+    const size_t kChunkBytes = 64 * 1024;
+
+    struct PeerSpec
+    {
+      Key public_key;
+      std::vector<test::AllowedIp> allowed_ips;
+    };
+
+    Key PublicKey(size_t index)
+    {
+      Key key{};
+      key[0] = 0xa5;
+      key[1] = static_cast<uint8_t>(index >> 8);
+      key[2] = static_cast<uint8_t>(index);
+      return key;
+    }
+
+    test::AllowedIp Ip(size_t peer, size_t index)
+    {
+      test::AllowedIp ip;
+      memset(&ip, 0, sizeof(ip));
+      uint8_t *address = reinterpret_cast<uint8_t *>(&ip.Address);
+      if (index % 3 == 2)
+      {
+        ip.AddressFamily = AF_INET6;
+        ip.Cidr = 128;
+        address[0] = 0xfd;
+        address[12] = static_cast<uint8_t>(peer >> 8);
+        address[13] = static_cast<uint8_t>(peer);
+        address[14] = static_cast<uint8_t>(index >> 8);
+        address[15] = static_cast<uint8_t>(index);
+      }
+      else
+      {
+        ip.AddressFamily = AF_INET;
+        ip.Cidr = 32;
+        address[0] = static_cast<uint8_t>(peer >> 8);
+        address[1] = static_cast<uint8_t>(peer);
+        address[2] = static_cast<uint8_t>(index >> 8);
+        address[3] = static_cast<uint8_t>(index);
+      }
+      return ip;
+    }
+
+    std::string Describe(const test::AllowedIp &ip)
+    {
+      size_t len = ip.AddressFamily == AF_INET ? 4 : 16;
+      return test::ToHex(reinterpret_cast<const uint8_t *>(&ip.Address), len) + "/" + std::to_string(ip.Cidr);
+    }
+
+    // 10,000 peers with none to a few allowed IPs each, and every 1,000th
+    // with more than fit in a chunk.
+    std::vector<PeerSpec> ManyPeers()
+    {
+      std::vector<PeerSpec> peers(10000);
+      for (size_t i = 0; i < peers.size(); i++)
+      {
+        peers[i].public_key = PublicKey(i);
+        size_t count = i % 1000 == 500 ? 7000 : i % 5;
+        for (size_t j = 0; j < count; j++)
+        {
+          peers[i].allowed_ips.push_back(Ip(i, j));
+        }
+      }
+      return peers;
+    }
+
+    // A chunk as WireGuardSetConfiguration would read it.
+    struct Chunk
+    {
+      test::Interface interface;
+      std::vector<test::Peer> peers;
+      std::vector<std::vector<test::AllowedIp>> allowed_ips;
+      size_t bytes;
+    };
+
+    // Walks the records of |bytes| at |config|, which must add up exactly.
+    Chunk Parse(const test::Interface *config, size_t bytes)
+    {
+      Chunk chunk;
+      chunk.bytes = bytes;
+      const uint8_t *in = reinterpret_cast<const uint8_t *>(config);
+      const uint8_t *end = in + bytes;
+      ASSERT_TRUE(bytes >= sizeof(test::Interface));
+      memcpy(&chunk.interface, in, sizeof(test::Interface));
+      in += sizeof(test::Interface);
+      for (uint32_t i = 0; i < chunk.interface.PeersCount; i++)
+      {
+        ASSERT_TRUE(static_cast<size_t>(end - in) >= sizeof(test::Peer));
+        test::Peer peer;
+        memcpy(&peer, in, sizeof(peer));
+        in += sizeof(peer);
+        ASSERT_TRUE(static_cast<size_t>(end - in) >= peer.AllowedIPsCount * sizeof(test::AllowedIp));
+        const test::AllowedIp *ips = reinterpret_cast<const test::AllowedIp *>(in);
+        chunk.peers.push_back(peer);
+        chunk.allowed_ips.emplace_back(ips, ips + peer.AllowedIPsCount);
+        in += peer.AllowedIPsCount * sizeof(test::AllowedIp);
+      }
+      EXPECT_TRUE(in == end);
+      return chunk;
+    }
+
+    // Applies chunks as the adapter does: a record adds a peer unless it is
+    // an update, and replaces the peer's allowed IPs if it says so.
+    class Adapter
+    {
+    public:
+      void Apply(const Chunk &chunk)
+      {
+        if (chunk.interface.Flags & kInterfaceReplacePeers)
+        {
+          peers_.clear();
+          order_.clear();
+        }
+        for (size_t i = 0; i < chunk.peers.size(); i++)
+        {
+          const test::Peer &peer = chunk.peers[i];
+          Key key;
+          memcpy(key.data(), peer.PublicKey, key.size());
+          auto it = peers_.find(key);
+          if (peer.Flags & kChunkerPeerUpdate)
+          {
+            ASSERT_TRUE(it != peers_.end());
+          }
+          else
+          {
+            ASSERT_TRUE(it == peers_.end());
+            it = peers_.emplace(key, std::vector<std::string>()).first;
+            order_.push_back(key);
+          }
+          if (peer.Flags & kChunkerPeerReplaceAllowedIps)
+          {
+            it->second.clear();
+          }
+          for (const test::AllowedIp &ip : chunk.allowed_ips[i])
+          {
+            it->second.push_back(Describe(ip));
+          }
+        }
+      }
+
+      size_t peers() const { return order_.size(); }
+      const Key &key(size_t i) const { return order_[i]; }
+      const std::vector<std::string> &allowed_ips(const Key &key) const { return peers_.at(key); }
+
+    private:
+      std::map<Key, std::vector<std::string>> peers_;
+      std::vector<Key> order_;
+    };
+
+    test::Interface MakeInterface()
+    {
+      test::Interface interface;
+      memset(&interface, 0, sizeof(interface));
+      interface.Flags = kInterfaceHasPrivateKey | kInterfaceReplacePeers;
+      interface.ListenPort = 51820;
+      memset(interface.PrivateKey, 0x42, sizeof(interface.PrivateKey));
+      return interface;
+    }
+
+    test::Peer MakePeer(const Key &public_key)
+    {
+      test::Peer peer;
+      memset(&peer, 0, sizeof(peer));
+      peer.Flags = kPeerHasPublicKey | kChunkerPeerReplaceAllowedIps;
+      memcpy(peer.PublicKey, public_key.data(), public_key.size());
+      peer.PersistentKeepalive = 25;
+      // Ignored: the chunker counts the IPs it is given.
+      peer.AllowedIPsCount = 12345;
+      return peer;
+    }
+
+  } // namespace
+
+  // A 10,000-peer configuration streamed in chunks arrives whole: each chunk
+  // is full before the next starts, adds up to its size, and continues
+  // split peers as updates.
+  TEST(config_chunker, RoundTripsManyPeers)
+  {
+    std::vector<PeerSpec> peers = ManyPeers();
+    std::vector<Chunk> chunks;
+    Chunker chunker(MakeInterface(), kChunkBytes, [&chunks](const test::Interface *config, size_t bytes)
+                    {
+                      EXPECT_EQ(reinterpret_cast<uintptr_t>(config) % 8, static_cast<uintptr_t>(0));
+                      EXPECT_TRUE(bytes <= kChunkBytes);
+                      chunks.push_back(Parse(config, bytes));
+                      return true; });
+    size_t total_ips = 0;
+    for (const PeerSpec &peer : peers)
+    {
+      ASSERT_TRUE(chunker.AddPeer(MakePeer(peer.public_key), peer.allowed_ips.data(), peer.allowed_ips.size()));
+      total_ips += peer.allowed_ips.size();
+    }
+    ASSERT_TRUE(chunker.Finish());
+    ASSERT_EQ(chunker.chunks(), chunks.size());
+    EXPECT_TRUE(chunks.size() > 1);
+
+    size_t records = 0, bytes = 0;
+    Adapter adapter;
+    std::map<Key, size_t> records_per_peer;
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+      const Chunk &chunk = chunks[c];
+      // Only the first chunk replaces the peers or sets the interface.
+      EXPECT_EQ(chunk.interface.Flags, c == 0 ? kInterfaceHasPrivateKey | kInterfaceReplacePeers : 0u);
+      EXPECT_EQ(chunk.interface.ListenPort, 51820);
+      // A chunk ends only when the next record, with at least one allowed
+      // IP, would not have fit.
+      if (c + 1 < chunks.size())
+      {
+        EXPECT_TRUE(chunk.bytes + sizeof(test::Peer) + sizeof(test::AllowedIp) > kChunkBytes);
+      }
+      for (const test::Peer &peer : chunk.peers)
+      {
+        Key key;
+        memcpy(key.data(), peer.PublicKey, key.size());
+        bool continuation = records_per_peer[key]++ > 0;
+        EXPECT_EQ(peer.PersistentKeepalive, 25);
+        EXPECT_EQ((peer.Flags & kChunkerPeerUpdate) != 0, continuation);
+        EXPECT_EQ((peer.Flags & kChunkerPeerReplaceAllowedIps) != 0, !continuation);
+        EXPECT_TRUE((peer.Flags & kPeerHasPublicKey) != 0);
+      }
+      records += chunk.peers.size();
+      bytes += chunk.bytes;
+      adapter.Apply(chunk);
+    }
+
+    // Every peer past the first record of a split is one more record.
+    EXPECT_EQ(records_per_peer.size(), peers.size());
+    EXPECT_TRUE(records > peers.size());
+    EXPECT_EQ(bytes,
+              chunks.size() * sizeof(test::Interface) + records * sizeof(test::Peer) +
+                  total_ips * sizeof(test::AllowedIp));
+
+    ASSERT_EQ(adapter.peers(), peers.size());
+    for (size_t i = 0; i < peers.size(); i++)
+    {
+      ASSERT_TRUE(adapter.key(i) == peers[i].public_key);
+      const std::vector<std::string> &got = adapter.allowed_ips(peers[i].public_key);
+      ASSERT_EQ(got.size(), peers[i].allowed_ips.size());
+      for (size_t j = 0; j < got.size(); j++)
+      {
+        EXPECT_EQ(got[j], Describe(peers[i].allowed_ips[j]));
+      }
+    }
+  }
+
+  // A peer with more allowed IPs than several chunks hold is split across
+  // all of them, each continuation adding to what came before.
+  TEST(config_chunker, SplitsOnePeerAcrossChunks)
+  {
+    const size_t chunk_bytes = sizeof(test::Interface) + sizeof(test::Peer) + 10 * sizeof(test::AllowedIp);
+    std::vector<test::AllowedIp> ips;
+    for (size_t j = 0; j < 35; j++)
+    {
+      ips.push_back(Ip(7, j));
+    }
+    std::vector<Chunk> chunks;
+    Chunker chunker(MakeInterface(), chunk_bytes, [&chunks](const test::Interface *config, size_t bytes)
+                    {
+                      chunks.push_back(Parse(config, bytes));
+                      return true; });
+    ASSERT_TRUE(chunker.AddPeer(MakePeer(PublicKey(7)), ips.data(), ips.size()));
+    ASSERT_TRUE(chunker.Finish());
+    ASSERT_EQ(chunks.size(), static_cast<size_t>(4));
+    const size_t expected[] = {10, 10, 10, 5};
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+      ASSERT_EQ(chunks[c].peers.size(), static_cast<size_t>(1));
+      EXPECT_EQ(chunks[c].peers[0].AllowedIPsCount, expected[c]);
+      EXPECT_EQ(chunks[c].bytes, sizeof(test::Interface) + sizeof(test::Peer) + expected[c] * sizeof(test::AllowedIp));
+    }
+    Adapter adapter;
+    for (const Chunk &chunk : chunks)
+    {
+      adapter.Apply(chunk);
+    }
+    EXPECT_EQ(adapter.allowed_ips(PublicKey(7)).size(), ips.size());
+  }
+
+  TEST(config_chunker, EmptyAndStopped)
+  {
+    std::vector<Chunk> chunks;
+    Chunker empty(MakeInterface(), kChunkBytes, [&chunks](const test::Interface *config, size_t bytes)
+                  {
+                    chunks.push_back(Parse(config, bytes));
+                    return true; });
+    ASSERT_TRUE(empty.Finish());
+    ASSERT_EQ(chunks.size(), static_cast<size_t>(1));
+    EXPECT_EQ(chunks[0].bytes, sizeof(test::Interface));
+    EXPECT_EQ(chunks[0].interface.PeersCount, 0u);
+
+    // The sink failing stops the stream at the first full chunk.
+    int calls = 0;
+    Chunker stopped(MakeInterface(), 4096, [&calls](const test::Interface *, size_t)
+                    {
+                      calls++;
+                      return false; });
+    std::vector<PeerSpec> peers = ManyPeers();
+    size_t added = 0;
+    while (stopped.AddPeer(MakePeer(peers[added].public_key), peers[added].allowed_ips.data(),
+                           peers[added].allowed_ips.size()))
+    {
+      added++;
+    }
+    EXPECT_EQ(calls, 1);
+    EXPECT_TRUE(added > 0 && added < peers.size());
+
+    bool thrown = false;
+    try
+    {
+      Chunker tiny(MakeInterface(), sizeof(test::Interface) + sizeof(test::Peer), [](const test::Interface *, size_t)
+                   { return true; });
+    }
+    catch (const std::runtime_error &)
+    {
+      thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,200 @@
+// 100k peers with two allowed IPs each, a preshared key on one in ten and
+// an endpoint on every one, held in the column-wise ConfigModel against
+// one object per peer: the bytes each holds, passes over one attribute of
+// every peer, and conversion to and from the adapter's packed layout.
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "benchmark.h"
+#include "config_model.h"
+#include "wireguard_layout.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const size_t kPeers = 100000;
+    const size_t kAllowedIps = 2;
+    const size_t kEndpoints = 1000;
+    const int kPasses = 20;
+
+    // One object per peer, as a configuration is naturally written.
+    struct PeerObject
+    {
+      ConfigModel::Key public_key;
+      bool has_preshared_key = false;
+      ConfigModel::Key preshared_key;
+      std::string endpoint;
+      uint16_t persistent_keepalive = 0;
+      uint64_t tx_bytes = 0;
+      uint64_t rx_bytes = 0;
+      uint64_t last_handshake = 0;
+      std::vector<ModelPrefix> allowed_ips;
+    };
+
+    ConfigModel::Key MakeKey(uint8_t tag, size_t index)
+    {
+      ConfigModel::Key key{};
+      key[0] = tag;
+      memcpy(key.data() + 1, &index, sizeof(index));
+      return key;
+    }
+
+    ModelEndpoint MakeEndpoint(size_t index)
+    {
+      ModelEndpoint endpoint;
+      endpoint.family = AF_INET;
+      endpoint.address[0] = 203;
+      endpoint.address[2] = 113;
+      endpoint.address[3] = static_cast<uint8_t>(index % kEndpoints);
+      endpoint.port = static_cast<uint16_t>(50000 + index % kEndpoints);
+      return endpoint;
+    }
+
+    ModelPrefix MakePrefix(size_t index, size_t j)
+    {
+      ModelPrefix prefix;
+      prefix.version = j == 0 ? 4 : 6;
+      prefix.cidr = j == 0 ? 32 : 128;
+      prefix.address[0] = j == 0 ? 10 : 0xfd;
+      memcpy(prefix.address + 1, &index, 3);
+      return prefix;
+    }
+
+    // The fastest of |kPasses| runs of |fn|, in milliseconds.
+    template <typename Fn>
+    double BestMs(Fn fn)
+    {
+      double best = 1e9;
+      for (int i = 0; i < kPasses; i++)
+      {
+        double start = benchmark::Now();
+        fn();
+        best = std::min(best, benchmark::Now() - start);
+      }
+      return best * 1e3;
+    }
+
+    // What the objects hold, counted as MemoryUsage() counts: capacity
+    // requested, without allocator overhead.
+    size_t ObjectsMemory(const std::vector<PeerObject> &peers)
+    {
+      size_t bytes = peers.capacity() * sizeof(PeerObject);
+      for (const auto &peer : peers)
+      {
+        // Strings up to the small-string size live inside the object.
+        if (peer.endpoint.capacity() > std::string().capacity())
+        {
+          bytes += peer.endpoint.capacity() + 1;
+        }
+        bytes += peer.allowed_ips.capacity() * sizeof(ModelPrefix);
+      }
+      return bytes;
+    }
+
+  } // namespace
+
+  BENCHMARK(config_model)
+  {
+    uint64_t sink = 0;
+    {
+      ConfigModel model;
+      model.Reserve(kPeers, kPeers * kAllowedIps);
+      for (size_t i = 0; i < kPeers; i++)
+      {
+        size_t peer = model.AddPeer(MakeKey(1, i));
+        if (i % 10 == 0)
+        {
+          model.SetPresharedKey(peer, MakeKey(2, i));
+        }
+        model.SetEndpoint(peer, MakeEndpoint(i));
+        model.SetPersistentKeepalive(peer, 25);
+        for (size_t j = 0; j < kAllowedIps; j++)
+        {
+          model.AddAllowedIp(peer, MakePrefix(i, j));
+        }
+      }
+      double ips = BestMs([&]
+                          {
+                            for (size_t i = 0; i < model.peers(); i++)
+                            {
+                              const ModelPrefix *prefix = model.allowed_ips(i);
+                              for (size_t j = 0; j < model.allowed_ip_count(i); j++)
+                              {
+                                sink += prefix[j].cidr;
+                              }
+                            } });
+      double keys = BestMs([&]
+                           {
+                             for (size_t i = 0; i < model.peers(); i++)
+                             {
+                               sink += model.public_key(i)[1];
+                             } });
+      size_t bytes = model.PackedSize<test::Interface, test::Peer, test::AllowedIp>();
+      std::vector<uint64_t> packed((bytes + 7) / 8);
+      double to_packed = BestMs([&]
+                                { model.ToPacked<test::Interface, test::Peer, test::AllowedIp>(packed.data()); });
+      double from_packed = BestMs([&]
+                                  {
+                                    ConfigModel copy;
+                                    copy.FromPacked<test::Interface, test::Peer, test::AllowedIp>(packed.data(), bytes);
+                                    sink += copy.peers(); });
+      printf("model    %6.1f MB  %4zu B/peer  allowed IPs %5.2f ms  keys %5.2f ms\n", model.MemoryUsage() / 1e6,
+             model.MemoryUsage() / kPeers, ips, keys);
+      printf("packed   %6.1f MB  to %6.2f ms  from %6.2f ms\n", bytes / 1e6, to_packed, from_packed);
+    }
+
+    {
+      std::vector<PeerObject> peers;
+      peers.reserve(kPeers);
+      for (size_t i = 0; i < kPeers; i++)
+      {
+        peers.emplace_back();
+        PeerObject &peer = peers.back();
+        peer.public_key = MakeKey(1, i);
+        if (i % 10 == 0)
+        {
+          peer.has_preshared_key = true;
+          peer.preshared_key = MakeKey(2, i);
+        }
+        ModelEndpoint endpoint = MakeEndpoint(i);
+        peer.endpoint = std::to_string(endpoint.address[0]) + ".0." + std::to_string(endpoint.address[2]) + "." +
+                        std::to_string(endpoint.address[3]) + ":" + std::to_string(endpoint.port);
+        peer.persistent_keepalive = 25;
+        for (size_t j = 0; j < kAllowedIps; j++)
+        {
+          peer.allowed_ips.push_back(MakePrefix(i, j));
+        }
+      }
+      double ips = BestMs([&]
+                          {
+                            for (const auto &peer : peers)
+                            {
+                              for (const auto &prefix : peer.allowed_ips)
+                              {
+                                sink += prefix.cidr;
+                              }
+                            } });
+      double keys = BestMs([&]
+                           {
+                             for (const auto &peer : peers)
+                             {
+                               sink += peer.public_key[1];
+                             } });
+      size_t bytes = ObjectsMemory(peers);
+      printf("objects  %6.1f MB  %4zu B/peer  allowed IPs %5.2f ms  keys %5.2f ms\n", bytes / 1e6, bytes / kPeers,
+             ips, keys);
+    }
+    // Keeps the passes from being optimized away.
+    if (sink == 1)
+    {
+      printf("\n");
+    }
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,224 @@
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "config_model.h"
+#include "test.h"
+#include "wireguard_layout.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    ConfigModel::Key MakeKey(uint8_t tag, size_t index)
+    {
+      ConfigModel::Key key{};
+      key[0] = tag;
+      key[1] = static_cast<uint8_t>(index >> 8);
+      key[2] = static_cast<uint8_t>(index);
+      key[31] = 0x55;
+      return key;
+    }
+
+    // A server-sized configuration: most peers with a preshared key, a few
+    // endpoints shared between many peers, and one to four allowed IPs of
+    // either family each.
+    void Fill(ConfigModel *model, size_t peers)
+    {
+      model->SetPrivateKey(MakeKey(0xee, 0));
+      model->SetListenPort(51820);
+      model->AddDns("1.1.1.1");
+      model->AddDns("vpn.example.com");
+      for (size_t i = 0; i < peers; i++)
+      {
+        size_t peer = model->AddPeer(MakeKey(0x01, i));
+        if (i % 4 != 0)
+        {
+          model->SetPresharedKey(peer, MakeKey(0x02, i));
+        }
+        if (i % 3 == 0)
+        {
+          ModelEndpoint endpoint;
+          endpoint.family = i % 2 == 0 ? AF_INET : AF_INET6;
+          endpoint.address[0] = endpoint.family == AF_INET ? 192 : 0x20;
+          endpoint.address[3] = static_cast<uint8_t>(i % 7);
+          endpoint.port = static_cast<uint16_t>(51820 + i % 7);
+          model->SetEndpoint(peer, endpoint);
+        }
+        model->SetPersistentKeepalive(peer, static_cast<uint16_t>(i % 2 == 0 ? 25 : 0));
+        for (size_t j = 0; j < 1 + i % 4; j++)
+        {
+          ModelPrefix prefix;
+          prefix.version = j % 2 == 0 ? 4 : 6;
+          prefix.cidr = prefix.version == 4 ? 32 : 128;
+          prefix.address[0] = prefix.version == 4 ? 10 : 0xfd;
+          prefix.address[1] = static_cast<uint8_t>(i >> 8);
+          prefix.address[2] = static_cast<uint8_t>(i);
+          prefix.address[3] = static_cast<uint8_t>(j);
+          model->AddAllowedIp(peer, prefix);
+        }
+      }
+    }
+
+    void ExpectSamePeers(const ConfigModel &a, const ConfigModel &b)
+    {
+      ASSERT_EQ(a.peers(), b.peers());
+      EXPECT_TRUE(a.has_private_key() == b.has_private_key() && a.private_key() == b.private_key());
+      EXPECT_EQ(a.listen_port(), b.listen_port());
+      for (size_t i = 0; i < a.peers(); i++)
+      {
+        ASSERT_TRUE(a.public_key(i) == b.public_key(i));
+        ASSERT_EQ(a.preshared_key(i) != nullptr, b.preshared_key(i) != nullptr);
+        if (a.preshared_key(i) != nullptr)
+        {
+          ASSERT_TRUE(*a.preshared_key(i) == *b.preshared_key(i));
+        }
+        ASSERT_EQ(a.endpoint(i) != nullptr, b.endpoint(i) != nullptr);
+        if (a.endpoint(i) != nullptr)
+        {
+          ASSERT_TRUE(*a.endpoint(i) == *b.endpoint(i));
+        }
+        ASSERT_EQ(a.persistent_keepalive(i), b.persistent_keepalive(i));
+        ASSERT_EQ(a.allowed_ip_count(i), b.allowed_ip_count(i));
+        for (size_t j = 0; j < a.allowed_ip_count(i); j++)
+        {
+          const ModelPrefix &x = a.allowed_ips(i)[j];
+          const ModelPrefix &y = b.allowed_ips(i)[j];
+          ASSERT_EQ(x.version, y.version);
+          ASSERT_EQ(x.cidr, y.cidr);
+          ASSERT_EQ(memcmp(x.address, y.address, x.version == 4 ? 4 : 16), 0);
+        }
+      }
+    }
+
+    // An 8-byte aligned buffer holding |model| packed.
+    std::vector<uint64_t> Pack(const ConfigModel &model, size_t *bytes)
+    {
+      *bytes = model.PackedSize<test::Interface, test::Peer, test::AllowedIp>();
+      std::vector<uint64_t> buffer((*bytes + 7) / 8);
+      model.ToPacked<test::Interface, test::Peer, test::AllowedIp>(buffer.data());
+      return buffer;
+    }
+
+    bool ThrowsTruncated(const void *buffer, size_t bytes)
+    {
+      ConfigModel model;
+      try
+      {
+        model.FromPacked<test::Interface, test::Peer, test::AllowedIp>(buffer, bytes);
+      }
+      catch (const std::runtime_error &)
+      {
+        return true;
+      }
+      return false;
+    }
+
+  } // namespace
+
+  // A configuration packed for the adapter and read back as the adapter
+  // returns it comes back the same, and packs to the same bytes again.
+  TEST(config_model, RoundTripsThroughPacked)
+  {
+    ConfigModel model;
+    Fill(&model, 5000);
+    size_t bytes;
+    std::vector<uint64_t> packed = Pack(model, &bytes);
+
+    const test::Interface *config = reinterpret_cast<const test::Interface *>(packed.data());
+    EXPECT_EQ(config->PeersCount, 5000u);
+    EXPECT_EQ(config->Flags, kModelInterfaceHasPrivateKey | kModelInterfaceHasListenPort | kModelInterfaceReplacePeers);
+    const test::Peer *first = reinterpret_cast<const test::Peer *>(config + 1);
+    EXPECT_EQ(first->Flags, kModelPeerHasPublicKey | kModelPeerHasPersistentKeepalive | kModelPeerReplaceAllowedIps |
+                                kModelPeerHasEndpoint);
+    EXPECT_EQ(first->Endpoint.si_family, AF_INET);
+    EXPECT_EQ(first->Endpoint.Ipv4.sin_port, htons(51820));
+
+    ConfigModel read;
+    read.FromPacked<test::Interface, test::Peer, test::AllowedIp>(packed.data(), bytes);
+    ExpectSamePeers(model, read);
+
+    size_t repacked_bytes;
+    std::vector<uint64_t> repacked = Pack(read, &repacked_bytes);
+    ASSERT_EQ(repacked_bytes, bytes);
+    EXPECT_EQ(memcmp(repacked.data(), packed.data(), bytes), 0);
+  }
+
+  // What only the adapter fills in, counters and handshakes, is read back
+  // per peer.
+  TEST(config_model, ReadsCounters)
+  {
+    ConfigModel model;
+    Fill(&model, 10);
+    size_t bytes;
+    std::vector<uint64_t> packed = Pack(model, &bytes);
+    uint8_t *p = reinterpret_cast<uint8_t *>(packed.data()) + sizeof(test::Interface);
+    for (size_t i = 0; i < model.peers(); i++)
+    {
+      test::Peer *peer = reinterpret_cast<test::Peer *>(p);
+      peer->TxBytes = 1000 + i;
+      peer->RxBytes = 2000 + i;
+      peer->LastHandshake = 133000000000000000ull + i;
+      p += sizeof(test::Peer) + peer->AllowedIPsCount * sizeof(test::AllowedIp);
+    }
+    ConfigModel read;
+    read.FromPacked<test::Interface, test::Peer, test::AllowedIp>(packed.data(), bytes);
+    ExpectSamePeers(model, read);
+    for (size_t i = 0; i < read.peers(); i++)
+    {
+      EXPECT_EQ(read.tx_bytes(i), 1000 + i);
+      EXPECT_EQ(read.rx_bytes(i), 2000 + i);
+      EXPECT_EQ(read.last_handshake(i), 133000000000000000ull + i);
+    }
+  }
+
+  // A buffer ending anywhere inside a record is refused rather than read
+  // past.
+  TEST(config_model, RejectsTruncated)
+  {
+    ConfigModel model;
+    Fill(&model, 20);
+    size_t bytes;
+    std::vector<uint64_t> packed = Pack(model, &bytes);
+    EXPECT_FALSE(ThrowsTruncated(packed.data(), bytes));
+    EXPECT_TRUE(ThrowsTruncated(packed.data(), sizeof(test::Interface) - 1));
+    EXPECT_TRUE(ThrowsTruncated(packed.data(), sizeof(test::Interface) + sizeof(test::Peer) - 1));
+    EXPECT_TRUE(ThrowsTruncated(packed.data(), sizeof(test::Interface) + sizeof(test::Peer) + 4));
+    for (size_t cut = 1; cut < sizeof(test::AllowedIp) * 4; cut++)
+    {
+      EXPECT_TRUE(ThrowsTruncated(packed.data(), bytes - cut));
+    }
+  }
+
+  TEST(config_model, Accessors)
+  {
+    ConfigModel model;
+    Fill(&model, 100);
+    EXPECT_EQ(model.dns_count(), static_cast<size_t>(2));
+    EXPECT_EQ(model.dns(1), std::string("vpn.example.com"));
+    EXPECT_EQ(model.FindPeer(MakeKey(0x01, 42)), 42u);
+    EXPECT_EQ(model.FindPeer(MakeKey(0x03, 42)), ConfigModel::kNone);
+    // Peers sharing an endpoint share one copy of it.
+    EXPECT_TRUE(model.endpoint(0) == model.endpoint(42));
+    EXPECT_TRUE(model.endpoint(0) != model.endpoint(6));
+
+    model.SetPresharedKey(1, MakeKey(0x09, 1));
+    EXPECT_TRUE(*model.preshared_key(1) == MakeKey(0x09, 1));
+    EXPECT_TRUE(model.preshared_key(0) == nullptr);
+
+    bool thrown = false;
+    try
+    {
+      model.AddAllowedIp(0, ModelPrefix());
+    }
+    catch (const std::runtime_error &)
+    {
+      thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,73 @@
+// What a TraceSpan costs around a plugin operation: with tracing off, the
+// price every call pays, and with it on, with and without a detail string,
+// on one thread and on one per CPU each writing its own buffer.
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "tracer.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    void Span()
+    {
+      TraceSpan span("benchmark");
+    }
+
+    void SpanWithDetail()
+    {
+      TraceSpan span("benchmark", "startVpn");
+    }
+
+    // Nanoseconds per call of |fn|, on each of |threads| threads at once.
+    template <typename Fn>
+    double NanosecondsPerCall(Fn fn, size_t threads)
+    {
+      std::vector<double> rates(threads);
+      std::vector<std::thread> workers;
+      for (size_t t = 0; t < threads; t++)
+      {
+        workers.emplace_back([&rates, fn, t]
+                             { rates[t] = benchmark::CallsPerSecond(fn, 0.5, 1024); });
+      }
+      for (auto &worker : workers)
+      {
+        worker.join();
+      }
+      return 1e9 / *std::min_element(rates.begin(), rates.end());
+    }
+
+  } // namespace
+
+  BENCHMARK(tracer)
+  {
+    size_t cpus = std::max<size_t>(1, std::thread::hardware_concurrency());
+    std::vector<size_t> thread_counts = {1};
+    if (cpus > 1)
+    {
+      thread_counts.push_back(cpus);
+    }
+    for (size_t threads : thread_counts)
+    {
+      SetTracing(false);
+      double off = NanosecondsPerCall(Span, threads);
+      SetTracing(true);
+      double on = NanosecondsPerCall(Span, threads);
+      double on_detail = NanosecondsPerCall(SpanWithDetail, threads);
+      SetTracing(false);
+      printf("%2zu threads  off %5.1f ns  on %5.1f ns  on with detail %5.1f ns per span\n", threads, off, on,
+             on_detail);
+    }
+    double start = benchmark::Now();
+    size_t bytes = DumpTrace().size();
+    printf("dump %zu bytes  %6.2f ms\n", bytes, (benchmark::Now() - start) * 1e3);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,609 @@
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "test.h"
+#include "tracer.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    struct Json
+    {
+      enum Type
+      {
+        kNull,
+        kBool,
+        kNumber,
+        kString,
+        kArray,
+        kObject
+      };
+      Type type = kNull;
+      bool boolean = false;
+      double number = 0;
+      std::string string;
+      std::vector<Json> array;
+      std::vector<std::pair<std::string, Json>> object;
+
+      // The member named |key|, or null if there is none.
+      const Json *Find(const std::string &key) const
+      {
+        for (const auto &member : object)
+        {
+          if (member.first == key)
+          {
+            return &member.second;
+          }
+        }
+        return nullptr;
+      }
+    };
+
+    // A strict RFC 8259 reader: one value and nothing after it, no trailing
+    // commas or leading zeros, only the escapes JSON has, no raw control
+    // characters, no repeated keys, and well-formed UTF-8 throughout.
+    class JsonParser
+    {
+    public:
+      explicit JsonParser(const std::string &text) : p_(text.data()), end_(text.data() + text.size()) {}
+
+      // Returns false if the text is not JSON.
+      bool Parse(Json *value)
+      {
+        return Value(value, 0) && (Space(), p_ == end_);
+      }
+
+    private:
+      void Space()
+      {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r'))
+        {
+          p_++;
+        }
+      }
+
+      bool Literal(const char *word)
+      {
+        size_t len = strlen(word);
+        if (static_cast<size_t>(end_ - p_) < len || memcmp(p_, word, len) != 0)
+        {
+          return false;
+        }
+        p_ += len;
+        return true;
+      }
+
+      bool Value(Json *value, int depth)
+      {
+        Space();
+        if (p_ == end_ || depth > 64)
+        {
+          return false;
+        }
+        switch (*p_)
+        {
+        case '{':
+          return Object(value, depth);
+        case '[':
+          return Array(value, depth);
+        case '"':
+          value->type = Json::kString;
+          return String(&value->string);
+        case 't':
+          value->type = Json::kBool;
+          value->boolean = true;
+          return Literal("true");
+        case 'f':
+          value->type = Json::kBool;
+          return Literal("false");
+        case 'n':
+          return Literal("null");
+        default:
+          value->type = Json::kNumber;
+          return Number(&value->number);
+        }
+      }
+
+      bool Object(Json *value, int depth)
+      {
+        value->type = Json::kObject;
+        p_++;
+        Space();
+        if (p_ < end_ && *p_ == '}')
+        {
+          p_++;
+          return true;
+        }
+        while (true)
+        {
+          std::string key;
+          Json member;
+          Space();
+          if (p_ == end_ || *p_ != '"' || !String(&key) || value->Find(key) != nullptr)
+          {
+            return false;
+          }
+          Space();
+          if (p_ == end_ || *p_++ != ':' || !Value(&member, depth + 1))
+          {
+            return false;
+          }
+          value->object.emplace_back(std::move(key), std::move(member));
+          Space();
+          if (p_ == end_)
+          {
+            return false;
+          }
+          if (*p_ == '}')
+          {
+            p_++;
+            return true;
+          }
+          if (*p_++ != ',')
+          {
+            return false;
+          }
+        }
+      }
+
+      bool Array(Json *value, int depth)
+      {
+        value->type = Json::kArray;
+        p_++;
+        Space();
+        if (p_ < end_ && *p_ == ']')
+        {
+          p_++;
+          return true;
+        }
+        while (true)
+        {
+          Json element;
+          if (!Value(&element, depth + 1))
+          {
+            return false;
+          }
+          value->array.push_back(std::move(element));
+          Space();
+          if (p_ == end_)
+          {
+            return false;
+          }
+          if (*p_ == ']')
+          {
+            p_++;
+            return true;
+          }
+          if (*p_++ != ',')
+          {
+            return false;
+          }
+        }
+      }
+
+      bool Digits()
+      {
+        const char *start = p_;
+        while (p_ < end_ && *p_ >= '0' && *p_ <= '9')
+        {
+          p_++;
+        }
+        return p_ > start;
+      }
+
+      bool Number(double *number)
+      {
+        const char *start = p_;
+        if (p_ < end_ && *p_ == '-')
+        {
+          p_++;
+        }
+        if (p_ < end_ && *p_ == '0')
+        {
+          p_++;
+        }
+        else if (!Digits())
+        {
+          return false;
+        }
+        if (p_ < end_ && *p_ == '.')
+        {
+          p_++;
+          if (!Digits())
+          {
+            return false;
+          }
+        }
+        if (p_ < end_ && (*p_ == 'e' || *p_ == 'E'))
+        {
+          p_++;
+          if (p_ < end_ && (*p_ == '+' || *p_ == '-'))
+          {
+            p_++;
+          }
+          if (!Digits())
+          {
+            return false;
+          }
+        }
+        *number = strtod(std::string(start, p_).c_str(), nullptr);
+        return true;
+      }
+
+      static void PutUtf8(std::string *out, uint32_t code)
+      {
+        if (code < 0x80)
+        {
+          out->push_back(static_cast<char>(code));
+        }
+        else if (code < 0x800)
+        {
+          out->push_back(static_cast<char>(0xc0 | code >> 6));
+          out->push_back(static_cast<char>(0x80 | (code & 0x3f)));
+        }
+        else if (code < 0x10000)
+        {
+          out->push_back(static_cast<char>(0xe0 | code >> 12));
+          out->push_back(static_cast<char>(0x80 | (code >> 6 & 0x3f)));
+          out->push_back(static_cast<char>(0x80 | (code & 0x3f)));
+        }
+        else
+        {
+          out->push_back(static_cast<char>(0xf0 | code >> 18));
+          out->push_back(static_cast<char>(0x80 | (code >> 12 & 0x3f)));
+          out->push_back(static_cast<char>(0x80 | (code >> 6 & 0x3f)));
+          out->push_back(static_cast<char>(0x80 | (code & 0x3f)));
+        }
+      }
+
+      bool Hex4(uint32_t *code)
+      {
+        if (end_ - p_ < 4)
+        {
+          return false;
+        }
+        *code = 0;
+        for (int i = 0; i < 4; i++)
+        {
+          char c = *p_++;
+          int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                                   : c >= 'A' && c <= 'F'   ? c - 'A' + 10
+                                                                            : -1;
+          if (digit < 0)
+          {
+            return false;
+          }
+          *code = *code << 4 | static_cast<uint32_t>(digit);
+        }
+        return true;
+      }
+
+      // One UTF-8 character of at least two bytes, starting at |lead|.
+      bool Utf8(unsigned char lead, std::string *out)
+      {
+        int more = lead >= 0xc2 && lead <= 0xdf ? 1 : lead >= 0xe0 && lead <= 0xef ? 2 : lead >= 0xf0 && lead <= 0xf4 ? 3 : -1;
+        if (more < 0 || end_ - p_ < more)
+        {
+          return false;
+        }
+        uint32_t code = lead & (0x3f >> more);
+        for (int i = 0; i < more; i++)
+        {
+          unsigned char c = static_cast<unsigned char>(*p_++);
+          if ((c & 0xc0) != 0x80)
+          {
+            return false;
+          }
+          code = code << 6 | (c & 0x3f);
+        }
+        static const uint32_t kLeast[] = {0, 0x80, 0x800, 0x10000};
+        if (code < kLeast[more] || (code >= 0xd800 && code <= 0xdfff) || code > 0x10ffff)
+        {
+          return false;
+        }
+        PutUtf8(out, code);
+        return true;
+      }
+
+      bool String(std::string *out)
+      {
+        p_++;
+        while (p_ < end_)
+        {
+          unsigned char c = static_cast<unsigned char>(*p_++);
+          if (c == '"')
+          {
+            return true;
+          }
+          if (c < 0x20)
+          {
+            return false;
+          }
+          if (c >= 0x80)
+          {
+            if (!Utf8(c, out))
+            {
+              return false;
+            }
+            continue;
+          }
+          if (c != '\\')
+          {
+            out->push_back(static_cast<char>(c));
+            continue;
+          }
+          if (p_ == end_)
+          {
+            return false;
+          }
+          char escape = *p_++;
+          static const char kEscapes[] = "\"\"\\\\//b\bf\fn\nr\rt\t";
+          const char *simple = escape != '\0' ? strchr(kEscapes, escape) : nullptr;
+          if (simple != nullptr && (simple - kEscapes) % 2 == 0)
+          {
+            out->push_back(simple[1]);
+            continue;
+          }
+          uint32_t code, low;
+          if (escape != 'u' || !Hex4(&code) || (code >= 0xdc00 && code <= 0xdfff))
+          {
+            return false;
+          }
+          if (code >= 0xd800 && code <= 0xdbff)
+          {
+            if (!Literal("\\u") || !Hex4(&low) || low < 0xdc00 || low > 0xdfff)
+            {
+              return false;
+            }
+            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+          }
+          PutUtf8(out, code);
+        }
+        return false;
+      }
+
+      const char *p_;
+      const char *end_;
+    };
+
+    struct Event
+    {
+      std::string name;
+      std::string detail;
+      double tid;
+      double ts;
+      double dur;
+    };
+
+    // Parses a dump and checks it is a Chrome trace: an object whose
+    // traceEvents hold the process name and complete events with every
+    // field they need.
+    std::vector<Event> ParseTrace(const std::string &text)
+    {
+      std::vector<Event> events;
+      Json trace;
+      ASSERT_TRUE(JsonParser(text).Parse(&trace));
+      ASSERT_TRUE(trace.type == Json::kObject);
+      const Json *list = trace.Find("traceEvents");
+      ASSERT_TRUE(list != nullptr && list->type == Json::kArray);
+      ASSERT_TRUE(!list->array.empty());
+      const Json &metadata = list->array[0];
+      ASSERT_TRUE(metadata.Find("ph") != nullptr && metadata.Find("ph")->string == "M");
+      EXPECT_EQ(metadata.Find("name")->string, std::string("process_name"));
+      for (size_t i = 1; i < list->array.size(); i++)
+      {
+        const Json &event = list->array[i];
+        ASSERT_TRUE(event.type == Json::kObject);
+        const Json *ph = event.Find("ph");
+        const Json *cat = event.Find("cat");
+        const Json *name = event.Find("name");
+        const Json *pid = event.Find("pid");
+        const Json *tid = event.Find("tid");
+        const Json *ts = event.Find("ts");
+        const Json *dur = event.Find("dur");
+        ASSERT_TRUE(ph != nullptr && ph->type == Json::kString && ph->string == "X");
+        ASSERT_TRUE(cat != nullptr && cat->type == Json::kString);
+        ASSERT_TRUE(name != nullptr && name->type == Json::kString);
+        ASSERT_TRUE(pid != nullptr && pid->type == Json::kNumber);
+        ASSERT_TRUE(tid != nullptr && tid->type == Json::kNumber);
+        ASSERT_TRUE(ts != nullptr && ts->type == Json::kNumber && ts->number >= 0);
+        ASSERT_TRUE(dur != nullptr && dur->type == Json::kNumber && dur->number >= 0);
+        Event parsed{name->string, "", tid->number, ts->number, dur->number};
+        if (const Json *args = event.Find("args"))
+        {
+          const Json *detail = args->Find("detail");
+          ASSERT_TRUE(detail != nullptr && detail->type == Json::kString);
+          parsed.detail = detail->string;
+        }
+        events.push_back(parsed);
+      }
+      return events;
+    }
+
+    bool ParsesAsJson(const std::string &text)
+    {
+      Json value;
+      return JsonParser(text).Parse(&value);
+    }
+
+  } // namespace
+
+  // The reader used below rejects what JSON forbids.
+  TEST(tracer, ParserIsStrict)
+  {
+    EXPECT_TRUE(ParsesAsJson("{\"a\":[1,-0.5,2e3,\"\\u00e9\\ud83d\\ude00\\n\",true,null]}"));
+    const char *bad[] = {
+        "{\"a\":1,}",    "[01]",         "[1.]",          "{\"a\":1,\"a\":2}", "[\"\\x\"]",   "[\"\t\"]",
+        "[\"\\ud83d\"]", "[\"\xc3\"]",   "[\"\xc0\xaf\"]", "[\"\xed\xa0\x80\"]", "[1] [2]",    "{a:1}",
+        "[+1]",          "[NaN]",        "",
+    };
+    for (const char *text : bad)
+    {
+      EXPECT_FALSE(ParsesAsJson(text));
+    }
+  }
+
+  // Spans from several threads, nested and with details that need
+  // escaping, dump as a Chrome trace with each event where it belongs.
+  TEST(tracer, DumpsValidChromeTrace)
+  {
+    SetTracing(true);
+    {
+      TraceSpan outer("outer", "quote \" backslash \\");
+      TraceSpan inner("inner", "tab\tnew\nline\x01");
+    }
+    // The workers stay alive until all have recorded, as a thread that
+    // exits hands its buffer and tid to the next.
+    std::atomic<int> done{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+      threads.emplace_back([t, &done]
+                           {
+                             for (int i = 0; i < 100; i++)
+                             {
+                               TraceSpan span("worker", ("thread " + std::to_string(t)).c_str());
+                             }
+                             done++;
+                             while (done.load() < 4)
+                             {
+                               std::this_thread::yield();
+                             } });
+    }
+    for (std::thread &thread : threads)
+    {
+      thread.join();
+    }
+    {
+      TraceSpan plain("caf\xc3\xa9");
+    }
+    SetTracing(false);
+    {
+      TraceSpan ignored("ignored");
+    }
+
+    std::vector<Event> events = ParseTrace(DumpTrace());
+    ASSERT_EQ(events.size(), static_cast<size_t>(403));
+    std::map<std::string, int> by_name;
+    std::map<double, std::string> thread_of;
+    const Event *outer = nullptr;
+    const Event *inner = nullptr;
+    for (const Event &event : events)
+    {
+      by_name[event.name]++;
+      if (event.name == "outer")
+      {
+        outer = &event;
+      }
+      if (event.name == "inner")
+      {
+        inner = &event;
+      }
+      if (event.name == "worker")
+      {
+        // Each worker's spans carry its tid alone.
+        auto known = thread_of.emplace(event.tid, event.detail);
+        EXPECT_EQ(known.first->second, event.detail);
+      }
+    }
+    EXPECT_EQ(by_name["worker"], 400);
+    EXPECT_EQ(by_name["caf\xc3\xa9"], 1);
+    EXPECT_EQ(by_name.count("ignored"), static_cast<size_t>(0));
+    EXPECT_EQ(thread_of.size(), static_cast<size_t>(4));
+    ASSERT_TRUE(outer != nullptr && inner != nullptr);
+    EXPECT_EQ(outer->detail, std::string("quote \" backslash \\"));
+    EXPECT_EQ(inner->detail, std::string("tab\tnew\nline\x01"));
+    EXPECT_TRUE(outer->tid == inner->tid);
+    // The inner span lies within the outer one, to the microsecond
+    // precision of the output.
+    EXPECT_TRUE(inner->ts >= outer->ts && inner->ts + inner->dur <= outer->ts + outer->dur + 0.002);
+  }
+
+  // A detail cut to fit is cut between characters, so the trace stays
+  // valid UTF-8.
+  TEST(tracer, TruncatesDetailAtCharacters)
+  {
+    SetTracing(true);
+    for (int shift = 0; shift < 4; shift++)
+    {
+      // Three- and four-byte characters straddling the cut.
+      std::string detail = std::string(static_cast<size_t>(shift), 'x');
+      for (int i = 0; i < 6; i++)
+      {
+        detail += i % 2 == 0 ? "\xe2\x82\xac" : "\xf0\x9f\x98\x80";
+      }
+      TraceSpan span("cut", detail.c_str());
+    }
+    std::vector<Event> events = ParseTrace(DumpTrace());
+    ASSERT_EQ(events.size(), static_cast<size_t>(4));
+    for (const Event &event : events)
+    {
+      EXPECT_TRUE(event.detail.size() < TraceSpan::kDetailSize);
+      EXPECT_TRUE(event.detail.size() + 4 >= TraceSpan::kDetailSize);
+    }
+    SetTracing(false);
+  }
+
+  // A thread keeps its latest spans, and starting a trace leaves out the
+  // spans recorded before.
+  TEST(tracer, KeepsLatestSpans)
+  {
+    SetTracing(true);
+    for (size_t i = 0; i < kTraceEventsPerThread + 100; i++)
+    {
+      TraceSpan span("loop", std::to_string(i).c_str());
+    }
+    std::vector<Event> events = ParseTrace(DumpTrace());
+    ASSERT_EQ(events.size(), kTraceEventsPerThread);
+    EXPECT_EQ(events.front().detail, std::string("100"));
+    EXPECT_EQ(events.back().detail, std::to_string(kTraceEventsPerThread + 99));
+
+    SetTracing(true);
+    {
+      TraceSpan span("fresh");
+    }
+    events = ParseTrace(DumpTrace());
+    ASSERT_EQ(events.size(), static_cast<size_t>(1));
+    EXPECT_EQ(events[0].name, std::string("fresh"));
+    SetTracing(false);
+  }
+
+  // Dumps taken while threads record parse every time.
+  TEST(tracer, DumpsWhileRecording)
+  {
+    SetTracing(true);
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; t++)
+    {
+      threads.emplace_back([&stop]
+                           {
+                             while (!stop.load())
+                             {
+                               TraceSpan span("busy", "detail \"quoted\"");
+                             } });
+    }
+    for (int dump = 0; dump < 10; dump++)
+    {
+      std::vector<Event> events = ParseTrace(DumpTrace());
+      EXPECT_TRUE(events.size() <= 2 * kTraceEventsPerThread);
+    }
+    stop.store(true);
+    for (std::thread &thread : threads)
+    {
+      thread.join();
+    }
+    SetTracing(false);
+  }
+
+} // namespace wireguard_flutter
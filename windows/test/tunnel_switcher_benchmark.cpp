@@ -0,0 +1,160 @@
+// How long traffic has no tunnel while TunnelSwitcher moves it between
+// servers: make-before-break between split tunnels, against the
+// break-before-make that a full tunnel's kill switch forces, to and from
+// one. The backend is a fake whose tunnels take as long to start, to
+// handshake and to stop as the delays below, scaled down from what the
+// tunnel service takes.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "benchmark.h"
+#include "tunnel_switcher.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    const std::chrono::milliseconds kStartDelay(40);
+    const std::chrono::milliseconds kHandshakeDelay(20);
+    const std::chrono::milliseconds kStopDelay(60);
+    const int kSwitches = 8;
+
+    std::string Config(const std::string &name, bool full_tunnel)
+    {
+      return "# " + name + "\n[Interface]\nPrivateKey = x\n\n[Peer]\nPublicKey = y\nAllowedIPs = " +
+             (full_tunnel ? "0.0.0.0/0, ::/0" : "10.0.0.0/8") + "\nEndpoint = " + name + ".example:51820\n";
+    }
+
+    // Tunnels that take their delays, and blocked handshakes beside a full
+    // tunnel, as in the tests. Traffic loses its tunnel once the one
+    // carrying it starts to stop, and has one again when a tunnel is routed.
+    class DelayedBackend : public TunnelBackend
+    {
+    public:
+      Tunnel Start(const std::string &config) override
+      {
+        std::this_thread::sleep_for(kStartDelay);
+        std::lock_guard<std::mutex> lock(mutex_);
+        Tunnel tunnel = next_++;
+        started_[tunnel] = benchmark::Now();
+        blocks_[tunnel] = BlocksOtherTunnels(config);
+        return tunnel;
+      }
+
+      bool HandshakeDone(Tunnel tunnel) override
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto &other : blocks_)
+        {
+          if (other.first != tunnel && other.second)
+          {
+            return false;
+          }
+        }
+        auto started = started_.find(tunnel);
+        return started != started_.end() &&
+               benchmark::Now() - started->second >= std::chrono::duration<double>(kHandshakeDelay).count();
+      }
+
+      void Route(Tunnel tunnel, Tunnel previous) override
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (gap_start_ >= 0)
+        {
+          double gap = benchmark::Now() - gap_start_;
+          gaps_++;
+          total_gap_ += gap;
+          worst_gap_ = std::max(worst_gap_, gap);
+          gap_start_ = -1;
+        }
+        else if (previous != kNoTunnel)
+        {
+          gaps_++;
+        }
+        carrier_ = tunnel;
+      }
+
+      void Stop(Tunnel tunnel) override
+      {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (tunnel == carrier_)
+          {
+            carrier_ = kNoTunnel;
+            gap_start_ = benchmark::Now();
+          }
+        }
+        std::this_thread::sleep_for(kStopDelay);
+        std::lock_guard<std::mutex> lock(mutex_);
+        started_.erase(tunnel);
+        blocks_.erase(tunnel);
+      }
+
+      // The switches that moved traffic since the last call, and the mean
+      // and the longest time it had no tunnel, in seconds.
+      void TakeGaps(int *switches, double *mean, double *worst)
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        *switches = gaps_;
+        *mean = gaps_ == 0 ? 0 : total_gap_ / gaps_;
+        *worst = worst_gap_;
+        gaps_ = 0;
+        total_gap_ = 0;
+        worst_gap_ = 0;
+      }
+
+    private:
+      std::mutex mutex_;
+      Tunnel next_ = 0;
+      std::map<Tunnel, double> started_;
+      std::map<Tunnel, bool> blocks_;
+      Tunnel carrier_ = kNoTunnel;
+      double gap_start_ = -1;
+      int gaps_ = 0;
+      double total_gap_ = 0;
+      double worst_gap_ = 0;
+    };
+
+    // Connects to |from|, then switches between |to| and |from| kSwitches
+    // times, and reports the gaps and how long the switches took.
+    void Run(const char *label, bool from_full, bool to_full)
+    {
+      DelayedBackend backend;
+      TunnelSwitcher switcher(&backend, SwitchOptions(), [](const std::string &) {});
+      switcher.SwitchTo(Config("from", from_full));
+      int gaps;
+      double mean, worst;
+      backend.TakeGaps(&gaps, &mean, &worst);
+
+      int make_before_break = 0;
+      double start = benchmark::Now();
+      for (int i = 0; i < kSwitches; i++)
+      {
+        bool to = i % 2 == 0;
+        make_before_break += switcher.SwitchTo(to ? Config("to", to_full) : Config("from", from_full));
+      }
+      double per_switch = (benchmark::Now() - start) / kSwitches;
+      backend.TakeGaps(&gaps, &mean, &worst);
+      printf("%-14s %d/%d make-before-break  switch %6.1f ms  no tunnel mean %6.1f ms  worst %6.1f ms\n", label,
+             make_before_break, gaps, per_switch * 1e3, mean * 1e3, worst * 1e3);
+    }
+
+  } // namespace
+
+  BENCHMARK(tunnel_switcher)
+  {
+    printf("start %lld ms  handshake %lld ms  stop %lld ms\n", static_cast<long long>(kStartDelay.count()),
+           static_cast<long long>(kHandshakeDelay.count()), static_cast<long long>(kStopDelay.count()));
+    Run("split to split", false, false);
+    Run("split to full", false, true);
+    Run("full to full", true, true);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,347 @@
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "test.h"
+#include "tunnel_switcher.h"
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    // A wg-quick config named by its first line; a full tunnel routes
+    // everything through its one peer.
+    std::string Config(const std::string &name, bool full_tunnel = false)
+    {
+      return "# " + name + "\n[Interface]\nPrivateKey = x\n\n[Peer]\nPublicKey = y\nAllowedIPs = " +
+             (full_tunnel ? "0.0.0.0/0, ::/0" : "10.0.0.0/8") + "\nEndpoint = " + name + ".example:51820\n";
+    }
+
+    // Tunnels that handshake unless another running tunnel blocks them, as
+    // the tunnel service's firewall would, and a log of what was done.
+    class FakeBackend : public TunnelBackend
+    {
+    public:
+      Tunnel Start(const std::string &config) override
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string name = config.substr(2, config.find('\n') - 2);
+        log_.push_back("start " + name);
+        if (unreachable_.count(name) != 0 && fail_start_)
+        {
+          throw std::runtime_error("failed to start");
+        }
+        Tunnel tunnel = next_++;
+        names_[tunnel] = name;
+        blocks_[tunnel] = BlocksOtherTunnels(config);
+        return tunnel;
+      }
+
+      bool HandshakeDone(Tunnel tunnel) override
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (names_.count(tunnel) == 0 || unreachable_.count(names_[tunnel]) != 0)
+        {
+          return false;
+        }
+        for (const auto &other : blocks_)
+        {
+          if (other.first != tunnel && other.second)
+          {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      void Route(Tunnel tunnel, Tunnel previous) override
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        log_.push_back("route " + names_[tunnel] + " from " + (previous == kNoTunnel ? "-" : names_[previous]));
+      }
+
+      void Stop(Tunnel tunnel) override
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        log_.push_back("stop " + names_[tunnel]);
+        blocks_.erase(tunnel);
+      }
+
+      void SetUnreachable(const std::string &name)
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        unreachable_.insert(name);
+      }
+
+      void SetFailStart()
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fail_start_ = true;
+      }
+
+      std::vector<std::string> log()
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return log_;
+      }
+
+      bool Logged(const std::string &entry)
+      {
+        std::vector<std::string> entries = log();
+        return std::find(entries.begin(), entries.end(), entry) != entries.end();
+      }
+
+      // Where |entry| is in the log, or -1; waits a while for it, as tunnels
+      // are stopped on the switcher's own thread.
+      int Find(const std::string &entry)
+      {
+        for (int i = 0; i < 500; i++)
+        {
+          std::vector<std::string> entries = log();
+          auto it = std::find(entries.begin(), entries.end(), entry);
+          if (it != entries.end())
+          {
+            return static_cast<int>(it - entries.begin());
+          }
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return -1;
+      }
+
+    private:
+      std::mutex mutex_;
+      Tunnel next_ = 0;
+      std::map<Tunnel, std::string> names_;
+      // Running tunnels, and whether each blocks the others.
+      std::map<Tunnel, bool> blocks_;
+      std::set<std::string> unreachable_;
+      bool fail_start_ = false;
+      std::vector<std::string> log_;
+    };
+
+    class Stages
+    {
+    public:
+      TunnelSwitcher::StageListener Listener()
+      {
+        return [this](const std::string &stage)
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          stages_.push_back(stage);
+        };
+      }
+
+      std::vector<std::string> Take()
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::string> stages;
+        stages.swap(stages_);
+        return stages;
+      }
+
+    private:
+      std::mutex mutex_;
+      std::vector<std::string> stages_;
+    };
+
+    SwitchOptions FastOptions()
+    {
+      SwitchOptions options;
+      options.handshake_timeout = std::chrono::milliseconds(200);
+      options.poll_interval = std::chrono::milliseconds(1);
+      return options;
+    }
+
+    bool SwitchThrows(TunnelSwitcher *switcher, const std::string &config)
+    {
+      try
+      {
+        switcher->SwitchTo(config);
+      }
+      catch (const std::runtime_error &)
+      {
+        return true;
+      }
+      return false;
+    }
+
+    bool StandbyThrows(TunnelSwitcher *switcher, const std::string &config)
+    {
+      try
+      {
+        switcher->SetStandby(config);
+      }
+      catch (const std::runtime_error &)
+      {
+        return true;
+      }
+      return false;
+    }
+
+  } // namespace
+
+  TEST(tunnel_switcher, BlocksOtherTunnels)
+  {
+    EXPECT_TRUE(BlocksOtherTunnels(Config("a", true)));
+    EXPECT_FALSE(BlocksOtherTunnels(Config("a")));
+    EXPECT_TRUE(BlocksOtherTunnels("[Interface]\n[Peer]\nAllowedIPs = 10.0.0.0/8,::/0\n"));
+    EXPECT_TRUE(BlocksOtherTunnels("[interface]\r\n[PEER]\r\n  allowedips=0.0.0.0/0 # all\r\n"));
+    // Split default routes are not default routes.
+    EXPECT_FALSE(BlocksOtherTunnels("[Interface]\n[Peer]\nAllowedIPs = 0.0.0.0/1, 128.0.0.0/1\n"));
+    EXPECT_FALSE(BlocksOtherTunnels("[Interface]\n[Peer]\nAllowedIPs = 10.0.0.0/10\n"));
+    EXPECT_FALSE(BlocksOtherTunnels("[Interface]\n[Peer]\n# AllowedIPs = 0.0.0.0/0\nAllowedIPs = 10.0.0.1\n"));
+    // The kill switch is only for a single peer, and not without routes.
+    EXPECT_FALSE(BlocksOtherTunnels("[Interface]\n[Peer]\nAllowedIPs = 0.0.0.0/0\n[Peer]\nAllowedIPs = 10.0.0.1/32\n"));
+    EXPECT_FALSE(BlocksOtherTunnels("[Interface]\nTable = off\n[Peer]\nAllowedIPs = 0.0.0.0/0\n"));
+    EXPECT_FALSE(BlocksOtherTunnels("AllowedIPs = 0.0.0.0/0\n"));
+    EXPECT_FALSE(BlocksOtherTunnels(""));
+  }
+
+  // The new tunnel is up and has handshaken before traffic moves to it, and
+  // the old one goes only afterwards.
+  TEST(tunnel_switcher, MakesBeforeBreaking)
+  {
+    FakeBackend backend;
+    Stages stages;
+    TunnelSwitcher switcher(&backend, FastOptions(), stages.Listener());
+    switcher.Adopt(backend.Start(Config("a")), Config("a"));
+    EXPECT_TRUE(switcher.SwitchTo(Config("b")));
+    EXPECT_TRUE(switcher.state() == TunnelSwitcher::State::kConnected);
+    EXPECT_TRUE(stages.Take() == std::vector<std::string>({"reconnect", "connected"}));
+    int route = backend.Find("route b from a");
+    ASSERT_TRUE(route >= 0);
+    EXPECT_TRUE(backend.Find("start b") < route);
+    EXPECT_TRUE(backend.Find("stop a") > route);
+    EXPECT_FALSE(backend.Logged("stop b"));
+  }
+
+  // A full tunnel's kill switch would block the other tunnel's traffic, so
+  // switching to or from one takes the old tunnel down first.
+  TEST(tunnel_switcher, BreaksBeforeMakingAroundKillSwitch)
+  {
+    FakeBackend backend;
+    Stages stages;
+    TunnelSwitcher switcher(&backend, FastOptions(), stages.Listener());
+    switcher.Adopt(backend.Start(Config("a")), Config("a"));
+    switcher.SetStandby(Config("s"));
+
+    EXPECT_FALSE(switcher.SwitchTo(Config("full", true)));
+    std::vector<std::string> log = backend.log();
+    EXPECT_TRUE(log == std::vector<std::string>(
+                           {"start a", "start s", "stop a", "stop s", "start full", "route full from -"}));
+    EXPECT_TRUE(stages.Take() == std::vector<std::string>({"reconnect", "connected"}));
+
+    EXPECT_FALSE(switcher.SwitchTo(Config("b")));
+    log = backend.log();
+    EXPECT_TRUE(std::vector<std::string>(log.begin() + 6, log.end()) ==
+                std::vector<std::string>({"stop full", "start b", "route b from -"}));
+    EXPECT_TRUE(switcher.state() == TunnelSwitcher::State::kConnected);
+
+    // Back to make-before-break between tunnels that let each other be.
+    EXPECT_TRUE(switcher.SwitchTo(Config("c")));
+    EXPECT_TRUE(backend.Find("route c from b") >= 0);
+  }
+
+  // When a switch fails, traffic stays on the active tunnel, unless the
+  // switch had to take it down.
+  TEST(tunnel_switcher, KeepsActiveOnFailure)
+  {
+    FakeBackend backend;
+    Stages stages;
+    TunnelSwitcher switcher(&backend, FastOptions(), stages.Listener());
+    switcher.Adopt(backend.Start(Config("a")), Config("a"));
+    backend.SetUnreachable("b");
+    backend.SetUnreachable("full");
+
+    EXPECT_TRUE(SwitchThrows(&switcher, Config("b")));
+    EXPECT_TRUE(switcher.state() == TunnelSwitcher::State::kConnected);
+    EXPECT_TRUE(stages.Take() == std::vector<std::string>({"reconnect", "connected"}));
+    EXPECT_TRUE(backend.Find("stop b") >= 0);
+    EXPECT_FALSE(backend.Logged("stop a"));
+
+    EXPECT_TRUE(SwitchThrows(&switcher, Config("full", true)));
+    EXPECT_TRUE(switcher.state() == TunnelSwitcher::State::kIdle);
+    EXPECT_TRUE(stages.Take() == std::vector<std::string>({"reconnect", "no_connection"}));
+    EXPECT_TRUE(backend.Find("stop a") >= 0);
+    EXPECT_TRUE(backend.Find("stop full") >= 0);
+
+    backend.SetFailStart();
+    EXPECT_TRUE(SwitchThrows(&switcher, Config("b")));
+    EXPECT_TRUE(stages.Take() == std::vector<std::string>({"connecting", "no_connection"}));
+  }
+
+  // A standby beside a full tunnel could never handshake, nor a full
+  // tunnel standby let the active one carry traffic.
+  TEST(tunnel_switcher, RefusesStandbyBesideKillSwitch)
+  {
+    FakeBackend backend;
+    Stages stages;
+    TunnelSwitcher switcher(&backend, FastOptions(), stages.Listener());
+    switcher.Adopt(backend.Start(Config("a")), Config("a"));
+    EXPECT_TRUE(StandbyThrows(&switcher, Config("full", true)));
+    EXPECT_FALSE(backend.Logged("start full"));
+
+    switcher.SwitchTo(Config("full", true));
+    EXPECT_TRUE(StandbyThrows(&switcher, Config("s")));
+    EXPECT_FALSE(backend.Logged("start s"));
+    EXPECT_FALSE(switcher.Failover());
+    // Dropping the standby is always fine.
+    EXPECT_FALSE(StandbyThrows(&switcher, ""));
+  }
+
+  // A handshaken standby takes over without a new tunnel.
+  TEST(tunnel_switcher, UsesStandby)
+  {
+    FakeBackend backend;
+    Stages stages;
+    TunnelSwitcher switcher(&backend, FastOptions(), stages.Listener());
+    switcher.Adopt(backend.Start(Config("a")), Config("a"));
+    switcher.SetStandby(Config("s"));
+    EXPECT_TRUE(switcher.SwitchTo(Config("s")));
+    EXPECT_TRUE(backend.Find("route s from a") >= 0);
+    EXPECT_TRUE(backend.Find("stop a") >= 0);
+    std::vector<std::string> log = backend.log();
+    EXPECT_EQ(std::count(log.begin(), log.end(), std::string("start s")), 1);
+
+    switcher.SetStandby(Config("t"));
+    EXPECT_TRUE(switcher.Failover());
+    EXPECT_TRUE(backend.Find("route t from s") >= 0);
+    EXPECT_FALSE(switcher.Failover());
+  }
+
+  // Stop() cuts short a switch waiting for its handshake, which reports no
+  // stages of its own afterwards.
+  TEST(tunnel_switcher, StopCancelsSwitch)
+  {
+    FakeBackend backend;
+    Stages stages;
+    SwitchOptions options = FastOptions();
+    options.handshake_timeout = std::chrono::seconds(30);
+    TunnelSwitcher switcher(&backend, options, stages.Listener());
+    switcher.Adopt(backend.Start(Config("a")), Config("a"));
+    backend.SetUnreachable("b");
+
+    auto start = std::chrono::steady_clock::now();
+    bool thrown = false;
+    std::thread thread([&]
+                       { thrown = SwitchThrows(&switcher, Config("b")); });
+    ASSERT_TRUE(backend.Find("start b") >= 0);
+    switcher.Stop();
+    thread.join();
+    EXPECT_TRUE(thrown);
+    EXPECT_TRUE(std::chrono::steady_clock::now() - start < std::chrono::seconds(10));
+    EXPECT_TRUE(switcher.state() == TunnelSwitcher::State::kIdle);
+    EXPECT_TRUE(stages.Take() == std::vector<std::string>({"reconnect", "disconnecting", "disconnected"}));
+    EXPECT_TRUE(backend.Find("stop a") >= 0);
+    EXPECT_TRUE(backend.Find("stop b") >= 0);
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,59 @@
+#ifndef WIREGUARD_FLUTTER_TEST_WIREGUARD_LAYOUT_H
+#define WIREGUARD_FLUTTER_TEST_WIREGUARD_LAYOUT_H
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2ipdef.h>
+#else
+#include <netinet/in.h>
+#endif
+
+#include <cstdint>
+
+namespace wireguard_flutter {
+namespace test {
+
+// Types laid out as wireguard.h's WIREGUARD_INTERFACE, WIREGUARD_PEER,
+// WIREGUARD_ALLOWED_IP and SOCKADDR_INET, with the same member names, so the
+// templates that take those can be tested without the Windows headers.
+
+struct alignas(8) AllowedIp {
+  union {
+    in_addr V4;
+    in6_addr V6;
+  } Address;
+  uint16_t AddressFamily;
+  uint8_t Cidr;
+};
+
+union SockaddrInet {
+  sockaddr_in Ipv4;
+  sockaddr_in6 Ipv6;
+  uint16_t si_family;
+};
+
+struct alignas(8) Peer {
+  uint32_t Flags;
+  uint32_t Reserved;
+  uint8_t PublicKey[32];
+  uint8_t PresharedKey[32];
+  uint16_t PersistentKeepalive;
+  SockaddrInet Endpoint;
+  uint64_t TxBytes;
+  uint64_t RxBytes;
+  uint64_t LastHandshake;
+  uint32_t AllowedIPsCount;
+};
+
+struct alignas(8) Interface {
+  uint32_t Flags;
+  uint16_t ListenPort;
+  uint8_t PrivateKey[32];
+  uint8_t PublicKey[32];
+  uint32_t PeersCount;
+};
+
+}  // namespace test
+}  // namespace wireguard_flutter
+
+#endif
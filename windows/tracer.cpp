@@ -0,0 +1,275 @@
+#include "tracer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace wireguard_flutter
+{
+
+  namespace internal
+  {
+    std::atomic<bool> tracing_enabled{false};
+  } // namespace internal
+
+  namespace
+  {
+
+    const size_t kDetailWords = TraceSpan::kDetailSize / 8;
+
+    // Fields are atomics so DumpTrace() can read a slot while its thread
+    // writes it; relaxed stores compile to plain moves.
+    struct TraceEvent
+    {
+      std::atomic<const char *> name;
+      std::atomic<int64_t> start_ns;
+      std::atomic<int64_t> duration_ns;
+      std::atomic<uint64_t> detail[kDetailWords];
+    };
+
+    // Written by one thread at a time. Event n goes to slot n %
+    // kTraceEventsPerThread; |begun| moves past n before the slot is
+    // written and |written| after, so a reader can tell which of the slots
+    // it read might have been overwritten meanwhile.
+    struct ThreadBuffer
+    {
+      uint32_t tid = 0;
+      std::atomic<uint64_t> begun{0};
+      std::atomic<uint64_t> written{0};
+      TraceEvent events[kTraceEventsPerThread];
+    };
+
+    struct Registry
+    {
+      std::mutex mutex;
+      std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+      // Buffers of threads that exited, reused by new threads so the
+      // memory stays bounded by the number of live threads.
+      std::vector<ThreadBuffer *> free;
+    };
+
+    Registry &GetRegistry()
+    {
+      // Never destroyed, as threads may still end spans during exit.
+      static Registry *registry = new Registry();
+      return *registry;
+    }
+
+    std::atomic<int64_t> trace_start_ns{0};
+
+    int64_t Now()
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+    }
+
+    struct ThreadBufferOwner
+    {
+      ThreadBuffer *buffer = nullptr;
+
+      ~ThreadBufferOwner()
+      {
+        if (buffer != nullptr)
+        {
+          Registry &registry = GetRegistry();
+          std::lock_guard<std::mutex> lock(registry.mutex);
+          registry.free.push_back(buffer);
+        }
+      }
+    };
+
+    thread_local ThreadBufferOwner thread_buffer;
+
+    ThreadBuffer *GetThreadBuffer()
+    {
+      if (thread_buffer.buffer == nullptr)
+      {
+        Registry &registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        if (!registry.free.empty())
+        {
+          thread_buffer.buffer = registry.free.back();
+          registry.free.pop_back();
+        }
+        else
+        {
+          registry.buffers.emplace_back(new ThreadBuffer());
+          thread_buffer.buffer = registry.buffers.back().get();
+          thread_buffer.buffer->tid = static_cast<uint32_t>(registry.buffers.size());
+        }
+      }
+      return thread_buffer.buffer;
+    }
+
+    struct Span
+    {
+      uint32_t tid;
+      const char *name;
+      int64_t start_ns;
+      int64_t duration_ns;
+      uint64_t detail[kDetailWords];
+    };
+
+    void AppendEscaped(std::string *out, const char *text)
+    {
+      for (; *text != '\0'; text++)
+      {
+        unsigned char c = static_cast<unsigned char>(*text);
+        if (c == '"' || c == '\\')
+        {
+          out->push_back('\\');
+          out->push_back(static_cast<char>(c));
+        }
+        else if (c < 0x20)
+        {
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          out->append(escaped);
+        }
+        else
+        {
+          out->push_back(static_cast<char>(c));
+        }
+      }
+    }
+
+    // Chrome trace timestamps are microseconds.
+    void AppendMicros(std::string *out, int64_t ns)
+    {
+      char number[32];
+      snprintf(number, sizeof(number), "%" PRId64 ".%03" PRId64, ns / 1000, ns % 1000);
+      out->append(number);
+    }
+
+  } // namespace
+
+  constexpr size_t TraceSpan::kDetailSize;
+
+  void SetTracing(bool enabled)
+  {
+    if (enabled)
+    {
+      trace_start_ns.store(Now(), std::memory_order_relaxed);
+    }
+    internal::tracing_enabled.store(enabled, std::memory_order_relaxed);
+  }
+
+  bool TracingEnabled()
+  {
+    return internal::tracing_enabled.load(std::memory_order_relaxed);
+  }
+
+  void TraceSpan::Begin(const char *name, const char *detail)
+  {
+    name_ = name;
+    memset(detail_, 0, sizeof(detail_));
+    if (detail != nullptr)
+    {
+      // Cut between characters, so the dump stays valid UTF-8: back off
+      // while the first byte left out continues a character.
+      size_t len = strnlen(detail, kDetailSize - 1);
+      while (len > 0 && (static_cast<unsigned char>(detail[len]) & 0xc0) == 0x80)
+      {
+        len--;
+      }
+      memcpy(detail_, detail, len);
+    }
+    start_ns_ = Now();
+  }
+
+  void TraceSpan::End()
+  {
+    int64_t duration_ns = Now() - start_ns_;
+    ThreadBuffer *buffer = GetThreadBuffer();
+    uint64_t n = buffer->written.load(std::memory_order_relaxed);
+    buffer->begun.store(n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    TraceEvent &event = buffer->events[n % kTraceEventsPerThread];
+    event.name.store(name_, std::memory_order_relaxed);
+    event.start_ns.store(start_ns_, std::memory_order_relaxed);
+    event.duration_ns.store(duration_ns, std::memory_order_relaxed);
+    for (size_t i = 0; i < kDetailWords; i++)
+    {
+      event.detail[i].store(detail_[i], std::memory_order_relaxed);
+    }
+    buffer->written.store(n + 1, std::memory_order_release);
+  }
+
+  std::string DumpTrace()
+  {
+    int64_t trace_start = trace_start_ns.load(std::memory_order_relaxed);
+    std::vector<Span> spans;
+    {
+      Registry &registry = GetRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      for (auto &buffer : registry.buffers)
+      {
+        uint64_t written = buffer->written.load(std::memory_order_acquire);
+        uint64_t first = written > kTraceEventsPerThread ? written - kTraceEventsPerThread : 0;
+        size_t read_from = spans.size();
+        for (uint64_t n = first; n < written; n++)
+        {
+          TraceEvent &event = buffer->events[n % kTraceEventsPerThread];
+          Span span;
+          span.tid = buffer->tid;
+          span.name = event.name.load(std::memory_order_relaxed);
+          span.start_ns = event.start_ns.load(std::memory_order_relaxed);
+          span.duration_ns = event.duration_ns.load(std::memory_order_relaxed);
+          for (size_t i = 0; i < kDetailWords; i++)
+          {
+            span.detail[i] = event.detail[i].load(std::memory_order_relaxed);
+          }
+          spans.push_back(span);
+        }
+        // Drops the spans whose slots the thread began to reuse while they
+        // were read.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t begun = buffer->begun.load(std::memory_order_relaxed);
+        uint64_t valid_from = begun > kTraceEventsPerThread ? begun - kTraceEventsPerThread : 0;
+        if (valid_from > first)
+        {
+          size_t overwritten = static_cast<size_t>(std::min(valid_from, written) - first);
+          spans.erase(spans.begin() + read_from, spans.begin() + read_from + overwritten);
+        }
+      }
+    }
+
+    std::string json;
+    json.reserve(256 + spans.size() * 160);
+    json.append("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    json.append("{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"wireguard_flutter\"}}");
+    for (const Span &span : spans)
+    {
+      if (span.start_ns < trace_start)
+      {
+        continue;
+      }
+      char ids[64];
+      snprintf(ids, sizeof(ids), "\"pid\":1,\"tid\":%" PRIu32 ",\"ts\":", span.tid);
+      json.append(",{\"ph\":\"X\",\"cat\":\"wireguard_flutter\",\"name\":\"");
+      AppendEscaped(&json, span.name);
+      json.append("\",");
+      json.append(ids);
+      AppendMicros(&json, span.start_ns - trace_start);
+      json.append(",\"dur\":");
+      AppendMicros(&json, span.duration_ns);
+      const char *detail = reinterpret_cast<const char *>(span.detail);
+      if (detail[0] != '\0')
+      {
+        json.append(",\"args\":{\"detail\":\"");
+        AppendEscaped(&json, detail);
+        json.append("\"}");
+      }
+      json.push_back('}');
+    }
+    json.append("]}");
+    return json;
+  }
+
+} // namespace wireguard_flutter
@@ -0,0 +1,63 @@
+#ifndef WIREGUARD_FLUTTER_TRACER_H
+#define WIREGUARD_FLUTTER_TRACER_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace wireguard_flutter {
+
+// Records how long plugin operations take, for reading in Perfetto or
+// chrome://tracing. Each thread keeps its last kTraceEventsPerThread spans
+// in a buffer of its own, so recording takes no locks; when tracing is off
+// a span costs one relaxed load. Uses only the standard library, so it
+// builds and can be measured on any platform.
+constexpr size_t kTraceEventsPerThread = 4096;
+
+// Starts a new trace, leaving out the spans recorded before, or stops
+// recording. The spans recorded so far can still be dumped after stopping.
+void SetTracing(bool enabled);
+
+bool TracingEnabled();
+
+// The spans of the current or last trace, as Chrome trace-event JSON.
+std::string DumpTrace();
+
+namespace internal {
+extern std::atomic<bool> tracing_enabled;
+}  // namespace internal
+
+// Records the time from its construction to its destruction as a span
+// named |name|, which must be a string literal. |detail|, e.g. the method
+// called, is copied, up to kDetailSize - 1 bytes.
+class TraceSpan {
+ public:
+  static constexpr size_t kDetailSize = 24;
+
+  explicit TraceSpan(const char *name, const char *detail = nullptr) : name_(nullptr) {
+    if (internal::tracing_enabled.load(std::memory_order_relaxed)) {
+      Begin(name, detail);
+    }
+  }
+
+  ~TraceSpan() {
+    if (name_ != nullptr) {
+      End();
+    }
+  }
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+ private:
+  void Begin(const char *name, const char *detail);
+  void End();
+
+  const char *name_;
+  int64_t start_ns_;
+  uint64_t detail_[kDetailSize / 8];
+};
+
+}  // namespace wireguard_flutter
+
+#endif
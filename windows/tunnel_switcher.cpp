@@ -0,0 +1,408 @@
+#include "tunnel_switcher.h"
+
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+#include <stdexcept>
+
+namespace wireguard_flutter
+{
+
+  namespace
+  {
+
+    std::string Trim(const std::string &text)
+    {
+      size_t begin = text.find_first_not_of(" \t\r");
+      if (begin == std::string::npos)
+      {
+        return std::string();
+      }
+      return text.substr(begin, text.find_last_not_of(" \t\r") + 1 - begin);
+    }
+
+    std::string Lower(std::string text)
+    {
+      std::transform(text.begin(), text.end(), text.begin(),
+                     [](unsigned char c)
+                     { return static_cast<char>(std::tolower(c)); });
+      return text;
+    }
+
+  } // namespace
+
+  constexpr TunnelBackend::Tunnel TunnelBackend::kNoTunnel;
+
+  bool BlocksOtherTunnels(const std::string &config)
+  {
+    size_t peers = 0;
+    bool default_route = false;
+    bool table_off = false;
+    std::string section;
+    std::istringstream lines(config);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+      line = Trim(line.substr(0, line.find('#')));
+      if (line.empty())
+      {
+        continue;
+      }
+      if (line[0] == '[')
+      {
+        section = Lower(line);
+        if (section == "[peer]")
+        {
+          peers++;
+        }
+        continue;
+      }
+      size_t equals = line.find('=');
+      if (equals == std::string::npos)
+      {
+        continue;
+      }
+      std::string key = Lower(Trim(line.substr(0, equals)));
+      std::string value = Trim(line.substr(equals + 1));
+      if (section == "[interface]" && key == "table")
+      {
+        table_off = Lower(value) == "off";
+      }
+      else if (section == "[peer]" && key == "allowedips")
+      {
+        std::istringstream prefixes(value);
+        std::string prefix;
+        while (std::getline(prefixes, prefix, ','))
+        {
+          prefix = Trim(prefix);
+          size_t slash = prefix.find('/');
+          if (slash != std::string::npos && prefix.compare(slash + 1, std::string::npos, "0") == 0)
+          {
+            default_route = true;
+          }
+        }
+      }
+    }
+    return peers == 1 && default_route && !table_off;
+  }
+
+  TunnelSwitcher::TunnelSwitcher(TunnelBackend *backend, const SwitchOptions &options, StageListener listener)
+      : backend_(backend), options_(options), listener_(std::move(listener))
+  {
+    retire_thread_ = std::thread(&TunnelSwitcher::RetireLoop, this);
+  }
+
+  TunnelSwitcher::~TunnelSwitcher()
+  {
+    {
+      std::lock_guard<std::mutex> lock(retire_mutex_);
+      stopping_ = true;
+    }
+    retire_cv_.notify_all();
+    retire_thread_.join();
+    for (TunnelBackend::Tunnel tunnel : {active_, standby_})
+    {
+      if (tunnel != TunnelBackend::kNoTunnel)
+      {
+        try
+        {
+          backend_->Stop(tunnel);
+        }
+        catch (...)
+        {
+        }
+      }
+    }
+  }
+
+  void TunnelSwitcher::Adopt(TunnelBackend::Tunnel tunnel, const std::string &config)
+  {
+    TunnelBackend::Tunnel previous;
+    TunnelBackend::Tunnel standby = TunnelBackend::kNoTunnel;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      previous = active_;
+      active_ = tunnel;
+      active_blocks_ = BlocksOtherTunnels(config);
+      if (active_blocks_)
+      {
+        standby = standby_;
+        standby_ = TunnelBackend::kNoTunnel;
+        standby_config_.clear();
+      }
+      if (state_ == State::kIdle)
+      {
+        state_ = State::kConnected;
+      }
+    }
+    for (TunnelBackend::Tunnel retired : {previous, standby})
+    {
+      if (retired != TunnelBackend::kNoTunnel && retired != tunnel)
+      {
+        Retire(retired);
+      }
+    }
+  }
+
+  bool TunnelSwitcher::SwitchTo(const std::string &config)
+  {
+    bool blocks = BlocksOtherTunnels(config);
+    TunnelBackend::Tunnel candidate = TunnelBackend::kNoTunnel;
+    // Taken down before the new tunnel starts, when the switch goes
+    // break-before-make.
+    TunnelBackend::Tunnel broken[2] = {TunnelBackend::kNoTunnel, TunnelBackend::kNoTunnel};
+    bool had_active;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (state_ == State::kConnecting || state_ == State::kSwitching)
+      {
+        throw std::runtime_error("a switch is already in progress");
+      }
+      had_active = active_ != TunnelBackend::kNoTunnel;
+      state_ = had_active ? State::kSwitching : State::kConnecting;
+      if (blocks || active_blocks_)
+      {
+        broken[0] = active_;
+        broken[1] = standby_;
+        active_ = TunnelBackend::kNoTunnel;
+        active_blocks_ = false;
+        standby_ = TunnelBackend::kNoTunnel;
+        standby_config_.clear();
+      }
+      else if (standby_ != TunnelBackend::kNoTunnel && standby_config_ == config)
+      {
+        candidate = standby_;
+        standby_ = TunnelBackend::kNoTunnel;
+        standby_config_.clear();
+      }
+    }
+    listener_(had_active ? "reconnect" : "connecting");
+
+    TunnelBackend::Tunnel previous = TunnelBackend::kNoTunnel;
+    bool cancelled = false;
+    try
+    {
+      for (TunnelBackend::Tunnel tunnel : broken)
+      {
+        if (tunnel != TunnelBackend::kNoTunnel)
+        {
+          try
+          {
+            backend_->Stop(tunnel);
+          }
+          catch (...)
+          {
+            // The new tunnel may still come up beside it.
+          }
+        }
+      }
+      if (candidate == TunnelBackend::kNoTunnel)
+      {
+        candidate = backend_->Start(config);
+      }
+      if (!WaitForHandshake(candidate))
+      {
+        cancelled = Cancelled();
+        throw std::runtime_error(cancelled ? "the switch was cancelled"
+                                           : "the new tunnel did not complete a handshake in time");
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      // Stop() ran meanwhile.
+      if (state_ == State::kIdle)
+      {
+        cancelled = true;
+        throw std::runtime_error("the switch was cancelled");
+      }
+      previous = active_;
+      backend_->Route(candidate, previous);
+      active_ = candidate;
+      active_blocks_ = blocks;
+      state_ = State::kConnected;
+    }
+    catch (...)
+    {
+      if (candidate != TunnelBackend::kNoTunnel)
+      {
+        Retire(candidate);
+      }
+      bool connected;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Stop() may have run while the switch failed, and reported it.
+        cancelled = cancelled || state_ == State::kIdle;
+        connected = active_ != TunnelBackend::kNoTunnel;
+        if (!cancelled)
+        {
+          state_ = connected ? State::kConnected : State::kIdle;
+        }
+      }
+      if (!cancelled)
+      {
+        listener_(connected ? "connected" : "no_connection");
+      }
+      throw;
+    }
+
+    if (previous != TunnelBackend::kNoTunnel)
+    {
+      Retire(previous);
+    }
+    listener_("connected");
+    return broken[0] == TunnelBackend::kNoTunnel;
+  }
+
+  void TunnelSwitcher::SetStandby(const std::string &config)
+  {
+    if (!config.empty())
+    {
+      if (BlocksOtherTunnels(config))
+      {
+        throw std::runtime_error("a standby cannot block the active tunnel's traffic");
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (active_blocks_)
+      {
+        throw std::runtime_error("the active tunnel blocks a standby's traffic");
+      }
+    }
+    TunnelBackend::Tunnel tunnel = config.empty() ? TunnelBackend::kNoTunnel : backend_->Start(config);
+    TunnelBackend::Tunnel previous;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      previous = standby_;
+      standby_ = tunnel;
+      standby_config_ = config;
+    }
+    if (previous != TunnelBackend::kNoTunnel)
+    {
+      Retire(previous);
+    }
+  }
+
+  bool TunnelSwitcher::Failover()
+  {
+    TunnelBackend::Tunnel previous;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (standby_ == TunnelBackend::kNoTunnel || !backend_->HandshakeDone(standby_))
+      {
+        return false;
+      }
+      previous = active_;
+      backend_->Route(standby_, previous);
+      active_ = standby_;
+      active_blocks_ = false;
+      standby_ = TunnelBackend::kNoTunnel;
+      standby_config_.clear();
+      if (state_ == State::kIdle)
+      {
+        state_ = State::kConnected;
+      }
+    }
+    if (previous != TunnelBackend::kNoTunnel)
+    {
+      Retire(previous);
+    }
+    listener_("connected");
+    return true;
+  }
+
+  void TunnelSwitcher::Stop()
+  {
+    TunnelBackend::Tunnel tunnels[2];
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tunnels[0] = active_;
+      tunnels[1] = standby_;
+      active_ = TunnelBackend::kNoTunnel;
+      active_blocks_ = false;
+      standby_ = TunnelBackend::kNoTunnel;
+      standby_config_.clear();
+      state_ = State::kIdle;
+    }
+    listener_("disconnecting");
+    for (TunnelBackend::Tunnel tunnel : tunnels)
+    {
+      if (tunnel != TunnelBackend::kNoTunnel)
+      {
+        Retire(tunnel);
+      }
+    }
+    std::unique_lock<std::mutex> lock(retire_mutex_);
+    retire_cv_.wait(lock, [this]
+                    { return retiring_.empty() && !retire_busy_; });
+    lock.unlock();
+    listener_("disconnected");
+  }
+
+  TunnelSwitcher::State TunnelSwitcher::state()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return state_;
+  }
+
+  void TunnelSwitcher::Retire(TunnelBackend::Tunnel tunnel)
+  {
+    {
+      std::lock_guard<std::mutex> lock(retire_mutex_);
+      retiring_.push_back(tunnel);
+    }
+    retire_cv_.notify_all();
+  }
+
+  void TunnelSwitcher::RetireLoop()
+  {
+    std::unique_lock<std::mutex> lock(retire_mutex_);
+    for (;;)
+    {
+      retire_cv_.wait(lock, [this]
+                      { return stopping_ || !retiring_.empty(); });
+      // Drains the queue before exiting.
+      if (retiring_.empty())
+      {
+        return;
+      }
+      TunnelBackend::Tunnel tunnel = retiring_.front();
+      retiring_.pop_front();
+      retire_busy_ = true;
+      lock.unlock();
+      try
+      {
+        backend_->Stop(tunnel);
+      }
+      catch (...)
+      {
+        // Nothing is left to do about a tunnel that would not stop.
+      }
+      lock.lock();
+      retire_busy_ = false;
+      retire_cv_.notify_all();
+    }
+  }
+
+  bool TunnelSwitcher::WaitForHandshake(TunnelBackend::Tunnel tunnel)
+  {
+    auto deadline = std::chrono::steady_clock::now() + options_.handshake_timeout;
+    for (;;)
+    {
+      if (backend_->HandshakeDone(tunnel))
+      {
+        return true;
+      }
+      auto now = std::chrono::steady_clock::now();
+      if (now >= deadline || Cancelled())
+      {
+        return false;
+      }
+      std::this_thread::sleep_for(
+          std::min<std::chrono::steady_clock::duration>(options_.poll_interval, deadline - now));
+    }
+  }
+
+  bool TunnelSwitcher::Cancelled()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return state_ == State::kIdle;
+  }
+
+} // namespace wireguard_flutter
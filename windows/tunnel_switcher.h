@@ -0,0 +1,135 @@
+#ifndef WIREGUARD_FLUTTER_TUNNEL_SWITCHER_H
+#define WIREGUARD_FLUTTER_TUNNEL_SWITCHER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace wireguard_flutter {
+
+// What TunnelSwitcher drives: a way to run several tunnels side by side and
+// choose which one carries traffic.
+class TunnelBackend {
+ public:
+  typedef int Tunnel;
+  static constexpr Tunnel kNoTunnel = -1;
+
+  virtual ~TunnelBackend() {}
+
+  // Brings up a tunnel for the wg-quick |config| next to the others,
+  // without routing traffic through it. Throws std::runtime_error.
+  virtual Tunnel Start(const std::string &config) = 0;
+  // Whether |tunnel| has completed a handshake since it started.
+  virtual bool HandshakeDone(Tunnel tunnel) = 0;
+  // Routes traffic through |tunnel| instead of |previous|, which may be
+  // kNoTunnel, in one step. Throws std::runtime_error.
+  virtual void Route(Tunnel tunnel, Tunnel previous) = 0;
+  // Takes |tunnel| down. May take a while; called off the switching thread.
+  virtual void Stop(Tunnel tunnel) = 0;
+};
+
+// Whether the tunnel service blocks every other tunnel's traffic while it
+// runs |config|: wireguard-windows turns on its firewall kill switch for a
+// config with a single peer whose AllowedIPs hold a default route, 0.0.0.0/0
+// or ::/0, unless the interface sets Table = off. Such a tunnel can only run
+// alone.
+bool BlocksOtherTunnels(const std::string &config);
+
+struct SwitchOptions {
+  // How long a new tunnel has to complete its first handshake.
+  std::chrono::milliseconds handshake_timeout{10000};
+  std::chrono::milliseconds poll_interval{20};
+};
+
+// Switches servers make-before-break: the new tunnel comes up beside the
+// active one, and traffic moves to it only once it has completed a
+// handshake, so the switch costs no more than the route swap. The old
+// tunnel is taken down afterwards on a thread of the switcher's own,
+// since stopping can take seconds. A standby tunnel can also be kept up
+// and handshaking beside the active one, so Failover() can move traffic
+// to it without waiting; its config should set PersistentKeepalive, or it
+// goes quiet without traffic. Switches to or from a tunnel that blocks the
+// others, see BlocksOtherTunnels(), go break-before-make instead: the new
+// tunnel's handshake could not get past the old one's firewall, nor the old
+// one's traffic past the new one's.
+//
+// Stages are reported to |listener| with the VpnStage codes, on the thread
+// that called the switcher. Calls may come from several threads; one
+// switch runs at a time, and Stop() cancels it.
+class TunnelSwitcher {
+ public:
+  enum class State { kIdle, kConnecting, kConnected, kSwitching };
+
+  typedef std::function<void(const std::string &stage)> StageListener;
+
+  TunnelSwitcher(TunnelBackend *backend, const SwitchOptions &options, StageListener listener);
+  // Takes down every tunnel and waits for them.
+  ~TunnelSwitcher();
+
+  TunnelSwitcher(const TunnelSwitcher &) = delete;
+  TunnelSwitcher &operator=(const TunnelSwitcher &) = delete;
+
+  // Takes |tunnel|, already up for |config| and carrying traffic, as the
+  // active one, e.g. one started before the switcher existed.
+  void Adopt(TunnelBackend::Tunnel tunnel, const std::string &config);
+
+  // Connects to |config|, switching from the active tunnel if there is
+  // one. Uses the standby if it is for the same config and has completed
+  // a handshake. Throws std::runtime_error if the new tunnel fails to start
+  // or to complete a handshake in time; the active tunnel is kept then,
+  // unless the switch went break-before-make. Blocks for as long as the
+  // switch takes, up to the handshake timeout. Returns whether traffic had
+  // a tunnel throughout, i.e. false if the switch went break-before-make,
+  // as it does to or from a config that BlocksOtherTunnels().
+  bool SwitchTo(const std::string &config);
+
+  // Brings up a standby tunnel for |config|, replacing any other standby,
+  // or drops the standby if |config| is empty. Throws std::runtime_error if
+  // it fails to start, or if it or the active tunnel blocks other tunnels.
+  void SetStandby(const std::string &config);
+
+  // Moves traffic to the standby at once. Returns false, changing nothing,
+  // if there is no standby or it has not completed a handshake yet.
+  bool Failover();
+
+  // Takes the active and standby tunnels down.
+  void Stop();
+
+  State state();
+
+ private:
+  void Retire(TunnelBackend::Tunnel tunnel);
+  void RetireLoop();
+  // Waits for |tunnel|'s first handshake, up to the timeout or until Stop()
+  // cancels the switch.
+  bool WaitForHandshake(TunnelBackend::Tunnel tunnel);
+  bool Cancelled();
+
+  TunnelBackend *backend_;
+  SwitchOptions options_;
+  StageListener listener_;
+
+  std::mutex mutex_;
+  State state_ = State::kIdle;
+  TunnelBackend::Tunnel active_ = TunnelBackend::kNoTunnel;
+  // Whether the active tunnel blocks other tunnels.
+  bool active_blocks_ = false;
+  TunnelBackend::Tunnel standby_ = TunnelBackend::kNoTunnel;
+  std::string standby_config_;
+
+  // Tunnels waiting to be stopped.
+  std::mutex retire_mutex_;
+  std::condition_variable retire_cv_;
+  std::deque<TunnelBackend::Tunnel> retiring_;
+  bool retire_busy_ = false;
+  bool stopping_ = false;
+  std::thread retire_thread_;
+};
+
+}  // namespace wireguard_flutter
+
+#endif
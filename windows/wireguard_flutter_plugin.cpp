@@ -13,9 +13,13 @@
 
 #include <memory>
 #include <sstream>
+#include <stdexcept>
 
 #include "config_writer.h"
 #include "service_control.h"
+#include "service_tunnel_backend.h"
+#include "tracer.h"
+#include "tunnel_switcher.h"
 #include "utils.h"
 
 using namespace flutter;
@@ -32,7 +36,7 @@ namespace wireguard_flutter
     auto eventChannel = make_unique<EventChannel<EncodableValue>>(
         registrar->messenger(), "billion.group.wireguard_flutter/wgstage", &StandardMethodCodec::GetInstance());
 
-    auto plugin = make_unique<WireguardFlutterPlugin>();
+    auto plugin = make_unique<WireguardFlutterPlugin>(registrar);
 
     channel->SetMethodCallHandler([plugin_pointer = plugin.get()](const auto &call, auto result)
                                   { plugin_pointer->HandleMethodCall(call, move(result)); });
@@ -56,13 +60,154 @@ namespace wireguard_flutter
     registrar->AddPlugin(move(plugin));
   }
 
-  WireguardFlutterPlugin::WireguardFlutterPlugin() {}
+  WireguardFlutterPlugin::WireguardFlutterPlugin(PluginRegistrarWindows *registrar)
+      : registrar_(registrar), run_tasks_message_(RegisterWindowMessage(L"wireguard_flutter.RunPlatformTasks"))
+  {
+    window_proc_id_ = registrar_->RegisterTopLevelWindowProcDelegate(
+        [this](HWND hwnd, UINT message, WPARAM wparam, LPARAM lparam)
+        { return HandleWindowProc(hwnd, message, wparam, lparam); });
+  }
+
+  WireguardFlutterPlugin::~WireguardFlutterPlugin()
+  {
+    registrar_->UnregisterTopLevelWindowProcDelegate(window_proc_id_);
+    if (switcher_ != nullptr)
+    {
+      // Cuts short a switch still waiting for its handshake.
+      switcher_->Stop();
+    }
+    JoinSwitchThread();
+  }
+
+  void WireguardFlutterPlugin::RunSwitchTask(function<EncodableValue()> task, const string &error,
+                                             unique_ptr<MethodResult<EncodableValue>> result)
+  {
+    // Where results of the switch thread are posted; a headless engine has
+    // no view, and then switch tasks run on the platform thread.
+    if (window_ == NULL && registrar_->GetView() != nullptr)
+    {
+      window_ = GetAncestor(registrar_->GetView()->GetNativeWindow(), GA_ROOT);
+    }
+    if (window_ == NULL)
+    {
+      // Without a window there is no posting back; runs it here instead.
+      EncodableValue value;
+      try
+      {
+        value = task();
+      }
+      catch (exception &e)
+      {
+        result->Error(string(error).append(e.what()));
+        return;
+      }
+      result->Success(value);
+      return;
+    }
+    if (switch_busy_)
+    {
+      result->Error(string(error).append("a switch is already in progress"));
+      return;
+    }
+    JoinSwitchThread();
+    switch_busy_ = true;
+    // Shared, as std::function needs a copyable task.
+    shared_ptr<MethodResult<EncodableValue>> shared_result = move(result);
+    switch_thread_ = thread(
+        [this, task, error, shared_result]
+        {
+          EncodableValue value;
+          string message;
+          bool failed = false;
+          try
+          {
+            value = task();
+          }
+          catch (exception &e)
+          {
+            failed = true;
+            message = string(error).append(e.what());
+          }
+          switch_busy_ = false;
+          RunOnPlatformThread(
+              [shared_result, value, failed, message]
+              {
+                if (failed)
+                {
+                  shared_result->Error(message);
+                }
+                else
+                {
+                  shared_result->Success(value);
+                }
+              });
+        });
+  }
 
-  WireguardFlutterPlugin::~WireguardFlutterPlugin() {}
+  void WireguardFlutterPlugin::JoinSwitchThread()
+  {
+    if (switch_thread_.joinable())
+    {
+      switch_thread_.join();
+    }
+  }
+
+  void WireguardFlutterPlugin::RunOnPlatformThread(function<void()> task)
+  {
+    if (window_ == NULL)
+    {
+      // Nothing runs off the platform thread then.
+      task();
+      return;
+    }
+    {
+      lock_guard<mutex> lock(platform_tasks_mutex_);
+      platform_tasks_.push_back(move(task));
+    }
+    PostMessage(window_, run_tasks_message_, 0, 0);
+  }
+
+  optional<LRESULT> WireguardFlutterPlugin::HandleWindowProc(HWND hwnd, UINT message, WPARAM wparam, LPARAM lparam)
+  {
+    if (message != run_tasks_message_)
+    {
+      return nullopt;
+    }
+    deque<function<void()>> tasks;
+    {
+      lock_guard<mutex> lock(platform_tasks_mutex_);
+      tasks.swap(platform_tasks_);
+    }
+    for (auto &task : tasks)
+    {
+      task();
+    }
+    return 0;
+  }
+
+  TunnelSwitcher *WireguardFlutterPlugin::Switcher()
+  {
+    if (switcher_ != nullptr)
+    {
+      return switcher_.get();
+    }
+    tunnel_backend_ = make_unique<ServiceTunnelBackend>(tunnel_service_->service_name_);
+    // Stages come from the switch thread too.
+    switcher_ = make_unique<TunnelSwitcher>(tunnel_backend_.get(), SwitchOptions(),
+                                            [this](const string &stage)
+                                            { RunOnPlatformThread([this, stage]
+                                                                  { tunnel_service_->EmitState(stage); }); });
+    if (!config_file_.empty() && tunnel_service_->GetStatus() == "connected")
+    {
+      switcher_->Adopt(tunnel_backend_->Adopt(tunnel_service_->service_name_, config_file_), config_);
+    }
+    return switcher_.get();
+  }
 
   void WireguardFlutterPlugin::HandleMethodCall(const MethodCall<EncodableValue> &call,
                                                 unique_ptr<MethodResult<EncodableValue>> result)
   {
+    TraceSpan span("HandleMethodCall", call.method_name().c_str());
     const auto *args = get_if<EncodableMap>(call.arguments());
 
     if (call.method_name() == "initialize")
@@ -101,6 +246,20 @@ namespace wireguard_flutter
         return;
       }
 
+      if (switcher_ != nullptr)
+      {
+        switcher_->Stop();
+        JoinSwitchThread();
+        switcher_ = nullptr;
+        tunnel_backend_ = nullptr;
+      }
+      if (switch_busy_)
+      {
+        // The last start is still waiting for the service.
+        result->Error("Could not start the tunnel: a switch is already in progress");
+        return;
+      }
+
       this->tunnel_service_->EmitState("prepare");
 
       wstring wg_config_filename;
@@ -115,14 +274,7 @@ namespace wireguard_flutter
         return;
       }
 
-      wchar_t module_filename[MAX_PATH];
-      GetModuleFileName(NULL, module_filename, MAX_PATH);
-      auto current_exec_dir = wstring(module_filename);
-      current_exec_dir = current_exec_dir.substr(0, current_exec_dir.find_last_of(L"\\/"));
-      wostringstream service_exec_builder;
-      service_exec_builder << current_exec_dir << "\\wireguard_svc.exe" << L" -service"
-                           << L" -config-file=\"" << wg_config_filename << "\"";
-      wstring service_exec = service_exec_builder.str();
+      wstring service_exec = TunnelServiceCommandLine(wg_config_filename);
       cout << "Starting service with command line: " << WideToAnsi(service_exec) << endl;
       try
       {
@@ -132,15 +284,33 @@ namespace wireguard_flutter
         csa.dependencies = L"Nsi\0TcpIp\0";
         csa.first_time = true;
 
+        config_file_ = wg_config_filename;
+        config_ = *wgQuickConfig;
         tunnel_service->CreateAndStart(csa);
       }
       catch (exception &e)
       {
+        DeleteFileW(wg_config_filename.c_str());
         result->Error(string(e.what()));
         return;
       }
 
-      result->Success();
+      // Once running, the service has read the config, and its private key
+      // should not sit on disk. Until then it may still read it, so the
+      // file stays if the service is slow to start; stop deletes it then.
+      // The wait takes seconds, so it runs on the switch thread, polling
+      // through its own handle as initialize may rename the service.
+      RunSwitchTask([service_name = tunnel_service->service_name_, wg_config_filename]
+                    {
+                      ServiceControl service(service_name);
+                      if (!service.WaitForRunning(15000))
+                      {
+                        throw runtime_error("The tunnel service did not start");
+                      }
+                      DeleteFileW(wg_config_filename.c_str());
+                      return EncodableValue();
+                    },
+                    "Could not start the tunnel: ", move(result));
       return;
     }
     else if (call.method_name() == "stop")
@@ -154,11 +324,29 @@ namespace wireguard_flutter
 
       try
       {
-        tunnel_service->Stop();
+        if (switcher_ != nullptr)
+        {
+          // Stop() cancels a switch in progress; its thread ends soon after.
+          switcher_->Stop();
+          JoinSwitchThread();
+          switcher_ = nullptr;
+          tunnel_backend_ = nullptr;
+        }
+        else
+        {
+          tunnel_service->Stop();
+          // A start waiting for the service gives up now that it stopped.
+          JoinSwitchThread();
+        }
+        if (!config_file_.empty())
+        {
+          DeleteFileW(config_file_.c_str());
+        }
       }
       catch (exception &e)
       {
         result->Error(string(e.what()));
+        return;
       }
 
       result->Success();
@@ -173,9 +361,124 @@ namespace wireguard_flutter
         return;
       }
 
+      if (switcher_ != nullptr)
+      {
+        switch (switcher_->state())
+        {
+        case TunnelSwitcher::State::kIdle:
+          result->Success(string("disconnected"));
+          break;
+        case TunnelSwitcher::State::kConnecting:
+          result->Success(string("connecting"));
+          break;
+        case TunnelSwitcher::State::kConnected:
+          result->Success(string("connected"));
+          break;
+        case TunnelSwitcher::State::kSwitching:
+          result->Success(string("reconnect"));
+          break;
+        }
+        return;
+      }
+
       result->Success(tunnel_service->GetStatus());
       return;
     }
+    else if (call.method_name() == "switchServer")
+    {
+      if (this->tunnel_service_ == nullptr)
+      {
+        result->Error("Invalid state: call 'initialize' first");
+        return;
+      }
+      const auto *wgQuickConfig = get_if<string>(ValueOrNull(*args, "wgQuickConfig"));
+      if (wgQuickConfig == NULL)
+      {
+        result->Error("Argument 'wgQuickConfig' is required");
+        return;
+      }
+
+      TunnelSwitcher *switcher;
+      try
+      {
+        switcher = Switcher();
+      }
+      catch (exception &e)
+      {
+        result->Error(string("Could not switch server: ").append(e.what()));
+        return;
+      }
+      // Answers whether the switch went make-before-break; it cannot to or
+      // from a full tunnel, whose kill switch would block the other tunnel.
+      RunSwitchTask([switcher, config = *wgQuickConfig]
+                    { return EncodableValue(switcher->SwitchTo(config)); },
+                    "Could not switch server: ", move(result));
+      return;
+    }
+    else if (call.method_name() == "setStandby")
+    {
+      if (this->tunnel_service_ == nullptr)
+      {
+        result->Error("Invalid state: call 'initialize' first");
+        return;
+      }
+      // A missing or empty config drops the standby.
+      const auto *wgQuickConfig = get_if<string>(ValueOrNull(*args, "wgQuickConfig"));
+
+      TunnelSwitcher *switcher;
+      try
+      {
+        switcher = Switcher();
+      }
+      catch (exception &e)
+      {
+        result->Error(string("Could not start the standby tunnel: ").append(e.what()));
+        return;
+      }
+      RunSwitchTask([switcher, config = wgQuickConfig == NULL ? string() : *wgQuickConfig]
+                    {
+                      switcher->SetStandby(config);
+                      return EncodableValue();
+                    },
+                    "Could not start the standby tunnel: ", move(result));
+      return;
+    }
+    else if (call.method_name() == "failover")
+    {
+      if (this->tunnel_service_ == nullptr)
+      {
+        result->Error("Invalid state: call 'initialize' first");
+        return;
+      }
+
+      try
+      {
+        result->Success(switcher_ != nullptr && switcher_->Failover());
+      }
+      catch (exception &e)
+      {
+        result->Error(string("Could not fail over: ").append(e.what()));
+      }
+      return;
+    }
+    else if (call.method_name() == "setTracing")
+    {
+      const auto *enabled = get_if<bool>(ValueOrNull(*args, "enabled"));
+      if (enabled == NULL)
+      {
+        result->Error("Argument 'enabled' is required");
+        return;
+      }
+
+      SetTracing(*enabled);
+      result->Success();
+      return;
+    }
+    else if (call.method_name() == "dumpTrace")
+    {
+      result->Success(DumpTrace());
+      return;
+    }
 
     result->NotImplemented();
   }
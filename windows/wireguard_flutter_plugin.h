@@ -9,9 +9,20 @@
 #include <flutter/event_stream_handler_functions.h>
 #include <flutter/encodable_value.h>
 
+#include <windows.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
 
 #include "service_control.h"
+#include "service_tunnel_backend.h"
+#include "tunnel_switcher.h"
 
 namespace wireguard_flutter
 {
@@ -21,7 +32,7 @@ namespace wireguard_flutter
   public:
     static void RegisterWithRegistrar(flutter::PluginRegistrarWindows *registrar);
 
-    WireguardFlutterPlugin();
+    explicit WireguardFlutterPlugin(flutter::PluginRegistrarWindows *registrar);
 
     virtual ~WireguardFlutterPlugin();
 
@@ -30,11 +41,47 @@ namespace wireguard_flutter
     WireguardFlutterPlugin &operator=(const WireguardFlutterPlugin &) = delete;
 
   private:
+    // Makes the switcher if there is none yet, taking on a running tunnel
+    // service as its active tunnel.
+    TunnelSwitcher *Switcher();
+
+    // Runs |task| on the switch thread, as switching can take seconds, and
+    // answers |result| on the platform thread with what it returns, or with
+    // |error| and the exception's message if it throws. One task runs at a
+    // time.
+    void RunSwitchTask(std::function<flutter::EncodableValue()> task, const std::string &error,
+                       std::unique_ptr<flutter::MethodResult<flutter::EncodableValue>> result);
+    // Waits for the switch thread, e.g. before the switcher goes.
+    void JoinSwitchThread();
+    // Queues |task| to run on the platform thread, which Flutter channels
+    // may only be used from.
+    void RunOnPlatformThread(std::function<void()> task);
+    std::optional<LRESULT> HandleWindowProc(HWND hwnd, UINT message, WPARAM wparam, LPARAM lparam);
+
     // Called when a method is called on this plugin's channel from Dart.
     void HandleMethodCall(const flutter::MethodCall<flutter::EncodableValue> &method_call,
                           std::unique_ptr<flutter::MethodResult<flutter::EncodableValue>> result);
 
+    flutter::PluginRegistrarWindows *registrar_;
+    int window_proc_id_ = -1;
+    // Posted to the top-level window to run |platform_tasks_|.
+    UINT run_tasks_message_;
+    HWND window_ = NULL;
+    std::mutex platform_tasks_mutex_;
+    std::deque<std::function<void()>> platform_tasks_;
+
+    std::thread switch_thread_;
+    std::atomic<bool> switch_busy_{false};
+
     std::unique_ptr<ServiceControl> tunnel_service_;
+    // The config file the tunnel service was last started with, deleted
+    // once the service is running or stopped, and the config itself.
+    std::wstring config_file_;
+    std::string config_;
+    // Made on the first switchServer or setStandby call; from then on the
+    // switcher owns every tunnel, the one started by start included.
+    std::unique_ptr<ServiceTunnelBackend> tunnel_backend_;
+    std::unique_ptr<TunnelSwitcher> switcher_;
     std::unique_ptr<flutter::EventSink<flutter::EncodableValue>> events_;
 
     std::unique_ptr<flutter::StreamHandlerError<flutter::EncodableValue>> OnListen(